@@ -0,0 +1,131 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Crc32c.h"
+
+#include <string.h>
+
+#include <array>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define GDEFLATE_HAS_SSE42_CRC32C 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GDEFLATE_TARGET_SSE42
+#else
+#define GDEFLATE_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define GDEFLATE_HAS_ARM_CRC32C 1
+#include <arm_acle.h>
+#endif
+
+namespace GDeflate
+{
+    static constexpr uint32_t kCrc32cPolynomial = 0x82f63b78; // Reflected 0x1edc6f41
+
+    static constexpr std::array<uint32_t, 256> MakeCrc32cTable()
+    {
+        std::array<uint32_t, 256> table{};
+
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (uint32_t bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+
+            table[i] = crc;
+        }
+
+        return table;
+    }
+
+    static constexpr std::array<uint32_t, 256> kCrc32cTable = MakeCrc32cTable();
+
+    static uint32_t Crc32cSoftware(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            crc = kCrc32cTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+        return crc;
+    }
+
+#if GDEFLATE_HAS_SSE42_CRC32C
+    GDEFLATE_TARGET_SSE42 static uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        uint64_t crc64 = crc;
+
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t))
+        {
+            uint64_t value;
+            memcpy(&value, data, sizeof(value));
+            crc64 = _mm_crc32_u64(crc64, value);
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+
+        for (; size > 0; --size, ++data)
+            crc = _mm_crc32_u8(crc, *data);
+
+        return crc;
+    }
+
+    static bool HasHardwareCrc32c()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    }
+#elif GDEFLATE_HAS_ARM_CRC32C
+    static uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t))
+        {
+            uint64_t value;
+            memcpy(&value, data, sizeof(value));
+            crc = __crc32cd(crc, value);
+        }
+
+        for (; size > 0; --size, ++data)
+            crc = __crc32cb(crc, *data);
+
+        return crc;
+    }
+
+    static bool HasHardwareCrc32c()
+    {
+        return true;
+    }
+#endif
+
+    uint32_t Crc32c(const uint8_t* data, size_t size)
+    {
+#if GDEFLATE_HAS_SSE42_CRC32C || GDEFLATE_HAS_ARM_CRC32C
+        static const bool hasHardwareCrc32c = HasHardwareCrc32c();
+
+        if (hasHardwareCrc32c)
+            return ~Crc32cHardware(~0u, data, size);
+#endif
+
+        return ~Crc32cSoftware(~0u, data, size);
+    }
+} // namespace GDeflate
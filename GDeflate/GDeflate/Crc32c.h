@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace GDeflate
+{
+    // Returns the CRC32C (Castagnoli) checksum of size bytes at data. Uses the CPU's CRC32C
+    // instructions where they are available.
+    uint32_t Crc32c(const uint8_t* data, size_t size);
+} // namespace GDeflate
@@ -20,6 +20,12 @@
 
 #include "config.h"
 
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <vector>
+
 namespace GDeflate
 {
     // See README.MD in libdeflate_1_8 for details on Compression Levels
@@ -29,18 +35,572 @@ namespace GDeflate
     enum Flags
     {
         COMPRESS_SINGLE_THREAD = 0x200, /*!< Force compression using a single thread. */
+        COMPRESS_TILE_SIZE_16K = 0x400, /*!< Use 16 KiB tiles instead of the default 64 KiB. */
+        COMPRESS_TILE_SIZE_32K = 0x800, /*!< Use 32 KiB tiles instead of the default 64 KiB. */
+        COMPRESS_STORED_TILES = 0x1000, /*!< Store tiles that don't shrink as raw bytes (not for DirectStorage). */
+        COMPRESS_TILE_CHECKSUMS = 0x2000, /*!< Add a CRC32C checksum per tile (not for DirectStorage). */
+    };
+
+    // Returns the tile size selected by the COMPRESS_TILE_SIZE_* flags, or 0 if the flags select
+    // more than one size. Only streams with the default 64 KiB tiles can be decompressed by
+    // DirectStorage; smaller tiles give more parallelism and finer random access for small assets.
+    size_t GetTileSize(uint32_t flags);
+
+    // How tiles are decoded on the CPU. The vector decoder decodes the 32 bitstreams of a tile side
+    // by side with AVX2, AVX-512 or NEON, the way GDeflate.hlsl does on the GPU; Auto uses it where
+    // the CPU has one of those and libdeflate elsewhere. Vector forces it even then, with its lanes
+    // run one by one. The setting applies to the whole process and may be changed at any time.
+    enum class TileDecoder
+    {
+        Auto,
+        Libdeflate,
+        Vector,
+    };
+
+    void SetTileDecoder(TileDecoder decoder);
+    TileDecoder GetTileDecoder();
+
+    // A preset dictionary for small assets that share structure, such as material blobs or small
+    // meshes, which compress poorly on their own. Every tile of a stream compressed with a
+    // dictionary is compressed as if the dictionary came right before it, so its matches can
+    // reach into the dictionary, and the stream records the dictionary's id. Such a stream can only
+    // be decompressed on the CPU, with the same dictionary; DirectStorage and GDeflate.hlsl can't
+    // decode it.
+    class Dictionary
+    {
+    public:
+        // Matches reach back 64 KiB, so a larger dictionary would leave the start of 32 KiB tiles
+        // with parts of it they can't use.
+        static constexpr size_t kMaxSize = 32 * 1024;
+
+        // Uses size bytes of data, at most kMaxSize, as they are. Ids tell dictionaries apart in
+        // the streams compressed with them; 0 is not a valid id.
+        Dictionary(uint8_t id, const uint8_t* data, size_t size);
+
+        // Builds a dictionary of at most maxSize bytes from samples of the assets it is meant for.
+        // The dictionary is made of the segments whose substrings occur in the most samples, with
+        // the most common ones last, closest to the data that refers to them.
+        static Dictionary Train(
+            uint8_t id,
+            const uint8_t* const* samples,
+            const size_t* sampleSizes,
+            size_t numSamples,
+            size_t maxSize = kMaxSize);
+
+        bool IsValid() const
+        {
+            return m_id != 0;
+        }
+
+        uint8_t GetId() const
+        {
+            return m_id;
+        }
+
+        const uint8_t* GetData() const
+        {
+            return m_data.data();
+        }
+
+        size_t GetSize() const
+        {
+            return m_data.size();
+        }
+
+    private:
+        uint8_t m_id;
+        std::vector<uint8_t> m_data;
     };
 
-    size_t CompressBound(size_t size);
+    // Runs the library's parallel work. By default a Context runs it on threads of its own;
+    // implement this interface to run it on an existing job system instead, so that compression and
+    // decompression don't compete with it for cores.
+    class Executor
+    {
+    public:
+        virtual ~Executor() = default;
+
+        // Returns how many threads besides the calling one Run may use at most.
+        virtual uint32_t GetNumThreads() const = 0;
+
+        // Invokes job on the calling thread and on up to (parallelism - 1) other threads, and
+        // returns once every invocation has returned. The invocations pull work from a shared
+        // counter until none is left, so running the job fewer times than requested is fine as
+        // long as the calling thread runs it. Run may be called from several threads at once.
+        virtual void Run(uint32_t parallelism, std::function<void()> const& job) = 0;
+    };
+
+    // Where a Context's own worker threads run. Left to the OS, which is the default, they may land
+    // on the efficiency cores of a hybrid CPU, or away from the NUMA node whose memory they were
+    // working in, so throughput varies from machine to machine and run to run. The processor
+    // topology is read with GetLogicalProcessorInformationEx, so on other platforms every policy
+    // leaves the threads to the OS. The calling thread, which always takes part, isn't moved.
+    enum class WorkerPlacement
+    {
+        Any,
+
+        // Only the cores of the highest efficiency class, the performance cores of a hybrid CPU.
+        PerformanceCores,
+
+        // The threads are spread evenly over the NUMA nodes, each kept within its node, so the
+        // libdeflate state each thread allocates is in its node's memory.
+        SpreadNodes,
+
+        // The first reservedCores physical cores are left to the application, for example for
+        // its render thread.
+        ReserveCores,
+    };
+
+    struct WorkerPlacementSettings
+    {
+        WorkerPlacement placement = WorkerPlacement::Any;
+
+        // Used by WorkerPlacement::ReserveCores.
+        uint32_t reservedCores = 1;
+    };
+
+    // Settings for adaptive compression. Every tile is first compressed at probeLevel, and only
+    // recompressed at the requested level if that is expected to save enough to be worth the time.
+    // The expected saving is learned while compressing, by recompressing a sample of the tiles
+    // regardless and comparing the two results.
+    struct AdaptiveSettings
+    {
+        uint32_t probeLevel = MinimumCompressionLevel;
+
+        // Minimum expected saving, as a fraction of the tile size, for a tile to be recompressed.
+        float minGain = 0.01f;
+
+        // Once compression has taken this long the remaining tiles keep their probe result, which
+        // makes the output depend on timing. 0 means there is no limit.
+        uint32_t timeBudgetMs = 0;
+    };
+
+    struct CompressProgress
+    {
+        uint32_t tilesDone = 0;
+        uint32_t numTiles = 0;
+
+        // Input consumed and compressed tile data produced so far, without the stream header.
+        size_t bytesIn = 0;
+        size_t bytesOut = 0;
+    };
+
+    // Lets the caller of a long compression follow it and stop it early.
+    struct CompressionMonitor
+    {
+        // Called after every tile, from whichever thread compressed it. Calls are serialized and
+        // the counts only ever grow, but they are taken while other tiles are in flight, so the
+        // byte counts of one call may lag its tile count.
+        std::function<void(CompressProgress const& progress)> progress;
+
+        // Checked before every tile. Once it is set the remaining tiles are skipped and the call
+        // returns false, leaving the output undefined.
+        std::atomic_bool const* cancel = nullptr;
+    };
+
+    // One stream of a DecompressBatch call. output must hold the whole uncompressed stream.
+    struct StreamDesc
+    {
+        const uint8_t* input = nullptr;
+        size_t inputSize = 0;
+
+        uint8_t* output = nullptr;
+        size_t outputSize = 0;
+
+        // Set when output is write-combined memory, such as a D3D12 upload heap. Each tile is then
+        // decoded into a small cached buffer owned by the worker and streamed out, so the output is
+        // never read back.
+        bool outputWriteCombined = false;
+
+        // Needed for streams compressed with a dictionary, and ignored for the others.
+        const Dictionary* dictionary = nullptr;
+
+        // Set by DecompressBatch.
+        bool succeeded = false;
+    };
+
+    // One stream of a CompressBatch call. output is sized for every tile at its worst case while
+    // the stream is compressed, and shrinks to the stream once it's done.
+    struct CompressDesc
+    {
+        const uint8_t* input = nullptr;
+        size_t inputSize = 0;
+
+        // Set by CompressBatch; cleared if the stream failed.
+        std::vector<uint8_t> output;
+        bool succeeded = false;
+    };
+
+    // Called once for every stream of a CompressBatch call as soon as it has finished, whether it
+    // succeeded or not. Streams finish in any order, and the callback may run on several worker
+    // threads at once; the output of the stream may be moved out of its CompressDesc.
+    using StreamCompletedCallback = std::function<void(size_t streamIndex)>;
+
+    enum class AsyncStatus
+    {
+        Pending,
+        Succeeded,
+        Failed,
+        Canceled,
+    };
+
+    // Called once when an asynchronous decompression has finished, on the thread that finished it.
+    // The final status is published first, so Wait() may return before the callback has run.
+    using CompletionCallback = std::function<void(AsyncStatus status)>;
+
+    // Handle to a decompression started with DecompressAsync. Handles may be copied; all copies
+    // refer to the same decompression.
+    class AsyncDecompression
+    {
+    public:
+        struct State;
+
+        AsyncDecompression() = default;
+
+        explicit AsyncDecompression(std::shared_ptr<State> state);
+
+        // Returns Pending until the decompression has finished.
+        AsyncStatus GetStatus() const;
+
+        // Blocks until the decompression has finished and returns its final status.
+        AsyncStatus Wait() const;
+
+        // Asks for the tiles that haven't been decoded yet to be skipped. Unless the decompression
+        // finishes first, its status becomes Canceled and the output is left incomplete.
+        void Cancel();
+
+        uint32_t GetNumTiles() const;
+
+        // Returns the number of tiles processed so far.
+        uint32_t GetNumTilesDone() const;
+
+    private:
+        std::shared_ptr<State> m_state;
+    };
+
+    class TaskQueue;
+
+    // A long-lived compression/decompression context. The worker threads are created once and
+    // reused by every call, and each thread keeps its libdeflate state around between calls, so
+    // compressing or decompressing many small buffers doesn't pay for thread creation and
+    // compressor allocation each time. A Context may be used from several threads at once.
+    class Context
+    {
+    public:
+        // Creates a context with one worker per hardware thread.
+        Context();
+
+        // Creates a context with numWorkers pool threads. The calling thread always takes part in
+        // the work as well, so a context with 0 workers runs everything on the caller.
+        explicit Context(uint32_t numWorkers);
+
+        // Creates a context with numWorkers pool threads, placed according to placement.
+        Context(uint32_t numWorkers, WorkerPlacementSettings const& placement);
+
+        // Creates a context that runs all of its work on executor, which must outlive the context.
+        explicit Context(Executor& executor);
+
+        ~Context();
 
+        Context(Context const&) = delete;
+        Context& operator=(Context const&) = delete;
+
+        uint32_t GetNumWorkers() const;
+
+        bool Compress(
+            uint8_t* output,
+            size_t* outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t level,
+            uint32_t flags,
+            CompressionMonitor const* monitor = nullptr);
+
+        bool Compress(
+            uint8_t* output,
+            size_t* outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t level,
+            uint32_t flags,
+            const Dictionary* dictionary);
+
+        // Appends the compressed stream to output, which only grows by the size of the stream.
+        bool Compress(
+            std::vector<uint8_t>& output,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t level,
+            uint32_t flags,
+            CompressionMonitor const* monitor = nullptr);
+
+        bool CompressAdaptive(
+            uint8_t* output,
+            size_t* outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t level,
+            uint32_t flags,
+            AdaptiveSettings const& settings,
+            CompressionMonitor const* monitor = nullptr);
+
+        bool CompressBatch(
+            CompressDesc* streams,
+            size_t numStreams,
+            uint32_t level,
+            uint32_t flags,
+            StreamCompletedCallback completed = nullptr);
+
+        bool Decompress(uint8_t* output, size_t outputSize, const uint8_t* in, size_t inSize, uint32_t numWorkers);
+
+        bool Decompress(
+            uint8_t* output,
+            size_t outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t numWorkers,
+            const Dictionary* dictionary);
+
+        bool DecompressTiles(
+            uint8_t* output,
+            size_t outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t firstTile,
+            uint32_t numTiles,
+            uint32_t numWorkers);
+
+        bool DecompressRange(
+            uint8_t* output,
+            const uint8_t* in,
+            size_t inSize,
+            size_t offset,
+            size_t size,
+            uint32_t numWorkers);
+
+        bool DecompressBatch(StreamDesc* streams, size_t numStreams, uint32_t numWorkers);
+
+        // Starts decompressing in the background and returns immediately. The stream is validated
+        // up front, and a handle that has already failed is returned if it is invalid. Requests
+        // run one after another in the order they were made, each using up to numWorkers threads.
+        // The input and output must stay valid until the decompression has finished; destroying
+        // the context waits for all pending requests.
+        AsyncDecompression DecompressAsync(
+            uint8_t* output,
+            size_t outputSize,
+            const uint8_t* in,
+            size_t inSize,
+            uint32_t numWorkers,
+            CompletionCallback callback = nullptr);
+
+        bool CompressFile(
+            std::filesystem::path const& inputPath,
+            std::filesystem::path const& outputPath,
+            uint32_t level,
+            uint32_t flags);
+
+        bool DecompressFile(
+            std::filesystem::path const& inputPath,
+            std::filesystem::path const& outputPath,
+            uint32_t numWorkers);
+
+    private:
+        std::unique_ptr<Executor> m_ownedExecutor;
+        Executor* m_executor;
+
+        // Runs DecompressAsync requests. Declared last so that it is destroyed, and pending
+        // requests completed, while the executor is still alive.
+        std::unique_ptr<TaskQueue> m_asyncQueue;
+    };
+
+    // Returns the process-wide context used by the free functions below.
+    Context& GetDefaultContext();
+
+    // Compresses input of any length that arrives in pieces of arbitrary size. The input is split
+    // into a sequence of independent TileStreams of at most tilesPerStream tiles each, and each
+    // stream is handed to the write function as soon as it is complete. Memory use is bounded by
+    // the size of one stream regardless of the total input size, and inputs are not limited to the
+    // ~4 GiB that fits in a single TileStream.
+    //
+    // The streams are written back to back; use GetCompressedSize to walk the sequence.
+    class StreamCompressor
+    {
+    public:
+        // Receives compressed data in order. Returning false aborts compression.
+        using WriteFunction = std::function<bool(const uint8_t* data, size_t size)>;
+
+        explicit StreamCompressor(Context& context);
+
+        // Starts a new sequence of streams. tilesPerStream of 0 picks a size that keeps every
+        // worker of the context busy.
+        bool BeginStream(uint32_t level, uint32_t flags, WriteFunction write, uint32_t tilesPerStream = 0);
+
+        bool AppendTiles(const uint8_t* in, size_t inSize);
+
+        // Compresses any remaining input and ends the sequence.
+        bool Finish();
+
+        uint64_t GetUncompressedSize() const
+        {
+            return m_uncompressedSize;
+        }
+
+        uint64_t GetCompressedSize() const
+        {
+            return m_compressedSize;
+        }
+
+    private:
+        bool CompressSegment(const uint8_t* in, size_t inSize);
+
+        Context& m_context;
+        WriteFunction m_write;
+        uint32_t m_level = 0;
+        uint32_t m_flags = 0;
+        size_t m_segmentSize = 0;
+        std::vector<uint8_t> m_pending;
+        std::vector<uint8_t> m_output;
+        uint64_t m_uncompressedSize = 0;
+        uint64_t m_compressedSize = 0;
+        bool m_active = false;
+    };
+
+    // Returns the number of bytes occupied by the TileStream starting at in, or 0 if in doesn't
+    // start with a valid stream that fits within inSize bytes.
+    size_t GetCompressedSize(const uint8_t* in, size_t inSize);
+
+    // Checks the stream at in without decoding it: the header and tile table must be consistent
+    // and, for streams compressed with COMPRESS_TILE_CHECKSUMS, every tile must match its
+    // checksum. This is fast enough to run on data as it arrives, so that a corrupt stream can be
+    // fetched again before it is handed to a GPU decompressor. Decompression checks the checksums
+    // itself and fails on the first mismatch.
+    bool VerifyStream(const uint8_t* in, size_t inSize);
+
+    size_t CompressBound(size_t size, uint32_t flags = 0);
+
+    // Predicts the size of the stream Compress produces, by compressing a few tiles sampled across
+    // the input. The prediction is typically within a few percent for inputs of a similar kind
+    // throughout, and is meant for planning allocations; CompressBound is the only upper bound.
+    // Returns 0 if the input can't be compressed with the given level and flags.
+    size_t EstimateCompressedSize(const uint8_t* in, size_t inSize, uint32_t level, uint32_t flags = 0);
+
+    // monitor, when given, is told about every tile as it is done and can cancel the compression;
+    // see CompressionMonitor.
     bool Compress(
         uint8_t* output,
         size_t* outputSize,
         const uint8_t* in,
         size_t inSize,
         uint32_t level,
-        uint32_t flags);
+        uint32_t flags,
+        CompressionMonitor const* monitor = nullptr);
+
+    // Compresses every tile against dictionary, see Dictionary. A null dictionary compresses as
+    // Compress does without one.
+    bool Compress(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        const Dictionary* dictionary);
+
+    // Appends the compressed stream to output. Tiles are compressed into worker-owned storage
+    // first, so no worst-case sized buffer is allocated.
+    bool Compress(
+        std::vector<uint8_t>& output,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        CompressionMonitor const* monitor = nullptr);
+
+    // Like Compress, but picks the level per tile as described by AdaptiveSettings. Tiles that
+    // barely benefit from the requested level are kept at the much faster probe level.
+    bool CompressAdaptive(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        AdaptiveSettings const& settings,
+        CompressionMonitor const* monitor = nullptr);
+
+    // Compresses many inputs at once. The tiles of all inputs are put into a single work list, so
+    // the workers stay busy across files of any size, and each stream is laid out and passed to
+    // completed by the worker that finishes its last tile, without waiting for the rest of the
+    // batch. A stream that fails doesn't affect the others; returns true if every stream succeeded.
+    bool CompressBatch(
+        CompressDesc* streams,
+        size_t numStreams,
+        uint32_t level,
+        uint32_t flags,
+        StreamCompletedCallback completed = nullptr);
 
     bool Decompress(uint8_t* output, size_t outputSize, const uint8_t* in, size_t inSize, uint32_t numWorkers);
 
+    // Decompresses a stream compressed with dictionary. Fails if the stream was compressed with a
+    // different dictionary; streams compressed without one decompress as with Decompress.
+    bool Decompress(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        const Dictionary* dictionary);
+
+    // Decompresses numTiles tiles starting at firstTile. Tiles are decoded independently using the
+    // stream's tile offset table, so the rest of the stream is never touched. output receives the
+    // first requested tile at offset 0.
+    bool DecompressTiles(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t firstTile,
+        uint32_t numTiles,
+        uint32_t numWorkers);
+
+    // Decompresses size bytes of uncompressed data starting at offset into output, decoding only
+    // the tiles that overlap the range.
+    bool DecompressRange(
+        uint8_t* output,
+        const uint8_t* in,
+        size_t inSize,
+        size_t offset,
+        size_t size,
+        uint32_t numWorkers);
+
+    // Decompresses many streams at once. The tiles of all streams are put into a single work list
+    // that the workers pull from, so a batch of small streams keeps every worker busy where
+    // decompressing them one by one would not. A stream that fails to decompress doesn't affect
+    // the others; returns true if every stream succeeded.
+    bool DecompressBatch(StreamDesc* streams, size_t numStreams, uint32_t numWorkers);
+
+    AsyncDecompression DecompressAsync(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        CompletionCallback callback = nullptr);
+
+    // Compresses the file at inputPath into a sequence of TileStreams written back to back to
+    // outputPath, in the same layout StreamCompressor produces. Both files are memory mapped and
+    // the tile workers read and write the mapped pages directly, so memory use doesn't grow with
+    // the size of the file.
+    bool CompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t level,
+        uint32_t flags);
+
+    // Decompresses a file written by CompressFile or StreamCompressor, mapping both files.
+    bool DecompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t numWorkers);
+
 } // namespace GDeflate
@@ -0,0 +1,360 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GDeflateArchive.h"
+
+#include "TileStream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+
+namespace GDeflate
+{
+    uint64_t HashArchiveName(std::string_view name)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+
+        for (char c : name)
+        {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+
+    static uint64_t GetIndexSize(ArchiveFooter const& footer)
+    {
+        return uint64_t(footer.numEntries) * sizeof(ArchiveEntry) +
+               uint64_t(footer.numSegments) * sizeof(ArchiveSegment);
+    }
+
+    ArchiveWriter::ArchiveWriter(Context& context)
+        : m_context(context)
+    {
+    }
+
+    bool ArchiveWriter::Begin(WriteFunction write, uint32_t level, uint32_t flags, uint32_t segmentSize)
+    {
+        const size_t tileSize = GetTileSize(flags);
+
+        if (m_active || !write || tileSize == 0)
+            return false;
+
+        if (segmentSize == 0)
+            segmentSize = kDefaultArchiveSegmentSize;
+
+        // Segment sizes are stored as 32-bit values, and each segment must fit in one stream.
+        const size_t maxSegmentSize = std::min<size_t>(TileStream::kMaxTiles * tileSize, UINT32_MAX / 2);
+        m_segmentSize = std::min<size_t>(segmentSize, maxSegmentSize) / tileSize * tileSize;
+
+        if (m_segmentSize == 0)
+            return false;
+
+        m_write = std::move(write);
+        m_level = level;
+        m_flags = flags;
+        m_offset = 0;
+        m_entries.clear();
+        m_segments.clear();
+        m_nameHashes.clear();
+
+        m_active = true;
+
+        const ArchiveHeader header{kArchiveMagic, kArchiveVersion};
+
+        return Write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+    }
+
+    bool ArchiveWriter::AddEntry(std::string_view name, const uint8_t* data, size_t size)
+    {
+        if (!m_active || (data == nullptr && size != 0))
+            return false;
+
+        ArchiveEntry entry{};
+        entry.nameHash = HashArchiveName(name);
+        entry.uncompressedSize = size;
+        entry.firstSegment = static_cast<uint32_t>(m_segments.size());
+
+        if (!m_nameHashes.insert(entry.nameHash).second)
+        {
+            printf("Duplicate archive entry: %.*s\n", static_cast<int>(name.size()), name.data());
+            return false;
+        }
+
+        for (size_t pos = 0; pos < size; pos += m_segmentSize)
+        {
+            const size_t segmentSize = std::min(m_segmentSize, size - pos);
+
+            m_output.clear();
+
+            if (m_segments.size() >= UINT32_MAX ||
+                !m_context.Compress(m_output, data + pos, segmentSize, m_level, m_flags))
+            {
+                Abort();
+                return false;
+            }
+
+            ArchiveSegment segment{};
+            segment.offset = m_offset;
+            segment.compressedSize = static_cast<uint32_t>(m_output.size());
+            segment.uncompressedSize = static_cast<uint32_t>(segmentSize);
+
+            if (!Write(m_output.data(), m_output.size()))
+                return false;
+
+            m_segments.push_back(segment);
+        }
+
+        entry.numSegments = static_cast<uint32_t>(m_segments.size()) - entry.firstSegment;
+        m_entries.push_back(entry);
+
+        return true;
+    }
+
+    bool ArchiveWriter::Finish()
+    {
+        if (!m_active)
+            return false;
+
+        if (m_entries.size() > UINT32_MAX)
+        {
+            Abort();
+            return false;
+        }
+
+        std::sort(
+            m_entries.begin(),
+            m_entries.end(),
+            [](ArchiveEntry const& a, ArchiveEntry const& b) { return a.nameHash < b.nameHash; });
+
+        ArchiveFooter footer{};
+        footer.indexOffset = m_offset;
+        footer.numEntries = static_cast<uint32_t>(m_entries.size());
+        footer.numSegments = static_cast<uint32_t>(m_segments.size());
+        footer.magic = kArchiveMagic;
+        footer.version = kArchiveVersion;
+
+        const bool succeeded =
+            Write(reinterpret_cast<const uint8_t*>(m_entries.data()), m_entries.size() * sizeof(ArchiveEntry)) &&
+            Write(reinterpret_cast<const uint8_t*>(m_segments.data()), m_segments.size() * sizeof(ArchiveSegment)) &&
+            Write(reinterpret_cast<const uint8_t*>(&footer), sizeof(footer));
+
+        Abort();
+
+        return succeeded;
+    }
+
+    bool ArchiveWriter::Write(const uint8_t* data, size_t size)
+    {
+        if (size != 0 && !m_write(data, size))
+        {
+            Abort();
+            return false;
+        }
+
+        m_offset += size;
+
+        return true;
+    }
+
+    void ArchiveWriter::Abort()
+    {
+        m_active = false;
+        m_write = nullptr;
+    }
+
+    bool ArchiveIndex::Load(std::filesystem::path const& path)
+    {
+        Reset();
+
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+
+        const uint64_t archiveSize = static_cast<uint64_t>(file.tellg());
+
+        ArchiveFooter footer{};
+        if (archiveSize < sizeof(ArchiveHeader) + sizeof(footer))
+            return false;
+
+        file.seekg(archiveSize - sizeof(footer));
+        if (!file.read(reinterpret_cast<char*>(&footer), sizeof(footer)))
+            return false;
+
+        // Checked up front so that a corrupt footer can't cause a huge allocation.
+        if (footer.indexOffset > archiveSize - sizeof(footer) ||
+            GetIndexSize(footer) != archiveSize - sizeof(footer) - footer.indexOffset)
+        {
+            printf("Malformed archive index.\n");
+            return false;
+        }
+
+        std::vector<uint8_t> index(static_cast<size_t>(GetIndexSize(footer)));
+
+        file.seekg(footer.indexOffset);
+        if (!file.read(reinterpret_cast<char*>(index.data()), index.size()))
+            return false;
+
+        return Parse(footer, index.data(), archiveSize);
+    }
+
+    bool ArchiveIndex::Load(const uint8_t* archive, size_t archiveSize)
+    {
+        Reset();
+
+        ArchiveFooter footer{};
+        if (archive == nullptr || archiveSize < sizeof(ArchiveHeader) + sizeof(footer))
+            return false;
+
+        memcpy(&footer, archive + archiveSize - sizeof(footer), sizeof(footer));
+
+        if (footer.indexOffset > archiveSize - sizeof(footer))
+            return false;
+
+        return Parse(footer, archive + footer.indexOffset, archiveSize);
+    }
+
+    void ArchiveIndex::Reset()
+    {
+        m_entries.clear();
+        m_segments.clear();
+        m_largestSegmentSize = 0;
+    }
+
+    bool ArchiveIndex::Parse(ArchiveFooter const& footer, const uint8_t* index, uint64_t archiveSize)
+    {
+        if (footer.magic != kArchiveMagic || footer.version != kArchiveVersion)
+        {
+            printf("Unknown archive format.\n");
+            return false;
+        }
+
+        if (footer.indexOffset < sizeof(ArchiveHeader) ||
+            footer.indexOffset + GetIndexSize(footer) + sizeof(footer) != archiveSize)
+        {
+            printf("Malformed archive index.\n");
+            return false;
+        }
+
+        std::vector<ArchiveEntry> entries(footer.numEntries);
+        std::vector<ArchiveSegment> segments(footer.numSegments);
+
+        memcpy(entries.data(), index, entries.size() * sizeof(ArchiveEntry));
+        memcpy(
+            segments.data(),
+            index + entries.size() * sizeof(ArchiveEntry),
+            segments.size() * sizeof(ArchiveSegment));
+
+        uint32_t largestSegmentSize = 0;
+
+        for (ArchiveSegment const& segment : segments)
+        {
+            if (segment.offset < sizeof(ArchiveHeader) || segment.offset > footer.indexOffset ||
+                segment.compressedSize > footer.indexOffset - segment.offset)
+            {
+                printf("Malformed archive index.\n");
+                return false;
+            }
+
+            largestSegmentSize = std::max(largestSegmentSize, segment.compressedSize);
+        }
+
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            ArchiveEntry const& entry = entries[i];
+
+            bool valid = (i == 0 || entries[i - 1].nameHash < entry.nameHash) &&
+                         entry.firstSegment <= segments.size() &&
+                         entry.numSegments <= segments.size() - entry.firstSegment;
+
+            uint64_t uncompressedSize = 0;
+            for (uint32_t s = 0; valid && s < entry.numSegments; ++s)
+                uncompressedSize += segments[entry.firstSegment + s].uncompressedSize;
+
+            if (!valid || uncompressedSize != entry.uncompressedSize)
+            {
+                printf("Malformed archive index.\n");
+                return false;
+            }
+        }
+
+        m_entries = std::move(entries);
+        m_segments = std::move(segments);
+        m_largestSegmentSize = largestSegmentSize;
+
+        return true;
+    }
+
+    const ArchiveEntry* ArchiveIndex::Find(std::string_view name) const
+    {
+        return FindHash(HashArchiveName(name));
+    }
+
+    const ArchiveEntry* ArchiveIndex::FindHash(uint64_t nameHash) const
+    {
+        auto it = std::lower_bound(
+            m_entries.begin(),
+            m_entries.end(),
+            nameHash,
+            [](ArchiveEntry const& entry, uint64_t hash) { return entry.nameHash < hash; });
+
+        return it != m_entries.end() && it->nameHash == nameHash ? &*it : nullptr;
+    }
+
+    bool DecompressArchiveEntry(
+        ArchiveIndex const& index,
+        ArchiveEntry const& entry,
+        const uint8_t* archive,
+        size_t archiveSize,
+        uint8_t* output,
+        size_t outputSize,
+        uint32_t numWorkers,
+        Context& context)
+    {
+        if (archive == nullptr || output == nullptr || outputSize < entry.uncompressedSize)
+            return false;
+
+        if (entry.numSegments == 0)
+            return true;
+
+        const ArchiveSegment* segments = index.GetSegments(entry);
+        std::vector<StreamDesc> streams(entry.numSegments);
+
+        uint64_t outputPos = 0;
+
+        for (uint32_t i = 0; i < entry.numSegments; ++i)
+        {
+            ArchiveSegment const& segment = segments[i];
+
+            if (segment.offset > archiveSize || segment.compressedSize > archiveSize - segment.offset)
+                return false;
+
+            streams[i].input = archive + segment.offset;
+            streams[i].inputSize = segment.compressedSize;
+            streams[i].output = output + outputPos;
+            streams[i].outputSize = segment.uncompressedSize;
+
+            outputPos += segment.uncompressedSize;
+        }
+
+        return context.DecompressBatch(streams.data(), streams.size(), numWorkers);
+    }
+} // namespace GDeflate
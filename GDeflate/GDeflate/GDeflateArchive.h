@@ -0,0 +1,177 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "GDeflate.h"
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace GDeflate
+{
+    // An archive packs many named entries into one file that can be read with a large number of
+    // independent requests. Every entry is split into segments that are stored as separate
+    // TileStreams, so each segment can be read and decompressed on its own, e.g. as one
+    // DirectStorage request. The file is laid out as:
+    //
+    //   ArchiveHeader
+    //   segment data
+    //   ArchiveEntry[numEntries], sorted by nameHash
+    //   ArchiveSegment[numSegments]
+    //   ArchiveFooter
+    //
+    // The index sits at the end so that archives can be written in a single pass.
+
+    static constexpr uint32_t kArchiveMagic = 0x52414447; /*!< "GDAR" */
+    static constexpr uint32_t kArchiveVersion = 1;
+
+    // Large enough for efficient reads, small enough to keep many requests in flight.
+    static constexpr uint32_t kDefaultArchiveSegmentSize = 1024 * 1024;
+
+    struct ArchiveHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+    };
+
+    struct ArchiveEntry
+    {
+        uint64_t nameHash;
+        uint64_t uncompressedSize;
+
+        uint32_t firstSegment;
+        uint32_t numSegments;
+    };
+
+    struct ArchiveSegment
+    {
+        uint64_t offset; // From the start of the archive
+        uint32_t compressedSize;
+        uint32_t uncompressedSize;
+    };
+
+    struct ArchiveFooter
+    {
+        uint64_t indexOffset;
+        uint32_t numEntries;
+        uint32_t numSegments;
+        uint32_t magic;
+        uint32_t version;
+    };
+
+    static_assert(sizeof(ArchiveHeader) == 8, "Archive header size mismatch");
+    static_assert(sizeof(ArchiveEntry) == 24, "Archive entry size mismatch");
+    static_assert(sizeof(ArchiveSegment) == 16, "Archive segment size mismatch");
+    static_assert(sizeof(ArchiveFooter) == 24, "Archive footer size mismatch");
+
+    // 64-bit FNV-1a hash of an entry name, as stored in ArchiveEntry::nameHash.
+    uint64_t HashArchiveName(std::string_view name);
+
+    class ArchiveWriter
+    {
+    public:
+        using WriteFunction = std::function<bool(const uint8_t* data, size_t size)>;
+
+        explicit ArchiveWriter(Context& context);
+
+        // Starts a new archive that is passed to write as it is produced. segmentSize is rounded
+        // down to a whole number of tiles; 0 selects kDefaultArchiveSegmentSize. Archives meant
+        // for DirectStorage must use the default tile size and no other COMPRESS_* flags besides
+        // COMPRESS_SINGLE_THREAD.
+        bool Begin(WriteFunction write, uint32_t level, uint32_t flags = 0, uint32_t segmentSize = 0);
+
+        // Compresses and writes one entry. Fails if an entry with the same name hash was added.
+        bool AddEntry(std::string_view name, const uint8_t* data, size_t size);
+
+        // Writes the index. Any failure ends the archive, which then has to be started again.
+        bool Finish();
+
+    private:
+        bool Write(const uint8_t* data, size_t size);
+        void Abort();
+
+        Context& m_context;
+        WriteFunction m_write;
+        uint32_t m_level = 0;
+        uint32_t m_flags = 0;
+        size_t m_segmentSize = 0;
+        uint64_t m_offset = 0;
+        bool m_active = false;
+
+        std::vector<ArchiveEntry> m_entries;
+        std::vector<ArchiveSegment> m_segments;
+        std::unordered_set<uint64_t> m_nameHashes;
+        std::vector<uint8_t> m_output;
+    };
+
+    class ArchiveIndex
+    {
+    public:
+        // Reads just the index of the archive at path.
+        bool Load(std::filesystem::path const& path);
+
+        // Reads the index of an archive held in memory.
+        bool Load(const uint8_t* archive, size_t archiveSize);
+
+        const ArchiveEntry* Find(std::string_view name) const;
+        const ArchiveEntry* FindHash(uint64_t nameHash) const;
+
+        std::vector<ArchiveEntry> const& GetEntries() const
+        {
+            return m_entries;
+        }
+
+        // Returns the entry's numSegments segments, in the order their data is decompressed.
+        const ArchiveSegment* GetSegments(ArchiveEntry const& entry) const
+        {
+            return m_segments.data() + entry.firstSegment;
+        }
+
+        // Size of the largest segment in the archive, which DirectStorage's staging buffer must
+        // be able to hold.
+        uint32_t GetLargestSegmentSize() const
+        {
+            return m_largestSegmentSize;
+        }
+
+    private:
+        void Reset();
+        bool Parse(ArchiveFooter const& footer, const uint8_t* index, uint64_t archiveSize);
+
+        std::vector<ArchiveEntry> m_entries;
+        std::vector<ArchiveSegment> m_segments;
+        uint32_t m_largestSegmentSize = 0;
+    };
+
+    // Decompresses entry from the archive in memory at archive into output, which must hold
+    // entry.uncompressedSize bytes. All segments of the entry are decoded as a single batch.
+    bool DecompressArchiveEntry(
+        ArchiveIndex const& index,
+        ArchiveEntry const& entry,
+        const uint8_t* archive,
+        size_t archiveSize,
+        uint8_t* output,
+        size_t outputSize,
+        uint32_t numWorkers,
+        Context& context = GetDefaultContext());
+} // namespace GDeflate
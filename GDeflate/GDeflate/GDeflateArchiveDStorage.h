@@ -0,0 +1,92 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Builds DirectStorage requests for archive entries. This header is not compiled into the
+// GDeflate library; include it from code that already uses dstorage.h.
+
+#include "GDeflateArchive.h"
+
+#include <dstorage.h>
+
+#include <vector>
+
+namespace GDeflate
+{
+    inline DSTORAGE_REQUEST MakeArchiveSegmentRequest(IDStorageFile* file, ArchiveSegment const& segment)
+    {
+        DSTORAGE_REQUEST request = {};
+        request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        request.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+        request.Source.File.Source = file;
+        request.Source.File.Offset = segment.offset;
+        request.Source.File.Size = segment.compressedSize;
+        request.UncompressedSize = segment.uncompressedSize;
+
+        return request;
+    }
+
+    // Appends one request per segment of entry, decompressing the segments back to back into
+    // buffer starting at bufferOffset.
+    inline void AppendArchiveRequests(
+        ArchiveIndex const& index,
+        ArchiveEntry const& entry,
+        IDStorageFile* file,
+        ID3D12Resource* buffer,
+        uint64_t bufferOffset,
+        std::vector<DSTORAGE_REQUEST>& requests)
+    {
+        const ArchiveSegment* segments = index.GetSegments(entry);
+
+        for (uint32_t i = 0; i < entry.numSegments; ++i)
+        {
+            DSTORAGE_REQUEST request = MakeArchiveSegmentRequest(file, segments[i]);
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+            request.Destination.Buffer.Resource = buffer;
+            request.Destination.Buffer.Offset = bufferOffset;
+            request.Destination.Buffer.Size = segments[i].uncompressedSize;
+
+            requests.push_back(request);
+            bufferOffset += segments[i].uncompressedSize;
+        }
+    }
+
+    // Appends one request per segment of entry, decompressing the segments back to back into
+    // system memory at destination.
+    inline void AppendArchiveRequests(
+        ArchiveIndex const& index,
+        ArchiveEntry const& entry,
+        IDStorageFile* file,
+        void* destination,
+        std::vector<DSTORAGE_REQUEST>& requests)
+    {
+        const ArchiveSegment* segments = index.GetSegments(entry);
+        uint8_t* memory = static_cast<uint8_t*>(destination);
+
+        for (uint32_t i = 0; i < entry.numSegments; ++i)
+        {
+            DSTORAGE_REQUEST request = MakeArchiveSegmentRequest(file, segments[i]);
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+            request.Destination.Memory.Buffer = memory;
+            request.Destination.Memory.Size = segments[i].uncompressedSize;
+
+            requests.push_back(request);
+            memory += segments[i].uncompressedSize;
+        }
+    }
+} // namespace GDeflate
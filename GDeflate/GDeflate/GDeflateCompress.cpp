@@ -17,6 +17,8 @@
  */
 
 #include "GDeflate.h"
+#include "Crc32c.h"
+#include "TileEncoder.h"
 #include "TileStream.h"
 #include "Utils.h"
 #include "config.h"
@@ -27,7 +29,10 @@
 
 #include <algorithm>
 #include <atomic>
-#include <thread>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 template<>
@@ -44,38 +49,38 @@ namespace GDeflate
     static constexpr uint32_t kMaxWorkers = 31;
     static constexpr uint32_t kMinTilesPerWorker = 64;
 
-    struct OutputStreamWrapper
+    static constexpr uint32_t kTilesPerChunk = 16;
+
+    // Number of tiles EstimateCompressedSize compresses to predict the size of the whole input.
+    static constexpr size_t kNumEstimateSamples = 8;
+
+    // Copying the finished tiles into place is only spread over several threads if every thread
+    // gets at least this many bytes to move.
+    static constexpr size_t kMinBytesPerCopyWorker = 1024 * 1024;
+
+    // Growable per-worker output storage used when the caller's buffer is too small to hold every
+    // tile at its worst-case size.
+    struct Slab
     {
-        uint8_t* ptr = nullptr;
+        std::unique_ptr<uint8_t[]> data;
         size_t size = 0;
-        size_t pos = 0;
+        size_t capacity = 0;
 
-        template<typename T>
-        void StreamOut(T* d, size_t n = 1)
+        uint8_t* Reserve(size_t n)
         {
-            const size_t dataSize = sizeof(T) * n;
-
-            if (pos + dataSize > size)
+            if (size + n > capacity)
             {
-                printf("Fatal: stream overrun!\n");
-                return;
-            }
+                size_t newCapacity = std::max(size + n, capacity * 2);
+                std::unique_ptr<uint8_t[]> newData(new uint8_t[newCapacity]);
 
-            memcpy(ptr + pos, d, dataSize);
-            pos += dataSize;
-        }
+                if (size != 0)
+                    memcpy(newData.get(), data.get(), size);
 
-        bool SetPos(size_t n)
-        {
-            if (n > size)
-            {
-                printf("Fatal: stream overrun!\n");
-                return false;
+                data = std::move(newData);
+                capacity = newCapacity;
             }
 
-            pos = n;
-
-            return true;
+            return data.get() + size;
         }
     };
 
@@ -84,187 +89,1002 @@ namespace GDeflate
         const uint8_t* inputPtr;
         size_t inputSize;
 
+        size_t tileSize;
+        size_t tileBound;
+        bool storeTiles;
+        bool checksums;
+
+        // When set, tiles are compressed straight into the output buffer: chunk N is written
+        // contiguously starting at directPtr + N * kTilesPerChunk * tileBound and compacted once
+        // all tiles are done. Otherwise every worker appends its tiles to its own slab.
+        uint8_t* directPtr;
+
         struct Tile
         {
-            std::vector<uint8_t> data;
-            size_t uncompressedSize = 0;
+            const uint8_t* data = nullptr;
+            uint32_t slabIndex = 0;
+            size_t slabOffset = 0;
+            size_t compressedSize = 0;
+            uint32_t checksum = 0;
         };
 
         std::vector<Tile> tiles;
+        std::vector<Slab> slabs;
+
+        // Set for adaptive compression.
+        const AdaptiveSettings* adaptive;
+        std::chrono::steady_clock::time_point deadline;
+
+        // Set when the tiles are compressed against a preset dictionary. libdeflate can't take one,
+        // so they are compressed with EncodeTile.
+        const Dictionary* dictionary;
 
         std::atomic_uint32_t globalIndex;
+        std::atomic_uint32_t slabIndex;
         uint32_t numItems;
+        uint32_t numChunks;
 
+        std::atomic_bool storedAny;
         std::atomic_bool failed;
+
+        // Set when the caller follows the compression, see CompressionMonitor.
+        const CompressionMonitor* monitor;
+        std::atomic_uint32_t tilesDone;
+        std::atomic<size_t> bytesIn;
+        std::atomic<size_t> bytesOut;
+        std::mutex progressMutex;
     };
 
-    static bool DoCompress(
-        uint8_t* output,
-        size_t* outputSize,
+    // Returns a compressor for the given level owned by the calling thread. Compressors are kept
+    // for the lifetime of the thread so that repeated calls don't reallocate the match finder.
+    static libdeflate_gdeflate_compressor* GetThreadCompressor(uint32_t level)
+    {
+        static thread_local std::unique_ptr<libdeflate_gdeflate_compressor> compressors[MaximumCompressionLevel + 1];
+
+        if (level > MaximumCompressionLevel)
+            return nullptr;
+
+        auto& compressor = compressors[level];
+        if (!compressor)
+            compressor.reset(libdeflate_alloc_gdeflate_compressor(static_cast<int>(level)));
+
+        return compressor.get();
+    }
+
+    // Worst-case compressed size of a single tile, as reported by libdeflate.
+    static size_t GetTileCompressBound(size_t tileSize)
+    {
+        size_t pageCount = 0;
+        const size_t tileBound = libdeflate_gdeflate_compress_bound(nullptr, tileSize, &pageCount);
+        assert(pageCount == 1);
+
+        return tileBound;
+    }
+
+    // Compresses a single tile into out, which must hold tileBound bytes. Returns the compressed
+    // size, or 0 on failure.
+    static size_t CompressTile(
+        libdeflate_gdeflate_compressor* compressor,
         const uint8_t* in,
         size_t inSize,
-        uint32_t level,
-        uint32_t flags)
+        uint8_t* out,
+        size_t tileBound)
     {
-        if (outputSize == nullptr || output == nullptr || in == nullptr || inSize == 0)
-            return false;
+        libdeflate_gdeflate_out_page compressedPage{};
+        compressedPage.data = out;
+        compressedPage.nbytes = tileBound;
 
-        if (inSize > kDefaultTileSize * TileStream::kMaxTiles)
-            return false;
+        if (libdeflate_gdeflate_compress(compressor, in, inSize, &compressedPage, 1) == 0)
+            return 0;
 
-        CompressionContext context{};
+        return compressedPage.nbytes;
+    }
 
-        context.inputPtr = in;
-        context.inputSize = inSize;
-        context.numItems = static_cast<uint32_t>((inSize + kDefaultTileSize - 1) / kDefaultTileSize);
-        context.tiles.resize(context.numItems);
-        context.failed = false;
+    // Running estimate of how much recompressing at the requested level saves beyond what the
+    // probe level saved. The estimate is kept per chunk: a chunk is always compressed by a single
+    // worker, so the output doesn't depend on how the tiles were spread over the threads.
+    struct GainEstimate
+    {
+        uint64_t probeSavings = 0;
+        uint64_t extraSavings = 0;
+        bool valid = false;
+    };
+
+    static size_t CompressTileAdaptive(
+        CompressionContext const& context,
+        libdeflate_gdeflate_compressor* compressor,
+        libdeflate_gdeflate_compressor* probeCompressor,
+        uint8_t* probeBuffer,
+        GainEstimate& estimate,
+        const uint8_t* in,
+        size_t inSize,
+        uint8_t* out)
+    {
+        const size_t probeSize = CompressTile(probeCompressor, in, inSize, probeBuffer, context.tileBound);
+        if (probeSize == 0)
+            return 0;
+
+        const size_t probeSavings = inSize - std::min(inSize, probeSize);
 
-        auto TileCompressionJob = [&context, level]()
+        bool recompress = false;
+
+        if (context.adaptive->timeBudgetMs != 0 && std::chrono::steady_clock::now() >= context.deadline)
+        {
+            recompress = false;
+        }
+        else if (!estimate.valid)
         {
-            size_t pageCount = 0;
-            const size_t scratchSize = libdeflate_gdeflate_compress_bound(nullptr, kDefaultTileSize, &pageCount);
-            assert(pageCount == 1);
+            // The first tile of every chunk is recompressed regardless to seed the estimate.
+            recompress = true;
+        }
+        else if (estimate.probeSavings != 0)
+        {
+            const double expectedGain =
+                static_cast<double>(probeSavings) * estimate.extraSavings / estimate.probeSavings;
+
+            recompress = expectedGain >= context.adaptive->minGain * inSize;
+        }
+
+        if (recompress)
+        {
+            const size_t compressedSize = CompressTile(compressor, in, inSize, out, context.tileBound);
+            if (compressedSize == 0)
+                return 0;
+
+            estimate.probeSavings += probeSavings;
+            estimate.extraSavings += probeSize - std::min(probeSize, compressedSize);
+            estimate.valid = true;
+
+            if (compressedSize <= probeSize)
+                return compressedSize;
+        }
+
+        memcpy(out, probeBuffer, probeSize);
+        return probeSize;
+    }
+
+    static bool IsCanceled(CompressionContext const& context)
+    {
+        return context.monitor != nullptr && context.monitor->cancel != nullptr &&
+               context.monitor->cancel->load(std::memory_order_relaxed);
+    }
+
+    static void ReportTile(CompressionContext& context, size_t uncompressedSize, size_t compressedSize)
+    {
+        context.tilesDone.fetch_add(1, std::memory_order_relaxed);
+        context.bytesIn.fetch_add(uncompressedSize, std::memory_order_relaxed);
+        context.bytesOut.fetch_add(compressedSize, std::memory_order_relaxed);
+
+        if (!context.monitor->progress)
+            return;
+
+        // The counts are read under the lock so that successive calls never go backwards.
+        std::lock_guard<std::mutex> lock(context.progressMutex);
 
-            void* scratch = alloca(scratchSize);
+        CompressProgress progress;
+        progress.tilesDone = context.tilesDone.load(std::memory_order_relaxed);
+        progress.numTiles = context.numItems;
+        progress.bytesIn = context.bytesIn.load(std::memory_order_relaxed);
+        progress.bytesOut = context.bytesOut.load(std::memory_order_relaxed);
 
-            std::unique_ptr<libdeflate_gdeflate_compressor> compressor(libdeflate_alloc_gdeflate_compressor(level));
+        context.monitor->progress(progress);
+    }
+
+    // The compressors a worker uses for every tile it takes.
+    struct TileCompressors
+    {
+        libdeflate_gdeflate_compressor* compressor = nullptr;
+        libdeflate_gdeflate_compressor* probeCompressor = nullptr;
+        std::unique_ptr<uint8_t[]> probeBuffer;
+        uint32_t level = 0;
+
+        bool Initialize(CompressionContext const& context, uint32_t inLevel)
+        {
+            level = inLevel;
+            compressor = GetThreadCompressor(level);
+            if (compressor == nullptr)
+                return false;
 
-            while (true)
+            if (context.adaptive != nullptr)
             {
-                const uint32_t tileIndex = context.globalIndex.fetch_add(1, std::memory_order_relaxed);
+                probeCompressor = GetThreadCompressor(context.adaptive->probeLevel);
+                if (probeCompressor == nullptr)
+                    return false;
 
-                if (tileIndex >= context.numItems)
-                    break;
+                probeBuffer.reset(new uint8_t[context.tileBound]);
+            }
+
+            return true;
+        }
+    };
+
+    // Compresses the tiles of a chunk, into slab if it is set and in place otherwise.
+    static bool CompressChunk(
+        CompressionContext& context,
+        TileCompressors const& compressors,
+        Slab* slab,
+        uint32_t slabIndex,
+        uint32_t chunkIndex)
+    {
+        const uint32_t firstTile = chunkIndex * kTilesPerChunk;
+        const uint32_t lastTile = std::min(firstTile + kTilesPerChunk, context.numItems);
+
+        uint8_t* chunkPtr = context.directPtr != nullptr ? context.directPtr + firstTile * context.tileBound : nullptr;
+
+        GainEstimate estimate;
+
+        for (uint32_t tileIndex = firstTile; tileIndex < lastTile; ++tileIndex)
+        {
+            if (IsCanceled(context))
+                return false;
+
+            const size_t tilePos = tileIndex * context.tileSize;
+
+            size_t remaining = context.inputSize - tilePos;
+            size_t uncompressedSize = std::min<size_t>(remaining, context.tileSize);
 
-                const size_t tilePos = tileIndex * kDefaultTileSize;
+            auto& tile = context.tiles[tileIndex];
 
-                size_t remaining = context.inputSize - tilePos;
-                size_t uncompressedSize = std::min<size_t>(remaining, kDefaultTileSize);
+            uint8_t* tilePtr;
 
-                auto& tile = context.tiles[tileIndex];
-                tile.uncompressedSize = uncompressedSize;
+            if (slab != nullptr)
+            {
+                tilePtr = slab->Reserve(context.tileBound);
+                tile.slabIndex = slabIndex;
+                tile.slabOffset = slab->size;
+            }
+            else
+            {
+                tilePtr = chunkPtr;
+                tile.data = chunkPtr;
+            }
 
-                libdeflate_gdeflate_out_page compressedPage{scratch, scratchSize};
+            size_t compressedSize;
 
-                size_t result = libdeflate_gdeflate_compress(
-                    compressor.get(),
+            if (context.dictionary != nullptr)
+            {
+                compressedSize = EncodeTile(
+                    context.inputPtr + tilePos,
+                    uncompressedSize,
+                    context.dictionary->GetData(),
+                    context.dictionary->GetSize(),
+                    tilePtr,
+                    context.tileBound,
+                    compressors.level);
+            }
+            else if (compressors.probeCompressor != nullptr)
+            {
+                compressedSize = CompressTileAdaptive(
+                    context,
+                    compressors.compressor,
+                    compressors.probeCompressor,
+                    compressors.probeBuffer.get(),
+                    estimate,
                     context.inputPtr + tilePos,
                     uncompressedSize,
-                    &compressedPage,
-                    1);
+                    tilePtr);
+            }
+            else
+            {
+                compressedSize = CompressTile(
+                    compressors.compressor,
+                    context.inputPtr + tilePos,
+                    uncompressedSize,
+                    tilePtr,
+                    context.tileBound);
+            }
 
-                if (result == 0)
-                {
-                    context.failed = true;
-                    break;
-                }
+            if (compressedSize == 0)
+                return false;
 
-                tile.data.resize(compressedPage.nbytes);
-                memcpy(tile.data.data(), compressedPage.data, compressedPage.nbytes);
+            // Tiles that don't shrink are kept as they are, which also spares the decoder the
+            // cost of decoding them. See TileStream::storedTiles.
+            if (context.storeTiles && compressedSize >= uncompressedSize)
+            {
+                memcpy(tilePtr, context.inputPtr + tilePos, uncompressedSize);
+                compressedSize = uncompressedSize;
+
+                if (!context.storedAny.load(std::memory_order_relaxed))
+                    context.storedAny = true;
             }
-        };
 
-        std::thread workers[kMaxWorkers + 1];
-        const uint32_t maxWorkers = std::min(kMaxWorkers, std::thread::hardware_concurrency());
+            tile.compressedSize = compressedSize;
 
-        uint32_t numWorkersLeft =
-            std::min(maxWorkers, (context.numItems + kMinTilesPerWorker - 1) / kMinTilesPerWorker);
+            if (context.checksums)
+                tile.checksum = Crc32c(tilePtr, compressedSize);
 
-        if (flags & COMPRESS_SINGLE_THREAD)
-            numWorkersLeft = 0;
+            if (slab != nullptr)
+                slab->size += compressedSize;
+            else
+                chunkPtr += compressedSize;
+
+            if (context.monitor != nullptr)
+                ReportTile(context, uncompressedSize, compressedSize);
+        }
+
+        return true;
+    }
 
-        for (auto& worker : workers)
+    static void TileCompressionJob(CompressionContext& context, uint32_t level)
+    {
+        TileCompressors compressors;
+        if (!compressors.Initialize(context, level))
+        {
+            context.failed = true;
+            return;
+        }
+
+        Slab* slab = nullptr;
+        uint32_t slabIndex = 0;
+        if (context.directPtr == nullptr)
         {
-            if (numWorkersLeft == 0)
+            slabIndex = context.slabIndex.fetch_add(1, std::memory_order_relaxed);
+            slab = &context.slabs[slabIndex];
+        }
+
+        while (!context.failed)
+        {
+            const uint32_t chunkIndex = context.globalIndex.fetch_add(1, std::memory_order_relaxed);
+
+            if (chunkIndex >= context.numChunks)
                 break;
 
-            worker = std::thread([TileCompressionJob]() { TileCompressionJob(); });
+            if (!CompressChunk(context, compressors, slab, slabIndex, chunkIndex))
+            {
+                context.failed = true;
+                return;
+            }
+        }
+    }
+
+    // Runs fn(i) for every i in [first, last) on up to parallelism threads.
+    template<typename Fn>
+    static void ParallelFor(Executor& executor, uint32_t parallelism, uint32_t first, uint32_t last, Fn const& fn)
+    {
+        if (parallelism <= 1)
+        {
+            for (uint32_t i = first; i < last; ++i)
+                fn(i);
 
-            --numWorkersLeft;
+            return;
         }
 
-        TileCompressionJob();
+        std::atomic_uint32_t next{first};
+
+        executor.Run(
+            parallelism,
+            [&]()
+            {
+                for (uint32_t i = next.fetch_add(1, std::memory_order_relaxed); i < last;
+                     i = next.fetch_add(1, std::memory_order_relaxed))
+                {
+                    fn(i);
+                }
+            });
+    }
+
+    static uint32_t GetCopyParallelism(size_t numBytes, uint32_t numItems, uint32_t maxParallelism)
+    {
+        const size_t parallelism = std::max<size_t>(1, numBytes / kMinBytesPerCopyWorker);
+
+        return static_cast<uint32_t>(std::min<size_t>({parallelism, numItems, maxParallelism}));
+    }
+
+    // Moves the chunks compressed in place to their final offsets in tilePtrs. Tiles within a
+    // chunk are already contiguous, so this is one move per chunk.
+    static void CompactChunks(
+        Executor& executor,
+        CompressionContext const& context,
+        std::vector<uint32_t> const& tilePtrs,
+        uint32_t maxParallelism)
+    {
+        const size_t chunkStride = kTilesPerChunk * context.tileBound;
 
-        for (auto& worker : workers)
+        auto ChunkBegin = [&](uint32_t chunkIndex) -> size_t { return tilePtrs[chunkIndex * kTilesPerChunk]; };
+
+        auto ChunkEnd = [&](uint32_t chunkIndex) -> size_t
         {
-            if (worker.joinable())
-                worker.join();
+            const uint32_t lastTile = std::min((chunkIndex + 1) * kTilesPerChunk, context.numItems) - 1;
+            return tilePtrs[lastTile] + context.tiles[lastTile].compressedSize;
+        };
+
+        auto MoveChunk = [&](uint32_t chunkIndex)
+        {
+            const uint8_t* src = context.tiles[chunkIndex * kTilesPerChunk].data;
+            uint8_t* dst = context.directPtr + ChunkBegin(chunkIndex);
+
+            if (dst != src)
+                memmove(dst, src, ChunkEnd(chunkIndex) - ChunkBegin(chunkIndex));
+        };
+
+        // Chunk N was written at N * chunkStride and only ever moves towards the start of the
+        // buffer, into space that chunks before it have vacated. The chunks are therefore moved in
+        // waves: a wave starting at chunk N also takes every following chunk whose destination ends
+        // before the source of chunk N, as those can't overlap the source of any chunk that is yet
+        // to move. Waves grow geometrically when the data compresses, and are a single chunk each
+        // when it doesn't.
+        for (uint32_t firstChunk = 0; firstChunk < context.numChunks;)
+        {
+            uint32_t endChunk = firstChunk + 1;
+            while (endChunk < context.numChunks && ChunkEnd(endChunk) <= firstChunk * chunkStride)
+                ++endChunk;
+
+            const size_t numBytes = ChunkEnd(endChunk - 1) - ChunkBegin(firstChunk);
+            const uint32_t parallelism = GetCopyParallelism(numBytes, endChunk - firstChunk, maxParallelism);
+
+            ParallelFor(executor, parallelism, firstChunk, endChunk, MoveChunk);
+
+            firstChunk = endChunk;
         }
+    }
 
-        // Compression failed
-        if (context.failed)
+    // Copies the tiles out of the per-worker slabs to their final offsets in tilePtrs.
+    static void CopyFromSlabs(
+        Executor& executor,
+        CompressionContext const& context,
+        std::vector<uint32_t> const& tilePtrs,
+        uint8_t* dataPtr,
+        size_t dataSize,
+        uint32_t maxParallelism)
+    {
+        auto CopyChunk = [&](uint32_t chunkIndex)
+        {
+            const uint32_t firstTile = chunkIndex * kTilesPerChunk;
+            const uint32_t lastTile = std::min(firstTile + kTilesPerChunk, context.numItems);
+
+            for (uint32_t i = firstTile; i < lastTile; ++i)
+            {
+                auto const& tile = context.tiles[i];
+                auto const& slab = context.slabs[tile.slabIndex];
+
+                memcpy(dataPtr + tilePtrs[i], slab.data.get() + tile.slabOffset, tile.compressedSize);
+            }
+        };
+
+        const uint32_t parallelism = GetCopyParallelism(dataSize, context.numChunks, maxParallelism);
+
+        ParallelFor(executor, parallelism, 0, context.numChunks, CopyChunk);
+    }
+
+    // Sets up context for compressing the inSize bytes at in. The work list and the output are
+    // left to the caller.
+    static bool InitializeContext(
+        CompressionContext& context,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        const AdaptiveSettings* adaptive)
+    {
+        if (in == nullptr || inSize == 0)
+            return false;
+
+        const size_t tileSize = GetTileSize(flags);
+        if (tileSize == 0)
+            return false;
+
+        if (inSize > tileSize * TileStream::kMaxTiles)
             return false;
 
-        // Compression is done. Prepare the output stream.
+        context.inputPtr = in;
+        context.inputSize = inSize;
+        context.tileSize = tileSize;
+        context.tileBound = GetTileCompressBound(tileSize);
+        context.numItems = static_cast<uint32_t>((inSize + tileSize - 1) / tileSize);
+        context.numChunks = (context.numItems + kTilesPerChunk - 1) / kTilesPerChunk;
+        context.tiles.resize(context.numItems);
+        context.storeTiles = (flags & COMPRESS_STORED_TILES) != 0;
+        context.checksums = (flags & COMPRESS_TILE_CHECKSUMS) != 0;
+        context.storedAny = false;
+        context.failed = false;
+
+        // Probing at or above the requested level would only make compression slower.
+        if (adaptive != nullptr && adaptive->probeLevel < level)
+        {
+            context.adaptive = adaptive;
+            context.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(adaptive->timeBudgetMs);
+        }
+
+        return true;
+    }
+
+    static TileStream GetStreamHeader(CompressionContext const& context)
+    {
+        TileStream header(context.inputSize, TileStream::GetTileSizeIdx(context.tileSize));
+        header.checksums = context.checksums ? 1 : 0;
+        header.dictionaryId = context.dictionary != nullptr ? context.dictionary->GetId() : 0;
+
+        return header;
+    }
+
+    // Lays out the compressed tiles of context as a stream in output, which holds *outputSize
+    // bytes, or appended to sink when that is given. The sink is only resized once the compressed
+    // size is known. The tiles are moved into place on up to parallelism threads.
+    static bool WriteStream(
+        Executor& executor,
+        CompressionContext const& context,
+        uint8_t* output,
+        size_t* outputSize,
+        std::vector<uint8_t>* sink,
+        uint32_t parallelism)
+    {
+        TileStream header = GetStreamHeader(context);
+
+        const size_t dataOffset = header.GetDataOffset();
 
-        std::vector<uint32_t> tilePtrs;
+        std::vector<uint32_t> tilePtrs(context.numItems);
         size_t dataPos = 0;
 
-        for (auto const& tile : context.tiles)
+        for (uint32_t i = 0; i < context.numItems; ++i)
+        {
+            tilePtrs[i] = static_cast<uint32_t>(dataPos);
+            dataPos += context.tiles[i].compressedSize;
+        }
+
+        if (sink != nullptr)
         {
-            tilePtrs.push_back(static_cast<uint32_t>(dataPos));
-            dataPos += tile.data.size();
+            const size_t sinkOffset = sink->size();
+            sink->resize(sinkOffset + dataOffset + dataPos);
+            output = sink->data() + sinkOffset;
+        }
+        else if (dataOffset + dataPos > *outputSize)
+        {
+            printf("Fatal: stream overrun!\n");
+            return false;
         }
 
+        if (context.directPtr != nullptr)
+            CompactChunks(executor, context, tilePtrs, parallelism);
+        else
+            CopyFromSlabs(executor, context, tilePtrs, output + dataOffset, dataPos, parallelism);
+
         // tilePtrs[0] is used to store the size of the last tile; all the other
         // elements are offsets to the tile data.
-        tilePtrs[0] = static_cast<uint32_t>(context.tiles.back().data.size());
+        tilePtrs[0] = static_cast<uint32_t>(context.tiles.back().compressedSize);
 
         assert(tilePtrs.size() <= TileStream::kMaxTiles);
-        assert(tilePtrs.size() == context.tiles.size());
-        assert(tilePtrs.size() == context.numItems);
 
-        OutputStreamWrapper outputStream;
-        outputStream.ptr = output;
-        outputStream.size = *outputSize;
+        // Streams without stored tiles are left unmarked so that any decoder can read them.
+        header.storedTiles = context.storedAny ? 1 : 0;
 
-        // calculate uncompressed size
-        size_t uncompressedSize = tilePtrs.size() * kDefaultTileSize;
-        size_t tailSize = context.inputSize - (tilePtrs.size() - 1) * kDefaultTileSize;
-        if (tailSize < kDefaultTileSize)
-            uncompressedSize -= kDefaultTileSize - tailSize;
+        assert(tilePtrs.size() == header.numTiles);
+        assert(header.GetUncompressedSize() == context.inputSize);
 
-        assert(uncompressedSize == inSize);
+        memcpy(output, &header, sizeof(header));
+        memcpy(output + sizeof(header), tilePtrs.data(), tilePtrs.size() * sizeof(uint32_t));
 
-        TileStream header(uncompressedSize);
+        if (context.checksums)
+        {
+            uint8_t* checksumsPtr = output + sizeof(header) + tilePtrs.size() * sizeof(uint32_t);
 
-        assert(tilePtrs.size() == header.numTiles);
+            for (uint32_t i = 0; i < context.numItems; ++i)
+                memcpy(checksumsPtr + i * sizeof(uint32_t), &context.tiles[i].checksum, sizeof(uint32_t));
+        }
 
-        outputStream.StreamOut(&header);
-        outputStream.StreamOut(tilePtrs.data(), tilePtrs.size());
+        if (outputSize != nullptr)
+            *outputSize = dataOffset + dataPos;
 
-        size_t dataOffset = outputStream.pos;
+        return true;
+    }
+
+    static uint32_t GetNumCompressionWorkers(uint64_t numTiles, uint32_t flags)
+    {
+        if (flags & COMPRESS_SINGLE_THREAD)
+            return 0;
+
+        const uint64_t numWorkers = (numTiles + kMinTilesPerWorker - 1) / kMinTilesPerWorker;
+
+        return static_cast<uint32_t>(std::min<uint64_t>(kMaxWorkers, numWorkers));
+    }
 
-        for (size_t i = 0; i < tilePtrs.size(); ++i)
+    // Compresses into output, which holds *outputSize bytes, or appends the stream to sink when that
+    // is given.
+    static bool DoCompress(
+        Executor& executor,
+        uint8_t* output,
+        size_t* outputSize,
+        std::vector<uint8_t>* sink,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        const AdaptiveSettings* adaptive,
+        const CompressionMonitor* monitor,
+        const Dictionary* dictionary = nullptr)
+    {
+        if (sink == nullptr && (outputSize == nullptr || output == nullptr))
+            return false;
+
+        if (dictionary != nullptr && !dictionary->IsValid())
+            return false;
+
+        CompressionContext context{};
+
+        if (!InitializeContext(context, in, inSize, level, flags, adaptive))
+            return false;
+
+        context.monitor = monitor;
+
+        if (dictionary != nullptr)
         {
-            CompressionContext::Tile const& tile = context.tiles[i];
-            uint32_t tileOffset = (i == 0) ? 0 : tilePtrs[i];
+            context.dictionary = dictionary;
+            context.tileBound = std::max(context.tileBound, GetEncodeTileBound(context.tileSize));
+        }
 
-            outputStream.SetPos(dataOffset + tileOffset);
-            outputStream.StreamOut(tile.data.data(), tile.data.size());
+        const size_t dataOffset = GetStreamHeader(context).GetDataOffset();
+
+        if (sink == nullptr && *outputSize >= dataOffset &&
+            (*outputSize - dataOffset) / context.tileBound >= context.numItems)
+        {
+            context.directPtr = output + dataOffset;
         }
 
-        *outputSize = outputStream.pos;
+        // The calling thread always runs the job too, so request one more than the helper count.
+        const uint32_t parallelism = GetNumCompressionWorkers(context.numItems, flags) + 1;
 
-        return true;
+        if (context.directPtr == nullptr)
+            context.slabs.resize(parallelism);
+
+        executor.Run(parallelism, [&context, level]() { TileCompressionJob(context, level); });
+
+        // Compression failed
+        if (context.failed)
+            return false;
+
+        return WriteStream(executor, context, output, outputSize, sink, parallelism);
+    }
+
+    struct BatchStream
+    {
+        CompressionContext context;
+
+        // The chunks that are yet to finish. Whoever finishes the last one writes the stream.
+        std::atomic_uint32_t chunksLeft;
+    };
+
+    // Lays out a stream of a CompressBatch call once its last chunk is done, and reports it.
+    static void FinishBatchStream(
+        Executor& executor,
+        BatchStream& stream,
+        CompressDesc& desc,
+        size_t streamIndex,
+        StreamCompletedCallback const& completed)
+    {
+        size_t outputSize = desc.output.size();
+
+        // The tiles were compressed in place, so compacting them is a single pass over memory the
+        // worker has just written; there's nothing to gain from sharing it out.
+        desc.succeeded = !stream.context.failed &&
+                         WriteStream(executor, stream.context, desc.output.data(), &outputSize, nullptr, 1);
+
+        if (desc.succeeded)
+            desc.output.resize(outputSize);
+        else
+            desc.output.clear();
+
+        if (completed)
+            completed(streamIndex);
+    }
+
+    static bool DoCompressBatch(
+        Executor& executor,
+        CompressDesc* streams,
+        size_t numStreams,
+        uint32_t level,
+        uint32_t flags,
+        StreamCompletedCallback const& completed)
+    {
+        if (nullptr == streams || 0 == numStreams || numStreams >= UINT32_MAX)
+            return false;
+
+        std::unique_ptr<BatchStream[]> contexts(new BatchStream[numStreams]());
+        std::vector<uint32_t> chunkStarts(numStreams + 1);
+
+        uint64_t numChunks = 0;
+        uint64_t numTiles = 0;
+
+        for (size_t i = 0; i < numStreams; ++i)
+        {
+            CompressDesc& desc = streams[i];
+            CompressionContext& context = contexts[i].context;
+
+            chunkStarts[i] = static_cast<uint32_t>(numChunks);
+
+            desc.output.clear();
+            desc.succeeded = InitializeContext(context, desc.input, desc.inputSize, level, flags, nullptr);
+
+            if (!desc.succeeded)
+                continue;
+
+            // The work list is indexed with 32 bits. Nothing in the batch is compressed then, and
+            // every stream is reported as failed.
+            if (numChunks + context.numChunks > UINT32_MAX)
+            {
+                for (size_t j = 0; j < numStreams; ++j)
+                {
+                    streams[j].output.clear();
+                    streams[j].succeeded = false;
+
+                    if (completed)
+                        completed(j);
+                }
+
+                return false;
+            }
+
+            // Every tile is compressed in place, as with Compress into a buffer of CompressBound
+            // bytes, and the output shrinks to the stream once it's done.
+            const size_t dataOffset = GetStreamHeader(context).GetDataOffset();
+
+            desc.output.resize(dataOffset + context.numItems * context.tileBound);
+            context.directPtr = desc.output.data() + dataOffset;
+
+            contexts[i].chunksLeft = context.numChunks;
+
+            numChunks += context.numChunks;
+            numTiles += context.numItems;
+        }
+
+        chunkStarts[numStreams] = static_cast<uint32_t>(numChunks);
+
+        // Streams that can't be compressed are reported up front.
+        for (size_t i = 0; i < numStreams; ++i)
+        {
+            if (!streams[i].succeeded && completed)
+                completed(i);
+        }
+
+        std::atomic_uint32_t globalIndex{0};
+
+        auto CompressionJob = [&]()
+        {
+            // Nothing in a batch is compressed adaptively, so every stream can share the
+            // compressors set up for the first one.
+            TileCompressors compressors;
+            const bool initialized = compressors.Initialize(contexts[0].context, level);
+
+            for (;;)
+            {
+                const uint32_t chunkIndex = globalIndex.fetch_add(1, std::memory_order_relaxed);
+
+                if (chunkIndex >= numChunks)
+                    break;
+
+                const size_t streamIndex =
+                    std::upper_bound(chunkStarts.begin(), chunkStarts.end(), chunkIndex) - chunkStarts.begin() - 1;
+
+                BatchStream& stream = contexts[streamIndex];
+                CompressionContext& context = stream.context;
+
+                // The other chunks of a stream that has failed are skipped, but still counted down.
+                if (!context.failed &&
+                    (!initialized ||
+                     !CompressChunk(context, compressors, nullptr, 0, chunkIndex - chunkStarts[streamIndex])))
+                {
+                    context.failed = true;
+                }
+
+                if (stream.chunksLeft.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    FinishBatchStream(executor, stream, streams[streamIndex], streamIndex, completed);
+            }
+        };
+
+        if (numChunks != 0)
+            executor.Run(GetNumCompressionWorkers(numTiles, flags) + 1, CompressionJob);
+
+        bool succeeded = true;
+
+        for (size_t i = 0; i < numStreams; ++i)
+            succeeded = succeeded && streams[i].succeeded;
+
+        return succeeded;
+    }
+
+    size_t GetTileSize(uint32_t flags)
+    {
+        switch (flags & (COMPRESS_TILE_SIZE_16K | COMPRESS_TILE_SIZE_32K))
+        {
+        case 0:
+            return kDefaultTileSize;
+        case COMPRESS_TILE_SIZE_16K:
+            return 16 * 1024;
+        case COMPRESS_TILE_SIZE_32K:
+            return 32 * 1024;
+        default:
+            return 0;
+        }
     }
 
-    size_t CompressBound(size_t size)
+    size_t CompressBound(size_t size, uint32_t flags)
     {
-        size_t numTiles = std::min(size_t(TileStream::kMaxTiles), (size + kDefaultTileSize - 1) / kDefaultTileSize);
+        const size_t uncompressedTileSize = std::max(kMinTileSize, GetTileSize(flags));
+
+        size_t numTiles =
+            std::min(size_t(TileStream::kMaxTiles), (size + uncompressedTileSize - 1) / uncompressedTileSize);
         numTiles = std::max(size_t(1), numTiles);
 
-        const size_t tileSize = kDefaultTileSize +
-                                // Tile header. Ideally need to make it a part of compressor API.
-                                (sizeof(uint32_t) + 4 * 208 + 4 * 8);
+        // Tile header. Ideally need to make it a part of compressor API. The tile offset entry is
+        // included as well so that a buffer of this size lets Compress write every tile in place.
+        const size_t tileSize = std::max(
+            uncompressedTileSize + (sizeof(uint32_t) + 4 * 208 + 4 * 8),
+            GetTileCompressBound(uncompressedTileSize) + sizeof(uint32_t));
+
+        const size_t checksumsSize = (flags & COMPRESS_TILE_CHECKSUMS) ? numTiles * sizeof(uint32_t) : 0;
 
-        return numTiles * tileSize + sizeof(TileStream) + sizeof(uint64_t);
+        return numTiles * tileSize + checksumsSize + sizeof(TileStream) + sizeof(uint64_t);
     }
 
-    bool Compress(uint8_t* output, size_t* outputSize, const uint8_t* in, size_t inSize, uint32_t level, uint32_t flags)
+    size_t EstimateCompressedSize(const uint8_t* in, size_t inSize, uint32_t level, uint32_t flags)
+    {
+        const size_t tileSize = GetTileSize(flags);
+
+        if (in == nullptr || inSize == 0 || tileSize == 0 || inSize > tileSize * TileStream::kMaxTiles)
+            return 0;
+
+        libdeflate_gdeflate_compressor* compressor = GetThreadCompressor(level);
+        if (compressor == nullptr)
+            return 0;
+
+        const size_t numTiles = (inSize + tileSize - 1) / tileSize;
+        const size_t numSamples = std::min<size_t>(numTiles, kNumEstimateSamples);
+        const size_t tileBound = GetTileCompressBound(tileSize);
+
+        std::unique_ptr<uint8_t[]> scratch(new uint8_t[tileBound]);
+
+        size_t sampledSize = 0;
+        size_t sampledCompressedSize = 0;
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            // The samples are spread evenly over the input, first and last tile included.
+            const size_t tileIndex = numSamples > 1 ? i * (numTiles - 1) / (numSamples - 1) : 0;
+            const size_t tilePos = tileIndex * tileSize;
+            const size_t uncompressedSize = std::min(tileSize, inSize - tilePos);
+
+            size_t compressedSize = CompressTile(compressor, in + tilePos, uncompressedSize, scratch.get(), tileBound);
+            if (compressedSize == 0)
+                return 0;
+
+            if (flags & COMPRESS_STORED_TILES)
+                compressedSize = std::min(compressedSize, uncompressedSize);
+
+            sampledSize += uncompressedSize;
+            sampledCompressedSize += compressedSize;
+        }
+
+        TileStream header(inSize, TileStream::GetTileSizeIdx(tileSize));
+        header.checksums = (flags & COMPRESS_TILE_CHECKSUMS) ? 1 : 0;
+
+        const double ratio = static_cast<double>(sampledCompressedSize) / sampledSize;
+
+        return header.GetDataOffset() + static_cast<size_t>(std::ceil(ratio * inSize));
+    }
+
+    bool Context::Compress(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        CompressionMonitor const* monitor)
+    {
+        return DoCompress(*m_executor, output, outputSize, nullptr, in, inSize, level, flags, nullptr, monitor);
+    }
+
+    bool Context::Compress(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        const Dictionary* dictionary)
+    {
+        return DoCompress(
+            *m_executor,
+            output,
+            outputSize,
+            nullptr,
+            in,
+            inSize,
+            level,
+            flags,
+            nullptr,
+            nullptr,
+            dictionary);
+    }
+
+    bool Context::Compress(
+        std::vector<uint8_t>& output,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        CompressionMonitor const* monitor)
+    {
+        return DoCompress(*m_executor, nullptr, nullptr, &output, in, inSize, level, flags, nullptr, monitor);
+    }
+
+    bool Context::CompressAdaptive(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        AdaptiveSettings const& settings,
+        CompressionMonitor const* monitor)
+    {
+        return DoCompress(*m_executor, output, outputSize, nullptr, in, inSize, level, flags, &settings, monitor);
+    }
+
+    bool Context::CompressBatch(
+        CompressDesc* streams,
+        size_t numStreams,
+        uint32_t level,
+        uint32_t flags,
+        StreamCompletedCallback completed)
+    {
+        return DoCompressBatch(*m_executor, streams, numStreams, level, flags, completed);
+    }
+
+    bool Compress(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        CompressionMonitor const* monitor)
+    {
+        return GetDefaultContext().Compress(output, outputSize, in, inSize, level, flags, monitor);
+    }
+
+    bool Compress(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        const Dictionary* dictionary)
+    {
+        return GetDefaultContext().Compress(output, outputSize, in, inSize, level, flags, dictionary);
+    }
+
+    bool Compress(
+        std::vector<uint8_t>& output,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        CompressionMonitor const* monitor)
+    {
+        return GetDefaultContext().Compress(output, in, inSize, level, flags, monitor);
+    }
+
+    bool CompressAdaptive(
+        uint8_t* output,
+        size_t* outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t level,
+        uint32_t flags,
+        AdaptiveSettings const& settings,
+        CompressionMonitor const* monitor)
+    {
+        return GetDefaultContext().CompressAdaptive(output, outputSize, in, inSize, level, flags, settings, monitor);
+    }
+
+    bool CompressBatch(
+        CompressDesc* streams,
+        size_t numStreams,
+        uint32_t level,
+        uint32_t flags,
+        StreamCompletedCallback completed)
     {
-        return DoCompress(output, outputSize, in, inSize, level, flags);
+        return GetDefaultContext().CompressBatch(streams, numStreams, level, flags, std::move(completed));
     }
 
 } // namespace GDeflate
@@ -0,0 +1,69 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GDeflate.h"
+#include "TaskQueue.h"
+#include "Topology.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace GDeflate
+{
+    static uint32_t GetDefaultNumWorkers()
+    {
+        const uint32_t numHardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        return numHardwareThreads - 1;
+    }
+
+    Context::Context()
+        : Context(GetDefaultNumWorkers())
+    {
+    }
+
+    Context::Context(uint32_t numWorkers)
+        : Context(numWorkers, WorkerPlacementSettings{})
+    {
+    }
+
+    Context::Context(uint32_t numWorkers, WorkerPlacementSettings const& placement)
+        : m_ownedExecutor(std::make_unique<WorkerPool>(numWorkers, GetWorkerAffinities(placement, numWorkers)))
+        , m_executor(m_ownedExecutor.get())
+        , m_asyncQueue(std::make_unique<TaskQueue>())
+    {
+    }
+
+    Context::Context(Executor& executor)
+        : m_executor(&executor)
+        , m_asyncQueue(std::make_unique<TaskQueue>())
+    {
+    }
+
+    Context::~Context() = default;
+
+    uint32_t Context::GetNumWorkers() const
+    {
+        return m_executor->GetNumThreads();
+    }
+
+    Context& GetDefaultContext()
+    {
+        static Context context;
+        return context;
+    }
+} // namespace GDeflate
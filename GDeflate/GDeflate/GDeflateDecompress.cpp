@@ -16,6 +16,10 @@
  * limitations under the License.
  */
 
+#include "GDeflate.h"
+#include "Crc32c.h"
+#include "TaskQueue.h"
+#include "TileDecoder.h"
 #include "TileStream.h"
 #include "Utils.h"
 
@@ -23,7 +27,11 @@
 
 #include <algorithm>
 #include <atomic>
-#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 template<>
 struct std::default_delete<libdeflate_gdeflate_decompressor>
@@ -36,7 +44,36 @@ struct std::default_delete<libdeflate_gdeflate_decompressor>
 
 namespace GDeflate
 {
-    static constexpr uint32_t kMaxWorkers = 31;
+    // A worker is only woken up if it can be given at least this much decoding time; below that the
+    // cost of handing out work outweighs the gain.
+    static constexpr uint64_t kMinNanosecondsPerWorker = 100 * 1000;
+
+    // Tiles are handed out in batches to keep workers from contending on the shared counter. Each
+    // worker still gets several batches so that uneven tiles balance out.
+    static constexpr uint32_t kMaxTilesPerBatch = 16;
+    static constexpr uint32_t kMinBatchesPerWorker = 4;
+
+    // Running estimate of the time it takes a single thread to decode 1 KiB of output. Starts out
+    // at roughly 1 GiB/s and is refined after every call. Updates from concurrent calls may race;
+    // the estimate only steers scheduling, so a lost update is harmless.
+    static std::atomic_uint32_t g_nanosecondsPerKiB{1000};
+
+    static std::atomic<TileDecoder> g_tileDecoder{TileDecoder::Auto};
+
+    static bool UseVectorTileDecoder()
+    {
+        switch (g_tileDecoder.load(std::memory_order_relaxed))
+        {
+        case TileDecoder::Libdeflate:
+            return false;
+
+        case TileDecoder::Vector:
+            return true;
+
+        default:
+            return HasVectorTileDecoder();
+        }
+    }
 
     static bool ValidateStream(const TileStream* header)
     {
@@ -52,119 +89,841 @@ namespace GDeflate
             return false;
         }
 
+        if (header->GetTileSize() == 0)
+        {
+            printf("Unsupported tile size index: %d\n", header->tileSizeIdx);
+            return false;
+        }
+
+        // Reserved bits are kept for features that change how tiles are decoded, so a stream that
+        // uses them can't be decoded correctly here.
+        if (header->reserved1 != 0)
+        {
+            printf("Unsupported stream features: 0x%x\n", header->reserved1);
+            return false;
+        }
+
         return true;
     }
 
-    struct DecompressionContext
+    struct StreamContext
     {
         const uint8_t* inputPtr;
         size_t inputSize;
 
+        const uint32_t* tileOffsets;
+        const uint32_t* tileChecksums; // nullptr if the stream has none
+        const uint8_t* inDataPtr;
+        size_t inDataSize;
+
+        uint32_t numTiles;
+        size_t tileSize;
+        size_t uncompressedSize;
+        const TileStream* header;
+
+        // The dictionary of a stream compressed with one, once it's known to match the stream's id.
+        const Dictionary* dictionary;
+
+        // Receives tile firstItem; the following tiles are laid out back to back.
         uint8_t* outputPtr;
         size_t outputSize;
+        bool outputWriteCombined;
 
-        std::atomic_uint32_t globalIndex;
+        uint32_t firstItem;
         uint32_t numItems;
 
         std::atomic_bool failed;
     };
 
-    static void TileDecompressionJob(DecompressionContext& context, uint32_t compressorId)
+    // Work is a flat list of tiles across all streams of a call; stream i owns the work items
+    // [streamStarts[i], streamStarts[i + 1]).
+    struct DecompressionContext
+    {
+        StreamContext* streams;
+        const uint32_t* streamStarts;
+        uint32_t numStreams;
+
+        uint32_t numItems;
+        uint32_t batchSize;
+
+        // Optional, for decompressions that report progress and can be canceled.
+        std::atomic_uint32_t* numItemsDone;
+        const std::atomic_bool* canceled;
+
+        // Kept on its own cache line, as every worker writes it for each batch and would
+        // otherwise keep evicting the read-only fields above.
+        alignas(64) std::atomic_uint32_t globalIndex;
+    };
+
+    // Returns a decompressor owned by the calling thread and kept for the lifetime of the thread.
+    static libdeflate_gdeflate_decompressor* GetThreadDecompressor()
+    {
+        static thread_local std::unique_ptr<libdeflate_gdeflate_decompressor> decompressor(
+            libdeflate_alloc_gdeflate_decompressor());
+
+        return decompressor.get();
+    }
+
+    // Returns a tile-sized buffer owned by the calling thread. Tiles never refer back to earlier
+    // tiles, so a single tile is all the history needed to decode one away from its destination.
+    static uint8_t* GetThreadScratchTile()
     {
-        std::unique_ptr<libdeflate_gdeflate_decompressor> decompressor(libdeflate_alloc_gdeflate_decompressor());
+        static thread_local std::unique_ptr<uint8_t[]> scratch(new uint8_t[kMaxTileSize]);
 
-        const uint32_t* tileOffsets = reinterpret_cast<const uint32_t*>(context.inputPtr + sizeof(TileStream));
-        const uint8_t* inDataPtr = reinterpret_cast<const uint8_t*>(tileOffsets + context.numItems);
+        return scratch.get();
+    }
+
+    static bool InitializeStream(
+        StreamContext& stream,
+        const uint8_t* in,
+        size_t inSize,
+        const Dictionary* dictionary = nullptr)
+    {
+        if (inSize < sizeof(TileStream))
+            return false;
+
+        auto header = reinterpret_cast<const TileStream*>(in);
+
+        if (!ValidateStream(header))
+            return false;
 
-        libdeflate_result decompressResult = LIBDEFLATE_SUCCESS;
-        while (true)
+        const size_t dataOffset = header->GetDataOffset();
+        if (header->numTiles == 0 || inSize < dataOffset)
+            return false;
+
+        stream.inputPtr = in;
+        stream.inputSize = inSize;
+
+        stream.tileOffsets = reinterpret_cast<const uint32_t*>(in + sizeof(TileStream));
+        stream.tileChecksums = header->checksums ? stream.tileOffsets + header->numTiles : nullptr;
+        stream.inDataPtr = in + dataOffset;
+        stream.inDataSize = inSize - dataOffset;
+
+        stream.numTiles = header->numTiles;
+        stream.tileSize = header->GetTileSize();
+        stream.uncompressedSize = header->GetUncompressedSize();
+        stream.header = header;
+
+        // Without the matching dictionary the stream can still be checked, but its tiles fail to
+        // decode
+        const bool hasDictionary = dictionary != nullptr && header->dictionaryId == dictionary->GetId();
+        stream.dictionary = header->dictionaryId != 0 && hasDictionary ? dictionary : nullptr;
+
+        stream.failed = false;
+
+        return true;
+    }
+
+    static size_t GetTileUncompressedSize(StreamContext const& stream, uint32_t tileIndex)
+    {
+        return std::min(stream.tileSize, stream.uncompressedSize - tileIndex * stream.tileSize);
+    }
+
+    // Streams that follow each other in a file can start at any offset, so table entries aren't
+    // necessarily aligned.
+    static uint32_t LoadTableEntry(const uint32_t* table, uint32_t index)
+    {
+        uint32_t value;
+        memcpy(&value, table + index, sizeof(value));
+        return value;
+    }
+
+    // Locates the data of a tile. Fails if the tile table points outside the stream or if the tile
+    // doesn't match its checksum.
+    static bool GetTileData(StreamContext const& stream, uint32_t tileIndex, const uint8_t*& data, size_t& size)
+    {
+        const size_t tileOffset = tileIndex > 0 ? LoadTableEntry(stream.tileOffsets, tileIndex) : 0;
+        const size_t tileSize = tileIndex < stream.numTiles - 1
+                                    ? LoadTableEntry(stream.tileOffsets, tileIndex + 1) - tileOffset
+                                    : LoadTableEntry(stream.tileOffsets, 0);
+
+        if (tileOffset > stream.inDataSize || tileSize > stream.inDataSize - tileOffset)
+            return false;
+
+        data = stream.inDataPtr + tileOffset;
+        size = tileSize;
+
+        if (stream.tileChecksums != nullptr && Crc32c(data, size) != LoadTableEntry(stream.tileChecksums, tileIndex))
         {
-            const uint32_t tileIndex = context.globalIndex.fetch_add(1, std::memory_order_relaxed);
+            printf("Checksum mismatch in tile %u\n", tileIndex);
+            return false;
+        }
 
-            if (tileIndex >= context.numItems)
-                break;
+        return true;
+    }
 
-            const size_t tileOffset = tileIndex > 0 ? tileOffsets[tileIndex] : 0;
-            libdeflate_gdeflate_in_page compressedPage{};
-            compressedPage.data = inDataPtr + tileOffset;
-            compressedPage.nbytes =
-                tileIndex < context.numItems - 1 ? tileOffsets[tileIndex + 1] - tileOffset : tileOffsets[0];
+    static bool DecompressTile(
+        libdeflate_gdeflate_decompressor* decompressor,
+        StreamContext const& stream,
+        uint32_t tileIndex,
+        uint8_t* output)
+    {
+        const uint8_t* tileData;
+        size_t tileSize;
 
-            auto outputOffset = tileIndex * kDefaultTileSize;
+        if (!GetTileData(stream, tileIndex, tileData, tileSize))
+            return false;
 
-            decompressResult = libdeflate_gdeflate_decompress(
-                decompressor.get(),
-                &compressedPage,
-                1,
-                context.outputPtr + outputOffset,
-                static_cast<size_t>(kDefaultTileSize),
-                nullptr);
+        const size_t uncompressedSize = GetTileUncompressedSize(stream, tileIndex);
 
-            if ( decompressResult != LIBDEFLATE_SUCCESS)
-            {
-                context.failed = true;
+        if (stream.header->IsStoredTile(tileSize, uncompressedSize))
+        {
+            memcpy(output, tileData, tileSize);
+            return true;
+        }
+
+        // libdeflate has no way to prime the window with a dictionary
+        if (stream.header->dictionaryId != 0)
+        {
+            if (stream.dictionary == nullptr)
+                return false;
+
+            return DecodeTile(
+                tileData,
+                tileSize,
+                output,
+                uncompressedSize,
+                stream.dictionary->GetData(),
+                stream.dictionary->GetSize());
+        }
+
+        if (UseVectorTileDecoder())
+            return DecodeTile(tileData, tileSize, output, uncompressedSize);
+
+        libdeflate_gdeflate_in_page compressedPage{};
+        compressedPage.data = tileData;
+        compressedPage.nbytes = tileSize;
+
+        libdeflate_result decompressResult = libdeflate_gdeflate_decompress(
+            decompressor,
+            &compressedPage,
+            1,
+            output,
+            uncompressedSize,
+            nullptr);
+
+        return decompressResult == LIBDEFLATE_SUCCESS;
+    }
+
+    static void TileDecompressionJob(DecompressionContext& context)
+    {
+        libdeflate_gdeflate_decompressor* decompressor = GetThreadDecompressor();
+
+        const auto start = std::chrono::steady_clock::now();
+        size_t numBytesDecoded = 0;
+
+        while (context.canceled == nullptr || !context.canceled->load(std::memory_order_relaxed))
+        {
+            const uint32_t firstIndex = context.globalIndex.fetch_add(context.batchSize, std::memory_order_relaxed);
+
+            if (firstIndex >= context.numItems)
                 break;
+
+            const uint32_t lastIndex = std::min(firstIndex + context.batchSize, context.numItems);
+
+            // A batch may span several streams; find the one holding its first tile and move
+            // forward from there.
+            const uint32_t* streamStartsEnd = context.streamStarts + context.numStreams + 1;
+            const uint32_t* nextStream = std::upper_bound(context.streamStarts, streamStartsEnd, firstIndex);
+            uint32_t streamIndex = static_cast<uint32_t>(nextStream - context.streamStarts) - 1;
+
+            for (uint32_t itemIndex = firstIndex; itemIndex < lastIndex; ++itemIndex)
+            {
+                while (itemIndex >= context.streamStarts[streamIndex + 1])
+                    ++streamIndex;
+
+                StreamContext& stream = context.streams[streamIndex];
+
+                // The rest of a stream that already failed is skipped.
+                if (stream.failed.load(std::memory_order_relaxed))
+                    continue;
+
+                const uint32_t streamItem = itemIndex - context.streamStarts[streamIndex];
+                const uint32_t tileIndex = stream.firstItem + streamItem;
+                auto outputOffset = streamItem * stream.tileSize;
+
+                uint8_t* tileOutput = stream.outputPtr + outputOffset;
+
+                // Decoding reads back its own output, which is very slow from write-combined
+                // memory; such tiles are decoded in cache and written out with streaming stores.
+                bool decoded;
+
+                if (stream.outputWriteCombined)
+                {
+                    uint8_t* scratch = GetThreadScratchTile();
+
+                    decoded = DecompressTile(decompressor, stream, tileIndex, scratch);
+                    if (decoded)
+                        StreamingCopy(tileOutput, scratch, GetTileUncompressedSize(stream, tileIndex));
+                }
+                else
+                {
+                    decoded = DecompressTile(decompressor, stream, tileIndex, tileOutput);
+                }
+
+                if (!decoded)
+                {
+                    stream.failed = true;
+                    continue;
+                }
+
+                numBytesDecoded += GetTileUncompressedSize(stream, tileIndex);
             }
+
+            if (context.numItemsDone != nullptr)
+                context.numItemsDone->fetch_add(lastIndex - firstIndex, std::memory_order_relaxed);
+        }
+
+        if (numBytesDecoded != 0)
+        {
+            const auto elapsed =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+            const int64_t sample = static_cast<int64_t>(elapsed.count() * 1024 / numBytesDecoded);
+            const int64_t estimate = g_nanosecondsPerKiB.load(std::memory_order_relaxed);
+
+            g_nanosecondsPerKiB.store(
+                static_cast<uint32_t>(std::max<int64_t>(1, estimate + (sample - estimate) / 8)),
+                std::memory_order_relaxed);
         }
     }
 
-    bool Decompress(uint8_t* output, size_t outputSize, const uint8_t* in, size_t inSize, uint32_t numWorkers)
+    // Picks how many threads to use for decoding numBytes spread over numTiles tiles, based on the
+    // measured decoding speed.
+    static uint32_t GetParallelism(size_t numBytes, uint32_t numTiles, uint32_t maxWorkers)
+    {
+        const uint64_t estimatedNanoseconds =
+            (static_cast<uint64_t>(numBytes) * g_nanosecondsPerKiB.load(std::memory_order_relaxed)) / 1024;
+
+        const uint64_t parallelism = std::max<uint64_t>(1, estimatedNanoseconds / kMinNanosecondsPerWorker);
+
+        return static_cast<uint32_t>(std::min<uint64_t>({parallelism, numTiles, maxWorkers}));
+    }
+
+    // Decodes the work items of the given streams, which must already have their firstItem and
+    // numItems set, using up to numWorkers threads.
+    static void RunDecompression(
+        Executor& executor,
+        StreamContext* streams,
+        uint32_t numStreams,
+        const uint32_t* streamStarts,
+        size_t numBytes,
+        uint32_t numWorkers,
+        std::atomic_uint32_t* numItemsDone = nullptr,
+        const std::atomic_bool* canceled = nullptr)
     {
-        if (nullptr == output || nullptr == in || 0 == outputSize || 0 == inSize)
+        DecompressionContext context{};
+
+        context.streams = streams;
+        context.streamStarts = streamStarts;
+        context.numStreams = numStreams;
+        context.numItems = streamStarts[numStreams];
+        context.numItemsDone = numItemsDone;
+        context.canceled = canceled;
+        context.globalIndex = 0;
+
+        if (context.numItems == 0)
+            return;
+
+        const uint32_t parallelism = GetParallelism(numBytes, context.numItems, std::max(1u, numWorkers));
+
+        context.batchSize = std::clamp(context.numItems / (parallelism * kMinBatchesPerWorker), 1u, kMaxTilesPerBatch);
+
+        executor.Run(parallelism, [&context]() { TileDecompressionJob(context); });
+    }
+
+    static bool DoDecompressTiles(
+        Executor& executor,
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t firstTile,
+        uint32_t numTiles,
+        uint32_t numWorkers,
+        const Dictionary* dictionary = nullptr)
+    {
+        if (nullptr == output || nullptr == in || 0 == outputSize || 0 == inSize || 0 == numTiles)
             return false;
 
-        numWorkers = std::min(kMaxWorkers, numWorkers);
-        numWorkers = std::max(1u, numWorkers);
+        StreamContext stream{};
 
-        auto header = reinterpret_cast<const TileStream*>(in);
+        if (!InitializeStream(stream, in, inSize, dictionary))
+            return false;
 
-        if (!ValidateStream(header))
+        if (firstTile >= stream.numTiles || numTiles > stream.numTiles - firstTile)
             return false;
 
-        std::thread workers[kMaxWorkers];
+        const size_t rangeStart = firstTile * stream.tileSize;
+        const size_t rangeEnd = std::min(stream.uncompressedSize, (firstTile + numTiles) * stream.tileSize);
 
-        // Run a tile per thread
-        header = reinterpret_cast<const TileStream*>(in);
+        if (outputSize < rangeEnd - rangeStart)
+            return false;
 
-        if (!ValidateStream(header))
+        stream.outputPtr = output;
+        stream.outputSize = outputSize;
+
+        stream.firstItem = firstTile;
+        stream.numItems = numTiles;
+
+        const uint32_t streamStarts[] = {0, numTiles};
+
+        RunDecompression(executor, &stream, 1, streamStarts, rangeEnd - rangeStart, numWorkers);
+
+        return (!stream.failed);
+    }
+
+    static bool DoDecompressRange(
+        Executor& executor,
+        uint8_t* output,
+        const uint8_t* in,
+        size_t inSize,
+        size_t offset,
+        size_t size,
+        uint32_t numWorkers)
+    {
+        if (nullptr == output || nullptr == in || 0 == size)
+            return false;
+
+        StreamContext stream{};
+
+        if (!InitializeStream(stream, in, inSize))
+            return false;
+
+        if (offset >= stream.uncompressedSize || size > stream.uncompressedSize - offset)
+            return false;
+
+        const size_t tileSize = stream.tileSize;
+        const size_t end = offset + size;
+        const uint32_t firstTile = static_cast<uint32_t>(offset / tileSize);
+        const uint32_t lastTile = static_cast<uint32_t>((end - 1) / tileSize);
+
+        // Tiles that the range covers completely are decoded straight into the output; the tiles
+        // at either end that are only partially covered go through a scratch tile.
+        const uint32_t firstFullTile = (offset % tileSize == 0) ? firstTile : firstTile + 1;
+        const uint32_t endFullTile = (end % tileSize == 0 || end == stream.uncompressedSize) ? lastTile + 1 : lastTile;
+
+        std::unique_ptr<uint8_t[]> scratch;
+
+        auto DecompressPartialTile = [&](uint32_t tileIndex)
         {
+            if (!scratch)
+                scratch.reset(new uint8_t[tileSize]);
+
+            if (!DecompressTile(GetThreadDecompressor(), stream, tileIndex, scratch.get()))
+                return false;
+
+            const size_t tileStart = tileIndex * tileSize;
+            const size_t copyStart = std::max(offset, tileStart);
+            const size_t copyEnd = std::min(end, tileStart + GetTileUncompressedSize(stream, tileIndex));
+
+            memcpy(output + (copyStart - offset), scratch.get() + (copyStart - tileStart), copyEnd - copyStart);
+
+            return true;
+        };
+
+        if (firstFullTile != firstTile && !DecompressPartialTile(firstTile))
             return false;
+
+        if (endFullTile <= lastTile && (lastTile != firstTile || firstFullTile == firstTile))
+        {
+            if (!DecompressPartialTile(lastTile))
+                return false;
         }
 
-        DecompressionContext context{};
+        if (firstFullTile < endFullTile)
+        {
+            const size_t fullStart = firstFullTile * tileSize;
+
+            return DoDecompressTiles(
+                executor,
+                output + (fullStart - offset),
+                end - fullStart,
+                in,
+                inSize,
+                firstFullTile,
+                endFullTile - firstFullTile,
+                numWorkers);
+        }
 
-        context.inputPtr = in;
-        context.inputSize = inSize;
+        return true;
+    }
 
-        context.outputPtr = output;
-        context.outputSize = header->GetUncompressedSize();
+    static bool DoDecompressBatch(Executor& executor, StreamDesc* streams, size_t numStreams, uint32_t numWorkers)
+    {
+        if (nullptr == streams || 0 == numStreams || numStreams >= UINT32_MAX)
+            return false;
 
-        context.globalIndex = 0;
-        context.numItems = header->numTiles;
+        std::unique_ptr<StreamContext[]> contexts(new StreamContext[numStreams]());
+        std::vector<uint32_t> streamStarts(numStreams + 1);
+
+        uint64_t numItems = 0;
+        size_t numBytes = 0;
+
+        for (size_t i = 0; i < numStreams; ++i)
+        {
+            StreamDesc& desc = streams[i];
+            StreamContext& stream = contexts[i];
+
+            streamStarts[i] = static_cast<uint32_t>(numItems);
+
+            desc.succeeded = nullptr != desc.input && nullptr != desc.output &&
+                             InitializeStream(stream, desc.input, desc.inputSize, desc.dictionary) &&
+                             desc.outputSize >= stream.uncompressedSize;
+
+            if (!desc.succeeded)
+                continue;
+
+            stream.outputPtr = desc.output;
+            stream.outputSize = desc.outputSize;
+            stream.outputWriteCombined = desc.outputWriteCombined;
+            stream.firstItem = 0;
+            stream.numItems = stream.numTiles;
+
+            // The work list is indexed with 32 bits. Nothing in the batch is decoded then, and
+            // every stream is reported as failed.
+            if (numItems + stream.numItems > UINT32_MAX)
+            {
+                for (size_t j = 0; j < numStreams; ++j)
+                    streams[j].succeeded = false;
+
+                return false;
+            }
+
+            numItems += stream.numItems;
+            numBytes += stream.uncompressedSize;
+        }
+
+        streamStarts[numStreams] = static_cast<uint32_t>(numItems);
 
-        context.failed = false;
+        RunDecompression(
+            executor,
+            contexts.get(),
+            static_cast<uint32_t>(numStreams),
+            streamStarts.data(),
+            numBytes,
+            numWorkers);
 
-        uint32_t numWorkersLeft = context.numItems > (2 * numWorkers) ? numWorkers : 1;
-        const uint32_t compressorId = header->id;
+        bool succeeded = true;
 
-        for (auto& worker : workers)
+        for (size_t i = 0; i < numStreams; ++i)
         {
-            if (numWorkersLeft == 1)
-                break;
+            if (streams[i].succeeded && contexts[i].failed)
+                streams[i].succeeded = false;
+
+            succeeded = succeeded && streams[i].succeeded;
+        }
+
+        return succeeded;
+    }
+
+    struct AsyncDecompression::State
+    {
+        uint32_t numTiles = 0;
+        std::atomic_uint32_t numTilesDone{0};
+        std::atomic_bool canceled{false};
+
+        std::atomic<AsyncStatus> status{AsyncStatus::Pending};
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        CompletionCallback callback;
+
+        void Finish(AsyncStatus finalStatus)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                status = finalStatus;
+            }
+
+            finished.notify_all();
+
+            if (callback)
+                callback(finalStatus);
+        }
+    };
+
+    AsyncDecompression::AsyncDecompression(std::shared_ptr<State> state)
+        : m_state(std::move(state))
+    {
+    }
+
+    AsyncStatus AsyncDecompression::GetStatus() const
+    {
+        return m_state ? m_state->status.load() : AsyncStatus::Failed;
+    }
+
+    AsyncStatus AsyncDecompression::Wait() const
+    {
+        if (!m_state)
+            return AsyncStatus::Failed;
+
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->finished.wait(lock, [this]() { return m_state->status != AsyncStatus::Pending; });
+
+        return m_state->status;
+    }
+
+    void AsyncDecompression::Cancel()
+    {
+        if (m_state)
+            m_state->canceled = true;
+    }
+
+    uint32_t AsyncDecompression::GetNumTiles() const
+    {
+        return m_state ? m_state->numTiles : 0;
+    }
+
+    uint32_t AsyncDecompression::GetNumTilesDone() const
+    {
+        return m_state ? m_state->numTilesDone.load(std::memory_order_relaxed) : 0;
+    }
 
-            worker = std::thread([&context, compressorId]() { TileDecompressionJob(context, compressorId); });
+    static AsyncDecompression DoDecompressAsync(
+        Executor& executor,
+        TaskQueue& queue,
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        CompletionCallback callback)
+    {
+        auto state = std::make_shared<AsyncDecompression::State>();
+        state->callback = std::move(callback);
 
-            --numWorkersLeft;
+        StreamContext stream{};
+
+        if (nullptr == output || nullptr == in || !InitializeStream(stream, in, inSize) ||
+            outputSize < stream.uncompressedSize)
+        {
+            state->Finish(AsyncStatus::Failed);
+            return AsyncDecompression(state);
         }
 
-        TileDecompressionJob(context, compressorId);
+        state->numTiles = stream.numTiles;
+
+        queue.Submit(
+            [&executor, state, output, outputSize, in, inSize, numWorkers]()
+            {
+                if (state->canceled)
+                {
+                    state->Finish(AsyncStatus::Canceled);
+                    return;
+                }
+
+                // The stream was validated when the request was made.
+                StreamContext stream{};
+                InitializeStream(stream, in, inSize);
+
+                stream.outputPtr = output;
+                stream.outputSize = outputSize;
+                stream.firstItem = 0;
+                stream.numItems = stream.numTiles;
+
+                const uint32_t streamStarts[] = {0, stream.numTiles};
+
+                RunDecompression(
+                    executor,
+                    &stream,
+                    1,
+                    streamStarts,
+                    stream.uncompressedSize,
+                    numWorkers,
+                    &state->numTilesDone,
+                    &state->canceled);
+
+                if (stream.failed)
+                    state->Finish(AsyncStatus::Failed);
+                else if (state->numTilesDone != state->numTiles)
+                    state->Finish(AsyncStatus::Canceled);
+                else
+                    state->Finish(AsyncStatus::Succeeded);
+            });
+
+        return AsyncDecompression(state);
+    }
+
+    static bool DoDecompress(
+        Executor& executor,
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        const Dictionary* dictionary = nullptr)
+    {
+        if (nullptr == in || inSize < sizeof(TileStream))
+            return false;
 
-        for (auto& worker : workers)
+        auto header = reinterpret_cast<const TileStream*>(in);
+
+        if (header->dictionaryId != 0 && (dictionary == nullptr || dictionary->GetId() != header->dictionaryId))
         {
-            if (worker.joinable())
-                worker.join();
+            printf("Stream needs dictionary %d\n", header->dictionaryId);
+            return false;
         }
 
-        return (!context.failed);
+        return DoDecompressTiles(
+            executor,
+            output,
+            outputSize,
+            in,
+            inSize,
+            0,
+            header->numTiles,
+            numWorkers,
+            dictionary);
+    }
+
+    void SetTileDecoder(TileDecoder decoder)
+    {
+        g_tileDecoder.store(decoder, std::memory_order_relaxed);
+    }
+
+    TileDecoder GetTileDecoder()
+    {
+        return g_tileDecoder.load(std::memory_order_relaxed);
+    }
+
+    bool VerifyStream(const uint8_t* in, size_t inSize)
+    {
+        if (nullptr == in)
+            return false;
+
+        StreamContext stream{};
+
+        if (!InitializeStream(stream, in, inSize))
+            return false;
+
+        for (uint32_t tileIndex = 0; tileIndex < stream.numTiles; ++tileIndex)
+        {
+            const uint8_t* tileData;
+            size_t tileSize;
+
+            if (!GetTileData(stream, tileIndex, tileData, tileSize))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool Context::Decompress(uint8_t* output, size_t outputSize, const uint8_t* in, size_t inSize, uint32_t numWorkers)
+    {
+        return DoDecompress(*m_executor, output, outputSize, in, inSize, numWorkers);
+    }
+
+    bool Context::Decompress(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        const Dictionary* dictionary)
+    {
+        return DoDecompress(*m_executor, output, outputSize, in, inSize, numWorkers, dictionary);
+    }
+
+    bool Context::DecompressTiles(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t firstTile,
+        uint32_t numTiles,
+        uint32_t numWorkers)
+    {
+        return DoDecompressTiles(*m_executor, output, outputSize, in, inSize, firstTile, numTiles, numWorkers);
+    }
+
+    bool Context::DecompressRange(
+        uint8_t* output,
+        const uint8_t* in,
+        size_t inSize,
+        size_t offset,
+        size_t size,
+        uint32_t numWorkers)
+    {
+        return DoDecompressRange(*m_executor, output, in, inSize, offset, size, numWorkers);
+    }
+
+    bool Context::DecompressBatch(StreamDesc* streams, size_t numStreams, uint32_t numWorkers)
+    {
+        return DoDecompressBatch(*m_executor, streams, numStreams, numWorkers);
+    }
+
+    AsyncDecompression Context::DecompressAsync(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        CompletionCallback callback)
+    {
+        return DoDecompressAsync(
+            *m_executor,
+            *m_asyncQueue,
+            output,
+            outputSize,
+            in,
+            inSize,
+            numWorkers,
+            std::move(callback));
+    }
+
+    bool Decompress(uint8_t* output, size_t outputSize, const uint8_t* in, size_t inSize, uint32_t numWorkers)
+    {
+        return GetDefaultContext().Decompress(output, outputSize, in, inSize, numWorkers);
+    }
+
+    bool Decompress(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        const Dictionary* dictionary)
+    {
+        return GetDefaultContext().Decompress(output, outputSize, in, inSize, numWorkers, dictionary);
+    }
+
+    bool DecompressTiles(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t firstTile,
+        uint32_t numTiles,
+        uint32_t numWorkers)
+    {
+        return GetDefaultContext().DecompressTiles(output, outputSize, in, inSize, firstTile, numTiles, numWorkers);
+    }
+
+    bool DecompressRange(
+        uint8_t* output,
+        const uint8_t* in,
+        size_t inSize,
+        size_t offset,
+        size_t size,
+        uint32_t numWorkers)
+    {
+        return GetDefaultContext().DecompressRange(output, in, inSize, offset, size, numWorkers);
+    }
+
+    bool DecompressBatch(StreamDesc* streams, size_t numStreams, uint32_t numWorkers)
+    {
+        return GetDefaultContext().DecompressBatch(streams, numStreams, numWorkers);
+    }
+
+    AsyncDecompression DecompressAsync(
+        uint8_t* output,
+        size_t outputSize,
+        const uint8_t* in,
+        size_t inSize,
+        uint32_t numWorkers,
+        CompletionCallback callback)
+    {
+        return GetDefaultContext().DecompressAsync(output, outputSize, in, inSize, numWorkers, std::move(callback));
     }
 } // namespace GDeflate
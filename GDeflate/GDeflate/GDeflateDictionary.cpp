@@ -0,0 +1,155 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GDeflate.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace GDeflate
+{
+    // Samples are compared by the substrings of kDmerSize bytes they have in common, and the
+    // dictionary is put together from segments of kSegmentSize bytes.
+    static constexpr size_t kDmerSize = 8;
+    static constexpr size_t kSegmentSize = 64;
+    static constexpr uint32_t kDmerHashBits = 20;
+
+    static uint32_t HashDmer(const uint8_t* p)
+    {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+
+        return static_cast<uint32_t>((value * 0x9e3779b97f4a7c15ull) >> (64 - kDmerHashBits));
+    }
+
+    Dictionary::Dictionary(uint8_t id, const uint8_t* data, size_t size)
+        : m_id(id)
+        , m_data(data, data + std::min(size, kMaxSize))
+    {
+    }
+
+    // A cut-down COVER, as in zstd's dictionary builder. Each dmer scores the number of samples it
+    // occurs in, less the one it came from, and the samples are split into even epochs, one per
+    // segment of the dictionary. Each epoch gives the segment with the highest score, and the dmers
+    // of a chosen segment score nothing from then on, so the segments don't repeat each other.
+    Dictionary Dictionary::Train(
+        uint8_t id,
+        const uint8_t* const* samples,
+        const size_t* sampleSizes,
+        size_t numSamples,
+        size_t maxSize)
+    {
+        maxSize = std::min(maxSize, kMaxSize);
+
+        std::vector<uint32_t> scores(size_t(1) << kDmerHashBits, 0);
+        std::vector<uint32_t> lastSample(scores.size(), 0);
+        size_t totalSize = 0;
+
+        for (size_t s = 0; s < numSamples; ++s)
+        {
+            totalSize += sampleSizes[s];
+
+            for (size_t pos = 0; pos + kDmerSize <= sampleSizes[s]; ++pos)
+            {
+                const uint32_t hash = HashDmer(samples[s] + pos);
+                if (lastSample[hash] == s + 1)
+                    continue;
+
+                if (lastSample[hash] != 0)
+                    scores[hash]++;
+
+                lastSample[hash] = static_cast<uint32_t>(s + 1);
+            }
+        }
+
+        struct Segment
+        {
+            const uint8_t* data;
+            uint64_t score;
+        };
+
+        std::vector<Segment> segments;
+        const size_t numEpochs = std::max<size_t>(1, std::min(maxSize, totalSize) / kSegmentSize);
+        const size_t epochSize = std::max(kSegmentSize, totalSize / numEpochs);
+
+        // Epochs run over the samples as if they were one buffer, but segments never straddle two
+        size_t sample = 0;
+        size_t sampleStart = 0;
+
+        for (size_t epochStart = 0; epochStart < totalSize; epochStart += epochSize)
+        {
+            const size_t epochEnd = std::min(totalSize, epochStart + epochSize);
+            Segment best = {nullptr, 0};
+
+            while (sample < numSamples && sampleStart + sampleSizes[sample] <= epochStart)
+                sampleStart += sampleSizes[sample++];
+
+            for (size_t s = sample, start = sampleStart; s < numSamples && start < epochEnd;
+                 start += sampleSizes[s++])
+            {
+                const size_t first = std::max(epochStart, start) - start;
+                const size_t last = std::min(epochEnd, start + sampleSizes[s]) - start;
+                if (last - first < kSegmentSize)
+                    continue;
+
+                // A sliding sum over the dmers that start in the segment
+                const uint8_t* data = samples[s];
+                const size_t numDmers = kSegmentSize - kDmerSize + 1;
+                uint64_t score = 0;
+
+                for (size_t pos = first; pos < first + numDmers; ++pos)
+                    score += scores[HashDmer(data + pos)];
+
+                for (size_t pos = first;; ++pos)
+                {
+                    if (score > best.score)
+                        best = {data + pos, score};
+
+                    if (pos + kSegmentSize >= last)
+                        break;
+
+                    score -= scores[HashDmer(data + pos)];
+                    score += scores[HashDmer(data + pos + numDmers)];
+                }
+            }
+
+            if (best.data == nullptr)
+                continue;
+
+            segments.push_back(best);
+
+            for (size_t pos = 0; pos + kDmerSize <= kSegmentSize; ++pos)
+                scores[HashDmer(best.data + pos)] = 0;
+        }
+
+        // The best segments go last, and what doesn't fit is dropped from the front
+        std::stable_sort(
+            segments.begin(),
+            segments.end(),
+            [](Segment const& a, Segment const& b) { return a.score < b.score; });
+
+        const size_t numSegments = std::min(segments.size(), maxSize / kSegmentSize);
+        std::vector<uint8_t> data;
+        data.reserve(numSegments * kSegmentSize);
+
+        for (size_t i = segments.size() - numSegments; i < segments.size(); ++i)
+            data.insert(data.end(), segments[i].data, segments[i].data + kSegmentSize);
+
+        return Dictionary(id, data.data(), data.size());
+    }
+} // namespace GDeflate
@@ -0,0 +1,365 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GDeflate.h"
+#include "TileStream.h"
+#include "config.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <system_error>
+
+namespace GDeflate
+{
+    // A file mapped into memory in its entirety. Files created for writing are sized up front and
+    // can be truncated to their final size when closed.
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator=(MappedFile const&) = delete;
+
+        ~MappedFile()
+        {
+            Close(m_size);
+        }
+
+        bool OpenRead(std::filesystem::path const& path)
+        {
+#ifdef _WIN32
+            m_file = CreateFileW(
+                path.c_str(),
+                GENERIC_READ,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+
+            LARGE_INTEGER size{};
+            if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+                return false;
+
+            m_size = static_cast<size_t>(size.QuadPart);
+#else
+            m_file = open(path.c_str(), O_RDONLY);
+
+            struct stat info
+            {
+            };
+            if (m_file < 0 || fstat(m_file, &info) != 0 || info.st_size == 0)
+                return false;
+
+            m_size = static_cast<size_t>(info.st_size);
+#endif
+            return Map(false);
+        }
+
+        bool Create(std::filesystem::path const& path, size_t size)
+        {
+            if (size == 0)
+                return false;
+
+#ifdef _WIN32
+            m_file = CreateFileW(
+                path.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+
+            if (m_file == INVALID_HANDLE_VALUE)
+                return false;
+#else
+            m_file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+            if (m_file < 0 || ftruncate(m_file, static_cast<off_t>(size)) != 0)
+                return false;
+#endif
+            m_size = size;
+            m_writable = true;
+
+            return Map(true);
+        }
+
+        // Unmaps and closes the file. Files created for writing are truncated to finalSize first.
+        bool Close(size_t finalSize)
+        {
+            bool succeeded = true;
+
+#ifdef _WIN32
+            if (m_data != nullptr)
+                UnmapViewOfFile(m_data);
+
+            if (m_mapping != nullptr)
+                CloseHandle(m_mapping);
+
+            if (m_file != INVALID_HANDLE_VALUE)
+            {
+                if (m_writable)
+                {
+                    LARGE_INTEGER size{};
+                    size.QuadPart = static_cast<LONGLONG>(finalSize);
+
+                    succeeded = SetFilePointerEx(m_file, size, nullptr, FILE_BEGIN) && SetEndOfFile(m_file);
+                }
+
+                CloseHandle(m_file);
+            }
+
+            m_mapping = nullptr;
+            m_file = INVALID_HANDLE_VALUE;
+#else
+            if (m_data != nullptr)
+                munmap(m_data, m_size);
+
+            if (m_file >= 0)
+            {
+                if (m_writable)
+                    succeeded = ftruncate(m_file, static_cast<off_t>(finalSize)) == 0;
+
+                close(m_file);
+            }
+
+            m_file = -1;
+#endif
+            m_data = nullptr;
+            m_size = 0;
+            m_writable = false;
+
+            return succeeded;
+        }
+
+        uint8_t* GetData() const
+        {
+            return m_data;
+        }
+
+        size_t GetSize() const
+        {
+            return m_size;
+        }
+
+    private:
+        bool Map(bool writable)
+        {
+#ifdef _WIN32
+            ULARGE_INTEGER size{};
+            size.QuadPart = m_size;
+
+            m_mapping = CreateFileMappingW(
+                m_file,
+                nullptr,
+                writable ? PAGE_READWRITE : PAGE_READONLY,
+                size.HighPart,
+                size.LowPart,
+                nullptr);
+
+            if (m_mapping == nullptr)
+                return false;
+
+            const DWORD access = writable ? FILE_MAP_WRITE : FILE_MAP_READ;
+
+            m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, access, 0, 0, 0));
+#else
+            void* data = mmap(nullptr, m_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m_file, 0);
+
+            m_data = data != MAP_FAILED ? static_cast<uint8_t*>(data) : nullptr;
+#endif
+            return m_data != nullptr;
+        }
+
+#ifdef _WIN32
+        HANDLE m_file = INVALID_HANDLE_VALUE;
+        HANDLE m_mapping = nullptr;
+#else
+        int m_file = -1;
+#endif
+        uint8_t* m_data = nullptr;
+        size_t m_size = 0;
+        bool m_writable = false;
+    };
+
+    static bool DoCompressFile(
+        Context& context,
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t level,
+        uint32_t flags)
+    {
+        const size_t tileSize = GetTileSize(flags);
+        if (tileSize == 0)
+            return false;
+
+        MappedFile input;
+        if (!input.OpenRead(inputPath))
+            return false;
+
+        // The input is split into streams of the largest size a TileStream can hold, each of which
+        // is compressed straight into its place in the mapped output.
+        const size_t streamSize = tileSize * TileStream::kMaxTiles;
+        const size_t numStreams = (input.GetSize() + streamSize - 1) / streamSize;
+
+        size_t outputBound = 0;
+        for (size_t i = 0; i < numStreams; ++i)
+            outputBound += CompressBound(std::min(streamSize, input.GetSize() - i * streamSize), flags);
+
+        MappedFile output;
+        bool succeeded = output.Create(outputPath, outputBound);
+
+        size_t outputPos = 0;
+
+        for (size_t i = 0; succeeded && i < numStreams; ++i)
+        {
+            const size_t inputPos = i * streamSize;
+            size_t outputSize = outputBound - outputPos;
+
+            succeeded = context.Compress(
+                output.GetData() + outputPos,
+                &outputSize,
+                input.GetData() + inputPos,
+                std::min(streamSize, input.GetSize() - inputPos),
+                level,
+                flags);
+
+            outputPos += outputSize;
+        }
+
+        succeeded = output.Close(outputPos) && succeeded;
+
+        if (!succeeded)
+        {
+            std::error_code ec;
+            std::filesystem::remove(outputPath, ec);
+        }
+
+        return succeeded;
+    }
+
+    static bool DoDecompressFile(
+        Context& context,
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t numWorkers)
+    {
+        MappedFile input;
+        if (!input.OpenRead(inputPath))
+            return false;
+
+        std::vector<StreamDesc> streams;
+        size_t outputSize = 0;
+
+        for (size_t inputPos = 0; inputPos < input.GetSize();)
+        {
+            const uint8_t* in = input.GetData() + inputPos;
+            const size_t inSize = GetCompressedSize(in, input.GetSize() - inputPos);
+
+            if (inSize == 0)
+                return false;
+
+            TileStream header(0);
+            memcpy(&header, in, sizeof(header));
+
+            StreamDesc stream;
+            stream.input = in;
+            stream.inputSize = inSize;
+            stream.outputSize = header.GetUncompressedSize();
+            streams.push_back(stream);
+
+            inputPos += inSize;
+            outputSize += stream.outputSize;
+        }
+
+        MappedFile output;
+        bool succeeded = output.Create(outputPath, outputSize);
+
+        if (succeeded)
+        {
+            uint8_t* outputPtr = output.GetData();
+            for (auto& stream : streams)
+            {
+                stream.output = outputPtr;
+                outputPtr += stream.outputSize;
+            }
+
+            succeeded = context.DecompressBatch(streams.data(), streams.size(), numWorkers);
+        }
+
+        succeeded = output.Close(outputSize) && succeeded;
+
+        if (!succeeded)
+        {
+            std::error_code ec;
+            std::filesystem::remove(outputPath, ec);
+        }
+
+        return succeeded;
+    }
+
+    bool Context::CompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t level,
+        uint32_t flags)
+    {
+        return DoCompressFile(*this, inputPath, outputPath, level, flags);
+    }
+
+    bool Context::DecompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t numWorkers)
+    {
+        return DoDecompressFile(*this, inputPath, outputPath, numWorkers);
+    }
+
+    bool CompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t level,
+        uint32_t flags)
+    {
+        return GetDefaultContext().CompressFile(inputPath, outputPath, level, flags);
+    }
+
+    bool DecompressFile(
+        std::filesystem::path const& inputPath,
+        std::filesystem::path const& outputPath,
+        uint32_t numWorkers)
+    {
+        return GetDefaultContext().DecompressFile(inputPath, outputPath, numWorkers);
+    }
+} // namespace GDeflate
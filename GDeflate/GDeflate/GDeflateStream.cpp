@@ -0,0 +1,168 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GDeflate.h"
+#include "TileStream.h"
+#include "config.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace GDeflate
+{
+    // Matches the number of tiles per worker at which Compress starts using another thread.
+    static constexpr uint32_t kDefaultTilesPerWorker = 64;
+
+    StreamCompressor::StreamCompressor(Context& context)
+        : m_context(context)
+    {
+    }
+
+    bool StreamCompressor::BeginStream(uint32_t level, uint32_t flags, WriteFunction write, uint32_t tilesPerStream)
+    {
+        const size_t tileSize = GetTileSize(flags);
+
+        if (m_active || !write || tileSize == 0)
+            return false;
+
+        if (tilesPerStream == 0)
+            tilesPerStream = (m_context.GetNumWorkers() + 1) * kDefaultTilesPerWorker;
+
+        tilesPerStream = std::min<uint32_t>(tilesPerStream, TileStream::kMaxTiles);
+
+        m_write = std::move(write);
+        m_level = level;
+        m_flags = flags;
+        m_segmentSize = tilesPerStream * tileSize;
+        m_uncompressedSize = 0;
+        m_compressedSize = 0;
+
+        m_pending.clear();
+        m_pending.reserve(m_segmentSize);
+        m_output.resize(CompressBound(m_segmentSize, flags));
+
+        m_active = true;
+
+        return true;
+    }
+
+    bool StreamCompressor::AppendTiles(const uint8_t* in, size_t inSize)
+    {
+        if (!m_active || (in == nullptr && inSize != 0))
+            return false;
+
+        while (inSize > 0)
+        {
+            // Whole segments that don't need to be stitched to earlier input are compressed
+            // straight from the caller's memory.
+            if (m_pending.empty() && inSize >= m_segmentSize)
+            {
+                if (!CompressSegment(in, m_segmentSize))
+                    return false;
+
+                in += m_segmentSize;
+                inSize -= m_segmentSize;
+                continue;
+            }
+
+            const size_t numBytes = std::min(inSize, m_segmentSize - m_pending.size());
+            m_pending.insert(m_pending.end(), in, in + numBytes);
+
+            in += numBytes;
+            inSize -= numBytes;
+
+            if (m_pending.size() == m_segmentSize)
+            {
+                if (!CompressSegment(m_pending.data(), m_pending.size()))
+                    return false;
+
+                m_pending.clear();
+            }
+        }
+
+        return true;
+    }
+
+    bool StreamCompressor::Finish()
+    {
+        if (!m_active)
+            return false;
+
+        bool result = true;
+
+        if (!m_pending.empty())
+        {
+            result = CompressSegment(m_pending.data(), m_pending.size());
+            m_pending.clear();
+        }
+
+        m_active = false;
+        m_write = nullptr;
+
+        return result;
+    }
+
+    bool StreamCompressor::CompressSegment(const uint8_t* in, size_t inSize)
+    {
+        size_t outputSize = m_output.size();
+
+        if (!m_context.Compress(m_output.data(), &outputSize, in, inSize, m_level, m_flags) ||
+            !m_write(m_output.data(), outputSize))
+        {
+            m_active = false;
+            m_write = nullptr;
+            return false;
+        }
+
+        m_uncompressedSize += inSize;
+        m_compressedSize += outputSize;
+
+        return true;
+    }
+
+    size_t GetCompressedSize(const uint8_t* in, size_t inSize)
+    {
+        if (in == nullptr || inSize < sizeof(TileStream))
+            return 0;
+
+        TileStream header(0);
+        memcpy(&header, in, sizeof(header));
+
+        if (!header.IsValid() || header.id != kGDeflateId || header.GetTileSize() == 0 || header.numTiles == 0)
+            return 0;
+
+        const size_t dataOffset = header.GetDataOffset();
+        if (inSize < dataOffset)
+            return 0;
+
+        // The first entry holds the size of the last tile, every other entry is a tile offset.
+        uint32_t lastTileSize = 0;
+        uint32_t lastTileOffset = 0;
+        memcpy(&lastTileSize, in + sizeof(TileStream), sizeof(uint32_t));
+
+        if (header.numTiles > 1)
+        {
+            const size_t lastEntryOffset = sizeof(TileStream) + (header.numTiles - 1) * sizeof(uint32_t);
+            memcpy(&lastTileOffset, in + lastEntryOffset, sizeof(uint32_t));
+        }
+
+        const size_t compressedSize = dataOffset + lastTileOffset + lastTileSize;
+
+        return compressedSize <= inSize ? compressedSize : 0;
+    }
+} // namespace GDeflate
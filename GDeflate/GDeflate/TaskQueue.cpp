@@ -0,0 +1,67 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TaskQueue.h"
+
+namespace GDeflate
+{
+    TaskQueue::~TaskQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+
+        m_wake.notify_one();
+
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    void TaskQueue::Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+
+            if (!m_thread.joinable())
+                m_thread = std::thread([this]() { ThreadLoop(); });
+        }
+
+        m_wake.notify_one();
+    }
+
+    void TaskQueue::ThreadLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (true)
+        {
+            m_wake.wait(lock, [this]() { return m_exit || !m_tasks.empty(); });
+
+            if (m_tasks.empty())
+                break;
+
+            std::function<void()> task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+} // namespace GDeflate
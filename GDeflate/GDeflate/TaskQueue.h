@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace GDeflate
+{
+    // A background thread that runs submitted tasks one after another, in submission order. The
+    // thread is only started once the first task is submitted. Tasks that are still queued when
+    // the queue is destroyed are run before it returns.
+    class TaskQueue
+    {
+    public:
+        TaskQueue() = default;
+        ~TaskQueue();
+
+        TaskQueue(TaskQueue const&) = delete;
+        TaskQueue& operator=(TaskQueue const&) = delete;
+
+        void Submit(std::function<void()> task);
+
+    private:
+        void ThreadLoop();
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<std::function<void()>> m_tasks;
+        std::thread m_thread;
+        bool m_exit = false;
+    };
+} // namespace GDeflate
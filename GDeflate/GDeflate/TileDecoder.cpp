@@ -0,0 +1,1008 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TileDecoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define GDEFLATE_HAS_X86_LANES 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GDEFLATE_TARGET_AVX2
+#define GDEFLATE_TARGET_AVX512
+#else
+#define GDEFLATE_TARGET_AVX2 __attribute__((target("avx2")))
+#define GDEFLATE_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GDEFLATE_HAS_NEON_LANES 1
+#include <arm_neon.h>
+#endif
+
+namespace GDeflate
+{
+    static constexpr uint32_t kNumLanes = 32; // GDeflate interleaves 32 bitstreams, one per lane
+
+    // Symbols are looked up with the next kTableBits bits of a lane. Longer codes, up to the 15 bits
+    // of the format, continue in a subtable.
+    static constexpr uint32_t kTableBits = 10;
+    static constexpr uint32_t kMaxCodeLength = 15;
+    static constexpr uint32_t kSubtableSize = 1 << (kMaxCodeLength - kTableBits);
+
+    static constexpr uint32_t kNumLitLenSymbols = 288;
+    static constexpr uint32_t kNumDistanceSymbols = 32;
+    static constexpr uint32_t kNumCodeLengthSymbols = 19;
+
+    static constexpr uint32_t kLitLenTableSize = (1 << kTableBits) + kNumLitLenSymbols * kSubtableSize;
+    static constexpr uint32_t kDistanceTableSize = (1 << kTableBits) + kNumDistanceSymbols * kSubtableSize;
+
+    // A table entry is len:4, bits:5, kind:2, symbol:5, base:16. bits is the length of the code and
+    // its extra bits, and the symbol decodes to base plus the extra bits. An entry with a len of 0
+    // points to a subtable at base, indexed with the next bits bits after the first kTableBits.
+    enum SymbolKind : uint32_t
+    {
+        kLiteral = 0, // Also every distance and code length symbol
+        kLength = 1,
+        kEndOfBlock = 2,
+        kInvalid = 3,
+    };
+
+    static constexpr uint32_t MakeEntry(uint32_t extraBits, SymbolKind kind, uint32_t symbol, uint32_t base)
+    {
+        return (extraBits << 4) | (kind << 9) | (symbol << 11) | (base << 16);
+    }
+
+    // Codes that aren't part of the code decode to this, and fail the tile
+    static constexpr uint32_t kInvalidEntry = MakeEntry(0, kInvalid, 0, 0) + 1 + (1 << 4);
+
+    static inline uint32_t EntryLength(uint32_t entry)
+    {
+        return entry & 15;
+    }
+
+    static inline uint32_t EntryBits(uint32_t entry)
+    {
+        return (entry >> 4) & 31;
+    }
+
+    static inline uint32_t EntryKind(uint32_t entry)
+    {
+        return (entry >> 9) & 3;
+    }
+
+    static inline uint32_t EntrySymbol(uint32_t entry)
+    {
+        return (entry >> 11) & 31;
+    }
+
+    static inline uint32_t Mask(uint32_t n)
+    {
+        return n >= 32 ? ~0u : (1u << n) - 1;
+    }
+
+    static inline uint32_t CountTrailingZeros(uint32_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return index;
+#else
+        return __builtin_ctz(value);
+#endif
+    }
+
+    // The length and distance tables follow Deflate64: symbol 285 takes 16 extra bits, and the
+    // distance codes 30 and 31 reach 64 KiB back.
+    static constexpr uint32_t kLengthBase[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                               31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 3};
+    static constexpr uint32_t kLengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 16};
+
+    static constexpr uint32_t kDistanceBase[] = {1,    2,    3,    4,    5,    7,     9,     13,    17,    25,   33,
+                                                 49,   65,   97,   129,  193,  257,   385,   513,   769,   1025, 1537,
+                                                 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32769, 49153};
+    static constexpr uint32_t kDistanceExtra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,  6,
+                                                  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14};
+
+    // The order that the first lanes read the code length code lengths in, from RFC 1951, 3.2.7
+    static constexpr uint8_t kCodeLengthOrder[kNumCodeLengthSymbols] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    // Entries without their code length, which BuildTable adds
+    static constexpr std::array<uint32_t, kNumLitLenSymbols> MakeLitLenTemplates()
+    {
+        std::array<uint32_t, kNumLitLenSymbols> templates{};
+
+        for (uint32_t sym = 0; sym < kNumLitLenSymbols; ++sym)
+        {
+            if (sym < 256)
+                templates[sym] = MakeEntry(0, kLiteral, 0, sym);
+            else if (sym == 256)
+                templates[sym] = MakeEntry(0, kEndOfBlock, 0, 0);
+            else if (sym < 286)
+                templates[sym] = MakeEntry(kLengthExtra[sym - 257], kLength, 0, kLengthBase[sym - 257]);
+            else
+                templates[sym] = MakeEntry(0, kInvalid, 0, 0);
+        }
+
+        return templates;
+    }
+
+    static constexpr std::array<uint32_t, kNumDistanceSymbols> MakeDistanceTemplates()
+    {
+        std::array<uint32_t, kNumDistanceSymbols> templates{};
+
+        for (uint32_t sym = 0; sym < kNumDistanceSymbols; ++sym)
+            templates[sym] = MakeEntry(kDistanceExtra[sym], kLiteral, 0, kDistanceBase[sym]);
+
+        return templates;
+    }
+
+    // Code length symbols decode to their repeat count
+    static constexpr std::array<uint32_t, kNumCodeLengthSymbols> MakeCodeLengthTemplates()
+    {
+        std::array<uint32_t, kNumCodeLengthSymbols> templates{};
+
+        for (uint32_t sym = 0; sym < 16; ++sym)
+            templates[sym] = MakeEntry(0, kLiteral, sym, 1);
+
+        templates[16] = MakeEntry(2, kLiteral, 16, 3);
+        templates[17] = MakeEntry(3, kLiteral, 17, 3);
+        templates[18] = MakeEntry(7, kLiteral, 18, 11);
+
+        return templates;
+    }
+
+    static constexpr std::array<uint32_t, kNumLitLenSymbols> kLitLenTemplates = MakeLitLenTemplates();
+    static constexpr std::array<uint32_t, kNumDistanceSymbols> kDistanceTemplates = MakeDistanceTemplates();
+    static constexpr std::array<uint32_t, kNumCodeLengthSymbols> kCodeLengthTemplates = MakeCodeLengthTemplates();
+
+    static uint32_t ReverseBits(uint32_t code, uint32_t length)
+    {
+        uint32_t reversed = 0;
+        for (uint32_t i = 0; i < length; ++i, code >>= 1)
+            reversed = (reversed << 1) | (code & 1);
+
+        return reversed;
+    }
+
+    // Builds the lookup table of the canonical code with the given code lengths. Fails if the
+    // lengths are oversubscribed; codes left unused by an incomplete code decode as invalid.
+    static bool BuildTable(const uint8_t* lengths, uint32_t numSymbols, const uint32_t* templates, uint32_t* table)
+    {
+        uint32_t counts[kMaxCodeLength + 1] = {};
+        for (uint32_t sym = 0; sym < numSymbols; ++sym)
+            counts[lengths[sym]]++;
+
+        int32_t left = 1;
+        uint32_t maxLength = 0;
+        for (uint32_t len = 1; len <= kMaxCodeLength; ++len)
+        {
+            left = (left << 1) - counts[len];
+            if (left < 0)
+                return false;
+
+            if (counts[len] != 0)
+                maxLength = len;
+        }
+
+        uint32_t nextCode[kMaxCodeLength + 1];
+        uint32_t code = 0;
+        counts[0] = 0;
+        for (uint32_t len = 1; len <= kMaxCodeLength; ++len)
+        {
+            code = (code + counts[len - 1]) << 1;
+            nextCode[len] = code;
+        }
+
+        for (uint32_t i = 0; i < (1u << kTableBits); ++i)
+            table[i] = kInvalidEntry;
+
+        const uint32_t subtableBits = maxLength > kTableBits ? maxLength - kTableBits : 0;
+        uint32_t nextSubtable = 1 << kTableBits;
+
+        for (uint32_t sym = 0; sym < numSymbols; ++sym)
+        {
+            const uint32_t len = lengths[sym];
+            if (len == 0)
+                continue;
+
+            const uint32_t reversed = ReverseBits(nextCode[len]++, len);
+            const uint32_t entry = templates[sym] + len + (len << 4);
+
+            if (len <= kTableBits)
+            {
+                for (uint32_t i = reversed; i < (1u << kTableBits); i += 1u << len)
+                    table[i] = entry;
+                continue;
+            }
+
+            uint32_t& pointer = table[reversed & Mask(kTableBits)];
+            if (EntryLength(pointer) != 0)
+            {
+                for (uint32_t i = 0; i < (1u << subtableBits); ++i)
+                    table[nextSubtable + i] = kInvalidEntry;
+
+                pointer = (nextSubtable << 16) | (subtableBits << 4);
+                nextSubtable += 1 << subtableBits;
+            }
+
+            uint32_t* subtable = table + (pointer >> 16);
+            for (uint32_t i = reversed >> kTableBits; i < (1u << subtableBits); i += 1u << (len - kTableBits))
+                subtable[i] = entry;
+        }
+
+        return true;
+    }
+
+    // The bit buffers of the 32 lanes. Each holds at least 32 bits whenever a symbol is looked up,
+    // as in the BitReader of GDeflate.hlsl.
+    struct alignas(64) LaneBits
+    {
+        uint32_t lo[kNumLanes]; // The next 32 bits, LSB first
+        uint32_t hi[kNumLanes]; // The bits after those
+        uint32_t cnt[kNumLanes];
+    };
+
+    // Looks up the next symbol of every lane in table + offsets[lane], returning its entry and the
+    // value it decodes to.
+    using LookupFunction = void (*)(
+        LaneBits const& bits,
+        const uint32_t* table,
+        const uint32_t* offsets,
+        uint32_t* entries,
+        uint32_t* values);
+
+    // Removes EntryBits(entries[lane]) bits from each lane in lanes, and returns the lanes that
+    // are left with fewer than 32 bits.
+    using ConsumeFunction = uint32_t (*)(LaneBits& bits, const uint32_t* entries, uint32_t lanes);
+
+    struct LaneKernels
+    {
+        LookupFunction lookup;
+        ConsumeFunction consume;
+        const char* isa;
+    };
+
+    static void LookupScalar(
+        LaneBits const& bits,
+        const uint32_t* table,
+        const uint32_t* offsets,
+        uint32_t* entries,
+        uint32_t* values)
+    {
+        for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+        {
+            const uint32_t lo = bits.lo[lane];
+            const uint32_t* laneTable = table + offsets[lane];
+
+            uint32_t entry = laneTable[lo & Mask(kTableBits)];
+            if (EntryLength(entry) == 0)
+                entry = laneTable[(entry >> 16) + ((lo >> kTableBits) & Mask(EntryBits(entry)))];
+
+            const uint32_t len = EntryLength(entry);
+            entries[lane] = entry;
+            values[lane] = (entry >> 16) + ((lo >> len) & Mask(EntryBits(entry) - len));
+        }
+    }
+
+    static uint32_t ConsumeScalar(LaneBits& bits, const uint32_t* entries, uint32_t lanes)
+    {
+        uint32_t refill = 0;
+
+        for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+        {
+            if ((lanes & (1u << lane)) == 0)
+                continue;
+
+            const uint32_t n = EntryBits(entries[lane]);
+            const uint64_t buf = ((static_cast<uint64_t>(bits.hi[lane]) << 32) | bits.lo[lane]) >> n;
+
+            bits.lo[lane] = static_cast<uint32_t>(buf);
+            bits.hi[lane] = static_cast<uint32_t>(buf >> 32);
+            bits.cnt[lane] -= n;
+
+            if (bits.cnt[lane] < 32)
+                refill |= 1u << lane;
+        }
+
+        return refill;
+    }
+
+#if GDEFLATE_HAS_X86_LANES
+    GDEFLATE_TARGET_AVX2 static void LookupAvx2(
+        LaneBits const& bits,
+        const uint32_t* table,
+        const uint32_t* offsets,
+        uint32_t* entries,
+        uint32_t* values)
+    {
+        const __m256i indexMask = _mm256_set1_epi32(Mask(kTableBits));
+        const __m256i lengthMask = _mm256_set1_epi32(15);
+        const __m256i bitsMask = _mm256_set1_epi32(31);
+        const __m256i one = _mm256_set1_epi32(1);
+        const int* base = reinterpret_cast<const int*>(table);
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 8)
+        {
+            const __m256i lo = _mm256_load_si256(reinterpret_cast<const __m256i*>(bits.lo + lane));
+            const __m256i offset = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets + lane));
+
+            __m256i entry = _mm256_i32gather_epi32(base, _mm256_add_epi32(offset, _mm256_and_si256(lo, indexMask)), 4);
+
+            const __m256i pointer = _mm256_cmpeq_epi32(_mm256_and_si256(entry, lengthMask), _mm256_setzero_si256());
+            if (!_mm256_testz_si256(pointer, pointer))
+            {
+                const __m256i subtableBits = _mm256_and_si256(_mm256_srli_epi32(entry, 4), bitsMask);
+                const __m256i subtableMask = _mm256_sub_epi32(_mm256_sllv_epi32(one, subtableBits), one);
+                const __m256i index = _mm256_add_epi32(
+                    _mm256_add_epi32(offset, _mm256_srli_epi32(entry, 16)),
+                    _mm256_and_si256(_mm256_srli_epi32(lo, kTableBits), subtableMask));
+
+                entry = _mm256_mask_i32gather_epi32(entry, base, index, pointer, 4);
+            }
+
+            const __m256i len = _mm256_and_si256(entry, lengthMask);
+            const __m256i extraBits = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(entry, 4), bitsMask), len);
+            const __m256i extra = _mm256_and_si256(
+                _mm256_srlv_epi32(lo, len), _mm256_sub_epi32(_mm256_sllv_epi32(one, extraBits), one));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(entries + lane), entry);
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(values + lane), _mm256_add_epi32(_mm256_srli_epi32(entry, 16), extra));
+        }
+    }
+
+    GDEFLATE_TARGET_AVX2 static uint32_t ConsumeAvx2(LaneBits& bits, const uint32_t* entries, uint32_t lanes)
+    {
+        const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        const __m256i bitsMask = _mm256_set1_epi32(31);
+        const __m256i width = _mm256_set1_epi32(32);
+        uint32_t refill = 0;
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 8)
+        {
+            const __m256i selected = _mm256_and_si256(_mm256_set1_epi32(static_cast<int>(lanes >> lane)), laneBits);
+            const __m256i active = _mm256_cmpeq_epi32(selected, laneBits);
+
+            const __m256i entry = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entries + lane));
+            const __m256i n = _mm256_and_si256(_mm256_and_si256(_mm256_srli_epi32(entry, 4), bitsMask), active);
+
+            __m256i* lo = reinterpret_cast<__m256i*>(bits.lo + lane);
+            __m256i* hi = reinterpret_cast<__m256i*>(bits.hi + lane);
+            __m256i* cnt = reinterpret_cast<__m256i*>(bits.cnt + lane);
+
+            // Shifting hi left by 32 - n gives 0 when n is 0, so the lanes that stay unchanged need
+            // no blend
+            const __m256i h = _mm256_load_si256(hi);
+            const __m256i shiftedIn = _mm256_sllv_epi32(h, _mm256_sub_epi32(width, n));
+            _mm256_store_si256(lo, _mm256_or_si256(_mm256_srlv_epi32(_mm256_load_si256(lo), n), shiftedIn));
+            _mm256_store_si256(hi, _mm256_srlv_epi32(h, n));
+
+            const __m256i count = _mm256_sub_epi32(_mm256_load_si256(cnt), n);
+            _mm256_store_si256(cnt, count);
+
+            const __m256i low = _mm256_and_si256(active, _mm256_cmpgt_epi32(width, count));
+            refill |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(low))) << lane;
+        }
+
+        return refill;
+    }
+
+    GDEFLATE_TARGET_AVX512 static void LookupAvx512(
+        LaneBits const& bits,
+        const uint32_t* table,
+        const uint32_t* offsets,
+        uint32_t* entries,
+        uint32_t* values)
+    {
+        const __m512i indexMask = _mm512_set1_epi32(Mask(kTableBits));
+        const __m512i lengthMask = _mm512_set1_epi32(15);
+        const __m512i bitsMask = _mm512_set1_epi32(31);
+        const __m512i one = _mm512_set1_epi32(1);
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 16)
+        {
+            const __m512i lo = _mm512_load_si512(bits.lo + lane);
+            const __m512i offset = _mm512_loadu_si512(offsets + lane);
+
+            __m512i entry = _mm512_i32gather_epi32(_mm512_add_epi32(offset, _mm512_and_si512(lo, indexMask)), table, 4);
+
+            const __mmask16 pointer = _mm512_testn_epi32_mask(entry, lengthMask);
+            if (pointer != 0)
+            {
+                const __m512i subtableBits = _mm512_and_si512(_mm512_srli_epi32(entry, 4), bitsMask);
+                const __m512i subtableMask = _mm512_sub_epi32(_mm512_sllv_epi32(one, subtableBits), one);
+                const __m512i index = _mm512_add_epi32(
+                    _mm512_add_epi32(offset, _mm512_srli_epi32(entry, 16)),
+                    _mm512_and_si512(_mm512_srli_epi32(lo, kTableBits), subtableMask));
+
+                entry = _mm512_mask_i32gather_epi32(entry, pointer, index, table, 4);
+            }
+
+            const __m512i len = _mm512_and_si512(entry, lengthMask);
+            const __m512i extraBits = _mm512_sub_epi32(_mm512_and_si512(_mm512_srli_epi32(entry, 4), bitsMask), len);
+            const __m512i extra = _mm512_and_si512(
+                _mm512_srlv_epi32(lo, len), _mm512_sub_epi32(_mm512_sllv_epi32(one, extraBits), one));
+
+            _mm512_storeu_si512(entries + lane, entry);
+            _mm512_storeu_si512(values + lane, _mm512_add_epi32(_mm512_srli_epi32(entry, 16), extra));
+        }
+    }
+
+    GDEFLATE_TARGET_AVX512 static uint32_t ConsumeAvx512(LaneBits& bits, const uint32_t* entries, uint32_t lanes)
+    {
+        const __m512i bitsMask = _mm512_set1_epi32(31);
+        const __m512i width = _mm512_set1_epi32(32);
+        uint32_t refill = 0;
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 16)
+        {
+            const __mmask16 active = static_cast<__mmask16>(lanes >> lane);
+
+            const __m512i entry = _mm512_loadu_si512(entries + lane);
+            const __m512i n = _mm512_maskz_and_epi32(active, _mm512_srli_epi32(entry, 4), bitsMask);
+
+            const __m512i h = _mm512_load_si512(bits.hi + lane);
+            const __m512i lo = _mm512_load_si512(bits.lo + lane);
+            _mm512_store_si512(
+                bits.lo + lane,
+                _mm512_or_si512(_mm512_srlv_epi32(lo, n), _mm512_sllv_epi32(h, _mm512_sub_epi32(width, n))));
+            _mm512_store_si512(bits.hi + lane, _mm512_srlv_epi32(h, n));
+
+            const __m512i count = _mm512_sub_epi32(_mm512_load_si512(bits.cnt + lane), n);
+            _mm512_store_si512(bits.cnt + lane, count);
+
+            refill |= static_cast<uint32_t>(_mm512_mask_cmplt_epu32_mask(active, count, width)) << lane;
+        }
+
+        return refill;
+    }
+
+    // Reads the CPUID leaves once, and whether the OS saves the AVX and AVX-512 registers
+    static void GetCpuFeatures(bool& avx2, bool& avx512)
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        const int maxLeaf = info[0];
+
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+        const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+        avx2 = avx512 = false;
+        if (maxLeaf < 7 || (xcr0 & 0x6) != 0x6)
+            return;
+
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+#else
+        avx2 = __builtin_cpu_supports("avx2");
+        avx512 = __builtin_cpu_supports("avx512f");
+#endif
+    }
+#elif GDEFLATE_HAS_NEON_LANES
+    // NEON has no gathers, so the table is read lane by lane and the rest is done 4 lanes at a time
+    static void LookupNeon(
+        LaneBits const& bits,
+        const uint32_t* table,
+        const uint32_t* offsets,
+        uint32_t* entries,
+        uint32_t* values)
+    {
+        for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+        {
+            const uint32_t lo = bits.lo[lane];
+            const uint32_t* laneTable = table + offsets[lane];
+
+            uint32_t entry = laneTable[lo & Mask(kTableBits)];
+            if (EntryLength(entry) == 0)
+                entry = laneTable[(entry >> 16) + ((lo >> kTableBits) & Mask(EntryBits(entry)))];
+
+            entries[lane] = entry;
+        }
+
+        const uint32x4_t lengthMask = vdupq_n_u32(15);
+        const uint32x4_t bitsMask = vdupq_n_u32(31);
+        const uint32x4_t one = vdupq_n_u32(1);
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 4)
+        {
+            const uint32x4_t entry = vld1q_u32(entries + lane);
+            const uint32x4_t len = vandq_u32(entry, lengthMask);
+            const uint32x4_t extraBits = vsubq_u32(vandq_u32(vshrq_n_u32(entry, 4), bitsMask), len);
+
+            const uint32x4_t shifted = vshlq_u32(vld1q_u32(bits.lo + lane), vnegq_s32(vreinterpretq_s32_u32(len)));
+            const uint32x4_t extraMask = vsubq_u32(vshlq_u32(one, vreinterpretq_s32_u32(extraBits)), one);
+
+            vst1q_u32(values + lane, vaddq_u32(vshrq_n_u32(entry, 16), vandq_u32(shifted, extraMask)));
+        }
+    }
+
+    static uint32_t ConsumeNeon(LaneBits& bits, const uint32_t* entries, uint32_t lanes)
+    {
+        static const uint32_t kLaneBits[4] = {1, 2, 4, 8};
+        const uint32x4_t laneBits = vld1q_u32(kLaneBits);
+        const uint32x4_t bitsMask = vdupq_n_u32(31);
+        const uint32x4_t width = vdupq_n_u32(32);
+        uint32_t refill = 0;
+
+        for (uint32_t lane = 0; lane < kNumLanes; lane += 4)
+        {
+            const uint32x4_t active = vtstq_u32(vdupq_n_u32(lanes >> lane), laneBits);
+
+            const uint32x4_t entry = vld1q_u32(entries + lane);
+            const uint32x4_t n = vandq_u32(vandq_u32(vshrq_n_u32(entry, 4), bitsMask), active);
+            const int32x4_t right = vnegq_s32(vreinterpretq_s32_u32(n));
+
+            // Shifts of 32 or more give 0, as in the x86 kernels
+            const uint32x4_t h = vld1q_u32(bits.hi + lane);
+            const uint32x4_t lo = vld1q_u32(bits.lo + lane);
+            vst1q_u32(
+                bits.lo + lane,
+                vorrq_u32(vshlq_u32(lo, right), vshlq_u32(h, vreinterpretq_s32_u32(vsubq_u32(width, n)))));
+            vst1q_u32(bits.hi + lane, vshlq_u32(h, right));
+
+            const uint32x4_t count = vsubq_u32(vld1q_u32(bits.cnt + lane), n);
+            vst1q_u32(bits.cnt + lane, count);
+
+            const uint32x4_t low = vandq_u32(vandq_u32(active, vcltq_u32(count, width)), laneBits);
+            refill |= vaddvq_u32(low) << lane;
+        }
+
+        return refill;
+    }
+#endif
+
+    static LaneKernels SelectLaneKernels()
+    {
+#if GDEFLATE_HAS_X86_LANES
+        bool avx2, avx512;
+        GetCpuFeatures(avx2, avx512);
+
+        if (avx512)
+            return {LookupAvx512, ConsumeAvx512, "avx512"};
+
+        if (avx2)
+            return {LookupAvx2, ConsumeAvx2, "avx2"};
+#elif GDEFLATE_HAS_NEON_LANES
+        return {LookupNeon, ConsumeNeon, "neon"};
+#endif
+
+        return {LookupScalar, ConsumeScalar, "scalar"};
+    }
+
+    static LaneKernels const& GetLaneKernels()
+    {
+        static const LaneKernels kernels = SelectLaneKernels();
+        return kernels;
+    }
+
+    // The tables of the block being decoded, the distance table following the literal/length
+    // one so that each lane picks its table with an offset
+    struct DecoderTables
+    {
+        uint32_t codes[kLitLenTableSize + kDistanceTableSize];
+        uint32_t codeLengthCodes[1 << kTableBits];
+    };
+
+    struct FixedTables
+    {
+        uint32_t codes[kLitLenTableSize + kDistanceTableSize];
+
+        FixedTables()
+        {
+            uint8_t lengths[kNumLitLenSymbols + kNumDistanceSymbols];
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 256 - 144);
+            memset(lengths + 256, 7, 280 - 256);
+            memset(lengths + 280, 8, kNumLitLenSymbols - 280);
+            memset(lengths + kNumLitLenSymbols, 5, kNumDistanceSymbols);
+
+            BuildTable(lengths, kNumLitLenSymbols, kLitLenTemplates.data(), codes);
+            BuildTable(
+                lengths + kNumLitLenSymbols, kNumDistanceSymbols, kDistanceTemplates.data(), codes + kLitLenTableSize);
+        }
+    };
+
+    class LaneDecoder
+    {
+    public:
+        LaneDecoder(
+            LaneKernels const& kernels,
+            DecoderTables& tables,
+            const uint8_t* in,
+            size_t inSize,
+            uint8_t* out,
+            size_t outSize,
+            const uint8_t* history,
+            size_t historySize)
+            : m_kernels(kernels)
+            , m_tables(tables)
+            , m_in(in)
+            , m_inSize(inSize)
+            , m_maxWords(inSize / 4 + 2 * kNumLanes)
+            , m_out(out)
+            , m_outSize(outSize)
+            , m_history(history)
+            , m_historySize(historySize)
+        {
+        }
+
+        bool Decode()
+        {
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                m_bits.lo[lane] = LoadWord(lane);
+                m_bits.hi[lane] = 0;
+                m_bits.cnt[lane] = 32;
+            }
+            m_base = kNumLanes;
+
+            bool done;
+            do
+            {
+                // The block header is read by the first lane
+                const uint32_t header = m_bits.lo[0];
+                done = (header & 1) != 0;
+                ConsumeUniform(3, 1);
+
+                bool decoded = false;
+                switch ((header >> 1) & 3)
+                {
+                case 2:
+                    decoded = ReadCodeLengths(header) && CompressedBlock(m_tables.codes);
+                    break;
+
+                case 1:
+                    decoded = CompressedBlock(GetFixedTables().codes);
+                    break;
+
+                case 0:
+                    decoded = UncompressedBlock();
+                    break;
+                }
+
+                if (!decoded)
+                    return false;
+            } while (!done);
+
+            return m_pos == m_outSize;
+        }
+
+    private:
+        static FixedTables const& GetFixedTables()
+        {
+            static const FixedTables tables;
+            return tables;
+        }
+
+        // Words past the end of the tile read as 0, like the padding the encoder flushes. A tile
+        // that keeps reading well past its end is malformed.
+        uint32_t LoadWord(size_t index) const
+        {
+            uint32_t word = 0;
+            if (index * 4 + 4 <= m_inSize)
+                memcpy(&word, m_in + index * 4, sizeof(word));
+            else if (index * 4 < m_inSize)
+                memcpy(&word, m_in + index * 4, m_inSize - index * 4);
+
+            return word;
+        }
+
+        // Appends the next word of the tile to each lane in lanes, in lane order
+        void Refill(uint32_t lanes)
+        {
+            for (; lanes != 0; lanes &= lanes - 1)
+            {
+                const uint32_t lane = CountTrailingZeros(lanes);
+                const uint64_t buf = ((static_cast<uint64_t>(m_bits.hi[lane]) << 32) | m_bits.lo[lane]) |
+                                     (static_cast<uint64_t>(LoadWord(m_base++)) << m_bits.cnt[lane]);
+
+                m_bits.lo[lane] = static_cast<uint32_t>(buf);
+                m_bits.hi[lane] = static_cast<uint32_t>(buf >> 32);
+                m_bits.cnt[lane] += 32;
+            }
+        }
+
+        bool Overrun() const
+        {
+            return m_base > m_maxWords;
+        }
+
+        void Consume(const uint32_t* entries, uint32_t lanes)
+        {
+            Refill(m_kernels.consume(m_bits, entries, lanes));
+        }
+
+        void ConsumeUniform(uint32_t n, uint32_t lanes)
+        {
+            alignas(64) uint32_t entries[kNumLanes];
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+                entries[lane] = n << 4;
+
+            Consume(entries, lanes);
+        }
+
+        // Reads the code lengths of a dynamic block into the tables. The code length code lengths
+        // are read by the first hclen lanes, one each, and the code lengths one per lane and round.
+        bool ReadCodeLengths(uint32_t header)
+        {
+            const uint32_t hlit = ((header >> 3) & 31) + 257;
+            const uint32_t hdist = ((header >> 8) & 31) + 1;
+            const uint32_t hclen = ((header >> 13) & 15) + 4;
+            ConsumeUniform(14, 1);
+
+            uint8_t codeLengthLengths[kNumCodeLengthSymbols] = {};
+            for (uint32_t lane = 0; lane < hclen; ++lane)
+                codeLengthLengths[kCodeLengthOrder[lane]] = m_bits.lo[lane] & 7;
+            ConsumeUniform(3, Mask(hclen));
+
+            if (!BuildTable(
+                    codeLengthLengths, kNumCodeLengthSymbols, kCodeLengthTemplates.data(), m_tables.codeLengthCodes))
+                return false;
+
+            alignas(64) static const uint32_t kNoOffsets[kNumLanes] = {};
+            alignas(64) uint32_t entries[kNumLanes];
+            alignas(64) uint32_t values[kNumLanes];
+
+            uint8_t lengths[kNumLitLenSymbols + kNumDistanceSymbols] = {};
+            const uint32_t count = hlit + hdist;
+            uint32_t pos = 0;
+
+            while (pos < count)
+            {
+                m_kernels.lookup(m_bits, m_tables.codeLengthCodes, kNoOffsets, entries, values);
+
+                uint32_t lanes = 0;
+                for (uint32_t lane = 0; lane < kNumLanes && pos < count; ++lane)
+                {
+                    const uint32_t entry = entries[lane];
+                    const uint32_t n = values[lane];
+                    if (EntryKind(entry) == kInvalid || n > count - pos)
+                        return false;
+
+                    // A repeat of the previous length takes it from the lane before, or from the
+                    // last lane of the round before
+                    uint32_t len = 0;
+                    const uint32_t sym = EntrySymbol(entry);
+                    if (sym < 16)
+                        len = sym;
+                    else if (sym == 16 && pos == 0)
+                        return false;
+                    else if (sym == 16)
+                        len = lengths[pos - 1];
+
+                    memset(lengths + pos, static_cast<int>(len), n);
+                    pos += n;
+                    lanes |= 1u << lane;
+                }
+
+                Consume(entries, lanes);
+
+                if (Overrun())
+                    return false;
+            }
+
+            return BuildTable(lengths, hlit, kLitLenTemplates.data(), m_tables.codes) &&
+                   BuildTable(lengths + hlit, hdist, kDistanceTemplates.data(), m_tables.codes + kLitLenTableSize);
+        }
+
+        // Writes the literals and matches that lanes decoded in the round before, in lane order.
+        // A match is written once the lane has decoded its distance in the next round.
+        bool WriteRound(uint32_t literals, uint32_t matches, const uint32_t* tokens, const uint32_t* distances)
+        {
+            for (uint32_t lanes = literals | matches; lanes != 0; lanes &= lanes - 1)
+            {
+                const uint32_t lane = CountTrailingZeros(lanes);
+
+                if (literals & (1u << lane))
+                {
+                    if (m_pos == m_outSize)
+                        return false;
+
+                    m_out[m_pos++] = static_cast<uint8_t>(tokens[lane]);
+                    continue;
+                }
+
+                const size_t length = tokens[lane];
+                const size_t distance = distances[lane];
+                if (distance > m_pos + m_historySize || length > m_outSize - m_pos)
+                    return false;
+
+                uint8_t* dst = m_out + m_pos;
+
+                // A match that starts in the history takes its first bytes from there
+                size_t copied = 0;
+                if (distance > m_pos)
+                {
+                    copied = std::min(length, distance - m_pos);
+                    memcpy(dst, m_history + m_historySize - (distance - m_pos), copied);
+                }
+
+                if (copied < length)
+                {
+                    uint8_t* to = dst + copied;
+                    const uint8_t* from = m_out + (m_pos + copied - distance);
+
+                    if (distance >= length)
+                    {
+                        memcpy(to, from, length - copied);
+                    }
+                    else
+                    {
+                        for (size_t i = 0; i < length - copied; ++i)
+                            to[i] = from[i];
+                    }
+                }
+
+                m_pos += length;
+            }
+
+            return true;
+        }
+
+        // Decodes the symbols of a Huffman block, one per lane and round. A lane that decodes a
+        // length decodes the match's distance in the next round, while the other lanes decode the
+        // next symbols. The first lane to decode the end of block ends it; the lanes after it have
+        // looked past the end and keep their bits.
+        bool CompressedBlock(const uint32_t* table)
+        {
+            alignas(64) uint32_t offsets[kNumLanes] = {};
+            alignas(64) uint32_t entries[kNumLanes];
+            alignas(64) uint32_t values[kNumLanes];
+            alignas(64) uint32_t tokens[kNumLanes];
+
+            uint32_t literals = 0;
+            uint32_t matches = 0; // Lanes that decode a distance in the current round
+            bool first = true;
+
+            for (;;)
+            {
+                m_kernels.lookup(m_bits, table, offsets, entries, values);
+
+                uint32_t endOfBlock = 0;
+                uint32_t invalid = 0;
+                uint32_t lengths = 0;
+                for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+                {
+                    const uint32_t kind = EntryKind(entries[lane]);
+                    endOfBlock |= (kind == kEndOfBlock ? 1u : 0) << lane;
+                    invalid |= (kind == kInvalid ? 1u : 0) << lane;
+                    lengths |= (kind == kLength ? 1u : 0) << lane;
+                }
+
+                endOfBlock &= ~matches;
+                const uint32_t inBlock = endOfBlock != 0 ? Mask(CountTrailingZeros(endOfBlock) + 1) : ~0u;
+                const uint32_t active = matches | inBlock;
+
+                if ((invalid & active) != 0)
+                    return false;
+
+                Consume(entries, active);
+
+                if (!first && !WriteRound(literals, matches, tokens, values))
+                    return false;
+
+                if (Overrun())
+                    return false;
+
+                // The symbols of this round, for the lanes that didn't decode a distance
+                const uint32_t symbols = inBlock & ~matches;
+                literals = symbols & ~lengths & ~endOfBlock;
+                matches = symbols & lengths;
+                memcpy(tokens, values, sizeof(tokens));
+
+                for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+                    offsets[lane] = (matches & (1u << lane)) ? kLitLenTableSize : 0;
+
+                first = false;
+                if (endOfBlock != 0)
+                    break;
+            }
+
+            // One last round for the distances of the matches decoded with the end of block
+            if (matches != 0)
+            {
+                m_kernels.lookup(m_bits, table, offsets, entries, values);
+
+                for (uint32_t lanes = matches; lanes != 0; lanes &= lanes - 1)
+                {
+                    if (EntryKind(entries[CountTrailingZeros(lanes)]) == kInvalid)
+                        return false;
+                }
+
+                Consume(entries, matches);
+            }
+
+            return WriteRound(literals, matches, tokens, values);
+        }
+
+        // The first lane reads the 16-bit size, and then every lane reads a byte per round
+        bool UncompressedBlock()
+        {
+            const uint32_t size = m_bits.lo[0] & 0xffff;
+            ConsumeUniform(16, 1);
+
+            if (size > m_outSize - m_pos)
+                return false;
+
+            for (uint32_t done = 0; done < size; done += kNumLanes)
+            {
+                const uint32_t numBytes = std::min(size - done, kNumLanes);
+                for (uint32_t lane = 0; lane < numBytes; ++lane)
+                    m_out[m_pos++] = static_cast<uint8_t>(m_bits.lo[lane]);
+
+                ConsumeUniform(8, Mask(numBytes));
+
+                if (Overrun())
+                    return false;
+            }
+
+            return !Overrun();
+        }
+
+        LaneKernels const& m_kernels;
+        DecoderTables& m_tables;
+
+        const uint8_t* m_in;
+        size_t m_inSize;
+        size_t m_base = 0;     // Index of the next word of the tile that a lane refills from
+        size_t m_maxWords;
+
+        uint8_t* m_out;
+        size_t m_outSize;
+        size_t m_pos = 0;
+
+        const uint8_t* m_history;
+        size_t m_historySize;
+
+        LaneBits m_bits;
+    };
+
+    bool DecodeTile(
+        const uint8_t* in,
+        size_t inSize,
+        uint8_t* out,
+        size_t outSize,
+        const uint8_t* history,
+        size_t historySize)
+    {
+        static thread_local std::unique_ptr<DecoderTables> tables(new DecoderTables);
+
+        LaneDecoder decoder(GetLaneKernels(), *tables, in, inSize, out, outSize, history, historySize);
+        return decoder.Decode();
+    }
+
+    const char* GetTileDecoderIsa()
+    {
+        return GetLaneKernels().isa;
+    }
+
+    bool HasVectorTileDecoder()
+    {
+        return GetLaneKernels().lookup != LookupScalar;
+    }
+} // namespace GDeflate
@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace GDeflate
+{
+    // Decodes one compressed tile of inSize bytes into exactly outSize bytes at out. This is the
+    // CPU counterpart of GDeflate.hlsl: the 32 bitstreams of the tile are decoded side by side, one
+    // per vector lane, with the bit reader refills and the block protocol of the shader. The
+    // historySize bytes at history prime the window, for tiles that EncodeTile compressed against
+    // them. Returns false if the tile is malformed or doesn't decode to outSize bytes.
+    bool DecodeTile(
+        const uint8_t* in,
+        size_t inSize,
+        uint8_t* out,
+        size_t outSize,
+        const uint8_t* history = nullptr,
+        size_t historySize = 0);
+
+    // Returns the instruction set DecodeTile runs its lanes with: "avx512", "avx2", "neon" or
+    // "scalar".
+    const char* GetTileDecoderIsa();
+
+    // Returns true if DecodeTile has a vector implementation on this CPU. Where it hasn't, tiles are
+    // left to libdeflate by default.
+    bool HasVectorTileDecoder();
+} // namespace GDeflate
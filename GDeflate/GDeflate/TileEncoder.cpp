@@ -0,0 +1,803 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TileEncoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace GDeflate
+{
+    static constexpr uint32_t kNumLanes = 32;
+
+    static constexpr uint32_t kMinMatchLength = 3;
+    static constexpr uint32_t kMaxMatchLength = 258; // 285 is a 16-bit length in GDeflate, and isn't used
+    static constexpr uint32_t kWindowSize = 64 * 1024;
+
+    static constexpr uint32_t kHashBits = 15;
+
+    // Blocks are cut after this many symbols, so that the codes follow the data
+    static constexpr size_t kMaxBlockSymbols = 16 * 1024;
+    static constexpr uint32_t kMaxStoredBlockSize = 0xffff;
+
+    static constexpr uint32_t kNumLitLenSymbols = 288;
+    static constexpr uint32_t kNumDistanceSymbols = 32;
+    static constexpr uint32_t kNumCodeLengthSymbols = 19;
+    static constexpr uint32_t kEndOfBlock = 256;
+
+    static constexpr uint32_t kLengthBase[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23,
+                                               27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227};
+    static constexpr uint32_t kLengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2,
+                                                2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5};
+
+    static constexpr uint32_t kDistanceBase[] = {1,    2,    3,    4,    5,    7,     9,     13,    17,    25,   33,
+                                                 49,   65,   97,   129,  193,  257,   385,   513,   769,   1025, 1537,
+                                                 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32769, 49153};
+    static constexpr uint32_t kDistanceExtra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,  6,
+                                                  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14};
+
+    static constexpr uint8_t kCodeLengthOrder[kNumCodeLengthSymbols] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    // How hard each level searches: the number of chain entries tried, and whether a match is
+    // deferred when the next position has a longer one
+    struct LevelParams
+    {
+        uint32_t maxChain;
+        uint32_t niceLength;
+        bool lazy;
+    };
+
+    static constexpr LevelParams kLevels[] = {
+        {4, 16, false},
+        {4, 16, false},
+        {8, 32, false},
+        {16, 64, false},
+        {16, 32, true},
+        {32, 64, true},
+        {64, 128, true},
+        {128, 128, true},
+        {256, 258, true},
+        {512, 258, true},
+        {1024, 258, true},
+        {2048, 258, true},
+        {4096, 258, true},
+    };
+
+    struct Token
+    {
+        uint32_t length; // 0 for a literal
+        uint32_t value;  // The literal, or the distance of the match
+    };
+
+    static uint32_t LengthIndex(uint32_t length)
+    {
+        uint32_t index = 0;
+        while (index + 1 < sizeof(kLengthBase) / sizeof(kLengthBase[0]) && kLengthBase[index + 1] <= length)
+            ++index;
+
+        return index;
+    }
+
+    static uint32_t DistanceIndex(uint32_t distance)
+    {
+        uint32_t index = 0;
+        while (index + 1 < kNumDistanceSymbols && kDistanceBase[index + 1] <= distance)
+            ++index;
+
+        return index;
+    }
+
+    // Finds the matches of the tile, which starts historySize bytes into data
+    static void ParseTile(
+        const uint8_t* data,
+        size_t historySize,
+        size_t size,
+        LevelParams const& params,
+        std::vector<Token>& tokens)
+    {
+        const size_t end = historySize + size;
+        std::vector<int32_t> head(1 << kHashBits, -1);
+        std::vector<int32_t> prev(end, -1);
+
+        auto hash = [&](size_t pos) {
+            const uint32_t bytes = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+            return (bytes * 2654435761u) >> (32 - kHashBits);
+        };
+
+        auto insert = [&](size_t pos) {
+            if (pos + kMinMatchLength > end)
+                return;
+
+            const uint32_t h = hash(pos);
+            prev[pos] = head[h];
+            head[h] = static_cast<int32_t>(pos);
+        };
+
+        auto findMatch = [&](size_t pos, uint32_t& bestDistance) {
+            uint32_t bestLength = 0;
+            const uint32_t maxLength = static_cast<uint32_t>(std::min<size_t>(kMaxMatchLength, end - pos));
+            if (maxLength < kMinMatchLength)
+                return bestLength;
+
+            uint32_t chain = params.maxChain;
+            for (int32_t candidate = head[hash(pos)]; candidate >= 0 && chain-- > 0; candidate = prev[candidate])
+            {
+                const size_t distance = pos - candidate;
+                if (distance > kWindowSize)
+                    break;
+
+                const uint8_t* a = data + candidate;
+                const uint8_t* b = data + pos;
+                if (a[bestLength] != b[bestLength])
+                    continue;
+
+                uint32_t length = 0;
+                while (length < maxLength && a[length] == b[length])
+                    ++length;
+
+                if (length > bestLength)
+                {
+                    bestLength = length;
+                    bestDistance = static_cast<uint32_t>(distance);
+                    if (length >= params.niceLength || length == maxLength)
+                        break;
+                }
+            }
+
+            return bestLength >= kMinMatchLength ? bestLength : 0;
+        };
+
+        for (size_t pos = 0; pos < historySize; ++pos)
+            insert(pos);
+
+        size_t pos = historySize;
+        while (pos < end)
+        {
+            uint32_t distance = 0;
+            uint32_t length = findMatch(pos, distance);
+
+            if (length != 0 && params.lazy && pos + 1 < end)
+            {
+                insert(pos);
+
+                uint32_t nextDistance = 0;
+                const uint32_t nextLength = findMatch(pos + 1, nextDistance);
+                if (nextLength > length)
+                {
+                    tokens.push_back({0, data[pos]});
+                    ++pos;
+                    length = nextLength;
+                    distance = nextDistance;
+                }
+                else
+                {
+                    tokens.push_back({length, distance});
+                    for (size_t i = pos + 1; i < pos + length; ++i)
+                        insert(i);
+                    pos += length;
+                    continue;
+                }
+            }
+
+            if (length == 0)
+            {
+                tokens.push_back({0, data[pos]});
+                insert(pos);
+                ++pos;
+                continue;
+            }
+
+            tokens.push_back({length, distance});
+            for (size_t i = pos; i < pos + length; ++i)
+                insert(i);
+            pos += length;
+        }
+    }
+
+    // Computes Huffman code lengths of at most maxLength bits. Every code gets at least two
+    // symbols, so that it is complete.
+    static void BuildCodeLengths(std::vector<uint32_t> freqs, uint32_t maxLength, uint8_t* lengths)
+    {
+        const uint32_t numSymbols = static_cast<uint32_t>(freqs.size());
+
+        uint32_t used = 0;
+        for (uint32_t sym = 0; sym < numSymbols && used < 2; ++sym)
+            used += freqs[sym] != 0;
+
+        for (uint32_t sym = 0; sym < numSymbols && used < 2; ++sym)
+        {
+            if (freqs[sym] == 0)
+            {
+                freqs[sym] = 1;
+                ++used;
+            }
+        }
+
+        for (;;)
+        {
+            // Nodes are the symbols followed by the internal nodes
+            std::vector<uint32_t> parent(2 * numSymbols, 0);
+            using Node = std::pair<uint64_t, uint32_t>;
+            std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+
+            for (uint32_t sym = 0; sym < numSymbols; ++sym)
+            {
+                if (freqs[sym] != 0)
+                    queue.push({freqs[sym], sym});
+            }
+
+            uint32_t next = numSymbols;
+            while (queue.size() > 1)
+            {
+                const Node a = queue.top();
+                queue.pop();
+                const Node b = queue.top();
+                queue.pop();
+
+                parent[a.second] = parent[b.second] = next;
+                queue.push({a.first + b.first, next++});
+            }
+
+            const uint32_t root = next - 1;
+            std::vector<uint32_t> depth(next, 0);
+            for (uint32_t node = root; node-- > 0;)
+            {
+                if (node >= numSymbols || freqs[node] != 0)
+                    depth[node] = depth[parent[node]] + 1;
+            }
+
+            uint32_t longest = 0;
+            for (uint32_t sym = 0; sym < numSymbols; ++sym)
+            {
+                lengths[sym] = freqs[sym] != 0 ? static_cast<uint8_t>(depth[sym]) : 0;
+                longest = std::max<uint32_t>(longest, lengths[sym]);
+            }
+
+            if (longest <= maxLength)
+                return;
+
+            // Flatten the distribution until the code fits
+            for (uint32_t& freq : freqs)
+            {
+                if (freq != 0)
+                    freq = (freq + 1) / 2;
+            }
+        }
+    }
+
+    // The canonical codes for the lengths, bit reversed for the LSB first bitstream
+    static void BuildCodes(const uint8_t* lengths, uint32_t numSymbols, uint32_t* codes)
+    {
+        uint32_t counts[16] = {};
+        for (uint32_t sym = 0; sym < numSymbols; ++sym)
+            counts[lengths[sym]]++;
+        counts[0] = 0;
+
+        uint32_t nextCode[16];
+        uint32_t code = 0;
+        for (uint32_t len = 1; len < 16; ++len)
+        {
+            code = (code + counts[len - 1]) << 1;
+            nextCode[len] = code;
+        }
+
+        for (uint32_t sym = 0; sym < numSymbols; ++sym)
+        {
+            const uint32_t len = lengths[sym];
+            uint32_t reversed = 0;
+            if (len != 0)
+            {
+                uint32_t c = nextCode[len]++;
+                for (uint32_t i = 0; i < len; ++i, c >>= 1)
+                    reversed = (reversed << 1) | (c & 1);
+            }
+
+            codes[sym] = reversed;
+        }
+    }
+
+    // The writing side of the decoder's bit reader, as in GDeflateCompress.hlsl. Every Put mirrors
+    // a Consume of the decoder and gives the next word of the tile to each lane that the decoder
+    // refills after it. A lane's words are stored in the slots it was given, in order, as their 32
+    // bits are written; a lane is never more than two slots ahead of its bits.
+    class LaneWriter
+    {
+    public:
+        LaneWriter(uint8_t* out, size_t capacity) : m_out(out), m_capacity(capacity)
+        {
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                m_buf[lane] = 0;
+                m_bufBits[lane] = 0;
+                m_cnt[lane] = 32;
+                m_slots[lane][0] = lane;
+                m_firstSlot[lane] = 0;
+                m_numSlots[lane] = 1;
+            }
+        }
+
+        // Appends n[lane] bits of bits[lane] to each lane in lanes
+        void Put(const uint32_t* bits, const uint32_t* n, uint32_t lanes)
+        {
+            uint32_t refill = 0;
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                if ((lanes & (1u << lane)) == 0)
+                    continue;
+
+                m_buf[lane] |= static_cast<uint64_t>(bits[lane]) << m_bufBits[lane];
+                m_bufBits[lane] += n[lane];
+                m_cnt[lane] -= n[lane];
+
+                if (m_cnt[lane] < 32)
+                    refill |= 1u << lane;
+            }
+
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                if ((refill & (1u << lane)) == 0)
+                    continue;
+
+                m_slots[lane][(m_firstSlot[lane] + m_numSlots[lane]++) % kMaxSlots] = m_base++;
+                m_cnt[lane] += 32;
+            }
+
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                if (m_bufBits[lane] < 32)
+                    continue;
+
+                Store(m_slots[lane][m_firstSlot[lane]], static_cast<uint32_t>(m_buf[lane]));
+                m_buf[lane] >>= 32;
+                m_bufBits[lane] -= 32;
+                m_firstSlot[lane] = (m_firstSlot[lane] + 1) % kMaxSlots;
+                m_numSlots[lane]--;
+            }
+        }
+
+        void Put(uint32_t lane, uint32_t bits, uint32_t n)
+        {
+            uint32_t laneBits[kNumLanes] = {};
+            uint32_t laneN[kNumLanes] = {};
+            laneBits[lane] = bits;
+            laneN[lane] = n;
+            Put(laneBits, laneN, 1u << lane);
+        }
+
+        // Stores the last bits, and zeros in any word that the decoder loads before it's done.
+        // Returns the size of the tile, or 0 if it didn't fit.
+        size_t Finish()
+        {
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                for (uint32_t i = 0; i < m_numSlots[lane]; ++i)
+                {
+                    Store(m_slots[lane][(m_firstSlot[lane] + i) % kMaxSlots], static_cast<uint32_t>(m_buf[lane]));
+                    m_buf[lane] = 0;
+                }
+            }
+
+            const size_t size = m_base * sizeof(uint32_t);
+            return m_overflow || size > m_capacity ? 0 : size;
+        }
+
+    private:
+        void Store(size_t index, uint32_t word)
+        {
+            if (index * sizeof(word) + sizeof(word) > m_capacity)
+            {
+                m_overflow = true;
+                return;
+            }
+
+            memcpy(m_out + index * sizeof(word), &word, sizeof(word));
+        }
+
+        uint8_t* m_out;
+        size_t m_capacity;
+        bool m_overflow = false;
+        size_t m_base = kNumLanes;
+
+        uint64_t m_buf[kNumLanes];
+        uint32_t m_bufBits[kNumLanes];
+        uint32_t m_cnt[kNumLanes]; // Bits the decoder holds for the lane after the same Consume
+        static constexpr uint32_t kMaxSlots = 3; // Two pending, and one given just before a word fills
+
+        size_t m_slots[kNumLanes][kMaxSlots];
+        uint32_t m_firstSlot[kNumLanes];
+        uint32_t m_numSlots[kNumLanes];
+    };
+
+    // The codes of a Huffman block
+    struct BlockCodes
+    {
+        uint8_t litLenLengths[kNumLitLenSymbols] = {};
+        uint8_t distanceLengths[kNumDistanceSymbols] = {};
+        uint32_t litLenCodes[kNumLitLenSymbols];
+        uint32_t distanceCodes[kNumDistanceSymbols];
+
+        void Finish()
+        {
+            BuildCodes(litLenLengths, kNumLitLenSymbols, litLenCodes);
+            BuildCodes(distanceLengths, kNumDistanceSymbols, distanceCodes);
+        }
+    };
+
+    // The code lengths of a dynamic block, run length coded as in RFC 1951, 3.2.7
+    struct BlockHeader
+    {
+        uint32_t hlit = 0;
+        uint32_t hdist = 0;
+        uint32_t hclen = 0;
+        uint8_t codeLengthLengths[kNumCodeLengthSymbols] = {};
+        uint32_t codeLengthCodes[kNumCodeLengthSymbols];
+        std::vector<uint32_t> symbols; // sym:5, extra:7
+
+        size_t GetBits() const
+        {
+            size_t bits = 3 + 14 + 3 * hclen;
+            for (uint32_t symbol : symbols)
+            {
+                const uint32_t sym = symbol & 31;
+                bits += codeLengthLengths[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+            }
+
+            return bits;
+        }
+    };
+
+    static void BuildHeader(BlockCodes const& codes, BlockHeader& header)
+    {
+        header.hlit = kNumLitLenSymbols - 2;
+        while (header.hlit > 257 && codes.litLenLengths[header.hlit - 1] == 0)
+            --header.hlit;
+
+        header.hdist = kNumDistanceSymbols;
+        while (header.hdist > 1 && codes.distanceLengths[header.hdist - 1] == 0)
+            --header.hdist;
+
+        uint8_t lengths[kNumLitLenSymbols + kNumDistanceSymbols];
+        memcpy(lengths, codes.litLenLengths, header.hlit);
+        memcpy(lengths + header.hlit, codes.distanceLengths, header.hdist);
+        const uint32_t count = header.hlit + header.hdist;
+
+        std::vector<uint32_t> freqs(kNumCodeLengthSymbols, 0);
+        for (uint32_t i = 0; i < count;)
+        {
+            const uint8_t len = lengths[i];
+            uint32_t run = 1;
+            while (i + run < count && lengths[i + run] == len)
+                ++run;
+
+            i += run;
+            if (len == 0)
+            {
+                while (run >= 11)
+                {
+                    const uint32_t n = std::min<uint32_t>(run, 138);
+                    header.symbols.push_back(18 | ((n - 11) << 5));
+                    run -= n;
+                }
+                if (run >= 3)
+                {
+                    header.symbols.push_back(17 | ((run - 3) << 5));
+                    run = 0;
+                }
+            }
+            else
+            {
+                header.symbols.push_back(len);
+                --run;
+                while (run >= 3)
+                {
+                    const uint32_t n = std::min<uint32_t>(run, 6);
+                    header.symbols.push_back(16 | ((n - 3) << 5));
+                    run -= n;
+                }
+            }
+
+            for (; run > 0; --run)
+                header.symbols.push_back(len);
+        }
+
+        for (uint32_t symbol : header.symbols)
+            freqs[symbol & 31]++;
+
+        BuildCodeLengths(freqs, 7, header.codeLengthLengths);
+        BuildCodes(header.codeLengthLengths, kNumCodeLengthSymbols, header.codeLengthCodes);
+
+        header.hclen = kNumCodeLengthSymbols;
+        while (header.hclen > 4 && header.codeLengthLengths[kCodeLengthOrder[header.hclen - 1]] == 0)
+            --header.hclen;
+    }
+
+    static size_t GetSymbolBits(BlockCodes const& codes, const Token* tokens, size_t numTokens)
+    {
+        size_t bits = codes.litLenLengths[kEndOfBlock];
+        for (size_t i = 0; i < numTokens; ++i)
+        {
+            const Token& token = tokens[i];
+            if (token.length == 0)
+            {
+                bits += codes.litLenLengths[token.value];
+                continue;
+            }
+
+            const uint32_t length = LengthIndex(token.length);
+            const uint32_t distance = DistanceIndex(token.value);
+            bits += codes.litLenLengths[257 + length] + kLengthExtra[length];
+            bits += codes.distanceLengths[distance] + kDistanceExtra[distance];
+        }
+
+        return bits;
+    }
+
+    static size_t GetStoredBits(size_t size)
+    {
+        const size_t numBlocks = std::max<size_t>(1, (size + kMaxStoredBlockSize - 1) / kMaxStoredBlockSize);
+        return numBlocks * (3 + 16) + size * 8;
+    }
+
+    // Codes the tokens of a Huffman block a symbol per lane and round. Each round, the lanes that
+    // took a match in the round before write its distance, and the others take the next symbols.
+    static void WriteSymbols(LaneWriter& writer, BlockCodes const& codes, const Token* tokens, size_t numTokens)
+    {
+        uint32_t bits[kNumLanes];
+        uint32_t n[kNumLanes];
+        uint32_t distanceBits[kNumLanes];
+        uint32_t distanceN[kNumLanes];
+
+        uint32_t copies = 0;
+        size_t next = 0;
+        bool done = false;
+
+        while (!done)
+        {
+            uint32_t lanes = copies;
+            uint32_t newCopies = 0;
+            uint32_t numFree = 0;
+            size_t index = next;
+
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+            {
+                const uint32_t laneBit = 1u << lane;
+                if (copies & laneBit)
+                {
+                    bits[lane] = distanceBits[lane];
+                    n[lane] = distanceN[lane];
+                    continue;
+                }
+
+                ++numFree;
+                if (index > numTokens)
+                    continue;
+
+                lanes |= laneBit;
+                if (index == numTokens)
+                {
+                    bits[lane] = codes.litLenCodes[kEndOfBlock];
+                    n[lane] = codes.litLenLengths[kEndOfBlock];
+                    ++index;
+                    continue;
+                }
+
+                const Token& token = tokens[index++];
+                if (token.length == 0)
+                {
+                    bits[lane] = codes.litLenCodes[token.value];
+                    n[lane] = codes.litLenLengths[token.value];
+                    continue;
+                }
+
+                const uint32_t length = LengthIndex(token.length);
+                const uint32_t lengthLen = codes.litLenLengths[257 + length];
+                bits[lane] = codes.litLenCodes[257 + length] | ((token.length - kLengthBase[length]) << lengthLen);
+                n[lane] = lengthLen + kLengthExtra[length];
+
+                const uint32_t distance = DistanceIndex(token.value);
+                const uint32_t distanceLen = codes.distanceLengths[distance];
+                distanceBits[lane] =
+                    codes.distanceCodes[distance] | ((token.value - kDistanceBase[distance]) << distanceLen);
+                distanceN[lane] = distanceLen + kDistanceExtra[distance];
+                newCopies |= laneBit;
+            }
+
+            writer.Put(bits, n, lanes);
+
+            next += numFree;
+            done = next > numTokens;
+            copies = newCopies;
+        }
+
+        // The distances of the matches taken in the round with the end of block
+        writer.Put(distanceBits, distanceN, copies);
+    }
+
+    static void WriteDynamicHeader(LaneWriter& writer, BlockHeader const& header)
+    {
+        writer.Put(0, (header.hlit - 257) | ((header.hdist - 1) << 5) | ((header.hclen - 4) << 10), 14);
+
+        uint32_t bits[kNumLanes] = {};
+        uint32_t n[kNumLanes] = {};
+        for (uint32_t lane = 0; lane < header.hclen; ++lane)
+        {
+            bits[lane] = header.codeLengthLengths[kCodeLengthOrder[lane]];
+            n[lane] = 3;
+        }
+        writer.Put(bits, n, (1u << header.hclen) - 1);
+
+        for (size_t i = 0; i < header.symbols.size(); i += kNumLanes)
+        {
+            const uint32_t numSymbols = static_cast<uint32_t>(std::min<size_t>(kNumLanes, header.symbols.size() - i));
+            for (uint32_t lane = 0; lane < numSymbols; ++lane)
+            {
+                const uint32_t sym = header.symbols[i + lane] & 31;
+                const uint32_t extra = header.symbols[i + lane] >> 5;
+                const uint32_t len = header.codeLengthLengths[sym];
+                const uint32_t extraBits = sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0;
+
+                bits[lane] = header.codeLengthCodes[sym] | (extra << len);
+                n[lane] = len + extraBits;
+            }
+
+            writer.Put(bits, n, numSymbols == kNumLanes ? ~0u : (1u << numSymbols) - 1);
+        }
+    }
+
+    static void WriteStored(LaneWriter& writer, const uint8_t* data, size_t size, bool last)
+    {
+        do
+        {
+            const uint32_t blockSize = static_cast<uint32_t>(std::min<size_t>(size, kMaxStoredBlockSize));
+            const bool final = last && blockSize == size;
+
+            writer.Put(0, final ? 1 : 0, 3);
+            writer.Put(0, blockSize, 16);
+
+            uint32_t bits[kNumLanes];
+            uint32_t n[kNumLanes];
+            for (uint32_t lane = 0; lane < kNumLanes; ++lane)
+                n[lane] = 8;
+
+            for (uint32_t done = 0; done < blockSize; done += kNumLanes)
+            {
+                const uint32_t numBytes = std::min(blockSize - done, kNumLanes);
+                for (uint32_t lane = 0; lane < numBytes; ++lane)
+                    bits[lane] = data[done + lane];
+
+                writer.Put(bits, n, numBytes == kNumLanes ? ~0u : (1u << numBytes) - 1);
+            }
+
+            data += blockSize;
+            size -= blockSize;
+        } while (size > 0);
+    }
+
+    static void GetFixedCodes(BlockCodes& codes)
+    {
+        memset(codes.litLenLengths, 8, 144);
+        memset(codes.litLenLengths + 144, 9, 256 - 144);
+        memset(codes.litLenLengths + 256, 7, 280 - 256);
+        memset(codes.litLenLengths + 280, 8, kNumLitLenSymbols - 280);
+        memset(codes.distanceLengths, 5, kNumDistanceSymbols);
+        codes.Finish();
+    }
+
+    size_t GetEncodeTileBound(size_t inSize)
+    {
+        // Stored blocks, a header per block and the words that each lane may load past its bits
+        return inSize + inSize / 2048 + 512;
+    }
+
+    size_t EncodeTile(
+        const uint8_t* in,
+        size_t inSize,
+        const uint8_t* history,
+        size_t historySize,
+        uint8_t* out,
+        size_t outCapacity,
+        uint32_t level)
+    {
+        // Only the last window of the history can be reached
+        if (historySize > kWindowSize)
+        {
+            history += historySize - kWindowSize;
+            historySize = kWindowSize;
+        }
+
+        std::vector<uint8_t> data(historySize + inSize);
+        if (historySize != 0)
+            memcpy(data.data(), history, historySize);
+        if (inSize != 0)
+            memcpy(data.data() + historySize, in, inSize);
+
+        std::vector<Token> tokens;
+        tokens.reserve(inSize);
+        ParseTile(data.data(), historySize, inSize, kLevels[std::min<uint32_t>(level, 12)], tokens);
+
+        BlockCodes fixed;
+        GetFixedCodes(fixed);
+
+        LaneWriter writer(out, outCapacity);
+        const uint8_t* blockData = in;
+        size_t first = 0;
+
+        do
+        {
+            const size_t numTokens = std::min(kMaxBlockSymbols, tokens.size() - first);
+            const Token* blockTokens = tokens.data() + first;
+            const bool last = first + numTokens == tokens.size();
+
+            std::vector<uint32_t> litLenFreqs(kNumLitLenSymbols - 2, 0);
+            std::vector<uint32_t> distanceFreqs(kNumDistanceSymbols, 0);
+            size_t blockSize = 0;
+            for (size_t i = 0; i < numTokens; ++i)
+            {
+                const Token& token = blockTokens[i];
+                if (token.length == 0)
+                {
+                    litLenFreqs[token.value]++;
+                    blockSize++;
+                    continue;
+                }
+
+                litLenFreqs[257 + LengthIndex(token.length)]++;
+                distanceFreqs[DistanceIndex(token.value)]++;
+                blockSize += token.length;
+            }
+            litLenFreqs[kEndOfBlock]++;
+
+            BlockCodes dynamic;
+            BuildCodeLengths(litLenFreqs, 15, dynamic.litLenLengths);
+            BuildCodeLengths(distanceFreqs, 15, dynamic.distanceLengths);
+            dynamic.Finish();
+
+            BlockHeader header;
+            BuildHeader(dynamic, header);
+
+            const size_t dynamicBits = header.GetBits() + GetSymbolBits(dynamic, blockTokens, numTokens);
+            const size_t fixedBits = 3 + GetSymbolBits(fixed, blockTokens, numTokens);
+            const size_t storedBits = GetStoredBits(blockSize);
+
+            if (storedBits <= dynamicBits && storedBits <= fixedBits)
+            {
+                WriteStored(writer, blockData, blockSize, last);
+            }
+            else if (dynamicBits < fixedBits)
+            {
+                writer.Put(0, (last ? 1 : 0) | (2 << 1), 3);
+                WriteDynamicHeader(writer, header);
+                WriteSymbols(writer, dynamic, blockTokens, numTokens);
+            }
+            else
+            {
+                writer.Put(0, (last ? 1 : 0) | (1 << 1), 3);
+                WriteSymbols(writer, fixed, blockTokens, numTokens);
+            }
+
+            blockData += blockSize;
+            first += numTokens;
+        } while (first < tokens.size());
+
+        return writer.Finish();
+    }
+} // namespace GDeflate
@@ -0,0 +1,42 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace GDeflate
+{
+    // Compresses one tile of inSize bytes into at most outCapacity bytes at out, and returns the
+    // compressed size, or 0 if it doesn't fit. The historySize bytes at history are taken to
+    // precede the tile, so matches may reach back into them; a tile compressed with history must
+    // be decoded with the same history. This is the writing side of DecodeTile, used where
+    // libdeflate can't be: matches are found with hash chains searched deeper at higher levels, and
+    // each block is coded with dynamic or fixed Huffman codes or stored, whichever is smallest.
+    size_t EncodeTile(
+        const uint8_t* in,
+        size_t inSize,
+        const uint8_t* history,
+        size_t historySize,
+        uint8_t* out,
+        size_t outCapacity,
+        uint32_t level);
+
+    // The most EncodeTile can produce for a tile of inSize bytes.
+    size_t GetEncodeTileBound(size_t inSize);
+} // namespace GDeflate
@@ -33,19 +33,39 @@ namespace GDeflate
     {
         static constexpr uint32_t kMaxTiles = (1 << 16) - 1;
 
+        // Index 1 (64 KiB) is the only tile size DirectStorage accepts. Index 2 is reserved for
+        // 128 KiB tiles, which libdeflate can't produce since it limits pages to 64 KiB.
+        static constexpr uint32_t kDefaultTileSizeIdx = 1;
+        static constexpr uint32_t kTileSizes[4] = {32 * 1024, 64 * 1024, 0, 16 * 1024};
+        static constexpr uint32_t kInvalidTileSizeIdx = 4;
+
         uint8_t id;
         uint8_t magic;
 
         uint16_t numTiles;
 
-        uint32_t tileSizeIdx : 2; // this must be set to 1
+        uint32_t tileSizeIdx : 2;
         uint32_t lastTileSize : 18;
-        uint32_t reserved1 : 12;
 
-        TileStream(size_t uncompressedSize)
+        // When set, a tile whose compressed size equals its uncompressed size is stored as raw
+        // bytes. Compressed tiles in such a stream are always smaller than their input.
+        uint32_t storedTiles : 1;
+
+        // When set, the offset table is followed by a table of numTiles CRC32C checksums, one per
+        // tile, computed over the tile's bytes as stored in the stream.
+        uint32_t checksums : 1;
+
+        // The id of the preset dictionary the tiles were compressed against, or 0 if there is none.
+        // See GDeflate::Dictionary; DirectStorage can't decode streams that set it.
+        uint32_t dictionaryId : 8;
+
+        // Must be 0. Decoders reject streams that set any of these bits.
+        uint32_t reserved1 : 2;
+
+        TileStream(size_t uncompressedSize, uint32_t inTileSizeIdx = kDefaultTileSizeIdx)
         {
             memset(this, 0, sizeof(*this));
-            tileSizeIdx = 1;
+            tileSizeIdx = inTileSizeIdx;
             SetCodecId(kGDeflateId);
             SetUncompressedSize(uncompressedSize);
         }
@@ -55,9 +75,38 @@ namespace GDeflate
             return id == (magic ^ 0xff);
         }
 
+        size_t GetTileSize() const
+        {
+            return kTileSizes[tileSizeIdx];
+        }
+
+        bool IsStoredTile(size_t compressedSize, size_t uncompressedSize) const
+        {
+            return storedTiles != 0 && compressedSize == uncompressedSize;
+        }
+
+        // Returns the offset of the first tile's data from the start of the stream.
+        size_t GetDataOffset() const
+        {
+            return sizeof(TileStream) + numTiles * sizeof(uint32_t) * (checksums ? 2 : 1);
+        }
+
         size_t GetUncompressedSize() const
         {
-            return numTiles * kDefaultTileSize - (lastTileSize == 0 ? 0 : kDefaultTileSize - lastTileSize);
+            const size_t tileSize = GetTileSize();
+            return numTiles * tileSize - (lastTileSize == 0 ? 0 : tileSize - lastTileSize);
+        }
+
+        // Returns the tile size index for tileSize, or kInvalidTileSizeIdx if it isn't supported.
+        static uint32_t GetTileSizeIdx(size_t tileSize)
+        {
+            for (uint32_t idx = 0; idx < kInvalidTileSizeIdx; ++idx)
+            {
+                if (tileSize != 0 && kTileSizes[idx] == tileSize)
+                    return idx;
+            }
+
+            return kInvalidTileSizeIdx;
         }
 
     private:
@@ -69,8 +118,9 @@ namespace GDeflate
 
         void SetUncompressedSize(size_t size)
         {
-            numTiles = static_cast<uint16_t>(size / kDefaultTileSize);
-            lastTileSize = static_cast<uint32_t>(size - numTiles * kDefaultTileSize);
+            const size_t tileSize = GetTileSize();
+            numTiles = static_cast<uint16_t>(size / tileSize);
+            lastTileSize = static_cast<uint32_t>(size - numTiles * tileSize);
 
             numTiles += lastTileSize != 0 ? 1 : 0;
         }
@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Topology.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+
+namespace GDeflate
+{
+#ifdef _WIN32
+    // Calls fn for each SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX of the relationship. Returns false
+    // if the information can't be read.
+    template <typename FN>
+    static bool ForEachProcessorRelation(LOGICAL_PROCESSOR_RELATIONSHIP relationship, FN&& fn)
+    {
+        DWORD size = 0;
+        if (GetLogicalProcessorInformationEx(relationship, nullptr, &size) ||
+            GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return false;
+
+        std::vector<uint8_t> buffer(size);
+        if (!GetLogicalProcessorInformationEx(
+                relationship,
+                reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()),
+                &size))
+            return false;
+
+        for (DWORD offset = 0; offset < size;)
+        {
+            auto const* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX const*>(&buffer[offset]);
+            fn(*info);
+            offset += info->Size;
+        }
+
+        return true;
+    }
+
+    // Adds the processors of mask to the set of their group, keeping the sets in group order.
+    static void AddToSets(std::vector<ProcessorSet>& sets, GROUP_AFFINITY const& mask)
+    {
+        auto it = std::find_if(
+            sets.begin(),
+            sets.end(),
+            [&](ProcessorSet const& set) { return set.group >= mask.Group; });
+
+        if (it == sets.end() || it->group != mask.Group)
+            it = sets.insert(it, ProcessorSet{mask.Group, 0});
+
+        it->mask |= mask.Mask;
+    }
+
+    // The cores, in the order Windows lists them. Each core's processors are in one group.
+    struct Core
+    {
+        GROUP_AFFINITY mask;
+        uint8_t efficiencyClass;
+    };
+
+    static std::vector<Core> GetCores()
+    {
+        std::vector<Core> cores;
+        ForEachProcessorRelation(
+            RelationProcessorCore,
+            [&](SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX const& info)
+            { cores.push_back({info.Processor.GroupMask[0], info.Processor.EfficiencyClass}); });
+        return cores;
+    }
+
+    // The processors of each NUMA node. Nodes can span groups, but are kept to their first here.
+    static std::vector<ProcessorSet> GetNodes()
+    {
+        std::vector<ProcessorSet> nodes;
+        ForEachProcessorRelation(
+            RelationNumaNode,
+            [&](SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX const& info)
+            { nodes.push_back({info.NumaNode.GroupMask.Group, info.NumaNode.GroupMask.Mask}); });
+        return nodes;
+    }
+
+    // Spreads the threads over the sets in turn.
+    static std::vector<ProcessorSet> Distribute(std::vector<ProcessorSet> const& sets, uint32_t numThreads)
+    {
+        std::vector<ProcessorSet> affinities;
+        if (sets.empty())
+            return affinities;
+
+        affinities.reserve(numThreads);
+        for (uint32_t i = 0; i < numThreads; ++i)
+            affinities.push_back(sets[i % sets.size()]);
+        return affinities;
+    }
+
+    std::vector<ProcessorSet> GetWorkerAffinities(WorkerPlacementSettings const& settings, uint32_t numThreads)
+    {
+        std::vector<ProcessorSet> sets;
+
+        switch (settings.placement)
+        {
+        case WorkerPlacement::Any:
+            break;
+
+        case WorkerPlacement::PerformanceCores:
+        {
+            // Higher efficiency classes are faster and use more power. On CPUs that aren't hybrid
+            // every core is in the same class, so the threads are left alone.
+            std::vector<Core> cores = GetCores();
+            auto isSlower = [](Core const& a, Core const& b) { return a.efficiencyClass < b.efficiencyClass; };
+            auto [slowest, fastest] = std::minmax_element(cores.begin(), cores.end(), isSlower);
+            if (cores.empty() || slowest->efficiencyClass == fastest->efficiencyClass)
+                break;
+
+            uint8_t const performanceClass = fastest->efficiencyClass;
+            for (Core const& core : cores)
+            {
+                if (core.efficiencyClass == performanceClass)
+                    AddToSets(sets, core.mask);
+            }
+            break;
+        }
+
+        case WorkerPlacement::SpreadNodes:
+        {
+            std::vector<ProcessorSet> nodes = GetNodes();
+            if (nodes.size() > 1)
+                sets = std::move(nodes);
+            break;
+        }
+
+        case WorkerPlacement::ReserveCores:
+        {
+            // If nothing would be left the threads share every core, as they would have anyway
+            std::vector<Core> cores = GetCores();
+            if (cores.size() <= settings.reservedCores)
+                break;
+
+            for (size_t i = settings.reservedCores; i < cores.size(); ++i)
+                AddToSets(sets, cores[i].mask);
+            break;
+        }
+        }
+
+        return Distribute(sets, numThreads);
+    }
+
+    void SetCurrentThreadAffinity(ProcessorSet const& set)
+    {
+        GROUP_AFFINITY affinity{};
+        affinity.Group = set.group;
+        affinity.Mask = static_cast<KAFFINITY>(set.mask);
+        SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+    }
+#else
+    std::vector<ProcessorSet> GetWorkerAffinities(WorkerPlacementSettings const&, uint32_t)
+    {
+        return {};
+    }
+
+    void SetCurrentThreadAffinity(ProcessorSet const&)
+    {
+    }
+#endif
+} // namespace GDeflate
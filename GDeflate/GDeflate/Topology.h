@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "GDeflate.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace GDeflate
+{
+    // Logical processors within one processor group. On Windows a thread can only be kept to the
+    // processors of one group at a time.
+    struct ProcessorSet
+    {
+        uint16_t group = 0;
+        uint64_t mask = 0;
+    };
+
+    // Returns the processors each of numThreads pool threads is to be kept to under settings, or
+    // nothing if the threads are to be left to the OS, which is the case for WorkerPlacement::Any,
+    // when the policy makes no difference on this machine, and on platforms other than Windows.
+    std::vector<ProcessorSet> GetWorkerAffinities(WorkerPlacementSettings const& settings, uint32_t numThreads);
+
+    // Keeps the calling thread to the processors in set.
+    void SetCurrentThreadAffinity(ProcessorSet const& set);
+} // namespace GDeflate
@@ -26,6 +26,11 @@
 #include <cstring>
 #include <limits>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define GDEFLATE_HAS_STREAMING_STORES 1
+#endif
+
 namespace GDeflate
 {
     template<int N, typename T>
@@ -79,4 +84,39 @@ namespace GDeflate
 
         return bits;
     }
+
+    // Copies size bytes with non-temporal stores, filling whole 64-byte lines where possible. Meant
+    // for destinations in write-combined memory, which must never be read back. The stores are
+    // fenced before returning.
+    static inline void StreamingCopy(uint8_t* dst, const uint8_t* src, size_t size)
+    {
+#ifdef GDEFLATE_HAS_STREAMING_STORES
+        constexpr size_t kLineSize = 64;
+
+        const size_t head = std::min(size, (kLineSize - reinterpret_cast<uintptr_t>(dst) % kLineSize) % kLineSize);
+        memcpy(dst, src, head);
+
+        dst += head;
+        src += head;
+        size -= head;
+
+        for (; size >= kLineSize; size -= kLineSize, dst += kLineSize, src += kLineSize)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+        }
+
+        memcpy(dst, src, size);
+        _mm_sfence();
+#else
+        memcpy(dst, src, size);
+#endif
+    }
 } // namespace GDeflate
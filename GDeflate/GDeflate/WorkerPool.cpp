@@ -0,0 +1,124 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <optional>
+
+namespace GDeflate
+{
+    WorkerPool::WorkerPool(uint32_t numThreads, std::vector<ProcessorSet> const& affinities)
+    {
+        m_threads.reserve(numThreads);
+
+        for (uint32_t i = 0; i < numThreads; ++i)
+        {
+            // Each thread moves itself before it allocates anything, so its per-thread state is
+            // allocated where it runs
+            std::optional<ProcessorSet> affinity;
+            if (i < affinities.size())
+                affinity = affinities[i];
+
+            m_threads.emplace_back(
+                [this, affinity]()
+                {
+                    if (affinity)
+                        SetCurrentThreadAffinity(*affinity);
+
+                    WorkerLoop();
+                });
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+
+        m_wake.notify_all();
+
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    void WorkerPool::Run(uint32_t parallelism, std::function<void()> const& job)
+    {
+        const uint32_t numHelpers = std::min(parallelism > 0 ? parallelism - 1 : 0, GetNumThreads());
+
+        if (numHelpers == 0)
+        {
+            job();
+            return;
+        }
+
+        Batch batch;
+        batch.job = &job;
+        batch.numQueued = numHelpers;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(&batch);
+        }
+
+        if (numHelpers == 1)
+            m_wake.notify_one();
+        else
+            m_wake.notify_all();
+
+        job();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // All work has been claimed by now, so helpers that haven't started have nothing to do.
+        if (batch.numQueued != 0)
+        {
+            batch.numQueued = 0;
+            m_queue.erase(std::find(m_queue.begin(), m_queue.end(), &batch));
+        }
+
+        batch.done.wait(lock, [&batch]() { return batch.numRunning == 0; });
+    }
+
+    void WorkerPool::WorkerLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (true)
+        {
+            m_wake.wait(lock, [this]() { return m_exit || !m_queue.empty(); });
+
+            if (m_exit)
+                break;
+
+            Batch* batch = m_queue.front();
+            if (--batch->numQueued == 0)
+                m_queue.pop_front();
+
+            ++batch->numRunning;
+
+            lock.unlock();
+            (*batch->job)();
+            lock.lock();
+
+            if (--batch->numRunning == 0)
+                batch->done.notify_all();
+        }
+    }
+} // namespace GDeflate
@@ -0,0 +1,75 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "GDeflate.h"
+#include "Topology.h"
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace GDeflate
+{
+    // A fixed set of long-lived threads that cooperatively run tile jobs. Each call to Run()
+    // invokes the same job on the calling thread and on a number of pool threads; the job is
+    // expected to pull work items from a shared counter until none are left. This is the Executor
+    // a Context uses unless it is given one.
+    class WorkerPool : public Executor
+    {
+    public:
+        // Thread i is kept to affinities[i], if there is one.
+        explicit WorkerPool(uint32_t numThreads, std::vector<ProcessorSet> const& affinities = {});
+        ~WorkerPool() override;
+
+        WorkerPool(WorkerPool const&) = delete;
+        WorkerPool& operator=(WorkerPool const&) = delete;
+
+        uint32_t GetNumThreads() const override
+        {
+            return static_cast<uint32_t>(m_threads.size());
+        }
+
+        // Invokes job on the calling thread and on up to (parallelism - 1) pool threads. Returns
+        // once every invocation has returned. Pool threads that have not picked up the job by the
+        // time the calling thread finishes are not started at all.
+        void Run(uint32_t parallelism, std::function<void()> const& job) override;
+
+    private:
+        struct Batch
+        {
+            std::function<void()> const* job = nullptr;
+            uint32_t numQueued = 0;
+            uint32_t numRunning = 0;
+            std::condition_variable done;
+        };
+
+        void WorkerLoop();
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<Batch*> m_queue;
+        std::vector<std::thread> m_threads;
+        bool m_exit = false;
+    };
+} // namespace GDeflate
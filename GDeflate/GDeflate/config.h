@@ -26,4 +26,7 @@ namespace GDeflate
     static constexpr uint8_t kGDeflateId = 4;
 
     static const size_t kDefaultTileSize = 64 * 1024; /*!< Default tile size */
+
+    static const size_t kMinTileSize = 16 * 1024; /*!< Smallest supported tile size */
+    static const size_t kMaxTileSize = 64 * 1024; /*!< Largest supported tile size */
 } // namespace GDeflate
\ No newline at end of file
@@ -0,0 +1,538 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <GDeflate.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Buffer = std::vector<uint8_t>;
+using Clock = std::chrono::high_resolution_clock;
+
+struct Input
+{
+    std::string name;
+    Buffer data;
+};
+
+struct Result
+{
+    std::string input;
+    uint32_t level;
+    uint32_t numThreads;
+    size_t tileSize;
+    size_t uncompressedSize;
+    size_t compressedSize;
+    double compressSpeed;
+    double decompressSpeed;
+};
+
+template<typename T>
+static void Append(Buffer& b, T const& value)
+{
+    const uint8_t* v = reinterpret_cast<const uint8_t*>(&value);
+    b.insert(b.end(), v, v + sizeof(value));
+}
+
+// Words drawn with a skewed distribution, which gives text-like symbol statistics and repeats.
+static Buffer GenerateText(std::default_random_engine& r, size_t size)
+{
+    static const char* const words[] = {
+        "the",    "of",      "and",     "to",       "in",      "is",     "that",    "for",     "it",
+        "as",     "with",    "was",     "on",       "be",      "by",     "this",    "which",   "are",
+        "from",   "or",      "texture", "shader",   "buffer",  "stream", "request", "queue",   "tile",
+        "memory", "storage", "compute", "pipeline", "resource", "upload", "level",  "decoder", "format",
+    };
+
+    std::geometric_distribution<size_t> word(0.12);
+    std::uniform_int_distribution<int> punctuation(0, 15);
+
+    Buffer b;
+    b.reserve(size + 16);
+
+    while (b.size() < size)
+    {
+        const char* w = words[std::min(word(r), std::size(words) - 1)];
+        b.insert(b.end(), w, w + strlen(w));
+
+        const int p = punctuation(r);
+        b.push_back(p == 0 ? '.' : p == 1 ? ',' : p == 2 ? '\n' : ' ');
+    }
+
+    b.resize(size);
+    return b;
+}
+
+// BC1 blocks of a smooth image: endpoints vary slowly from block to block, the per-texel
+// indices are close to random. Compresses about as poorly as real BCn data.
+static Buffer GenerateBCn(std::default_random_engine& r, size_t size)
+{
+    constexpr uint32_t blocksPerRow = 1024;
+
+    std::uniform_int_distribution<uint32_t> indices;
+    std::normal_distribution<float> noise(0.0f, 1.5f);
+
+    auto To565 = [](float red, float green, float blue)
+    {
+        auto Channel = [](float v, uint32_t bits)
+        { return static_cast<uint32_t>(std::clamp(v, 0.0f, 1.0f) * ((1u << bits) - 1) + 0.5f); };
+
+        return static_cast<uint16_t>(Channel(red, 5) << 11 | Channel(green, 6) << 5 | Channel(blue, 5));
+    };
+
+    Buffer b;
+    b.reserve(size + 8);
+
+    for (uint32_t block = 0; b.size() < size; ++block)
+    {
+        const float x = static_cast<float>(block % blocksPerRow) / blocksPerRow;
+        const float y = static_cast<float>(block / blocksPerRow % blocksPerRow) / blocksPerRow;
+
+        const float red = 0.5f + 0.4f * std::sin(x * 7.0f + noise(r) * 0.01f);
+        const float green = 0.5f + 0.4f * std::cos(y * 5.0f + noise(r) * 0.01f);
+        const float blue = 0.5f + 0.4f * std::sin((x + y) * 3.0f);
+
+        Append(b, To565(red + 0.1f, green + 0.1f, blue + 0.1f));
+        Append(b, To565(red - 0.1f, green - 0.1f, blue - 0.1f));
+        Append(b, indices(r));
+    }
+
+    b.resize(size);
+    return b;
+}
+
+// An interleaved vertex buffer (position, normal, uv) of a displaced grid followed by its index
+// buffer, repeated until the requested size is reached.
+static Buffer GenerateMesh(std::default_random_engine& r, size_t size)
+{
+    constexpr uint32_t gridSize = 256;
+
+    std::normal_distribution<float> noise(0.0f, 0.01f);
+
+    Buffer b;
+    b.reserve(size + gridSize * gridSize * 32);
+
+    while (b.size() < size)
+    {
+        for (uint32_t y = 0; y < gridSize; ++y)
+        {
+            for (uint32_t x = 0; x < gridSize; ++x)
+            {
+                const float u = static_cast<float>(x) / (gridSize - 1);
+                const float v = static_cast<float>(y) / (gridSize - 1);
+                const float height = 0.1f * std::sin(u * 12.0f) * std::cos(v * 9.0f) + noise(r);
+
+                const float position[3] = {u * 10.0f, height, v * 10.0f};
+                const float normal[3] = {-std::cos(u * 12.0f) * 0.12f, 1.0f, std::sin(v * 9.0f) * 0.09f};
+                const float uv[2] = {u, v};
+
+                Append(b, position);
+                Append(b, normal);
+                Append(b, uv);
+            }
+        }
+
+        for (uint32_t y = 0; y + 1 < gridSize; ++y)
+        {
+            for (uint32_t x = 0; x + 1 < gridSize; ++x)
+            {
+                const uint32_t i = y * gridSize + x;
+                const uint32_t triangles[6] = {i, i + gridSize, i + 1, i + 1, i + gridSize, i + gridSize + 1};
+
+                Append(b, triangles);
+            }
+        }
+    }
+
+    b.resize(size);
+    return b;
+}
+
+static Buffer GenerateRandom(std::default_random_engine& r, size_t size)
+{
+    std::uniform_int_distribution<uint32_t> value;
+
+    Buffer b;
+    b.reserve(size + 4);
+
+    while (b.size() < size)
+        Append(b, value(r));
+
+    b.resize(size);
+    return b;
+}
+
+static Buffer ReadEntireFileContent(std::filesystem::path const& path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+
+    if (!file.is_open())
+        throw std::runtime_error("Content file is not open");
+
+    Buffer contents(static_cast<size_t>(std::filesystem::file_size(path)));
+    file.read(reinterpret_cast<char*>(contents.data()), contents.size());
+
+    return contents;
+}
+
+// Runs fn repeatedly for at least minDuration and returns the throughput in MB/s of processing
+// numBytes per call.
+template<typename Fn>
+static double MeasureThroughput(size_t numBytes, Fn&& fn)
+{
+    constexpr auto minDuration = std::chrono::milliseconds(500);
+
+    uint32_t numIterations = 0;
+    auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+
+    do
+    {
+        if (!fn())
+            return 0.0;
+
+        ++numIterations;
+        elapsed = Clock::now() - start;
+    } while (elapsed < minDuration);
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    return (static_cast<double>(numBytes) * numIterations) / (seconds * 1024.0 * 1024.0);
+}
+
+static bool ParseList(const char* arg, std::vector<uint32_t>& values)
+{
+    values.clear();
+
+    std::istringstream s(arg);
+    std::string item;
+
+    while (std::getline(s, item, ','))
+    {
+        char* end = nullptr;
+        const unsigned long value = strtoul(item.c_str(), &end, 10);
+
+        if (item.empty() || *end != '\0')
+            return false;
+
+        values.push_back(static_cast<uint32_t>(value));
+    }
+
+    return !values.empty();
+}
+
+static bool GetTileSizeFlags(uint32_t tileSizeKiB, uint32_t& flags)
+{
+    switch (tileSizeKiB)
+    {
+    case 16:
+        flags = GDeflate::COMPRESS_TILE_SIZE_16K;
+        return true;
+    case 32:
+        flags = GDeflate::COMPRESS_TILE_SIZE_32K;
+        return true;
+    case 64:
+        flags = 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::string EscapeJson(std::string const& s)
+{
+    std::string escaped;
+
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            escaped.push_back('\\');
+
+        escaped.push_back(c);
+    }
+
+    return escaped;
+}
+
+static bool WriteJson(std::filesystem::path const& path, std::vector<Result> const& results)
+{
+    std::ofstream file(path);
+
+    if (!file.is_open())
+        return false;
+
+    file << "{\n  \"hardwareThreads\": " << std::thread::hardware_concurrency() << ",\n  \"results\": [\n";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        Result const& result = results[i];
+
+        file << "    {\"input\": \"" << EscapeJson(result.input) << "\", \"level\": " << result.level
+             << ", \"threads\": " << result.numThreads << ", \"tileSize\": " << result.tileSize
+             << ", \"uncompressedBytes\": " << result.uncompressedSize
+             << ", \"compressedBytes\": " << result.compressedSize << ", \"compressMBps\": " << std::fixed
+             << std::setprecision(1) << result.compressSpeed << ", \"decompressMBps\": " << result.decompressSpeed
+             << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+
+        file.unsetf(std::ios::floatfield);
+    }
+
+    file << "  ]\n}\n";
+
+    return file.good();
+}
+
+static void PrintUsage()
+{
+    std::cout << "Usage: GDeflateBench [options] [files...]\n\n"
+              << "  --inputs text,bcn,mesh,random  Generated input classes (default all, none if files are given)\n"
+              << "  --size <MiB>                   Size of each generated input (default 16)\n"
+              << "  --levels <list>                Compression levels (default 1,9,12)\n"
+              << "  --threads <list>               Thread counts (default 1 and all hardware threads)\n"
+              << "  --tiles <list>                 Tile sizes in KiB: 16, 32 or 64 (default 64)\n"
+              << "  --json <path>                  Also write the results as JSON\n"
+              << "  --placement <policy>           Worker placement: any, pcores, nodes or reserve (default any)\n";
+}
+
+static bool ParsePlacement(std::string const& value, GDeflate::WorkerPlacement& placement)
+{
+    if (value == "any")
+        placement = GDeflate::WorkerPlacement::Any;
+    else if (value == "pcores")
+        placement = GDeflate::WorkerPlacement::PerformanceCores;
+    else if (value == "nodes")
+        placement = GDeflate::WorkerPlacement::SpreadNodes;
+    else if (value == "reserve")
+        placement = GDeflate::WorkerPlacement::ReserveCores;
+    else
+        return false;
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const uint32_t hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::string> inputClasses;
+    std::vector<std::filesystem::path> files;
+    std::vector<uint32_t> levels = {1, 9, 12};
+    std::vector<uint32_t> threadCounts = {1, hardwareThreads};
+    std::vector<uint32_t> tileSizes = {64};
+    std::filesystem::path jsonPath;
+    GDeflate::WorkerPlacementSettings placement;
+    size_t inputSize = 16 * 1024 * 1024;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool valid = true;
+
+        if (arg == "--inputs" && value)
+        {
+            inputClasses.clear();
+
+            std::istringstream s(value);
+            for (std::string item; std::getline(s, item, ',');)
+                inputClasses.push_back(item);
+        }
+        else if (arg == "--size" && value)
+        {
+            std::vector<uint32_t> size;
+            valid = ParseList(value, size) && size.size() == 1 && size[0] > 0;
+            inputSize = valid ? size[0] * size_t(1024 * 1024) : 0;
+        }
+        else if (arg == "--levels" && value)
+            valid = ParseList(value, levels);
+        else if (arg == "--threads" && value)
+            valid = ParseList(value, threadCounts);
+        else if (arg == "--tiles" && value)
+            valid = ParseList(value, tileSizes);
+        else if (arg == "--json" && value)
+            jsonPath = value;
+        else if (arg == "--placement" && value)
+            valid = ParsePlacement(value, placement.placement);
+        else if (arg.rfind("--", 0) != 0)
+        {
+            files.push_back(arg);
+            continue;
+        }
+        else
+            valid = false;
+
+        if (!valid)
+        {
+            PrintUsage();
+            return -1;
+        }
+
+        ++i;
+    }
+
+    if (inputClasses.empty() && files.empty())
+        inputClasses = {"text", "bcn", "mesh", "random"};
+
+    std::sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    std::vector<Input> inputs;
+    std::default_random_engine r;
+
+    for (auto const& inputClass : inputClasses)
+    {
+        if (inputClass == "text")
+            inputs.push_back({inputClass, GenerateText(r, inputSize)});
+        else if (inputClass == "bcn")
+            inputs.push_back({inputClass, GenerateBCn(r, inputSize)});
+        else if (inputClass == "mesh")
+            inputs.push_back({inputClass, GenerateMesh(r, inputSize)});
+        else if (inputClass == "random")
+            inputs.push_back({inputClass, GenerateRandom(r, inputSize)});
+        else
+        {
+            std::cout << "Unknown input class: " << inputClass << "\n";
+            return -1;
+        }
+    }
+
+    for (auto const& file : files)
+        inputs.push_back({file.filename().string(), ReadEntireFileContent(file)});
+
+    auto row = [](auto&& input,
+                  auto&& level,
+                  auto&& threads,
+                  auto&& tileSize,
+                  auto&& ratio,
+                  auto&& compress,
+                  auto&& decompress)
+    {
+        std::cout << std::setw(12) << input              //
+                  << " |" << std::setw(6) << level       //
+                  << " |" << std::setw(8) << threads     //
+                  << " |" << std::setw(6) << tileSize    //
+                  << " |" << std::setw(7) << ratio       //
+                  << " |" << std::setw(14) << compress   //
+                  << " |" << std::setw(16) << decompress << std::endl;
+    };
+
+    row("Input", "Level", "Threads", "Tile", "Ratio", "Compress MB/s", "Decompress MB/s");
+
+    std::vector<Result> results;
+
+    for (uint32_t numThreads : threadCounts)
+    {
+        if (numThreads == 0)
+            continue;
+
+        // The calling thread always takes part, so the pool needs one thread less.
+        GDeflate::Context context(numThreads - 1, placement);
+
+        for (auto const& input : inputs)
+        {
+            if (input.data.empty())
+                continue;
+
+            for (uint32_t level : levels)
+            {
+                for (uint32_t tileSizeKiB : tileSizes)
+                {
+                    uint32_t flags = 0;
+
+                    if (!GetTileSizeFlags(tileSizeKiB, flags))
+                    {
+                        std::cout << "Unsupported tile size: " << tileSizeKiB << " KiB\n";
+                        return -1;
+                    }
+
+                    Buffer const& source = input.data;
+                    Buffer compressed(GDeflate::CompressBound(source.size(), flags));
+                    size_t compressedSize = 0;
+
+                    double compressSpeed = MeasureThroughput(
+                        source.size(),
+                        [&]()
+                        {
+                            compressedSize = compressed.size();
+                            return context.Compress(
+                                compressed.data(),
+                                &compressedSize,
+                                source.data(),
+                                source.size(),
+                                level,
+                                flags);
+                        });
+
+                    if (compressSpeed == 0.0)
+                    {
+                        std::cout << "Compression failed!\n";
+                        return -1;
+                    }
+
+                    Buffer decompressed(source.size());
+
+                    double decompressSpeed = MeasureThroughput(
+                        source.size(),
+                        [&]()
+                        {
+                            return context.Decompress(
+                                decompressed.data(),
+                                decompressed.size(),
+                                compressed.data(),
+                                compressedSize,
+                                numThreads);
+                        });
+
+                    if (decompressSpeed == 0.0 || memcmp(decompressed.data(), source.data(), source.size()) != 0)
+                    {
+                        std::cout << "Decompression failed!\n";
+                        return -1;
+                    }
+
+                    std::ostringstream ratio;
+                    ratio << std::fixed << std::setprecision(3) << static_cast<double>(source.size()) / compressedSize;
+
+                    row(input.name,
+                        level,
+                        numThreads,
+                        std::to_string(tileSizeKiB) + "K",
+                        ratio.str(),
+                        static_cast<uint64_t>(compressSpeed),
+                        static_cast<uint64_t>(decompressSpeed));
+
+                    results.push_back(
+                        {input.name,
+                         level,
+                         numThreads,
+                         GDeflate::GetTileSize(flags),
+                         source.size(),
+                         compressedSize,
+                         compressSpeed,
+                         decompressSpeed});
+                }
+            }
+        }
+    }
+
+    if (!jsonPath.empty() && !WriteJson(jsonPath, results))
+    {
+        std::cout << "Failed to write " << jsonPath.string() << "\n";
+        return -1;
+    }
+
+    return 0;
+}
@@ -5,15 +5,57 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <vector>
+
+using BufferVector = std::vector<std::vector<uint8_t>>;
 
 struct CompressedFileHeader
 {
     char Id[8]; // "GDEFLATE"
     size_t UncompressedSize = 0;
+    uint64_t ContentHash = 0; // ComputeContentHash of the uncompressed data
 };
 
-static void InitializeHeader(CompressedFileHeader* header, size_t uncompressedSize)
+static uint32_t MixContentHash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Folds in the size, which also tells apart contents that only differ by trailing zeros
+static uint64_t FinalizeContentHash(uint32_t sumA, uint32_t sumB, size_t size)
+{
+    uint32_t size32 = static_cast<uint32_t>(size);
+    return (uint64_t(MixContentHash(sumB ^ size32)) << 32) | MixContentHash(sumA + size32);
+}
+
+// Every dword of the zero padded content is mixed with its index and the mixes are summed,
+// so that GDeflateHash.hlsl can recompute the hash on the GPU with the dwords taken in any order
+static uint64_t ComputeContentHash(uint8_t const* data, size_t size)
+{
+    uint32_t sumA = 0;
+    uint32_t sumB = 0;
+    for (size_t offset = 0; offset < size; offset += 4)
+    {
+        uint32_t word = 0;
+        memcpy(&word, data + offset, std::min<size_t>(4, size - offset));
+
+        uint32_t index = static_cast<uint32_t>(offset / 4);
+        uint32_t a = MixContentHash(word + index * 0x9e3779b9);
+        sumA += a;
+        sumB += MixContentHash(a ^ index ^ 0x85ebca6b);
+    }
+    return FinalizeContentHash(sumA, sumB, size);
+}
+
+static void InitializeHeader(CompressedFileHeader* header, size_t uncompressedSize, uint64_t contentHash)
 {
     header->Id[0] = 'G';
     header->Id[1] = 'D';
@@ -24,15 +66,75 @@ static void InitializeHeader(CompressedFileHeader* header, size_t uncompressedSi
     header->Id[6] = 'T';
     header->Id[7] = 'E';
     header->UncompressedSize = uncompressedSize;
+    header->ContentHash = contentHash;
 }
 
 static bool IsValidHeader(CompressedFileHeader* header)
 {
     CompressedFileHeader expected{};
-    InitializeHeader(&expected, header->UncompressedSize);
+    InitializeHeader(&expected, header->UncompressedSize, header->ContentHash);
     return (memcmp(&expected, header, sizeof(expected)) == 0);
 }
 
+// A pack holds many compressed streams in one file, so that they load with a single read: a
+// PackFileHeader, NumEntries PackEntry records, a table of the entries' names (not terminated),
+// and then the streams, each starting on a kPackAlignment boundary.
+struct PackFileHeader
+{
+    char Id[8]; // "GDEFPACK"
+    uint32_t NumEntries = 0;
+    uint32_t NameTableSize = 0;
+};
+
+struct PackEntry
+{
+    uint64_t DataOffset; // From the start of the file
+    uint64_t CompressedSize;
+    uint64_t UncompressedSize;
+    uint64_t ContentHash; // ComputeContentHash of the uncompressed data
+    uint32_t NameOffset;  // Into the name table
+    uint32_t NameLength;
+};
+
+static constexpr uint64_t kPackAlignment = 256;
+
+static uint64_t AlignPackOffset(uint64_t offset)
+{
+    return (offset + kPackAlignment - 1) & ~(kPackAlignment - 1);
+}
+
+static void InitializePackHeader(PackFileHeader* header, uint32_t numEntries, uint32_t nameTableSize)
+{
+    memcpy(header->Id, "GDEFPACK", sizeof(header->Id));
+    header->NumEntries = numEntries;
+    header->NameTableSize = nameTableSize;
+}
+
+// Checks the header and that the index and every stream lie within the packSize bytes of the file
+inline bool IsValidPack(uint8_t const* pack, size_t packSize)
+{
+    if (packSize < sizeof(PackFileHeader))
+        return false;
+
+    auto header = reinterpret_cast<PackFileHeader const*>(pack);
+    if (memcmp(header->Id, "GDEFPACK", sizeof(header->Id)) != 0)
+        return false;
+
+    uint64_t namesOffset = sizeof(PackFileHeader) + uint64_t(header->NumEntries) * sizeof(PackEntry);
+    if (namesOffset + header->NameTableSize > packSize)
+        return false;
+
+    auto entries = reinterpret_cast<PackEntry const*>(pack + sizeof(PackFileHeader));
+    for (uint32_t i = 0; i < header->NumEntries; ++i)
+    {
+        auto& entry = entries[i];
+        if (entry.DataOffset > packSize || entry.CompressedSize > packSize - entry.DataOffset ||
+            uint64_t(entry.NameOffset) + entry.NameLength > header->NameTableSize)
+            return false;
+    }
+    return true;
+}
+
 #ifdef WIN32
 
 static std::filesystem::path GetModulePath()
@@ -0,0 +1,350 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "GpuCompressor.h"
+
+#include <TileStream.h>
+
+static std::vector<uint8_t> ReadShaderIfPresent(std::filesystem::path const& path)
+{
+    std::vector<uint8_t> contents;
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (file)
+    {
+        contents.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(contents.data()), contents.size());
+        if (!file)
+            contents.clear();
+    }
+    return contents;
+}
+
+GpuCompressor::GpuCompressor(
+    ID3D12Device* device,
+    DeviceInfo const& deviceInfo,
+    std::filesystem::path const& shaderPath)
+    : m_nextFenceValue(1)
+{
+    m_device.copy_from(device);
+    D3D12_COMMAND_QUEUE_DESC desc{};
+    desc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+    desc.Type = D3D12_COMMAND_LIST_TYPE_COMPUTE;
+    winrt::check_hresult(device->CreateCommandQueue(&desc, IID_PPV_ARGS(m_commandQueue.put())));
+
+    winrt::check_hresult(device->CreateCommandAllocator(desc.Type, IID_PPV_ARGS(m_commandAllocator.put())));
+
+    winrt::check_hresult(
+        device->CreateCommandList(0, desc.Type, m_commandAllocator.get(), nullptr, IID_PPV_ARGS(m_commandList.put())));
+
+    winrt::check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_fence.put())));
+
+    m_fenceEvent.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+    m_rootSignature = CreateRootSignature(device);
+
+    // The wave build takes its ballots with WaveActiveBallot, which needs all 32 threads of a
+    // group in one wave. The other build takes them through groupshared memory.
+    bool useWaveIntrinsics = deviceInfo.SupportsWaveIntrinsics && deviceInfo.SIMDWidth >= 32;
+    ShaderPermutation permutation{
+        useWaveIntrinsics ? L"GDeflateCompress_wave" : L"GDeflateCompress",
+        L"cs_6_0",
+        useWaveIntrinsics ? 32u : 0u,
+        32,
+        false};
+
+    auto byteCode = ReadShaderIfPresent(shaderPath.parent_path() / (permutation.Name + L".dxil"));
+    if (byteCode.empty())
+        byteCode = GpuDecompressor::CompileShader(shaderPath.parent_path() / L"GDeflateCompress.hlsl", permutation);
+
+    D3D12_COMPUTE_PIPELINE_STATE_DESC pipelineDesc{};
+    pipelineDesc.pRootSignature = m_rootSignature.get();
+    pipelineDesc.CS.pShaderBytecode = byteCode.data();
+    pipelineDesc.CS.BytecodeLength = byteCode.size();
+    winrt::check_hresult(m_device->CreateComputePipelineState(&pipelineDesc, IID_PPV_ARGS(m_pipelineState.put())));
+}
+
+BufferVector GpuCompressor::Compress(BufferVector const& uncompressedData, uint64_t batchInputSize)
+{
+    BufferVector compressedData;
+
+    size_t firstBuffer = 0;
+    while (firstBuffer < uncompressedData.size())
+    {
+        // Every batch takes at least one buffer, however large
+        size_t numBuffers = 0;
+        uint64_t inputSize = 0;
+        while (firstBuffer + numBuffers < uncompressedData.size() &&
+               (numBuffers == 0 || inputSize + uncompressedData[firstBuffer + numBuffers].size() <= batchInputSize))
+        {
+            inputSize += uncompressedData[firstBuffer + numBuffers].size();
+            ++numBuffers;
+        }
+
+        CompressBatch(uncompressedData, firstBuffer, numBuffers, compressedData);
+        firstBuffer += numBuffers;
+    }
+
+    return compressedData;
+}
+
+void GpuCompressor::CompressBatch(
+    BufferVector const& uncompressedData,
+    size_t firstBuffer,
+    size_t numBuffers,
+    BufferVector& compressedData)
+{
+    // The buffers are laid out back to back on dword boundaries, and tile i of the batch is
+    // written to i * kTileSize of the output
+    std::vector<TileEntry> tiles;
+    std::vector<uint64_t> inputOffsets;
+    uint64_t inputBufferSize = 0;
+    for (size_t b = firstBuffer; b < firstBuffer + numBuffers; ++b)
+    {
+        uint64_t size = uncompressedData[b].size();
+        if ((size + kTileSize - 1) / kTileSize > GDeflate::TileStream::kMaxTiles)
+            throw std::runtime_error("Buffer is too large for a single tile stream");
+
+        inputOffsets.push_back(inputBufferSize);
+        for (uint64_t offset = 0; offset < size; offset += kTileSize)
+        {
+            TileEntry tile{};
+            tile.InputOffset = static_cast<uint32_t>(inputBufferSize + offset);
+            tile.UncompressedSize = static_cast<uint32_t>(std::min<uint64_t>(kTileSize, size - offset));
+            tiles.push_back(tile);
+        }
+        inputBufferSize += DWORD_ALIGN(size);
+    }
+
+    uint32_t numTiles = static_cast<uint32_t>(tiles.size());
+    uint64_t outputBufferSize = uint64_t(numTiles) * kTileSize;
+    uint64_t controlBufferSize = sizeof(uint32_t) + tiles.size() * sizeof(TileEntry);
+
+    // A batch of empty buffers has nothing to dispatch, its streams are just headers
+    winrt::com_ptr<ID3D12Resource> readbackBuffer;
+    uint8_t* readbackData = nullptr;
+    if (numTiles != 0)
+    {
+        inputBufferSize += kInputPadding;
+        uint32_t numGroups = std::min(numTiles, kMaxGroups);
+
+        auto inputBuffer = CreateBuffer(
+            m_device.get(),
+            inputBufferSize,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            D3D12_RESOURCE_FLAG_NONE);
+        auto controlBuffer = CreateBuffer(
+            m_device.get(),
+            controlBufferSize,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        auto outputBuffer = CreateBuffer(
+            m_device.get(),
+            outputBufferSize,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        auto scratchBuffer = CreateBuffer(
+            m_device.get(),
+            numGroups * kScratchSizePerGroup,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        auto uploadBuffer = CreateBuffer(
+            m_device.get(),
+            inputBufferSize + controlBufferSize,
+            D3D12_HEAP_TYPE_UPLOAD,
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            D3D12_RESOURCE_FLAG_NONE);
+        readbackBuffer = CreateBuffer(
+            m_device.get(),
+            outputBufferSize + controlBufferSize,
+            D3D12_HEAP_TYPE_READBACK,
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            D3D12_RESOURCE_FLAG_NONE);
+
+        // The upload buffer holds the input followed by the control buffer
+        uint8_t* uploadData = nullptr;
+        winrt::check_hresult(uploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&uploadData)));
+        for (size_t i = 0; i < numBuffers; ++i)
+        {
+            auto& buffer = uncompressedData[firstBuffer + i];
+            memcpy(uploadData + inputOffsets[i], buffer.data(), buffer.size());
+        }
+
+        uint8_t* controlData = uploadData + inputBufferSize;
+        memcpy(controlData, &numTiles, sizeof(numTiles));
+        memcpy(controlData + sizeof(numTiles), tiles.data(), tiles.size() * sizeof(TileEntry));
+        uploadBuffer->Unmap(0, nullptr);
+
+        m_commandList->CopyBufferRegion(inputBuffer.get(), 0, uploadBuffer.get(), 0, inputBufferSize);
+        m_commandList->CopyBufferRegion(
+            controlBuffer.get(),
+            0,
+            uploadBuffer.get(),
+            inputBufferSize,
+            controlBufferSize);
+
+        D3D12_RESOURCE_BARRIER uploadBarriers[] = {
+            CD3DX12_RESOURCE_BARRIER::Transition(
+                inputBuffer.get(),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+            CD3DX12_RESOURCE_BARRIER::Transition(
+                controlBuffer.get(),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS)};
+        m_commandList->ResourceBarrier(_countof(uploadBarriers), uploadBarriers);
+
+        m_commandList->SetComputeRootSignature(m_rootSignature.get());
+        m_commandList->SetPipelineState(m_pipelineState.get());
+        m_commandList->SetComputeRootShaderResourceView(RootSRVInput, inputBuffer->GetGPUVirtualAddress());
+        m_commandList->SetComputeRootUnorderedAccessView(RootUAVControl, controlBuffer->GetGPUVirtualAddress());
+        m_commandList->SetComputeRootUnorderedAccessView(RootUAVOutput, outputBuffer->GetGPUVirtualAddress());
+        m_commandList->SetComputeRootUnorderedAccessView(RootUAVScratch, scratchBuffer->GetGPUVirtualAddress());
+        m_commandList->SetComputeRoot32BitConstant(RootConstantNumGroups, numGroups, 0);
+        m_commandList->Dispatch(numGroups, 1, 1);
+
+        D3D12_RESOURCE_BARRIER readbackBarriers[] = {
+            CD3DX12_RESOURCE_BARRIER::Transition(
+                outputBuffer.get(),
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                D3D12_RESOURCE_STATE_COPY_SOURCE),
+            CD3DX12_RESOURCE_BARRIER::Transition(
+                controlBuffer.get(),
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                D3D12_RESOURCE_STATE_COPY_SOURCE)};
+        m_commandList->ResourceBarrier(_countof(readbackBarriers), readbackBarriers);
+
+        m_commandList->CopyBufferRegion(readbackBuffer.get(), 0, outputBuffer.get(), 0, outputBufferSize);
+        m_commandList->CopyBufferRegion(
+            readbackBuffer.get(),
+            outputBufferSize,
+            controlBuffer.get(),
+            0,
+            controlBufferSize);
+        ExecuteCommandListSynchronously();
+
+        winrt::check_hresult(readbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&readbackData)));
+        memcpy(tiles.data(), readbackData + outputBufferSize + sizeof(uint32_t), tiles.size() * sizeof(TileEntry));
+    }
+
+    // Each stream gets a header and tile table like the ones GDeflate::Compress writes
+    size_t firstTile = 0;
+    for (size_t b = firstBuffer; b < firstBuffer + numBuffers; ++b)
+    {
+        GDeflate::TileStream header(uncompressedData[b].size());
+
+        std::vector<uint32_t> tilePtrs(header.numTiles);
+        uint64_t dataSize = 0;
+        bool storedAny = false;
+        for (uint32_t t = 0; t < header.numTiles; ++t)
+        {
+            auto const& tile = tiles[firstTile + t];
+            tilePtrs[t] = static_cast<uint32_t>(dataSize);
+            dataSize += tile.CompressedSize;
+            storedAny |= tile.CompressedSize == tile.UncompressedSize;
+        }
+
+        // tilePtrs[0] holds the size of the last tile, the others are offsets to the tile data
+        if (header.numTiles != 0)
+            tilePtrs[0] = tiles[firstTile + header.numTiles - 1].CompressedSize;
+
+        // Streams without stored tiles are left unmarked so that any decoder can read them
+        header.storedTiles = storedAny ? 1 : 0;
+
+        std::vector<uint8_t> stream(header.GetDataOffset() + dataSize);
+        memcpy(stream.data(), &header, sizeof(header));
+        memcpy(stream.data() + sizeof(header), tilePtrs.data(), tilePtrs.size() * sizeof(uint32_t));
+
+        uint8_t* data = stream.data() + header.GetDataOffset();
+        for (uint32_t t = 0; t < header.numTiles; ++t)
+        {
+            auto const& tile = tiles[firstTile + t];
+            memcpy(data, readbackData + (firstTile + t) * kTileSize, tile.CompressedSize);
+            data += tile.CompressedSize;
+        }
+
+        compressedData.push_back(std::move(stream));
+        firstTile += header.numTiles;
+    }
+
+    if (readbackBuffer)
+        readbackBuffer->Unmap(0, nullptr);
+}
+
+std::unique_ptr<GpuCompressor> GpuCompressor::Create(
+    ID3D12Device* device,
+    DeviceInfo const& deviceInfo,
+    std::filesystem::path const& shaderPath)
+{
+    return std::make_unique<GpuCompressor>(device, deviceInfo, shaderPath);
+}
+
+void GpuCompressor::ExecuteCommandListSynchronously()
+{
+    m_commandList->Close();
+    ID3D12CommandList* commandLists[] = {m_commandList.get()};
+    m_commandQueue->ExecuteCommandLists(1, commandLists);
+    m_commandQueue->Signal(m_fence.get(), m_nextFenceValue);
+
+    m_fence->SetEventOnCompletion(m_nextFenceValue++, m_fenceEvent.get());
+    m_fenceEvent.wait();
+
+    m_commandAllocator->Reset();
+    m_commandList->Reset(m_commandAllocator.get(), nullptr);
+}
+
+winrt::com_ptr<ID3D12Resource> GpuCompressor::CreateBuffer(
+    ID3D12Device* device,
+    uint64_t size,
+    D3D12_HEAP_TYPE heapType,
+    D3D12_RESOURCE_STATES initialState,
+    D3D12_RESOURCE_FLAGS flags)
+{
+    winrt::com_ptr<ID3D12Resource> buffer;
+    auto bufferHeapProps = CD3DX12_HEAP_PROPERTIES(heapType);
+    auto bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(size, flags);
+    winrt::check_hresult(device->CreateCommittedResource(
+        &bufferHeapProps,
+        D3D12_HEAP_FLAG_NONE,
+        &bufferDesc,
+        initialState,
+        nullptr,
+        IID_PPV_ARGS(buffer.put())));
+    return buffer;
+}
+
+winrt::com_ptr<ID3D12RootSignature> GpuCompressor::CreateRootSignature(ID3D12Device* device)
+{
+    winrt::com_ptr<ID3D12RootSignature> rootSignature;
+    std::vector<CD3DX12_ROOT_PARAMETER1> rootParameters(RootParametersCount);
+
+    rootParameters[RootSRVInput].InitAsShaderResourceView(0);
+    rootParameters[RootUAVControl].InitAsUnorderedAccessView(0);
+    rootParameters[RootUAVOutput].InitAsUnorderedAccessView(1);
+    rootParameters[RootUAVScratch].InitAsUnorderedAccessView(2);
+    rootParameters[RootConstantNumGroups].InitAsConstants(1, 0);
+
+    CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC computeRootSignatureDesc;
+    computeRootSignatureDesc.Init_1_1(static_cast<uint32_t>(rootParameters.size()), rootParameters.data(), 0, nullptr);
+
+    winrt::com_ptr<ID3DBlob> signature;
+    winrt::check_hresult(D3DX12SerializeVersionedRootSignature(
+        &computeRootSignatureDesc,
+        D3D_ROOT_SIGNATURE_VERSION_1_1,
+        signature.put(),
+        nullptr));
+
+    winrt::check_hresult(device->CreateRootSignature(
+        0,
+        signature->GetBufferPointer(),
+        signature->GetBufferSize(),
+        IID_PPV_ARGS(rootSignature.put())));
+
+    return rootSignature;
+}
@@ -0,0 +1,95 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "GpuDecompressor.h"
+
+#ifdef WIN32
+
+// Compresses buffers into GDeflate tile streams on the GPU with GDeflateCompress.hlsl, for
+// content that is generated at runtime. The kernel only finds greedy matches and codes them
+// with the fixed Huffman codes, so the streams come out larger than with GDeflate::Compress,
+// but every GDeflate decoder reads them.
+class GpuCompressor
+{
+    winrt::com_ptr<ID3D12Device> m_device;
+    winrt::com_ptr<ID3D12CommandQueue> m_commandQueue;
+    winrt::com_ptr<ID3D12CommandAllocator> m_commandAllocator;
+    winrt::com_ptr<ID3D12GraphicsCommandList> m_commandList;
+
+    winrt::com_ptr<ID3D12Fence> m_fence;
+    uint64_t m_nextFenceValue;
+    wil::unique_event m_fenceEvent;
+
+    winrt::com_ptr<ID3D12RootSignature> m_rootSignature;
+    winrt::com_ptr<ID3D12PipelineState> m_pipelineState;
+
+    enum RootParameters : uint32_t
+    {
+        RootSRVInput = 0,
+        RootUAVControl,
+        RootUAVOutput,
+        RootUAVScratch,
+        RootConstantNumGroups,
+        RootParametersCount
+    };
+
+    // Follows the tile count in the control buffer, see GDeflateCompress.hlsl
+    struct TileEntry
+    {
+        uint32_t InputOffset;
+        uint32_t UncompressedSize;
+        uint32_t CompressedSize; // Written by the kernel, equal to UncompressedSize for a stored tile
+    };
+
+    // The kernel writes tile i at i * kTileSize in the output buffer
+    static constexpr uint32_t kTileSize = 64 * 1024;
+
+    // Each group keeps the symbols of the tile it's on in the scratch buffer, so a dispatch is
+    // capped at kMaxGroups groups, which loop over the tiles
+    static constexpr uint32_t kMaxGroups = 256;
+    static constexpr uint64_t kScratchSizePerGroup = kTileSize * sizeof(uint32_t);
+
+    // Matching reads up to 7 bytes past the end of the input
+    static constexpr uint64_t kInputPadding = 8;
+
+public:
+    // Compress dispatches the buffers in batches of about kBatchInputSize bytes
+    static constexpr uint64_t kBatchInputSize = 64 * 1024 * 1024;
+
+    GpuCompressor(ID3D12Device* device, DeviceInfo const& deviceInfo, std::filesystem::path const& shaderPath);
+
+    // Returns a tile stream of 64 KiB tiles for each buffer, in the format that GDeflate::Compress
+    // writes. A buffer must fit in TileStream::kMaxTiles tiles.
+    BufferVector Compress(BufferVector const& uncompressedData, uint64_t batchInputSize = kBatchInputSize);
+
+    // Loads GDeflateCompress.dxil, or GDeflateCompress_wave.dxil on GPUs with waves of at least
+    // 32 lanes, from next to shaderPath. GDeflateCompress.hlsl is compiled if neither is there.
+    static std::unique_ptr<GpuCompressor> Create(
+        ID3D12Device* device,
+        DeviceInfo const& deviceInfo,
+        std::filesystem::path const& shaderPath);
+
+private:
+    void CompressBatch(
+        BufferVector const& uncompressedData,
+        size_t firstBuffer,
+        size_t numBuffers,
+        BufferVector& compressedData);
+
+    void ExecuteCommandListSynchronously();
+
+    static winrt::com_ptr<ID3D12Resource> CreateBuffer(
+        ID3D12Device* device,
+        uint64_t size,
+        D3D12_HEAP_TYPE heapType,
+        D3D12_RESOURCE_STATES initialState,
+        D3D12_RESOURCE_FLAGS flags);
+
+    static winrt::com_ptr<ID3D12RootSignature> CreateRootSignature(ID3D12Device* device);
+};
+
+#endif
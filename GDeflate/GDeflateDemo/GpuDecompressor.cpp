@@ -7,9 +7,88 @@
 
 #include "CompressedFile.h"
 
-GpuDecompressor::GpuDecompressor(ID3D12Device* device, DeviceInfo deviceInfo, std::filesystem::path const& shaderPath)
+// Matches NUM_BITSTREAMS in GDeflate.hlsl
+static constexpr uint32_t kShaderNumThreads = 32;
+
+// Placed buffers start on 64KB boundaries
+static uint64_t AlignPlacement(uint64_t size)
+{
+    return (size + D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT - 1) & ~(D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT - 1);
+}
+
+// Upload heaps are write-combined, so the staging copy bypasses the cache with non-temporal
+// stores where they are available
+static void CopyToUploadHeap(uint8_t* destination, uint8_t const* source, size_t size)
+{
+#if defined(_M_X64) || defined(__SSE2__)
+    size_t head = std::min(size, size_t(-reinterpret_cast<uintptr_t>(destination) & 15));
+    memcpy(destination, source, head);
+
+    size_t offset = head;
+    for (; offset + 16 <= size; offset += 16)
+    {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<__m128i const*>(source + offset));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination + offset), data);
+    }
+    memcpy(destination + offset, source + offset, size - offset);
+    _mm_sfence();
+#else
+    memcpy(destination, source, size);
+#endif
+}
+
+// numTiles from the header of the tile stream that follows the CompressedFileHeader, see TileStream.h
+static uint32_t GetNumTiles(std::vector<uint8_t> const& compressedData)
+{
+    uint16_t numTiles = 0;
+    memcpy(&numTiles, compressedData.data() + sizeof(CompressedFileHeader) + 2, sizeof(numTiles));
+    return numTiles;
+}
+
+static std::vector<uint8_t> ReadFileIfPresent(std::filesystem::path const& path)
+{
+    std::vector<uint8_t> contents;
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (file)
+    {
+        contents.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(contents.data()), contents.size());
+        if (!file)
+            contents.clear();
+    }
+    return contents;
+}
+
+// Cache writes are best effort, a read-only install directory just means nothing is cached
+static void WriteCacheFile(std::filesystem::path const& path, void const* data, size_t size)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(static_cast<char const*>(data), size);
+}
+
+GpuDecompressor::GpuDecompressor(
+    ID3D12Device* device,
+    DeviceInfo deviceInfo,
+    std::filesystem::path const& shaderPath,
+    bool profile)
     : m_nextFenceValue(1)
-    , m_dispatchSize((deviceInfo.SIMDLaneCount / deviceInfo.SIMDWidth) * 8)
+    , m_shaderPath(shaderPath)
+    , m_deviceInfo(deviceInfo)
+    , m_numSIMDs(deviceInfo.SIMDLaneCount / deviceInfo.SIMDWidth)
+    , m_dispatchSize(m_numSIMDs * kDefaultGroupsPerSIMD)
+    , m_nextUploadFenceValue(1)
+    , m_nextReadbackFenceValue(1)
+    , m_profile(profile)
+    , m_tilesPerGroup(1)
+    , m_timestampFrequency(0)
+    , m_batches(kMaxBatchesInFlight)
+    , m_residentDecodes(kMaxBatchesInFlight)
+    , m_nextResidentDecode(0)
+    , m_bufferPoolLimit(kDefaultBufferPoolLimit)
+    , m_bufferPoolSize(0)
 {
     m_device.copy_from(device);
     D3D12_COMMAND_QUEUE_DESC desc{};
@@ -24,130 +103,1415 @@ GpuDecompressor::GpuDecompressor(ID3D12Device* device, DeviceInfo deviceInfo, st
 
     winrt::check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_fence.put())));
 
-    m_fenceEvent.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_fenceEvent.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+    D3D12_COMMAND_QUEUE_DESC copyDesc{};
+    copyDesc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+    copyDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+    winrt::check_hresult(device->CreateCommandQueue(&copyDesc, IID_PPV_ARGS(m_uploadQueue.put())));
+    winrt::check_hresult(device->CreateCommandQueue(&copyDesc, IID_PPV_ARGS(m_readbackQueue.put())));
+
+    winrt::check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_uploadFence.put())));
+    winrt::check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_readbackFence.put())));
+
+    // Command lists are created open, each batch resets its own before recording
+    auto createCommandList = [&](D3D12_COMMAND_LIST_TYPE type,
+                                 winrt::com_ptr<ID3D12CommandAllocator>& allocator,
+                                 winrt::com_ptr<ID3D12GraphicsCommandList>& commandList)
+    {
+        winrt::check_hresult(device->CreateCommandAllocator(type, IID_PPV_ARGS(allocator.put())));
+        winrt::check_hresult(
+            device->CreateCommandList(0, type, allocator.get(), nullptr, IID_PPV_ARGS(commandList.put())));
+        winrt::check_hresult(commandList->Close());
+    };
+
+    for (auto& batch : m_batches)
+    {
+        createCommandList(D3D12_COMMAND_LIST_TYPE_COPY, batch.UploadAllocator, batch.UploadList);
+        createCommandList(D3D12_COMMAND_LIST_TYPE_COMPUTE, batch.ComputeAllocator, batch.ComputeList);
+        createCommandList(D3D12_COMMAND_LIST_TYPE_COPY, batch.ReadbackAllocator, batch.ReadbackList);
+    }
+
+    for (auto& decode : m_residentDecodes)
+        createCommandList(D3D12_COMMAND_LIST_TYPE_COMPUTE, decode.Allocator, decode.CommandList);
+
+    m_rootSignature = CreateRootSignature(device);
+
+    // Batches decode through ExecuteIndirect, which sets the scratch epoch and dispatches,
+    // so that a slot's compute list can be submitted again with new arguments
+    D3D12_INDIRECT_ARGUMENT_DESC decodeArguments[2]{};
+    decodeArguments[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT;
+    decodeArguments[0].Constant.RootParameterIndex = RootConstantScratchEpoch;
+    decodeArguments[0].Constant.DestOffsetIn32BitValues = 0;
+    decodeArguments[0].Constant.Num32BitValuesToSet = 1;
+    decodeArguments[1].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DISPATCH;
+
+    D3D12_COMMAND_SIGNATURE_DESC commandSignatureDesc{};
+    commandSignatureDesc.ByteStride = sizeof(DecodeArguments);
+    commandSignatureDesc.NumArgumentDescs = _countof(decodeArguments);
+    commandSignatureDesc.pArgumentDescs = decodeArguments;
+    winrt::check_hresult(device->CreateCommandSignature(
+        &commandSignatureDesc,
+        m_rootSignature.get(),
+        IID_PPV_ARGS(m_decodeCommandSignature.put())));
+
+    // A dispatch size tuned earlier for this adapter and driver replaces the default
+    m_dispatchSizeCachePath = shaderPath.parent_path() / L"ShaderCache" /
+                              (L"DispatchSize_" + GetShaderCacheKey(deviceInfo) + L".txt");
+    std::ifstream dispatchSizeFile(m_dispatchSizeCachePath);
+    uint32_t tunedDispatchSize = 0;
+    if (dispatchSizeFile >> tunedDispatchSize && tunedDispatchSize > 0)
+        m_dispatchSize = std::min(tunedDispatchSize, GetMaxDispatchSize());
+
+    ShaderPermutation permutation = SelectShaderPermutation(deviceInfo);
+    m_permutation = permutation;
+
+    // The persistent kernel used by DecompressStreaming is built from the same permutation
+    ShaderPermutation persistentPermutation = permutation;
+    persistentPermutation.Name += L"_persistent";
+    persistentPermutation.Persistent = true;
+
+    if (m_profile)
+    {
+        permutation.Name += L"_profile";
+        permutation.Profile = true;
+    }
+
+    auto byteCode = LoadShader(shaderPath, deviceInfo, permutation);
+    std::wcout << L"Shader permutation " << permutation.Name << L" loaded, bytecode size = " << byteCode.size()
+               << L" bytes\n";
+    m_pipelineState = CreatePipelineState(GetPipelineCachePath(permutation), byteCode);
+    m_tilesPerGroup = permutation.NumThreads / kShaderNumThreads;
+
+    byteCode = LoadShader(shaderPath, deviceInfo, persistentPermutation);
+    m_persistentPipelineState = CreatePipelineState(GetPipelineCachePath(persistentPermutation), byteCode);
+
+    // The hash kernel that checks Benchmark's output has a single build for every device
+    ShaderPermutation hashPermutation{L"hash", L"cs_6_0", 0, kShaderNumThreads, false};
+    byteCode = ReadFileIfPresent(shaderPath.parent_path() / L"GDeflateHash.dxil");
+    if (byteCode.empty())
+        byteCode = CompileShader(shaderPath.parent_path() / L"GDeflateHash.hlsl", hashPermutation);
+    m_hashPipelineState = CreatePipelineState(GetPipelineCachePath(hashPermutation), byteCode);
+
+    D3D12_DESCRIPTOR_HEAP_DESC descriptorHeapDesc{};
+    descriptorHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+    descriptorHeapDesc.NumDescriptors = 2 * kMaxBatchesInFlight; // One scratch buffer view per batch and resident slot
+    descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+    winrt::check_hresult(m_device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(m_gpuVisibleDescHeap.put())));
+
+    descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
+    winrt::check_hresult(m_device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(m_cpuVisibleDescHeap.put())));
+
+    if (m_profile)
+    {
+        // Two timestamps around the dispatch of every batch in flight
+        D3D12_QUERY_HEAP_DESC queryHeapDesc{};
+        queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+        queryHeapDesc.Count = 2 * kMaxBatchesInFlight;
+        winrt::check_hresult(m_device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(m_timestampQueryHeap.put())));
+        winrt::check_hresult(m_commandQueue->GetTimestampFrequency(&m_timestampFrequency));
+
+        for (auto& batch : m_batches)
+        {
+            batch.ProfileBuffer = CreateBuffer(
+                device,
+                GetProfileBufferSize(),
+                D3D12_HEAP_TYPE_DEFAULT,
+                D3D12_RESOURCE_STATE_COMMON,
+                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+            batch.ProfileReadbackBuffer = CreateBuffer(
+                device,
+                2 * sizeof(uint64_t) + GetProfileBufferSize(),
+                D3D12_HEAP_TYPE_READBACK,
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                D3D12_RESOURCE_FLAG_NONE);
+        }
+    }
+}
+
+std::vector<GpuDecompressor::Stream> GpuDecompressor::LayoutStreams(
+    BufferVector const& compressedData,
+    size_t firstStream,
+    size_t numStreams,
+    uint64_t& inputBufferSize,
+    uint64_t& outputBufferSize)
+{
+    std::vector<Stream> streams;
+    streams.reserve(numStreams);
+
+    inputBufferSize = 0;
+    outputBufferSize = 0;
+
+    // Construct stream entries for the control buffer from the compressed data in the range
+    Stream stream{};
+    for (size_t s = firstStream; s < firstStream + numStreams; ++s)
+    {
+        streams.push_back(stream);
+        CompressedFileHeader const* header = reinterpret_cast<CompressedFileHeader const*>(compressedData[s].data());
+        uint32_t compressedSize = static_cast<uint32_t>(compressedData[s].size() - sizeof(CompressedFileHeader));
+        uint32_t uncompressedSize = static_cast<uint32_t>(header->UncompressedSize);
+
+        inputBufferSize = stream.InputOffset + compressedSize;
+        outputBufferSize = stream.OutputOffset + uncompressedSize;
+
+        stream.InputOffset = DWORD_ALIGN(stream.InputOffset + compressedSize);
+        stream.OutputOffset = DWORD_ALIGN(stream.OutputOffset + uncompressedSize);
+    }
+
+    return streams;
+}
+
+BufferVector GpuDecompressor::Decompress(BufferVector const& compressedData, uint64_t batchInputSize)
+{
+    // Split the streams into batches, a stream larger than batchInputSize gets a batch of its own
+    std::vector<std::pair<size_t, size_t>> batches;
+    size_t firstStream = 0;
+    uint64_t currentBatchSize = 0;
+    for (size_t s = 0; s < compressedData.size(); ++s)
+    {
+        uint64_t compressedSize = compressedData[s].size() - sizeof(CompressedFileHeader);
+        if (s > firstStream && currentBatchSize + compressedSize > batchInputSize)
+        {
+            batches.emplace_back(firstStream, s - firstStream);
+            firstStream = s;
+            currentBatchSize = 0;
+        }
+        currentBatchSize += DWORD_ALIGN(compressedSize);
+    }
+    if (firstStream < compressedData.size())
+        batches.emplace_back(firstStream, compressedData.size() - firstStream);
+
+    std::cout << "GPU decompression of " << compressedData.size() << " streams in " << batches.size()
+              << " batches, up to " << kMaxBatchesInFlight << " in flight\n\n";
+
+    // Batch N + 1 uploads while batch N decodes and batch N - 1 reads back. A slot is only
+    // refilled once the batch it held has been read back.
+    BufferVector uncompressedData(compressedData.size());
+    for (size_t b = 0; b < batches.size(); ++b)
+    {
+        uint32_t batchIndex = static_cast<uint32_t>(b % m_batches.size());
+        CompleteBatch(m_batches[batchIndex], compressedData, uncompressedData);
+        SubmitBatch(batchIndex, compressedData, batches[b].first, batches[b].second);
+    }
+
+    for (size_t b = batches.size(); b < batches.size() + m_batches.size(); ++b)
+        CompleteBatch(m_batches[b % m_batches.size()], compressedData, uncompressedData);
+
+    return uncompressedData;
+}
+
+void GpuDecompressor::StageBatch(
+    uint32_t batchIndex,
+    BufferVector const& compressedData,
+    size_t firstStream,
+    size_t numStreams,
+    uint64_t& inputBufferSize,
+    uint64_t& outputBufferSize,
+    uint64_t& controlBufferSize,
+    bool hashOutput)
+{
+    Batch& batch = m_batches[batchIndex];
+
+    batch.FirstStream = firstStream;
+    batch.Streams = LayoutStreams(compressedData, firstStream, numStreams, inputBufferSize, outputBufferSize);
+
+    controlBufferSize = CalculateControlBufferSize(numStreams) + (hashOutput ? numStreams * sizeof(HashEntry) : 0);
+
+    uint64_t numTiles = 0;
+    for (size_t s = firstStream; s < firstStream + numStreams; ++s)
+        numTiles += GetNumTiles(compressedData[s]);
+    batch.DispatchSize = GetDispatchSize(numTiles);
+    uint64_t scratchBufferSize = GetRequiredScratchBufferSize(static_cast<uint16_t>(numStreams));
+
+    if (inputBufferSize > batch.InputCapacity || outputBufferSize > batch.OutputCapacity ||
+        controlBufferSize > batch.ControlCapacity || scratchBufferSize > batch.ScratchCapacity)
+    {
+        AllocateBatchBuffers(batch, inputBufferSize, outputBufferSize, controlBufferSize, scratchBufferSize);
+
+        std::cout << "GPU decompression buffer sizes for batch slot " << batchIndex
+                  << (batch.Transient ? " (over the pool limit)\n" : "\n");
+        std::cout << "Input Buffer:   " << batch.InputCapacity << " bytes\n";
+        std::cout << "Control Buffer: " << batch.ControlCapacity << " bytes\n";
+        std::cout << "Scratch Buffer: " << batch.ScratchCapacity << " bytes\n";
+        std::cout << "Output Buffer:  " << batch.OutputCapacity << " bytes\n";
+        std::cout << "Buffer Pool:    " << m_bufferPoolSize << " of " << m_bufferPoolLimit << " bytes\n\n";
+    }
+    Buffers& buffers = batch.Resources;
+
+    // Copy compressed data into upload buffer, in chunks spread over worker threads once the
+    // batch is large enough for one thread's copy to hold up the upload
+    uint8_t* uploadBuffer = nullptr;
+    winrt::check_hresult(buffers.UploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&uploadBuffer)));
+
+    struct CopyChunk
+    {
+        uint8_t* Destination;
+        uint8_t const* Source;
+        size_t Size;
+    };
+    std::vector<CopyChunk> chunks;
+    for (size_t s = 0; s < batch.Streams.size(); ++s)
+    {
+        auto& data = compressedData[firstStream + s];
+        uint8_t* destination = uploadBuffer + batch.Streams[s].InputOffset;
+        uint8_t const* source = data.data() + sizeof(CompressedFileHeader);
+        size_t size = data.size() - sizeof(CompressedFileHeader);
+        for (size_t offset = 0; offset < size; offset += kStagingChunkSize)
+            chunks.push_back({destination + offset, source + offset, std::min(kStagingChunkSize, size - offset)});
+    }
+
+    uint32_t numWorkers = inputBufferSize < kParallelStagingSize
+                              ? 1
+                              : std::min<uint32_t>(kMaxStagingThreads, std::thread::hardware_concurrency());
+    std::atomic<size_t> nextChunk = 0;
+    auto copyChunks = [&]()
+    {
+        for (size_t c = nextChunk++; c < chunks.size(); c = nextChunk++)
+            CopyToUploadHeap(chunks[c].Destination, chunks[c].Source, chunks[c].Size);
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t w = 1; w < numWorkers; ++w)
+        workers.emplace_back(copyChunks);
+    copyChunks();
+    for (auto& worker : workers)
+        worker.join();
+
+    // CSMain takes streams from the last control buffer entry to the first, with every group
+    // claiming tiles of the same stream until it runs out. The entries are ordered by tile
+    // count, smallest first, so that the largest streams are decoded while all the groups are
+    // busy and the end of the dispatch is left with the shortest ones. batch.Streams keeps
+    // the file order that readback uses.
+    std::vector<uint32_t> order(batch.Streams.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(
+        order.begin(),
+        order.end(),
+        [&](uint32_t a, uint32_t b)
+        { return GetNumTiles(compressedData[firstStream + a]) < GetNumTiles(compressedData[firstStream + b]); });
+
+    // Copy control buffer into upload buffer
+    uint32_t* controlData = reinterpret_cast<uint32_t*>(uploadBuffer + inputBufferSize);
+    *controlData = static_cast<uint32_t>(batch.Streams.size());
+    Stream* streamEntries = reinterpret_cast<Stream*>(controlData + 1);
+    for (size_t i = 0; i < order.size(); ++i)
+        streamEntries[i] = batch.Streams[order[i]];
+
+    // The decoder ignores the hash entries past the streams, which stay in file order and
+    // have their sums start at zero
+    if (hashOutput)
+    {
+        auto hashEntries = reinterpret_cast<HashEntry*>(
+            uploadBuffer + inputBufferSize + CalculateControlBufferSize(batch.Streams.size()));
+        for (size_t s = 0; s < batch.Streams.size(); ++s)
+        {
+            auto header = reinterpret_cast<CompressedFileHeader const*>(compressedData[firstStream + s].data());
+            hashEntries[s] = {batch.Streams[s].OutputOffset, static_cast<uint32_t>(header->UncompressedSize), 0, 0};
+        }
+    }
+
+    buffers.UploadBuffer->Unmap(0, nullptr);
+}
+
+void GpuDecompressor::RecordBatchUpload(
+    Batch& batch,
+    ID3D12GraphicsCommandList* commandList,
+    uint64_t inputBufferSize,
+    uint64_t controlBufferSize)
+{
+    Buffers& buffers = batch.Resources;
+    commandList->CopyBufferRegion(buffers.InputBuffer.get(), 0, buffers.UploadBuffer.get(), 0, inputBufferSize);
+    commandList->CopyBufferRegion(
+        buffers.ControlBuffer.get(),
+        0,
+        buffers.UploadBuffer.get(),
+        inputBufferSize,
+        controlBufferSize);
+}
+
+void GpuDecompressor::SetDecodeArguments(Batch& batch, uint32_t batchIndex, ID3D12GraphicsCommandList* commandList)
+{
+    if (AdvanceScratchEpoch(batch))
+    {
+        ClearScratchBuffer(commandList, batchIndex, batch.Resources.ScratchBuffer.get(), batch.ScratchCapacity);
+        auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(batch.Resources.ScratchBuffer.get());
+        commandList->ResourceBarrier(1, &barrier);
+    }
+
+    SetDecodeResources(batch, commandList);
+    commandList->SetComputeRoot32BitConstant(RootConstantScratchEpoch, batch.ScratchEpoch, 0);
+}
+
+void GpuDecompressor::SetDecodeResources(Batch& batch, ID3D12GraphicsCommandList* commandList)
+{
+    Buffers& buffers = batch.Resources;
+    commandList->SetComputeRootSignature(m_rootSignature.get());
+    commandList->SetPipelineState(m_pipelineState.get());
+    commandList->SetComputeRootShaderResourceView(RootSRVInput, buffers.InputBuffer->GetGPUVirtualAddress());
+    commandList->SetComputeRootUnorderedAccessView(RootUAVOutput, buffers.OutputBuffer->GetGPUVirtualAddress());
+    commandList->SetComputeRootUnorderedAccessView(RootUAVControl, buffers.ControlBuffer->GetGPUVirtualAddress());
+    commandList->SetComputeRootUnorderedAccessView(RootUAVScratch, buffers.ScratchBuffer->GetGPUVirtualAddress());
+    if (m_profile)
+        commandList->SetComputeRootUnorderedAccessView(RootUAVProfile, batch.ProfileBuffer->GetGPUVirtualAddress());
+}
+
+bool GpuDecompressor::AdvanceScratchEpoch(Batch& batch)
+{
+    // Tile counters from earlier dispatches are told apart by their epoch, so the scratch
+    // buffer only needs clearing once every kMaxScratchEpoch dispatches
+    if (++batch.ScratchEpoch <= kMaxScratchEpoch)
+        return false;
+
+    batch.ScratchEpoch = 1;
+    return true;
+}
+
+void GpuDecompressor::RecordDecode(Batch& batch, uint32_t batchIndex, bool clearScratch)
+{
+    auto commandList = batch.ComputeList.get();
+    winrt::check_hresult(batch.ComputeAllocator->Reset());
+    winrt::check_hresult(commandList->Reset(batch.ComputeAllocator.get(), nullptr));
+
+    if (clearScratch)
+    {
+        ClearScratchBuffer(commandList, batchIndex, batch.Resources.ScratchBuffer.get(), batch.ScratchCapacity);
+        auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(batch.Resources.ScratchBuffer.get());
+        commandList->ResourceBarrier(1, &barrier);
+    }
+
+    SetDecodeResources(batch, commandList);
+    if (m_profile)
+        commandList->EndQuery(m_timestampQueryHeap.get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * batchIndex);
+    commandList->ExecuteIndirect(
+        m_decodeCommandSignature.get(),
+        1,
+        batch.Resources.UploadBuffer.get(),
+        GetDecodeArgumentsOffset(batch),
+        nullptr,
+        0);
+    if (m_profile)
+        RecordProfileReadback(batch, batchIndex);
+    winrt::check_hresult(commandList->Close());
+
+    // A list that clears the scratch buffer is only good for one dispatch
+    batch.DecodeRecorded = !clearScratch;
+}
+
+uint64_t GpuDecompressor::GetDecodeArgumentsOffset(Batch const& batch)
+{
+    return AlignPlacement(batch.InputCapacity) + batch.ControlCapacity;
+}
+
+void GpuDecompressor::SubmitBatch(
+    uint32_t batchIndex,
+    BufferVector const& compressedData,
+    size_t firstStream,
+    size_t numStreams)
+{
+    Batch& batch = m_batches[batchIndex];
+
+    uint64_t inputBufferSize = 0;
+    uint64_t outputBufferSize = 0;
+    uint64_t controlBufferSize = 0;
+    StageBatch(
+        batchIndex,
+        compressedData,
+        firstStream,
+        numStreams,
+        inputBufferSize,
+        outputBufferSize,
+        controlBufferSize);
+    Buffers& buffers = batch.Resources;
+
+    // The slot's compute list is recorded once for its buffers and then submitted as is, with
+    // ExecuteIndirect reading the epoch and group count from the end of the upload buffer.
+    // Only clearing the scratch buffer needs it recorded again.
+    bool clearScratch = AdvanceScratchEpoch(batch);
+    if (clearScratch || !batch.DecodeRecorded)
+        RecordDecode(batch, batchIndex, clearScratch);
+
+    uint8_t* uploadBuffer = nullptr;
+    winrt::check_hresult(buffers.UploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&uploadBuffer)));
+    auto decodeArguments = reinterpret_cast<DecodeArguments*>(uploadBuffer + GetDecodeArgumentsOffset(batch));
+    decodeArguments->ScratchEpoch = batch.ScratchEpoch;
+    decodeArguments->Dispatch = {batch.DispatchSize, 1, 1};
+    buffers.UploadBuffer->Unmap(0, nullptr);
+
+    // Every buffer is left in D3D12_RESOURCE_STATE_COMMON, so it is promoted implicitly on
+    // first use by each queue and decays back once that queue's work completes. The fences
+    // order the accesses, and no barriers are needed to hand a buffer between queues.
+    winrt::check_hresult(batch.UploadAllocator->Reset());
+    winrt::check_hresult(batch.UploadList->Reset(batch.UploadAllocator.get(), nullptr));
+    RecordBatchUpload(batch, batch.UploadList.get(), inputBufferSize, controlBufferSize);
+    winrt::check_hresult(batch.UploadList->Close());
+
+    ID3D12CommandList* uploadLists[] = {batch.UploadList.get()};
+    m_uploadQueue->ExecuteCommandLists(1, uploadLists);
+    uint64_t uploadFenceValue = m_nextUploadFenceValue++;
+    winrt::check_hresult(m_uploadQueue->Signal(m_uploadFence.get(), uploadFenceValue));
+
+    // Decompress input buffer to output buffer once the upload has landed
+    winrt::check_hresult(m_commandQueue->Wait(m_uploadFence.get(), uploadFenceValue));
+    ID3D12CommandList* computeLists[] = {batch.ComputeList.get()};
+    m_commandQueue->ExecuteCommandLists(1, computeLists);
+    uint64_t decodeFenceValue = m_nextFenceValue++;
+    winrt::check_hresult(m_commandQueue->Signal(m_fence.get(), decodeFenceValue));
+
+    // Readback on a second copy queue, so that the next upload isn't queued behind this one
+    winrt::check_hresult(batch.ReadbackAllocator->Reset());
+    winrt::check_hresult(batch.ReadbackList->Reset(batch.ReadbackAllocator.get(), nullptr));
+    batch.ReadbackList->CopyBufferRegion(
+        buffers.ReadbackBuffer.get(),
+        0,
+        buffers.OutputBuffer.get(),
+        0,
+        outputBufferSize);
+    winrt::check_hresult(batch.ReadbackList->Close());
+
+    winrt::check_hresult(m_readbackQueue->Wait(m_fence.get(), decodeFenceValue));
+    ID3D12CommandList* readbackLists[] = {batch.ReadbackList.get()};
+    m_readbackQueue->ExecuteCommandLists(1, readbackLists);
+    batch.ReadbackFenceValue = m_nextReadbackFenceValue++;
+    winrt::check_hresult(m_readbackQueue->Signal(m_readbackFence.get(), batch.ReadbackFenceValue));
+}
+
+void GpuDecompressor::CompleteBatch(Batch& batch, BufferVector const& compressedData, BufferVector& uncompressedData)
+{
+    if (batch.ReadbackFenceValue == 0)
+        return;
+
+    winrt::check_hresult(m_readbackFence->SetEventOnCompletion(batch.ReadbackFenceValue, m_fenceEvent.get()));
+    m_fenceEvent.wait();
+    batch.ReadbackFenceValue = 0;
+
+    // Read the output buffer data and reconstruct the original uncompressed content
+    uint8_t* outputBufferData = nullptr;
+    winrt::check_hresult(batch.Resources.ReadbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&outputBufferData)));
+
+    for (size_t s = 0; s < batch.Streams.size(); ++s)
+    {
+        size_t index = batch.FirstStream + s;
+        auto header = reinterpret_cast<CompressedFileHeader const*>(compressedData[index].data());
+        uint8_t const* output = outputBufferData + batch.Streams[s].OutputOffset;
+        uncompressedData[index].assign(output, output + header->UncompressedSize);
+    }
+    batch.Resources.ReadbackBuffer->Unmap(0, nullptr);
+
+    if (m_profile)
+        ReportBatchProfile(batch);
+
+    if (batch.Transient)
+        ReleaseBatchBuffers(batch);
+}
+
+uint64_t GpuDecompressor::GetProfileBufferSize() const
+{
+    // Sized for the largest dispatch, so that tuning can't outgrow it
+    return kProfileHeaderSize + uint64_t(GetMaxDispatchSize()) * m_tilesPerGroup * sizeof(ProfileRecord);
+}
+
+void GpuDecompressor::RecordProfileReadback(Batch& batch, uint32_t batchIndex)
+{
+    auto commandList = batch.ComputeList.get();
+    commandList->EndQuery(m_timestampQueryHeap.get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * batchIndex + 1);
+    commandList->ResolveQueryData(
+        m_timestampQueryHeap.get(),
+        D3D12_QUERY_TYPE_TIMESTAMP,
+        2 * batchIndex,
+        2,
+        batch.ProfileReadbackBuffer.get(),
+        0);
+
+    // The dispatch promoted the profile buffer to unordered access, it decays back to common
+    // once the command list completes
+    auto barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+        batch.ProfileBuffer.get(),
+        D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+        D3D12_RESOURCE_STATE_COPY_SOURCE);
+    commandList->ResourceBarrier(1, &barrier);
+
+    commandList->CopyBufferRegion(
+        batch.ProfileReadbackBuffer.get(),
+        2 * sizeof(uint64_t),
+        batch.ProfileBuffer.get(),
+        0,
+        GetProfileBufferSize());
+}
+
+void GpuDecompressor::ReportBatchProfile(Batch const& batch)
+{
+    uint8_t* profileData = nullptr;
+    winrt::check_hresult(batch.ProfileReadbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&profileData)));
+
+    auto timestamps = reinterpret_cast<uint64_t const*>(profileData);
+    auto records = reinterpret_cast<ProfileRecord const*>(profileData + 2 * sizeof(uint64_t) + kProfileHeaderSize);
+    size_t numRecords = size_t(batch.DispatchSize) * m_tilesPerGroup;
+
+    // Tickets keep counting across dispatches, so they are read relative to the first start
+    uint32_t firstStart = records[0].StartTicket;
+    for (size_t r = 1; r < numRecords; ++r)
+        firstStart = std::min(firstStart, records[r].StartTicket);
+
+    uint32_t firstEnd = ~0u;
+    uint32_t minTiles = ~0u;
+    uint32_t maxTiles = 0;
+    uint64_t totalTiles = 0;
+    uint64_t totalBytes = 0;
+    size_t idleSlots = 0;
+    for (size_t r = 0; r < numRecords; ++r)
+    {
+        firstEnd = std::min(firstEnd, records[r].EndTicket - firstStart);
+        minTiles = std::min(minTiles, records[r].TilesDecoded);
+        maxTiles = std::max(maxTiles, records[r].TilesDecoded);
+        totalTiles += records[r].TilesDecoded;
+        totalBytes += records[r].BytesDecoded;
+        idleSlots += records[r].TilesDecoded == 0 ? 1 : 0;
+    }
+
+    // A group slot that only started after another had run out of work didn't fit on the
+    // GPU alongside the others
+    size_t lateStarts = 0;
+    for (size_t r = 0; r < numRecords; ++r)
+        lateStarts += records[r].StartTicket - firstStart > firstEnd ? 1 : 0;
+
+    batch.ProfileReadbackBuffer->Unmap(0, nullptr);
+
+    double seconds = double(timestamps[1] - timestamps[0]) / double(m_timestampFrequency);
+    double averageTiles = double(totalTiles) / double(numRecords);
+
+    std::cout << "Profile of streams " << batch.FirstStream << " to " << batch.FirstStream + batch.Streams.size() - 1
+              << "\n";
+    std::cout << "GPU Time:       " << seconds * 1000.0 << " ms\n";
+    std::cout << "Throughput:     " << double(totalBytes) / seconds / 1e9 << " GB/s\n";
+    std::cout << "Tiles:          " << totalTiles << " over " << numRecords << " group slots, " << minTiles
+              << " / " << averageTiles << " / " << maxTiles << " min / avg / max\n";
+    std::cout << "Load Imbalance: " << (averageTiles > 0.0 ? double(maxTiles) / averageTiles : 0.0)
+              << "x max over avg, " << idleSlots << " idle\n";
+    std::cout << "Late Starts:    " << lateStarts << " group slots started after the first finished\n\n";
+}
+
+GpuDecompressor::BenchmarkResult GpuDecompressor::Benchmark(
+    BufferVector const& compressedData,
+    size_t numStreams,
+    uint32_t iterations)
+{
+    // The streams stay resident in the first batch slot, which is idle between calls
+    Batch& batch = m_batches[0];
+
+    uint64_t inputBufferSize = 0;
+    uint64_t outputBufferSize = 0;
+    uint64_t controlBufferSize = 0;
+    StageBatch(0, compressedData, 0, numStreams, inputBufferSize, outputBufferSize, controlBufferSize, true);
+    RecordBatchUpload(batch, m_commandList.get(), inputBufferSize, controlBufferSize);
+    ExecuteCommandListSynchronously();
+
+    winrt::com_ptr<ID3D12QueryHeap> queryHeap;
+    D3D12_QUERY_HEAP_DESC queryHeapDesc{};
+    queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+    queryHeapDesc.Count = 2 * iterations;
+    winrt::check_hresult(m_device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(queryHeap.put())));
+
+    auto timestampBuffer = CreateBuffer(
+        m_device.get(),
+        queryHeapDesc.Count * sizeof(uint64_t),
+        D3D12_HEAP_TYPE_READBACK,
+        D3D12_RESOURCE_STATE_COPY_DEST,
+        D3D12_RESOURCE_FLAG_NONE);
+
+    // Each dispatch gets a new scratch epoch, and the UAV barrier keeps consecutive ones
+    // from overlapping so that every one of them is timed on its own
+    auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        // CSMain counts the streams left in the control buffer down to zero, so the count
+        // is copied back from the upload buffer before every dispatch after the first
+        if (i > 0)
+        {
+            auto toCopyDest = CD3DX12_RESOURCE_BARRIER::Transition(
+                batch.Resources.ControlBuffer.get(),
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                D3D12_RESOURCE_STATE_COPY_DEST);
+            m_commandList->ResourceBarrier(1, &toCopyDest);
+            m_commandList->CopyBufferRegion(
+                batch.Resources.ControlBuffer.get(),
+                0,
+                batch.Resources.UploadBuffer.get(),
+                inputBufferSize,
+                sizeof(uint32_t));
+            auto toUnorderedAccess = CD3DX12_RESOURCE_BARRIER::Transition(
+                batch.Resources.ControlBuffer.get(),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            m_commandList->ResourceBarrier(1, &toUnorderedAccess);
+        }
+
+        SetDecodeArguments(batch, 0, m_commandList.get());
+        m_commandList->EndQuery(queryHeap.get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * i);
+        m_commandList->Dispatch(batch.DispatchSize, 1, 1);
+        m_commandList->EndQuery(queryHeap.get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * i + 1);
+        m_commandList->ResourceBarrier(1, &barrier);
+    }
+    m_commandList->ResolveQueryData(
+        queryHeap.get(),
+        D3D12_QUERY_TYPE_TIMESTAMP,
+        0,
+        queryHeapDesc.Count,
+        timestampBuffer.get(),
+        0);
+    ExecuteCommandListSynchronously();
+
+    uint64_t frequency = 0;
+    winrt::check_hresult(m_commandQueue->GetTimestampFrequency(&frequency));
+
+    uint64_t* timestamps = nullptr;
+    winrt::check_hresult(timestampBuffer->Map(0, nullptr, reinterpret_cast<void**>(&timestamps)));
+
+    BenchmarkResult result{};
+    result.MinSeconds = std::numeric_limits<double>::max();
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        double seconds = double(timestamps[2 * i + 1] - timestamps[2 * i]) / double(frequency);
+        result.MinSeconds = std::min(result.MinSeconds, seconds);
+        result.AverageSeconds += seconds / iterations;
+    }
+    timestampBuffer->Unmap(0, nullptr);
+
+    for (size_t s = 0; s < numStreams; ++s)
+        result.UncompressedSize +=
+            reinterpret_cast<CompressedFileHeader const*>(compressedData[s].data())->UncompressedSize;
+
+    result.MismatchedStreams = CountHashMismatches(batch, compressedData);
+
+    if (batch.Transient)
+        ReleaseBatchBuffers(batch);
+
+    return result;
+}
+
+size_t GpuDecompressor::CountHashMismatches(Batch& batch, BufferVector const& compressedData)
+{
+    Buffers& buffers = batch.Resources;
+    size_t numStreams = batch.Streams.size();
+    uint64_t hashOffset = CalculateControlBufferSize(numStreams);
+    uint64_t hashSize = numStreams * sizeof(HashEntry);
+
+    // One group per chunk of the largest stream, the groups past the end of a smaller one exit at once
+    uint64_t maxStreamSize = 0;
+    for (size_t s = 0; s < numStreams; ++s)
+    {
+        auto header = reinterpret_cast<CompressedFileHeader const*>(compressedData[batch.FirstStream + s].data());
+        maxStreamSize = std::max<uint64_t>(maxStreamSize, header->UncompressedSize);
+    }
+    uint64_t numChunks = std::max<uint64_t>(1, (maxStreamSize + kHashChunkSize - 1) / kHashChunkSize);
+
+    auto hashReadbackBuffer = CreateBuffer(
+        m_device.get(),
+        hashSize,
+        D3D12_HEAP_TYPE_READBACK,
+        D3D12_RESOURCE_STATE_COPY_DEST,
+        D3D12_RESOURCE_FLAG_NONE);
+
+    // The output buffer decayed to common after the timed dispatches and is promoted for the
+    // kernel to read it as a shader resource
+    m_commandList->SetComputeRootSignature(m_rootSignature.get());
+    m_commandList->SetPipelineState(m_hashPipelineState.get());
+    m_commandList->SetComputeRoot32BitConstant(RootConstantScratchEpoch, static_cast<uint32_t>(hashOffset), 0);
+    m_commandList->SetComputeRootShaderResourceView(RootSRVInput, buffers.OutputBuffer->GetGPUVirtualAddress());
+    m_commandList->SetComputeRootUnorderedAccessView(RootUAVControl, buffers.ControlBuffer->GetGPUVirtualAddress());
+    m_commandList->Dispatch(static_cast<uint32_t>(numChunks), static_cast<uint32_t>(numStreams), 1);
+
+    auto barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+        buffers.ControlBuffer.get(),
+        D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+        D3D12_RESOURCE_STATE_COPY_SOURCE);
+    m_commandList->ResourceBarrier(1, &barrier);
+    m_commandList->CopyBufferRegion(hashReadbackBuffer.get(), 0, buffers.ControlBuffer.get(), hashOffset, hashSize);
+    ExecuteCommandListSynchronously();
+
+    HashEntry* hashEntries = nullptr;
+    winrt::check_hresult(hashReadbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&hashEntries)));
+
+    size_t mismatches = 0;
+    for (size_t s = 0; s < numStreams; ++s)
+    {
+        auto header = reinterpret_cast<CompressedFileHeader const*>(compressedData[batch.FirstStream + s].data());
+        auto& entry = hashEntries[s];
+        if (FinalizeContentHash(entry.SumA, entry.SumB, header->UncompressedSize) != header->ContentHash)
+            ++mismatches;
+    }
+    hashReadbackBuffer->Unmap(0, nullptr);
+
+    return mismatches;
+}
+
+uint32_t GpuDecompressor::GetMaxDispatchSize() const
+{
+    return m_numSIMDs * kMaxGroupsPerSIMD;
+}
+
+uint32_t GpuDecompressor::GetDispatchSize(uint64_t numTiles) const
+{
+    // Groups past one per tile would only find the counters exhausted and exit
+    uint64_t numGroups = (numTiles + m_tilesPerGroup - 1) / m_tilesPerGroup;
+    return static_cast<uint32_t>(std::clamp<uint64_t>(numGroups, 1, m_dispatchSize));
+}
+
+uint32_t GpuDecompressor::AutoTuneDispatchSize(BufferVector const& compressedData, uint32_t iterations)
+{
+    std::cout << "Tuning the dispatch size over " << compressedData.size() << " streams, " << iterations
+              << " dispatches each\n";
+
+    uint32_t bestDispatchSize = m_dispatchSize;
+    double bestSeconds = std::numeric_limits<double>::max();
+    for (uint32_t groupsPerSIMD = 1; groupsPerSIMD <= kMaxGroupsPerSIMD; groupsPerSIMD *= 2)
+    {
+        m_dispatchSize = m_numSIMDs * groupsPerSIMD;
+        auto result = Benchmark(compressedData, compressedData.size(), iterations);
+        std::cout << std::left << std::setw(6) << m_dispatchSize << " groups: " << result.MinSeconds * 1000.0
+                  << " ms best\n";
+
+        if (result.MinSeconds < bestSeconds)
+        {
+            bestSeconds = result.MinSeconds;
+            bestDispatchSize = m_dispatchSize;
+        }
+
+        // Benchmark was capped at one group per tile, larger sizes would dispatch the same groups
+        if (m_batches[0].DispatchSize < m_dispatchSize)
+            break;
+    }
+
+    m_dispatchSize = bestDispatchSize;
+    std::string text = std::to_string(m_dispatchSize);
+    WriteCacheFile(m_dispatchSizeCachePath, text.data(), text.size());
+    return m_dispatchSize;
+}
+
+void GpuDecompressor::SetBufferPoolLimit(uint64_t limitInBytes)
+{
+    m_bufferPoolLimit = limitInBytes;
+}
+
+void GpuDecompressor::AllocateBatchBuffers(
+    Batch& batch,
+    uint64_t inputBufferSize,
+    uint64_t outputBufferSize,
+    uint64_t controlBufferSize,
+    uint64_t scratchBufferSize)
+{
+    auto grow = [](uint64_t capacity, uint64_t size)
+    {
+        capacity = std::max(capacity, kMinPooledBufferSize);
+        while (capacity < size)
+            capacity *= 2;
+        return capacity;
+    };
+
+    uint64_t inputCapacity = grow(batch.InputCapacity, inputBufferSize);
+    uint64_t outputCapacity = grow(batch.OutputCapacity, outputBufferSize);
+    uint64_t controlCapacity = grow(batch.ControlCapacity, controlBufferSize);
+    uint64_t scratchCapacity = grow(batch.ScratchCapacity, scratchBufferSize);
+
+    uint64_t defaultHeapSize = 0;
+    uint64_t uploadHeapSize = 0;
+    uint64_t readbackHeapSize = 0;
+    auto calculateHeapSizes = [&]()
+    {
+        defaultHeapSize = AlignPlacement(inputCapacity) + AlignPlacement(outputCapacity) +
+                          AlignPlacement(controlCapacity) + AlignPlacement(scratchCapacity);
+        uploadHeapSize = AlignPlacement(AlignPlacement(inputCapacity) + controlCapacity + sizeof(DecodeArguments));
+        readbackHeapSize = AlignPlacement(outputCapacity);
+        return defaultHeapSize + uploadHeapSize + readbackHeapSize;
+    };
+
+    // The slot's current heaps are freed first, they don't count against the new ones
+    ReleaseBatchBuffers(batch);
+
+    batch.Transient = m_bufferPoolSize + calculateHeapSizes() > m_bufferPoolLimit;
+    if (batch.Transient)
+    {
+        inputCapacity = inputBufferSize;
+        outputCapacity = outputBufferSize;
+        controlCapacity = controlBufferSize;
+        scratchCapacity = scratchBufferSize;
+        calculateHeapSizes();
+    }
+
+    ID3D12Device* device = m_device.get();
+    batch.DefaultHeap = CreateHeap(device, defaultHeapSize, D3D12_HEAP_TYPE_DEFAULT);
+    batch.UploadHeap = CreateHeap(device, uploadHeapSize, D3D12_HEAP_TYPE_UPLOAD);
+    batch.ReadbackHeap = CreateHeap(device, readbackHeapSize, D3D12_HEAP_TYPE_READBACK);
+    batch.HeapSize = defaultHeapSize + uploadHeapSize + readbackHeapSize;
+    if (!batch.Transient)
+        m_bufferPoolSize += batch.HeapSize;
+
+    Buffers& buffers = batch.Resources;
+    uint64_t offset = 0;
+    buffers.InputBuffer = CreatePlacedBuffer(
+        device,
+        batch.DefaultHeap.get(),
+        offset,
+        inputCapacity,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,
+        L"Input Buffer");
+
+    buffers.OutputBuffer = CreatePlacedBuffer(
+        device,
+        batch.DefaultHeap.get(),
+        offset,
+        outputCapacity,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,
+        L"Output Buffer");
+
+    buffers.ControlBuffer = CreatePlacedBuffer(
+        device,
+        batch.DefaultHeap.get(),
+        offset,
+        controlCapacity,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,
+        L"Control Buffer");
+
+    buffers.ScratchBuffer = CreatePlacedBuffer(
+        device,
+        batch.DefaultHeap.get(),
+        offset,
+        scratchCapacity,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,
+        L"Scratch Buffer");
+
+    offset = 0;
+    buffers.UploadBuffer = CreatePlacedBuffer(
+        device,
+        batch.UploadHeap.get(),
+        offset,
+        AlignPlacement(inputCapacity) + controlCapacity + sizeof(DecodeArguments),
+        D3D12_RESOURCE_STATE_GENERIC_READ,
+        D3D12_RESOURCE_FLAG_NONE,
+        L"Upload Buffer");
+
+    offset = 0;
+    buffers.ReadbackBuffer = CreatePlacedBuffer(
+        device,
+        batch.ReadbackHeap.get(),
+        offset,
+        outputCapacity,
+        D3D12_RESOURCE_STATE_COPY_DEST,
+        D3D12_RESOURCE_FLAG_NONE,
+        L"Readback Buffer");
+
+    batch.InputCapacity = inputCapacity;
+    batch.OutputCapacity = outputCapacity;
+    batch.ControlCapacity = controlCapacity;
+    batch.ScratchCapacity = scratchCapacity;
+}
+
+void GpuDecompressor::ReleaseBatchBuffers(Batch& batch)
+{
+    if (!batch.Transient)
+        m_bufferPoolSize -= batch.HeapSize;
+
+    batch.Resources = {};
+    batch.DefaultHeap = nullptr;
+    batch.UploadHeap = nullptr;
+    batch.ReadbackHeap = nullptr;
+    batch.HeapSize = 0;
+    batch.Transient = false;
+    batch.InputCapacity = 0;
+    batch.OutputCapacity = 0;
+    batch.ControlCapacity = 0;
+    batch.ScratchCapacity = 0;
+    batch.ScratchEpoch = 0;
+    batch.DecodeRecorded = false;
+}
+
+BufferVector GpuDecompressor::DecompressStreaming(BufferVector const& compressedData, uint32_t queueCapacity)
+{
+    // Slots are indexed with the kernel's 12-bit stream sequence number, which the capacity has to divide
+    bool validCapacity =
+        queueCapacity >= 2 && queueCapacity <= kMaxQueueCapacity && (queueCapacity & (queueCapacity - 1)) == 0;
+    winrt::check_hresult(validCapacity ? S_OK : E_INVALIDARG);
+
+    uint64_t inputBufferSize = 0;
+    uint64_t outputBufferSize = 0;
+    std::vector<Stream> streams =
+        LayoutStreams(compressedData, 0, compressedData.size(), inputBufferSize, outputBufferSize);
+    uint64_t queueBufferSize = sizeof(QueueHeader) + queueCapacity * sizeof(QueueEntry);
+
+    std::cout << "GPU streaming decompression buffer sizes\n";
+    std::cout << "Input Buffer:   " << inputBufferSize << " bytes\n";
+    std::cout << "Queue Buffer:   " << queueBufferSize << " bytes (" << queueCapacity << " entries)\n";
+    std::cout << "Output Buffer:  " << outputBufferSize << " bytes\n\n";
+
+    // The kernel reads its input straight from an upload heap, and the queue lives in
+    // CPU-visible memory so that streams can be appended while the kernel runs
+    auto inputBuffer = CreateBuffer(
+        m_device.get(),
+        inputBufferSize,
+        D3D12_HEAP_TYPE_UPLOAD,
+        D3D12_RESOURCE_STATE_GENERIC_READ,
+        D3D12_RESOURCE_FLAG_NONE);
+
+    auto outputBuffer = CreateBuffer(
+        m_device.get(),
+        outputBufferSize,
+        D3D12_HEAP_TYPE_DEFAULT,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    winrt::com_ptr<ID3D12Resource> queueBuffer;
+    auto queueHeapProps = CD3DX12_HEAP_PROPERTIES(D3D12_CPU_PAGE_PROPERTY_WRITE_BACK, D3D12_MEMORY_POOL_L0);
+    auto queueDesc = CD3DX12_RESOURCE_DESC::Buffer(queueBufferSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    winrt::check_hresult(m_device->CreateCommittedResource(
+        &queueHeapProps,
+        D3D12_HEAP_FLAG_NONE,
+        &queueDesc,
+        D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+        nullptr,
+        IID_PPV_ARGS(queueBuffer.put())));
+
+    winrt::check_hresult(queueBuffer->SetName(L"Queue Buffer"));
+
+    uint8_t* inputData = nullptr;
+    winrt::check_hresult(inputBuffer->Map(0, nullptr, reinterpret_cast<void**>(&inputData)));
+
+    uint8_t* queueData = nullptr;
+    winrt::check_hresult(queueBuffer->Map(0, nullptr, reinterpret_cast<void**>(&queueData)));
+    memset(queueData, 0, queueBufferSize);
+
+    auto queueHeader = reinterpret_cast<QueueHeader volatile*>(queueData);
+    auto queueEntries = reinterpret_cast<QueueEntry volatile*>(queueData + sizeof(QueueHeader));
+    queueHeader->Capacity = queueCapacity;
+
+    // Start the kernel before anything is queued, it waits for the first stream
+    m_commandList->SetComputeRootSignature(m_rootSignature.get());
+    m_commandList->SetPipelineState(m_persistentPipelineState.get());
+    m_commandList->SetComputeRootShaderResourceView(RootSRVInput, inputBuffer->GetGPUVirtualAddress());
+    m_commandList->SetComputeRootUnorderedAccessView(RootUAVOutput, outputBuffer->GetGPUVirtualAddress());
+    m_commandList->SetComputeRootUnorderedAccessView(RootUAVControl, queueBuffer->GetGPUVirtualAddress());
+    // Not the tuned size, which was measured for the regular kernel and may keep more groups
+    // than fit on the GPU at once waiting on the queue
+    m_commandList->Dispatch(m_numSIMDs * kDefaultGroupsPerSIMD, 1, 1);
+    uint64_t fenceValue = ExecuteCommandList();
+
+
+    // A slot is free once the cursor has moved past its stream and every tile is done
+    auto isSlotFree = [&](size_t s)
+    {
+        if (s < queueCapacity)
+            return true;
+
+        size_t previous = s - queueCapacity;
+        uint32_t cursorSequence = queueHeader->Cursor >> kQueueTileBits;
+        return cursorSequence != (previous & kQueueSequenceMask) &&
+               queueEntries[s % queueCapacity].TilesDone == GetNumTiles(compressedData[previous]);
+    };
+
+    for (size_t s = 0; s < streams.size(); ++s)
+    {
+        while (!isSlotFree(s))
+            std::this_thread::yield();
+
+        memcpy(
+            inputData + streams[s].InputOffset,
+            compressedData[s].data() + sizeof(CompressedFileHeader),
+            compressedData[s].size() - sizeof(CompressedFileHeader));
+
+        auto& entry = queueEntries[s % queueCapacity];
+        entry.InputOffset = streams[s].InputOffset;
+        entry.OutputOffset = streams[s].OutputOffset;
+        entry.TilesDone = 0;
+
+        // The entry and its data have to be visible before the kernel can see the new tail
+        std::atomic_thread_fence(std::memory_order_release);
+        queueHeader->Tail = static_cast<uint32_t>(s + 1);
+    }
+
+    // The kernel exits once it has claimed every queued tile
+    std::atomic_thread_fence(std::memory_order_release);
+    queueHeader->Quit = 1;
+    WaitForFence(fenceValue);
+
+    queueBuffer->Unmap(0, nullptr);
+    inputBuffer->Unmap(0, nullptr);
+
+    return ReadbackOutput(outputBuffer.get(), outputBufferSize, streams, compressedData);
+}
+
+uint64_t GpuDecompressor::DecompressResident(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    std::vector<ResidentStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    static_assert(sizeof(ResidentStream) == sizeof(Stream), "ResidentStream is a control buffer entry");
+
+    // A profiling build writes its records to the batch slots' profile buffers
+    assert(!m_profile);
+
+    return SubmitResidentDecode(
+        m_pipelineState.get(),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(ResidentStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue);
+}
+
+uint64_t GpuDecompressor::DecompressStaged(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    std::vector<ResidentStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    // Staged dwords are stored whole
+    for (auto& stream : streams)
+        assert(stream.OutputOffset % 4 == 0);
+
+    return SubmitResidentDecode(
+        GetFeaturePipelineState(m_stagedPipelineState, &ShaderPermutation::StagedOutput),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(ResidentStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue);
+}
+
+uint64_t GpuDecompressor::DecompressTextures(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    std::vector<TextureStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    static_assert(sizeof(TextureStream) == 24, "TextureStream is a control buffer entry of GDeflate.hlsl");
 
-    auto byteCode = CompileShader(shaderPath, deviceInfo);
-    std::cout << "Shader compiled successfully, bytecode size = " << byteCode.size() << " bytes\n";
+    // Aligned dwords of the packed rows have to land whole in the subresource
+    for (auto& stream : streams)
+    {
+        assert(stream.OutputOffset % 4 == 0 && stream.RowSize % 4 == 0);
+        assert(stream.RowPitch % 4 == 0 && stream.SlicePitch % 4 == 0);
+    }
 
-    m_rootSignature = CreateRootSignature(device);
+    return SubmitResidentDecode(
+        GetFeaturePipelineState(m_texturePipelineState, &ShaderPermutation::TextureOutput),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(TextureStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue);
+}
 
-    D3D12_COMPUTE_PIPELINE_STATE_DESC pipelineDesc{};
-    pipelineDesc.pRootSignature = m_rootSignature.get();
-    pipelineDesc.CS.pShaderBytecode = byteCode.data();
-    pipelineDesc.CS.BytecodeLength = byteCode.size();
-    winrt::check_hresult(device->CreateComputePipelineState(&pipelineDesc, IID_PPV_ARGS(m_pipelineState.put())));
+uint64_t GpuDecompressor::DecompressTileRanges(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    std::vector<TileRangeStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    static_assert(sizeof(TileRangeStream) == 12, "TileRangeStream is a control buffer entry of GDeflate.hlsl");
+
+    return SubmitResidentDecode(
+        GetFeaturePipelineState(m_tileRangePipelineState, &ShaderPermutation::TileRange),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(TileRangeStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue);
+}
 
-    D3D12_DESCRIPTOR_HEAP_DESC descriptorHeapDesc{};
-    descriptorHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
-    descriptorHeapDesc.NumDescriptors = 1;
-    descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-    winrt::check_hresult(m_device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(m_gpuVisibleDescHeap.put())));
+uint64_t GpuDecompressor::DecompressTransformed(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    std::vector<TransformStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    static_assert(sizeof(TransformStream) == 12, "TransformStream is a control buffer entry of GDeflate.hlsl");
+
+    // The delta is undone a dword at a time from the start of each tile
+    for (auto& stream : streams)
+        assert(stream.Transform >> 24 == 0 || stream.OutputOffset % 4 == 0);
+
+    return SubmitResidentDecode(
+        GetFeaturePipelineState(m_transformPipelineState, &ShaderPermutation::PostTransform),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(TransformStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue);
+}
 
-    descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
-    winrt::check_hresult(m_device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(m_cpuVisibleDescHeap.put())));
+uint64_t GpuDecompressor::DecompressEncrypted(
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    ID3D12Resource* keyBuffer,
+    uint64_t keyOffset,
+    std::vector<EncryptedStream> const& streams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue)
+{
+    static_assert(sizeof(EncryptedStream) == 20, "EncryptedStream is a control buffer entry of GDeflate.hlsl");
+    assert(keyOffset % 4 == 0);
+
+    return SubmitResidentDecode(
+        GetFeaturePipelineState(m_decryptPipelineState, &ShaderPermutation::Decrypt),
+        inputBuffer,
+        inputOffset,
+        outputBuffer,
+        outputOffset,
+        streams.data(),
+        sizeof(EncryptedStream),
+        streams.size(),
+        numTiles,
+        waitFence,
+        waitValue,
+        keyBuffer->GetGPUVirtualAddress() + keyOffset);
 }
 
-BufferVector GpuDecompressor::Decompress(BufferVector const& compressedData)
+uint64_t GpuDecompressor::SubmitResidentDecode(
+    ID3D12PipelineState* pipelineState,
+    ID3D12Resource* inputBuffer,
+    uint64_t inputOffset,
+    ID3D12Resource* outputBuffer,
+    uint64_t outputOffset,
+    void const* entries,
+    size_t entrySize,
+    size_t numStreams,
+    uint64_t numTiles,
+    ID3D12Fence* waitFence,
+    uint64_t waitValue,
+    D3D12_GPU_VIRTUAL_ADDRESS cryptoContext)
 {
-    std::vector<Stream> streams;
-    streams.reserve(compressedData.size());
+    assert(numStreams != 0 && numStreams <= std::numeric_limits<uint16_t>::max());
+    assert(inputOffset % 4 == 0 && outputOffset % 4 == 0);
 
-    uint64_t inputBufferSize = 0;
-    uint64_t outputBufferSize = 0;
+    uint32_t slotIndex = m_nextResidentDecode;
+    m_nextResidentDecode = (m_nextResidentDecode + 1) % kMaxBatchesInFlight;
+    ResidentDecode& decode = m_residentDecodes[slotIndex];
 
-    // Construct stream entries for the control buffer from all of the compressed data
-    Stream stream{};
-    for (size_t s = 0; s < compressedData.size(); ++s)
+    // The slot's upload buffer and command list are about to be reused
+    if (decode.FenceValue != 0)
     {
-        streams.push_back(stream);
-        CompressedFileHeader const* header = reinterpret_cast<CompressedFileHeader const*>(compressedData[s].data());
-        uint32_t compressedSize = static_cast<uint32_t>(compressedData[s].size() - sizeof(CompressedFileHeader));
-        uint32_t uncompressedSize = static_cast<uint32_t>(header->UncompressedSize);
+        winrt::check_hresult(m_fence->SetEventOnCompletion(decode.FenceValue, m_fenceEvent.get()));
+        m_fenceEvent.wait();
+        decode.FenceValue = 0;
+    }
 
-        inputBufferSize = stream.InputOffset + compressedSize;
-        outputBufferSize = stream.OutputOffset + uncompressedSize;
+    uint64_t controlBufferSize = CalculateControlBufferSize(numStreams, entrySize);
+    if (controlBufferSize > decode.ControlCapacity)
+    {
+        decode.ControlCapacity = std::max(controlBufferSize, 2 * decode.ControlCapacity);
+        decode.ControlBuffer = CreateBuffer(
+            m_device.get(),
+            decode.ControlCapacity,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_COMMON,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        decode.UploadBuffer = CreateBuffer(
+            m_device.get(),
+            decode.ControlCapacity,
+            D3D12_HEAP_TYPE_UPLOAD,
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            D3D12_RESOURCE_FLAG_NONE);
+    }
 
-        stream.InputOffset = DWORD_ALIGN(stream.InputOffset + compressedSize);
-        stream.OutputOffset = DWORD_ALIGN(stream.OutputOffset + uncompressedSize);
+    // A new scratch buffer starts out zeroed, which is epoch 0
+    uint64_t scratchBufferSize = GetRequiredScratchBufferSize(static_cast<uint16_t>(numStreams));
+    if (scratchBufferSize > decode.ScratchCapacity)
+    {
+        decode.ScratchCapacity = std::max(scratchBufferSize, 2 * decode.ScratchCapacity);
+        decode.ScratchBuffer = CreateBuffer(
+            m_device.get(),
+            decode.ScratchCapacity,
+            D3D12_HEAP_TYPE_DEFAULT,
+            D3D12_RESOURCE_STATE_COMMON,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        decode.ScratchEpoch = 0;
     }
 
-    uint64_t controlBufferSize = CalculateControlBufferSize(streams.size());
-    uint64_t scratchBufferSize = GetRequiredScratchBufferSize(static_cast<uint16_t>(streams.size()));
-    uint64_t uploadBufferSize = controlBufferSize + inputBufferSize;
+    uint32_t* controlData = nullptr;
+    winrt::check_hresult(decode.UploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&controlData)));
+    *controlData = static_cast<uint32_t>(numStreams);
+    memcpy(controlData + 1, entries, numStreams * entrySize);
+    decode.UploadBuffer->Unmap(0, nullptr);
 
-    std::cout << "GPU decompression buffer sizes\n";
-    std::cout << "Input Buffer:   " << inputBufferSize << " bytes\n";
-    std::cout << "Control Buffer: " << controlBufferSize << " bytes\n";
-    std::cout << "Scratch Buffer: " << scratchBufferSize << " bytes\n";
-    std::cout << "Output Buffer:  " << outputBufferSize << " bytes\n\n";
+    auto commandList = decode.CommandList.get();
+    winrt::check_hresult(decode.Allocator->Reset());
+    winrt::check_hresult(commandList->Reset(decode.Allocator.get(), nullptr));
 
-    m_buffers = CreateBuffers(
-        m_device.get(),
-        inputBufferSize,
-        outputBufferSize,
-        controlBufferSize,
-        uploadBufferSize,
-        scratchBufferSize);
+    if (++decode.ScratchEpoch > kMaxScratchEpoch)
+    {
+        decode.ScratchEpoch = 1;
+        ClearScratchBuffer(
+            commandList,
+            kMaxBatchesInFlight + slotIndex,
+            decode.ScratchBuffer.get(),
+            decode.ScratchCapacity);
+        auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(decode.ScratchBuffer.get());
+        commandList->ResourceBarrier(1, &barrier);
+    }
 
-    // Copy compressed data into upload buffer
-    uint8_t* uploadBuffer = nullptr;
-    winrt::check_hresult(m_buffers.UploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&uploadBuffer)));
-    for (size_t s = 0; s < streams.size(); ++s)
+    // The control buffer decayed to common after its last decode and is promoted for the copy
+    commandList->CopyBufferRegion(decode.ControlBuffer.get(), 0, decode.UploadBuffer.get(), 0, controlBufferSize);
+    auto toUnorderedAccess = CD3DX12_RESOURCE_BARRIER::Transition(
+        decode.ControlBuffer.get(),
+        D3D12_RESOURCE_STATE_COPY_DEST,
+        D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    commandList->ResourceBarrier(1, &toUnorderedAccess);
+
+    commandList->SetComputeRootSignature(m_rootSignature.get());
+    commandList->SetPipelineState(pipelineState);
+    commandList->SetComputeRootShaderResourceView(RootSRVInput, inputBuffer->GetGPUVirtualAddress() + inputOffset);
+    commandList->SetComputeRootUnorderedAccessView(
+        RootUAVOutput,
+        outputBuffer->GetGPUVirtualAddress() + outputOffset);
+    commandList->SetComputeRootUnorderedAccessView(RootUAVControl, decode.ControlBuffer->GetGPUVirtualAddress());
+    commandList->SetComputeRootUnorderedAccessView(RootUAVScratch, decode.ScratchBuffer->GetGPUVirtualAddress());
+    commandList->SetComputeRoot32BitConstant(RootConstantScratchEpoch, decode.ScratchEpoch, 0);
+    if (cryptoContext != 0)
+        commandList->SetComputeRootShaderResourceView(RootSRVCryptoCtx, cryptoContext);
+    commandList->Dispatch(numTiles != 0 ? GetDispatchSize(numTiles) : m_dispatchSize, 1, 1);
+    winrt::check_hresult(commandList->Close());
+
+    if (waitFence != nullptr)
+        winrt::check_hresult(m_commandQueue->Wait(waitFence, waitValue));
+
+    ID3D12CommandList* commandLists[] = {commandList};
+    m_commandQueue->ExecuteCommandLists(1, commandLists);
+    decode.FenceValue = m_nextFenceValue++;
+    winrt::check_hresult(m_commandQueue->Signal(m_fence.get(), decode.FenceValue));
+
+    return decode.FenceValue;
+}
+
+ID3D12Fence* GpuDecompressor::GetFence() const
+{
+    return m_fence.get();
+}
+
+ID3D12PipelineState* GpuDecompressor::GetFeaturePipelineState(
+    winrt::com_ptr<ID3D12PipelineState>& pipelineState,
+    bool ShaderPermutation::*feature)
+{
+    if (!pipelineState)
     {
-        auto& stream = streams[s];
-        uint32_t compressedSize = static_cast<uint32_t>(compressedData[s].size() - sizeof(CompressedFileHeader));
-        memcpy(
-            uploadBuffer + stream.InputOffset,
-            compressedData[s].data() + sizeof(CompressedFileHeader),
-            compressedSize);
+        ShaderPermutation permutation = m_permutation;
+        permutation.*feature = true;
+        permutation.Name += GetVariantSuffix(permutation);
+
+        auto byteCode = LoadShader(m_shaderPath, m_deviceInfo, permutation);
+        std::wcout << L"Shader permutation " << permutation.Name << L" loaded, bytecode size = " << byteCode.size()
+                   << L" bytes\n";
+        pipelineState = CreatePipelineState(GetPipelineCachePath(permutation), byteCode);
     }
+    return pipelineState.get();
+}
 
-    // Copy control buffer into upload buffer
-    uint32_t* controlData = reinterpret_cast<uint32_t*>(uploadBuffer + inputBufferSize);
-    *controlData = static_cast<uint32_t>(streams.size());
-    memcpy(controlData + 1, streams.data(), streams.size() * sizeof(Stream));
+std::vector<uint8_t> GpuDecompressor::DecompressFromHost(
+    std::vector<uint8_t> const& input,
+    uint64_t outputSize,
+    std::function<void(ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)> const& decode)
+{
+    // The kernel reads whole dwords, so the input is padded to the next one
+    auto inputBuffer = CreateBuffer(
+        m_device.get(),
+        DWORD_ALIGN(input.size()),
+        D3D12_HEAP_TYPE_UPLOAD,
+        D3D12_RESOURCE_STATE_GENERIC_READ,
+        D3D12_RESOURCE_FLAG_NONE);
 
-    m_buffers.UploadBuffer->Unmap(0, nullptr);
+    uint8_t* inputData = nullptr;
+    winrt::check_hresult(inputBuffer->Map(0, nullptr, reinterpret_cast<void**>(&inputData)));
+    memcpy(inputData, input.data(), input.size());
+    inputBuffer->Unmap(0, nullptr);
 
-    // Copy into input buffer
-    m_commandList->CopyBufferRegion(m_buffers.InputBuffer.get(), 0, m_buffers.UploadBuffer.get(), 0, inputBufferSize);
+    // Committed buffers start out zeroed
+    auto outputBuffer = CreateBuffer(
+        m_device.get(),
+        outputSize,
+        D3D12_HEAP_TYPE_DEFAULT,
+        D3D12_RESOURCE_STATE_COMMON,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
 
-    // Copy into control buffer
-    m_commandList->CopyBufferRegion(
-        m_buffers.ControlBuffer.get(),
-        0,
-        m_buffers.UploadBuffer.get(),
-        inputBufferSize,
-        controlBufferSize);
+    auto readbackBuffer = CreateBuffer(
+        m_device.get(),
+        outputSize,
+        D3D12_HEAP_TYPE_READBACK,
+        D3D12_RESOURCE_STATE_COPY_DEST,
+        D3D12_RESOURCE_FLAG_NONE);
 
-    // Transition InputBuffer from D3D12_RESOURCE_STATE_COPY_DEST after the CopyBufferRegion
-    // to D3D12_RESOURCE_STATE_COMMON and transition ControlBuffer from 
-    // D3D12_RESOURCE_STATE_COPY_DEST after the CopyBufferRegion to 
-    // D3D12_RESOURCE_STATE_UNORDERED_ACCESS.
-    D3D12_RESOURCE_BARRIER barriers[] = {
-        CD3DX12_RESOURCE_BARRIER::Transition(
-            m_buffers.InputBuffer.get(),
-            D3D12_RESOURCE_STATE_COPY_DEST,
-            D3D12_RESOURCE_STATE_COMMON),
-        CD3DX12_RESOURCE_BARRIER::Transition(
-            m_buffers.ControlBuffer.get(),
-            D3D12_RESOURCE_STATE_COPY_DEST,
-            D3D12_RESOURCE_STATE_UNORDERED_ACCESS)};
-    m_commandList->ResourceBarrier(_countof(barriers), barriers);
-
-    // Clear scratch buffer
-    ClearScratchBuffer(scratchBufferSize);
-
-    // Decompress input buffer to output buffer
-    m_commandList->SetComputeRootSignature(m_rootSignature.get());
-    m_commandList->SetPipelineState(m_pipelineState.get());
-    m_commandList->SetComputeRootShaderResourceView(RootSRVInput, m_buffers.InputBuffer->GetGPUVirtualAddress());
-    m_commandList->SetComputeRootUnorderedAccessView(RootUAVOutput, m_buffers.OutputBuffer->GetGPUVirtualAddress());
-    m_commandList->SetComputeRootUnorderedAccessView(RootUAVControl, m_buffers.ControlBuffer->GetGPUVirtualAddress());
-    m_commandList->SetComputeRootUnorderedAccessView(RootUAVScratch, m_buffers.ScratchBuffer->GetGPUVirtualAddress());
-    m_commandList->Dispatch(m_dispatchSize, 1, 1);
+    decode(inputBuffer.get(), outputBuffer.get());
+
+    // The decode was submitted to the compute queue, so the copy runs after it. The output
+    // buffer decays to common when the decode completes, and is promoted for the copy.
+    m_commandList->CopyBufferRegion(readbackBuffer.get(), 0, outputBuffer.get(), 0, outputSize);
     ExecuteCommandListSynchronously();
 
+    std::vector<uint8_t> output(outputSize);
+    uint8_t* outputData = nullptr;
+    winrt::check_hresult(readbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&outputData)));
+    memcpy(output.data(), outputData, output.size());
+    readbackBuffer->Unmap(0, nullptr);
+
+    return output;
+}
+
+BufferVector GpuDecompressor::ReadbackOutput(
+    ID3D12Resource* outputBuffer,
+    uint64_t outputBufferSize,
+    std::vector<Stream> const& streams,
+    BufferVector const& compressedData)
+{
     // Readback the decompressed data from the output buffer to return
     winrt::com_ptr<ID3D12Resource> readbackBuffer;
     auto bufferHeapProps = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
@@ -160,7 +1524,7 @@ BufferVector GpuDecompressor::Decompress(BufferVector const& compressedData)
         nullptr,
         IID_PPV_ARGS(readbackBuffer.put())));
 
-    m_commandList->CopyBufferRegion(readbackBuffer.get(), 0, m_buffers.OutputBuffer.get(), 0, outputBufferSize);
+    m_commandList->CopyBufferRegion(readbackBuffer.get(), 0, outputBuffer, 0, outputBufferSize);
     ExecuteCommandListSynchronously();
 
     BufferVector uncompressedData;
@@ -183,33 +1547,227 @@ BufferVector GpuDecompressor::Decompress(BufferVector const& compressedData)
     return uncompressedData;
 }
 
+GpuDecompressor::TextureStream GpuDecompressor::MakeTextureStream(
+    uint32_t inputOffset,
+    D3D12_PLACED_SUBRESOURCE_FOOTPRINT const& footprint,
+    uint32_t numRows,
+    uint64_t rowSizeInBytes)
+{
+    TextureStream stream{};
+    stream.InputOffset = inputOffset;
+    stream.OutputOffset = static_cast<uint32_t>(footprint.Offset);
+    stream.RowSize = static_cast<uint32_t>(rowSizeInBytes);
+    stream.RowPitch = footprint.Footprint.RowPitch;
+    stream.NumRows = numRows;
+    stream.SlicePitch = footprint.Footprint.RowPitch * numRows;
+    return stream;
+}
+
+GpuDecompressor::TileRangeStream GpuDecompressor::MakeTileRangeStream(
+    uint32_t inputOffset,
+    uint32_t outputOffset,
+    uint32_t firstTile,
+    uint32_t numTiles)
+{
+    assert(firstTile <= 0xffff && numTiles <= 0xffff);
+
+    TileRangeStream stream{};
+    stream.InputOffset = inputOffset;
+    stream.OutputOffset = outputOffset;
+    stream.TileRange = firstTile | (numTiles << 16);
+    return stream;
+}
+
+GpuDecompressor::TransformStream GpuDecompressor::MakeTransformStream(
+    uint32_t inputOffset,
+    uint32_t outputOffset,
+    TransformKind kind,
+    uint32_t size,
+    uint32_t split,
+    uint32_t deltaStride)
+{
+    assert(kind == TransformNone || (size != 0 && size <= 0xff));
+    assert(kind != TransformBlockSplit || (split != 0 && split < size));
+    assert(deltaStride == 0 || deltaStride == 1 || deltaStride == 2 || deltaStride == 4);
+
+    TransformStream stream{};
+    stream.InputOffset = inputOffset;
+    stream.OutputOffset = outputOffset;
+    stream.Transform = kind | (size << 8) | (split << 16) | (deltaStride << 24);
+    return stream;
+}
+
+void GpuDecompressor::ApplyTransform(uint8_t* data, size_t size, uint32_t transform)
+{
+    uint32_t kind = transform & 0xff;
+    uint32_t elementSize = (transform >> 8) & 0xff;
+    uint32_t split = (transform >> 16) & 0xff;
+    uint32_t stride = transform >> 24;
+
+    std::vector<uint8_t> elements;
+    for (size_t tileStart = 0; tileStart < size; tileStart += kTileSize)
+    {
+        uint8_t* tile = data + tileStart;
+        size_t tileSize = std::min<size_t>(kTileSize, size - tileStart);
+
+        // The kernel undoes the delta once the bytes are back in place, so it goes first here
+        if (stride != 0)
+        {
+            for (size_t i = tileSize; i-- > stride;)
+                tile[i] -= tile[i - stride];
+        }
+
+        if (kind == TransformNone)
+            continue;
+
+        // Moves every byte of the whole elements to the position that TransformAddress maps
+        // back to it. Bytes past the last whole element stay where they are.
+        size_t count = tileSize / elementSize;
+        elements.assign(tile, tile + count * elementSize);
+        for (size_t e = 0; e < count; ++e)
+        {
+            for (size_t b = 0; b < elementSize; ++b)
+            {
+                size_t filtered;
+                if (kind == TransformBytePlanes)
+                    filtered = b * count + e;
+                else if (b < split)
+                    filtered = e * split + b;
+                else
+                    filtered = count * split + e * (elementSize - split) + (b - split);
+
+                tile[filtered] = elements[e * elementSize + b];
+            }
+        }
+    }
+}
+
+// One 64 byte block of the ChaCha20 keystream (RFC 8439), as ChaChaRounds in GDeflate.hlsl
+// computes it
+static void ChaCha20Block(uint32_t const (&key)[8], uint32_t counter, uint32_t const (&nonce)[3], uint32_t (&out)[16])
+{
+    uint32_t const initial[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, // "expand 32-byte k"
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        counter, nonce[0], nonce[1], nonce[2]};
+
+    uint32_t x[16];
+    std::copy(std::begin(initial), std::end(initial), x);
+
+    auto rotl = [](uint32_t value, int n) { return (value << n) | (value >> (32 - n)); };
+    auto quarterRound = [&](int a, int b, int c, int d)
+    {
+        x[a] += x[b];
+        x[d] = rotl(x[d] ^ x[a], 16);
+        x[c] += x[d];
+        x[b] = rotl(x[b] ^ x[c], 12);
+        x[a] += x[b];
+        x[d] = rotl(x[d] ^ x[a], 8);
+        x[c] += x[d];
+        x[b] = rotl(x[b] ^ x[c], 7);
+    };
+
+    for (int round = 0; round < 20; round += 2)
+    {
+        quarterRound(0, 4, 8, 12);
+        quarterRound(1, 5, 9, 13);
+        quarterRound(2, 6, 10, 14);
+        quarterRound(3, 7, 11, 15);
+        quarterRound(0, 5, 10, 15);
+        quarterRound(1, 6, 11, 12);
+        quarterRound(2, 7, 8, 13);
+        quarterRound(3, 4, 9, 14);
+    }
+
+    for (int i = 0; i < 16; ++i)
+        out[i] = x[i] + initial[i];
+}
+
+void GpuDecompressor::EncryptTileStream(
+    uint8_t* tileStream,
+    size_t size,
+    uint8_t const (&key)[kCryptoKeySize],
+    uint32_t const (&nonce)[3])
+{
+    // The tile table follows the 8 byte header, with a checksum table after it when the
+    // header's checksums bit is set, see TileStream.h
+    uint16_t numTiles = 0;
+    uint32_t flags = 0;
+    memcpy(&numTiles, tileStream + 2, sizeof(numTiles));
+    memcpy(&flags, tileStream + 4, sizeof(flags));
+    bool checksums = (flags >> 21) & 1;
+    size_t dataStart = 8 + numTiles * sizeof(uint32_t) * (checksums ? 2 : 1);
+
+    uint32_t keyWords[8];
+    memcpy(keyWords, key, sizeof(keyWords));
+
+    constexpr size_t kBlockSize = 64;
+    for (size_t blockStart = dataStart & ~(kBlockSize - 1); blockStart < size; blockStart += kBlockSize)
+    {
+        uint32_t keystream[16];
+        ChaCha20Block(keyWords, static_cast<uint32_t>(blockStart / kBlockSize), nonce, keystream);
+
+        uint8_t const* keystreamBytes = reinterpret_cast<uint8_t const*>(keystream);
+        for (size_t i = std::max(blockStart, dataStart); i < std::min(blockStart + kBlockSize, size); ++i)
+            tileStream[i] ^= keystreamBytes[i - blockStart];
+    }
+}
+
 std::unique_ptr<GpuDecompressor> GpuDecompressor::Create(
     ID3D12Device* device,
     DeviceInfo deviceInfo,
-    std::filesystem::path const& shaderPath)
+    std::filesystem::path const& shaderPath,
+    bool profile)
 {
-    return std::make_unique<GpuDecompressor>(device, deviceInfo, shaderPath);
+    return std::make_unique<GpuDecompressor>(device, deviceInfo, shaderPath, profile);
 }
 
 void GpuDecompressor::ExecuteCommandListSynchronously()
+{
+    WaitForFence(ExecuteCommandList());
+}
+
+uint64_t GpuDecompressor::ExecuteCommandList()
 {
     m_commandList->Close();
     ID3D12CommandList* commandLists[] = {m_commandList.get()};
     m_commandQueue->ExecuteCommandLists(1, commandLists);
     m_commandQueue->Signal(m_fence.get(), m_nextFenceValue);
-    m_fence->SetEventOnCompletion(m_nextFenceValue, m_fenceEvent.get());
+    return m_nextFenceValue++;
+}
 
-    ++m_nextFenceValue;
+void GpuDecompressor::WaitForFence(uint64_t fenceValue)
+{
+    m_fence->SetEventOnCompletion(fenceValue, m_fenceEvent.get());
     m_fenceEvent.wait();
 
     m_commandAllocator->Reset();
     m_commandList->Reset(m_commandAllocator.get(), nullptr);
 }
 
-void GpuDecompressor::ClearScratchBuffer(uint64_t scratchBufferSize)
+void GpuDecompressor::ClearScratchBuffer(
+    ID3D12GraphicsCommandList* commandList,
+    uint32_t descriptorIndex,
+    ID3D12Resource* scratchBuffer,
+    uint64_t scratchBufferSize)
 {
     ID3D12DescriptorHeap* heaps[] = {m_gpuVisibleDescHeap.get()};
-    m_commandList->SetDescriptorHeaps(_countof(heaps), heaps);
+    commandList->SetDescriptorHeaps(_countof(heaps), heaps);
+
+    // Batches in flight each clear through their own descriptor
+    uint32_t descriptorSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    CD3DX12_CPU_DESCRIPTOR_HANDLE gpuHeapCpuHandle(
+        m_gpuVisibleDescHeap->GetCPUDescriptorHandleForHeapStart(),
+        descriptorIndex,
+        descriptorSize);
+    CD3DX12_GPU_DESCRIPTOR_HANDLE gpuHeapGpuHandle(
+        m_gpuVisibleDescHeap->GetGPUDescriptorHandleForHeapStart(),
+        descriptorIndex,
+        descriptorSize);
+    CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHeapCpuHandle(
+        m_cpuVisibleDescHeap->GetCPUDescriptorHandleForHeapStart(),
+        descriptorIndex,
+        descriptorSize);
 
     D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc{};
     uavDesc.Format = DXGI_FORMAT_R32_UINT;
@@ -217,23 +1775,15 @@ void GpuDecompressor::ClearScratchBuffer(uint64_t scratchBufferSize)
     uavDesc.Buffer.FirstElement = 0;
     uavDesc.Buffer.NumElements = static_cast<uint32_t>(static_cast<uint32_t>(scratchBufferSize) / sizeof(uint32_t));
 
-    m_device->CreateUnorderedAccessView(
-        m_buffers.ScratchBuffer.get(),
-        nullptr,
-        &uavDesc,
-        m_gpuVisibleDescHeap->GetCPUDescriptorHandleForHeapStart());
+    m_device->CreateUnorderedAccessView(scratchBuffer, nullptr, &uavDesc, gpuHeapCpuHandle);
 
-    m_device->CreateUnorderedAccessView(
-        m_buffers.ScratchBuffer.get(),
-        nullptr,
-        &uavDesc,
-        m_cpuVisibleDescHeap->GetCPUDescriptorHandleForHeapStart());
+    m_device->CreateUnorderedAccessView(scratchBuffer, nullptr, &uavDesc, cpuHeapCpuHandle);
 
     uint32_t values[4]{0, 0, 0, 0};
-    m_commandList->ClearUnorderedAccessViewUint(
-        m_gpuVisibleDescHeap->GetGPUDescriptorHandleForHeapStart(),
-        m_cpuVisibleDescHeap->GetCPUDescriptorHandleForHeapStart(),
-        m_buffers.ScratchBuffer.get(),
+    commandList->ClearUnorderedAccessViewUint(
+        gpuHeapGpuHandle,
+        cpuHeapCpuHandle,
+        scratchBuffer,
         values,
         0,
         nullptr);
@@ -244,10 +1794,10 @@ uint64_t GpuDecompressor::GetRequiredScratchBufferSize(uint16_t numStreams)
     return sizeof(uint32_t) * numStreams;
 }
 
-size_t GpuDecompressor::CalculateControlBufferSize(size_t numStreams)
+size_t GpuDecompressor::CalculateControlBufferSize(size_t numStreams, size_t entrySize)
 {
     // [Total Streams] + [Stream Entry] + [Stream Entry]...
-    return sizeof(uint32_t) + (numStreams * sizeof(Stream));
+    return sizeof(uint32_t) + (numStreams * entrySize);
 }
 
 winrt::com_ptr<ID3D12Resource> GpuDecompressor::CreateBuffer(
@@ -270,62 +1820,32 @@ winrt::com_ptr<ID3D12Resource> GpuDecompressor::CreateBuffer(
     return buffer;
 }
 
-GpuDecompressor::Buffers GpuDecompressor::CreateBuffers(
-    ID3D12Device* device,
-    uint64_t inputBufferSize,
-    uint64_t outputBufferSize,
-    uint64_t controlBufferSize,
-    uint64_t uploadBufferSize,
-    uint64_t scratchBufferSize)
+winrt::com_ptr<ID3D12Heap> GpuDecompressor::CreateHeap(ID3D12Device* device, uint64_t size, D3D12_HEAP_TYPE heapType)
 {
-    Buffers buffers{};
-
-    buffers.InputBuffer = CreateBuffer(
-        device,
-        inputBufferSize,
-        D3D12_HEAP_TYPE_DEFAULT,
-        D3D12_RESOURCE_STATE_COMMON,
-        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-
-    winrt::check_hresult(buffers.InputBuffer->SetName(L"Input Buffer"));
-
-    buffers.OutputBuffer = CreateBuffer(
-        device,
-        outputBufferSize,
-        D3D12_HEAP_TYPE_DEFAULT,
-        D3D12_RESOURCE_STATE_COMMON,
-        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-
-    winrt::check_hresult(buffers.OutputBuffer->SetName(L"Ouput Buffer"));
-
-    buffers.ControlBuffer = CreateBuffer(
-        device,
-        controlBufferSize,
-        D3D12_HEAP_TYPE_DEFAULT,
-        D3D12_RESOURCE_STATE_COMMON,
-        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-
-    winrt::check_hresult(buffers.ControlBuffer->SetName(L"Control Buffer"));
-
-    buffers.UploadBuffer = CreateBuffer(
-        device,
-        uploadBufferSize,
-        D3D12_HEAP_TYPE_UPLOAD,
-        D3D12_RESOURCE_STATE_GENERIC_READ,
-        D3D12_RESOURCE_FLAG_NONE);
-
-    winrt::check_hresult(buffers.UploadBuffer->SetName(L"Upload Buffer"));
+    winrt::com_ptr<ID3D12Heap> heap;
+    auto heapDesc = CD3DX12_HEAP_DESC(size, heapType, 0, D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS);
+    winrt::check_hresult(device->CreateHeap(&heapDesc, IID_PPV_ARGS(heap.put())));
+    return heap;
+}
 
-    buffers.ScratchBuffer = CreateBuffer(
-        device,
-        scratchBufferSize,
-        D3D12_HEAP_TYPE_DEFAULT,
-        D3D12_RESOURCE_STATE_COMMON,
-        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+winrt::com_ptr<ID3D12Resource> GpuDecompressor::CreatePlacedBuffer(
+    ID3D12Device* device,
+    ID3D12Heap* heap,
+    uint64_t& heapOffset,
+    uint64_t size,
+    D3D12_RESOURCE_STATES initialState,
+    D3D12_RESOURCE_FLAGS flags,
+    wchar_t const* name)
+{
+    winrt::com_ptr<ID3D12Resource> buffer;
+    auto bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(size, flags);
+    winrt::check_hresult(
+        device->CreatePlacedResource(heap, heapOffset, &bufferDesc, initialState, nullptr, IID_PPV_ARGS(buffer.put())));
 
-    winrt::check_hresult(buffers.ScratchBuffer->SetName(L"Scratch Buffer"));
+    winrt::check_hresult(buffer->SetName(name));
 
-    return buffers;
+    heapOffset += AlignPlacement(size);
+    return buffer;
 }
 
 winrt::com_ptr<ID3D12RootSignature> GpuDecompressor::CreateRootSignature(ID3D12Device* device)
@@ -338,6 +1858,8 @@ winrt::com_ptr<ID3D12RootSignature> GpuDecompressor::CreateRootSignature(ID3D12D
     rootParameters[RootUAVControl].InitAsUnorderedAccessView(0);
     rootParameters[RootUAVOutput].InitAsUnorderedAccessView(1);
     rootParameters[RootUAVScratch].InitAsUnorderedAccessView(2);
+    rootParameters[RootConstantScratchEpoch].InitAsConstants(1, 0);
+    rootParameters[RootUAVProfile].InitAsUnorderedAccessView(3);
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC computeRootSignatureDesc;
     computeRootSignatureDesc.Init_1_1(static_cast<uint32_t>(rootParameters.size()), rootParameters.data(), 0, nullptr);
@@ -358,34 +1880,226 @@ winrt::com_ptr<ID3D12RootSignature> GpuDecompressor::CreateRootSignature(ID3D12D
     return rootSignature;
 }
 
-std::vector<uint8_t> GpuDecompressor::CompileShader(std::filesystem::path const& shaderPath, DeviceInfo const& info)
+ShaderPermutation GpuDecompressor::SelectShaderPermutation(DeviceInfo const& info)
+{
+    ShaderPermutation permutation;
+
+    // The precompiled wave permutations use WaveMatch and so target shader model 6.5.
+    // wave64 runs two tiles per group so that the upper half of each wave has work.
+    if (info.SupportsWaveIntrinsics && info.SupportsWaveMatch && (info.SIMDWidth == 32 || info.SIMDWidth == 64))
+    {
+        uint32_t numThreads = info.SIMDWidth == 64 ? 2 * kShaderNumThreads : kShaderNumThreads;
+        permutation = {L"wave" + std::to_wstring(info.SIMDWidth), L"cs_6_5", info.SIMDWidth, numThreads, true};
+    }
+    // Other wave widths get a permutation that is compiled on first use and then cached
+    else if (info.SupportsWaveIntrinsics)
+    {
+        permutation = {
+            L"wave" + std::to_wstring(info.SIMDWidth) + L"_" + info.SupportedShaderModel,
+            info.SupportedShaderModel,
+            info.SIMDWidth,
+            kShaderNumThreads,
+            info.SupportsWaveMatch};
+    }
+    else
+    {
+        return {L"groupshared", L"cs_6_0", 0, kShaderNumThreads, false};
+    }
+
+    // Native 16-bit types need shader model 6.2. The names match the precompiled
+    // wave32_16bit and wave64_16bit builds.
+    if (info.Supports16BitTypes && permutation.ShaderModel >= L"cs_6_2")
+    {
+        permutation.Name += L"_16bit";
+        permutation.Use16BitTypes = true;
+    }
+
+    return permutation;
+}
+
+std::wstring GpuDecompressor::GetShaderCacheKey(DeviceInfo const& info)
+{
+    std::wstringstream key;
+    key << std::hex << info.VendorId << L"_" << info.DeviceId << L"_" << std::dec
+        << ((info.DriverVersion >> 48) & 0xffff) << L"." << ((info.DriverVersion >> 32) & 0xffff) << L"."
+        << ((info.DriverVersion >> 16) & 0xffff) << L"." << (info.DriverVersion & 0xffff);
+    return key.str();
+}
+
+std::wstring GpuDecompressor::GetVariantSuffix(ShaderPermutation const& permutation)
+{
+    std::wstring suffix;
+    if (permutation.Persistent)
+        suffix += L"_persistent";
+    if (permutation.TextureOutput)
+        suffix += L"_texture";
+    if (permutation.PostTransform)
+        suffix += L"_transform";
+    if (permutation.TileRange)
+        suffix += L"_tilerange";
+    if (permutation.StagedOutput)
+        suffix += L"_staged";
+    if (permutation.Decrypt)
+        suffix += L"_decrypt";
+    if (permutation.Profile)
+        suffix += L"_profile";
+    return suffix;
+}
+
+std::filesystem::path GpuDecompressor::GetPipelineCachePath(ShaderPermutation const& permutation) const
+{
+    return m_shaderPath.parent_path() / L"ShaderCache" /
+           (L"GDeflate_" + permutation.Name + L"_" + GetShaderCacheKey(m_deviceInfo) + L".pso");
+}
+
+std::vector<uint8_t> GpuDecompressor::LoadShader(
+    std::filesystem::path const& shaderPath,
+    DeviceInfo const& info,
+    ShaderPermutation& permutation)
+{
+    auto shaderDirectory = shaderPath.parent_path();
+
+    // Permutations built along with the demo are used as is
+    auto byteCode = ReadFileIfPresent(shaderDirectory / (L"GDeflate_" + permutation.Name + L".dxil"));
+    if (!byteCode.empty())
+        return byteCode;
+
+    // Without the HLSL source only the precompiled fallback is left
+    std::error_code ec;
+    if (!std::filesystem::exists(shaderPath, ec))
+    {
+        // Profiling builds aren't precompiled, so one is never found here
+        ShaderPermutation fallback = {L"groupshared", L"cs_6_0", 0, kShaderNumThreads, false};
+        fallback.Persistent = permutation.Persistent;
+        fallback.Profile = permutation.Profile;
+        fallback.TextureOutput = permutation.TextureOutput;
+        fallback.PostTransform = permutation.PostTransform;
+        fallback.TileRange = permutation.TileRange;
+        fallback.StagedOutput = permutation.StagedOutput;
+        fallback.Decrypt = permutation.Decrypt;
+        fallback.Name += GetVariantSuffix(fallback);
+        permutation = fallback;
+        byteCode = ReadFileIfPresent(shaderDirectory / (L"GDeflate_" + permutation.Name + L".dxil"));
+        winrt::check_hresult(byteCode.empty() ? HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) : S_OK);
+        return byteCode;
+    }
+
+    // Anything else is compiled once per adapter and driver, and again whenever the source changes
+    auto cachedPath = shaderDirectory / L"ShaderCache" /
+                      (L"GDeflate_" + permutation.Name + L"_" + GetShaderCacheKey(info) + L".dxil");
+    auto cachedTime = std::filesystem::last_write_time(cachedPath, ec);
+    if (!ec && cachedTime >= std::filesystem::last_write_time(shaderPath, ec) && !ec &&
+        cachedTime >= std::filesystem::last_write_time(shaderDirectory / L"tilestream.hlsl", ec) && !ec)
+    {
+        byteCode = ReadFileIfPresent(cachedPath);
+        if (!byteCode.empty())
+            return byteCode;
+    }
+
+    std::cout << "Compiling shader, this only happens on the first run\n";
+    byteCode = CompileShader(shaderPath, permutation);
+    WriteCacheFile(cachedPath, byteCode.data(), byteCode.size());
+    return byteCode;
+}
+
+winrt::com_ptr<ID3D12PipelineState> GpuDecompressor::CreatePipelineState(
+    std::filesystem::path const& cachePath,
+    std::vector<uint8_t> const& byteCode)
+{
+    winrt::com_ptr<ID3D12PipelineState> pipelineState;
+
+    D3D12_COMPUTE_PIPELINE_STATE_DESC pipelineDesc{};
+    pipelineDesc.pRootSignature = m_rootSignature.get();
+    pipelineDesc.CS.pShaderBytecode = byteCode.data();
+    pipelineDesc.CS.BytecodeLength = byteCode.size();
+
+    // The driver rejects a blob cached by another adapter or driver version, in which case
+    // the pipeline is built from the bytecode and the cache is refreshed
+    auto cachedBlob = ReadFileIfPresent(cachePath);
+    if (!cachedBlob.empty())
+    {
+        pipelineDesc.CachedPSO.pCachedBlob = cachedBlob.data();
+        pipelineDesc.CachedPSO.CachedBlobSizeInBytes = cachedBlob.size();
+        if (SUCCEEDED(m_device->CreateComputePipelineState(&pipelineDesc, IID_PPV_ARGS(pipelineState.put()))))
+            return pipelineState;
+
+        pipelineDesc.CachedPSO = {};
+    }
+
+    winrt::check_hresult(m_device->CreateComputePipelineState(&pipelineDesc, IID_PPV_ARGS(pipelineState.put())));
+
+    winrt::com_ptr<ID3DBlob> blob;
+    if (SUCCEEDED(pipelineState->GetCachedBlob(blob.put())))
+        WriteCacheFile(cachePath, blob->GetBufferPointer(), blob->GetBufferSize());
+
+    return pipelineState;
+}
+
+std::vector<uint8_t> GpuDecompressor::CompileShader(
+    std::filesystem::path const& shaderPath,
+    ShaderPermutation const& permutation)
 {
     std::vector<uint8_t> byteCode;
 
-    // Build compiler arguments based on device's supported features
+    // Build compiler arguments for the permutation, these match the ones used in CMakeLists.txt
     std::vector<std::wstring> arguments;
     arguments.push_back(L"-O3");
     arguments.push_back(L"-WX");
     arguments.push_back(L"-Zi");
 
-    if (info.SupportsWaveIntrinsics)
+    if (permutation.SIMDWidth != 0)
     {
         arguments.push_back(L"-DUSE_WAVE_INTRINSICS");
+        arguments.push_back(L"-DSIMD_WIDTH=" + std::to_wstring(permutation.SIMDWidth));
     }
 
-    if (info.SupportsWaveMatch)
+    if (permutation.UseWaveMatch)
     {
         arguments.push_back(L"-DUSE_WAVE_MATCH");
     }
 
-    if (info.Supports16BitTypes)
+    arguments.push_back(L"-DNUM_THREADS=" + std::to_wstring(permutation.NumThreads));
+
+    if (permutation.Persistent)
     {
-        arguments.push_back(L"-enable-16bit-types");
+        arguments.push_back(L"-DPERSISTENT_THREADS");
+    }
+
+    if (permutation.Profile)
+    {
+        arguments.push_back(L"-DPROFILE");
+    }
+
+    if (permutation.TextureOutput)
+    {
+        arguments.push_back(L"-DTEXTURE_OUTPUT");
+    }
+
+    if (permutation.PostTransform)
+    {
+        arguments.push_back(L"-DPOST_TRANSFORM");
+    }
+
+    if (permutation.TileRange)
+    {
+        arguments.push_back(L"-DTILE_RANGE");
+    }
+
+    if (permutation.StagedOutput)
+    {
+        arguments.push_back(L"-DSTAGED_OUTPUT");
+    }
+
+    if (permutation.Decrypt)
+    {
+        arguments.push_back(L"-DDECRYPT");
     }
 
-    std::wstringstream simdArg;
-    simdArg << L"-DSIMD_WIDTH=" << info.SIMDWidth;
-    arguments.push_back(simdArg.str());
+    if (permutation.Use16BitTypes)
+    {
+        arguments.push_back(L"-enable-16bit-types");
+        arguments.push_back(L"-DUSE_16BIT_TYPES");
+    }
 
     winrt::com_ptr<IDxcLibrary> library;
     winrt::check_hresult(DxcCreateInstance(CLSID_DxcLibrary, IID_PPV_ARGS(library.put())));
@@ -408,7 +2122,7 @@ std::vector<uint8_t> GpuDecompressor::CompileShader(std::filesystem::path const&
         sourceBlob.get(),
         shaderPath.wstring().c_str(),
         L"CSMain",
-        info.SupportedShaderModel.c_str(),
+        permutation.ShaderModel.c_str(),
         pargs.data(),
         static_cast<uint32_t>(pargs.size()),
         nullptr,
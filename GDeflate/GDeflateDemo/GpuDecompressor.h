@@ -3,6 +3,10 @@
  * SPDX-License-Identifier: MIT
  */
 
+#pragma once
+
+#include "CompressedFile.h"
+
 #ifdef WIN32
 
 struct DeviceInfo
@@ -15,11 +19,31 @@ struct DeviceInfo
     uint32_t SIMDWidth;
     uint32_t SIMDLaneCount;
     std::wstring SupportedShaderModel;
+    uint32_t VendorId;
+    uint32_t DeviceId;
+    uint64_t DriverVersion;
 };
 
-#define DWORD_ALIGN(count) ((count + 3) & ~3)
+// A build of GDeflate.hlsl for one class of hardware. The common permutations are
+// compiled ahead of time (see CMakeLists.txt) and loaded as GDeflate_<Name>.dxil.
+struct ShaderPermutation
+{
+    std::wstring Name;
+    std::wstring ShaderModel;
+    uint32_t SIMDWidth; // 0 selects the groupshared fallback
+    uint32_t NumThreads;
+    bool UseWaveMatch;
+    bool Persistent = false; // Built with PERSISTENT_THREADS for DecompressStreaming
+    bool Profile = false;    // Built with PROFILE, compiled at runtime only
+    bool Use16BitTypes = false; // Built with USE_16BIT_TYPES and -enable-16bit-types
+    bool TextureOutput = false; // Built with TEXTURE_OUTPUT for DecompressTextures
+    bool Decrypt = false;       // Built with DECRYPT for DecompressEncrypted
+    bool TileRange = false;     // Built with TILE_RANGE for DecompressTileRanges
+    bool PostTransform = false; // Built with POST_TRANSFORM for DecompressTransformed
+    bool StagedOutput = false;  // Built with STAGED_OUTPUT for DecompressStaged
+};
 
-using BufferVector = std::vector<std::vector<uint8_t>>;
+#define DWORD_ALIGN(count) ((count + 3) & ~3)
 
 class GpuDecompressor
 {
@@ -34,18 +58,55 @@ class GpuDecompressor
 
     winrt::com_ptr<ID3D12RootSignature> m_rootSignature;
     winrt::com_ptr<ID3D12PipelineState> m_pipelineState;
-    uint32_t m_dispatchSize;
+    winrt::com_ptr<ID3D12PipelineState> m_persistentPipelineState;
+    winrt::com_ptr<ID3D12PipelineState> m_hashPipelineState;
+
+    // Builds of the kernel with the optional features of GDeflate.hlsl, each loaded by the first
+    // decode that needs it, see GetFeaturePipelineState
+    winrt::com_ptr<ID3D12PipelineState> m_texturePipelineState;
+    winrt::com_ptr<ID3D12PipelineState> m_decryptPipelineState;
+    winrt::com_ptr<ID3D12PipelineState> m_tileRangePipelineState;
+    winrt::com_ptr<ID3D12PipelineState> m_transformPipelineState;
+    winrt::com_ptr<ID3D12PipelineState> m_stagedPipelineState;
+    std::filesystem::path m_shaderPath;
+    DeviceInfo m_deviceInfo;
+    ShaderPermutation m_permutation; // Selected for the device, the feature builds add to it
+    winrt::com_ptr<ID3D12CommandSignature> m_decodeCommandSignature; // Epoch constant and dispatch, see RecordDecode
+    uint32_t m_numSIMDs;
+    uint32_t m_dispatchSize; // Upper bound on the groups of a dispatch, see GetDispatchSize
+    std::filesystem::path m_dispatchSizeCachePath;
+
+    static constexpr uint32_t kDefaultGroupsPerSIMD = 8;
+    static constexpr uint32_t kMaxGroupsPerSIMD = 32;
+
+    // Decompress keeps uploads and readbacks off the compute queue, each on its own copy
+    // queue, so that the transfers for one batch overlap decoding the batch before it
+    winrt::com_ptr<ID3D12CommandQueue> m_uploadQueue;
+    winrt::com_ptr<ID3D12CommandQueue> m_readbackQueue;
+
+    winrt::com_ptr<ID3D12Fence> m_uploadFence;
+    uint64_t m_nextUploadFenceValue;
+    winrt::com_ptr<ID3D12Fence> m_readbackFence;
+    uint64_t m_nextReadbackFenceValue;
 
     winrt::com_ptr<ID3D12DescriptorHeap> m_gpuVisibleDescHeap;
     winrt::com_ptr<ID3D12DescriptorHeap> m_cpuVisibleDescHeap;
 
+    // Set when created for profiling, Decompress then reports each batch, see GDeflate.hlsl
+    bool m_profile;
+    uint32_t m_tilesPerGroup;
+    winrt::com_ptr<ID3D12QueryHeap> m_timestampQueryHeap;
+    uint64_t m_timestampFrequency;
+
     enum RootParameters : uint32_t
     {
         RootSRVInput = 0,
-        RootSRVCryptoCtx, // unused
+        RootSRVCryptoCtx, // Key of a kernel built with DECRYPT
         RootUAVControl,
         RootUAVOutput,
         RootUAVScratch,
+        RootConstantScratchEpoch, // Offset of the hash entries for GDeflateHash.hlsl
+        RootUAVProfile,
         RootParametersCount
     };
 
@@ -55,6 +116,57 @@ class GpuDecompressor
         uint32_t OutputOffset;
     };
 
+    // Stream queue read by the PERSISTENT_THREADS kernel, see GDeflate.hlsl
+    struct QueueHeader
+    {
+        uint32_t Cursor;
+        uint32_t Tail;
+        uint32_t Quit;
+        uint32_t Capacity;
+        uint32_t Padding[4];
+    };
+
+    struct QueueEntry
+    {
+        uint32_t InputOffset;
+        uint32_t OutputOffset;
+        uint32_t TilesDone;
+        uint32_t Padding;
+    };
+
+    static constexpr uint32_t kQueueSequenceMask = 0xfff;
+    static constexpr uint32_t kQueueTileBits = 20;
+
+    // Written by a kernel built with PROFILE, after a 16 byte header
+    struct ProfileRecord
+    {
+        uint32_t StartTicket;
+        uint32_t EndTicket;
+        uint32_t TilesDecoded;
+        uint32_t BytesDecoded;
+    };
+
+    static constexpr uint32_t kProfileHeaderSize = 16;
+
+    // Read by the ExecuteIndirect of a batch's decode, from the end of its upload buffer
+    struct DecodeArguments
+    {
+        uint32_t ScratchEpoch;
+        D3D12_DISPATCH_ARGUMENTS Dispatch;
+    };
+
+    // Follows the stream entries in the control buffer of a batch staged for hashing, see GDeflateHash.hlsl
+    struct HashEntry
+    {
+        uint32_t OutputOffset;
+        uint32_t Size;
+        uint32_t SumA;
+        uint32_t SumB;
+        uint32_t Padding;
+    };
+
+    static constexpr uint32_t kHashChunkSize = 64 * 1024;
+
     struct Buffers
     {
         winrt::com_ptr<ID3D12Resource> InputBuffer;
@@ -62,26 +174,439 @@ class GpuDecompressor
         winrt::com_ptr<ID3D12Resource> ControlBuffer;
         winrt::com_ptr<ID3D12Resource> ScratchBuffer;
         winrt::com_ptr<ID3D12Resource> UploadBuffer;
+        winrt::com_ptr<ID3D12Resource> ReadbackBuffer;
+    };
+
+    // One slot of the Decompress pipeline, reused once the readback of the batch it last
+    // held has completed. Its buffers are placed in heaps that the slot keeps between calls
+    // and only reallocates to grow, by doubling.
+    struct Batch
+    {
+        winrt::com_ptr<ID3D12CommandAllocator> UploadAllocator;
+        winrt::com_ptr<ID3D12GraphicsCommandList> UploadList;
+        winrt::com_ptr<ID3D12CommandAllocator> ComputeAllocator;
+        winrt::com_ptr<ID3D12GraphicsCommandList> ComputeList;
+        winrt::com_ptr<ID3D12CommandAllocator> ReadbackAllocator;
+        winrt::com_ptr<ID3D12GraphicsCommandList> ReadbackList;
+
+        winrt::com_ptr<ID3D12Heap> DefaultHeap; // Input, output, control and scratch buffers
+        winrt::com_ptr<ID3D12Heap> UploadHeap;
+        winrt::com_ptr<ID3D12Heap> ReadbackHeap;
+        uint64_t HeapSize = 0;
+        bool Transient = false; // Over the pool limit, released once read back
+
+        Buffers Resources;
+        uint64_t InputCapacity = 0;
+        uint64_t OutputCapacity = 0;
+        uint64_t ControlCapacity = 0;
+        uint64_t ScratchCapacity = 0;
+        uint32_t ScratchEpoch = 0; // Epoch of the last dispatch, 0 for a zeroed scratch buffer
+        uint32_t DispatchSize = 0;
+        bool DecodeRecorded = false; // ComputeList holds the decode of these buffers, see RecordDecode
+
+        // Only with profiling. The readback holds the dispatch's two timestamps followed by
+        // a copy of the profile buffer.
+        winrt::com_ptr<ID3D12Resource> ProfileBuffer;
+        winrt::com_ptr<ID3D12Resource> ProfileReadbackBuffer;
+
+        size_t FirstStream = 0;
+        std::vector<Stream> Streams;
+        uint64_t ReadbackFenceValue = 0; // 0 while the slot holds no batch
+    };
+    std::vector<Batch> m_batches;
+
+    // One slot of DecompressResident, reused once the decode it last held has completed. The
+    // control and scratch buffers are its own, the streams stay in the caller's buffers.
+    struct ResidentDecode
+    {
+        winrt::com_ptr<ID3D12CommandAllocator> Allocator;
+        winrt::com_ptr<ID3D12GraphicsCommandList> CommandList;
+
+        winrt::com_ptr<ID3D12Resource> ControlBuffer;
+        winrt::com_ptr<ID3D12Resource> UploadBuffer; // What the control buffer is copied from
+        winrt::com_ptr<ID3D12Resource> ScratchBuffer;
+        uint64_t ControlCapacity = 0;
+        uint64_t ScratchCapacity = 0;
+        uint32_t ScratchEpoch = 0;
+
+        uint64_t FenceValue = 0; // Of the decode on m_fence, 0 while the slot holds none
     };
-    Buffers m_buffers;
+    std::vector<ResidentDecode> m_residentDecodes;
+    uint32_t m_nextResidentDecode;
+
+    uint64_t m_bufferPoolLimit;
+    uint64_t m_bufferPoolSize; // Heap bytes held by the batch slots, not counting transient ones
+
+    static constexpr uint64_t kMinPooledBufferSize = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+
+    // StageBatch copies batches of at least kParallelStagingSize bytes on up to kMaxStagingThreads
+    // threads, in chunks of kStagingChunkSize
+    static constexpr uint64_t kParallelStagingSize = 4 * 1024 * 1024;
+    static constexpr size_t kStagingChunkSize = 1024 * 1024;
+    static constexpr uint32_t kMaxStagingThreads = 8;
+
+    // Matches the 12-bit epoch of the scratch tile counters in GDeflate.hlsl
+    static constexpr uint32_t kMaxScratchEpoch = 0xfff;
 
 public:
-    GpuDecompressor(ID3D12Device* device, DeviceInfo deviceInfo, std::filesystem::path const& shaderPath);
-    BufferVector Decompress(BufferVector const& compressedData);
+    // Control buffer entry of a kernel built with TEXTURE_OUTPUT, see GDeflate.hlsl
+    struct TextureStream
+    {
+        uint32_t InputOffset;
+        uint32_t OutputOffset;
+        uint32_t RowSize;
+        uint32_t RowPitch;
+        uint32_t NumRows;
+        uint32_t SlicePitch;
+    };
 
+    // Describes a subresource from the values returned by ID3D12Device::GetCopyableFootprints
+    // for a texture placed with D3D12_TEXTURE_LAYOUT_ROW_MAJOR
+    static TextureStream MakeTextureStream(
+        uint32_t inputOffset,
+        D3D12_PLACED_SUBRESOURCE_FOOTPRINT const& footprint,
+        uint32_t numRows,
+        uint64_t rowSizeInBytes);
+
+    // Control buffer entry of a kernel built with TILE_RANGE, see GDeflate.hlsl
+    struct TileRangeStream
+    {
+        uint32_t InputOffset;
+        uint32_t OutputOffset;
+        uint32_t TileRange;
+    };
+
+    // Decodes numTiles tiles of the stream at inputOffset, starting with firstTile, to
+    // outputOffset. Both counts must fit in 16 bits.
+    static TileRangeStream MakeTileRangeStream(
+        uint32_t inputOffset,
+        uint32_t outputOffset,
+        uint32_t firstTile,
+        uint32_t numTiles);
+
+    // Filters that a kernel built with POST_TRANSFORM undoes, see TransformAddress in GDeflate.hlsl
+    enum TransformKind : uint32_t
+    {
+        TransformNone = 0,
+        TransformBytePlanes, // Elements of size bytes split into one plane per byte
+        TransformBlockSplit, // The first split bytes of every block of size bytes stored ahead of the rest
+    };
+
+    // Filters apply per tile of the stream, so that tiles still decode independently
+    static constexpr uint32_t kTileSize = 64 * 1024;
+
+    // Control buffer entry of a kernel built with POST_TRANSFORM, see GDeflate.hlsl
+    struct TransformStream
+    {
+        uint32_t InputOffset;
+        uint32_t OutputOffset;
+        uint32_t Transform;
+    };
+
+    // Decodes the stream at inputOffset to outputOffset and undoes the filter. size is the element
+    // or block size, up to 255 bytes, split is only used by block split, and deltaStride is 0 for
+    // no delta, or 1, 2 or 4 bytes.
+    static TransformStream MakeTransformStream(
+        uint32_t inputOffset,
+        uint32_t outputOffset,
+        TransformKind kind,
+        uint32_t size,
+        uint32_t split,
+        uint32_t deltaStride);
+
+    // Filters content in place before it is compressed, with the transform word of an entry, so
+    // that the kernel gives the content back. This is the CPU reference for the filters.
+    static void ApplyTransform(uint8_t* data, size_t size, uint32_t transform);
+
+    // Control buffer entry of a kernel built with DECRYPT, see GDeflate.hlsl. The key is bound
+    // to RootSRVCryptoCtx, and every stream of a dispatch needs a nonce of its own.
+    struct EncryptedStream
+    {
+        uint32_t InputOffset;
+        uint32_t OutputOffset;
+        uint32_t Nonce[3];
+    };
+
+    static constexpr size_t kCryptoKeySize = 32;
+
+    // Encrypts a tile stream in place, with the ChaCha20 keystream that a kernel built with
+    // DECRYPT decrypts it with. The header and the tile table stay in the clear.
+    static void EncryptTileStream(
+        uint8_t* tileStream,
+        size_t size,
+        uint8_t const (&key)[kCryptoKeySize],
+        uint32_t const (&nonce)[3]);
+
+    // Decompress splits its input into batches of about kBatchInputSize bytes of compressed
+    // data and keeps up to kMaxBatchesInFlight of them between upload and readback
+    static constexpr uint32_t kMaxBatchesInFlight = 3;
+    static constexpr uint64_t kBatchInputSize = 32 * 1024 * 1024;
+
+    // Upper bound on the heap memory that Decompress keeps between calls. A batch that would
+    // take the pool past it gets buffers of just the size it needs, released after readback.
+    static constexpr uint64_t kDefaultBufferPoolLimit = 512 * 1024 * 1024;
+
+    static constexpr uint32_t kDefaultQueueCapacity = 64;
+    static constexpr uint32_t kMaxQueueCapacity = 1024;
+
+    GpuDecompressor(
+        ID3D12Device* device,
+        DeviceInfo deviceInfo,
+        std::filesystem::path const& shaderPath,
+        bool profile = false);
+
+    // batchInputSize bounds the compressed bytes of each batch. Passing the total size of the
+    // input, or more, decodes every stream in a single dispatch.
+    BufferVector Decompress(BufferVector const& compressedData, uint64_t batchInputSize = kBatchInputSize);
+
+    // Takes effect the next time a batch slot grows
+    void SetBufferPoolLimit(uint64_t limitInBytes);
+
+    // Benchmarks the streams with 1, 2, 4... kMaxGroupsPerSIMD groups per SIMD and keeps the
+    // fastest as the dispatch size. The result is cached in ShaderCache for the adapter and
+    // driver, and later instances start from it.
+    uint32_t AutoTuneDispatchSize(BufferVector const& compressedData, uint32_t iterations);
+
+    struct BenchmarkResult
+    {
+        uint64_t UncompressedSize;
+        double MinSeconds;
+        double AverageSeconds;
+        size_t MismatchedStreams;
+    };
+
+    // Uploads the first numStreams streams once and times iterations back-to-back dispatches
+    // of them with timestamp queries. The output stays on the GPU. It is hashed there once
+    // timing is done, and only the hashes are read back to be checked against the headers.
+    BenchmarkResult Benchmark(BufferVector const& compressedData, size_t numStreams, uint32_t iterations);
+
+    // Starts one persistent dispatch and then feeds it the streams through a ring of
+    // queueCapacity entries, a power of two between 2 and kMaxQueueCapacity. New streams
+    // are appended while earlier ones decode, without a dispatch and wait per batch.
+    BufferVector DecompressStreaming(
+        BufferVector const& compressedData,
+        uint32_t queueCapacity = kDefaultQueueCapacity);
+
+    // A tile stream that is already in GPU memory, see DecompressResident
+    struct ResidentStream
+    {
+        uint32_t InputOffset;  // Of the TileStream header, from the start of the input range
+        uint32_t OutputOffset; // From the start of the output range
+    };
+
+    // Decodes streams from one GPU buffer into another with a dispatch on the decompressor's
+    // compute queue, for engines that load the compressed data themselves. Nothing is staged
+    // or read back. The streams are bare TileStreams, without a CompressedFileHeader, and every
+    // offset is a multiple of 4. The input buffer must be in D3D12_RESOURCE_STATE_COMMON or
+    // NON_PIXEL_SHADER_RESOURCE, and the output buffer in COMMON or UNORDERED_ACCESS.
+    //
+    // numTiles, the tiles of all the streams together, caps the dispatch at one group per tile
+    // and may be 0 if unknown. With waitFence set, the decode first waits on the GPU for it to
+    // reach waitValue, e.g. for an upload on another queue. Returns the value that GetFence
+    // reaches once the output is complete. Up to kMaxBatchesInFlight decodes can be in flight,
+    // and they may overlap, so decodes into the same range need a wait in between.
+    uint64_t DecompressResident(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        std::vector<ResidentStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // As DecompressResident, with a STAGED_OUTPUT build of the kernel that assembles each tile in
+    // groupshared memory and stores it a dword at a time, instead of with an atomic per byte
+    uint64_t DecompressStaged(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        std::vector<ResidentStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // Decodes every stream into the subresource that its entry describes, see MakeTextureStream,
+    // with a TEXTURE_OUTPUT build of the kernel. The entries' output offsets are from
+    // outputOffset, and everything else is as for DecompressResident.
+    uint64_t DecompressTextures(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        std::vector<TextureStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // Decodes the range of tiles of every entry, see MakeTileRangeStream, with a TILE_RANGE build of
+    // the kernel. numTiles counts the tiles of the ranges, and everything else is as for
+    // DecompressResident.
+    uint64_t DecompressTileRanges(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        std::vector<TileRangeStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // Decodes streams filtered with ApplyTransform and undoes the filters, with a POST_TRANSFORM
+    // build of the kernel. Everything else is as for DecompressResident.
+    uint64_t DecompressTransformed(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        std::vector<TransformStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // Decodes streams encrypted with EncryptTileStream, with a DECRYPT build of the kernel. The
+    // kCryptoKeySize bytes of the key are read from keyBuffer at keyOffset, a multiple of 4, and
+    // keyBuffer has to be in the same states as the input buffer. Everything else is as for
+    // DecompressResident.
+    uint64_t DecompressEncrypted(
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        ID3D12Resource* keyBuffer,
+        uint64_t keyOffset,
+        std::vector<EncryptedStream> const& streams,
+        uint64_t numTiles = 0,
+        ID3D12Fence* waitFence = nullptr,
+        uint64_t waitValue = 0);
+
+    // Signaled on the decompressor's compute queue, see DecompressResident
+    ID3D12Fence* GetFence() const;
+
+    // Runs one of the resident decodes on data in host memory, to check it against the CPU
+    // decoder. input is uploaded, decode records its decode of it into a zeroed output buffer
+    // of outputSize bytes, and the output buffer is read back once the decode has completed.
+    std::vector<uint8_t> DecompressFromHost(
+        std::vector<uint8_t> const& input,
+        uint64_t outputSize,
+        std::function<void(ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)> const& decode);
+
+    // With profile set, Decompress runs a PROFILE build of the kernel and prints the GPU time,
+    // throughput and spread of tiles over the groups for every batch. The profiling build
+    // is compiled from GDeflate.hlsl, which has to be present.
     static std::unique_ptr<GpuDecompressor> Create(
         ID3D12Device* device,
         DeviceInfo deviceInfo,
-        std::filesystem::path const& shaderPath);
+        std::filesystem::path const& shaderPath,
+        bool profile = false);
+
+    // Also builds GDeflateCompress.hlsl for GpuCompressor, when it isn't precompiled
+    static std::vector<uint8_t> CompileShader(
+        std::filesystem::path const& shaderPath,
+        ShaderPermutation const& permutation);
 
 private:
     void ExecuteCommandListSynchronously();
 
-    void ClearScratchBuffer(uint64_t scratchBufferSize);
+    uint64_t ExecuteCommandList();
+
+    void WaitForFence(uint64_t fenceValue);
+
+    static std::vector<Stream> LayoutStreams(
+        BufferVector const& compressedData,
+        size_t firstStream,
+        size_t numStreams,
+        uint64_t& inputBufferSize,
+        uint64_t& outputBufferSize);
+
+    BufferVector ReadbackOutput(
+        ID3D12Resource* outputBuffer,
+        uint64_t outputBufferSize,
+        std::vector<Stream> const& streams,
+        BufferVector const& compressedData);
+
+    void SubmitBatch(uint32_t batchIndex, BufferVector const& compressedData, size_t firstStream, size_t numStreams);
+
+    void CompleteBatch(Batch& batch, BufferVector const& compressedData, BufferVector& uncompressedData);
+
+    void AllocateBatchBuffers(
+        Batch& batch,
+        uint64_t inputBufferSize,
+        uint64_t outputBufferSize,
+        uint64_t controlBufferSize,
+        uint64_t scratchBufferSize);
+
+    void ReleaseBatchBuffers(Batch& batch);
+
+    void StageBatch(
+        uint32_t batchIndex,
+        BufferVector const& compressedData,
+        size_t firstStream,
+        size_t numStreams,
+        uint64_t& inputBufferSize,
+        uint64_t& outputBufferSize,
+        uint64_t& controlBufferSize,
+        bool hashOutput = false);
+
+    static void RecordBatchUpload(
+        Batch& batch,
+        ID3D12GraphicsCommandList* commandList,
+        uint64_t inputBufferSize,
+        uint64_t controlBufferSize);
+
+    void SetDecodeArguments(Batch& batch, uint32_t batchIndex, ID3D12GraphicsCommandList* commandList);
+
+    void SetDecodeResources(Batch& batch, ID3D12GraphicsCommandList* commandList);
+
+    static bool AdvanceScratchEpoch(Batch& batch);
+
+    void RecordDecode(Batch& batch, uint32_t batchIndex, bool clearScratch);
+
+    static uint64_t GetDecodeArgumentsOffset(Batch const& batch);
+
+    uint32_t GetMaxDispatchSize() const;
+
+    uint32_t GetDispatchSize(uint64_t numTiles) const;
+
+    size_t CountHashMismatches(Batch& batch, BufferVector const& compressedData);
+
+    uint64_t GetProfileBufferSize() const;
+
+    void RecordProfileReadback(Batch& batch, uint32_t batchIndex);
+
+    void ReportBatchProfile(Batch const& batch);
+
+    void ClearScratchBuffer(
+        ID3D12GraphicsCommandList* commandList,
+        uint32_t descriptorIndex,
+        ID3D12Resource* scratchBuffer,
+        uint64_t scratchBufferSize);
+
+    // The decode of DecompressResident and the feature builds, with numStreams control buffer
+    // entries of entrySize bytes each. cryptoContext is bound to RootSRVCryptoCtx unless it is 0.
+    uint64_t SubmitResidentDecode(
+        ID3D12PipelineState* pipelineState,
+        ID3D12Resource* inputBuffer,
+        uint64_t inputOffset,
+        ID3D12Resource* outputBuffer,
+        uint64_t outputOffset,
+        void const* entries,
+        size_t entrySize,
+        size_t numStreams,
+        uint64_t numTiles,
+        ID3D12Fence* waitFence,
+        uint64_t waitValue,
+        D3D12_GPU_VIRTUAL_ADDRESS cryptoContext = 0);
+
+    // Loads the build of m_permutation with feature set into pipelineState, unless it is there
+    ID3D12PipelineState* GetFeaturePipelineState(
+        winrt::com_ptr<ID3D12PipelineState>& pipelineState,
+        bool ShaderPermutation::*feature);
 
     static uint64_t GetRequiredScratchBufferSize(uint16_t numStreams);
 
-    static size_t CalculateControlBufferSize(size_t numStreams);
+    static size_t CalculateControlBufferSize(size_t numStreams, size_t entrySize = sizeof(Stream));
 
     static winrt::com_ptr<ID3D12Resource> CreateBuffer(
         ID3D12Device* device,
@@ -90,17 +615,36 @@ private:
         D3D12_RESOURCE_STATES initialState,
         D3D12_RESOURCE_FLAGS flags);
 
-    static Buffers CreateBuffers(
+    static winrt::com_ptr<ID3D12Heap> CreateHeap(ID3D12Device* device, uint64_t size, D3D12_HEAP_TYPE heapType);
+
+    static winrt::com_ptr<ID3D12Resource> CreatePlacedBuffer(
         ID3D12Device* device,
-        uint64_t inputBufferSize,
-        uint64_t outputBufferSize,
-        uint64_t controlBufferSize,
-        uint64_t uploadBufferSize,
-        uint64_t scratchBufferSize);
+        ID3D12Heap* heap,
+        uint64_t& heapOffset,
+        uint64_t size,
+        D3D12_RESOURCE_STATES initialState,
+        D3D12_RESOURCE_FLAGS flags,
+        wchar_t const* name);
 
     static winrt::com_ptr<ID3D12RootSignature> CreateRootSignature(ID3D12Device* device);
 
-    static std::vector<uint8_t> CompileShader(std::filesystem::path const& shaderPath, DeviceInfo const& info);
+    static ShaderPermutation SelectShaderPermutation(DeviceInfo const& info);
+
+    static std::wstring GetShaderCacheKey(DeviceInfo const& info);
+
+    // The suffix that CMakeLists.txt gives the builds of a permutation, e.g. _persistent
+    static std::wstring GetVariantSuffix(ShaderPermutation const& permutation);
+
+    std::filesystem::path GetPipelineCachePath(ShaderPermutation const& permutation) const;
+
+    static std::vector<uint8_t> LoadShader(
+        std::filesystem::path const& shaderPath,
+        DeviceInfo const& info,
+        ShaderPermutation& permutation);
+
+    winrt::com_ptr<ID3D12PipelineState> CreatePipelineState(
+        std::filesystem::path const& cachePath,
+        std::vector<uint8_t> const& byteCode);
 };
 
 #endif
@@ -0,0 +1,473 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "GpuTests.h"
+
+#include <GDeflate.h>
+
+#include <random>
+
+#ifdef WIN32
+
+static constexpr uint32_t kTestCompressionLevel = 12;
+
+// A tile stream in the input of a test, and the content that the CPU decoder gets from it
+struct TestStream
+{
+    std::vector<uint8_t> Content;
+    std::vector<uint8_t> Compressed; // Without a CompressedFileHeader
+    uint32_t InputOffset;
+};
+
+// What the tests upload, every stream at a multiple of 4
+struct TestInput
+{
+    std::vector<TestStream> Streams;
+    std::vector<uint8_t> Input;
+};
+
+static void Report(char const* name, bool passed)
+{
+    std::cout << name << ": " << (passed ? "Ok" : "FAILED") << std::endl;
+}
+
+// Words from a small vocabulary with runs of random bytes in between, so that the tiles have
+// literals as well as matches of every length
+static std::vector<uint8_t> GenerateContent(uint32_t seed, size_t size)
+{
+    static char const* const kWords[] = {
+        "texture ", "mesh ", "vertex ", "index ", "material ", "shader ", "normal ", "tangent "};
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> content;
+    while (content.size() < size)
+    {
+        if (rng() % 16 == 0)
+        {
+            size_t length = 1 + rng() % 512;
+            for (size_t i = 0; i < length; ++i)
+                content.push_back(static_cast<uint8_t>(rng()));
+        }
+        else
+        {
+            char const* word = kWords[rng() % _countof(kWords)];
+            content.insert(content.end(), word, word + strlen(word));
+        }
+    }
+    content.resize(size);
+    return content;
+}
+
+// Doesn't compress, so every tile is stored
+static std::vector<uint8_t> GenerateNoise(uint32_t seed, size_t size)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> content(size);
+    for (auto& byte : content)
+        byte = static_cast<uint8_t>(rng());
+    return content;
+}
+
+// Random bytes copied from 9 to 32 KiB back, past the 8 KiB window of STAGED_OUTPUT, with a
+// random byte after every copy. Once a tile is that far in, its matches reach back further than
+// the window.
+static std::vector<uint8_t> GenerateFarMatches(uint32_t seed, size_t size)
+{
+    constexpr size_t kMinDistance = 9 * 1024;
+    constexpr size_t kMaxDistance = 32 * 1024; // The Deflate window
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> content = GenerateNoise(seed, kMaxDistance);
+    while (content.size() < size)
+    {
+        size_t distance = kMinDistance + rng() % (kMaxDistance - kMinDistance + 1);
+        size_t length = 3 + rng() % 4096;
+        for (size_t i = 0; i < length; ++i)
+            content.push_back(content[content.size() - distance]);
+        content.push_back(static_cast<uint8_t>(rng()));
+    }
+    content.resize(size);
+    return content;
+}
+
+// Compresses the contents on the CPU and checks that the CPU decoder gives them back, so that
+// any mismatch in the tests is down to the GPU
+static bool BuildTestInput(BufferVector const& contents, TestInput& test)
+{
+    for (auto& content : contents)
+    {
+        if (content.empty())
+            continue;
+
+        TestStream stream;
+        stream.Content = content;
+        if (!GDeflate::Compress(stream.Compressed, content.data(), content.size(), kTestCompressionLevel, 0))
+            return false;
+
+        std::vector<uint8_t> decoded(content.size());
+        if (!GDeflate::Decompress(
+                decoded.data(),
+                decoded.size(),
+                stream.Compressed.data(),
+                stream.Compressed.size(),
+                1) ||
+            decoded != content)
+            return false;
+
+        stream.InputOffset = static_cast<uint32_t>(test.Input.size());
+        test.Input.insert(test.Input.end(), stream.Compressed.begin(), stream.Compressed.end());
+        test.Input.resize(DWORD_ALIGN(test.Input.size()));
+        test.Streams.push_back(std::move(stream));
+    }
+    return true;
+}
+
+// Each stream goes into a subresource of 1000 byte rows at a pitch of 1024, so that rows
+// straddle tiles and the last row of a stream may be partial. Every byte of the content has
+// to land at its place in the subresource.
+static bool TestTextureOutput(GpuDecompressor& decompressor, TestInput const& test)
+{
+    constexpr uint32_t kRowSize = 1000;
+    constexpr uint32_t kRowPitch = 4 * D3D12_TEXTURE_DATA_PITCH_ALIGNMENT;
+    constexpr uint32_t kNumRows = 16;
+
+    std::vector<GpuDecompressor::TextureStream> entries;
+    uint64_t outputSize = 0;
+    for (auto& stream : test.Streams)
+    {
+        D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint{};
+        footprint.Offset = outputSize;
+        footprint.Footprint.RowPitch = kRowPitch;
+        entries.push_back(GpuDecompressor::MakeTextureStream(stream.InputOffset, footprint, kNumRows, kRowSize));
+
+        uint64_t numRows = (stream.Content.size() + kRowSize - 1) / kRowSize;
+        outputSize += (numRows + kNumRows - 1) / kNumRows * entries.back().SlicePitch;
+    }
+
+    auto output = decompressor.DecompressFromHost(
+        test.Input,
+        outputSize,
+        [&](ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)
+        { decompressor.DecompressTextures(inputBuffer, 0, outputBuffer, 0, entries); });
+
+    for (size_t s = 0; s < test.Streams.size(); ++s)
+    {
+        auto& entry = entries[s];
+        auto& content = test.Streams[s].Content;
+        for (size_t i = 0; i < content.size(); ++i)
+        {
+            size_t row = i / entry.RowSize;
+            size_t address = entry.OutputOffset + row / entry.NumRows * entry.SlicePitch +
+                             row % entry.NumRows * entry.RowPitch + i % entry.RowSize;
+            if (output[address] != content[i])
+                return false;
+        }
+    }
+    return true;
+}
+
+// The kernel has to give back every stream, including the ones whose matches reach past the
+// groupshared window into the bytes that it has already flushed to the output buffer
+static bool TestStagedOutput(GpuDecompressor& decompressor, TestInput const& test)
+{
+    std::vector<GpuDecompressor::ResidentStream> entries;
+    uint64_t outputSize = 0;
+    for (auto& stream : test.Streams)
+    {
+        entries.push_back({stream.InputOffset, static_cast<uint32_t>(outputSize)});
+        outputSize += DWORD_ALIGN(stream.Content.size());
+    }
+
+    auto output = decompressor.DecompressFromHost(
+        test.Input,
+        outputSize,
+        [&](ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)
+        { decompressor.DecompressStaged(inputBuffer, 0, outputBuffer, 0, entries); });
+
+    for (size_t s = 0; s < test.Streams.size(); ++s)
+    {
+        auto& content = test.Streams[s].Content;
+        if (memcmp(output.data() + entries[s].OutputOffset, content.data(), content.size()) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Every stream gets entries for its first tile, for the tiles after it, for its last tile, which
+// may be short, and for a range that runs past its end and has to stop at the last tile. Each
+// entry has an output of its own, which has to match CPU DecompressRange byte for byte.
+static bool TestTileRange(GpuDecompressor& decompressor, TestInput const& test)
+{
+    constexpr uint32_t kTileSize = GDeflate::kDefaultTileSize;
+
+    struct Range
+    {
+        size_t Stream;
+        size_t Offset;
+        size_t Size;
+    };
+
+    std::vector<GpuDecompressor::TileRangeStream> entries;
+    std::vector<Range> ranges;
+    uint64_t outputSize = 0;
+    for (size_t s = 0; s < test.Streams.size(); ++s)
+    {
+        auto& stream = test.Streams[s];
+        uint32_t numTiles = static_cast<uint32_t>((stream.Content.size() + kTileSize - 1) / kTileSize);
+
+        auto add = [&](uint32_t firstTile, uint32_t count)
+        {
+            size_t offset = size_t(firstTile) * kTileSize;
+            size_t size = std::min(stream.Content.size(), size_t(firstTile + count) * kTileSize) - offset;
+            entries.push_back(GpuDecompressor::MakeTileRangeStream(
+                stream.InputOffset,
+                static_cast<uint32_t>(outputSize),
+                firstTile,
+                count));
+            ranges.push_back({s, offset, size});
+            outputSize += DWORD_ALIGN(size);
+        };
+
+        add(0, 1);
+        if (numTiles > 1)
+        {
+            add(1, numTiles - 1);
+            add(numTiles - 1, 1);
+        }
+        add(numTiles - 1, 3);
+    }
+
+    auto output = decompressor.DecompressFromHost(
+        test.Input,
+        outputSize,
+        [&](ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)
+        { decompressor.DecompressTileRanges(inputBuffer, 0, outputBuffer, 0, entries); });
+
+    for (size_t r = 0; r < ranges.size(); ++r)
+    {
+        auto& range = ranges[r];
+        auto& stream = test.Streams[range.Stream];
+
+        std::vector<uint8_t> expected(range.Size);
+        if (!GDeflate::DecompressRange(
+                expected.data(),
+                stream.Compressed.data(),
+                stream.Compressed.size(),
+                range.Offset,
+                range.Size,
+                1) ||
+            memcmp(expected.data(), stream.Content.data() + range.Offset, range.Size) != 0)
+            return false;
+
+        if (memcmp(output.data() + entries[r].OutputOffset, expected.data(), range.Size) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Every stream is filtered on the CPU with each transform and each delta stride, and compressed
+// again. The sizes that don't divide a tile leave bytes past the last whole element, which the
+// filters leave in place. The kernel has to give back the unfiltered content.
+static bool TestPostTransform(GpuDecompressor& decompressor, TestInput const& test)
+{
+    struct Transform
+    {
+        GpuDecompressor::TransformKind Kind;
+        uint32_t Size;
+        uint32_t Split;
+    };
+
+    static Transform const kTransforms[] = {
+        {GpuDecompressor::TransformNone, 0, 0},
+        {GpuDecompressor::TransformBytePlanes, 4, 0},
+        {GpuDecompressor::TransformBytePlanes, 3, 0},
+        {GpuDecompressor::TransformBlockSplit, 8, 4},
+        {GpuDecompressor::TransformBlockSplit, 7, 3},
+    };
+    static uint32_t const kDeltaStrides[] = {0, 1, 2, 4};
+
+    BufferVector filtered;
+    std::vector<GpuDecompressor::TransformStream> entries;
+    std::vector<size_t> sources;
+    for (auto& transform : kTransforms)
+    {
+        for (uint32_t stride : kDeltaStrides)
+        {
+            if (transform.Kind == GpuDecompressor::TransformNone && stride == 0)
+                continue;
+
+            for (size_t s = 0; s < test.Streams.size(); ++s)
+            {
+                auto entry = GpuDecompressor::MakeTransformStream(
+                    0,
+                    0,
+                    transform.Kind,
+                    transform.Size,
+                    transform.Split,
+                    stride);
+
+                std::vector<uint8_t> content = test.Streams[s].Content;
+                GpuDecompressor::ApplyTransform(content.data(), content.size(), entry.Transform);
+                filtered.push_back(std::move(content));
+                entries.push_back(entry);
+                sources.push_back(s);
+            }
+        }
+    }
+
+    TestInput transformed;
+    if (!BuildTestInput(filtered, transformed))
+        return false;
+
+    uint64_t outputSize = 0;
+    for (size_t e = 0; e < entries.size(); ++e)
+    {
+        entries[e].InputOffset = transformed.Streams[e].InputOffset;
+        entries[e].OutputOffset = static_cast<uint32_t>(outputSize);
+        outputSize += DWORD_ALIGN(transformed.Streams[e].Content.size());
+    }
+
+    auto output = decompressor.DecompressFromHost(
+        transformed.Input,
+        outputSize,
+        [&](ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)
+        { decompressor.DecompressTransformed(inputBuffer, 0, outputBuffer, 0, entries); });
+
+    for (size_t e = 0; e < entries.size(); ++e)
+    {
+        auto& content = test.Streams[sources[e]].Content;
+        if (memcmp(output.data() + entries[e].OutputOffset, content.data(), content.size()) != 0)
+            return false;
+    }
+    return true;
+}
+
+// RFC 8439, section 2.4.2. Keystream blocks are numbered by their offset in the stream, so the
+// plaintext goes at offset 64 to be encrypted from block 1, the test vector's initial counter.
+static bool TestChaCha20Vector()
+{
+    static char const kPlaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                                     "for the future, sunscreen would be it.";
+    static uint8_t const kCiphertext[] = {
+        0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+        0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+        0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+        0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+        0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+        0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+        0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+        0x87, 0x4d};
+    static_assert(sizeof(kPlaintext) == sizeof(kCiphertext) + 1, "The plaintext is the ciphertext's size");
+
+    // A zeroed header has no tiles, so everything after its 8 bytes is encrypted
+    std::vector<uint8_t> stream(64 + sizeof(kCiphertext));
+    memcpy(stream.data() + 64, kPlaintext, sizeof(kCiphertext));
+
+    uint8_t key[GpuDecompressor::kCryptoKeySize];
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = static_cast<uint8_t>(i);
+    uint32_t const nonce[3] = {0, 0x4a000000, 0};
+
+    GpuDecompressor::EncryptTileStream(stream.data(), stream.size(), key, nonce);
+    return memcmp(stream.data() + 64, kCiphertext, sizeof(kCiphertext)) == 0;
+}
+
+// Every stream is encrypted with a nonce of its own, and the key follows the streams in the
+// input. Decrypting a copy on the CPU has to give back the stream that the CPU decoder reads,
+// and the kernel's output has to match the CPU decoder's byte for byte.
+static bool TestDecrypt(GpuDecompressor& decompressor, TestInput const& test)
+{
+    if (!TestChaCha20Vector())
+        return false;
+
+    std::mt19937 rng(5);
+    uint8_t key[GpuDecompressor::kCryptoKeySize];
+    for (auto& byte : key)
+        byte = static_cast<uint8_t>(rng());
+
+    std::vector<uint8_t> input = test.Input;
+    std::vector<GpuDecompressor::EncryptedStream> entries;
+    uint64_t outputSize = 0;
+    for (size_t s = 0; s < test.Streams.size(); ++s)
+    {
+        auto& stream = test.Streams[s];
+        GpuDecompressor::EncryptedStream entry{};
+        entry.InputOffset = stream.InputOffset;
+        entry.OutputOffset = static_cast<uint32_t>(outputSize);
+        entry.Nonce[0] = static_cast<uint32_t>(s);
+        entry.Nonce[1] = rng();
+        entry.Nonce[2] = rng();
+        entries.push_back(entry);
+        outputSize += DWORD_ALIGN(stream.Content.size());
+
+        uint8_t* encrypted = input.data() + stream.InputOffset;
+        GpuDecompressor::EncryptTileStream(encrypted, stream.Compressed.size(), key, entry.Nonce);
+
+        std::vector<uint8_t> decrypted(encrypted, encrypted + stream.Compressed.size());
+        if (decrypted == stream.Compressed)
+            return false;
+
+        GpuDecompressor::EncryptTileStream(decrypted.data(), decrypted.size(), key, entry.Nonce);
+        if (decrypted != stream.Compressed)
+            return false;
+    }
+
+    uint64_t keyOffset = input.size();
+    input.insert(input.end(), std::begin(key), std::end(key));
+
+    auto output = decompressor.DecompressFromHost(
+        input,
+        outputSize,
+        [&](ID3D12Resource* inputBuffer, ID3D12Resource* outputBuffer)
+        { decompressor.DecompressEncrypted(inputBuffer, 0, outputBuffer, 0, inputBuffer, keyOffset, entries); });
+
+    for (size_t s = 0; s < test.Streams.size(); ++s)
+    {
+        auto& content = test.Streams[s].Content;
+        if (memcmp(output.data() + entries[s].OutputOffset, content.data(), content.size()) != 0)
+            return false;
+    }
+    return true;
+}
+
+bool RunGpuDecompressorTests(GpuDecompressor& decompressor, BufferVector const& contents)
+{
+    // Streams of less than a tile, of whole tiles and with a short last tile, one that is stored
+    // and one with matches from further back than the STAGED_OUTPUT window
+    BufferVector testContents = {
+        GenerateContent(1, 1000),
+        GenerateContent(2, 4 * GDeflate::kDefaultTileSize),
+        GenerateContent(3, 5 * GDeflate::kDefaultTileSize / 2 + 3),
+        GenerateNoise(4, 3 * GDeflate::kDefaultTileSize / 2),
+        GenerateFarMatches(5, 3 * GDeflate::kDefaultTileSize + 1234),
+    };
+    testContents.insert(testContents.end(), contents.begin(), contents.end());
+
+    TestInput test;
+    if (!BuildTestInput(testContents, test))
+    {
+        Report("CPU round trip", false);
+        return false;
+    }
+
+    bool passed = true;
+
+    auto run = [&](char const* name, bool (*testFunction)(GpuDecompressor&, TestInput const&))
+    {
+        bool result = testFunction(decompressor, test);
+        Report(name, result);
+        passed &= result;
+    };
+
+    run("Texture output", TestTextureOutput);
+    run("Post transform", TestPostTransform);
+    run("Tile range", TestTileRange);
+    run("Staged output", TestStagedOutput);
+    run("Decrypt", TestDecrypt);
+
+    return passed;
+}
+
+#endif
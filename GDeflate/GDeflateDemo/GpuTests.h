@@ -0,0 +1,17 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "GpuDecompressor.h"
+
+#ifdef WIN32
+
+// Checks of the optional builds of GDeflate.hlsl against the CPU decoder, on contents and on
+// content that the tests generate. Each prints its own result line, and the return value is
+// true when all of them pass.
+bool RunGpuDecompressorTests(GpuDecompressor& decompressor, BufferVector const& contents);
+
+#endif
@@ -4,7 +4,9 @@
  */
 
 #include "CompressedFile.h"
+#include "GpuCompressor.h"
 #include "GpuDecompressor.h"
+#include "GpuTests.h"
 
 #include <GDeflate.h>
 
@@ -23,8 +25,32 @@ void ShowHelp()
     std::cout << "/compress      Compress a single file or multiple files using the CPU.\n";
     std::cout << "/decompress    Decompress a single file or multiple files using the CPU.\n";
 #ifdef WIN32
+    std::cout << "/compressgpu   Compress a single file or multiple files using the GPU, with\n";
+    std::cout << "               greedy matching and fixed Huffman codes.\n";
     std::cout << "/decompressgpu Decompress a single file or multiple files using the GPU.\n";
+    std::cout << "/decompressgpupack\n";
+    std::cout << "               Decompress every file in packs created with /compresspack\n";
+    std::cout << "               using the GPU, with one read and one dispatch per pack.\n";
+    std::cout << "/decompressgpuqueue\n";
+    std::cout << "               Decompress using the GPU with a single persistent dispatch that\n";
+    std::cout << "               takes the files from a queue as they are uploaded.\n";
+    std::cout << "/decompressgpuprofile\n";
+    std::cout << "               Decompress using the GPU with a profiling build of the shader\n";
+    std::cout << "               and report its timing and load balance for every batch.\n";
+    std::cout << "/benchgpu      Time GPU decompression of the files with the data kept resident on\n";
+    std::cout << "               the GPU. No destination directory is needed.\n";
+    std::cout << "/tunegpu       Find the fastest dispatch size for the files and cache it for\n";
+    std::cout << "               this GPU and driver. No destination directory is needed.\n";
+    std::cout << "/testgpu       Check the optional builds of the GPU decompressor against the CPU\n";
+    std::cout << "               on the files and on generated content. No destination directory\n";
+    std::cout << "               is needed.\n";
 #endif
+    std::cout << "/compresspack  Compress a single file or multiple files using the CPU into one\n";
+    std::cout << "               pack file with an index, named after the source.\n";
+    std::cout << "/compressmap   Compress a single file or multiple files using the CPU,\n";
+    std::cout << "               reading and writing through memory-mapped files.\n";
+    std::cout << "/decompressmap Decompress files created with /compressmap using the CPU,\n";
+    std::cout << "               reading and writing through memory-mapped files.\n";
     std::cout << "\n";
     std::cout << "/demo          Compress a single file or multiple files using the CPU and\n";
     std::cout << "               decompress the result "
@@ -45,14 +71,32 @@ void ShowHelp()
     std::cout << "GDeflateDemo.exe /decompressgpu c:\\file.compressed c:\\output_directory\n";
     std::cout << "GDeflateDemo.exe /decompressgpu c:\\input_directory c:\\output_directory\n";
     std::cout << "\n";
+    std::cout << "GDeflateDemo.exe /compresspack c:\\input_directory c:\\output_directory\n";
+    std::cout << "GDeflateDemo.exe /decompressgpupack c:\\output_directory\\input_directory.gdpack c:\\unpacked\n";
+    std::cout << "\n";
+    std::cout << "GDeflateDemo.exe /benchgpu c:\\input_directory\n";
+    std::cout << "\n";
+    std::cout << "GDeflateDemo.exe /compressmap c:\\file.any c:\\output_directory\n";
+    std::cout << "GDeflateDemo.exe /decompressmap c:\\file.gdeflate c:\\output_directory\n";
+    std::cout << "\n";
 }
 
 enum class OperationType
 {
     None,
     Compress,
+    CompressGPU,
     DecompressCPU,
     DecompressGPU,
+    DecompressGPUPack,
+    DecompressGPUQueue,
+    DecompressGPUProfile,
+    BenchmarkGPU,
+    TuneGPU,
+    TestGPU,
+    CompressPack,
+    CompressMapped,
+    DecompressMapped,
     Demo
 };
 
@@ -70,9 +114,9 @@ static Options ParseOptions(int argc, char** argv)
     // Expects:
     // argv[1] - option
     // argv[2] - source path
-    // argv[3] - destination path
+    // argv[3] - destination path, not used by /benchgpu, /tunegpu and /testgpu
     Options options;
-    if (argc < 4)
+    if (argc < 3)
     {
         options.ShowHelp = true;
         std::cout << "\nToo few parameters were passed.\n\n";
@@ -83,6 +127,10 @@ static Options ParseOptions(int argc, char** argv)
     {
         options.Operation = OperationType::Compress;
     }
+    else if ((strcasecmp(argv[1], "/compressgpu") == 0) || (strcasecmp(argv[1], "-compressgpu") == 0))
+    {
+        options.Operation = OperationType::CompressGPU;
+    }
     else if ((strcasecmp(argv[1], "/decompress") == 0) || (strcasecmp(argv[1], "-decompress") == 0))
     {
         options.Operation = OperationType::DecompressCPU;
@@ -91,6 +139,43 @@ static Options ParseOptions(int argc, char** argv)
     {
         options.Operation = OperationType::DecompressGPU;
     }
+    else if ((strcasecmp(argv[1], "/decompressgpupack") == 0) || (strcasecmp(argv[1], "-decompressgpupack") == 0))
+    {
+        options.Operation = OperationType::DecompressGPUPack;
+    }
+    else if ((strcasecmp(argv[1], "/decompressgpuqueue") == 0) || (strcasecmp(argv[1], "-decompressgpuqueue") == 0))
+    {
+        options.Operation = OperationType::DecompressGPUQueue;
+    }
+    else if (
+        (strcasecmp(argv[1], "/decompressgpuprofile") == 0) || (strcasecmp(argv[1], "-decompressgpuprofile") == 0))
+    {
+        options.Operation = OperationType::DecompressGPUProfile;
+    }
+    else if ((strcasecmp(argv[1], "/benchgpu") == 0) || (strcasecmp(argv[1], "-benchgpu") == 0))
+    {
+        options.Operation = OperationType::BenchmarkGPU;
+    }
+    else if ((strcasecmp(argv[1], "/tunegpu") == 0) || (strcasecmp(argv[1], "-tunegpu") == 0))
+    {
+        options.Operation = OperationType::TuneGPU;
+    }
+    else if ((strcasecmp(argv[1], "/testgpu") == 0) || (strcasecmp(argv[1], "-testgpu") == 0))
+    {
+        options.Operation = OperationType::TestGPU;
+    }
+    else if ((strcasecmp(argv[1], "/compresspack") == 0) || (strcasecmp(argv[1], "-compresspack") == 0))
+    {
+        options.Operation = OperationType::CompressPack;
+    }
+    else if ((strcasecmp(argv[1], "/compressmap") == 0) || (strcasecmp(argv[1], "-compressmap") == 0))
+    {
+        options.Operation = OperationType::CompressMapped;
+    }
+    else if ((strcasecmp(argv[1], "/decompressmap") == 0) || (strcasecmp(argv[1], "-decompressmap") == 0))
+    {
+        options.Operation = OperationType::DecompressMapped;
+    }
     else if ((strcasecmp(argv[1], "/demo") == 0) || (strcasecmp(argv[1], "-demo") == 0))
     {
         options.Operation = OperationType::Demo;
@@ -102,6 +187,15 @@ static Options ParseOptions(int argc, char** argv)
         return options;
     }
 
+    bool needsDestination = options.Operation != OperationType::BenchmarkGPU &&
+                            options.Operation != OperationType::TuneGPU && options.Operation != OperationType::TestGPU;
+    if (needsDestination && argc < 4)
+    {
+        options.ShowHelp = true;
+        std::cout << "\nToo few parameters were passed.\n\n";
+        return options;
+    }
+
     // Detect if the specified source file or path exists.
     options.SourcePath = std::filesystem::weakly_canonical(argv[2]);
     if (!std::filesystem::exists(options.SourcePath))
@@ -112,8 +206,9 @@ static Options ParseOptions(int argc, char** argv)
     }
 
     // Detect if the specified destination path is valid.
-    options.DestinationPath = std::filesystem::weakly_canonical(argv[3]);
-    if (!std::filesystem::exists(options.DestinationPath))
+    if (needsDestination)
+        options.DestinationPath = std::filesystem::weakly_canonical(argv[3]);
+    if (needsDestination && !std::filesystem::exists(options.DestinationPath))
     {
         // Attempt to create the full destination folder structure if needed.
         if (!std::filesystem::create_directories(options.DestinationPath))
@@ -125,21 +220,27 @@ static Options ParseOptions(int argc, char** argv)
         }
     }
 
-    if (options.Operation == OperationType::DecompressGPU || options.Operation == OperationType::Demo)
+    if (options.Operation == OperationType::DecompressGPU || options.Operation == OperationType::DecompressGPUPack ||
+        options.Operation == OperationType::DecompressGPUQueue ||
+        options.Operation == OperationType::DecompressGPUProfile || options.Operation == OperationType::BenchmarkGPU ||
+        options.Operation == OperationType::TuneGPU || options.Operation == OperationType::TestGPU ||
+        options.Operation == OperationType::Demo)
     {
 #ifdef WIN32
-        // Detect if the shaders required for decompression are present.
+        // Detect if the shaders required for decompression are present. The precompiled
+        // permutations are enough on their own, the HLSL source is only needed to build others.
         auto currentPath = GetModulePath();
+        bool hasPrecompiledShaders = std::filesystem::exists(currentPath / "GDeflate_groupshared.dxil");
 
         options.ShaderPath = currentPath / "GDeflate.hlsl";
-        if (!std::filesystem::exists(options.ShaderPath))
+        if (!hasPrecompiledShaders && !std::filesystem::exists(options.ShaderPath))
         {
             std::cout << "\nThe required shader file GDeflate.hlsl is not found!\n\n";
             options.ShowHelp = true;
             return options;
         }
 
-        if (!std::filesystem::exists(currentPath / "tilestream.hlsl"))
+        if (!hasPrecompiledShaders && !std::filesystem::exists(currentPath / "tilestream.hlsl"))
         {
             std::cout << "\nThe required shader file tilestream.hlsl is not found!\n\n";
             options.ShowHelp = true;
@@ -148,6 +249,22 @@ static Options ParseOptions(int argc, char** argv)
 #endif
     }
 
+    if (options.Operation == OperationType::CompressGPU)
+    {
+#ifdef WIN32
+        // Either of the precompiled builds of the compressor means both are there
+        auto currentPath = GetModulePath();
+        options.ShaderPath = currentPath / "GDeflateCompress.hlsl";
+        if (!std::filesystem::exists(currentPath / "GDeflateCompress.dxil") &&
+            !std::filesystem::exists(options.ShaderPath))
+        {
+            std::cout << "\nThe required shader file GDeflateCompress.hlsl is not found!\n\n";
+            options.ShowHelp = true;
+            return options;
+        }
+#endif
+    }
+
     return options;
 }
 
@@ -168,56 +285,170 @@ static std::vector<uint8_t> ReadEntireFileContent(std::filesystem::path const& p
     return contents;
 }
 
+// DirectStorage exposes 3 compression setting values to use with the runtime's
+// built-in GDeflate compressor. Below is the mapping of GDeflate's compression
+// settings to DirectStorage's built-in compression settings.
+constexpr uint32_t FastestGDeflateCompressionLevel = 1;    // Maps to DSTORAGE_COMPRESSION_FASTEST
+constexpr uint32_t DefaultGDeflateCompressionLevel = 9;    // Maps to DSTORAGE_COMPRESSION_DEFAULT
+constexpr uint32_t BestRatioGDeflateCompressionLevel = 12; // Maps to DSTORAGE_COMPRESSION_BEST_RATIO
+
+// CompressContent reads the files in batches of about this many bytes, and compresses each batch
+// at once so that small files don't leave workers idle.
+constexpr size_t kCompressBatchInputSize = 256 * 1024 * 1024;
+
 int CompressContent(std::vector<std::filesystem::path> const& sourcePaths, std::filesystem::path const& destinationPath)
 {
     std::cout << "\nCompressing " << sourcePaths.size() << " file(s)\n";
 
-    for (auto& sourcePath : sourcePaths)
+    std::mutex outputMutex;
+    bool failed = false;
+
+    for (size_t firstFile = 0; firstFile < sourcePaths.size();)
     {
-        auto compressedFilename = sourcePath.filename();
-        compressedFilename += ".compressed";
-        std::filesystem::path compressedFilePath = destinationPath / compressedFilename;
+        std::vector<std::vector<uint8_t>> fileContents;
+        size_t batchSize = 0;
 
-        auto fileContents = ReadEntireFileContent(sourcePath);
-        size_t compressBounds = GDeflate::CompressBound(fileContents.size());
-        std::vector<uint8_t> compressedContents(compressBounds);
+        while (firstFile + fileContents.size() < sourcePaths.size() &&
+               (fileContents.empty() || batchSize < kCompressBatchInputSize))
+        {
+            fileContents.push_back(ReadEntireFileContent(sourcePaths[firstFile + fileContents.size()]));
+            batchSize += fileContents.back().size();
+        }
+
+        std::vector<GDeflate::CompressDesc> streams(fileContents.size());
+
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            streams[i].input = fileContents[i].data();
+            streams[i].inputSize = fileContents[i].size();
+        }
 
-        size_t outputSize = compressedContents.size();
-        uint32_t flags = GDeflate::Flags::COMPRESS_SINGLE_THREAD;
+        // Each file is written as soon as its last tile is done, while the rest of the batch is
+        // still being compressed.
+        auto WriteCompressedFile = [&](size_t i)
+        {
+            auto const& sourcePath = sourcePaths[firstFile + i];
+            auto const& contents = fileContents[i];
+            GDeflate::CompressDesc& stream = streams[i];
 
-        // DirectStorage exposes 3 compression setting values to use with the runtime's
-        // built-in GDeflate compressor. Below is the mapping of GDeflate's compression
-        // settings to DirectStorage's built-in compression settings.
+            auto compressedFilename = sourcePath.filename();
+            compressedFilename += ".compressed";
+            std::filesystem::path compressedFilePath = destinationPath / compressedFilename;
 
-        constexpr uint32_t FastestGDeflateCompressionLevel = 1;    // Maps to DSTORAGE_COMPRESSION_FASTEST
-        constexpr uint32_t DefaultGDeflateCompressionLevel = 9;    // Maps to DSTORAGE_COMPRESSION_DEFAULT
-        constexpr uint32_t BestRatioGDeflateCompressionLevel = 12; // Maps to DSTORAGE_COMPRESSION_BEST_RATIO
+            if (stream.succeeded)
+            {
+                std::ofstream compressedFile(compressedFilePath, std::ios::binary);
+                // Write file header that contains the uncompressed size of the original data.
+                CompressedFileHeader header{};
+                InitializeHeader(&header, contents.size(), ComputeContentHash(contents.data(), contents.size()));
+                compressedFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                compressedFile.write(reinterpret_cast<const char*>(stream.output.data()), stream.output.size());
+            }
 
-        std::cout << "Compressing " << sourcePath.string() << " to " << compressedFilePath.string() << "...\n";
+            std::lock_guard<std::mutex> lock(outputMutex);
+
+            std::cout << "Compressing " << sourcePath.string() << " to " << compressedFilePath.string() << "...\n";
+            if (!stream.succeeded)
+            {
+                std::cout << "Compression failed!\n";
+                return;
+            }
+            std::cout << "Uncompressed Size: " << contents.size() << " bytes,"
+                      << "Compressed Size: " << stream.output.size() << " bytes\n";
+
+            // The stream is on disk, so its memory can go before the batch is done.
+            std::vector<uint8_t>().swap(stream.output);
+        };
+
+        if (!GDeflate::CompressBatch(
+                streams.data(),
+                streams.size(),
+                BestRatioGDeflateCompressionLevel,
+                0,
+                WriteCompressedFile))
+        {
+            failed = true;
+        }
+
+        firstFile += fileContents.size();
+    }
+
+    return failed ? -1 : 0;
+}
+
+// Compresses every file into one pack, see PackFileHeader, named after the source file or directory
+int CompressContentPacked(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& sourcePath,
+    std::filesystem::path const& destinationPath)
+{
+    auto packFilename = sourcePath.filename();
+    if (packFilename.empty())
+        packFilename = "content";
+    packFilename += ".gdpack";
+    std::filesystem::path packFilePath = destinationPath / packFilename;
+
+    std::cout << "\nCompressing " << sourcePaths.size() << " file(s) into " << packFilePath.string() << "\n";
+
+    std::vector<PackEntry> entries;
+    BufferVector streams;
+    std::string names;
+    for (auto& path : sourcePaths)
+    {
+        auto fileContents = ReadEntireFileContent(path);
+        std::vector<uint8_t> compressedContents;
         if (!GDeflate::Compress(
-                compressedContents.data(),
-                &outputSize,
+                compressedContents,
                 fileContents.data(),
                 fileContents.size(),
                 BestRatioGDeflateCompressionLevel,
-                flags))
+                GDeflate::Flags::COMPRESS_SINGLE_THREAD))
         {
-            std::cout << "Compression failed!\n";
+            std::cout << "Compression of " << path.string() << " failed!\n";
             return -1;
         }
-        std::cout << "Uncompressed Size: " << fileContents.size() << " bytes,"
-                  << "Compressed Size: " << outputSize << " bytes\n";
-        compressedContents.resize(outputSize); // ensure compressed out is exactly what was compressed.
 
-        std::ofstream compressedFile(compressedFilePath, std::ios::binary);
-        // Write file header that contains the uncompressed size of the original data.
-        CompressedFileHeader header{};
-        InitializeHeader(&header, fileContents.size());
-        compressedFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
-        compressedFile.write(reinterpret_cast<const char*>(compressedContents.data()), compressedContents.size());
+        std::string name = path.filename().string();
+        PackEntry entry{};
+        entry.CompressedSize = compressedContents.size();
+        entry.UncompressedSize = fileContents.size();
+        entry.ContentHash = ComputeContentHash(fileContents.data(), fileContents.size());
+        entry.NameOffset = static_cast<uint32_t>(names.size());
+        entry.NameLength = static_cast<uint32_t>(name.size());
+        entries.push_back(entry);
+        names += name;
+        streams.push_back(std::move(compressedContents));
+
+        std::cout << path.string() << ": " << fileContents.size() << " to " << entry.CompressedSize << " bytes\n";
     }
 
-    return 0;
+    // The streams follow the index, each on a kPackAlignment boundary
+    uint64_t offset = AlignPackOffset(sizeof(PackFileHeader) + entries.size() * sizeof(PackEntry) + names.size());
+    for (auto& entry : entries)
+    {
+        entry.DataOffset = offset;
+        offset = AlignPackOffset(offset + entry.CompressedSize);
+    }
+
+    PackFileHeader header{};
+    InitializePackHeader(&header, static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(names.size()));
+
+    std::ofstream packFile(packFilePath, std::ios::binary);
+    packFile.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    packFile.write(reinterpret_cast<char const*>(entries.data()), entries.size() * sizeof(PackEntry));
+    packFile.write(names.data(), names.size());
+
+    std::vector<char> padding(kPackAlignment);
+    uint64_t position = sizeof(PackFileHeader) + entries.size() * sizeof(PackEntry) + names.size();
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        packFile.write(padding.data(), entries[i].DataOffset - position);
+        packFile.write(reinterpret_cast<char const*>(streams[i].data()), streams[i].size());
+        position = entries[i].DataOffset + streams[i].size();
+    }
+
+    std::cout << "Wrote " << offset << " bytes\n";
+    return packFile ? 0 : -1;
 }
 
 int DecompressContent(
@@ -263,6 +494,59 @@ int DecompressContent(
     return 0;
 }
 
+// Compresses each file into a sequence of GDeflate streams (without a CompressedFileHeader), with
+// GDeflate mapping both files so that neither has to fit in memory.
+int CompressContentMapped(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& destinationPath)
+{
+    std::cout << "\nCompressing " << sourcePaths.size() << " file(s) using memory-mapped files\n";
+
+    constexpr uint32_t BestRatioGDeflateCompressionLevel = 12; // Maps to DSTORAGE_COMPRESSION_BEST_RATIO
+
+    for (auto& sourcePath : sourcePaths)
+    {
+        auto compressedFilename = sourcePath.filename();
+        compressedFilename += ".gdeflate";
+        std::filesystem::path compressedFilePath = destinationPath / compressedFilename;
+
+        std::cout << "Compressing " << sourcePath.string() << " to " << compressedFilePath.string() << "...\n";
+        if (!GDeflate::CompressFile(sourcePath, compressedFilePath, BestRatioGDeflateCompressionLevel, 0))
+        {
+            std::cout << "Compression failed!\n";
+            return -1;
+        }
+        std::cout << "Uncompressed Size: " << std::filesystem::file_size(sourcePath) << " bytes,"
+                  << "Compressed Size: " << std::filesystem::file_size(compressedFilePath) << " bytes\n";
+    }
+
+    return 0;
+}
+
+int DecompressContentMapped(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& destinationPath)
+{
+    std::cout << "\nDecompressing " << sourcePaths.size() << " file(s) (using the CPU and memory-mapped files)\n";
+
+    for (auto& sourcePath : sourcePaths)
+    {
+        std::filesystem::path uncompressedFilePath = destinationPath / sourcePath.filename();
+        uncompressedFilePath.replace_extension("");
+
+        std::cout << "Decompressing " << sourcePath.string() << " to " << uncompressedFilePath.string() << "...\n";
+        if (!GDeflate::DecompressFile(sourcePath, uncompressedFilePath, std::thread::hardware_concurrency()))
+        {
+            std::cout << "Decompression failed!\n";
+            return -1;
+        }
+        std::cout << "Compressed Size: " << std::filesystem::file_size(sourcePath) << " bytes, ";
+        std::cout << "Uncompressed Size: " << std::filesystem::file_size(uncompressedFilePath) << " bytes\n";
+    }
+
+    return 0;
+}
+
 #ifdef WIN32
 
 DeviceInfo GetDeviceInfo(ID3D12Device5* device)
@@ -282,6 +566,13 @@ DeviceInfo GetDeviceInfo(ID3D12Device5* device)
     check_hresult(adapter->GetDesc1(&adapterDesc));
 
     info.Description = adapterDesc.Description;
+    info.VendorId = adapterDesc.VendorId;
+    info.DeviceId = adapterDesc.DeviceId;
+
+    // The UMD version keys the shader cache, so that a driver update rebuilds it
+    LARGE_INTEGER driverVersion{};
+    if (SUCCEEDED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion)))
+        info.DriverVersion = static_cast<uint64_t>(driverVersion.QuadPart);
 
     // The Microsoft Basic Render Driver has the same limitations as a Warp device.
     // DXGI_ADAPTER_FLAG_SOFTWARE is not set for this device, so we must use the
@@ -315,18 +606,11 @@ DeviceInfo GetDeviceInfo(ID3D12Device5* device)
     return info;
 }
 
-int DecompressContentUsingGPU(
-    std::vector<std::filesystem::path> const& sourcePaths,
-    std::filesystem::path const& destinationPath,
-    std::filesystem::path const& shaderPath)
+// Returns nullptr when the device can't run the decompressor, which the compressor needs as well
+static winrt::com_ptr<ID3D12Device5> CreateGpuDevice(DeviceInfo& deviceInfo)
 {
     using namespace winrt;
 
-    std::cout << "\nDecompressing " << sourcePaths.size() << " file(s) (using the GPU)\n";
-
-    if (sourcePaths.empty())
-        return 0;
-
 #ifdef _DEBUG
     com_ptr<ID3D12Debug1> debugController;
     if (SUCCEEDED(D3D12GetDebugInterface(IID_PPV_ARGS(&debugController))))
@@ -342,7 +626,7 @@ int DecompressContentUsingGPU(
     com_ptr<ID3D12Device5> device;
     check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&device)));
 
-    DeviceInfo deviceInfo = GetDeviceInfo(device.get());
+    deviceInfo = GetDeviceInfo(device.get());
     std::wcout << L"Device: " << deviceInfo.Description << L"\n";
     std::wcout << L"Supported Shader Model:    " << deviceInfo.SupportedShaderModel << L"\n";
     std::cout << "SupportsGpuDecompression:  " << (deviceInfo.SupportsGpuDecompression ? "Yes" : "No") << "\n";
@@ -353,12 +637,77 @@ int DecompressContentUsingGPU(
     if (!deviceInfo.SupportsGpuDecompression)
     {
         std::cout << "\n\nDevice does not support GPU decompression!\n";
-        return -1;
+        return nullptr;
     }
 
-    auto GpuDecompressor = GpuDecompressor::Create(device.get(), deviceInfo, shaderPath);
+    return device;
+}
+
+static std::unique_ptr<GpuDecompressor> CreateGpuDecompressor(std::filesystem::path const& shaderPath, bool profile)
+{
+    DeviceInfo deviceInfo{};
+    auto device = CreateGpuDevice(deviceInfo);
+    if (!device)
+        return nullptr;
+
+    return GpuDecompressor::Create(device.get(), deviceInfo, shaderPath, profile);
+}
+
+static std::unique_ptr<GpuCompressor> CreateGpuCompressor(std::filesystem::path const& shaderPath)
+{
+    DeviceInfo deviceInfo{};
+    auto device = CreateGpuDevice(deviceInfo);
+    if (!device)
+        return nullptr;
+
+    return GpuCompressor::Create(device.get(), deviceInfo, shaderPath);
+}
+
+// Compresses all the files in one go, writing them in the same format as CompressContent
+int CompressContentUsingGPU(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& destinationPath,
+    std::filesystem::path const& shaderPath)
+{
+    std::cout << "\nCompressing " << sourcePaths.size() << " file(s) (using the GPU)\n";
+
+    if (sourcePaths.empty())
+        return 0;
+
+    auto gpuCompressor = CreateGpuCompressor(shaderPath);
+    if (!gpuCompressor)
+        return -1;
 
     BufferVector buffers;
+    for (auto& sourcePath : sourcePaths)
+        buffers.push_back(ReadEntireFileContent(sourcePath));
+
+    auto compressedData = gpuCompressor->Compress(buffers);
+
+    for (size_t i = 0; i < sourcePaths.size(); ++i)
+    {
+        auto compressedFilename = sourcePaths[i].filename();
+        compressedFilename += ".compressed";
+        std::filesystem::path compressedFilePath = destinationPath / compressedFilename;
+
+        auto& fileContents = buffers[i];
+        auto& compressedContents = compressedData[i];
+        std::cout << "Writing " << sourcePaths[i].string() << " to " << compressedFilePath.string() << "...\n";
+        std::cout << "Uncompressed Size: " << fileContents.size() << " bytes,"
+                  << "Compressed Size: " << compressedContents.size() << " bytes\n";
+
+        std::ofstream compressedFile(compressedFilePath, std::ios::binary);
+        CompressedFileHeader header{};
+        InitializeHeader(&header, fileContents.size(), ComputeContentHash(fileContents.data(), fileContents.size()));
+        compressedFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        compressedFile.write(reinterpret_cast<const char*>(compressedContents.data()), compressedContents.size());
+    }
+
+    return 0;
+}
+
+static bool ReadCompressedFiles(std::vector<std::filesystem::path> const& sourcePaths, BufferVector& buffers)
+{
     for (auto& sourcePath : sourcePaths)
     {
         auto fileContents = ReadEntireFileContent(sourcePath);
@@ -367,12 +716,36 @@ int DecompressContentUsingGPU(
         {
             std::cout << "Invalid compressed file format. The compressed file " << sourcePath.string() << "\n"
                       << "is expected to have been compressed using this sample.\n";
-            return -1;
+            return false;
         }
         buffers.push_back(std::move(fileContents));
     }
+    return true;
+}
+
+int DecompressContentUsingGPU(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& destinationPath,
+    std::filesystem::path const& shaderPath,
+    bool useStreamQueue = false,
+    bool profile = false)
+{
+    std::cout << "\nDecompressing " << sourcePaths.size() << " file(s) (using the GPU"
+              << (useStreamQueue ? " with a stream queue" : "") << (profile ? " with profiling" : "") << ")\n";
+
+    if (sourcePaths.empty())
+        return 0;
+
+    auto GpuDecompressor = CreateGpuDecompressor(shaderPath, profile);
+    if (!GpuDecompressor)
+        return -1;
 
-    auto uncompressedData = GpuDecompressor->Decompress(buffers);
+    BufferVector buffers;
+    if (!ReadCompressedFiles(sourcePaths, buffers))
+        return -1;
+
+    auto uncompressedData =
+        useStreamQueue ? GpuDecompressor->DecompressStreaming(buffers) : GpuDecompressor->Decompress(buffers);
 
     // Write uncompressed data to destination
     for (size_t i = 0; i < sourcePaths.size(); ++i)
@@ -390,6 +763,167 @@ int DecompressContentUsingGPU(
     return 0;
 }
 
+// Each pack is loaded with one read and all of its streams are decoded in one dispatch
+int DecompressPackUsingGPU(
+    std::vector<std::filesystem::path> const& packPaths,
+    std::filesystem::path const& destinationPath,
+    std::filesystem::path const& shaderPath)
+{
+    std::cout << "\nDecompressing " << packPaths.size() << " pack(s) (using the GPU)\n";
+
+    if (packPaths.empty())
+        return 0;
+
+    auto GpuDecompressor = CreateGpuDecompressor(shaderPath, false);
+    if (!GpuDecompressor)
+        return -1;
+
+    for (auto& packPath : packPaths)
+    {
+        auto pack = ReadEntireFileContent(packPath);
+        if (!IsValidPack(pack.data(), pack.size()))
+        {
+            std::cout << "Invalid pack file " << packPath.string() << ". The pack is expected to have\n"
+                      << "been created using /compresspack.\n";
+            return -1;
+        }
+
+        auto header = reinterpret_cast<PackFileHeader const*>(pack.data());
+        auto entries = reinterpret_cast<PackEntry const*>(pack.data() + sizeof(PackFileHeader));
+        auto names = reinterpret_cast<char const*>(entries + header->NumEntries);
+
+        // GpuDecompressor takes every stream behind its own CompressedFileHeader
+        BufferVector buffers(header->NumEntries);
+        for (uint32_t i = 0; i < header->NumEntries; ++i)
+        {
+            CompressedFileHeader streamHeader{};
+            InitializeHeader(&streamHeader, entries[i].UncompressedSize, entries[i].ContentHash);
+
+            auto& buffer = buffers[i];
+            buffer.resize(sizeof(CompressedFileHeader) + entries[i].CompressedSize);
+            memcpy(buffer.data(), &streamHeader, sizeof(streamHeader));
+            memcpy(
+                buffer.data() + sizeof(streamHeader),
+                pack.data() + entries[i].DataOffset,
+                entries[i].CompressedSize);
+        }
+
+        std::cout << "Decompressing " << header->NumEntries << " file(s) from " << packPath.string() << "\n";
+        auto uncompressedData = GpuDecompressor->Decompress(buffers, std::numeric_limits<uint64_t>::max());
+
+        for (uint32_t i = 0; i < header->NumEntries; ++i)
+        {
+            auto& uncompressedBuffer = uncompressedData[i];
+            if (ComputeContentHash(uncompressedBuffer.data(), uncompressedBuffer.size()) != entries[i].ContentHash)
+            {
+                std::cout << "Entry " << i << " of " << packPath.string() << " doesn't match its hash!\n";
+                return -1;
+            }
+
+            // Only the file name is kept, so that a pack can't write outside the destination
+            std::filesystem::path name = std::string(names + entries[i].NameOffset, entries[i].NameLength);
+            std::filesystem::path uncompressedFilePath = destinationPath / name.filename();
+            std::cout << "Writing uncompressed result to " << uncompressedFilePath.string() << "...\n";
+            std::ofstream uncompressedFile(uncompressedFilePath, std::ios::binary);
+            uncompressedFile.write(
+                reinterpret_cast<const char*>(uncompressedBuffer.data()),
+                uncompressedBuffer.size());
+        }
+    }
+
+    return 0;
+}
+
+int BenchmarkContentUsingGPU(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& shaderPath)
+{
+    static constexpr uint32_t kIterations = 10;
+
+    std::cout << "\nBenchmarking GPU decompression of " << sourcePaths.size() << " file(s), " << kIterations
+              << " dispatches each\n";
+
+    if (sourcePaths.empty())
+        return 0;
+
+    auto GpuDecompressor = CreateGpuDecompressor(shaderPath, false);
+    if (!GpuDecompressor)
+        return -1;
+
+    BufferVector buffers;
+    if (!ReadCompressedFiles(sourcePaths, buffers))
+        return -1;
+
+    // Decode the first 1, 2, 4... files and then all of them, to show how throughput scales
+    std::vector<size_t> streamCounts;
+    for (size_t count = 1; count < buffers.size(); count *= 2)
+        streamCounts.push_back(count);
+    streamCounts.push_back(buffers.size());
+
+    std::cout << "\nStreams    Uncompressed   Average     Best        Average GB/s  Best GB/s\n";
+    for (size_t count : streamCounts)
+    {
+        auto result = GpuDecompressor->Benchmark(buffers, count, kIterations);
+        if (result.MismatchedStreams != 0)
+        {
+            std::cout << result.MismatchedStreams << " of " << count
+                      << " streams don't match the hash in their header!\n";
+            return -1;
+        }
+
+        double size = static_cast<double>(result.UncompressedSize);
+        std::cout << std::left << std::setw(11) << count << std::setw(15) << result.UncompressedSize << std::setw(12)
+                  << result.AverageSeconds * 1000.0 << std::setw(12) << result.MinSeconds * 1000.0 << std::setw(14)
+                  << size / result.AverageSeconds / 1e9 << size / result.MinSeconds / 1e9 << "\n";
+    }
+    std::cout << "(times in ms, sizes in bytes)\n";
+
+    return 0;
+}
+
+int TuneContentUsingGPU(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& shaderPath)
+{
+    static constexpr uint32_t kIterations = 10;
+
+    std::cout << "\nTuning GPU decompression on " << sourcePaths.size() << " file(s)\n";
+
+    if (sourcePaths.empty())
+        return 0;
+
+    auto GpuDecompressor = CreateGpuDecompressor(shaderPath, false);
+    if (!GpuDecompressor)
+        return -1;
+
+    BufferVector buffers;
+    if (!ReadCompressedFiles(sourcePaths, buffers))
+        return -1;
+
+    uint32_t dispatchSize = GpuDecompressor->AutoTuneDispatchSize(buffers, kIterations);
+    std::cout << "Dispatch size of " << dispatchSize << " groups cached for this GPU and driver\n";
+
+    return 0;
+}
+
+// The files are compressed on the CPU, along with the content that the tests generate
+int TestContentUsingGPU(
+    std::vector<std::filesystem::path> const& sourcePaths,
+    std::filesystem::path const& shaderPath)
+{
+    std::cout << "\nTesting GPU decompression on " << sourcePaths.size() << " file(s) and generated content\n";
+
+    auto GpuDecompressor = CreateGpuDecompressor(shaderPath, false);
+    if (!GpuDecompressor)
+        return -1;
+
+    BufferVector contents;
+    for (auto& sourcePath : sourcePaths)
+        contents.push_back(ReadEntireFileContent(sourcePath));
+
+    return RunGpuDecompressorTests(*GpuDecompressor, contents) ? 0 : -1;
+}
+
 #endif
 
 template<typename A, typename B>
@@ -469,7 +1003,11 @@ int DemoCompressionAndDecompression(
     return 0;
 }
 
-static std::vector<std::filesystem::path> CollectSourcePaths(std::filesystem::path const& path, bool forDecompression)
+// Collects the files at path, keeping only those with the given extension when path is a
+// directory and extension is not empty.
+static std::vector<std::filesystem::path> CollectSourcePaths(
+    std::filesystem::path const& path,
+    std::filesystem::path const& extension)
 {
     std::vector<std::filesystem::path> sourcePaths;
     if (std::filesystem::is_directory(path))
@@ -481,11 +1019,11 @@ static std::vector<std::filesystem::path> CollectSourcePaths(std::filesystem::pa
 
             bool addFile = true;
 
-            if (forDecompression)
+            if (!extension.empty())
             {
-                // Only pickup files with the .compressed extension if the source paths are to be used
-                // for gpu decompression
-                addFile = (dirEntry.path().extension() == ".compressed");
+                // Only pickup files with the extension that the operation produces, e.g. .compressed
+                // if the source paths are to be used for decompression
+                addFile = (dirEntry.path().extension() == extension);
             }
 
             if (addFile)
@@ -511,9 +1049,18 @@ int main(int argc, char** argv)
         return 0;
     }
 
-    std::vector<std::filesystem::path> sourcePaths = CollectSourcePaths(
-        options.SourcePath,
-        (options.Operation == OperationType::DecompressCPU || options.Operation == OperationType::DecompressGPU));
+    std::filesystem::path sourceExtension;
+    if (options.Operation == OperationType::DecompressCPU || options.Operation == OperationType::DecompressGPU ||
+        options.Operation == OperationType::DecompressGPUQueue ||
+        options.Operation == OperationType::DecompressGPUProfile || options.Operation == OperationType::BenchmarkGPU ||
+        options.Operation == OperationType::TuneGPU)
+        sourceExtension = ".compressed";
+    else if (options.Operation == OperationType::DecompressMapped)
+        sourceExtension = ".gdeflate";
+    else if (options.Operation == OperationType::DecompressGPUPack)
+        sourceExtension = ".gdpack";
+
+    std::vector<std::filesystem::path> sourcePaths = CollectSourcePaths(options.SourcePath, sourceExtension);
 
     switch (options.Operation)
     {
@@ -522,9 +1069,29 @@ int main(int argc, char** argv)
     case OperationType::DecompressCPU:
         return DecompressContent(sourcePaths, options.DestinationPath);
 #ifdef WIN32
+    case OperationType::CompressGPU:
+        return CompressContentUsingGPU(sourcePaths, options.DestinationPath, options.ShaderPath);
     case OperationType::DecompressGPU:
         return DecompressContentUsingGPU(sourcePaths, options.DestinationPath, options.ShaderPath);
+    case OperationType::DecompressGPUPack:
+        return DecompressPackUsingGPU(sourcePaths, options.DestinationPath, options.ShaderPath);
+    case OperationType::DecompressGPUQueue:
+        return DecompressContentUsingGPU(sourcePaths, options.DestinationPath, options.ShaderPath, true);
+    case OperationType::DecompressGPUProfile:
+        return DecompressContentUsingGPU(sourcePaths, options.DestinationPath, options.ShaderPath, false, true);
+    case OperationType::BenchmarkGPU:
+        return BenchmarkContentUsingGPU(sourcePaths, options.ShaderPath);
+    case OperationType::TuneGPU:
+        return TuneContentUsingGPU(sourcePaths, options.ShaderPath);
+    case OperationType::TestGPU:
+        return TestContentUsingGPU(sourcePaths, options.ShaderPath);
 #endif
+    case OperationType::CompressPack:
+        return CompressContentPacked(sourcePaths, options.SourcePath, options.DestinationPath);
+    case OperationType::CompressMapped:
+        return CompressContentMapped(sourcePaths, options.DestinationPath);
+    case OperationType::DecompressMapped:
+        return DecompressContentMapped(sourcePaths, options.DestinationPath);
     case OperationType::Demo:
         return DemoCompressionAndDecompression(sourcePaths, options.DestinationPath, options.ShaderPath);
     default:
@@ -18,19 +18,29 @@
 
 #include <assert.h>
 
+#if defined(_M_X64) || defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -8,9 +8,18 @@
 #include <GDeflate.h>
 #include <winrt/base.h>
 
+#include "LibraryTests.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
 using Buffer = std::vector<uint8_t>;
@@ -171,8 +180,565 @@ static bool Validate(IDStorageCompressionCodec* codec, Buffer const& compressedB
     }
 }
 
-int main()
+// Stress mode (--stress): generates many varied inputs in parallel, compresses each one at every
+// level and checks that both the GDeflate CPU decoder and DirectStorage's decoder restore it.
+// Every case is generated from the seed and its index alone, so a failure can be reproduced with
+// --stress 1 <seed> --first <index>.
+
+static constexpr size_t kTileSize = 64 * 1024;
+static constexpr size_t kMaxTiles = (1 << 16) - 1; // TileStream::kMaxTiles
+static constexpr size_t kMaxStressCaseSize = 32 * 1024 * 1024;
+
+enum class ContentKind
+{
+    Doubles,
+    RandomBytes,
+    SingleByte,
+    Periodic,
+    Runs,
+    Text,
+    Mixed,
+    Count
+};
+
+static char const* GetContentKindName(ContentKind kind)
+{
+    switch (kind)
+    {
+    case ContentKind::Doubles:
+        return "doubles";
+    case ContentKind::RandomBytes:
+        return "random bytes";
+    case ContentKind::SingleByte:
+        return "single byte";
+    case ContentKind::Periodic:
+        return "periodic";
+    case ContentKind::Runs:
+        return "runs";
+    case ContentKind::Text:
+        return "text";
+    case ContentKind::Mixed:
+    default:
+        return "mixed";
+    }
+}
+
+static void AppendContent(std::mt19937_64& r, ContentKind kind, size_t size, Buffer& b)
+{
+    size_t end = b.size() + size;
+    switch (kind)
+    {
+    case ContentKind::Doubles:
+    {
+        // Random doubles compress a little, like the fixed cases
+        std::uniform_real_distribution<double> randomDouble(0, 100.0);
+        while (b.size() < end)
+        {
+            double value = randomDouble(r);
+            uint8_t const* v = reinterpret_cast<uint8_t const*>(&value);
+            b.insert(b.end(), v, v + std::min(end - b.size(), sizeof(value)));
+        }
+        break;
+    }
+    case ContentKind::RandomBytes:
+        while (b.size() < end)
+            b.push_back(static_cast<uint8_t>(r()));
+        break;
+    case ContentKind::SingleByte:
+        b.resize(end, static_cast<uint8_t>(r()));
+        break;
+    case ContentKind::Periodic:
+    {
+        size_t period = 1 + r() % 64;
+        Buffer pattern(period);
+        for (auto& p : pattern)
+            p = static_cast<uint8_t>(r());
+        for (size_t i = 0; b.size() < end; ++i)
+            b.push_back(pattern[i % period]);
+        break;
+    }
+    case ContentKind::Runs:
+        while (b.size() < end)
+            b.resize(std::min(end, b.size() + 1 + r() % 300), static_cast<uint8_t>(r()));
+        break;
+    case ContentKind::Text:
+    {
+        // Words from a small vocabulary, for long matches at every distance
+        static char const* words[] = {"tile ", "stream ", "GPU ", "deflate ", "the ", "of ", "buffer ", "\n"};
+        while (b.size() < end)
+        {
+            char const* word = words[r() % std::size(words)];
+            b.insert(b.end(), word, word + std::min(end - b.size(), strlen(word)));
+        }
+        break;
+    }
+    case ContentKind::Mixed:
+    default:
+        // Segments of the other kinds, so that block types change within a tile
+        while (b.size() < end)
+        {
+            auto segmentKind = static_cast<ContentKind>(r() % static_cast<uint64_t>(ContentKind::Mixed));
+            AppendContent(r, segmentKind, std::min(end - b.size(), size_t(1 + r() % 20000)), b);
+        }
+        break;
+    }
+}
+
+struct StressCase
+{
+    uint64_t Index;
+    ContentKind Kind;
+    Buffer Source;
+    std::vector<Buffer> Compressed; // One stream per compression level
+    std::string Failure;
+};
+
+static void GenerateStressCase(uint64_t seed, bool maxTiles, StressCase& c)
 {
+    std::mt19937_64 r(seed ^ (c.Index * 0x9e3779b97f4a7c15ull));
+
+    // Mostly small inputs and inputs within a few bytes of a tile boundary, with the occasional large one
+    size_t size = 0;
+    switch (r() % 8)
+    {
+    case 0:
+    case 1:
+    case 2:
+        size = 1 + r() % 256;
+        break;
+    case 3:
+    case 4:
+        size = kTileSize * (1 + r() % 8) + r() % 5 - 2;
+        break;
+    case 5:
+    case 6:
+        size = 1 + r() % (1024 * 1024);
+        break;
+    default:
+        size = 1 + r() % (r() % 64 == 0 ? kMaxStressCaseSize : 4 * kTileSize);
+        break;
+    }
+
+    c.Kind = static_cast<ContentKind>(r() % static_cast<uint64_t>(ContentKind::Count));
+
+    // With --maxtiles the first case is the largest stream a tile stream can describe
+    if (maxTiles && c.Index == 0)
+    {
+        size = kMaxTiles * kTileSize;
+        c.Kind = ContentKind::Runs;
+    }
+
+    c.Source.clear();
+    c.Source.reserve(size);
+    AppendContent(r, c.Kind, size, c.Source);
+}
+
+struct StressTotals
+{
+    uint64_t Cases = 0;
+    uint64_t Streams = 0;
+    uint64_t Failures = 0;
+    uint64_t UncompressedBytes = 0;
+    uint64_t CompressedBytes = 0;
+    uint64_t GpuBytes = 0;
+    double CompressSeconds = 0;
+    double CpuDecompressSeconds = 0;
+    double GpuDecompressSeconds = 0;
+};
+
+using StressClock = std::chrono::steady_clock;
+
+static double SecondsSince(StressClock::time_point start)
+{
+    return std::chrono::duration<double>(StressClock::now() - start).count();
+}
+
+// Compresses the case at every level and decodes each stream with the CPU decoder
+static void RunCpuStressCase(StressCase& c, StressTotals& totals)
+{
+    c.Compressed.clear();
+    for (uint32_t level = GDeflate::MinimumCompressionLevel; level <= GDeflate::MaximumCompressionLevel; ++level)
+    {
+        Buffer compressed(GDeflate::CompressBound(c.Source.size()));
+        size_t compressedSize = compressed.size();
+
+        auto start = StressClock::now();
+        bool compressedOk = GDeflate::Compress(
+            compressed.data(),
+            &compressedSize,
+            c.Source.data(),
+            c.Source.size(),
+            level,
+            GDeflate::COMPRESS_SINGLE_THREAD);
+        totals.CompressSeconds += SecondsSince(start);
+
+        if (!compressedOk)
+        {
+            c.Failure += "compression failed at level " + std::to_string(level) + " ";
+            c.Compressed.emplace_back();
+            continue;
+        }
+        compressed.resize(compressedSize);
+
+        Buffer uncompressed(c.Source.size());
+        start = StressClock::now();
+        bool decompressedOk = GDeflate::Decompress(
+            uncompressed.data(),
+            uncompressed.size(),
+            compressed.data(),
+            compressed.size(),
+            1);
+        totals.CpuDecompressSeconds += SecondsSince(start);
+
+        if (!decompressedOk || uncompressed != c.Source)
+            c.Failure += "CPU decode failed at level " + std::to_string(level) + " ";
+
+        totals.UncompressedBytes += c.Source.size();
+        totals.CompressedBytes += compressed.size();
+        totals.Streams++;
+        c.Compressed.push_back(std::move(compressed));
+    }
+}
+
+// Decodes GDeflate streams from memory into a GPU buffer through a DirectStorage queue. DirectStorage
+// decompresses them on the GPU when the adapter and driver support it, and on the CPU otherwise.
+class DirectStorageDecoder
+{
+    winrt::com_ptr<ID3D12Device> m_device;
+    winrt::com_ptr<IDStorageFactory> m_factory;
+    winrt::com_ptr<IDStorageQueue> m_queue;
+    winrt::com_ptr<ID3D12CommandQueue> m_copyQueue;
+    winrt::com_ptr<ID3D12CommandAllocator> m_commandAllocator;
+    winrt::com_ptr<ID3D12GraphicsCommandList> m_commandList;
+    winrt::com_ptr<ID3D12Fence> m_fence;
+    uint64_t m_nextFenceValue = 1;
+    winrt::handle m_fenceEvent;
+
+    static winrt::com_ptr<ID3D12Resource> CreateBuffer(
+        ID3D12Device* device,
+        uint64_t size,
+        D3D12_HEAP_TYPE heapType,
+        D3D12_RESOURCE_STATES initialState)
+    {
+        D3D12_HEAP_PROPERTIES heapProperties{};
+        heapProperties.Type = heapType;
+
+        D3D12_RESOURCE_DESC desc{};
+        desc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        desc.Width = std::max<uint64_t>(size, 1);
+        desc.Height = 1;
+        desc.DepthOrArraySize = 1;
+        desc.MipLevels = 1;
+        desc.SampleDesc.Count = 1;
+        desc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+
+        winrt::com_ptr<ID3D12Resource> buffer;
+        winrt::check_hresult(device->CreateCommittedResource(
+            &heapProperties,
+            D3D12_HEAP_FLAG_NONE,
+            &desc,
+            initialState,
+            nullptr,
+            IID_PPV_ARGS(buffer.put())));
+        return buffer;
+    }
+
+public:
+    // Streams whose compressed data doesn't fit in the staging buffer can't be decoded
+    static constexpr uint32_t kStagingBufferSize = 2 * kMaxStressCaseSize;
+    static constexpr uint32_t kQueueCapacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+
+    bool Initialize()
+    {
+        if (FAILED(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(m_device.put()))))
+            return false;
+
+        winrt::check_hresult(DStorageGetFactory(IID_PPV_ARGS(m_factory.put())));
+        winrt::check_hresult(m_factory->SetStagingBufferSize(kStagingBufferSize));
+
+        DSTORAGE_QUEUE_DESC queueDesc{};
+        queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+        queueDesc.Capacity = kQueueCapacity;
+        queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+        queueDesc.Name = "GDeflateTest";
+        queueDesc.Device = m_device.get();
+        winrt::check_hresult(m_factory->CreateQueue(&queueDesc, IID_PPV_ARGS(m_queue.put())));
+
+        D3D12_COMMAND_QUEUE_DESC copyQueueDesc{};
+        copyQueueDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+        winrt::check_hresult(m_device->CreateCommandQueue(&copyQueueDesc, IID_PPV_ARGS(m_copyQueue.put())));
+        winrt::check_hresult(m_device->CreateCommandAllocator(
+            D3D12_COMMAND_LIST_TYPE_COPY,
+            IID_PPV_ARGS(m_commandAllocator.put())));
+        winrt::check_hresult(m_device->CreateCommandList(
+            0,
+            D3D12_COMMAND_LIST_TYPE_COPY,
+            m_commandAllocator.get(),
+            nullptr,
+            IID_PPV_ARGS(m_commandList.put())));
+        winrt::check_hresult(m_commandList->Close());
+
+        winrt::check_hresult(m_device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_fence.put())));
+        m_fenceEvent.attach(CreateEventW(nullptr, FALSE, FALSE, nullptr));
+        winrt::check_bool(bool(m_fenceEvent));
+        return true;
+    }
+
+    std::string DescribeSupport() const
+    {
+        auto queue2 = m_queue.try_as<IDStorageQueue2>();
+        if (!queue2)
+            return "unknown";
+
+        DSTORAGE_COMPRESSION_SUPPORT support = queue2->GetCompressionSupport(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE);
+        if (support & DSTORAGE_COMPRESSION_SUPPORT_GPU_OPTIMIZED)
+            return "GPU, optimized driver";
+        if (support & DSTORAGE_COMPRESSION_SUPPORT_GPU_FALLBACK)
+            return "GPU, DirectStorage fallback shader";
+        return "CPU fallback";
+    }
+
+    // Decodes up to kQueueCapacity streams with one submission. Returns false if DirectStorage
+    // reported a failed request, and otherwise fills uncompressed with each stream's output.
+    bool Decode(
+        std::vector<Buffer const*> const& streams,
+        std::vector<size_t> const& sizes,
+        std::vector<Buffer>& uncompressed)
+    {
+        std::vector<uint64_t> offsets(streams.size());
+        uint64_t outputSize = 0;
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            offsets[i] = outputSize;
+            outputSize += (sizes[i] + 255) & ~255ull;
+        }
+
+        auto outputBuffer =
+            CreateBuffer(m_device.get(), outputSize, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+        auto readbackBuffer =
+            CreateBuffer(m_device.get(), outputSize, D3D12_HEAP_TYPE_READBACK, D3D12_RESOURCE_STATE_COPY_DEST);
+
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            DSTORAGE_REQUEST request{};
+            request.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+            request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+            request.Source.Memory.Source = streams[i]->data();
+            request.Source.Memory.Size = static_cast<uint32_t>(streams[i]->size());
+            request.Destination.Buffer.Resource = outputBuffer.get();
+            request.Destination.Buffer.Offset = offsets[i];
+            request.Destination.Buffer.Size = static_cast<uint32_t>(sizes[i]);
+            request.UncompressedSize = static_cast<uint32_t>(sizes[i]);
+            m_queue->EnqueueRequest(&request);
+        }
+
+        uint64_t decodedFenceValue = m_nextFenceValue++;
+        m_queue->EnqueueSignal(m_fence.get(), decodedFenceValue);
+        m_queue->Submit();
+
+        // Read the output back on a copy queue once DirectStorage has signaled
+        winrt::check_hresult(m_commandAllocator->Reset());
+        winrt::check_hresult(m_commandList->Reset(m_commandAllocator.get(), nullptr));
+        m_commandList->CopyBufferRegion(readbackBuffer.get(), 0, outputBuffer.get(), 0, outputSize);
+        winrt::check_hresult(m_commandList->Close());
+
+        winrt::check_hresult(m_copyQueue->Wait(m_fence.get(), decodedFenceValue));
+        ID3D12CommandList* commandLists[] = {m_commandList.get()};
+        m_copyQueue->ExecuteCommandLists(1, commandLists);
+        uint64_t readbackFenceValue = m_nextFenceValue++;
+        winrt::check_hresult(m_copyQueue->Signal(m_fence.get(), readbackFenceValue));
+
+        winrt::check_hresult(m_fence->SetEventOnCompletion(readbackFenceValue, m_fenceEvent.get()));
+        WaitForSingleObject(m_fenceEvent.get(), INFINITE);
+
+        DSTORAGE_ERROR_RECORD errorRecord{};
+        m_queue->RetrieveErrorRecord(&errorRecord);
+        if (errorRecord.FailureCount > 0)
+            return false;
+
+        uint8_t* output = nullptr;
+        winrt::check_hresult(readbackBuffer->Map(0, nullptr, reinterpret_cast<void**>(&output)));
+        uncompressed.resize(streams.size());
+        for (size_t i = 0; i < streams.size(); ++i)
+            uncompressed[i].assign(output + offsets[i], output + offsets[i] + sizes[i]);
+        readbackBuffer->Unmap(0, nullptr);
+        return true;
+    }
+};
+
+// Decodes each round's streams with DirectStorage, in as few submissions as the queue allows
+static void RunGpuStressRound(DirectStorageDecoder& decoder, std::vector<StressCase>& cases, StressTotals& totals)
+{
+    std::vector<Buffer const*> streams;
+    std::vector<size_t> sizes;
+    std::vector<std::pair<StressCase*, uint32_t>> owners;
+    std::vector<Buffer> uncompressed;
+
+    auto flush = [&]()
+    {
+        if (streams.empty())
+            return;
+
+        auto start = StressClock::now();
+        bool decoded = decoder.Decode(streams, sizes, uncompressed);
+        totals.GpuDecompressSeconds += SecondsSince(start);
+
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            auto& [c, level] = owners[i];
+            if (!decoded)
+                c->Failure += "DirectStorage reported a failed request in this submission ";
+            else if (uncompressed[i] != c->Source)
+                c->Failure += "DirectStorage decode failed at level " + std::to_string(level) + " ";
+            totals.GpuBytes += sizes[i];
+        }
+
+        streams.clear();
+        sizes.clear();
+        owners.clear();
+    };
+
+    for (auto& c : cases)
+    {
+        for (uint32_t l = 0; l < c.Compressed.size(); ++l)
+        {
+            auto& compressed = c.Compressed[l];
+            if (compressed.empty() || compressed.size() > DirectStorageDecoder::kStagingBufferSize ||
+                c.Source.size() > kMaxStressCaseSize)
+                continue;
+
+            if (streams.size() == DirectStorageDecoder::kQueueCapacity)
+                flush();
+
+            streams.push_back(&compressed);
+            sizes.push_back(c.Source.size());
+            owners.emplace_back(&c, GDeflate::MinimumCompressionLevel + l);
+        }
+    }
+    flush();
+}
+
+static int RunStressTest(int argc, char** argv)
+{
+    // --stress [cases] [seed] [--first index] [--maxtiles] [--cpuonly]
+    uint64_t numCases = 1000000;
+    uint64_t seed = 1;
+    uint64_t firstCase = 0;
+    bool maxTiles = false;
+    bool cpuOnly = false;
+
+    int positional = 0;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--first") == 0 && i + 1 < argc)
+            firstCase = std::strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--maxtiles") == 0)
+            maxTiles = true;
+        else if (strcmp(argv[i], "--cpuonly") == 0)
+            cpuOnly = true;
+        else if (positional++ == 0)
+            numCases = std::strtoull(argv[i], nullptr, 10);
+        else
+            seed = std::strtoull(argv[i], nullptr, 10);
+    }
+
+    DirectStorageDecoder decoder;
+    bool useGpu = !cpuOnly && decoder.Initialize();
+
+    uint32_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Stress testing " << numCases << " cases from seed " << seed << " on " << numThreads
+              << " threads, DirectStorage decode: " << (useGpu ? decoder.DescribeSupport() : "skipped") << std::endl;
+
+    // Cases run in rounds, each round's streams are decoded by DirectStorage together
+    static constexpr uint64_t kCasesPerRound = 256;
+    static constexpr size_t kMaxReportedFailures = 20;
+
+    StressTotals totals;
+    std::mutex totalsMutex;
+    size_t reportedFailures = 0;
+    auto start = StressClock::now();
+
+    std::vector<StressCase> cases;
+    for (uint64_t roundStart = firstCase; roundStart < firstCase + numCases; roundStart += kCasesPerRound)
+    {
+        uint64_t roundSize = std::min(kCasesPerRound, firstCase + numCases - roundStart);
+        cases.resize(roundSize);
+
+        std::atomic<uint64_t> nextCase = 0;
+        std::vector<std::thread> workers;
+        for (uint32_t t = 0; t < numThreads; ++t)
+        {
+            workers.emplace_back(
+                [&]()
+                {
+                    StressTotals workerTotals;
+                    for (uint64_t i = nextCase++; i < roundSize; i = nextCase++)
+                    {
+                        auto& c = cases[i];
+                        c.Index = roundStart + i;
+                        c.Failure.clear();
+                        GenerateStressCase(seed, maxTiles, c);
+                        RunCpuStressCase(c, workerTotals);
+                    }
+
+                    std::lock_guard lock(totalsMutex);
+                    totals.Streams += workerTotals.Streams;
+                    totals.UncompressedBytes += workerTotals.UncompressedBytes;
+                    totals.CompressedBytes += workerTotals.CompressedBytes;
+                    totals.CompressSeconds += workerTotals.CompressSeconds;
+                    totals.CpuDecompressSeconds += workerTotals.CpuDecompressSeconds;
+                });
+        }
+        for (auto& worker : workers)
+            worker.join();
+
+        if (useGpu)
+            RunGpuStressRound(decoder, cases, totals);
+
+        for (auto& c : cases)
+        {
+            totals.Cases++;
+            if (c.Failure.empty())
+                continue;
+
+            totals.Failures++;
+            if (reportedFailures++ < kMaxReportedFailures)
+            {
+                std::cout << "\rCase " << c.Index << " (" << c.Source.size() << " bytes, "
+                          << GetContentKindName(c.Kind) << "): " << c.Failure << std::endl;
+            }
+        }
+
+        std::cout << "\r" << totals.Cases << " / " << numCases << " cases, " << totals.Failures << " failed"
+                  << std::flush;
+    }
+
+    // Compression and CPU decode times are summed over the worker threads, so their rates are per thread
+    double megabytes = double(totals.UncompressedBytes) / (1024.0 * 1024.0);
+    std::cout << "\n\n" << totals.Cases << " cases, " << totals.Streams << " streams, " << totals.Failures
+              << " failed in " << SecondsSince(start) << " s\n";
+    std::cout << "Ratio:          "
+              << double(totals.UncompressedBytes) / double(std::max<uint64_t>(totals.CompressedBytes, 1)) << "\n";
+    std::cout << "Compress:       " << megabytes / totals.CompressSeconds << " MB/s per thread\n";
+    std::cout << "CPU Decompress: " << megabytes / totals.CpuDecompressSeconds << " MB/s per thread\n";
+    if (useGpu)
+    {
+        std::cout << "DirectStorage:  " << double(totals.GpuBytes) / (1024.0 * 1024.0) / totals.GpuDecompressSeconds
+                  << " MB/s, including upload and readback\n";
+    }
+
+    return totals.Failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0)
+        return RunStressTest(argc - 2, argv + 2);
+
+    if (argc > 1 && strcmp(argv[1], "--library") == 0)
+        return RunLibraryTests() ? 0 : 1;
+
     std::default_random_engine r;
 
     std::vector<Buffer> sourceBuffers;
@@ -0,0 +1,233 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+#include "LibraryTests.h"
+
+#include <GDeflate.h>
+#include <TileStream.h>
+
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using Buffer = std::vector<uint8_t>;
+
+    void Report(const char* name, bool passed)
+    {
+        std::cout << name << ": " << (passed ? "Ok" : "FAILED") << std::endl;
+    }
+
+    // A batch whose tile count does not fit the 32-bit work list is rejected as a whole, and every stream in it
+    // is reported as failed, including the ones validated before the overflow was found.
+    bool TestBatchWorkListOverflow()
+    {
+        // A header at the tile limit with a zeroed offset table. The batch fails before any tile is read, so
+        // the tile data and the output are never touched.
+        GDeflate::TileStream header(GDeflate::TileStream::kMaxTiles * GDeflate::kDefaultTileSize);
+        Buffer stream(header.GetDataOffset());
+        memcpy(stream.data(), &header, sizeof(header));
+
+        uint8_t output = 0;
+        size_t numStreams = UINT32_MAX / GDeflate::TileStream::kMaxTiles + 1;
+        std::vector<GDeflate::StreamDesc> streams(numStreams);
+
+        for (auto& desc : streams)
+        {
+            desc.input = stream.data();
+            desc.inputSize = stream.size();
+            desc.output = &output;
+            desc.outputSize = header.GetUncompressedSize();
+            desc.succeeded = true;
+        }
+
+        if (GDeflate::DecompressBatch(streams.data(), streams.size(), 1))
+            return false;
+
+        for (auto& desc : streams)
+        {
+            if (desc.succeeded)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Inputs that exercise stored, fixed and dynamic blocks, long matches and literal runs. The size leaves the
+    // last tile short.
+    std::vector<Buffer> MakeTileDecoderInputs()
+    {
+        const size_t size = 3 * GDeflate::kDefaultTileSize + 1234;
+        std::mt19937 rng(2024);
+        std::vector<Buffer> inputs(4, Buffer(size));
+
+        static const char kWords[] = "the quick brown fox jumps over the lazy dog while decoding tiles ";
+        for (size_t i = 0; i < size; ++i)
+        {
+            inputs[0][i] = static_cast<uint8_t>(rng());
+            inputs[1][i] = static_cast<uint8_t>(kWords[(i * 7 + rng() % 3) % (sizeof(kWords) - 1)]);
+            inputs[2][i] = static_cast<uint8_t>((i / 300) * 37);
+            inputs[3][i] = i < 64 || rng() % 16 == 0 ? static_cast<uint8_t>(rng()) : inputs[3][i - 1 - rng() % 64];
+        }
+
+        return inputs;
+    }
+
+    // Streams compressed by libdeflate decode to the same bytes with the vector tile decoder as with libdeflate.
+    // The vector decoder is forced, so this also covers CPUs where it runs its lanes one by one.
+    bool TestVectorTileDecoder()
+    {
+        const GDeflate::TileDecoder previous = GDeflate::GetTileDecoder();
+        bool passed = true;
+
+        for (Buffer const& input : MakeTileDecoderInputs())
+        {
+            for (uint32_t level : {1u, 9u, 12u})
+            {
+                for (uint32_t flags : {0u, uint32_t(GDeflate::COMPRESS_TILE_SIZE_16K)})
+                {
+                    Buffer compressed;
+                    if (!GDeflate::Compress(compressed, input.data(), input.size(), level, flags))
+                    {
+                        passed = false;
+                        continue;
+                    }
+
+                    for (auto decoder : {GDeflate::TileDecoder::Libdeflate, GDeflate::TileDecoder::Vector})
+                    {
+                        GDeflate::SetTileDecoder(decoder);
+
+                        Buffer output(input.size());
+                        passed &= GDeflate::Decompress(
+                                      output.data(), output.size(), compressed.data(), compressed.size(), 1) &&
+                                  output == input;
+                    }
+                }
+            }
+        }
+
+        GDeflate::SetTileDecoder(previous);
+        return passed;
+    }
+
+    // Small assets that share their layout and differ in their values, like material blobs.
+    std::vector<Buffer> MakeDictionarySamples(size_t numSamples)
+    {
+        static const char* kKeys[] = {"albedo", "normal", "roughness", "metallic", "emissive", "occlusion", "uvScale"};
+        std::mt19937 rng(7);
+        std::vector<Buffer> samples;
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            std::string text = "{ \"material\": \"mat_" + std::to_string(rng() % 10000) + "\", \"layers\": [";
+            for (uint32_t layer = 0; layer < 4 + rng() % 4; ++layer)
+            {
+                text += " { ";
+                for (const char* key : kKeys)
+                {
+                    text += "\"" + std::string(key) + "\": " + std::to_string(rng() % 4) + ".";
+                    text += std::to_string(rng() % 4 * 25) + ", ";
+                }
+                text += "\"texture\": \"textures/" + std::to_string(rng() % 500) + "_d.dds\" },";
+            }
+            text += " ] }";
+
+            samples.emplace_back(text.begin(), text.end());
+        }
+
+        return samples;
+    }
+
+    // A trained dictionary makes small, similar assets smaller, and streams compressed with it decode only with
+    // the same dictionary, both on their own and in a batch.
+    bool TestDictionary()
+    {
+        std::vector<Buffer> samples = MakeDictionarySamples(64);
+        const size_t numTraining = 48;
+
+        std::vector<const uint8_t*> sampleData;
+        std::vector<size_t> sampleSizes;
+        for (size_t i = 0; i < numTraining; ++i)
+        {
+            sampleData.push_back(samples[i].data());
+            sampleSizes.push_back(samples[i].size());
+        }
+
+        const GDeflate::Dictionary dictionary =
+            GDeflate::Dictionary::Train(1, sampleData.data(), sampleSizes.data(), numTraining);
+        const GDeflate::Dictionary other(2, dictionary.GetData(), dictionary.GetSize());
+
+        if (dictionary.GetSize() == 0 || dictionary.GetSize() > GDeflate::Dictionary::kMaxSize)
+            return false;
+
+        size_t plainSize = 0;
+        size_t dictionarySize = 0;
+
+        for (size_t i = numTraining; i < samples.size(); ++i)
+        {
+            Buffer const& input = samples[i];
+
+            Buffer plain(GDeflate::CompressBound(input.size()));
+            size_t plainStreamSize = plain.size();
+            Buffer compressed(GDeflate::CompressBound(input.size()));
+            size_t compressedSize = compressed.size();
+
+            if (!GDeflate::Compress(plain.data(), &plainStreamSize, input.data(), input.size(), 9, 0) ||
+                !GDeflate::Compress(
+                    compressed.data(), &compressedSize, input.data(), input.size(), 9, 0, &dictionary))
+                return false;
+
+            plainSize += plainStreamSize;
+            dictionarySize += compressedSize;
+
+            GDeflate::TileStream header(0);
+            memcpy(&header, compressed.data(), sizeof(header));
+            if (header.dictionaryId != dictionary.GetId())
+                return false;
+
+            Buffer output(input.size());
+            if (!GDeflate::Decompress(output.data(), output.size(), compressed.data(), compressedSize, 1, &dictionary) ||
+                output != input)
+                return false;
+
+            if (GDeflate::Decompress(output.data(), output.size(), compressed.data(), compressedSize, 1) ||
+                GDeflate::Decompress(output.data(), output.size(), compressed.data(), compressedSize, 1, &other))
+                return false;
+
+            std::fill(output.begin(), output.end(), uint8_t(0));
+            GDeflate::StreamDesc desc;
+            desc.input = compressed.data();
+            desc.inputSize = compressedSize;
+            desc.output = output.data();
+            desc.outputSize = output.size();
+            desc.dictionary = &dictionary;
+
+            if (!GDeflate::DecompressBatch(&desc, 1, 1) || output != input)
+                return false;
+        }
+
+        return dictionarySize < plainSize;
+    }
+}
+
+bool RunLibraryTests()
+{
+    bool passed = true;
+
+    auto run = [&](const char* name, bool (*test)())
+    {
+        bool result = test();
+        Report(name, result);
+        passed &= result;
+    };
+
+    run("Batch work list overflow", TestBatchWorkListOverflow);
+    run("Vector tile decoder", TestVectorTileDecoder);
+    run("Dictionary", TestDictionary);
+
+    return passed;
+}
@@ -0,0 +1,9 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+#pragma once
+
+// Tests of the CPU codec that need neither DirectStorage nor a GPU. Each prints its own result line, and the
+// return value is true when all of them pass.
+bool RunLibraryTests();
@@ -19,26 +19,164 @@
 //#define USE_WAVE_INTRINSICS // Enable on machines with WaveOps support (SM 6.0 and above)
 //#define USE_WAVE_MATCH      // Enable use of the WaveMatch() intrinsics (requires shader  model 6.5)
 //#define SIMD_WIDTH <width>  // SIMD width of the machine (required when USE_WAVE_INTRINSICS)
+//#define NUM_THREADS <count> // Thread block size chosen by the permutation (defaults to NUM_BITSTREAMS)
+//#define USE_16BIT_TYPES     // Keep symbol tables in 16-bit types (requires -enable-16bit-types, shader model 6.2)
+//#define PERSISTENT_THREADS  // Run until told to quit, taking streams from a queue in the control buffer
+//#define TEXTURE_OUTPUT      // Write each stream into a linear texture subresource described in the control buffer
+//#define POST_TRANSFORM      // Undo a per-stream filter (byte planes, block split, delta) as tiles are stored
+//#define TILE_RANGE          // Decode only a range of each stream's tiles, given in the control buffer
+//#define DECRYPT             // Decrypt the tile data with ChaCha20 as it is read, keyed by the crypto context
+//#define STAGED_OUTPUT       // Assemble decoded tiles in a groupshared window and flush it with dword stores
+//#define STAGED_OUTPUT_WINDOW <bytes> // Window size per tile, a power of two of at least 512 (defaults to 8192)
+
+#define NUM_BITSTREAMS 32         // GDeflate interleaves 32 compressed bitstreams
+#define NUM_LANES NUM_BITSTREAMS  // Each tile is decoded by one thread per bitstream
+
+#ifndef NUM_THREADS
+#define NUM_THREADS NUM_LANES // Thread blocks are sized to match that
+#endif
+
+// With NUM_THREADS set to 64 on wave64 hardware, each wave decodes two tiles at once with
+// lanes 0-31 and 32-63 working independently. Every wave operation is confined to the
+// thread's own half, which needs WaveMultiPrefixSum and WaveMatch (shader model 6.5).
+#define NUM_TILES_PER_GROUP (NUM_THREADS / NUM_LANES)
+
+#if NUM_THREADS != NUM_LANES && NUM_THREADS != 2 * NUM_LANES
+#error NUM_THREADS must be NUM_BITSTREAMS or twice that
+#endif
 
-#define NUM_BITSTREAMS 32          // GDeflate interleaves 32 compressed bitstreams
-#define NUM_THREADS NUM_BITSTREAMS // Thread blocks are sized to match that
+#if NUM_TILES_PER_GROUP > 1
+#if !defined(USE_WAVE_INTRINSICS) || !defined(USE_WAVE_MATCH) || (SIMD_WIDTH < NUM_THREADS)
+#error Decoding two tiles per group requires USE_WAVE_INTRINSICS, USE_WAVE_MATCH and SIMD_WIDTH >= 64
+#endif
+static uint s_tileSlot; // Which of the group's tiles this thread decodes
+#define TILE_SLOT s_tileSlot
+#else
+#define TILE_SLOT 0
+#endif
 
 #if defined(USE_WAVE_INTRINSICS) && (SIMD_WIDTH >= NUM_THREADS)
 #define IN_REGISTER_DECODER
 #define SINGLE_WAVE
 #endif
 
+// Element type of the groupshared tables whose values fit in 16 bits: symbols and their
+// offsets, which are all below kMaxSymbols. Narrowing them halves the decoder's largest
+// groupshared allocation, so more groups fit on a SIMD where that memory is the limit.
+#ifdef USE_16BIT_TYPES
+#if !__HLSL_ENABLE_16_BIT
+#error USE_16BIT_TYPES requires -enable-16bit-types
+#endif
+typedef uint16_t table_t;
+#else
+typedef uint32_t table_t;
+#endif
+
 // Raw input and output buffers
 ByteAddressBuffer input : register(t0);
+#ifdef DECRYPT
+ByteAddressBuffer cryptoCtx : register(t1); // The 256-bit ChaCha20 key
+#endif
+#ifdef PERSISTENT_THREADS
+globallycoherent RWByteAddressBuffer control : register(u0); // Written by the host while the kernel runs
+#else
 RWByteAddressBuffer control : register(u0);
+#endif
 RWByteAddressBuffer output : register(u1);
 RWByteAddressBuffer scratch : register(u2);
 // Control buffer format: numStreams, [stream0, stream0 inPos, stream0 outPos], ...
-// Scratch buffer format: stream0 tileIdx, stream1 tileIdx, ...
+// Scratch buffer format: stream0 [epoch:12, tileIdx:20], stream1 [epoch:12, tileIdx:20], ...
+//
+// With TEXTURE_OUTPUT every stream is followed by the footprint of the subresource it
+// decodes into: [inPos, outPos, rowSize, rowPitch, numRows, slicePitch]. The stream holds
+// rowSize bytes per row, packed, and outPos is the subresource's first byte in the output
+// buffer, which aliases a texture placed with D3D12_TEXTURE_LAYOUT_ROW_MAJOR. rowSize,
+// rowPitch, slicePitch and outPos must all be multiples of 4.
+//
+// With POST_TRANSFORM the entry ends with a transform word that describes how the content
+// was filtered before compression, see TransformAddress:
+//   kind:8 (0 = none, 1 = byte planes, 2 = block split), size:8, split:8, delta stride:8
+// The delta stride is 0 for none, or 1, 2 or 4 bytes. Deltas are undone after the bytes
+// have been moved back into place.
+//
+// With TILE_RANGE the entry ends with the tiles to decode: firstTile:16, numTiles:16. Tiles
+// past the end of the stream are skipped. outPos is where the range's first tile goes, so a
+// range decodes into a buffer of its own size. With TEXTURE_OUTPUT as well, the tiles go to
+// their place in the whole subresource instead. Several entries can name the same stream.
+//
+// With DECRYPT the entry ends with the stream's 96-bit ChaCha20 nonce: nonce0, nonce1,
+// nonce2. Everything in the stream after its tile table is encrypted, with each 64 byte
+// keystream block numbered by its offset from the stream's header, so that tiles still
+// decrypt independently. The header and the tile table are left in the clear.
+
+#if (defined(TEXTURE_OUTPUT) || defined(POST_TRANSFORM) || defined(TILE_RANGE) || defined(DECRYPT) || \
+     defined(PROFILE)) &&                                                                             \
+    defined(PERSISTENT_THREADS)
+#error TEXTURE_OUTPUT, POST_TRANSFORM, TILE_RANGE, DECRYPT and PROFILE are not supported with PERSISTENT_THREADS
+#endif
+
+// A transform scatters the bytes of a dword over the tile, so staged dwords can't be flushed whole
+#if defined(STAGED_OUTPUT) && defined(POST_TRANSFORM)
+#error STAGED_OUTPUT is not supported with POST_TRANSFORM
+#endif
+
+#ifdef PROFILE
+// Profile buffer format: ticket counter, padding[3], then one record per tile slot of
+// every group: [startTicket, endTicket, tilesDecoded, bytesDecoded]
+//
+// Shader model 6 has no clock to read, so each leader takes a ticket from a shared counter
+// when it starts and again when it runs out of work. The tickets give the order in which
+// groups started and finished, and the counts show how evenly the tiles were spread. The
+// counter is never reset, the host reads the tickets relative to the lowest start. The
+// dispatch as a whole is timed with timestamp queries.
+RWByteAddressBuffer profile : register(u3);
+
+static const uint kProfileHeaderSize = 16;
+static const uint kProfileRecordSize = 16;
+
+uint ProfileRecordOffset(uint groupId)
+{
+    return kProfileHeaderSize + (groupId * NUM_TILES_PER_GROUP + TILE_SLOT) * kProfileRecordSize;
+}
+
+uint TakeProfileTicket()
+{
+    uint ticket;
+    profile.InterlockedAdd(0, 1u, ticket);
+    return ticket;
+}
+#endif
+
+#ifdef TEXTURE_OUTPUT
+static const uint kControlFootprintSize = 16;
+#else
+static const uint kControlFootprintSize = 0;
+#endif
+
+#ifdef POST_TRANSFORM
+static const uint kControlTransformSize = 4;
+#else
+static const uint kControlTransformSize = 0;
+#endif
+
+#ifdef TILE_RANGE
+static const uint kControlTileRangeSize = 4;
+#else
+static const uint kControlTileRangeSize = 0;
+#endif
+
+#ifdef DECRYPT
+static const uint kControlNonceSize = 12;
+#else
+static const uint kControlNonceSize = 0;
+#endif
+
+static const uint kControlStreamSize =
+    8 + kControlFootprintSize + kControlTransformSize + kControlTileRangeSize + kControlNonceSize;
 
 uint ControlStreamOffset(uint streamIndex)
 {
-    return 4 + streamIndex * 8;
+    return 4 + streamIndex * kControlStreamSize;
 }
 
 uint ControlStreamInOffset(uint streamIndex)
@@ -51,6 +189,42 @@ uint ScratchStreamTileIndexOffset(uint streamIndex)
     return streamIndex * 4;
 }
 
+// The host gives each dispatch on a scratch buffer a new epoch, so that the tile counters
+// left behind by earlier dispatches can be told apart without clearing the buffer. Epoch 0
+// is a zeroed buffer and is never used, the host clears the buffer when the epoch wraps.
+cbuffer DispatchConstants : register(b0)
+{
+    uint g_scratchEpoch; // 1 to 4095
+};
+
+static const uint kScratchTileBits = 20;
+static const uint kScratchTileMask = (1u << kScratchTileBits) - 1;
+
+// Claims the next tile of a stream. The first claim in a dispatch finds a counter tagged
+// with an older epoch, and swaps it for the current epoch with tile 0 already taken. The
+// tile index stays far below 2^20, so increments never carry into the epoch.
+uint ClaimStreamTile(uint streamIdx)
+{
+    const uint offset = ScratchStreamTileIndexOffset(streamIdx);
+    const uint epochBase = g_scratchEpoch << kScratchTileBits;
+
+    uint value;
+    scratch.InterlockedAdd(offset, 0, value);
+
+    [allow_uav_condition] while ((value & ~kScratchTileMask) != epochBase)
+    {
+        uint prev;
+        scratch.InterlockedCompareExchange(offset, value, epochBase + 1, prev);
+        if (prev == value)
+            return 0;
+
+        value = prev;
+    }
+
+    scratch.InterlockedAdd(offset, 1u, value);
+    return value & kScratchTileMask;
+}
+
 #include "tilestream.hlsl"
 
 uint ControlStreamOutOffset(uint streamIndex)
@@ -58,6 +232,164 @@ uint ControlStreamOutOffset(uint streamIndex)
     return ControlStreamInOffset(streamIndex) + 4;
 }
 
+#ifdef TEXTURE_OUTPUT
+
+struct OutputFootprint
+{
+    uint base;
+    uint rowSize;
+    uint rowPitch;
+    uint numRows;
+    uint slicePitch;
+};
+
+static OutputFootprint s_footprint; // Subresource of the stream being decoded
+
+// Maps an offset in the packed stream to its byte in the subresource. Rows are multiples of
+// 4 bytes, so the low bits carry over and an aligned dword never straddles two rows.
+uint FootprintAddress(uint offset)
+{
+    uint row = offset / s_footprint.rowSize;
+    uint column = offset - row * s_footprint.rowSize;
+    uint slice = row / s_footprint.numRows;
+    row -= slice * s_footprint.numRows;
+    return s_footprint.base + slice * s_footprint.slicePitch + row * s_footprint.rowPitch + column;
+}
+
+#else
+
+uint FootprintAddress(uint offset)
+{
+    return offset;
+}
+
+#endif
+
+#ifdef POST_TRANSFORM
+
+static const uint kTransformNone = 0;
+static const uint kTransformBytePlanes = 1;
+static const uint kTransformBlockSplit = 2;
+
+static uint s_transform; // Transform word of the stream being decoded
+static uint s_tileStart; // Output position and size of the tile being decoded
+static uint s_tileSize;
+
+uint GetTransformKind()
+{
+    return s_transform & 0xff;
+}
+
+uint GetDeltaStride()
+{
+    return s_transform >> 24;
+}
+
+// Maps a position in the filtered tile to the position of the same byte once unfiltered.
+// Filters are applied per tile, so that tiles still decode independently:
+//  - byte planes: elements of size bytes were split into size planes, the first holding
+//    byte 0 of every element, the second byte 1 and so on.
+//  - block split: blocks of size bytes were split into their first split bytes and the
+//    rest, e.g. BCn endpoints and indices, with all first parts stored ahead of the rest.
+// Bytes past the last whole element or block of a tile are left in place.
+uint TransformAddress(uint offset)
+{
+    uint kind = GetTransformKind();
+    if (kind == kTransformNone)
+        return offset;
+
+    uint size = (s_transform >> 8) & 0xff;
+    uint count = s_tileSize / size;
+    uint local = offset - s_tileStart;
+
+    if (local >= count * size)
+        return offset;
+
+    if (kind == kTransformBytePlanes)
+    {
+        uint plane = local / count;
+        local = (local - plane * count) * size + plane;
+    }
+    else
+    {
+        uint split = (s_transform >> 16) & 0xff;
+        uint head = count * split;
+        if (local < head)
+        {
+            uint block = local / split;
+            local = block * size + (local - block * split);
+        }
+        else
+        {
+            uint rest = size - split;
+            uint block = (local - head) / rest;
+            local = block * size + split + (local - head - block * rest);
+        }
+    }
+
+    return s_tileStart + local;
+}
+
+#else
+
+uint TransformAddress(uint offset)
+{
+    return offset;
+}
+
+#endif
+
+uint OutputAddress(uint offset)
+{
+    return FootprintAddress(TransformAddress(offset));
+}
+
+#ifdef TILE_RANGE
+static uint s_rangeFirstTile; // Tile range of the stream being decoded
+static uint s_rangeNumTiles;
+#endif
+
+#ifdef DECRYPT
+static const uint kNoKeystreamWindow = 0x80000000;
+
+static uint s_cryptoBase;    // Input position of the stream being decoded, where block 0 starts
+static uint3 s_nonce;        // Its nonce
+static uint s_keystreamWord; // First dword of the keystream window from s_cryptoBase, see GetKeystream
+static uint s_keystream;     // This thread's dword of the window
+#endif
+
+// Loads the stream's footprint, transform, tile range and nonce. With TEXTURE_OUTPUT, tiles
+// are then decoded at offsets relative to the stream.
+uint BeginOutputStream(uint streamIndex, uint streamOutPos)
+{
+    uint offset = ControlStreamOutOffset(streamIndex) + 4;
+#ifdef TEXTURE_OUTPUT
+    s_footprint.base = streamOutPos;
+    s_footprint.rowSize = control.Load(offset);
+    s_footprint.rowPitch = control.Load(offset + 4);
+    s_footprint.numRows = control.Load(offset + 8);
+    s_footprint.slicePitch = control.Load(offset + 12);
+    offset += kControlFootprintSize;
+    streamOutPos = 0;
+#endif
+#ifdef POST_TRANSFORM
+    s_transform = control.Load(offset);
+    offset += kControlTransformSize;
+#endif
+#ifdef TILE_RANGE
+    uint range = control.Load(offset);
+    s_rangeFirstTile = range & 0xffff;
+    s_rangeNumTiles = range >> 16;
+    offset += kControlTileRangeSize;
+#endif
+#ifdef DECRYPT
+    s_cryptoBase = control.Load(ControlStreamInOffset(streamIndex));
+    s_nonce = control.Load3(offset);
+    s_keystreamWord = kNoKeystreamWindow; // The window belongs to the previous stream's keystream
+#endif
+    return streamOutPos;
+}
+
 inline uint32_t mask(uint32_t n)
 {
     return (1u << n) - 1u;
@@ -73,40 +405,66 @@ inline uint32_t extract(uint32_t data, uint32_t pos, uint32_t n, uint32_t base =
     return ((data >> pos) & mask(n)) + base;
 }
 
-groupshared uint32_t g_tmp[NUM_THREADS];
+groupshared uint32_t g_tmp[NUM_TILES_PER_GROUP][NUM_LANES];
+
+// Wave lane of thread idx of the current tile
+inline uint TileLane(uint idx)
+{
+    return TILE_SLOT * NUM_LANES + idx;
+}
 
 #if defined(USE_WAVE_INTRINSICS) && (SIMD_WIDTH >= NUM_THREADS)
 
+#if NUM_TILES_PER_GROUP > 1
+// Selects the current tile's 32 lanes from a wave-wide mask
+inline uint32_t TileBits(uint4 mask)
+{
+    return TILE_SLOT != 0 ? mask.y : mask.x;
+}
+#endif
+
 inline uint32_t vote(bool p, uint tid)
 {
+#if NUM_TILES_PER_GROUP > 1
+    return TileBits(WaveActiveBallot(p));
+#else
     return (uint32_t)WaveActiveBallot(p);
+#endif
 }
 
 inline uint32_t shuffle(uint32_t value, uint idx, uint tid)
 {
-    return WaveReadLaneAt(value, idx);
+    return WaveReadLaneAt(value, TileLane(idx));
 }
 
 inline uint32_t broadcast(uint32_t value, uint idx, uint tid)
 {
-    return WaveReadLaneAt(value, idx);
+    return WaveReadLaneAt(value, TileLane(idx));
 }
 
 inline bool all(bool p, uint tid)
 {
+#if NUM_TILES_PER_GROUP > 1
+    return vote(p, tid) == 0xffffffff;
+#else
     return (uint32_t)WaveActiveAllTrue(p);
+#endif
 }
 
 uint32_t scan(uint32_t value, uint tid)
 {
+#if NUM_TILES_PER_GROUP > 1
+    return WaveMultiPrefixSum(value, TILE_SLOT != 0 ? uint4(0, 0xffffffff, 0, 0) : uint4(0xffffffff, 0, 0, 0));
+#else
     return WavePrefixSum(value);
+#endif
 }
 
 #else
 
-groupshared uint32_t g_tmp1[NUM_THREADS];
-groupshared uint32_t g_tmp2[NUM_THREADS];
-groupshared uint32_t g_tmp3[NUM_THREADS];
+groupshared uint32_t g_tmp1[NUM_LANES];
+groupshared uint32_t g_tmp2[NUM_LANES];
+groupshared uint32_t g_tmp3[NUM_LANES];
 
 inline uint32_t vote(bool p, uint tid)
 {
@@ -114,13 +472,13 @@ inline uint32_t vote(bool p, uint tid)
     g_tmp1[tid / SIMD_WIDTH] = (uint32_t)WaveActiveBallot(p);
     GroupMemoryBarrierWithGroupSync();
     uint32_t ballot = g_tmp1[0];
-    [unroll] for (uint i = 1; i < NUM_THREADS / SIMD_WIDTH; i++) ballot |= g_tmp1[i] << (SIMD_WIDTH * i);
+    [unroll] for (uint i = 1; i < NUM_LANES / SIMD_WIDTH; i++) ballot |= g_tmp1[i] << (SIMD_WIDTH * i);
     GroupMemoryBarrierWithGroupSync();
     return ballot;
 #else
     g_tmp1[tid] = p ? (1u << tid) : 0;
     GroupMemoryBarrierWithGroupSync();
-    [unroll] for (uint i = NUM_THREADS / 2; i > 0; i >>= 1)
+    [unroll] for (uint i = NUM_LANES / 2; i > 0; i >>= 1)
     {
         if (tid < i)
             g_tmp1[tid] |= g_tmp1[tid + i];
@@ -152,7 +510,7 @@ inline uint32_t broadcast(uint32_t value, uint idx, uint tid)
 
 bool all(bool p, uint tid)
 {
-    return vote(p, tid) == (1 << NUM_THREADS) - 1;
+    return vote(p, tid) == (1 << NUM_LANES) - 1;
 }
 
 // Prefix sum
@@ -169,7 +527,7 @@ inline uint32_t scan(uint32_t value, uint tid)
 #else
     uint32_t sum = value;
 
-    [unroll] for (uint i = 1; i < NUM_THREADS; i *= 2) sum += tid >= i ? shuffle(sum, tid - i, tid) : 0;
+    [unroll] for (uint i = 1; i < NUM_LANES; i *= 2) sum += tid >= i ? shuffle(sum, tid - i, tid) : 0;
 
     return sum - value;
 #endif
@@ -183,7 +541,7 @@ uint32_t scan16(uint32_t value, uint tid)
 #if defined(USE_WAVE_INTRINSICS) && (SIMD_WIDTH == 16)
     return WavePrefixSum(value) + value;
 #else
-    [unroll] for (uint i = 1; i < NUM_THREADS / 2; i *= 2)
+    [unroll] for (uint i = 1; i < NUM_LANES / 2; i *= 2)
     {
         value += (tid & 15) >= i ? shuffle(value, tid - i, tid) : 0;
     }
@@ -194,19 +552,23 @@ uint32_t scan16(uint32_t value, uint tid)
 uint32_t match(uint32_t value, uint tid)
 {
 #if defined(USE_WAVE_MATCH) && defined(USE_WAVE_INTRINSICS) && (SIMD_WIDTH >= NUM_THREADS)
+#if NUM_TILES_PER_GROUP > 1
+    return TileBits(WaveMatch(value));
+#else
     return (uint32_t)WaveMatch(value);
+#endif
 #else
     uint32_t mask = 0;
 
 #if defined(USE_WAVE_INTRINSICS) && (SIMD_WIDTH >= NUM_THREADS)
-    [unroll] for (uint i = 0; i < NUM_THREADS; i++)
+    [unroll] for (uint i = 0; i < NUM_LANES; i++)
     {
-        mask |= (WaveReadLaneAt(value, i) == value ? 1u : 0) << i;
+        mask |= (WaveReadLaneAt(value, TileLane(i)) == value ? 1u : 0) << i;
     }
 #else
     g_tmp1[tid] = value;
     GroupMemoryBarrierWithGroupSync();
-    [unroll] for (uint i = 0; i < NUM_THREADS; i++)
+    [unroll] for (uint i = 0; i < NUM_LANES; i++)
     {
         GroupMemoryBarrierWithGroupSync();
         mask |= g_tmp1[i] == value ? (1u << i) : 0;
@@ -218,8 +580,200 @@ uint32_t match(uint32_t value, uint tid)
 #endif
 }
 
+#ifdef STAGED_OUTPUT
+
+#ifndef STAGED_OUTPUT_WINDOW
+#define STAGED_OUTPUT_WINDOW 8192
+#endif
+
+#if STAGED_OUTPUT_WINDOW < 512 || (STAGED_OUTPUT_WINDOW & (STAGED_OUTPUT_WINDOW - 1)) != 0
+#error STAGED_OUTPUT_WINDOW must be a power of two of at least 512
+#endif
+
+// The window is a ring over the tile's most recent bytes. It is flushed in lines of one dword
+// per thread, so each store covers NUM_LANES consecutive dwords. Bytes that have left the ring
+// are read back from the output buffer, which holds them by then.
+static const uint kStageLineSize = NUM_LANES * 4;
+static const uint kStageWindowSize = STAGED_OUTPUT_WINDOW;
+static const uint kStageWindowWords = kStageWindowSize / 4;
+
+groupshared uint32_t g_stage[NUM_TILES_PER_GROUP][kStageWindowWords];
+
+static uint s_stageBase;     // Output position of the tile being decoded
+static uint s_stageEnd;      // Tile offset past the window, which holds the kStageWindowSize bytes before it
+static uint s_stageFlushed;  // Tile offset up to which the output buffer holds the tile
+static uint s_stageRoundEnd; // Tile offset past the round being written, when it bypasses the window
+static bool s_stageDirect;   // Set while a round that doesn't fit the window is written to the output buffer
+
+inline uint StageSlot(uint local)
+{
+    return (local / 4) % kStageWindowWords;
+}
+
+inline bool IsStaged(uint local)
+{
+    return !s_stageDirect && local >= s_stageEnd - kStageWindowSize;
+}
+
+inline uint32_t ReadOutputByte(uint32_t offset)
+{
+    uint32_t local = offset - s_stageBase;
+    if (IsStaged(local))
+        return (g_stage[TILE_SLOT][StageSlot(local)] >> ((local & 3) << 3)) & 0xff;
+
+    offset = OutputAddress(offset);
+    uint32_t offsetMod4 = offset & 3;
+    offset -= offsetMod4;
+    uint32_t shift = offsetMod4 << 3;
+    return (output.Load(offset) >> shift) & 0xff;
+}
+
+inline void StoreByte(uint32_t offset, uint32_t data)
+{
+    uint32_t local = offset - s_stageBase;
+    if (!s_stageDirect)
+    {
+        InterlockedOr(g_stage[TILE_SLOT][StageSlot(local)], (data & 0xff) << ((local & 3) << 3));
+        return;
+    }
+
+    offset = OutputAddress(offset);
+    uint32_t offsetMod4 = offset & 3;
+    offset -= offsetMod4;
+    uint32_t shift = offsetMod4 << 3;
+    output.InterlockedOr(offset, (data & 0xff) << shift);
+}
+
+// Reads the dword at a multiple of 4
+inline uint32_t ReadOutputWord(uint32_t offset)
+{
+    uint32_t local = offset - s_stageBase;
+    if (IsStaged(local))
+        return g_stage[TILE_SLOT][StageSlot(local)];
+    return output.Load(OutputAddress(offset));
+}
+
+// Stores the bytes of data that are set in byteMask to the dword at a multiple of 4
+inline void StoreWord(uint32_t offset, uint32_t data, uint32_t byteMask)
+{
+    uint32_t local = offset - s_stageBase;
+    if (!s_stageDirect)
+    {
+        if (byteMask == 0xffffffff)
+            g_stage[TILE_SLOT][StageSlot(local)] = data;
+        else
+            InterlockedOr(g_stage[TILE_SLOT][StageSlot(local)], data & byteMask);
+        return;
+    }
+
+    if (byteMask == 0xffffffff)
+        output.Store(OutputAddress(offset), data);
+    else
+        output.InterlockedOr(OutputAddress(offset), data & byteMask);
+}
+
+inline void StageBarrier()
+{
+#if SIMD_WIDTH < NUM_THREADS
+    AllMemoryBarrierWithGroupSync();
+#else
+    AllMemoryBarrier();
+#endif
+}
+
+// Called before a tile is decoded, with an empty window over its first bytes
+void BeginStage(uint dst, uint tid)
+{
+    s_stageBase = dst;
+    s_stageEnd = kStageWindowSize;
+    s_stageFlushed = 0;
+    s_stageDirect = false;
+
+    for (uint i = tid; i < kStageWindowWords; i += NUM_LANES)
+        g_stage[TILE_SLOT][i] = 0;
+    StageBarrier();
+}
+
+// Stores the dwords from s_stageFlushed up to end to the output buffer, and clears their slots
+// so that the bytes which take them over can be ORed in. The bytes before end must be final.
+void FlushStage(uint end, uint tid)
+{
+    for (uint local = s_stageFlushed + tid * 4; local < end; local += kStageLineSize)
+    {
+        uint slot = StageSlot(local);
+        output.Store(FootprintAddress(s_stageBase + local), g_stage[TILE_SLOT][slot]);
+        g_stage[TILE_SLOT][slot] = 0;
+    }
+
+    s_stageFlushed = max(s_stageFlushed, end);
+    StageBarrier();
+}
+
+// Makes room in the window for the bytes [dst, dst + size) of a round, by flushing the lines
+// that the window moves past. The line that dst is in stays, as it is still being written. A
+// round too long for that, which takes a run of long matches, is written to the output buffer
+// as it would be without STAGED_OUTPUT, once the window has been flushed in front of it.
+void StageRound(uint dst, uint size, uint tid)
+{
+#if SIMD_WIDTH < NUM_THREADS
+    GroupMemoryBarrierWithGroupSync(); // size was broadcast through g_tmp1
+#endif
+    uint local = dst - s_stageBase;
+    uint end = local + size;
+    if (end <= s_stageEnd)
+        return;
+
+    uint stageEnd = (end + kStageLineSize - 1) & ~(kStageLineSize - 1);
+    if (stageEnd - kStageWindowSize <= (local & ~(kStageLineSize - 1)))
+    {
+        FlushStage(stageEnd - kStageWindowSize, tid);
+        s_stageEnd = stageEnd;
+        return;
+    }
+
+    // The dword that dst is in goes out partially written, its remaining bytes are still 0
+    uint head = (local + 3) & ~3;
+    FlushStage(head, tid);
+
+    for (uint i = head + tid * 4; i < end; i += kStageLineSize)
+        output.Store(FootprintAddress(s_stageBase + i), 0);
+    StageBarrier();
+
+    s_stageRoundEnd = end;
+    s_stageDirect = true;
+}
+
+// Moves the window back up to the end of a round that bypassed it. Flushing in front of the
+// round left every slot clear, the bytes already written to the window's first line are
+// loaded back into it.
+void FinishRound(uint tid)
+{
+    if (!s_stageDirect)
+        return;
+
+    uint line = s_stageRoundEnd & ~(kStageLineSize - 1);
+    s_stageEnd = line + kStageWindowSize;
+    s_stageFlushed = line;
+    s_stageDirect = false;
+    StageBarrier();
+
+    uint local = line + tid * 4;
+    if (local < s_stageRoundEnd)
+        g_stage[TILE_SLOT][StageSlot(local)] = output.Load(FootprintAddress(s_stageBase + local));
+    StageBarrier();
+}
+
+// Called once a tile has been decoded, flushes what remains in the window
+void EndStage(uint size, uint tid)
+{
+    FlushStage((size + 3) & ~3, tid);
+}
+
+#else
+
 inline uint32_t ReadOutputByte(uint32_t offset)
 {
+    offset = OutputAddress(offset);
     uint32_t offsetMod4 = offset & 3;
     offset -= offsetMod4;
     uint32_t shift = offsetMod4 << 3;
@@ -228,12 +782,144 @@ inline uint32_t ReadOutputByte(uint32_t offset)
 
 inline void StoreByte(uint32_t offset, uint32_t data)
 {
+    offset = OutputAddress(offset);
     uint32_t offsetMod4 = offset & 3;
     offset -= offsetMod4;
     uint32_t shift = offsetMod4 << 3;
     output.InterlockedOr(offset, (data & 0xff) << shift);
 }
 
+// Reads the dword at a multiple of 4
+inline uint32_t ReadOutputWord(uint32_t offset)
+{
+    return output.Load(OutputAddress(offset));
+}
+
+// Stores the bytes of data that are set in byteMask to the dword at a multiple of 4. A whole
+// dword is stored over the cleared tile, the others are ORed in next to their neighbours.
+inline void StoreWord(uint32_t offset, uint32_t data, uint32_t byteMask)
+{
+    if (byteMask == 0xffffffff)
+        output.Store(OutputAddress(offset), data);
+    else
+        output.InterlockedOr(OutputAddress(offset), data & byteMask);
+}
+
+#endif
+
+// Reads the 4 bytes from any offset
+inline uint32_t ReadOutputBytes(uint32_t offset)
+{
+    uint32_t shift = (offset & 3) << 3;
+    uint32_t aligned = offset & ~3;
+    uint32_t low = ReadOutputWord(aligned);
+    return shift == 0 ? low : (low >> shift) | (ReadOutputWord(aligned + 4) << (32 - shift));
+}
+
+#ifdef DECRYPT
+
+static const uint kKeystreamBlockWords = 16;
+
+inline uint32_t rotl(uint32_t value, uint n)
+{
+    return (value << n) | (value >> (32 - n));
+}
+
+// A word of the initial ChaCha20 state (RFC 8439) of a keystream block of the current stream
+uint32_t ChaChaInitialWord(uint word, uint block)
+{
+    static const uint32_t kSigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574}; // "expand 32-byte k"
+
+    if (word < 4)
+        return kSigma[word];
+    if (word < 12)
+        return cryptoCtx.Load((word - 4) * 4);
+    if (word == 12)
+        return block;
+    return word == 13 ? s_nonce.x : (word == 14 ? s_nonce.y : s_nonce.z);
+}
+
+// Runs the 20 ChaCha20 rounds on two blocks spread over the tile's threads, a state word per
+// thread. Each thread gathers the four words of the quarter round its word is in, computes
+// the quarter round, and keeps its own word of the result. Column rounds take the words of
+// one column, diagonal rounds move one column to the right with every row.
+uint32_t ChaChaRounds(uint32_t x, uint tid)
+{
+    const uint blockLane = tid & ~(kKeystreamBlockWords - 1); // Thread holding word 0 of the block
+    const uint row = (tid >> 2) & 3;
+    const uint col = tid & 3;
+
+    [loop] for (uint round = 0; round < 20; round++)
+    {
+        uint diagonal = round & 1;
+        uint quarter = (col - row * diagonal) & 3;
+
+        uint32_t a = shuffle(x, blockLane | quarter, tid);
+        uint32_t b = shuffle(x, blockLane | 4 | ((quarter + diagonal) & 3), tid);
+        uint32_t c = shuffle(x, blockLane | 8 | ((quarter + 2 * diagonal) & 3), tid);
+        uint32_t d = shuffle(x, blockLane | 12 | ((quarter + 3 * diagonal) & 3), tid);
+
+        a += b;
+        d = rotl(d ^ a, 16);
+        c += d;
+        b = rotl(b ^ c, 12);
+        a += b;
+        d = rotl(d ^ a, 8);
+        c += d;
+        b = rotl(b ^ c, 7);
+
+        x = row == 0 ? a : (row == 1 ? b : (row == 2 ? c : d));
+    }
+
+    return x;
+}
+
+// Fills the window with the two keystream blocks that start with the block of firstWord
+void ComputeKeystreamWindow(uint firstWord, uint tid)
+{
+    uint block = firstWord / kKeystreamBlockWords + tid / kKeystreamBlockWords;
+    uint32_t initial = ChaChaInitialWord(tid % kKeystreamBlockWords, block);
+    s_keystream = ChaChaRounds(initial, tid) + initial;
+    s_keystreamWord = firstWord & ~(kKeystreamBlockWords - 1);
+}
+
+// Returns the keystream dword of the input dword at address, when the tile's threads read the
+// dwords from begin to end between them. Every thread of the tile takes part, whether it reads
+// one of those dwords or not. The window of NUM_LANES dwords moves forward until it has
+// covered the range, and each thread takes its dword as the window passes over it. The
+// decoder reads its input front to back, so a window is used for several refills.
+uint32_t GetKeystream(uint address, uint begin, uint end, uint tid)
+{
+    uint word = (address - s_cryptoBase) / 4;
+    uint first = (begin - s_cryptoBase) / 4;
+    uint last = (end - s_cryptoBase) / 4;
+    uint32_t keystream = 0;
+
+    [loop] while (first < last)
+    {
+        if (first - s_keystreamWord >= NUM_LANES)
+            ComputeKeystreamWindow(first, tid);
+
+        uint index = word - s_keystreamWord;
+        uint32_t value = shuffle(s_keystream, min(index, NUM_LANES - 1), tid);
+        if (index < NUM_LANES)
+            keystream = value;
+
+        first = s_keystreamWord + NUM_LANES;
+    }
+
+    return keystream;
+}
+
+#else
+
+uint32_t GetKeystream(uint address, uint begin, uint end, uint tid)
+{
+    return 0;
+}
+
+#endif
+
 struct BitReader
 {
     static const uint kWidth = NUM_BITSTREAMS;
@@ -245,7 +931,7 @@ struct BitReader
     void init(uint i, uint tid)
     {
         cnt = kWidth;
-        buf = (uint64_t)input.Load(i + tid * 4);
+        buf = (uint64_t)(input.Load(i + tid * 4) ^ GetKeystream(i + tid * 4, i, i + kWidth * 4, tid));
         base = i + kWidth * 4;
     }
 
@@ -255,9 +941,10 @@ struct BitReader
         p &= cnt < kWidth;
         uint32_t ballot = vote(p, tid);
         uint offset = countbits(ballot & ltMask(tid)) * 4;
+        uint32_t keystream = GetKeystream(base + offset, base, base + countbits(ballot) * 4, tid);
         if (p)
         {
-            buf |= (uint64_t)input.Load(base + offset) << cnt;
+            buf |= (uint64_t)(input.Load(base + offset) ^ keystream) << cnt;
             cnt += kWidth;
         }
         base += countbits(ballot) * 4;
@@ -301,7 +988,7 @@ groupshared struct Scratch
     uint32_t data[64];
     void clear(uint tid)
     {
-        data[tid] = data[tid + NUM_THREADS] = 0;
+        data[tid] = data[tid + NUM_LANES] = 0;
     } // Clear first 64 words
 
     // Returns a nibble of data
@@ -309,7 +996,7 @@ groupshared struct Scratch
     {
         return (data[i / 8] >> (4 * (i % 8))) & 15;
     }
-} g_buf;
+} g_buf[NUM_TILES_PER_GROUP];
 
 void set4b(uint32_t nibbles, uint32_t n, uint32_t i)
 {
@@ -322,9 +1009,9 @@ void set4b(uint32_t nibbles, uint32_t n, uint32_t i)
     uint32_t base = i / 8;
     uint32_t shift = i % 8;
 
-    InterlockedOr(g_buf.data[base], nibbles << (shift * 4));
+    InterlockedOr(g_buf[TILE_SLOT].data[base], nibbles << (shift * 4));
     if (shift + n > 8)
-        InterlockedOr(g_buf.data[base + 1], nibbles >> ((8 - shift) * 4));
+        InterlockedOr(g_buf[TILE_SLOT].data[base + 1], nibbles >> ((8 - shift) * 4));
 }
 
 // Symbol table
@@ -333,14 +1020,14 @@ groupshared struct SymbolTable
     static const uint32_t kMaxSymbols = 288 + 32;
     static const uint32_t kDistanceCodesBase = 288;
 
-    uint symbols[kMaxSymbols]; // Can be stored in uint16_t
+    table_t symbols[kMaxSymbols];
 
     // Scatter symbols according to in-register lengths and their corresponding offsets
     uint32_t scatter(uint sym, uint len, uint offset, uint tid)
     {
         uint32_t mask = match(len, tid);
         if (len != 0)
-            symbols[offset + countbits(mask & ltMask(tid))] = sym;
+            symbols[offset + countbits(mask & ltMask(tid))] = (table_t)sym;
         return mask;
     }
 
@@ -351,39 +1038,39 @@ groupshared struct SymbolTable
     void init(uint hlit, uint offsets, uint tid)
     {
         if (tid != 15 && tid != 31)
-            g_tmp[tid + 1] = offsets;
+            g_tmp[TILE_SLOT][tid + 1] = offsets;
 
 #if SIMD_WIDTH < NUM_THREADS
         GroupMemoryBarrierWithGroupSync();
 #endif
         // 8 unconditional iterations, fully unroll
-        [unroll] for (uint32_t i = 0; i < 256 / NUM_THREADS; i++)
+        [unroll] for (uint32_t i = 0; i < 256 / NUM_LANES; i++)
         {
-            uint32_t sym = i * NUM_THREADS + tid;
-            uint32_t len = g_buf.get4b(sym);
-            uint32_t match = scatter(sym, len, g_tmp[len], tid);
+            uint32_t sym = i * NUM_LANES + tid;
+            uint32_t len = g_buf[TILE_SLOT].get4b(sym);
+            uint32_t match = scatter(sym, len, g_tmp[TILE_SLOT][len], tid);
             if (tid == firstbitlow(match))
-                g_tmp[len] += countbits(match);
+                g_tmp[TILE_SLOT][len] += countbits(match);
 #if SIMD_WIDTH < NUM_THREADS
             GroupMemoryBarrierWithGroupSync();
 #endif
         }
 
         // Bounds check on the last iteration for literals
-        uint32_t sym = 8 * NUM_THREADS + tid;
-        uint32_t len = sym < hlit ? g_buf.get4b(sym) : 0;
-        scatter(sym, len, g_tmp[len], tid);
+        uint32_t sym = 8 * NUM_LANES + tid;
+        uint32_t len = sym < hlit ? g_buf[TILE_SLOT].get4b(sym) : 0;
+        scatter(sym, len, g_tmp[TILE_SLOT][len], tid);
 
         // Scatter distance codes (assumes source array is padded with 0)
-        len = g_buf.get4b(tid + hlit);
-        scatter(tid, len, kDistanceCodesBase + g_tmp[16 + len], tid);
+        len = g_buf[TILE_SLOT].get4b(tid + hlit);
+        scatter(tid, len, kDistanceCodesBase + g_tmp[TILE_SLOT][16 + len], tid);
     }
 
-} g_lut;
+} g_lut[NUM_TILES_PER_GROUP];
 
 #ifdef IN_REGISTER_DECODER
 #define LVAL(name, index) name
-#define RVAL(name, index) WaveReadLaneAt(name, (index))
+#define RVAL(name, index) WaveReadLaneAt(name, TileLane(index))
 #else
 #define LVAL(name, index) name[index]
 #define RVAL(name, index) name[index]
@@ -397,8 +1084,12 @@ struct DecoderPair
     static const uint kMaxCodeLen = 15;
 
     // Aligned so that both can be indexed with (len-1)
-    DECLARE(uint32_t, baseCodes, NUM_THREADS); // Base codes for each code length + sentinel code
-    DECLARE(uint, offsets, NUM_THREADS);       // Offsets into the symbol table
+    DECLARE(uint32_t, baseCodes, NUM_LANES); // Base codes for each code length + sentinel code
+#ifdef IN_REGISTER_DECODER
+    DECLARE(uint, offsets, NUM_LANES);       // Offsets into the symbol table
+#else
+    DECLARE(table_t, offsets, NUM_LANES);    // Offsets into the symbol table
+#endif
 
     uint offset(uint i)
     {
@@ -410,7 +1101,7 @@ struct DecoderPair
     { // counts contain a histogram of code lengths
 
         // Calculate offsets into the symbol table
-        LVAL(offsets, tid) = scan16(counts, tid);
+        LVAL(offsets, tid) = (table_t)scan16(counts, tid);
 
         // Calculate base codes
 #ifndef IN_REGISTER_DECODER
@@ -464,7 +1155,7 @@ struct DecoderPair
     {
         uint32_t code = reversebits(bits);
         len = len4code(code, isdist ? 16 : 0);
-        return g_lut.symbols[id4code(code, len, isdist ? 16 : 0) + (isdist ? 288 : 0)];
+        return g_lut[TILE_SLOT].symbols[id4code(code, len, isdist ? 16 : 0) + (isdist ? 288 : 0)];
     }
 };
 
@@ -473,19 +1164,49 @@ struct DecoderPair
 groupshared DecoderPair dec;
 #endif
 
+// Decode a symbol of a fixed huffman block. The fixed codes (RFC 1951, 3.2.6) are canonical
+// with known lengths, so the symbol follows from the code itself and blocks that use them
+// need no decoder or symbol table to be built.
+uint DecodeFixed(uint32_t bits, out uint len, bool isdist)
+{
+    uint32_t code = reversebits(bits);
+    if (isdist)
+    {
+        len = 5;
+        return code >> 27;
+    }
+
+    uint32_t code7 = code >> 25; // 256 - 279
+    if (code7 < 24)
+    {
+        len = 7;
+        return 256 + code7;
+    }
+
+    uint32_t code8 = code >> 24; // 0 - 143, then 280 - 287
+    len = 8;
+    if (code8 < 0xc0)
+        return code8 - 0x30;
+    if (code8 < 0xc8)
+        return 280 + code8 - 0xc0;
+
+    len = 9; // 144 - 255
+    return 144 + (code >> 23) - 0x190;
+}
+
 // Calculate a histogram from in-register code lengths (each thread maps to a length)
 uint32_t GetHistogram(uint32_t cnt, uint32_t len, uint32_t maxlen, uint tid)
 {
-    g_tmp[tid] = 0;
+    g_tmp[TILE_SLOT][tid] = 0;
 #if SIMD_WIDTH < NUM_THREADS
     GroupMemoryBarrierWithGroupSync();
 #endif
     if (len != 0 && tid < cnt)
-        InterlockedAdd(g_tmp[len], 1);
+        InterlockedAdd(g_tmp[TILE_SLOT][len], 1);
 #if SIMD_WIDTH < NUM_THREADS
     GroupMemoryBarrierWithGroupSync();
 #endif
-    return g_tmp[tid & 15];
+    return g_tmp[TILE_SLOT][tid & 15];
 }
 
 // Read and sort code length code lengths
@@ -507,11 +1228,11 @@ void UpdateHistograms(uint32_t len, int i, int n, int hlit)
 {
     uint32_t cnt = max(min(hlit - i, n), 0);
     if (cnt != 0)
-        InterlockedAdd(g_tmp[len], cnt);
+        InterlockedAdd(g_tmp[TILE_SLOT][len], cnt);
 
     cnt = max(min(i + n - hlit, n), 0);
     if (cnt != 0)
-        InterlockedAdd(g_tmp[16 + len], cnt);
+        InterlockedAdd(g_tmp[TILE_SLOT][16 + len], cnt);
 }
 
 // Unpack code lengths and create a histogram of lengths.
@@ -528,15 +1249,15 @@ uint UnpackCodeLengths(inout BitReader br, uint hlit, uint hdist, uint hclen, ui
     // Init decoder
     uint cnts = GetHistogram(19, len, 7, tid);
     dec.init(cnts, 7, tid);
-    g_lut.scatter(tid, len, dec.offset(len - 1), tid);
+    g_lut[TILE_SLOT].scatter(tid, len, dec.offset(len - 1), tid);
 
     uint32_t count = hlit + hdist;
     uint32_t baseOffset = 0;
     uint32_t lastlen = ~0;
 
     // Clear codelens array (4 bit lengths)
-    g_buf.clear(tid);
-    g_tmp[tid] = 0;
+    g_buf[TILE_SLOT].clear(tid);
+    g_tmp[TILE_SLOT][tid] = 0;
 
 #if SIMD_WIDTH < NUM_THREADS
     GroupMemoryBarrierWithGroupSync();
@@ -566,7 +1287,7 @@ uint UnpackCodeLengths(inout BitReader br, uint hlit, uint hdist, uint hclen, ui
         if (sym == 16)
             codelen = lane == ~0 ? lastlen : prevlen;
 
-        lastlen = broadcast(codelen, NUM_THREADS - 1, tid);
+        lastlen = broadcast(codelen, NUM_LANES - 1, tid);
 #if SIMD_WIDTH < NUM_THREADS
         GroupMemoryBarrierWithGroupSync();
 #endif
@@ -580,7 +1301,7 @@ uint UnpackCodeLengths(inout BitReader br, uint hlit, uint hdist, uint hclen, ui
 
         br.eat(len + xlen[idx], tid, baseOffset < count);
 
-        baseOffset = broadcast(baseOffset + n, NUM_THREADS - 1, tid);
+        baseOffset = broadcast(baseOffset + n, NUM_LANES - 1, tid);
 #if SIMD_WIDTH < NUM_THREADS
         GroupMemoryBarrierWithGroupSync();
 #endif
@@ -591,11 +1312,52 @@ uint UnpackCodeLengths(inout BitReader br, uint hlit, uint hdist, uint hclen, ui
     GroupMemoryBarrierWithGroupSync(); // Needed for HW with SIMD width < 16
 #endif
 
-    return g_tmp[tid];
+    return g_tmp[TILE_SLOT][tid];
+}
+
+// Copies a match a dword per thread, for matches that are long enough to take more than one
+// round of bytes. Each thread builds an aligned dword of the destination from the off bytes
+// before it, which repeat every off bytes. Distances below 4 repeat the pattern in registers,
+// longer ones read the dword from where its first byte falls in the pattern, and the start
+// of the pattern if it wraps within the dword. Only the dwords at either end are ORed in.
+void CopyLongMatch(uint32_t dst, uint32_t off, uint32_t len, uint tid)
+{
+    uint32_t end = dst + len;
+    uint32_t pattern = ReadOutputBytes(dst - off);
+
+    for (uint32_t word = (dst & ~3) + tid * 4; word < end; word += NUM_LANES * 4)
+    {
+        uint32_t first = max(word, dst);
+        uint32_t phase = (first - dst) % off;
+        uint32_t data;
+
+        if (off < 4)
+        {
+            data = 0;
+            [unroll] for (uint32_t b = 0; b < 4; b++)
+                data |= ((pattern >> (((phase + b) % off) * 8)) & 0xff) << (b * 8);
+        }
+        else
+        {
+            uint32_t head = min(off - phase, 4);
+            data = ReadOutputBytes(dst - off + phase);
+            if (head < 4)
+                data = (data & mask(head * 8)) | (pattern << (head * 8));
+        }
+
+        uint32_t lo = (first - word) * 8;
+        uint32_t hi = min(end - word, 4) * 8;
+        uint32_t byteMask = (hi == 32 ? 0xffffffff : mask(hi)) & ~mask(lo);
+        StoreWord(word, data << lo, byteMask);
+    }
 }
 
 void WriteOutput(uint32_t dst, uint32_t offset, uint32_t dist, uint32_t length, uint32_t byte, bool iscopy, uint tid)
 {
+#ifdef STAGED_OUTPUT
+    StageRound(dst, broadcast(offset + length, NUM_LANES - 1, tid), tid);
+#endif
+
     dst += offset;
     // Output literals
     if (!iscopy && length != 0)
@@ -625,15 +1387,32 @@ void WriteOutput(uint32_t dst, uint32_t offset, uint32_t dist, uint32_t length,
         uint32_t output = broadcast(dst, lane, tid);
 #endif
 
-        // Copy using all threads in the wave
-        for (uint32_t i = tid; i < len; i += NUM_THREADS)
+        // Copy using all threads in the wave. A transform moves the bytes of a dword apart, so
+        // dwords are only copied whole when there is none.
+#ifdef POST_TRANSFORM
+        bool wide = len > NUM_LANES && GetTransformKind() == kTransformNone;
+#else
+        bool wide = len > NUM_LANES;
+#endif
+        if (wide)
+        {
+            CopyLongMatch(output, off, len, tid);
+        }
+        else
         {
-            uint32_t data = ReadOutputByte(output + i % off - off);
-            StoreByte(i + output, data);
+            for (uint32_t i = tid; i < len; i += NUM_LANES)
+            {
+                uint32_t data = ReadOutputByte(output + i % off - off);
+                StoreByte(i + output, data);
+            }
         }
 
         mask &= mask - 1;
     }
+
+#ifdef STAGED_OUTPUT
+    FinishRound(tid);
+#endif
 }
 
 // Translate a symbol to its value
@@ -672,20 +1451,27 @@ uint TranslateSymbol(inout BitReader br, int sym, uint len, uint32_t bits, bool
     return base + ((bits >> len) & mask(n));
 }
 
-// Assumes code lengths have been stored in the shared memory array
-uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint tid)
+// Assumes code lengths have been stored in the shared memory array, unless fixedCodes is set
+uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint tid, bool fixedCodes)
 {
     // Init decoders
 #ifdef IN_REGISTER_DECODER
     DecoderPair dec;
 #endif
 
-    dec.init(counts, 15, tid);
-    g_lut.init(hlit, RVAL(dec.offsets, tid), tid);
+    if (!fixedCodes)
+    {
+        dec.init(counts, 15, tid);
+        g_lut[TILE_SLOT].init(hlit, RVAL(dec.offsets, tid), tid);
+    }
 
     // Initial round - no copy processing
     uint32_t len;
-    uint32_t sym = dec.decode(br.peek(15 + 16), len, false);
+    uint32_t sym;
+    if (fixedCodes)
+        sym = DecodeFixed(br.peek(15 + 16), len, false);
+    else
+        sym = dec.decode(br.peek(15 + 16), len, false);
 
     uint32_t eob = vote(sym == 256, tid);
     bool oob = (eob & ltMask(tid)) != 0;
@@ -704,7 +1490,10 @@ uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint
     // Translate all symbols in the block
     while (eob == 0)
     {
-        sym = dec.decode(br.peek(15 + 16), len, iscopy);
+        if (fixedCodes)
+            sym = DecodeFixed(br.peek(15 + 16), len, iscopy);
+        else
+            sym = dec.decode(br.peek(15 + 16), len, iscopy);
 
         // Set predicates based on the current symbol
         eob = vote(sym == 256, tid);    // end of block symbol
@@ -716,7 +1505,7 @@ uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint
         WriteOutput(dst, offset, value, length, byte, iscopy, tid);
 
         // Advance output pointers
-        dst += broadcast(offset + length, NUM_THREADS - 1, tid);
+        dst += broadcast(offset + length, NUM_LANES - 1, tid);
 #if SIMD_WIDTH < NUM_THREADS
         GroupMemoryBarrierWithGroupSync();
 #endif
@@ -729,12 +1518,15 @@ uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint
     }
 
     // One last round of copy processing
-    sym = dec.decode(br.peek(15 + 16), len, true);
+    if (fixedCodes)
+        sym = DecodeFixed(br.peek(15 + 16), len, true);
+    else
+        sym = dec.decode(br.peek(15 + 16), len, true);
     iscopy &= !oob;
     uint32_t dist = TranslateSymbol(br, sym, len, br.peek(), iscopy, tid, false);
     WriteOutput(dst, offset, dist, length, byte, iscopy, tid);
 
-    uint res = dst + broadcast(offset + length, NUM_THREADS - 1, tid); // Advance destination pointer
+    uint res = dst + broadcast(offset + length, NUM_LANES - 1, tid); // Advance destination pointer
 #if SIMD_WIDTH < NUM_THREADS
     GroupMemoryBarrierWithGroupSync(); // THIS BARRIER IS REQUIRED
 #endif
@@ -744,20 +1536,27 @@ uint CompressedBlock(inout BitReader br, uint hlit, uint counts, uint dst, uint
 // Uncompressed block (raw copy)
 uint32_t UncompressedBlock(inout BitReader br, uint32_t dst, uint32_t size, uint tid)
 {
-    uint32_t nrounds = size / NUM_THREADS;
+    uint32_t nrounds = size / NUM_LANES;
 
-    // Full rounds with no bounds checking
+    // Full rounds with no bounds checking. A round always fits the window once it has been
+    // staged, so it never needs FinishRound.
     while (nrounds--)
     {
+#ifdef STAGED_OUTPUT
+        StageRound(dst, NUM_LANES, tid);
+#endif
         StoreByte(dst + tid, br.read(8, tid, true));
-        dst += NUM_THREADS;
+        dst += NUM_LANES;
     }
 
-    uint32_t rem = size % NUM_THREADS;
+    uint32_t rem = size % NUM_LANES;
 
     // Last partial round with bounds check
     if (rem != 0)
     {
+#ifdef STAGED_OUTPUT
+        StageRound(dst, rem, tid);
+#endif
         uint32_t byte = br.read(8, tid, tid < rem);
         if (tid < rem)
             StoreByte(dst + tid, byte);
@@ -767,16 +1566,6 @@ uint32_t UncompressedBlock(inout BitReader br, uint32_t dst, uint32_t size, uint
     return dst;
 }
 
-// Initialize fixed code lengths, return a histogram
-uint FixedCodeLengths(uint tid)
-{
-    g_buf.data[tid] = tid < 18 ? 0x88888888 : 0x99999999;
-    g_buf.data[tid + 32] = tid < 3 ? 0x77777777 : (tid < 4 ? 0x88888888 : 0x55555555);
-
-    // Threads can be synchronized later..
-    return tid == 7 ? 24 : (tid == 8 ? 152 : (tid == 9 ? 112 : tid == 16 + 5 ? 32 : 0));
-}
-
 // This is main entry point for tile decompressor
 void DecompressTile(in TileParams params, uint tid)
 {
@@ -787,9 +1576,13 @@ void DecompressTile(in TileParams params, uint tid)
     bool done;
     uint32_t dst = params.outPos;
 
+#ifdef STAGED_OUTPUT
+    BeginStage(dst, tid);
+#else
     // Clear destination to 0
-    for (uint32_t i = tid; i < (params.outSize + 3) / 4; i += NUM_THREADS)
-        output.Store(dst + i * 4, 0);
+    for (uint32_t i = tid; i < (params.outSize + 3) / 4; i += NUM_LANES)
+        output.Store(FootprintAddress(dst + i * 4), 0); // A transform only moves bytes within the tile
+#endif
 
     // .. for each block
     do
@@ -816,17 +1609,18 @@ void DecompressTile(in TileParams params, uint tid)
             hdist = extract(header, 8, 5, 1);
             br.eat(14, tid, tid == 0);
             counts = UnpackCodeLengths(br, hlit, hdist, extract(header, 13, 4, 4), tid, dst);
-            // Falls through to the following case
-        case 1: // Fixed huffman block
-            if (btype == 1)
-                counts = FixedCodeLengths(tid);
+            dst = CompressedBlock(br, hlit, counts, dst, tid, false);
+            break;
 
-            dst = CompressedBlock(br, btype == 1 ? 288 : hlit, counts, dst, tid);
+        case 1: // Fixed huffman block, decoded without building tables
+            dst = CompressedBlock(br, 288, 0, dst, tid, true);
             break;
 
         case 0: // Uncompressed block
             size = broadcast(br.read(16, tid, tid == 0), 0, tid);
+#if SIMD_WIDTH < NUM_THREADS
             GroupMemoryBarrierWithGroupSync();
+#endif
             dst = UncompressedBlock(br, dst, size, tid);
             break;
 
@@ -834,6 +1628,199 @@ void DecompressTile(in TileParams params, uint tid)
         }
 
     } while (!done);
+
+#ifdef STAGED_OUTPUT
+    EndStage(params.outSize, tid);
+#endif
+}
+
+// Copies a tile that was stored as raw bytes
+void CopyStoredTile(in TileParams params, uint tid)
+{
+#ifdef POST_TRANSFORM
+    // Filtered bytes are scattered one at a time into the cleared tile
+    if (GetTransformKind() != kTransformNone)
+    {
+        for (uint32_t i = tid; i < (params.outSize + 3) / 4; i += NUM_LANES)
+            output.Store(FootprintAddress(params.outPos + i * 4), 0);
+#if SIMD_WIDTH < NUM_THREADS
+        DeviceMemoryBarrierWithGroupSync();
+#endif
+
+        for (uint32_t round = 0; round < params.outSize; round += NUM_LANES * 4)
+        {
+            uint32_t i = round + tid * 4;
+            uint32_t begin = params.inPos + round;
+            uint32_t keystream = GetKeystream(params.inPos + i, begin, begin + NUM_LANES * 4, tid);
+            if (i >= params.outSize)
+                continue;
+
+            uint32_t data = input.Load(params.inPos + i) ^ keystream;
+            [unroll] for (uint32_t b = 0; b < 4; b++)
+            {
+                if (i + b < params.outSize)
+                    StoreByte(params.outPos + i + b, data >> (b * 8));
+            }
+        }
+        return;
+    }
+#endif
+
+    // Every thread runs every round, GetKeystream needs all of them
+    for (uint32_t round = 0; round < params.outSize; round += NUM_LANES * 4)
+    {
+        uint32_t i = round + tid * 4;
+        uint32_t begin = params.inPos + round;
+        uint32_t keystream = GetKeystream(params.inPos + i, begin, begin + NUM_LANES * 4, tid);
+        if (i < params.outSize)
+            output.Store(OutputAddress(params.outPos + i), input.Load(params.inPos + i) ^ keystream);
+    }
+}
+
+#ifdef POST_TRANSFORM
+
+// Adds bytes lane by lane, without carries between them
+inline uint32_t AddBytes(uint32_t a, uint32_t b)
+{
+    return ((a & 0x7f7f7f7f) + (b & 0x7f7f7f7f)) ^ ((a ^ b) & 0x80808080);
+}
+
+// Prefix sum of the bytes of a dword for a delta stride of 1, 2 or 4 bytes
+inline uint32_t DeltaPrefix(uint32_t value, uint32_t stride)
+{
+    if (stride == 1)
+    {
+        value = AddBytes(value, value << 8);
+        value = AddBytes(value, value << 16);
+    }
+    else if (stride == 2)
+    {
+        value = AddBytes(value, value << 16);
+    }
+    return value;
+}
+
+// What a dword's prefix adds to every byte of the dwords that follow it
+inline uint32_t DeltaCarry(uint32_t prefix, uint32_t stride)
+{
+    if (stride == 1)
+        return (prefix >> 24) * 0x01010101;
+    if (stride == 2)
+        return (prefix >> 16) * 0x00010001;
+    return prefix;
+}
+
+// Undoes a byte-wise delta filter over the tile, out[i] += out[i - stride], once the tile
+// is in place. The running sum is carried across rounds of NUM_LANES dwords.
+void DeltaDecodeTile(uint stride, uint tid)
+{
+    uint32_t carry = 0;
+
+    for (uint32_t base = 0; base < s_tileSize; base += NUM_LANES * 4)
+    {
+        uint32_t offset = base + tid * 4;
+        uint32_t address = FootprintAddress(s_tileStart + offset);
+        uint32_t value = offset < s_tileSize ? output.Load(address) : 0;
+
+        uint32_t prefix = DeltaPrefix(value, stride);
+        uint32_t sum = DeltaCarry(prefix, stride);
+
+        // Inclusive scan of the carries
+        [unroll] for (uint i = 1; i < NUM_LANES; i *= 2)
+        {
+            uint32_t other = shuffle(sum, tid >= i ? tid - i : 0, tid);
+            if (tid >= i)
+                sum = AddBytes(sum, other);
+        }
+
+        uint32_t preceding = shuffle(sum, tid > 0 ? tid - 1 : 0, tid);
+        if (tid == 0)
+            preceding = 0;
+
+        if (offset < s_tileSize)
+            output.Store(address, AddBytes(prefix, AddBytes(preceding, carry)));
+
+        carry = AddBytes(carry, broadcast(sum, NUM_LANES - 1, tid));
+#if SIMD_WIDTH < NUM_THREADS
+        GroupMemoryBarrierWithGroupSync();
+#endif
+    }
+}
+
+#endif
+
+// Tile table cache. Groups claim the tiles of a stream in increasing order, so the entries of
+// the tiles a group takes next are usually close to the ones of the tile it has just decoded.
+// Each tile slot keeps a block of kTileTableCacheSize entries of the stream it's on, which the
+// tile's threads load with one coalesced load each when a claim falls outside of it, instead
+// of the two dependent loads of every tile that TileStream::GetTileParams makes.
+static const uint kTileTableCacheSize = 4 * NUM_LANES;
+
+groupshared uint32_t g_tileTable[NUM_TILES_PER_GROUP][kTileTableCacheSize];
+
+static uint s_tileTableStream = ~0u; // Stream whose entries are cached, by its index or queue sequence
+static uint s_tileTableFirst;        // Tile whose entry is first in the block
+static uint s_tileTableLast;         // Entry 0, for the last tile
+
+TileParams GetCachedTileParams(
+    in TileStream tileStream,
+    uint stream,
+    uint streamInPos,
+    uint streamOutPos,
+    uint tileIdx,
+    uint tid)
+{
+    const uint numTiles = tileStream.GetNumTiles();
+    const uint tileTablePos = tileStream.GetTileTablePos(streamInPos);
+
+    // The block holds the entries of tileIdx and the tile after it
+    if (stream != s_tileTableStream || tileIdx - s_tileTableFirst >= kTileTableCacheSize - 1)
+    {
+#if SIMD_WIDTH < NUM_THREADS
+        GroupMemoryBarrierWithGroupSync(); // Every thread is done with the previous block
+#endif
+        for (uint i = tid; i < kTileTableCacheSize; i += NUM_LANES)
+            g_tileTable[TILE_SLOT][i] = tileIdx + i < numTiles ? input.Load(tileTablePos + (tileIdx + i) * 4) : 0;
+
+        s_tileTableStream = stream;
+        s_tileTableFirst = tileIdx;
+        s_tileTableLast = input.Load(tileTablePos);
+#if SIMD_WIDTH < NUM_THREADS
+        GroupMemoryBarrierWithGroupSync();
+#endif
+    }
+
+    uint index = tileIdx - s_tileTableFirst;
+    uint entry = g_tileTable[TILE_SLOT][index];
+    uint nextEntry = tileIdx == numTiles - 1 ? s_tileTableLast : g_tileTable[TILE_SLOT][index + 1];
+
+    return tileStream.GetTileParams(streamInPos, streamOutPos, tileIdx, entry, nextEntry);
+}
+
+// Called before a tile is decoded
+void BeginTile(in TileParams params)
+{
+#ifdef POST_TRANSFORM
+    s_tileStart = params.outPos;
+    s_tileSize = params.outSize;
+#endif
+}
+
+// Called once a tile has been decoded, while it is still hot in the cache
+void EndTile(uint tid)
+{
+#ifdef POST_TRANSFORM
+    uint stride = GetDeltaStride();
+    if (stride != 0)
+    {
+#if SIMD_WIDTH < NUM_THREADS
+        DeviceMemoryBarrierWithGroupSync();
+#else
+        DeviceMemoryBarrier();
+#endif
+        DeltaDecodeTile(stride, tid);
+    }
+#endif
 }
 
 groupshared uint g_bcst;
@@ -845,7 +1832,7 @@ void CopyUncompressedTile(uint tid, uint streamInPos, uint streamOutPos, uint to
     uint inTileStart = streamInPos + streamOffset;
     uint outTileStart = streamOutPos + streamOffset;
 
-    for (uint i = 0; i < kDefaultTileSize; i += sizeof(uint) * NUM_THREADS)
+    for (uint i = 0; i < kDefaultTileSize; i += sizeof(uint) * NUM_LANES)
     {
         uint offset = i + (sizeof(uint) * tid);
 
@@ -854,7 +1841,7 @@ void CopyUncompressedTile(uint tid, uint streamInPos, uint streamOutPos, uint to
             uint inPos = inTileStart + offset;
             uint outPos = outTileStart + offset;
 
-            output.Store(outPos, input.Load(inPos));
+            output.Store(OutputAddress(outPos), input.Load(inPos));
         }
     }
 }
@@ -873,7 +1860,7 @@ void CopyUncompressedStream(uint tid, uint streamIdx, uint streamInPos, uint str
         // Leader grabs the tile index
         if (tid == 0)
         {
-            scratch.InterlockedAdd(ScratchStreamTileIndexOffset(streamIdx), 1u, tileIdx);
+            tileIdx = ClaimStreamTile(streamIdx);
         }
 
         // Broadcast tile index
@@ -889,11 +1876,175 @@ void CopyUncompressedStream(uint tid, uint streamIdx, uint streamInPos, uint str
     }
 }
 
+#ifdef PERSISTENT_THREADS
+
+// Persistent mode control buffer format:
+//   cursor (stream sequence:12, tile index:20), tail, quit, capacity, padding[4],
+//   capacity x [inPos, outPos, tilesDone, padding]
+// The host appends a stream by writing the entry at slot (tail % capacity) and then
+// incrementing tail. A slot may be reused once the cursor has moved past its stream and
+// tilesDone has reached the stream's tile count. Groups claim tiles by incrementing the
+// cursor, and move it to the next stream with a CAS once every tile of the current one
+// has been claimed. Keeping the stream and the tile index in one word means a late
+// increment can never claim a tile of a retired stream.
+static const uint kQueueCursorOffset = 0;
+static const uint kQueueTailOffset = 4;
+static const uint kQueueQuitOffset = 8;
+static const uint kQueueCapacityOffset = 12;
+static const uint kQueueEntriesOffset = 32;
+static const uint kQueueEntrySize = 16;
+static const uint kQueueTileBits = 20;
+static const uint kQueueSequenceMask = 0xfff; // Capacity must be a power of two between 2 and 1024
+
+static const uint kQueueWork = 0;
+static const uint kQueueRetry = 1;
+static const uint kQueueQuit = 2;
+
+uint AtomicLoad(uint offset)
+{
+    uint value;
+    control.InterlockedOr(offset, 0, value);
+    return value;
+}
+
+uint QueueEntryOffset(uint sequence, uint capacity)
+{
+    return kQueueEntriesOffset + (sequence % capacity) * kQueueEntrySize;
+}
+
+bool IsPublished(uint sequence, uint capacity)
+{
+    uint pending = (AtomicLoad(kQueueTailOffset) - sequence) & kQueueSequenceMask;
+    return pending != 0 && pending <= capacity;
+}
+
+uint GetQueuedNumTiles(uint sequence, uint capacity)
+{
+    return TileStream::construct(control.Load(QueueEntryOffset(sequence, capacity))).GetNumTiles();
+}
+
+// Run by the leader, returns kQueueWork with the claimed stream and tile
+uint ClaimQueuedTile(uint capacity, out uint sequence, out uint tileIdx)
+{
+    uint cursor = AtomicLoad(kQueueCursorOffset);
+    sequence = cursor >> kQueueTileBits;
+    tileIdx = cursor & mask(kQueueTileBits);
+
+    // The cursor only ever moves to published streams, so this only waits for the first one
+    if (!IsPublished(sequence, capacity))
+        return AtomicLoad(kQueueQuitOffset) != 0 ? kQueueQuit : kQueueRetry;
+
+    uint numTiles = GetQueuedNumTiles(sequence, capacity);
+    if (tileIdx < numTiles)
+    {
+        control.InterlockedAdd(kQueueCursorOffset, 1, cursor);
+
+        // Another group may have moved the cursor on, in which case the claim is for its stream
+        uint claimedSequence = cursor >> kQueueTileBits;
+        if (claimedSequence != sequence)
+            numTiles = GetQueuedNumTiles(claimedSequence, capacity);
+
+        sequence = claimedSequence;
+        tileIdx = cursor & mask(kQueueTileBits);
+        return tileIdx < numTiles ? kQueueWork : kQueueRetry;
+    }
+
+    // Every tile of the current stream is claimed, move on once the next one is published
+    uint nextSequence = (sequence + 1) & kQueueSequenceMask;
+    if (IsPublished(nextSequence, capacity))
+    {
+        uint prevCursor;
+        control.InterlockedCompareExchange(kQueueCursorOffset, cursor, nextSequence << kQueueTileBits, prevCursor);
+        return kQueueRetry;
+    }
+
+    return AtomicLoad(kQueueQuitOffset) != 0 ? kQueueQuit : kQueueRetry;
+}
+
+// Main entry point for persistent mode - the groups stay resident and decode streams as
+// the host queues them, until the host sets the quit flag and every tile has been claimed
+[numthreads(NUM_THREADS, 1, 1)] 
+void CSMain(uint groupThreadId : SV_GroupThreadID)
+{
+    uint tid = groupThreadId % NUM_LANES;
+#if NUM_TILES_PER_GROUP > 1
+    s_tileSlot = groupThreadId / NUM_LANES;
+#endif
+
+    const uint capacity = control.Load(kQueueCapacityOffset);
+
+    [allow_uav_condition] while (true)
+    {
+        uint state = kQueueRetry;
+        uint sequence = 0;
+        uint tileIdx = 0;
+
+        // Leader claims the next tile
+        if (tid == 0)
+            state = ClaimQueuedTile(capacity, sequence, tileIdx);
+
+        // Broadcast the claim from leader
+        state = broadcast(state, 0, tid);
+        sequence = broadcast(sequence, 0, tid);
+        tileIdx = broadcast(tileIdx, 0, tid);
+#if SIMD_WIDTH < NUM_THREADS
+        GroupMemoryBarrierWithGroupSync();
+#endif
+        if (state == kQueueQuit)
+            break;
+
+        // Sequences wrap, a group that waited may find a new stream under the one it has cached
+        if (state != kQueueWork)
+        {
+            s_tileTableStream = ~0u;
+            continue;
+        }
+
+        uint entryOffset = QueueEntryOffset(sequence, capacity);
+        const uint streamInPos = control.Load(entryOffset);
+        const uint streamOutPos = control.Load(entryOffset + 4);
+        const TileStream tileStream = TileStream::construct(streamInPos);
+
+        TileParams params = GetCachedTileParams(tileStream, sequence, streamInPos, streamOutPos, tileIdx, tid);
+
+        if (tileStream.IsStoredTile(params))
+            CopyStoredTile(params, tid);
+        else
+            DecompressTile(params, tid);
+
+        // Count the tile as done so that the host can tell when the stream is complete
+        DeviceMemoryBarrier();
+        if (tid == 0)
+            control.InterlockedAdd(entryOffset + 8, 1);
+
+#if SIMD_WIDTH < NUM_THREADS
+        GroupMemoryBarrierWithGroupSync();
+#endif
+    }
+}
+
+#else
+
 // Main entry point - each thread group processes a page/tile and uses a work
-// stealing scheme such that it runs until all streams have been decompressed
+// stealing scheme such that it runs until all streams have been decompressed.
+// When a group holds two tiles, each half elects its own leader and runs this
+// loop on its own.
 [numthreads(NUM_THREADS, 1, 1)] 
-void CSMain(uint tid : SV_GroupThreadID)
+void CSMain(uint groupThreadId : SV_GroupThreadID, uint groupId : SV_GroupID)
 {
+    uint tid = groupThreadId % NUM_LANES;
+#if NUM_TILES_PER_GROUP > 1
+    s_tileSlot = groupThreadId / NUM_LANES;
+#endif
+
+#ifdef PROFILE
+    uint profileStart = 0;
+    uint profileTiles = 0;
+    uint profileBytes = 0;
+    if (tid == 0)
+        profileStart = TakeProfileTicket();
+#endif
+
     // Read the control buffer to determine how many streams are left
     // for decompressing.
     int numStreamsLeft = 0;
@@ -912,9 +2063,20 @@ void CSMain(uint tid : SV_GroupThreadID)
         // access the tiles.
         uint streamIdx = numStreamsLeft - 1;
         const uint streamInPos = control.Load(ControlStreamInOffset(streamIdx));
-        uint streamOutPos = control.Load(ControlStreamOutOffset(streamIdx));
+        uint streamOutPos = BeginOutputStream(streamIdx, control.Load(ControlStreamOutOffset(streamIdx)));
         const TileStream tileStream = TileStream::construct(streamInPos);
 
+#ifdef TILE_RANGE
+        // Tile positions are computed for the whole stream, this moves the range's first tile
+        // to outPos. The subtraction wraps, and adding the tile's offset back undoes it.
+#ifndef TEXTURE_OUTPUT
+        streamOutPos -= s_rangeFirstTile * tileStream.GetTileSize();
+#endif
+        const uint endTile = min(s_rangeFirstTile + s_rangeNumTiles, tileStream.GetNumTiles());
+#else
+        const uint endTile = tileStream.GetNumTiles();
+#endif
+
         // Grab a tile and decompress it until no tiles remain
         [allow_uav_condition] while (true)
         {
@@ -923,7 +2085,10 @@ void CSMain(uint tid : SV_GroupThreadID)
             // Leader grabs the tile index
             if (tid == 0)
             {
-                scratch.InterlockedAdd(ScratchStreamTileIndexOffset(streamIdx), 1u, tileIdx);
+                tileIdx = ClaimStreamTile(streamIdx);
+#ifdef TILE_RANGE
+                tileIdx += s_rangeFirstTile;
+#endif
             }
 
             // Broadcast tile index from leader
@@ -931,11 +2096,23 @@ void CSMain(uint tid : SV_GroupThreadID)
 #if SIMD_WIDTH < NUM_THREADS
             GroupMemoryBarrierWithGroupSync();
 #endif
-            if (tileIdx >= tileStream.GetNumTiles())
+            if (tileIdx >= endTile)
                 break;
 
-            TileParams params = tileStream.GetTileParams(streamInPos, streamOutPos, tileIdx);
-            DecompressTile(params, tid);
+            TileParams params = GetCachedTileParams(tileStream, streamIdx, streamInPos, streamOutPos, tileIdx, tid);
+            BeginTile(params);
+
+            if (tileStream.IsStoredTile(params))
+                CopyStoredTile(params, tid);
+            else
+                DecompressTile(params, tid);
+
+            EndTile(tid);
+
+#ifdef PROFILE
+            profileTiles++;
+            profileBytes += params.outSize;
+#endif
         }
 
         // First thread in a partition does the CAS
@@ -957,4 +2134,14 @@ void CSMain(uint tid : SV_GroupThreadID)
         GroupMemoryBarrierWithGroupSync();
 #endif
     }
+
+#ifdef PROFILE
+    if (tid == 0)
+    {
+        uint profileEnd = TakeProfileTicket();
+        profile.Store4(ProfileRecordOffset(groupId), uint4(profileStart, profileEnd, profileTiles, profileBytes));
+    }
+#endif
 }
+
+#endif
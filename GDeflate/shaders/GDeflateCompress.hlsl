@@ -0,0 +1,393 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+// Compresses 64KB tiles into GDeflate, for content that is generated on the GPU and would
+// otherwise have to be read back to be compressed. This is the fast end of the format:
+// matches are found greedily and coded with the fixed Huffman codes in a single block, so
+// the output is larger than the CPU compressor's, but GDeflate.hlsl and the CPU decoder read
+// it like any other tile.
+//
+// Each group compresses one tile at a time with one thread per bitstream. A thread parses
+// its own 1/32 of the tile, so its matches only reach back into that slice. The symbols are
+// then handed out in the order that GDeflate.hlsl decodes them: every round, each thread
+// that isn't decoding the distance of the match it took in the round before takes the next
+// symbol. The bitstreams are interleaved in 32-bit words, and each word goes where the
+// decoder's BitReader will fetch it, which the threads work out by running its refills.
+// A tile that doesn't shrink is stored, see TileStream::storedTiles.
+//
+// Dispatched with up to one group per tile, each group moving on by the number of groups.
+
+//#define USE_WAVE_INTRINSICS // Enable on machines with WaveOps support and waves of at least 32 lanes
+
+#define NUM_BITSTREAMS 32        // GDeflate interleaves 32 compressed bitstreams
+#define NUM_LANES NUM_BITSTREAMS // Each tile is compressed by one thread per bitstream
+
+ByteAddressBuffer input : register(t0);
+RWByteAddressBuffer control : register(u0);
+RWByteAddressBuffer output : register(u1);
+RWByteAddressBuffer scratch : register(u2);
+// Control buffer format: numTiles, [tile0 inPos, tile0 size, tile0 compressed size], ...
+// The compressed size is written by the kernel, and tile i is written at i * kTileSize in
+// the output buffer. Matching reads up to 7 bytes past the end of the input, so the host
+// pads the input buffer by that much.
+//
+// Scratch buffer format: kTileSize symbols per group, each thread's from where its slice of
+// the tile begins. A literal is its byte, a match is length:16, distance - 1:16.
+
+cbuffer CompressConstants : register(b0)
+{
+    uint g_numGroups;
+};
+
+static const uint kTileSize = 64 * 1024;
+static const uint kMinMatchLength = 3;
+static const uint kMaxMatchLength = 258;
+
+// Each thread has a table of 1 << kHashBits 16-bit entries, two to a word, that hold the
+// position + 1 in the thread's slice of the last 3 bytes with that hash
+static const uint kHashBits = 8;
+static const uint kHashWords = (1 << kHashBits) / 2;
+
+groupshared uint g_hashTable[kHashWords * NUM_LANES];
+groupshared uint g_symbolStart[NUM_LANES]; // The index in the tile of each thread's first symbol
+#ifndef USE_WAVE_INTRINSICS
+groupshared uint g_ballot;
+#endif
+
+uint ltMask(uint tid)
+{
+    return (1u << tid) - 1;
+}
+
+uint vote(bool p, uint tid)
+{
+#ifdef USE_WAVE_INTRINSICS
+    return WaveActiveBallot(p).x;
+#else
+    if (tid == 0)
+        g_ballot = 0;
+    GroupMemoryBarrierWithGroupSync();
+
+    if (p)
+        InterlockedOr(g_ballot, 1u << tid);
+    GroupMemoryBarrierWithGroupSync();
+
+    uint ballot = g_ballot;
+    GroupMemoryBarrierWithGroupSync();
+    return ballot;
+#endif
+}
+
+// Returns the 4 bytes at address, which needn't be aligned
+uint LoadInput(uint address)
+{
+    uint shift = (address & 3) * 8;
+    uint2 words = input.Load2(address & ~3);
+    return shift == 0 ? words.x : (words.x >> shift) | (words.y << (32 - shift));
+}
+
+// Counts the bytes, up to maxLength, that match between the earlier position a and b
+uint MatchLength(uint a, uint b, uint maxLength)
+{
+    for (uint length = 0; length < maxLength; length += 4)
+    {
+        uint diff = LoadInput(a + length) ^ LoadInput(b + length);
+        if (diff != 0)
+            return min(length + firstbitlow(diff) / 8, maxLength);
+    }
+    return maxLength;
+}
+
+// Parses the slice [begin, end) of the tile into literals and matches, written to the scratch
+// buffer at symbolsPos, and returns how many there are. Matches never cross the end.
+uint ParseSlice(uint inPos, uint begin, uint end, uint symbolsPos, uint tid)
+{
+    for (uint i = 0; i < kHashWords; ++i)
+        g_hashTable[i * NUM_LANES + tid] = 0;
+
+    uint numSymbols = 0;
+    uint pos = begin;
+    while (pos < end)
+    {
+        uint maxLength = min(kMaxMatchLength, end - pos);
+        uint bytes = LoadInput(inPos + pos);
+
+        uint length = 0;
+        uint distance = 0;
+        if (maxLength >= kMinMatchLength)
+        {
+            uint hash = ((bytes & 0xffffff) * 2654435761u) >> (32 - kHashBits);
+            uint word = (hash >> 1) * NUM_LANES + tid;
+            uint shift = (hash & 1) * 16;
+
+            uint entries = g_hashTable[word];
+            uint candidate = (entries >> shift) & 0xffff;
+            g_hashTable[word] = (entries & ~(0xffffu << shift)) | ((pos - begin + 1) << shift);
+
+            // Slices are far shorter than the 32KB window, so every candidate is in reach
+            if (candidate != 0)
+            {
+                candidate += begin - 1;
+                distance = pos - candidate;
+                length = MatchLength(inPos + candidate, inPos + pos, maxLength);
+            }
+        }
+
+        uint symbol;
+        if (length >= kMinMatchLength)
+        {
+            symbol = (length << 16) | (distance - 1);
+            pos += length;
+        }
+        else
+        {
+            symbol = bytes & 0xff;
+            pos += 1;
+        }
+
+        scratch.Store(symbolsPos + (begin + numSymbols) * 4, symbol);
+        ++numSymbols;
+    }
+
+    return numSymbols;
+}
+
+// Returns the symbol at index in the tile, from the slice that holds it
+uint LoadSymbol(uint index, uint sliceSize, uint symbolsPos)
+{
+    uint slice = 0;
+    for (uint step = NUM_LANES / 2; step > 0; step >>= 1)
+    {
+        if (g_symbolStart[slice + step] <= index)
+            slice += step;
+    }
+
+    return scratch.Load(symbolsPos + (slice * sliceSize + index - g_symbolStart[slice]) * 4);
+}
+
+// Returns the fixed Huffman code of a literal/length symbol (RFC 1951, 3.2.6), reversed for
+// the LSB first bitstream, and its length
+uint2 LiteralLengthCode(uint sym)
+{
+    uint code;
+    uint len;
+    if (sym < 144)
+    {
+        code = 0x30 + sym;
+        len = 8;
+    }
+    else if (sym < 256)
+    {
+        code = 0x190 + sym - 144;
+        len = 9;
+    }
+    else if (sym < 280)
+    {
+        code = sym - 256;
+        len = 7;
+    }
+    else
+    {
+        code = 0xc0 + sym - 280;
+        len = 8;
+    }
+
+    return uint2(reversebits(code) >> (32 - len), len);
+}
+
+// Returns the code of a match length and its extra bits. 258 takes symbol 284 with all of its
+// extra bits set, because GDeflate follows Deflate64 and gives 285 a 16-bit length.
+uint2 LengthCode(uint length)
+{
+    uint v = length - 3;
+    uint n = v < 8 ? 0 : firstbithigh(v) - 2;
+    uint2 code = LiteralLengthCode(257 + 4 * n + (v >> n));
+    return uint2(code.x | ((v & ((1u << n) - 1)) << code.y), code.y + n);
+}
+
+// Returns the code of a match distance and its extra bits. The fixed distance codes are 5 bits.
+uint2 DistanceCode(uint distance)
+{
+    uint v = distance - 1;
+    uint n = v < 4 ? 0 : firstbithigh(v) - 1;
+    uint code = 2 * n + (v >> n);
+    return uint2((reversebits(code) >> 27) | ((v & ((1u << n) - 1)) << 5), 5 + n);
+}
+
+// The writing side of BitReader in GDeflate.hlsl. Every put matches an eat of the decoder,
+// and takes the next word slot of the tile wherever the refill after that eat would load a
+// word. A word is stored when its 32 bits are written, by which time it always has a slot.
+struct BitWriter
+{
+    uint outPos, base, cnt;
+    uint64_t buf;
+    uint bufBits;
+    uint slot, nextSlot, numSlots;
+
+    void init(uint pos, uint tid)
+    {
+        outPos = pos;
+        base = NUM_LANES;
+        cnt = 32;
+        buf = 0;
+        bufBits = 0;
+        slot = tid;
+        nextSlot = 0;
+        numSlots = 1;
+    }
+
+    // Words past the end of the tile are dropped, the tile is stored instead
+    void store(uint index, uint word)
+    {
+        if (index * 4 < kTileSize)
+            output.Store(outPos + index * 4, word);
+    }
+
+    // Append n bits to the bitstream, in the threads where p is set
+    void put(uint bits, uint n, bool p, uint tid)
+    {
+        if (p)
+        {
+            buf |= (uint64_t)bits << bufBits;
+            bufBits += n;
+            cnt -= n;
+        }
+
+        p = p && cnt < 32;
+        uint ballot = vote(p, tid);
+        if (p)
+        {
+            nextSlot = base + countbits(ballot & ltMask(tid));
+            numSlots++;
+            cnt += 32;
+        }
+        base += countbits(ballot);
+
+        if (bufBits >= 32)
+        {
+            store(slot, (uint)buf);
+            buf >>= 32;
+            bufBits -= 32;
+            slot = nextSlot;
+            numSlots--;
+        }
+    }
+
+    // Store the last bits, and zeros in any slot that the decoder loads before it's done
+    void flush()
+    {
+        if (numSlots > 0)
+            store(slot, (uint)buf);
+        if (numSlots > 1)
+            store(nextSlot, 0);
+    }
+};
+
+// Codes the tile's symbols in one fixed Huffman block and returns its compressed size
+uint EncodeBlock(uint outPos, uint numSymbols, uint sliceSize, uint symbolsPos, uint tid)
+{
+    BitWriter bw;
+    bw.init(outPos, tid);
+
+    // BFINAL and BTYPE = 1, read by the first thread
+    bw.put(3, 3, tid == 0, tid);
+
+    uint next = 0;
+    bool iscopy = false;
+    uint2 dist = 0;
+    bool done = false;
+
+    while (!done)
+    {
+        // A thread that took a match in the last round writes its distance in this one
+        uint freeLanes = vote(!iscopy, tid);
+        uint index = next + countbits(freeLanes & ltMask(tid));
+        bool take = !iscopy && index <= numSymbols;
+
+        uint2 code = dist;
+        bool copy = false;
+        if (take && index == numSymbols)
+        {
+            code = LiteralLengthCode(256); // End of block, the threads after this one take nothing
+        }
+        else if (take)
+        {
+            uint symbol = LoadSymbol(index, sliceSize, symbolsPos);
+            if (symbol < 256)
+            {
+                code = LiteralLengthCode(symbol);
+            }
+            else
+            {
+                code = LengthCode(symbol >> 16);
+                dist = DistanceCode((symbol & 0xffff) + 1);
+                copy = true;
+            }
+        }
+
+        bw.put(code.x, code.y, iscopy || take, tid);
+
+        next += countbits(freeLanes);
+        done = next > numSymbols;
+        iscopy = copy;
+    }
+
+    // The distances of the matches taken in the round with the end of block
+    bw.put(dist.x, dist.y, iscopy, tid);
+    bw.flush();
+
+    return bw.base * 4;
+}
+
+[numthreads(NUM_LANES, 1, 1)]
+void CSMain(uint tid : SV_GroupThreadID, uint3 groupId : SV_GroupID)
+{
+    uint numTiles = control.Load(0);
+    uint symbolsPos = groupId.x * kTileSize * 4;
+
+    for (uint tile = groupId.x; tile < numTiles; tile += g_numGroups)
+    {
+        uint entry = 4 + tile * 12;
+        uint inPos = control.Load(entry);
+        uint size = control.Load(entry + 4);
+        uint outPos = tile * kTileSize;
+
+        uint sliceSize = (size + NUM_LANES - 1) / NUM_LANES;
+        uint begin = min(tid * sliceSize, size);
+        uint end = min(begin + sliceSize, size);
+
+        g_symbolStart[tid] = ParseSlice(inPos, begin, end, symbolsPos, tid);
+        AllMemoryBarrierWithGroupSync();
+
+        // Exclusive prefix sum of the symbol counts, in place
+        uint start = 0;
+        for (uint i = 0; i < tid; ++i)
+            start += g_symbolStart[i];
+        uint numSymbols = start;
+        for (uint j = tid; j < NUM_LANES; ++j)
+            numSymbols += g_symbolStart[j];
+        GroupMemoryBarrierWithGroupSync();
+
+        g_symbolStart[tid] = start;
+        GroupMemoryBarrierWithGroupSync();
+
+        uint compressedSize = EncodeBlock(outPos, numSymbols, sliceSize, symbolsPos, tid);
+
+        // A compressed tile must come out smaller than its input, otherwise it is stored
+        if (compressedSize >= size)
+        {
+            DeviceMemoryBarrierWithGroupSync();
+            for (uint offset = tid * 4; offset < size; offset += NUM_LANES * 4)
+                output.Store(outPos + offset, input.Load(inPos + offset));
+            compressedSize = size;
+        }
+
+        if (tid == 0)
+            control.Store(entry + 8, compressedSize);
+
+        // The next tile reuses the scratch symbols and the groupshared tables
+        AllMemoryBarrierWithGroupSync();
+    }
+}
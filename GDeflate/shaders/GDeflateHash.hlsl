@@ -0,0 +1,86 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) Microsoft Corporation. All rights reserved.
+ * SPDX-License-Identifier: MIT
+ */
+
+// Hashes the streams that GDeflate.hlsl decompressed, so that its output can be checked
+// without reading it back. The hash matches ComputeContentHash in GDeflateDemo/CompressedFile.h:
+// every dword of the zero padded content is mixed with its index and the mixes are summed,
+// which lets the groups add up their parts of a stream in any order.
+//
+// Dispatched with one group per 64KB chunk of the largest stream in x and one per stream in y.
+
+ByteAddressBuffer output : register(t0);
+RWByteAddressBuffer control : register(u0);
+// The control buffer's stream entries are followed by a hash entry per stream, at the
+// offset passed as a root constant: [outPos, size, sumA, sumB]. The sums start at zero and
+// are added to by every group that covers part of the stream. The decoder has counted
+// numStreams down to zero by now, and orders its stream entries by tile count, so neither is used.
+
+cbuffer HashConstants : register(b0)
+{
+    uint g_hashEntryOffset;
+};
+
+#define HASH_THREADS 256
+#define HASH_CHUNK_SIZE 65536
+
+uint Mix(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+groupshared uint g_sumA;
+groupshared uint g_sumB;
+
+[numthreads(HASH_THREADS, 1, 1)]
+void CSMain(uint3 groupId : SV_GroupID, uint threadIdx : SV_GroupIndex)
+{
+    uint entry = g_hashEntryOffset + groupId.y * 16;
+    uint outPos = control.Load(entry);
+    uint size = control.Load(entry + 4);
+
+    // The whole group leaves together, before any barrier
+    uint chunkStart = groupId.x * HASH_CHUNK_SIZE;
+    if (chunkStart >= size)
+        return;
+
+    if (threadIdx == 0)
+    {
+        g_sumA = 0;
+        g_sumB = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    uint chunkEnd = min(chunkStart + HASH_CHUNK_SIZE, size);
+    uint sumA = 0;
+    uint sumB = 0;
+    for (uint offset = chunkStart + threadIdx * 4; offset < chunkEnd; offset += HASH_THREADS * 4)
+    {
+        // Output offsets are dword aligned, the bytes past the end of the stream are masked off
+        uint word = output.Load(outPos + offset);
+        uint remaining = chunkEnd - offset;
+        if (remaining < 4)
+            word &= (1u << (remaining * 8)) - 1;
+
+        uint index = offset / 4;
+        uint a = Mix(word + index * 0x9e3779b9u);
+        sumA += a;
+        sumB += Mix(a ^ index ^ 0x85ebca6bu);
+    }
+
+    InterlockedAdd(g_sumA, sumA);
+    InterlockedAdd(g_sumB, sumB);
+    GroupMemoryBarrierWithGroupSync();
+
+    if (threadIdx == 0)
+    {
+        control.InterlockedAdd(entry + 8, g_sumA);
+        control.InterlockedAdd(entry + 12, g_sumB);
+    }
+}
@@ -21,6 +21,9 @@
 static const uint32_t kDefaultTileSize = 64 * 1024;
 static const uint32_t kStreamHeaderSize = 8;
 
+// This should match TileStream::kTileSizes in TileStream.h (index 2 is reserved)
+static const uint32_t kTileSizes[4] = {32 * 1024, 64 * 1024, 0, 16 * 1024};
+
 struct TileParams
 {
     uint32_t inPos;
@@ -34,9 +37,12 @@ struct TileParams
 // uint8_t id;
 // uint8_t magic;
 // uint16_t numTiles;
-// uint32_t reserved0 : 2;
+// uint32_t tileSizeIdx : 2;
 // uint32_t lastTileSize : 18;
-// uint32_t reserved1 : 12;
+// uint32_t storedTiles : 1;
+// uint32_t checksums : 1;
+// uint32_t dictionaryId : 8;
+// uint32_t reserved1 : 2;
 
 static uint32_t TileStream_GetField(uint32_t value, uint32_t bitsOffset, uint32_t bitsLength)
 {
@@ -66,6 +72,11 @@ struct TileStream
         return m_numTiles;
     }
 
+    uint32_t GetTileSize()
+    {
+        return kTileSizes[TileStream_GetField(m_word2, 0, 2)];
+    }
+
     uint32_t GetLastTileSizeField()
     {
         return TileStream_GetField(m_word2, 2, 18);
@@ -74,26 +85,63 @@ struct TileStream
     uint32_t GetLastTileSize()
     {
         uint32_t lastTileSize = GetLastTileSizeField();
-        return lastTileSize > 0 ? lastTileSize : kDefaultTileSize;
+        return lastTileSize > 0 ? lastTileSize : GetTileSize();
+    }
+
+    bool HasStoredTiles()
+    {
+        return TileStream_GetField(m_word2, 20, 1) != 0;
+    }
+
+    // Tile checksums aren't verified here; VerifyStream on the CPU checks them before upload.
+    bool HasChecksums()
+    {
+        return TileStream_GetField(m_word2, 21, 1) != 0;
+    }
+
+    // Stored tiles hold raw bytes; compressed tiles in such streams are always smaller.
+    bool IsStoredTile(in TileParams params)
+    {
+        return HasStoredTiles() && params.inSize == params.outSize;
+    }
+
+    uint32_t GetTileTablePos(uint32_t streamInPos)
+    {
+        return streamInPos + kStreamHeaderSize;
     }
 
     TileParams GetTileParams(uint32_t streamInPos, uint32_t streamOutPos, uint32_t tileIdx)
+    {
+        const uint32_t tileTablePos = GetTileTablePos(streamInPos);
+
+        uint32_t entry = tileIdx > 0 ? input.Load(tileTablePos + tileIdx * 4) : 0;
+        uint32_t nextEntry = input.Load(tileTablePos + (tileIdx == m_numTiles - 1 ? 0 : (tileIdx + 1) * 4));
+
+        return GetTileParams(streamInPos, streamOutPos, tileIdx, entry, nextEntry);
+    }
+
+    // Builds the parameters of a tile from its tile table entry and the next one, which is
+    // entry 0 for the last tile. The entry of tile 0 is taken to be 0.
+    TileParams GetTileParams(
+        uint32_t streamInPos,
+        uint32_t streamOutPos,
+        uint32_t tileIdx,
+        uint32_t entry,
+        uint32_t nextEntry)
     {
         TileParams params;
 
-        const uint32_t tileTablePos = streamInPos + kStreamHeaderSize;
+        const uint32_t tileTablePos = GetTileTablePos(streamInPos);
 
-        params.inPos = (tileIdx > 0 ? input.Load(tileTablePos + tileIdx * 4) : 0);
+        params.inPos = tileIdx > 0 ? entry : 0;
+        params.inSize = tileIdx == m_numTiles - 1 ? nextEntry : nextEntry - params.inPos;
 
-        if (tileIdx == m_numTiles - 1)
-            params.inSize = input.Load(tileTablePos);
-        else
-            params.inSize = input.Load(tileTablePos + (tileIdx + 1) * 4) - params.inPos;
+        const uint32_t tileSize = GetTileSize();
 
-        params.outPos = streamOutPos + tileIdx * kDefaultTileSize;
-        params.outSize = tileIdx < m_numTiles - 1 ? kDefaultTileSize : GetLastTileSize();
+        params.outPos = streamOutPos + tileIdx * tileSize;
+        params.outSize = tileIdx < m_numTiles - 1 ? tileSize : GetLastTileSize();
 
-        const uint32_t streamDataStartPos = tileTablePos + m_numTiles * 4;
+        const uint32_t streamDataStartPos = tileTablePos + m_numTiles * 4 * (HasChecksums() ? 2 : 1);
         params.inPos += streamDataStartPos;
 
         return params;
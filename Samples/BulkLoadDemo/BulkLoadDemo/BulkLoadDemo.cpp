@@ -11,6 +11,9 @@
 
 #include "CpuPerformance.h"
 #include "DStorageLoader.h"
+#include "DStorageTextureLoader.h"
+#include "DeferredReleaseQueue.h"
+#include "LoadTelemetry.h"
 #include "MarcFile.h"
 #include "MarcFileManager.h"
 
@@ -18,16 +21,53 @@
 #include <FXAA.h>
 #include <GameCore.h>
 #include <GameInput.h>
+#include <InstanceBatch.h>
+#include <MeshConstantsPool.h>
+#include <ModelLoader.h>
 #include <PostEffects.h>
 #include <Renderer.h>
 #include <SSAO.h>
 #include <ShadowCamera.h>
 
+#include <algorithm>
+#include <execution>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <optional>
 #include <random>
 
 using namespace Math;
 
+namespace
+{
+    // When set, each model is shown as soon as it has loaded, rather than
+    // once the whole set has loaded.
+    BoolVar ProgressiveShow("DirectStorage/Progressive Show", false);
+
+    // When set, the models of a set that has finished loading are drawn with
+    // ExecuteIndirect and culled on the GPU, rather than each of their meshes
+    // being sorted on the CPU every frame.  Takes effect from the next set.
+    BoolVar GpuDrivenInstances("Renderer/GPU-Driven Instances", false);
+
+    // When set, the objects' locators and scene graphs are updated on the
+    // worker threads, one object at a time.
+    BoolVar ParallelInstanceUpdate("Renderer/Parallel Instance Update", true);
+
+    // When set, the sun shadow map is recorded on its own context by a worker
+    // thread while the depth pre-pass and SSAO are recorded, and both contexts
+    // are submitted with one ExecuteCommandLists call.
+    BoolVar ParallelSceneRecording("Renderer/Parallel Scene Recording", true);
+
+    // While a set with at least this much GPU data loads, SSAO and bloom are
+    // turned off and the native resolution is lowered by the given number of
+    // steps, so that the frames leave more of the GPU to decompression.  The
+    // settings are put back once the set has loaded.
+    BoolVar ThrottleWhileLoading("DirectStorage/Load Quality/Throttle While Loading", true);
+    IntVar ThrottleMinSetMiB("DirectStorage/Load Quality/Min Set Size (MiB)", 256, 0, 65536, 64);
+    IntVar ThrottleResolutionSteps("DirectStorage/Load Quality/Resolution Steps Down", 2, 0, 5);
+}
+
 class BulkLoadDemo : public GameCore::IGameApp
 {
 public:
@@ -42,16 +82,33 @@ public:
     void Update(float deltaT) override;
     void RenderScene() override;
     void RenderUI(GraphicsContext& gfxContext) override;
+    bool IsDone() override;
 
 private:
     void LoadIblTextures(std::filesystem::path const& directory);
 
+    void OrderNextSet();
     void LoadNextSet();
+    void SetExpectedPlacements();
+    void RecordSetTelemetry();
+    void CreateInstancesForSet();
     void ShowSet();
+    void ShowNewlyLoadedFiles();
+    void AddObject(ModelInstance instance, MarcFileManager::FileId fileId, int slot, int numColumns);
+    bool IsShowingObjects() const;
 
+    static AffineTransform GetCameraTransform(float t);
+
+    void CreateInstanceBatch();
     void UpdateInstances(float deltaT);
     void RenderInstances(Renderer::MeshSorter& sorter);
 
+    void ThrottleRendering();
+    void RestoreRendering();
+
+    void RecordBenchmarkIteration();
+    bool WriteBenchmarkResults() const;
+
     std::default_random_engine m_rng;
 
     bool m_enableGpuDecompression = true;
@@ -60,14 +117,38 @@ private:
 
     std::vector<MarcFileManager::FileId> m_fileIds;
 
+    // The order of the next set is decided as soon as the current one is
+    // shown, so that its first files can be prefetched while it's on screen.
+    bool m_nextSetOrdered = false;
+
     struct Object
     {
         ModelInstance ModelInstance;
+        MarcFileManager::FileId FileId;
         Vector3 TumbleAxis;
         Vector3 StartPos;
+        bool Batched;
     };
 
     std::vector<Object> m_objects;
+
+    // The instances of a set that has loaded, being created on a worker
+    // thread.  Not used in progressive mode.
+    std::future<std::vector<ModelInstance>> m_setInstances;
+
+    // The objects that can be drawn indirectly, once the set is shown
+    std::unique_ptr<Renderer::InstanceBatch> m_instanceBatch = std::make_unique<Renderer::InstanceBatch>();
+
+    // Objects that have been unloaded, kept until the frames that drew them
+    // have finished
+    DeferredReleaseQueue m_deferredReleases;
+
+    // In progressive mode each file's position is decided when the set starts
+    // loading, since the models are added in the order they finish.
+    bool m_progressive = false;
+    std::vector<int> m_slots; // indexed by FileId
+    int m_numColumns = 0;
+
     float m_t;
     BoundingSphere m_objectsBoundingSphere;
 
@@ -75,15 +156,48 @@ private:
     {
         Idle,
         LoadingASet,
+        CreatingInstances,
         ShowingASet,
         Unloading
     };
 
     State m_state{State::Idle};
 
+    // The settings ThrottleRendering changed, while a set is loading
+    // throttled
+    struct RenderQuality
+    {
+        int32_t NativeResolution;
+        bool SSAO;
+        bool Bloom;
+    };
+
+    std::optional<RenderQuality> m_fullQuality;
+
     float m_maxCpuUsage = 0;
+    LoadTelemetrySummary m_telemetry{};
+    CpuThreadCycles m_cpuThreadCycles{};
 
-    uint64_t m_lastObjectRenderFenceValue = static_cast<uint64_t>(-1);
+    // With -benchmark, every set is unloaded as soon as it has loaded, without
+    // being shown, and the demo exits once it has loaded m_benchmarkIterations
+    // sets and written their results to m_benchmarkOutput.
+    struct BenchmarkIteration
+    {
+        MarcFileManager::LoadedDataSize Size;
+        float LoadTime; // seconds
+        size_t NumDeferredFiles;
+        float MaxCpuUsage;
+        CpuThreadCycles ThreadCycles;
+        LoadTelemetrySummary Telemetry;
+        MarcFileManager::HeapUsage PeakHeapUsage;
+    };
+
+    uint32_t m_benchmarkIterations = 0;
+    std::filesystem::path m_benchmarkOutput;
+    std::vector<std::wstring> m_benchmarkFiles;
+    std::vector<BenchmarkIteration> m_benchmarkResults;
+    MarcFileManager::HeapUsage m_peakHeapUsage{};
+    bool m_benchmarkDone = false;
 
     Camera m_camera;
     ShadowCamera m_sunShadowCamera;
@@ -118,6 +232,7 @@ static std::filesystem::path GetExecutableDirectory()
 void BulkLoadDemo::Startup()
 {
     InitializeCpuPerformanceMonitor();
+    RegisterCpuThread(CpuThreadClass::Render);
 
     FXAA::Enable = false;
     PostEffects::EnableHDR = true;
@@ -130,17 +245,17 @@ void BulkLoadDemo::Startup()
 
     m_enableGpuDecompression = !!enableGpuDecompression;
 
-    InitializeDStorage(!m_enableGpuDecompression);
+    CommandLineArgs::GetInteger(L"benchmark", m_benchmarkIterations);
+
+    std::wstring benchmarkOutput = L"BulkLoadDemo.benchmark.json";
+    CommandLineArgs::GetString(L"benchmark-output", benchmarkOutput);
+    m_benchmarkOutput = benchmarkOutput;
+
     Renderer::Initialize();
 
     m_camera.SetZRange(1.0f, 10000.0f);
 
     std::filesystem::path executableDirectory = GetExecutableDirectory();
-    LoadIblTextures(executableDirectory);
-
-    // Construct the MarcFileManager.  This is deferred until after the renderer
-    // has been initialized.
-    m_marcFiles.emplace();
 
     // Figure out what mode we're running in, and add the appropriate files.
     std::vector<std::wstring> filesToLoad;
@@ -150,6 +265,24 @@ void BulkLoadDemo::Startup()
     {
         filesToLoad.push_back(std::move(param));
     }
+    else if (CommandLineArgs::GetString(L"list", param))
+    {
+        // One file per line, relative to the list's directory.  Blank lines
+        // and lines starting with # are skipped.
+        std::filesystem::path listDirectory = std::filesystem::path(param).parent_path();
+
+        std::ifstream list(param);
+        for (std::string line; std::getline(list, line);)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (line.empty() || line.front() == '#')
+                continue;
+
+            filesToLoad.push_back((listDirectory / line).make_preferred().wstring());
+        }
+    }
     else if (CommandLineArgs::GetString(L"dir", param))
     {
         for (auto const& entry : std::filesystem::directory_iterator(param))
@@ -160,7 +293,7 @@ void BulkLoadDemo::Startup()
 
                 fname.make_preferred();
 
-                if (fname.extension() == ".marc")
+                if (fname.extension() == ".marc" || fname.extension() == ".bundle")
                 {
                     filesToLoad.push_back(fname.wstring());
                 }
@@ -180,7 +313,7 @@ void BulkLoadDemo::Startup()
 
                 fname.make_preferred();
 
-                if (fname.extension() == ".marc")
+                if (fname.extension() == ".marc" || fname.extension() == ".bundle")
                 {
                     localMarcFiles.push_back(fname);
                 }
@@ -198,18 +331,61 @@ void BulkLoadDemo::Startup()
         }
     }
 
+    if (m_benchmarkIterations > 0)
+        m_benchmarkFiles = filesToLoad;
+
+    // DirectStorage is initialized once the files are known, so that the first
+    // one can be used to calibrate it.
+    InitializeDStorage(
+        !m_enableGpuDecompression,
+        filesToLoad.empty() ? std::filesystem::path() : std::filesystem::path(filesToLoad.front()));
+    InitializeLoadTelemetry();
+
+    // Loose DDS files, such as the IBL textures, are read by DirectStorage
+    // straight into their textures too
+    TextureManager::SetDDSFileLoader(LoadDDSTextureWithDStorage);
+
+    // So is the geometry of any .mini or .h3d model that Renderer::LoadModel
+    // or ModelH3D loads, straight into its buffer
+    Renderer::SetGeometryFileLoader(LoadGeometryWithDStorage);
+    LoadIblTextures(executableDirectory);
+
+    // Construct the MarcFileManager.  This is deferred until after the renderer
+    // and DirectStorage have been initialized.
+    m_marcFiles.emplace();
+
     // Add all the files
+    m_marcFiles->BeginBatch();
     for (auto& f : filesToLoad)
     {
-        m_fileIds.push_back(m_marcFiles->Add(f));
+        if (std::filesystem::path(f).extension() == ".bundle")
+        {
+            std::vector<MarcFileManager::FileId> ids = m_marcFiles->AddBundle(f);
+            m_fileIds.insert(m_fileIds.end(), ids.begin(), ids.end());
+        }
+        else
+        {
+            m_fileIds.push_back(m_marcFiles->Add(f));
+        }
     }
+    m_marcFiles->EndBatch();
 }
 
 void BulkLoadDemo::Cleanup()
 {
+    // Instances that are still being created would outlive the pool that
+    // their constants are in
+    if (m_setInstances.valid())
+        m_setInstances.get();
+
+    // The unloaded objects' constants are in the pool too
+    m_deferredReleases.Flush();
+
     m_marcFiles.reset();
 
     Renderer::Shutdown();
+    ShutdownLoadTelemetry();
+    TextureManager::SetDDSFileLoader(nullptr);
     ShutdownDStorage();
 
     ShutdownCpuPerformanceMonitor();
@@ -219,8 +395,11 @@ void BulkLoadDemo::LoadIblTextures(std::filesystem::path const& directory)
 {
     std::filesystem::path texturesDirectory = directory / L"Textures";
 
-    TextureRef diffuse = TextureManager::LoadDDSFromFile((texturesDirectory / L"Stonewall_diffuseIBL.dds").wstring());
-    TextureRef specular = TextureManager::LoadDDSFromFile((texturesDirectory / L"Stonewall_specularIBL.dds").wstring());
+    // Both are loaded at once; SetIBLTextures waits for them
+    TextureRef diffuse =
+        TextureManager::LoadDDSFromFileAsync((texturesDirectory / L"Stonewall_diffuseIBL.dds").wstring());
+    TextureRef specular =
+        TextureManager::LoadDDSFromFileAsync((texturesDirectory / L"Stonewall_specularIBL.dds").wstring());
 
     Renderer::SetIBLTextures(diffuse, specular);
 }
@@ -228,6 +407,7 @@ void BulkLoadDemo::LoadIblTextures(std::filesystem::path const& directory)
 namespace Graphics
 {
     extern EnumVar DebugZoom;
+    extern EnumVar NativeResolution;
 }
 
 void BulkLoadDemo::Update(float deltaT)
@@ -239,6 +419,9 @@ void BulkLoadDemo::Update(float deltaT)
     else if (GameInput::IsFirstPressed(GameInput::kRShoulder))
         Graphics::DebugZoom.Increment();
 
+    UpdateDStorage(deltaT);
+    UpdateLoadTelemetry();
+    m_deferredReleases.Update();
     m_marcFiles->Update();
 
     using namespace std::chrono_literals;
@@ -246,21 +429,77 @@ void BulkLoadDemo::Update(float deltaT)
     switch (m_state)
     {
     case State::Idle:
+        if (m_benchmarkIterations > 0 && m_benchmarkResults.size() == m_benchmarkIterations)
+        {
+            if (!m_benchmarkDone)
+            {
+                WriteBenchmarkResults();
+                m_benchmarkDone = true;
+            }
+            break;
+        }
+
         if (m_marcFiles->IsReadyToLoad())
         {
+            // Texture stores that were in the directory aren't shown
+            std::erase_if(m_fileIds, [&](MarcFileManager::FileId id) { return m_marcFiles->IsTextureStore(id); });
+
             LoadNextSet();
+            ThrottleRendering();
             m_state = State::LoadingASet;
         }
         break;
 
     case State::LoadingASet:
+        // Skips to the next set; the files that are still loading are
+        // cancelled, and come first in the next set.
+        if (m_marcFiles->IsLoading() &&
+            (GameInput::IsFirstPressed(GameInput::kKey_n) || GameInput::IsFirstPressed(GameInput::kBButton)))
+        {
+            m_marcFiles->CancelSet();
+            m_state = State::Unloading;
+            break;
+        }
+
+        if (m_progressive)
+            ShowNewlyLoadedFiles();
+
+        if (m_benchmarkIterations > 0)
+        {
+            MarcFileManager::HeapUsage heapUsage = m_marcFiles->GetHeapUsage();
+            m_peakHeapUsage.TexturesByteCount =
+                std::max(m_peakHeapUsage.TexturesByteCount, heapUsage.TexturesByteCount);
+            m_peakHeapUsage.BuffersByteCount = std::max(m_peakHeapUsage.BuffersByteCount, heapUsage.BuffersByteCount);
+        }
+
         if (m_marcFiles->SetIsLoaded())
         {
-            ShowSet();
-            m_state = State::ShowingASet;
+            RecordSetTelemetry();
+            if (m_benchmarkIterations > 0)
+            {
+                RecordBenchmarkIteration();
+                m_state = State::Unloading;
+                break;
+            }
+
+            if (!m_progressive)
+                CreateInstancesForSet();
+            m_state = State::CreatingInstances;
         }
         break;
 
+    case State::CreatingInstances:
+        // Creating the instances of a large set takes long enough to drop a
+        // frame, so the loading screen stays up until the worker is done
+        if (m_setInstances.valid() && m_setInstances.wait_for(0s) != std::future_status::ready)
+            break;
+
+        ShowSet();
+        OrderNextSet();
+        m_marcFiles->PrefetchFiles(m_fileIds);
+        m_state = State::ShowingASet;
+        break;
+
     case State::ShowingASet:
         if (m_marcFiles->GetTimeSinceLoad() > 10s)
         {
@@ -269,42 +508,203 @@ void BulkLoadDemo::Update(float deltaT)
         break;
 
     case State::Unloading:
-        // Unloading is surprisingly expensive - especially freeing the mesh
-        // constants buffers associated with ModelInstances (these are all committed
-        // resources).  So we +1 to the fence value so that we are sure we do this
-        // when the loading screen is visible, which hides the glitch.
-        if (Graphics::g_CommandManager.GetQueue().IsFenceComplete(m_lastObjectRenderFenceValue + 1))
+        // Frames that have already been submitted may still be drawing the
+        // objects, so rather than waiting for them the objects and the set are
+        // released once the GPU has finished.  That's expensive - especially
+        // freeing the mesh constants buffers associated with ModelInstances
+        // (these are all committed resources) - but by then the loading
+        // screen is visible, which hides the glitch.
+        if (!m_marcFiles->IsCancelling())
         {
+            m_deferredReleases.Push(
+                DeferredReleaseQueue::SignalGraphicsQueue(),
+                [objects = std::make_shared<std::vector<Object>>(std::move(m_objects)),
+                 batch = std::shared_ptr<Renderer::InstanceBatch>(std::move(m_instanceBatch))] {});
+
             m_objects.clear();
+            m_instanceBatch = std::make_unique<Renderer::InstanceBatch>();
             m_marcFiles->UnloadSet();
 
             m_state = State::Idle;
-            m_lastObjectRenderFenceValue = static_cast<uint64_t>(-1);
         }
         break;
     }
 
-    // Update the camera
-    {
-        Matrix3 orientation = Matrix3::MakeXRotation(-m_t * 0.1f);
+    // A cancelled set's reads keep the GPU busy until they've completed
+    if (m_fullQuality && !m_marcFiles->IsLoading() && !m_marcFiles->IsCancelling())
+        RestoreRendering();
 
-        Vector3 position = orientation.GetZ() * (50.0f + m_t);
-        m_camera.SetTransform(AffineTransform(orientation, position));
-        m_camera.Update();
-    }
+    // Update the camera
+    m_camera.SetTransform(GetCameraTransform(m_t));
+    m_camera.Update();
 
     UpdateInstances(deltaT);
 }
 
-void BulkLoadDemo::LoadNextSet()
+AffineTransform BulkLoadDemo::GetCameraTransform(float t)
 {
-    // Shuffle the models, so that we load them in a random order each time
+    Matrix3 orientation = Matrix3::MakeXRotation(-t * 0.1f);
+
+    Vector3 position = orientation.GetZ() * (50.0f + t);
+    return AffineTransform(orientation, position);
+}
+
+void BulkLoadDemo::OrderNextSet()
+{
+    // Shuffle the models, so that we load them in a random order each time,
+    // but put the ones that didn't fit in the last set first so that every
+    // model is eventually shown.
     std::shuffle(m_fileIds.begin(), m_fileIds.end(), m_rng);
+
+    auto const& deferredFiles = m_marcFiles->GetDeferredFiles();
+    std::stable_partition(
+        m_fileIds.begin(),
+        m_fileIds.end(),
+        [&](MarcFileManager::FileId id)
+        { return std::find(deferredFiles.begin(), deferredFiles.end(), id) != deferredFiles.end(); });
+
+    m_nextSetOrdered = true;
+}
+
+void BulkLoadDemo::LoadNextSet()
+{
+    // A set that was cancelled was never shown, so the next one hasn't been
+    // ordered yet
+    if (!m_nextSetOrdered)
+        OrderNextSet();
+    m_nextSetOrdered = false;
+
     ResetCpuPerformance();
+    ResetLoadTelemetry();
+    ResetHybridDecompressionStats();
+    m_peakHeapUsage = {};
+    SetExpectedPlacements();
     m_marcFiles->SetNextSet(m_fileIds);
+
+    m_progressive = ProgressiveShow;
+    if (m_progressive)
+    {
+        m_slots.assign(m_fileIds.empty() ? 0 : *std::max_element(m_fileIds.begin(), m_fileIds.end()) + 1, 0);
+        for (int i = 0; i < static_cast<int>(m_fileIds.size()); ++i)
+            m_slots[m_fileIds[i]] = i;
+        m_numColumns = static_cast<int>((m_fileIds.size() + 1) / 2);
+
+        m_t = 0;
+    }
 }
 
-void BulkLoadDemo::ShowSet()
+//
+// Turns off the most expensive passes of the frame and lowers the resolution
+// it's rendered at while a large set loads, since they compete with GPU
+// decompression for the GPU.  The scene is upscaled to the display as usual.
+// A change of resolution recreates the rendering buffers at the next present,
+// so small sets aren't worth it.
+//
+void BulkLoadDemo::ThrottleRendering()
+{
+    if (!ThrottleWhileLoading || m_fullQuality)
+        return;
+
+    MarcFileManager::LoadedDataSize size = m_marcFiles->GetCurrentSetSize();
+    if (size.TexturesByteCount + size.BuffersByteCount < uint64_t(ThrottleMinSetMiB) * 1024 * 1024)
+        return;
+
+    m_fullQuality = RenderQuality{Graphics::NativeResolution, SSAO::Enable, PostEffects::BloomEnable};
+
+    Graphics::NativeResolution = std::max(0, Graphics::NativeResolution - ThrottleResolutionSteps);
+    SSAO::Enable = false;
+    PostEffects::BloomEnable = false;
+}
+
+// Settings changed by hand while the set was loading are overwritten
+void BulkLoadDemo::RestoreRendering()
+{
+    Graphics::NativeResolution = m_fullQuality->NativeResolution;
+    SSAO::Enable = m_fullQuality->SSAO;
+    PostEffects::BloomEnable = m_fullQuality->Bloom;
+
+    m_fullQuality.reset();
+}
+
+// The objects are laid out in a grid with numColumns columns
+static Vector3 GetSlotPosition(int slot, int numColumns)
+{
+    constexpr float instanceRadius = 10.0f;
+
+    int row = slot / numColumns;
+    int column = slot % numColumns;
+
+    return Vector3(column * instanceRadius * 2.0f, 0, -row * instanceRadius * 3.0f);
+}
+
+//
+// Tells the file manager where each model of the next set will be when the set
+// is first shown, and where the camera will be, so that the mips that matter
+// most on screen are read first.  A set that isn't shown progressively is laid
+// out in the order its files finish, which isn't known yet, so the order they
+// are loaded in stands in for it.
+//
+void BulkLoadDemo::SetExpectedPlacements()
+{
+    Camera camera = m_camera;
+    camera.SetTransform(GetCameraTransform(0.0f));
+    camera.Update();
+
+    int numColumns = static_cast<int>((m_fileIds.size() + 1) / 2);
+    for (int slot = 0; slot < static_cast<int>(m_fileIds.size()); ++slot)
+    {
+        MarcFileManager::FileId id = m_fileIds[slot];
+
+        // UpdateInstances scales each model to a radius of 10, centered on its
+        // slot
+        BoundingSphere sphere = m_marcFiles->GetBoundingSphere(id);
+        if (sphere.GetRadius() == 0.0f)
+            continue;
+
+        Scalar scale = Scalar(10.0f) / sphere.GetRadius();
+        Vector3 translation = GetSlotPosition(slot, numColumns) - sphere.GetCenter() * scale;
+
+        m_marcFiles->SetExpectedPlacement(id, UniformTransform(Quaternion(kIdentity), scale, translation), camera);
+    }
+}
+
+//
+// Adds the models that have loaded since the last frame.  When several finish
+// at once, the ones nearest the camera are added first.
+//
+void BulkLoadDemo::ShowNewlyLoadedFiles()
+{
+    auto fileIds = m_marcFiles->TakeNewlyLoadedFiles();
+    if (fileIds.empty())
+        return;
+
+    // UpdateInstances moves all the objects along by this much
+    Vector3 offset(-m_t * 50.0f, 0, 0);
+
+    auto distanceToCamera = [&](MarcFileManager::FileId id)
+    {
+        Vector3 position = GetSlotPosition(m_slots[id], m_numColumns) + offset;
+        return (float)Length(position - m_camera.GetPosition());
+    };
+
+    std::sort(
+        fileIds.begin(),
+        fileIds.end(),
+        [&](auto a, auto b) { return distanceToCamera(a) < distanceToCamera(b); });
+
+    for (auto id : fileIds)
+        AddObject(m_marcFiles->CreateInstance(id), id, m_slots[id], m_numColumns);
+}
+
+bool BulkLoadDemo::IsShowingObjects() const
+{
+    return m_state == State::ShowingASet ||
+           ((m_state == State::LoadingASet || m_state == State::CreatingInstances) && m_progressive);
+}
+
+// Called as soon as the set has loaded, so that the instances being created
+// afterwards don't count towards the load
+void BulkLoadDemo::RecordSetTelemetry()
 {
     float cpuUsage = GetMaxCpuUsage();
 
@@ -316,35 +716,214 @@ void BulkLoadDemo::ShowSet()
     }();
 
     m_maxCpuUsage = std::min(100.0f, 100.0f * cpuUsage / numProcessors);
+    m_telemetry = GetLoadTelemetrySummary();
+    m_cpuThreadCycles = GetCpuThreadCycles();
+}
 
-    auto instances = m_marcFiles->CreateInstancesForSet();
+void BulkLoadDemo::RecordBenchmarkIteration()
+{
+    BenchmarkIteration& iteration = m_benchmarkResults.emplace_back();
+    iteration.Size = m_marcFiles->GetCurrentSetSize();
+    iteration.LoadTime = m_marcFiles->GetLoadTime().count();
+    iteration.NumDeferredFiles = m_marcFiles->GetDeferredFiles().size();
+    iteration.MaxCpuUsage = m_maxCpuUsage;
+    iteration.ThreadCycles = m_cpuThreadCycles;
+    iteration.Telemetry = m_telemetry;
+    iteration.PeakHeapUsage = m_peakHeapUsage;
+
+    Utility::Printf(
+        "Benchmark set %zu of %u loaded in %.3f seconds\n",
+        m_benchmarkResults.size(),
+        m_benchmarkIterations,
+        iteration.LoadTime);
+}
 
-    constexpr float instanceRadius = 10.0f;
+static std::string ToJsonString(std::wstring const& value)
+{
+    std::string json = "\"";
+    for (char8_t c : std::filesystem::path(value).u8string())
+    {
+        if (c == '"' || c == '\\')
+            json += '\\';
+        json += static_cast<char>(c);
+    }
+    return json + "\"";
+}
+
+//
+// Writes the -benchmark results as JSON: the settings and files, then each
+// set's load time, CPU usage, bytes by format and peak heap usage, then the
+// load times' minimum, mean and maximum.
+//
+bool BulkLoadDemo::WriteBenchmarkResults() const
+{
+    static char const* formatNames[] = {"uncompressed", "gdeflate", "zlib"};
+    static_assert(std::size(formatNames) == static_cast<size_t>(TelemetryFormat::Count));
+
+    static char const* threadClassNames[] = {"render", "directStorage", "zlibWorkers", "threadpool", "other"};
+    static_assert(std::size(threadClassNames) == static_cast<size_t>(CpuThreadClass::Count));
+
+    std::ofstream out(m_benchmarkOutput);
+    out << std::fixed << std::setprecision(6);
+
+    out << "{\n";
+    out << "  \"gpuDecompression\": " << (m_enableGpuDecompression ? "true" : "false") << ",\n";
+    out << "  \"files\": [";
+    for (size_t i = 0; i < m_benchmarkFiles.size(); ++i)
+        out << (i > 0 ? ", " : "") << ToJsonString(m_benchmarkFiles[i]);
+    out << "],\n";
+
+    out << "  \"iterations\": [\n";
+    for (size_t i = 0; i < m_benchmarkResults.size(); ++i)
+    {
+        BenchmarkIteration const& iteration = m_benchmarkResults[i];
+        MarcFileManager::LoadedDataSize const& s = iteration.Size;
+
+        out << "    {\n";
+        out << "      \"loadTimeSeconds\": " << iteration.LoadTime << ",\n";
+        out << "      \"models\": " << s.NumLoadedModels << ",\n";
+        out << "      \"deferredFiles\": " << iteration.NumDeferredFiles << ",\n";
+        out << "      \"cpuBytes\": " << s.CpuByteCount << ",\n";
+        out << "      \"textureBytes\": " << s.TexturesByteCount << ",\n";
+        out << "      \"bufferBytes\": " << s.BuffersByteCount << ",\n";
+
+        // What was read from the files in each format, and what it
+        // decompressed to
+        out << "      \"readBytes\": {";
+        for (size_t format = 0; format < std::size(formatNames); ++format)
+        {
+            out << (format > 0 ? ", " : "") << "\"" << formatNames[format]
+                << "\": " << iteration.Telemetry.ByteCount[format];
+        }
+        out << "},\n";
+
+        out << "      \"outputBytes\": {";
+        for (size_t format = 0; format < std::size(formatNames); ++format)
+        {
+            out << (format > 0 ? ", " : "") << "\"" << formatNames[format]
+                << "\": " << iteration.Telemetry.UncompressedByteCount[format];
+        }
+        out << "},\n";
+
+        out << "      \"maxCpuUsagePercent\": " << iteration.MaxCpuUsage << ",\n";
+        out << "      \"cpuCycles\": {";
+        for (size_t threadClass = 0; threadClass < std::size(threadClassNames); ++threadClass)
+        {
+            out << (threadClass > 0 ? ", " : "") << "\"" << threadClassNames[threadClass]
+                << "\": " << iteration.ThreadCycles.Cycles[threadClass];
+        }
+        out << "},\n";
+
+        out << "      \"peakTextureHeapBytes\": " << iteration.PeakHeapUsage.TexturesByteCount << ",\n";
+        out << "      \"peakBufferHeapBytes\": " << iteration.PeakHeapUsage.BuffersByteCount << "\n";
+        out << "    }" << (i + 1 < m_benchmarkResults.size() ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+
+    float minLoadTime = m_benchmarkResults.empty() ? 0.0f : m_benchmarkResults.front().LoadTime;
+    float maxLoadTime = 0;
+    float totalLoadTime = 0;
+    for (BenchmarkIteration const& iteration : m_benchmarkResults)
+    {
+        minLoadTime = std::min(minLoadTime, iteration.LoadTime);
+        maxLoadTime = std::max(maxLoadTime, iteration.LoadTime);
+        totalLoadTime += iteration.LoadTime;
+    }
 
-    auto numColumns = static_cast<int>((instances.size() + 1) / 2);
+    out << "  \"minLoadTimeSeconds\": " << minLoadTime << ",\n";
+    out << "  \"meanLoadTimeSeconds\": " << totalLoadTime / std::max<size_t>(1, m_benchmarkResults.size()) << ",\n";
+    out << "  \"maxLoadTimeSeconds\": " << maxLoadTime << "\n";
+    out << "}\n";
+
+    bool succeeded = out.good();
+    Utility::Printf(
+        "%s benchmark results to %ls\n",
+        succeeded ? "Wrote" : "Failed to write",
+        m_benchmarkOutput.c_str());
+    return succeeded;
+}
 
-    int instanceIndex = 0;
+bool BulkLoadDemo::IsDone()
+{
+    return m_benchmarkDone || IGameApp::IsDone();
+}
 
-    for (auto& instance : instances)
+//
+// Creates the instances of a set that has loaded on a worker thread.  Their
+// constants come from MeshConstantsPool, so this doesn't create any resources
+// unless the pool is full.
+//
+void BulkLoadDemo::CreateInstancesForSet()
+{
+    // The models are gathered here, so that the worker doesn't touch the
+    // file manager while it's being updated
+    m_setInstances = std::async(
+        std::launch::async,
+        [models = m_marcFiles->GetModelsForSet()]()
+        {
+            std::vector<ModelInstance> instances;
+            instances.reserve(models.size());
+            for (auto const& model : models)
+                instances.emplace_back(model);
+            return instances;
+        });
+}
+
+void BulkLoadDemo::ShowSet()
+{
+    if (m_progressive)
+    {
+        // Everything but the last files to finish has already been added
+        ShowNewlyLoadedFiles();
+    }
+    else
     {
-        Object object{};
-        object.ModelInstance = std::move(instance);
-        object.ModelInstance.LoopAllAnimations();
+        auto instances = m_setInstances.get();
+        auto fileIds = m_marcFiles->GetFilesForSet();
 
-        int row = instanceIndex / numColumns;
-        int column = instanceIndex % numColumns;
+        auto numColumns = static_cast<int>((instances.size() + 1) / 2);
 
-        object.StartPos = Vector3(column * instanceRadius * 2.0f, 0, -row * instanceRadius * 3.0f);
+        for (int instanceIndex = 0; instanceIndex < static_cast<int>(instances.size()); ++instanceIndex)
+            AddObject(std::move(instances[instanceIndex]), fileIds[instanceIndex], instanceIndex, numColumns);
 
-        std::uniform_real_distribution<float> d(0.01f, 2.0f);
-        object.TumbleAxis = Vector3(0, d(m_rng), 0);
+        m_t = 0;
+    }
 
-        ++instanceIndex;
+    CreateInstanceBatch();
+}
 
-        m_objects.push_back(std::move(object));
+//
+// The set is complete, so no more objects will be added or moved until it is
+// unloaded.  The ones that can be are put in a batch that is drawn indirectly.
+//
+void BulkLoadDemo::CreateInstanceBatch()
+{
+    if (!GpuDrivenInstances)
+        return;
+
+    std::vector<ModelInstance const*> instances;
+    for (auto& object : m_objects)
+    {
+        object.Batched = Renderer::InstanceBatch::CanBatch(object.ModelInstance);
+        if (object.Batched)
+            instances.push_back(&object.ModelInstance);
     }
 
-    m_t = 0;
+    m_instanceBatch->Create(instances);
+}
+
+void BulkLoadDemo::AddObject(ModelInstance instance, MarcFileManager::FileId fileId, int slot, int numColumns)
+{
+    Object object{};
+    object.ModelInstance = std::move(instance);
+    object.ModelInstance.LoopAllAnimations();
+    object.FileId = fileId;
+    object.StartPos = GetSlotPosition(slot, numColumns);
+
+    std::uniform_real_distribution<float> d(0.01f, 2.0f);
+    object.TumbleAxis = Vector3(0, d(m_rng), 0);
+
+    m_objects.push_back(std::move(object));
 }
 
 void BulkLoadDemo::UpdateInstances(float deltaT)
@@ -353,9 +932,11 @@ void BulkLoadDemo::UpdateInstances(float deltaT)
 
     m_objectsBoundingSphere = BoundingSphere(EZeroTag{});
 
-    GraphicsContext& gfxContext = GraphicsContext::Begin(L"UpdateInstances");
+    const bool showingObjects = IsShowingObjects();
 
-    for (auto& object : m_objects)
+    // Only touches the object itself, so the objects can be updated in any
+    // order and on any thread
+    auto updateTransforms = [&](Object& object)
     {
         object.ModelInstance.Locator() = UniformTransform(EIdentityTag{});
         auto boundingSphere = object.ModelInstance.GetBoundingSphere();
@@ -378,8 +959,29 @@ void BulkLoadDemo::UpdateInstances(float deltaT)
             Scalar(XMVectorSwizzle<XM_SWIZZLE_X, XM_SWIZZLE_X, XM_SWIZZLE_X, XM_SWIZZLE_X>(decomposedScale)),
             Vector3(decomposedTranslate));
 
-        if (m_state == State::ShowingASet)
-            object.ModelInstance.Update(gfxContext, deltaT);
+        if (showingObjects)
+            object.ModelInstance.UpdateTransforms(deltaT);
+    };
+
+    if (ParallelInstanceUpdate)
+        std::for_each(std::execution::par, m_objects.begin(), m_objects.end(), updateTransforms);
+    else
+        std::for_each(m_objects.begin(), m_objects.end(), updateTransforms);
+
+    GraphicsContext& gfxContext = GraphicsContext::Begin(L"UpdateInstances");
+
+    for (auto& object : m_objects)
+    {
+        if (showingObjects)
+        {
+            object.ModelInstance.CommitConstants(gfxContext);
+
+            // Estimate how large the model is on screen, for mip streaming
+            float pixelsAcross =
+                MarcFileManager::EstimateScreenSize(object.ModelInstance.GetBoundingSphere(), m_camera);
+
+            m_marcFiles->RequestMips(object.FileId, pixelsAcross);
+        }
 
         if (m_objectsBoundingSphere.GetRadius() == 0.0f)
         {
@@ -393,6 +995,9 @@ void BulkLoadDemo::UpdateInstances(float deltaT)
 
     gfxContext.Finish();
 
+    // One copy for the constants of every object that moved
+    MeshConstantsPool::Commit();
+
     m_t += deltaT;
 }
 
@@ -442,6 +1047,35 @@ void BulkLoadDemo::RenderScene()
     globals.SunDirection = SunDirection;
     globals.SunIntensity = Vector3(Scalar(4.0f));
 
+    auto renderShadows = [&](GraphicsContext& context)
+    {
+        MeshSorter shadowSorter(MeshSorter::kShadows);
+        shadowSorter.SetCamera(m_sunShadowCamera);
+        shadowSorter.SetDepthStencilTarget(g_ShadowBuffer);
+
+        RenderInstances(shadowSorter);
+
+        shadowSorter.Sort();
+        shadowSorter.RenderMeshes(MeshSorter::kZPass, context, globals);
+    };
+
+    // The shadow map only touches the shadow buffer and the shadow view's
+    // culling buffers, so it can be recorded while the passes before the color
+    // pass are.  Its context is submitted ahead of this one, so the color pass
+    // sees it finished.
+    GraphicsContext* shadowContext = nullptr;
+    std::future<void> shadowPass;
+    if (ParallelSceneRecording && !SSAO::DebugDraw)
+    {
+        shadowContext = &GraphicsContext::Begin();
+        shadowPass = std::async(std::launch::async, [&]
+        {
+            ScopedTraceEvent _trace("Sun Shadow Map");
+            ScopedTimer _prof(L"Sun Shadow Map", *shadowContext);
+            renderShadows(*shadowContext);
+        });
+    }
+
     // Begin rendering depth
     gfxContext.TransitionResource(g_SceneDepthBuffer, D3D12_RESOURCE_STATE_DEPTH_WRITE, true);
     gfxContext.ClearDepth(g_SceneDepthBuffer);
@@ -468,17 +1102,15 @@ void BulkLoadDemo::RenderScene()
     {
         ScopedTimer _outerprof(L"Main Render", gfxContext);
 
+        if (shadowPass.valid())
+        {
+            ScopedTimer _prof(L"Wait for Sun Shadow Map");
+            shadowPass.get();
+        }
+        else
         {
             ScopedTimer _prof(L"Sun Shadow Map", gfxContext);
-
-            MeshSorter shadowSorter(MeshSorter::kShadows);
-            shadowSorter.SetCamera(m_sunShadowCamera);
-            shadowSorter.SetDepthStencilTarget(g_ShadowBuffer);
-
-            RenderInstances(shadowSorter);
-
-            shadowSorter.Sort();
-            shadowSorter.RenderMeshes(MeshSorter::kZPass, gfxContext, globals);
+            renderShadows(gfxContext);
         }
 
         gfxContext.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET, true);
@@ -507,20 +1139,34 @@ void BulkLoadDemo::RenderScene()
         }
     }
 
-    gfxContext.Finish();
+    if (shadowContext != nullptr)
+    {
+        CommandContext* contexts[] = {shadowContext, &gfxContext};
+        CommandContext::FinishBatch(contexts, _countof(contexts));
+    }
+    else
+    {
+        gfxContext.Finish();
+    }
 }
 
 void BulkLoadDemo::RenderInstances(Renderer::MeshSorter& sorter)
 {
-    if (m_state != State::ShowingASet)
+    if (!IsShowingObjects())
         return;
 
-    for (auto& object : m_objects)
-    {
-        object.ModelInstance.Render(sorter);
-    }
+    bool useBatch = GpuDrivenInstances && !m_instanceBatch->IsEmpty();
+    if (useBatch)
+        sorter.AddInstanceBatch(*m_instanceBatch);
 
-    m_lastObjectRenderFenceValue = Graphics::g_CommandManager.GetQueue().GetNextFenceValue();
+    sorter.AddInParallel(
+        m_objects.size(),
+        [&](Renderer::MeshSorter& objectSorter, size_t i)
+        {
+            auto const& object = m_objects[i];
+            if (!(useBatch && object.Batched))
+                object.ModelInstance.Render(objectSorter);
+        });
 }
 
 namespace EngineTuning
@@ -551,6 +1197,28 @@ void BulkLoadDemo::RenderUI(GraphicsContext& gfxContext)
                 (s.CpuByteCount + s.TexturesByteCount + s.BuffersByteCount) / 1000.0f / 1000.0f / 1000.0f,
                 m_marcFiles->GetTimeSinceLoad().count(),
                 m_maxCpuUsage);
+
+            // The same values can be graphed from DirectStorage/Telemetry
+            LoadTelemetryCounters c = GetLoadTelemetryCounters();
+            float decompressionBandwidth = 0.0f;
+            for (float bandwidth : c.DecompressionBandwidth)
+                decompressionBandwidth += bandwidth;
+
+            text.SetTextSize(24.0f);
+            text.DrawFormattedString(
+                "%8.1f MB/s read, %8.1f MB/s output (%.1f GDeflate, %.1f Zlib)\n",
+                c.ReadBandwidth,
+                decompressionBandwidth,
+                c.DecompressionBandwidth[static_cast<size_t>(TelemetryFormat::GDeflate)],
+                c.DecompressionBandwidth[static_cast<size_t>(TelemetryFormat::ZLib)]);
+            text.DrawFormattedString(
+                "%4u system memory / %4u GPU requests in flight, %5.1f%% staging, "
+                "%5.1f%% texture / %5.1f%% buffer heap\n",
+                c.RequestsInFlight[static_cast<size_t>(TelemetryQueue::SystemMemory)],
+                c.RequestsInFlight[static_cast<size_t>(TelemetryQueue::Gpu)],
+                100.0f * c.StagingOccupancy,
+                100.0f * c.HeapUsage[static_cast<size_t>(TelemetryHeap::Textures)],
+                100.0f * c.HeapUsage[static_cast<size_t>(TelemetryHeap::Buffers)]);
         }
     }
     else
@@ -577,11 +1245,21 @@ void BulkLoadDemo::RenderUI(GraphicsContext& gfxContext)
         if (s.UncompressedByteCount > 0)
             text.DrawFormattedString("Uncompressed: %7.2f MB\n", s.UncompressedByteCount / 1000.0f / 1000.0f);
 
-        if (s.GDeflateByteCount > 0)
+        HybridDecompressionStats hybrid = GetHybridDecompressionStats();
+        if (s.GDeflateByteCount > 0 && hybrid.CpuByteCount > 0)
+        {
+            text.DrawFormattedString(
+                "    GDeflate: %7.2f MB (hybrid, %.0f%% on the CPU)\n",
+                s.GDeflateByteCount / 1000.0f / 1000.0f,
+                100.0f * hybrid.CpuByteCount / (hybrid.CpuByteCount + hybrid.GpuByteCount));
+        }
+        else if (s.GDeflateByteCount > 0)
+        {
             text.DrawFormattedString(
                 "    GDeflate: %7.2f MB (%s decompression)\n",
                 s.GDeflateByteCount / 1000.0f / 1000.0f,
                 m_enableGpuDecompression ? "GPU" : "CPU");
+        }
 
         if (s.ZLibByteCount > 0)
             text.DrawFormattedString("        Zlib: %7.2f MB\n", s.ZLibByteCount / 1000.0f / 1000.0f);
@@ -590,6 +1268,56 @@ void BulkLoadDemo::RenderUI(GraphicsContext& gfxContext)
 
         text.DrawFormattedString("              %7u models\n", s.NumLoadedModels);
         text.DrawFormattedString("              %7d textures\n", s.NumTextureHandles);
+
+        text.NewLine();
+
+        static char const* queueNames[] = {"System Memory", "          GPU"};
+        for (size_t i = 0; i < std::size(m_telemetry.Queues); ++i)
+        {
+            auto const& queue = m_telemetry.Queues[i];
+            text.DrawFormattedString(
+                "%s: %7u requests, %7.2f ms avg / %7.2f ms max latency, %4u max depth\n",
+                queueNames[i],
+                queue.NumRequests,
+                queue.AverageLatency,
+                queue.MaxLatency,
+                queue.MaxDepth);
+        }
+
+        if (m_telemetry.NumCustomDecompressions > 0)
+            text.DrawFormattedString(
+                "  Zlib decode: %7u requests, %7.2f ms of worker time, %5.2f cycles/byte\n",
+                m_telemetry.NumCustomDecompressions,
+                m_telemetry.CustomDecompressionTime,
+                static_cast<double>(m_telemetry.CustomDecompressionCycles) /
+                    std::max<uint64_t>(1, m_telemetry.CustomDecompressionByteCount));
+
+        text.NewLine();
+
+        // DirectStorage's threads read every format, and decompress GDeflate
+        // when it's decompressed on the CPU, so their cycles are given per byte
+        // of uncompressed and GDeflate output.  ZLib is decompressed by the
+        // workers and, when their queues are full, threadpool callbacks.
+        static char const* threadClassNames[] = {"Render", "DirectStorage", "Zlib workers", "Threadpool", "Other"};
+        static_assert(std::size(threadClassNames) == static_cast<size_t>(CpuThreadClass::Count));
+
+        for (size_t i = 0; i < std::size(threadClassNames); ++i)
+        {
+            text.DrawFormattedString(
+                "%13s: %7.3f Gcycles\n",
+                threadClassNames[i],
+                m_cpuThreadCycles.Cycles[i] / 1000.0f / 1000.0f / 1000.0f);
+        }
+
+        uint64_t directStorageByteCount =
+            m_telemetry.UncompressedByteCount[static_cast<size_t>(TelemetryFormat::Uncompressed)] +
+            m_telemetry.UncompressedByteCount[static_cast<size_t>(TelemetryFormat::GDeflate)];
+        if (directStorageByteCount > 0)
+            text.DrawFormattedString(
+                "DirectStorage: %5.2f cycles/byte of uncompressed and GDeflate output\n",
+                static_cast<double>(
+                    m_cpuThreadCycles.Cycles[static_cast<size_t>(CpuThreadClass::DirectStorage)]) /
+                    directStorageByteCount);
     }
 
     text.End();
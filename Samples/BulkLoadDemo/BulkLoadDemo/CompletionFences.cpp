@@ -0,0 +1,125 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "CompletionFences.h"
+
+#include <algorithm>
+
+CompletionFences::CompletionFences(ID3D12Device* device)
+    : m_device(device)
+{
+    constexpr BOOL manualReset = FALSE;
+    constexpr BOOL initialState = FALSE;
+    m_fenceEvent.Attach(CreateEventW(nullptr, manualReset, initialState, nullptr));
+    if (!m_fenceEvent.IsValid())
+        std::abort();
+
+    m_thread = std::thread([this] { ThreadProc(); });
+}
+
+CompletionFences::~CompletionFences()
+{
+    {
+        std::unique_lock lock{m_mutex};
+        m_exit = true;
+    }
+    SetEvent(m_fenceEvent.Get());
+    m_thread.join();
+}
+
+void CompletionFences::EnqueueSignal(IDStorageQueue1* queue, Callback const& callback)
+{
+    std::unique_lock lock{m_mutex};
+
+    // The value is taken while the lock is held, so that the signals on each
+    // queue are enqueued in the order of their values.
+    QueueFence& queueFence = GetQueueFence(queue);
+    uint64_t value = queueFence.NextValue++;
+
+    queueFence.Pending.push_back({value, callback});
+    queue->EnqueueSignal(queueFence.Fence.Get(), value);
+
+    if (FAILED(queueFence.Fence->SetEventOnCompletion(value, m_fenceEvent.Get())))
+        std::abort();
+}
+
+void CompletionFences::Cancel(void* context)
+{
+    std::unique_lock lock{m_mutex};
+
+    for (auto& queueFence : m_fences)
+    {
+        std::erase_if(
+            queueFence->Pending,
+            [context](PendingCallback const& pending) { return pending.Target.Context == context; });
+    }
+
+    m_callbackReturned.wait(lock, [&] { return m_runningContext != context; });
+}
+
+CompletionFences::QueueFence& CompletionFences::GetQueueFence(IDStorageQueue1* queue)
+{
+    // assumes m_mutex is locked
+
+    auto it = std::find_if(
+        m_fences.begin(),
+        m_fences.end(),
+        [queue](auto const& queueFence) { return queueFence->Queue == queue; });
+    if (it != m_fences.end())
+        return **it;
+
+    auto queueFence = std::make_unique<QueueFence>();
+    queueFence->Queue = queue;
+    if (FAILED(m_device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&queueFence->Fence))))
+        std::abort();
+
+    m_fences.push_back(std::move(queueFence));
+    return *m_fences.back();
+}
+
+//
+// The event is auto-reset and may have been set by several fences, so each
+// time it's set every fence is checked.  The lock is released while a
+// callback runs, since callbacks go on to enqueue more signals.
+//
+void CompletionFences::ThreadProc()
+{
+    std::unique_lock lock{m_mutex};
+
+    while (!m_exit)
+    {
+        lock.unlock();
+        WaitForSingleObject(m_fenceEvent.Get(), INFINITE);
+        lock.lock();
+
+        // Callbacks may add fences, so m_fences is indexed rather than iterated
+        for (size_t i = 0; i < m_fences.size(); ++i)
+        {
+            QueueFence& queueFence = *m_fences[i];
+            uint64_t completedValue = queueFence.Fence->GetCompletedValue();
+
+            while (!queueFence.Pending.empty() && queueFence.Pending.front().Value <= completedValue)
+            {
+                Callback callback = queueFence.Pending.front().Target;
+                queueFence.Pending.pop_front();
+
+                m_runningContext = callback.Context;
+                lock.unlock();
+
+                callback.Function(callback.Context);
+
+                lock.lock();
+                m_runningContext = nullptr;
+                m_callbackReturned.notify_all();
+            }
+        }
+    }
+}
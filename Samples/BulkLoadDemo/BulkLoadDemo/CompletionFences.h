@@ -0,0 +1,96 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <d3d12.h>
+#include <dstorage.h>
+#include <wrl/client.h>
+#include <wrl/wrappers/corewrappers.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// CompletionFences is an alternative to an EventWait per completion.  Each
+// DirectStorage queue gets one fence, and a callback's completion is an
+// EnqueueSignal of the next value of its queue's fence.  A single thread
+// waits for all of the fences and calls the callbacks, so the number of
+// events and threadpool waits doesn't grow with the number of files.
+//
+// The queues complete independently, so values are only ordered within a
+// queue; that's why there's a fence per queue rather than one for everything.
+//
+class CompletionFences
+{
+public:
+    struct Callback
+    {
+        void (*Function)(void* context) = nullptr;
+        void* Context = nullptr;
+
+        template<typename T, void (T::*FN)()>
+        static Callback Create(T* target)
+        {
+            auto function = [](void* context) { (static_cast<T*>(context)->*FN)(); };
+            return Callback{function, target};
+        }
+    };
+
+    explicit CompletionFences(ID3D12Device* device);
+    ~CompletionFences();
+
+    CompletionFences(CompletionFences const&) = delete;
+    CompletionFences& operator=(CompletionFences const&) = delete;
+
+    // Enqueues a signal on the queue.  The callback is called on the waiter
+    // thread once the requests enqueued before it have completed.  The caller
+    // submits the queue.
+    void EnqueueSignal(IDStorageQueue1* queue, Callback const& callback);
+
+    // Drops the callbacks that have yet to be called for the context, and
+    // waits for one that is being called to return.  Must not be called from
+    // a callback.
+    void Cancel(void* context);
+
+private:
+    struct PendingCallback
+    {
+        uint64_t Value;
+        Callback Target;
+    };
+
+    struct QueueFence
+    {
+        IDStorageQueue1* Queue;
+        Microsoft::WRL::ComPtr<ID3D12Fence> Fence;
+        uint64_t NextValue = 1;
+        std::deque<PendingCallback> Pending;
+    };
+
+    Microsoft::WRL::ComPtr<ID3D12Device> m_device;
+
+    std::mutex m_mutex;
+    std::condition_variable m_callbackReturned;
+    std::vector<std::unique_ptr<QueueFence>> m_fences;
+    void* m_runningContext = nullptr;
+    bool m_exit = false;
+
+    // Every fence sets this as it reaches a value that has a callback
+    Microsoft::WRL::Wrappers::Event m_fenceEvent;
+    std::thread m_thread;
+
+    QueueFence& GetQueueFence(IDStorageQueue1* queue);
+    void ThreadProc();
+};
@@ -0,0 +1,43 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+//
+// Collects the IDs of files whose loading has progressed.  Files push to it
+// from their threadpool callbacks, and the MarcFileManager takes everything
+// that has been pushed once per frame, so it only needs to look at the files
+// that have changed.
+//
+// The same ID may be pushed more than once.
+//
+class CompletionQueue
+{
+    std::mutex m_mutex;
+    std::vector<size_t> m_ids;
+
+public:
+    void Push(size_t id)
+    {
+        std::unique_lock lock(m_mutex);
+        m_ids.push_back(id);
+    }
+
+    std::vector<size_t> TakeAll()
+    {
+        std::vector<size_t> ids;
+
+        std::unique_lock lock(m_mutex);
+        ids.swap(m_ids);
+        return ids;
+    }
+};
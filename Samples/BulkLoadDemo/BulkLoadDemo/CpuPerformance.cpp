@@ -11,17 +11,68 @@
 #include "CpuPerformance.h"
 
 #include <Utility.h>
+#include <tlhelp32.h>
 #include <wbemidl.h>
 #include <wil/Resource.h>
 #include <winrt/base.h>
+#include <winternl.h>
 
 #include <optional>
+#include <unordered_map>
 
+#pragma comment(lib, "ntdll.lib")
 #pragma comment(lib, "wbemuuid.lib")
 
 using winrt::check_hresult;
 using winrt::com_ptr;
 
+// Threads register themselves before or after the monitor starts, so these
+// are kept apart from it
+static std::mutex g_registeredThreadsMutex;
+static std::unordered_map<DWORD, CpuThreadClass> g_registeredThreads;
+
+//
+// Classifies a thread that didn't register by the module that contains its
+// start address.  NtQueryInformationThread isn't documented for
+// ThreadQuerySetWin32StartAddress, but it's the only way to get it.
+//
+static CpuThreadClass ClassifyThreadByStartAddress(HANDLE thread)
+{
+    constexpr THREADINFOCLASS ThreadQuerySetWin32StartAddress = static_cast<THREADINFOCLASS>(9);
+
+    void* startAddress = nullptr;
+    if (!NT_SUCCESS(NtQueryInformationThread(
+            thread,
+            ThreadQuerySetWin32StartAddress,
+            &startAddress,
+            sizeof(startAddress),
+            nullptr)))
+        return CpuThreadClass::Other;
+
+    HMODULE module = nullptr;
+    if (!GetModuleHandleExW(
+            GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+            static_cast<LPCWSTR>(startAddress),
+            &module))
+        return CpuThreadClass::Other;
+
+    wchar_t path[MAX_PATH];
+    if (GetModuleFileNameW(module, path, MAX_PATH) == 0)
+        return CpuThreadClass::Other;
+
+    wchar_t const* filename = wcsrchr(path, L'\\');
+    filename = filename ? filename + 1 : path;
+
+    if (_wcsnicmp(filename, L"dstorage", 8) == 0)
+        return CpuThreadClass::DirectStorage;
+
+    // Threadpool workers start in ntdll's TppWorkerThread
+    if (_wcsicmp(filename, L"ntdll.dll") == 0)
+        return CpuThreadClass::Threadpool;
+
+    return CpuThreadClass::Other;
+}
+
 class CpuPerformanceMonitor
 {
     com_ptr<IWbemLocator> m_locator;
@@ -38,6 +89,15 @@ class CpuPerformanceMonitor
 
     float m_maxPercentProcessorTime;
 
+    struct ThreadSample
+    {
+        CpuThreadClass StartClass; // the class from its start address
+        uint64_t Cycles;
+    };
+
+    std::unordered_map<DWORD, ThreadSample> m_threadSamples;
+    CpuThreadCycles m_threadCycles{};
+
     bool m_quit = false;
 
 public:
@@ -111,10 +171,9 @@ public:
             break;
         }
 
-        if (m_perfData)
-        {
-            m_workerThread = std::thread([this] { this->WorkerThread(); });
-        }
+        // The threads are sampled even if the process counters can't be
+        SampleThreads();
+        m_workerThread = std::thread([this] { this->WorkerThread(); });
     }
 
     ~CpuPerformanceMonitor()
@@ -135,6 +194,9 @@ public:
     {
         std::unique_lock lock(m_mutex);
         m_maxPercentProcessorTime = 0.0f;
+
+        SampleThreads();
+        m_threadCycles = CpuThreadCycles{};
     }
 
     float GetMaxCpuUsage()
@@ -143,7 +205,68 @@ public:
         return m_maxPercentProcessorTime;
     }
 
+    CpuThreadCycles GetCpuThreadCycles()
+    {
+        std::unique_lock lock(m_mutex);
+        SampleThreads();
+        return m_threadCycles;
+    }
+
 private:
+    //
+    // Adds the cycles each thread used since it was last sampled to its
+    // class.  A thread seen for the first time counts every cycle it has
+    // used, since it started after the last sample.  m_mutex must be held.
+    //
+    void SampleThreads()
+    {
+        wil::unique_hfile snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0));
+        if (!snapshot)
+            return;
+
+        std::unordered_map<DWORD, CpuThreadClass> registeredThreads;
+        {
+            std::unique_lock lock(g_registeredThreadsMutex);
+            registeredThreads = g_registeredThreads;
+        }
+
+        DWORD const processId = GetCurrentProcessId();
+        std::unordered_map<DWORD, ThreadSample> threadSamples;
+
+        THREADENTRY32 entry{};
+        entry.dwSize = sizeof(entry);
+        for (BOOL found = Thread32First(snapshot.get(), &entry); found; found = Thread32Next(snapshot.get(), &entry))
+        {
+            if (entry.th32OwnerProcessID != processId)
+                continue;
+
+            wil::unique_handle thread(OpenThread(THREAD_QUERY_INFORMATION, FALSE, entry.th32ThreadID));
+            ULONG64 cycles = 0;
+            if (!thread || !QueryThreadCycleTime(thread.get(), &cycles))
+                continue;
+
+            // A thread whose cycle count went backwards is a new thread that
+            // was given the id of one that exited
+            ThreadSample sample{};
+            if (auto it = m_threadSamples.find(entry.th32ThreadID); it != m_threadSamples.end() &&
+                cycles >= it->second.Cycles)
+                sample = it->second;
+            else
+                sample.StartClass = ClassifyThreadByStartAddress(thread.get());
+
+            CpuThreadClass threadClass = sample.StartClass;
+            if (auto it = registeredThreads.find(entry.th32ThreadID); it != registeredThreads.end())
+                threadClass = it->second;
+
+            m_threadCycles.Cycles[static_cast<size_t>(threadClass)] += cycles - sample.Cycles;
+
+            sample.Cycles = cycles;
+            threadSamples[entry.th32ThreadID] = sample;
+        }
+
+        m_threadSamples = std::move(threadSamples);
+    }
+
     void WorkerThread()
     {
         try
@@ -156,6 +279,11 @@ private:
 
                 m_cv.wait_for(lock, 100ms);
 
+                SampleThreads();
+
+                if (!m_perfData)
+                    continue;
+
                 m_refresher->Refresh(0);
 
                 wil::unique_variant percentProcessorTimeString;
@@ -226,3 +354,17 @@ float GetMaxCpuUsage()
 
     return 0.0f;
 }
+
+void RegisterCpuThread(CpuThreadClass threadClass)
+{
+    std::unique_lock lock(g_registeredThreadsMutex);
+    g_registeredThreads[GetCurrentThreadId()] = threadClass;
+}
+
+CpuThreadCycles GetCpuThreadCycles()
+{
+    if (g_cpuPerformanceMonitor)
+        return g_cpuPerformanceMonitor->GetCpuThreadCycles();
+
+    return {};
+}
@@ -9,6 +9,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 void InitializeCpuPerformanceMonitor();
@@ -16,3 +17,34 @@ void ShutdownCpuPerformanceMonitor();
 
 void ResetCpuPerformance();
 float GetMaxCpuUsage();
+
+//
+// The CPU time of every thread in the process is sampled with
+// QueryThreadCycleTime, and added up by the class of thread.  Threads that the
+// demo creates register their class.  Other threads are classified by the
+// module they started in: DirectStorage's own threads start in dstorage.dll or
+// dstoragecore.dll, and threadpool threads, which run the completion and
+// custom decompression callbacks, start in ntdll.dll.
+//
+enum class CpuThreadClass
+{
+    Render,
+    DirectStorage,
+    Decompression, // the ZLib decompression workers
+    Threadpool,
+    Other,
+    Count
+};
+
+// Sets the class of the calling thread
+void RegisterCpuThread(CpuThreadClass threadClass);
+
+struct CpuThreadCycles
+{
+    // Cycles used by each class of thread since ResetCpuPerformance.  Cycles
+    // used by a thread that exited since it was last sampled, every 100ms,
+    // are missed.
+    uint64_t Cycles[static_cast<size_t>(CpuThreadClass::Count)];
+};
+
+CpuThreadCycles GetCpuThreadCycles();
@@ -11,14 +11,46 @@
 
 #define USE_PIX
 
+#include "CpuPerformance.h"
 #include "DStorageLoader.h"
+#include "DStorageSettings.h"
+#include "LoadTelemetry.h"
+#include "MarcFileFormat.h"
 
 #include <GraphicsCore.h>
 #include <pix3.h>
 #include <zlib.h>
 
+#ifndef USE_LIBDEFLATE
+#define USE_LIBDEFLATE 0
+#endif
+
+#if USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifndef USE_GDEFLATE_LIBRARY
+#define USE_GDEFLATE_LIBRARY 0
+#endif
+
+#if USE_GDEFLATE_LIBRARY
+#if USE_LIBDEFLATE
+// The GDeflate library links its own copy of libdeflate
+#error USE_GDEFLATE_LIBRARY and USE_LIBDEFLATE can't be combined
+#endif
+#include <GDeflate.h>
+#endif
+
+#include <emmintrin.h>
+
 #include <algorithm>
-#include <deque>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using Microsoft::WRL::ComPtr;
 
@@ -26,6 +58,12 @@ ComPtr<IDStorageFactory> g_dsFactory;
 ComPtr<IDStorageQueue1> g_dsSystemMemoryQueue;
 ComPtr<IDStorageQueue1> g_dsGpuQueue;
 
+static ComPtr<IDStorageQueue1> g_dsSystemMemoryQueues[DSTORAGE_PRIORITY_COUNT];
+static ComPtr<IDStorageQueue1> g_dsGpuQueues[DSTORAGE_PRIORITY_COUNT];
+static ComPtr<IDStorageQueue1> g_dsMemorySourceSystemMemoryQueues[DSTORAGE_PRIORITY_COUNT];
+static ComPtr<IDStorageQueue1> g_dsMemorySourceGpuQueues[DSTORAGE_PRIORITY_COUNT];
+static uint32_t g_stagingBufferSize;
+
 //
 // Custom decompression implementation.
 //
@@ -37,101 +75,592 @@ ComPtr<IDStorageQueue1> g_dsGpuQueue;
 // the request.
 //
 // The DirectStorage's custom decompression has been designed to be easy to
-// integrate with existing job systems.  In this example, the Windows Threadpool
-// APIs are used.  The basic approach is:
+// integrate with existing job systems.  In this example, a Windows Threadpool
+// wait feeds a dedicated pool of worker threads.  The basic approach is:
 //
 // * g_customDecompressionRequestsAvailableWait is configured to run a callback,
 //   OnCustomDecompressionRequestsAvailable, when the event returned by
 //   IDStorageCustomDecompressionQueue1::GetEvent() is set.
 //
-// * g_decompressionWork is configured to be able to execute units of work on
-//   the threadpool by calling DecompressionWork.
-//
 // * OnCustomDecompressionRequestsAvailable pulls batches of custom
-//   decompression requests from the custom decompression queue.  These are then
-//   added to g_decompressionRequests, and one g_decompressionWork is submitted
-//   for each request.
+//   decompression requests from the custom decompression queue.  Each batch is
+//   spread over the active workers' queues, and as many of them are woken as
+//   the batch can keep busy.
+//
+// * Each worker takes requests from its own queue and, once that is empty,
+//   steals from the others.  It decompresses each one, calling
+//   IDStorageCustomDecompressionQueue1::SetRequestResults when complete.  The
+//   queues are lock-free, so workers never contend on a lock for small
+//   requests.
 //
-// * DecompressionWork pulls one request from g_decompressionRequests and
-//   decompresses it, calling IDStorageCustomDecompressionQueue1::SetResult when
-//   complete.
+// * The size of the pool, the workers' priority and the cores they may run on
+//   are set through the DirectStorage/Decompression tuning variables.  When a
+//   frame budget is set, UpdateDStorage shrinks the number of active workers
+//   while frames run over it and grows it back while they don't.
 //
 
 static ComPtr<IDStorageCustomDecompressionQueue1> g_customDecompressionQueue;
 static HANDLE g_customDecompressionQueueEvent;
 static TP_WAIT* g_customDecompressionRequestsAvailableWait;
-static TP_WORK* g_decompressionWork;
 
-static std::mutex g_decompressionRequestsMutex;
-static std::deque<DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST> g_decompressionRequests;
+//
+// A worker's queue of requests.  Only the threadpool wait callback pushes, so
+// the tail has a single writer; the owning worker and any worker stealing from
+// it all pop from the head with a compare-exchange.
+//
+class DecompressionQueue
+{
+public:
+    bool Push(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+    {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= Capacity)
+            return false;
+
+        m_requests[tail % Capacity] = request;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST& request)
+    {
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        while (head != m_tail.load(std::memory_order_acquire))
+        {
+            // The slot can't be refilled until the head moves past it, so it is
+            // safe to read before claiming it
+            request = m_requests[head % Capacity];
+            if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel))
+                return true;
+        }
+        return false;
+    }
+
+    // The number of requests waiting in the queue, which may be stale by the
+    // time it's used
+    uint32_t GetSize() const
+    {
+        return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr uint32_t Capacity = 1024;
+
+    alignas(64) std::atomic<uint32_t> m_head{0};
+    alignas(64) std::atomic<uint32_t> m_tail{0};
+    DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST m_requests[Capacity];
+};
+
+static std::vector<std::unique_ptr<DecompressionQueue>> g_decompressionQueues;
+static std::vector<std::thread> g_decompressionWorkers;
+static std::vector<HANDLE> g_decompressionWorkAvailable;
+static std::atomic<bool> g_shutdownDecompressionWorkers;
+static std::atomic<uint32_t> g_activeDecompressionWorkers;
+static uint32_t g_nextDecompressionQueue;
+
+namespace
+{
+    const char* WorkerPriorityLabels[] = { "Below Normal", "Normal", "Above Normal", "Highest" };
+    const int WorkerPriorities[] = {
+        THREAD_PRIORITY_BELOW_NORMAL,
+        THREAD_PRIORITY_NORMAL,
+        THREAD_PRIORITY_ABOVE_NORMAL,
+        THREAD_PRIORITY_HIGHEST };
+
+    enum class WorkerAffinity { AnyCore, EfficiencyCores, PerformanceCores };
+    const char* WorkerAffinityLabels[] = { "Any Core", "Efficiency Cores", "Performance Cores" };
+
+    // The worker count is read when DirectStorage is initialized; 0 starts one
+    // worker per logical processor.
+    IntVar WorkerCount("DirectStorage/Decompression/Worker Count", 0, 0, 64);
+    EnumVar WorkerPriority(
+        "DirectStorage/Decompression/Priority", 3, _countof(WorkerPriorityLabels), WorkerPriorityLabels);
+    EnumVar WorkerAffinityClass(
+        "DirectStorage/Decompression/Affinity", 0, _countof(WorkerAffinityLabels), WorkerAffinityLabels);
+    IntVar SkipFirstCores("DirectStorage/Decompression/Skip First Cores", 0, 0, 63);
+    NumVar FrameBudget("DirectStorage/Decompression/Frame Budget (ms)", 0.0f, 0.0f, 100.0f, 1.0f);
+
+    // See RouteDecompression
+    BoolVar HybridDecompression("DirectStorage/Decompression/Hybrid GDeflate", false);
+    IntVar HybridSmallRequestKiB("DirectStorage/Decompression/Hybrid Small Request (KiB)", 64, 0, 16 * 1024, 16);
+    NumVar HybridGpuBusy("DirectStorage/Decompression/Hybrid GPU Busy (%)", 80.0f, 0.0f, 100.0f, 5.0f);
+
+#if USE_GDEFLATE_LIBRARY
+    // GDeflate regions loaded into memory are decoded by the workers with the
+    // GDeflate library rather than by the runtime.  Larger regions than this
+    // have their tiles decoded on every core.
+    BoolVar LibraryCpuGDeflate("DirectStorage/Decompression/GDeflate Library CPU Regions", true);
+    IntVar LibraryParallelKiB("DirectStorage/Decompression/GDeflate Library Parallel (KiB)", 1024, 64, 64 * 1024, 64);
+#endif
+}
 
 //
-// This is called on the threadpool, once per custom decompression request.
+// How the workers should run.  UpdateDStorage rebuilds this when the tuning
+// variables change and bumps the version; each worker applies it to itself
+// the next time it wakes, so priority and affinity are only ever set from the
+// thread they apply to, and only when they change.
 //
-static void CALLBACK DecompressionWork(TP_CALLBACK_INSTANCE*, void*, TP_WORK*)
+struct DecompressionPolicy
 {
-    PIXScopedEvent(0, "OnDecompress");
+    int Priority = THREAD_PRIORITY_HIGHEST;
+    std::vector<ULONG> CpuSets; // empty means any core
+};
+
+static std::mutex g_decompressionPolicyMutex;
+static DecompressionPolicy g_decompressionPolicy;
+static std::atomic<uint32_t> g_decompressionPolicyVersion;
+static int32_t g_appliedPolicySettings[3] = { -1, -1, -1 };
+
+//
+// Returns the CPU sets the workers may run on for the given settings, or an
+// empty list when that would place no restriction on them.
+//
+static std::vector<ULONG> SelectWorkerCpuSets(WorkerAffinity affinity, uint32_t skipFirstCores)
+{
+    ULONG length = 0;
+    GetSystemCpuSetInformation(nullptr, 0, &length, GetCurrentProcess(), 0);
+    std::vector<uint8_t> buffer(length);
+    auto info = reinterpret_cast<SYSTEM_CPU_SET_INFORMATION*>(buffer.data());
+    if (length == 0 || !GetSystemCpuSetInformation(info, length, &length, GetCurrentProcess(), 0))
+        return {};
+
+    struct CpuSet
+    {
+        ULONG Id;
+        BYTE EfficiencyClass;
+    };
+    std::vector<CpuSet> cpuSets;
+    for (ULONG offset = 0; offset < length; offset += info->Size)
+    {
+        info = reinterpret_cast<SYSTEM_CPU_SET_INFORMATION*>(buffer.data() + offset);
+        if (info->Type == CpuSetInformation && !info->CpuSet.Parked)
+            cpuSets.push_back({info->CpuSet.Id, info->CpuSet.EfficiencyClass});
+    }
 
-    // Give this thread a high priority to ensure we perform decompression without
-    // excessive context switching between available cores.
-    auto oldPriority = GetThreadPriority(GetCurrentThread());
-    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+    // Leave the first cores to the rest of the game
+    if (skipFirstCores >= cpuSets.size())
+        return {};
+    cpuSets.erase(cpuSets.begin(), cpuSets.begin() + skipFirstCores);
 
-    // Get the next request.
-    DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST request;
+    // A higher efficiency class means a faster, less efficient, core.  On CPUs
+    // where every core is the same this selects all of them.
+    BYTE lowestClass = UINT8_MAX;
+    BYTE highestClass = 0;
+    for (CpuSet const& cpuSet : cpuSets)
     {
-        std::unique_lock lock(g_decompressionRequestsMutex);
+        lowestClass = std::min(lowestClass, cpuSet.EfficiencyClass);
+        highestClass = std::max(highestClass, cpuSet.EfficiencyClass);
+    }
 
-        // DecompressionWork is submitted once per request added to the deque
-        ASSERT(!g_decompressionRequests.empty());
+    std::vector<ULONG> ids;
+    for (CpuSet const& cpuSet : cpuSets)
+    {
+        if ((affinity == WorkerAffinity::EfficiencyCores && cpuSet.EfficiencyClass != lowestClass) ||
+            (affinity == WorkerAffinity::PerformanceCores && cpuSet.EfficiencyClass != highestClass))
+            continue;
+        ids.push_back(cpuSet.Id);
+    }
+
+    if (affinity == WorkerAffinity::AnyCore && skipFirstCores == 0)
+        ids.clear();
+    return ids;
+}
 
-        request = g_decompressionRequests.front();
-        g_decompressionRequests.pop_front();
+//
+// Rebuilds the policy if the tuning variables have changed since it was last
+// built.  Returns true if they had.
+//
+static bool UpdateDecompressionPolicy()
+{
+    int32_t settings[3] = { WorkerPriority, WorkerAffinityClass, SkipFirstCores };
+    if (std::equal(std::begin(settings), std::end(settings), std::begin(g_appliedPolicySettings)))
+        return false;
+    std::copy(std::begin(settings), std::end(settings), std::begin(g_appliedPolicySettings));
+
+    DecompressionPolicy policy;
+    policy.Priority = WorkerPriorities[settings[0]];
+    policy.CpuSets = SelectWorkerCpuSets(static_cast<WorkerAffinity>(settings[1]), settings[2]);
+
+    {
+        std::lock_guard lock(g_decompressionPolicyMutex);
+        g_decompressionPolicy = std::move(policy);
     }
-    
-    // We only expect ZLib requests
-    ASSERT(request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_ZLIB);
+    ++g_decompressionPolicyVersion;
+    return true;
+}
 
-    // If the destination is in an upload heap (write-combined memory) then it's
-    // better for us to first decompress to a scratch buffer and then copy that
-    // to the final destination.  This is because ZLib decompression tends to
-    // read from the destination buffer, which is extremely slow from
-    // write-combined memory.
-    std::unique_ptr<uint8_t[]> scratchBuffer;
-    void* decompressionDestination;
+//
+// Returns this thread's inflate stream, ready for a new request.  ZLib's state
+// and window are allocated the first time and then reused, so decompressing a
+// request allocates nothing.
+//
+static z_stream* AcquireInflateStream()
+{
+    struct InflateStream
+    {
+        z_stream Stream{};
+        bool Initialized = false;
+
+        ~InflateStream()
+        {
+            if (Initialized)
+                inflateEnd(&Stream);
+        }
+    };
+    static thread_local InflateStream inflateStream;
 
-    if (request.Flags & DSTORAGE_CUSTOM_DECOMPRESSION_FLAG_DEST_IN_UPLOAD_HEAP)
+    if (!inflateStream.Initialized)
     {
-        scratchBuffer.reset(new uint8_t[request.DstSize]);
-        decompressionDestination = scratchBuffer.get();
+        if (inflateInit(&inflateStream.Stream) != Z_OK)
+            return nullptr;
+        inflateStream.Initialized = true;
     }
-    else
+    else if (inflateReset(&inflateStream.Stream) != Z_OK)
+    {
+        return nullptr;
+    }
+
+    return &inflateStream.Stream;
+}
+
+//
+// Decompresses a request whose destination is ordinary memory, straight into
+// the destination.
+//
+static bool InflateToMemory(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+{
+#if USE_LIBDEFLATE
+    // libdeflate decodes the same ZLib streams faster.  It only works on whole
+    // buffers, reading back what it has written, so write-combined destinations
+    // still go through InflateToWriteCombined.
+    static thread_local std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+        decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+
+    return decompressor && libdeflate_zlib_decompress(
+                               decompressor.get(),
+                               request.SrcBuffer,
+                               request.SrcSize,
+                               request.DstBuffer,
+                               request.DstSize,
+                               nullptr) == LIBDEFLATE_SUCCESS;
+#else
+    z_stream* stream = AcquireInflateStream();
+    if (!stream)
+        return false;
+
+    stream->next_in = const_cast<Bytef*>(static_cast<Bytef const*>(request.SrcBuffer));
+    stream->avail_in = static_cast<uInt>(request.SrcSize);
+    stream->next_out = static_cast<Bytef*>(request.DstBuffer);
+    stream->avail_out = static_cast<uInt>(request.DstSize);
+
+    return inflate(stream, Z_FINISH) == Z_STREAM_END;
+#endif
+}
+
+//
+// Copies a slice into write-combined memory with non-temporal stores.  These
+// fill whole write-combining buffers without pulling the destination into the
+// cache, and leave the just-inflated slice in the cache for ZLib to reuse as
+// it decodes the next one.
+//
+static void StreamToWriteCombined(uint8_t* dst, uint8_t const* src, size_t size)
+{
+    size_t head = std::min(size, static_cast<size_t>((16 - reinterpret_cast<uintptr_t>(dst)) & 15));
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, src += 64, dst += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src) + 0);
+        __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src) + 1);
+        __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src) + 2);
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src) + 3);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst) + 0, a);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst) + 1, b);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst) + 2, c);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst) + 3, d);
+    }
+
+    memcpy(dst, src, size);
+}
+
+//
+// Decompresses a request whose destination is write-combined memory, writing
+// the destination strictly front to back and never reading from it.
+//
+static bool InflateToWriteCombined(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+{
+    constexpr uInt chunkSize = 256 * 1024;
+    static thread_local std::unique_ptr<uint8_t[]> chunk(new uint8_t[chunkSize]);
+
+    z_stream* stream = AcquireInflateStream();
+    if (!stream)
+        return false;
+
+    stream->next_in = const_cast<Bytef*>(static_cast<Bytef const*>(request.SrcBuffer));
+    stream->avail_in = static_cast<uInt>(request.SrcSize);
+
+    uint8_t* dst = static_cast<uint8_t*>(request.DstBuffer);
+    uint64_t remaining = request.DstSize;
+    int inflateResult;
+
+    do
+    {
+        stream->next_out = chunk.get();
+        stream->avail_out = chunkSize;
+
+        inflateResult = inflate(stream, Z_NO_FLUSH);
+        if (inflateResult != Z_OK && inflateResult != Z_STREAM_END)
+            break;
+
+        uint64_t produced = chunkSize - stream->avail_out;
+        if (produced > remaining)
+        {
+            inflateResult = Z_BUF_ERROR;
+            break;
+        }
+
+        StreamToWriteCombined(dst, chunk.get(), produced);
+        dst += produced;
+        remaining -= produced;
+    } while (inflateResult == Z_OK);
+
+    // Make the streaming stores visible before DirectStorage is told the
+    // request is complete
+    _mm_sfence();
+
+    return inflateResult == Z_STREAM_END;
+}
+
+//
+// Decompresses a request whose blocks were split into planes.  The planes are
+// inflated into a buffer owned by this thread, and the blocks put back
+// together from them are written to the destination front to back, so this
+// works whether or not the destination is write-combined.
+//
+static bool InflateBcSplit(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+{
+    marc::BcSplitHeader header;
+    if (request.SrcSize < sizeof(header))
+        return false;
+    memcpy(&header, request.SrcBuffer, sizeof(header));
+
+    uint32_t const blockSize = header.BlockSize;
+    if (blockSize == 0 || blockSize > 16 || (request.DstSize % blockSize) != 0)
+        return false;
+
+    static thread_local std::vector<uint8_t> planes;
+    planes.resize(request.DstSize);
+
+    DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST planesRequest = request;
+    planesRequest.SrcBuffer = static_cast<uint8_t const*>(request.SrcBuffer) + sizeof(header);
+    planesRequest.SrcSize = request.SrcSize - sizeof(header);
+    planesRequest.DstBuffer = planes.data();
+    if (!InflateToMemory(planesRequest))
+        return false;
+
+    uint64_t const numBlocks = request.DstSize / blockSize;
+    uint32_t const endpointMask = header.EndpointMask & ((1u << blockSize) - 1);
+    uint32_t const numEndpointBytes = std::popcount(endpointMask);
+
+    uint8_t const* endpoints = planes.data();
+    uint8_t const* indices = planes.data() + numBlocks * numEndpointBytes;
+    uint8_t* dst = static_cast<uint8_t*>(request.DstBuffer);
+
+    for (uint64_t i = 0; i < numBlocks; ++i)
     {
-        decompressionDestination = request.DstBuffer;
+        uint8_t block[16];
+        for (uint32_t b = 0; b < blockSize; ++b)
+            block[b] = (endpointMask & (1u << b)) ? *endpoints++ : *indices++;
+
+        memcpy(dst, block, blockSize);
+        dst += blockSize;
     }
 
-    // Perform the actual decompression
-    uLong decompressedSize = static_cast<uLong>(request.DstSize);
-    int uncompressResult = uncompress(
-        reinterpret_cast<Bytef*>(decompressionDestination),
-        &decompressedSize,
-        static_cast<Bytef const*>(request.SrcBuffer),
-        static_cast<uLong>(request.SrcSize));
+    return true;
+}
+
+static bool GDeflateOnCpu(void const* src, size_t srcSize, void* dst, size_t dstSize)
+{
+#if USE_GDEFLATE_LIBRARY
+    // Each 64 KiB tile decodes on its own, so a large region is spread over
+    // the library's pool, with this thread taking part.  Smaller ones stay on
+    // this thread, leaving the pool to the other workers' large regions.
+    static uint32_t const numThreads = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t const numWorkers = dstSize > static_cast<size_t>(LibraryParallelKiB) * 1024 ? numThreads : 1;
 
-    if (uncompressResult == Z_OK && decompressionDestination != request.DstBuffer)
+    return GDeflate::Decompress(
+        static_cast<uint8_t*>(dst),
+        dstSize,
+        static_cast<uint8_t const*>(src),
+        srcSize,
+        numWorkers);
+#else
+    // Each thread has its own codec, like MiniArchive's compression workers
+    static thread_local ComPtr<IDStorageCompressionCodec> codec;
+    if (!codec &&
+        FAILED(DStorageCreateCompressionCodec(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE, 1, IID_PPV_ARGS(&codec))))
     {
-        memcpy(request.DstBuffer, decompressionDestination, request.DstSize);
+        return false;
     }
 
+    size_t decompressedSize = 0;
+    return SUCCEEDED(codec->DecompressBuffer(src, srcSize, dst, dstSize, &decompressedSize)) &&
+           decompressedSize == dstSize;
+#endif
+}
+
+//
+// Decompresses a GDeflate request that RouteDecompression sent to the CPU.
+// Like ZLib, GDeflate reads back what it has written, so a write-combined
+// destination is decompressed into a buffer owned by this thread first.
+//
+static bool InflateGDeflate(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+{
+    if (!(request.Flags & DSTORAGE_CUSTOM_DECOMPRESSION_FLAG_DEST_IN_UPLOAD_HEAP))
+        return GDeflateOnCpu(request.SrcBuffer, request.SrcSize, request.DstBuffer, request.DstSize);
+
+    static thread_local std::vector<uint8_t> scratch;
+    scratch.resize(request.DstSize);
+    if (!GDeflateOnCpu(request.SrcBuffer, request.SrcSize, scratch.data(), scratch.size()))
+        return false;
+
+    StreamToWriteCombined(static_cast<uint8_t*>(request.DstBuffer), scratch.data(), scratch.size());
+    _mm_sfence();
+    return true;
+}
+
+//
+// Decompresses one request and reports its result to DirectStorage.
+//
+static void DecompressRequest(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+{
+    PIXScopedEvent(0, "OnDecompress");
+    ScopedTraceEvent traceEvent("DecompressRequest");
+
+    // We only expect ZLib requests, and GDeflate that was routed to the CPU
+    ASSERT(
+        request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_ZLIB ||
+        request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT ||
+        request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU);
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    ULONG64 startCycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &startCycles);
+
+    // If the destination is in an upload heap (write-combined memory) then we
+    // must not let ZLib decompress straight into it.  This is because ZLib
+    // decompression tends to read from the destination buffer, which is
+    // extremely slow from write-combined memory.  Instead, the data is inflated
+    // in small chunks into a buffer owned by this thread, which stays in the
+    // cache, and each chunk is copied out sequentially.  ZLib keeps its own copy
+    // of the window that back-references point into, so no scratch buffer the
+    // size of the whole destination is needed.
+    bool succeeded;
+
+    if (request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU)
+    {
+        succeeded = InflateGDeflate(request);
+    }
+    else if (request.CompressionFormat == CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT)
+    {
+        succeeded = InflateBcSplit(request);
+    }
+    else if (request.Flags & DSTORAGE_CUSTOM_DECOMPRESSION_FLAG_DEST_IN_UPLOAD_HEAP)
+    {
+        succeeded = InflateToWriteCombined(request);
+    }
+    else
+    {
+        succeeded = InflateToMemory(request);
+    }
+
+    ULONG64 endCycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &endCycles);
+    RecordCustomDecompression(
+        request.DstSize,
+        std::chrono::high_resolution_clock::now() - startTime,
+        endCycles - startCycles);
+
     // Tell DirectStorage that this request has been completed.
     DSTORAGE_CUSTOM_DECOMPRESSION_RESULT result{};
     result.Id = request.Id;
-    result.Result = uncompressResult == Z_OK ? S_OK : E_FAIL;
+    result.Result = succeeded ? S_OK : E_FAIL;
 
     g_customDecompressionQueue->SetRequestResults(1, &result);
+}
 
-    // Restore the original thread's priority back to its original setting.
-    SetThreadPriority(GetCurrentThread(), oldPriority);
+//
+// Takes a request from the worker's own queue, or failing that from another
+// worker's.
+//
+static bool TakeRequest(uint32_t workerIndex, DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST& request)
+{
+    uint32_t numQueues = static_cast<uint32_t>(g_decompressionQueues.size());
+    for (uint32_t i = 0; i < numQueues; ++i)
+    {
+        if (g_decompressionQueues[(workerIndex + i) % numQueues]->Pop(request))
+            return true;
+    }
+    return false;
+}
+
+//
+// Applies the current policy to the calling worker thread.
+//
+static void ApplyDecompressionPolicy(uint32_t workerIndex)
+{
+    DecompressionPolicy policy;
+    {
+        std::lock_guard lock(g_decompressionPolicyMutex);
+        policy = g_decompressionPolicy;
+    }
+
+    // By default this thread gets a high priority to ensure we perform
+    // decompression without excessive context switching between available cores.
+    SetThreadPriority(GetCurrentThread(), policy.Priority);
+
+    SetThreadSelectedCpuSets(GetCurrentThread(), policy.CpuSets.data(), static_cast<ULONG>(policy.CpuSets.size()));
+    if (policy.CpuSets.empty())
+        SetThreadIdealProcessor(GetCurrentThread(), workerIndex);
+}
+
+//
+// The body of each worker thread.  Requests are taken until none are left
+// anywhere, then the worker sleeps until the next batch arrives.
+//
+static void DecompressionWorker(uint32_t workerIndex)
+{
+    // Names the thread in the profiler's trace and in debuggers
+    SetThreadDescription(GetCurrentThread(), L"ZLib decompression worker");
+    RegisterCpuThread(CpuThreadClass::Decompression);
+
+    uint32_t appliedPolicyVersion = ~0u;
+
+    while (true)
+    {
+        if (appliedPolicyVersion != g_decompressionPolicyVersion)
+        {
+            appliedPolicyVersion = g_decompressionPolicyVersion;
+            ApplyDecompressionPolicy(workerIndex);
+        }
+
+        DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST request;
+        while (workerIndex < g_activeDecompressionWorkers && TakeRequest(workerIndex, request))
+            DecompressRequest(request);
+
+        // A worker that has been throttled may still have been handed requests
+        // just before; the first worker is always active and steals them.
+        if (workerIndex >= g_activeDecompressionWorkers)
+            SetEvent(g_decompressionWorkAvailable[0]);
+
+        if (g_shutdownDecompressionWorkers)
+            break;
+
+        WaitForSingleObject(g_decompressionWorkAvailable[workerIndex], INFINITE);
+    }
 }
 
 //
@@ -141,6 +670,7 @@ static void CALLBACK DecompressionWork(TP_CALLBACK_INSTANCE*, void*, TP_WORK*)
 static void CALLBACK OnCustomDecompressionRequestsAvailable(TP_CALLBACK_INSTANCE*, void*, TP_WAIT* wait, TP_WAIT_RESULT)
 {
     PIXScopedEvent(0, "OnCustomDecompressionRequestsReady");
+    ScopedTraceEvent traceEvent("OnCustomDecompressionRequestsReady");
 
     // Loop through all requests pending requests until no more remain.
     while (true)
@@ -156,20 +686,27 @@ static void CALLBACK OnCustomDecompressionRequestsAvailable(TP_CALLBACK_INSTANCE
         if (numRequests == 0)
             break;
 
-        std::unique_lock lock(g_decompressionRequestsMutex);
-
+        // Deal the batch out over the active workers' queues.  A request that
+        // finds every queue full is decompressed here instead.
+        uint32_t numQueues = g_activeDecompressionWorkers;
+        g_nextDecompressionQueue %= numQueues;
+        uint32_t firstQueue = g_nextDecompressionQueue;
         for (uint32_t i = 0; i < numRequests; ++i)
         {
-            g_decompressionRequests.push_back(requests[i]);
-        }
-
-        lock.unlock();
+            bool queued = false;
+            for (uint32_t attempt = 0; attempt < numQueues && !queued; ++attempt)
+            {
+                queued = g_decompressionQueues[g_nextDecompressionQueue]->Push(requests[i]);
+                g_nextDecompressionQueue = (g_nextDecompressionQueue + 1) % numQueues;
+            }
 
-        // Submit one piece of work for each request.
-        for (uint32_t i = 0; i < numRequests; ++i)
-        {
-            SubmitThreadpoolWork(g_decompressionWork);
+            if (!queued)
+                DecompressRequest(requests[i]);
         }
+
+        // Wake one worker per request, up to every active worker.
+        for (uint32_t i = 0; i < std::min(numRequests, numQueues); ++i)
+            SetEvent(g_decompressionWorkAvailable[(firstQueue + i) % numQueues]);
     }
 
     // Re-register the custom decompression queue event with this callback to be
@@ -178,42 +715,227 @@ static void CALLBACK OnCustomDecompressionRequestsAvailable(TP_CALLBACK_INSTANCE
     SetThreadpoolWait(wait, g_customDecompressionQueueEvent, nullptr);
 }
 
+//
+// Hybrid GDeflate decompression.
+//
+// GDeflate is normally decompressed on the GPU, but on a PC with a strong CPU
+// and a GPU that is busy rendering it can be quicker to let the CPU take part
+// of it.  RouteDecompression picks a path for each GDeflate request as it is
+// enqueued:
+//
+// * While the workers have more requests waiting than they can get through
+//   soon, everything goes to the GPU.
+//
+// * Requests no larger than the small request size go to the CPU, where they
+//   cost little more than a copy.
+//
+// * The bytes of the larger requests are split between the two paths, with
+//   g_hybridCpuShare of them going to the CPU.  UpdateDStorage grows the share
+//   while the GPU is busier than the threshold and the workers keep up, and
+//   shrinks it otherwise.
+//
+// A request sent to the CPU is enqueued as CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU,
+// and decompressed by the same workers as ZLib.
+//
+// Built with the GDeflate library, GDeflate requests whose destination is
+// memory always go to the workers, which decode them with the library instead
+// of leaving them to the runtime's own CPU decompressor.
+//
+
+static bool g_gpuDecompressionEnabled;
+
+static std::mutex g_hybridMutex;
+static float g_hybridCpuShare;
+static double g_hybridCpuCredit;  // Bytes the CPU is owed, so the split is exact over many requests
+
+static std::atomic<uint64_t> g_hybridGpuByteCount;
+static std::atomic<uint64_t> g_hybridCpuByteCount;
+
+// A worker with more than this many requests waiting is falling behind
+static constexpr uint32_t MaxHybridBacklogPerWorker = 4;
+
+static bool AreDecompressionWorkersBehind()
+{
+    uint32_t backlog = 0;
+    for (auto const& queue : g_decompressionQueues)
+        backlog += queue->GetSize();
+    return backlog >= g_activeDecompressionWorkers * MaxHybridBacklogPerWorker;
+}
+
+void RouteDecompression(DSTORAGE_REQUEST& request)
+{
+    if (request.Options.CompressionFormat != DSTORAGE_COMPRESSION_FORMAT_GDEFLATE)
+        return;
+
+#if USE_GDEFLATE_LIBRARY
+    if (LibraryCpuGDeflate && request.Options.DestinationType == DSTORAGE_REQUEST_DESTINATION_MEMORY)
+    {
+        request.Options.CompressionFormat = CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU;
+        return;
+    }
+#endif
+
+    if (!HybridDecompression || !g_gpuDecompressionEnabled)
+        return;
+
+    bool toCpu = false;
+    if (!AreDecompressionWorkersBehind())
+    {
+        if (request.UncompressedSize <= static_cast<uint32_t>(HybridSmallRequestKiB) * 1024)
+        {
+            toCpu = true;
+        }
+        else
+        {
+            std::lock_guard lock(g_hybridMutex);
+            g_hybridCpuCredit += request.UncompressedSize * static_cast<double>(g_hybridCpuShare);
+            if (g_hybridCpuCredit >= request.UncompressedSize)
+            {
+                g_hybridCpuCredit -= request.UncompressedSize;
+                toCpu = true;
+            }
+        }
+    }
+
+    if (toCpu)
+    {
+        request.Options.CompressionFormat = CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU;
+        g_hybridCpuByteCount += request.UncompressedSize;
+    }
+    else
+    {
+        g_hybridGpuByteCount += request.UncompressedSize;
+    }
+}
+
+HybridDecompressionStats GetHybridDecompressionStats()
+{
+    std::lock_guard lock(g_hybridMutex);
+    return {g_hybridGpuByteCount, g_hybridCpuByteCount, g_hybridCpuShare};
+}
+
+void ResetHybridDecompressionStats()
+{
+    g_hybridGpuByteCount = 0;
+    g_hybridCpuByteCount = 0;
+}
+
 //
 // Public entry points
 //
 
-void InitializeDStorage(bool disableGpuDecompression)
+void InitializeDStorage(bool disableGpuDecompression, std::filesystem::path const& calibrationFile)
 {
     DSTORAGE_CONFIGURATION config{};
     config.DisableGpuDecompression = disableGpuDecompression;
     ASSERT_SUCCEEDED(DStorageSetConfiguration(&config));
+    g_gpuDecompressionEnabled = !disableGpuDecompression;
 
     ASSERT_SUCCEEDED(DStorageGetFactory(IID_PPV_ARGS(&g_dsFactory)));
     g_dsFactory->SetDebugFlags(DSTORAGE_DEBUG_BREAK_ON_ERROR | DSTORAGE_DEBUG_SHOW_ERRORS);
-    g_dsFactory->SetStagingBufferSize(256 * 1024 * 1024);
 
-    // Create the system memory queue, used for reading data into system memory.
+    // The staging buffer size can also be given on the command line, which
+    // skips calibration.
+    DStorageSettings settings;
+    uint32_t stagingBufferSizeMiB = 0;
+    if (CommandLineArgs::GetInteger(L"staging-buffer-mib", stagingBufferSizeMiB) && stagingBufferSizeMiB > 0)
     {
-        DSTORAGE_QUEUE_DESC queueDesc{};
-        queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
-        queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
-        queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-        queueDesc.Name = "g_dsSystemMemoryQueue";
-
-        ASSERT_SUCCEEDED(g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsSystemMemoryQueue)));
+        settings.StagingBufferSize = stagingBufferSizeMiB * 1024 * 1024;
     }
+    else
+    {
+        uint32_t recalibrate = 0;
+        CommandLineArgs::GetInteger(L"recalibrate", recalibrate);
+        settings = LoadOrCalibrateDStorageSettings(g_dsFactory.Get(), calibrationFile, recalibrate != 0);
+    }
+    g_dsFactory->SetStagingBufferSize(settings.StagingBufferSize);
+    g_stagingBufferSize = settings.StagingBufferSize;
+
+    static char const* priorityNames[DSTORAGE_PRIORITY_COUNT] = {"Low", "Normal", "High", "Realtime"};
 
-    // Create the GPU queue, used for reading GPU resources.
+    for (uint32_t i = 0; i < DSTORAGE_PRIORITY_COUNT; ++i)
     {
-        DSTORAGE_QUEUE_DESC queueDesc{};
-        queueDesc.Device = Graphics::g_Device;
-        queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
-        queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
-        queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-        queueDesc.Name = "g_dsGpuQueue";
+        char name[64];
 
-        ASSERT_SUCCEEDED(g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsGpuQueue)));
+        // Create the system memory queue, used for reading data into system memory.
+        {
+            sprintf_s(name, "g_dsSystemMemoryQueues[%s]", priorityNames[i]);
+
+            // The device isn't needed for system memory destinations, but it
+            // is for EnqueueSignal, which CompletionFences uses.
+            DSTORAGE_QUEUE_DESC queueDesc{};
+            queueDesc.Device = Graphics::g_Device;
+            queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+            queueDesc.Priority = GetPriorityFromIndex(i);
+            queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+            queueDesc.Name = name;
+
+            ASSERT_SUCCEEDED(g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsSystemMemoryQueues[i])));
+        }
+
+        // Create the GPU queue, used for reading GPU resources.
+        {
+            sprintf_s(name, "g_dsGpuQueues[%s]", priorityNames[i]);
+
+            DSTORAGE_QUEUE_DESC queueDesc{};
+            queueDesc.Device = Graphics::g_Device;
+            queueDesc.Capacity = settings.QueueCapacity;
+            queueDesc.Priority = GetPriorityFromIndex(i);
+            queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+            queueDesc.Name = name;
+
+            ASSERT_SUCCEEDED(g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsGpuQueues[i])));
+        }
+
+        // A queue only accepts requests of its source type, so requests that
+        // read from memory, such as data that was read ahead of time, have
+        // queues of their own.
+        {
+            sprintf_s(name, "g_dsMemorySourceSystemMemoryQueues[%s]", priorityNames[i]);
+
+            DSTORAGE_QUEUE_DESC queueDesc{};
+            queueDesc.Device = Graphics::g_Device;
+            queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+            queueDesc.Priority = GetPriorityFromIndex(i);
+            queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+            queueDesc.Name = name;
+
+            ASSERT_SUCCEEDED(
+                g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsMemorySourceSystemMemoryQueues[i])));
+        }
+
+        {
+            sprintf_s(name, "g_dsMemorySourceGpuQueues[%s]", priorityNames[i]);
+
+            DSTORAGE_QUEUE_DESC queueDesc{};
+            queueDesc.Device = Graphics::g_Device;
+            queueDesc.Capacity = settings.QueueCapacity;
+            queueDesc.Priority = GetPriorityFromIndex(i);
+            queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+            queueDesc.Name = name;
+
+            ASSERT_SUCCEEDED(g_dsFactory->CreateQueue(&queueDesc, IID_PPV_ARGS(&g_dsMemorySourceGpuQueues[i])));
+        }
+    }
+
+    g_dsSystemMemoryQueue = g_dsSystemMemoryQueues[GetPriorityIndex(DSTORAGE_PRIORITY_NORMAL)];
+    g_dsGpuQueue = g_dsGpuQueues[GetPriorityIndex(DSTORAGE_PRIORITY_NORMAL)];
+
+    // Start the decompression workers, by default one per core, before any
+    // requests can arrive
+    uint32_t numWorkers = WorkerCount > 0 ? WorkerCount : std::max(1u, std::thread::hardware_concurrency());
+    g_shutdownDecompressionWorkers = false;
+    g_activeDecompressionWorkers = numWorkers;
+    g_nextDecompressionQueue = 0;
+    std::fill(std::begin(g_appliedPolicySettings), std::end(g_appliedPolicySettings), -1);
+    UpdateDecompressionPolicy();
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        g_decompressionQueues.push_back(std::make_unique<DecompressionQueue>());
+        g_decompressionWorkAvailable.push_back(CreateEvent(nullptr, FALSE, FALSE, nullptr));
     }
+    for (uint32_t i = 0; i < numWorkers; ++i)
+        g_decompressionWorkers.emplace_back(DecompressionWorker, i);
 
     // Configure custom decompression queue
     ASSERT_SUCCEEDED(g_dsFactory.As(&g_customDecompressionQueue));
@@ -221,8 +943,104 @@ void InitializeDStorage(bool disableGpuDecompression)
     g_customDecompressionRequestsAvailableWait =
         CreateThreadpoolWait(OnCustomDecompressionRequestsAvailable, nullptr, nullptr);
     SetThreadpoolWait(g_customDecompressionRequestsAvailableWait, g_customDecompressionQueueEvent, nullptr);
+}
+
+void UpdateDStorage(float frameTime)
+{
+    if (g_decompressionWorkers.empty())
+        return;
 
-    g_decompressionWork = CreateThreadpoolWork(DecompressionWork, nullptr, nullptr);
+    uint32_t numWorkers = static_cast<uint32_t>(g_decompressionWorkers.size());
+    uint32_t activeWorkers = g_activeDecompressionWorkers;
+    uint32_t newActiveWorkers = numWorkers;
+
+    // Halve the workers while frames run over budget, so the game gets its cores
+    // back quickly, and return them one at a time once there is some headroom.
+    float budget = FrameBudget / 1000.0f;
+    if (budget > 0.0f)
+    {
+        if (frameTime > budget)
+            newActiveWorkers = std::max(1u, activeWorkers / 2);
+        else if (frameTime < budget * 0.9f)
+            newActiveWorkers = std::min(numWorkers, activeWorkers + 1);
+        else
+            newActiveWorkers = activeWorkers;
+    }
+
+    if (newActiveWorkers != activeWorkers)
+    {
+        g_activeDecompressionWorkers = newActiveWorkers;
+
+        // Newly active workers may already have requests waiting
+        for (uint32_t i = activeWorkers; i < newActiveWorkers; ++i)
+            SetEvent(g_decompressionWorkAvailable[i]);
+    }
+
+    // Wake every worker so that each applies a changed policy to itself
+    if (UpdateDecompressionPolicy())
+    {
+        for (HANDLE workAvailable : g_decompressionWorkAvailable)
+            SetEvent(workAvailable);
+    }
+
+    // Move GDeflate towards the CPU a step at a time while the GPU is busy
+    // and the workers keep up, and back once either changes
+    if (HybridDecompression && g_gpuDecompressionEnabled)
+    {
+        constexpr float step = 0.05f;
+        bool gpuBusy = EngineProfiling::GetGpuBusyFraction() * 100.0f > HybridGpuBusy;
+        bool workersBehind = AreDecompressionWorkersBehind();
+
+        std::lock_guard lock(g_hybridMutex);
+        g_hybridCpuShare = std::clamp(g_hybridCpuShare + (gpuBusy && !workersBehind ? step : -step), 0.0f, 1.0f);
+    }
+}
+
+IDStorageQueue1* GetSystemMemoryQueue(DSTORAGE_PRIORITY priority, DSTORAGE_REQUEST_SOURCE_TYPE sourceType)
+{
+    if (sourceType == DSTORAGE_REQUEST_SOURCE_MEMORY)
+        return g_dsMemorySourceSystemMemoryQueues[GetPriorityIndex(priority)].Get();
+    return g_dsSystemMemoryQueues[GetPriorityIndex(priority)].Get();
+}
+
+IDStorageQueue1* GetGpuQueue(DSTORAGE_PRIORITY priority, DSTORAGE_REQUEST_SOURCE_TYPE sourceType)
+{
+    if (sourceType == DSTORAGE_REQUEST_SOURCE_MEMORY)
+        return g_dsMemorySourceGpuQueues[GetPriorityIndex(priority)].Get();
+    return g_dsGpuQueues[GetPriorityIndex(priority)].Get();
+}
+
+uint32_t GetStagingBufferSize()
+{
+    return g_stagingBufferSize;
+}
+
+bool DecompressOnCpu(DSTORAGE_COMPRESSION_FORMAT format, void const* src, size_t srcSize, void* dst, size_t dstSize)
+{
+    DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST request{};
+    request.CompressionFormat = format;
+    request.SrcBuffer = src;
+    request.SrcSize = srcSize;
+    request.DstBuffer = dst;
+    request.DstSize = dstSize;
+
+    switch (format)
+    {
+    case DSTORAGE_COMPRESSION_FORMAT_NONE:
+        if (srcSize != dstSize)
+            return false;
+        memcpy(dst, src, dstSize);
+        return true;
+
+    case DSTORAGE_COMPRESSION_FORMAT_GDEFLATE:
+        return GDeflateOnCpu(src, srcSize, dst, dstSize);
+
+    case CUSTOM_COMPRESSION_FORMAT_ZLIB:
+        return InflateToMemory(request);
+
+    default:
+        return false;
+    }
 }
 
 void ShutdownDStorage()
@@ -230,12 +1048,34 @@ void ShutdownDStorage()
     if (!g_dsFactory)
         return;
 
+    // Stop the callback that feeds the workers, then let them finish what they
+    // have queued before they exit
+    SetThreadpoolWait(g_customDecompressionRequestsAvailableWait, nullptr, nullptr);
+    WaitForThreadpoolWaitCallbacks(g_customDecompressionRequestsAvailableWait, TRUE);
     CloseThreadpoolWait(g_customDecompressionRequestsAvailableWait);
-    CloseThreadpoolWork(g_decompressionWork);
+
+    g_shutdownDecompressionWorkers = true;
+    for (HANDLE workAvailable : g_decompressionWorkAvailable)
+        SetEvent(workAvailable);
+    for (auto& worker : g_decompressionWorkers)
+        worker.join();
+    g_decompressionWorkers.clear();
+    g_decompressionQueues.clear();
+    for (HANDLE workAvailable : g_decompressionWorkAvailable)
+        CloseHandle(workAvailable);
+    g_decompressionWorkAvailable.clear();
+
     g_customDecompressionQueue.Reset();
     CloseHandle(g_customDecompressionQueueEvent);
 
     g_dsGpuQueue.Reset();
     g_dsSystemMemoryQueue.Reset();
+    for (uint32_t i = 0; i < DSTORAGE_PRIORITY_COUNT; ++i)
+    {
+        g_dsGpuQueues[i].Reset();
+        g_dsSystemMemoryQueues[i].Reset();
+        g_dsMemorySourceGpuQueues[i].Reset();
+        g_dsMemorySourceSystemMemoryQueues[i].Reset();
+    }
     g_dsFactory.Reset();
 }
@@ -12,13 +12,70 @@
 #include <dstorage.h>
 #include <wrl/client.h>
 
-void InitializeDStorage(bool disableGpuDecompression);
+#include <filesystem>
+
+// calibrationFile is read to tune the staging buffer size and queue capacity
+// the first time the demo runs on this PC; see DStorageSettings.h.
+void InitializeDStorage(bool disableGpuDecompression, std::filesystem::path const& calibrationFile);
+void UpdateDStorage(float frameTime);
 void ShutdownDStorage();
 
 extern Microsoft::WRL::ComPtr<IDStorageFactory> g_dsFactory;
+
+//
+// There is a system memory queue and a GPU queue for each DSTORAGE_PRIORITY,
+// so that critical data isn't held up behind bulk streaming.  These read from
+// files; there is another set of queues for requests that read from memory.
+// g_dsSystemMemoryQueue and g_dsGpuQueue are the DSTORAGE_PRIORITY_NORMAL
+// queues.
+//
 extern Microsoft::WRL::ComPtr<IDStorageQueue1> g_dsSystemMemoryQueue;
 extern Microsoft::WRL::ComPtr<IDStorageQueue1> g_dsGpuQueue;
 
+constexpr uint32_t GetPriorityIndex(DSTORAGE_PRIORITY priority)
+{
+    return static_cast<uint32_t>(priority - DSTORAGE_PRIORITY_FIRST);
+}
+
+constexpr DSTORAGE_PRIORITY GetPriorityFromIndex(uint32_t index)
+{
+    return static_cast<DSTORAGE_PRIORITY>(DSTORAGE_PRIORITY_FIRST + static_cast<int32_t>(index));
+}
+
+IDStorageQueue1* GetSystemMemoryQueue(
+    DSTORAGE_PRIORITY priority,
+    DSTORAGE_REQUEST_SOURCE_TYPE sourceType = DSTORAGE_REQUEST_SOURCE_FILE);
+IDStorageQueue1* GetGpuQueue(
+    DSTORAGE_PRIORITY priority,
+    DSTORAGE_REQUEST_SOURCE_TYPE sourceType = DSTORAGE_REQUEST_SOURCE_FILE);
+
+// The staging buffer size that the factory was given, in bytes
+uint32_t GetStagingBufferSize();
+
+// Chooses whether a GDeflate request is decompressed on the GPU or by the CPU
+// decompression workers, when "DirectStorage/Decompression/Hybrid GDeflate"
+// is set, and changes its format to match.  Call it on each request before
+// it's enqueued; other requests are left as they are.
+void RouteDecompression(DSTORAGE_REQUEST& request);
+
+// The GDeflate bytes (uncompressed) that RouteDecompression has sent each
+// way since the last reset, and the share of the larger requests that it
+// currently sends to the CPU.
+struct HybridDecompressionStats
+{
+    uint64_t GpuByteCount;
+    uint64_t CpuByteCount;
+    float CpuShare;
+};
+
+HybridDecompressionStats GetHybridDecompressionStats();
+void ResetHybridDecompressionStats();
+
+// Decompresses a buffer on the calling thread, for data too small to be worth
+// a DirectStorage request.  Returns false if it fails, or if the format can't
+// be decompressed this way.
+bool DecompressOnCpu(DSTORAGE_COMPRESSION_FORMAT format, void const* src, size_t srcSize, void* dst, size_t dstSize);
+
 //
 // ZLib is supported via custom compression.  The CUSTOM_COMPRESSION_FORMAT_ZLIB
 // constant provides a more meaningful name that DSTORAGE_CUSTOM_COMPRESSION_0.
@@ -26,3 +83,15 @@ extern Microsoft::WRL::ComPtr<IDStorageQueue1> g_dsGpuQueue;
 
 constexpr DSTORAGE_COMPRESSION_FORMAT CUSTOM_COMPRESSION_FORMAT_ZLIB = DSTORAGE_CUSTOM_COMPRESSION_0;
 
+// ZLib over BCn blocks split into planes (marc::Compression::ZlibBcSplit).  The
+// blocks are put back together by the same custom decompression.
+constexpr DSTORAGE_COMPRESSION_FORMAT CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT =
+    static_cast<DSTORAGE_COMPRESSION_FORMAT>(DSTORAGE_CUSTOM_COMPRESSION_0 + 1);
+
+// GDeflate that RouteDecompression has sent to the CPU.  The data is the same
+// GDeflate stream; only the format that the request is enqueued with differs,
+// so that DirectStorage hands it to the custom decompression queue.  It
+// never appears in a file.
+constexpr DSTORAGE_COMPRESSION_FORMAT CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU =
+    static_cast<DSTORAGE_COMPRESSION_FORMAT>(DSTORAGE_CUSTOM_COMPRESSION_0 + 2);
+
@@ -0,0 +1,275 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "DStorageSettings.h"
+
+#include <GraphicsCore.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using Microsoft::WRL::ComPtr;
+
+static constexpr wchar_t SettingsFilename[] = L"DStorageSettings.txt";
+
+// Each calibration run reads this much, in requests of this size, wrapping
+// around the file if it is smaller.
+static constexpr uint64_t CalibrationReadSize = 256 * 1024 * 1024;
+static constexpr uint32_t CalibrationRequestSize = 1024 * 1024;
+static constexpr uint32_t CalibrationBufferSize = 64 * 1024 * 1024;
+
+// The smallest setting that gets within this fraction of the best bandwidth is
+// chosen, so that memory isn't spent on the last few percent.
+static constexpr double BandwidthTolerance = 0.95;
+
+//
+// Settings are keyed by the GPU, since that determines how quickly the staging
+// buffer drains, and by the volume, since that determines how quickly it
+// fills.
+//
+static std::wstring GetSettingsKey(std::filesystem::path const& calibrationFile)
+{
+    ComPtr<IDXGIFactory4> dxgiFactory;
+    ComPtr<IDXGIAdapter1> dxgiAdapter;
+    DXGI_ADAPTER_DESC1 adapterDesc{};
+    if (SUCCEEDED(CreateDXGIFactory1(IID_PPV_ARGS(&dxgiFactory))) &&
+        SUCCEEDED(dxgiFactory->EnumAdapterByLuid(Graphics::g_Device->GetAdapterLuid(), IID_PPV_ARGS(&dxgiAdapter))))
+    {
+        dxgiAdapter->GetDesc1(&adapterDesc);
+    }
+
+    wchar_t volume[MAX_PATH] = L"";
+    GetVolumePathNameW(std::filesystem::absolute(calibrationFile).c_str(), volume, _countof(volume));
+
+    wchar_t key[MAX_PATH + 32];
+    swprintf_s(key, L"%04x:%04x:%s", adapterDesc.VendorId, adapterDesc.DeviceId, volume);
+    return key;
+}
+
+static bool LoadSettings(std::wstring const& key, DStorageSettings& settings)
+{
+    std::wifstream file(SettingsFilename);
+    std::wstring line;
+    while (std::getline(file, line))
+    {
+        // Each line is "<key> <staging buffer size> <queue capacity>"
+        std::wistringstream fields(line);
+        std::wstring lineKey;
+        uint32_t stagingBufferSize = 0;
+        uint32_t queueCapacity = 0;
+        if (!(fields >> lineKey >> stagingBufferSize >> queueCapacity) || lineKey != key)
+            continue;
+
+        if (stagingBufferSize == 0 || queueCapacity < DSTORAGE_MIN_QUEUE_CAPACITY ||
+            queueCapacity > DSTORAGE_MAX_QUEUE_CAPACITY)
+            return false;
+
+        settings.StagingBufferSize = stagingBufferSize;
+        settings.QueueCapacity = static_cast<uint16_t>(queueCapacity);
+        return true;
+    }
+    return false;
+}
+
+static void SaveSettings(std::wstring const& key, DStorageSettings const& settings)
+{
+    // Keep the settings for other GPUs and volumes
+    std::vector<std::wstring> lines;
+    {
+        std::wifstream file(SettingsFilename);
+        std::wstring line;
+        while (std::getline(file, line))
+        {
+            if (line.compare(0, key.size() + 1, key + L" ") != 0)
+                lines.push_back(line);
+        }
+    }
+
+    std::wofstream file(SettingsFilename, std::ios::trunc);
+    for (auto const& line : lines)
+        file << line << L"\n";
+    file << key << L" " << settings.StagingBufferSize << L" " << settings.QueueCapacity << L"\n";
+}
+
+//
+// Reads CalibrationReadSize bytes of the file into a GPU buffer through a
+// queue with the given capacity, returning the bandwidth in bytes per second,
+// or 0 if the reads failed.
+//
+static double MeasureBandwidth(
+    IDStorageFactory* factory,
+    IDStorageFile* file,
+    uint64_t fileSize,
+    ID3D12Resource* buffer,
+    uint16_t queueCapacity)
+{
+    DSTORAGE_QUEUE_DESC queueDesc{};
+    queueDesc.Device = Graphics::g_Device;
+    queueDesc.Capacity = queueCapacity;
+    queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+    queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    queueDesc.Name = "DStorageSettings calibration";
+
+    ComPtr<IDStorageQueue> queue;
+    if (FAILED(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(&queue))))
+        return 0;
+
+    ComPtr<ID3D12Fence> fence;
+    ASSERT_SUCCEEDED(Graphics::g_Device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence)));
+    HANDLE fenceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    fence->SetEventOnCompletion(1, fenceEvent);
+
+    // The clock starts before enqueuing, since a small queue fills up and
+    // makes EnqueueRequest wait for earlier requests to complete.
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    uint64_t sourceOffset = 0;
+    uint64_t destOffset = 0;
+    for (uint64_t bytesRead = 0; bytesRead < CalibrationReadSize; bytesRead += CalibrationRequestSize)
+    {
+        uint32_t size = static_cast<uint32_t>(std::min<uint64_t>(CalibrationRequestSize, fileSize - sourceOffset));
+
+        DSTORAGE_REQUEST request{};
+        request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+        request.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+        request.Source.File.Source = file;
+        request.Source.File.Offset = sourceOffset;
+        request.Source.File.Size = size;
+        request.UncompressedSize = size;
+        request.Destination.Buffer.Resource = buffer;
+        request.Destination.Buffer.Offset = destOffset;
+        request.Destination.Buffer.Size = size;
+        queue->EnqueueRequest(&request);
+
+        sourceOffset = (sourceOffset + size) % fileSize;
+        destOffset = (destOffset + CalibrationRequestSize) % CalibrationBufferSize;
+    }
+
+    queue->EnqueueSignal(fence.Get(), 1);
+    queue->Submit();
+    WaitForSingleObject(fenceEvent, INFINITE);
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime);
+    CloseHandle(fenceEvent);
+
+    DSTORAGE_ERROR_RECORD errorRecord{};
+    queue->RetrieveErrorRecord(&errorRecord);
+    if (FAILED(errorRecord.FirstFailure.HResult))
+        return 0;
+
+    return CalibrationReadSize / elapsed.count();
+}
+
+//
+// Measures each candidate and returns the smallest one within
+// BandwidthTolerance of the best.  Candidates must be in increasing order.
+//
+template<typename T, typename MEASURE>
+static T SelectSmallestFastEnough(std::vector<T> const& candidates, MEASURE measure)
+{
+    std::vector<double> bandwidths;
+    for (T candidate : candidates)
+        bandwidths.push_back(measure(candidate));
+
+    double best = *std::max_element(bandwidths.begin(), bandwidths.end());
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        if (best > 0 && bandwidths[i] >= best * BandwidthTolerance)
+            return candidates[i];
+    }
+    return candidates.back();
+}
+
+static DStorageSettings Calibrate(IDStorageFactory* factory, std::filesystem::path const& calibrationFile)
+{
+    DStorageSettings settings;
+
+    ComPtr<IDStorageFile> file;
+    BY_HANDLE_FILE_INFORMATION info{};
+    if (FAILED(factory->OpenFile(calibrationFile.c_str(), IID_PPV_ARGS(&file))) ||
+        FAILED(file->GetFileInformation(&info)))
+        return settings;
+
+    uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    if (fileSize == 0)
+        return settings;
+
+    D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+    D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(CalibrationBufferSize);
+    ComPtr<ID3D12Resource> buffer;
+    ASSERT_SUCCEEDED(Graphics::g_Device->CreateCommittedResource(
+        &heapProperties,
+        D3D12_HEAP_FLAG_NONE,
+        &bufferDesc,
+        D3D12_RESOURCE_STATE_COMMON,
+        nullptr,
+        IID_PPV_ARGS(&buffer)));
+
+    // The staging buffer size must be set before any queues are created, so
+    // each measurement uses a queue of its own.
+    settings.StagingBufferSize = SelectSmallestFastEnough<uint32_t>(
+        {16 * 1024 * 1024, 32 * 1024 * 1024, 64 * 1024 * 1024, 128 * 1024 * 1024, 256 * 1024 * 1024},
+        [&](uint32_t stagingBufferSize)
+        {
+            factory->SetStagingBufferSize(stagingBufferSize);
+            double bandwidth =
+                MeasureBandwidth(factory, file.Get(), fileSize, buffer.Get(), DSTORAGE_MAX_QUEUE_CAPACITY);
+            Utility::Printf(
+                "DirectStorage calibration: %3u MiB staging buffer, %.2f GB/s\n",
+                stagingBufferSize / 1024 / 1024,
+                bandwidth / 1000.0 / 1000.0 / 1000.0);
+            return bandwidth;
+        });
+
+    factory->SetStagingBufferSize(settings.StagingBufferSize);
+    settings.QueueCapacity = SelectSmallestFastEnough<uint16_t>(
+        {256, 1024, 4096, DSTORAGE_MAX_QUEUE_CAPACITY},
+        [&](uint16_t queueCapacity)
+        {
+            double bandwidth = MeasureBandwidth(factory, file.Get(), fileSize, buffer.Get(), queueCapacity);
+            Utility::Printf(
+                "DirectStorage calibration: %5u queue capacity, %.2f GB/s\n",
+                queueCapacity,
+                bandwidth / 1000.0 / 1000.0 / 1000.0);
+            return bandwidth;
+        });
+
+    return settings;
+}
+
+DStorageSettings LoadOrCalibrateDStorageSettings(
+    IDStorageFactory* factory,
+    std::filesystem::path const& calibrationFile,
+    bool recalibrate)
+{
+    DStorageSettings settings;
+    if (calibrationFile.empty())
+        return settings;
+
+    std::wstring key = GetSettingsKey(calibrationFile);
+    if (!recalibrate && LoadSettings(key, settings))
+        return settings;
+
+    settings = Calibrate(factory, calibrationFile);
+    SaveSettings(key, settings);
+
+    Utility::Printf(
+        "DirectStorage calibration: using a %u MiB staging buffer and queue capacity of %u\n",
+        settings.StagingBufferSize / 1024 / 1024,
+        settings.QueueCapacity);
+
+    return settings;
+}
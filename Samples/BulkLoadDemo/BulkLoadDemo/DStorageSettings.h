@@ -0,0 +1,35 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <dstorage.h>
+
+#include <filesystem>
+
+//
+// The staging buffer size and queue capacity that give the best bandwidth
+// vary a lot between PCs.  Rather than use the same values everywhere, they
+// are measured the first time the demo runs on a given GPU and drive and saved
+// to DStorageSettings.txt in the working directory.
+//
+
+struct DStorageSettings
+{
+    uint32_t StagingBufferSize = 256 * 1024 * 1024;
+    uint16_t QueueCapacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+};
+
+// Returns the saved settings for this GPU and the drive that holds
+// calibrationFile, calibrating with reads of calibrationFile if there are none
+// or recalibrate is set.  Must be called before the factory creates any queues.
+DStorageSettings LoadOrCalibrateDStorageSettings(
+    IDStorageFactory* factory,
+    std::filesystem::path const& calibrationFile,
+    bool recalibrate);
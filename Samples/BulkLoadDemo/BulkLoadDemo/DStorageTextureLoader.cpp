@@ -0,0 +1,231 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "DStorageTextureLoader.h"
+#include "DStorageLoader.h"
+
+#include <DDSTextureLoader.h>
+#include <GraphicsCore.h>
+#include <wrl/wrappers/corewrappers.h>
+
+#include <algorithm>
+
+using Microsoft::WRL::ComPtr;
+
+// Stays well below the smallest staging buffer that DStorageSettings picks, so
+// that large mips are split into bands of rows.
+static constexpr uint32_t MaxRequestSize = 4 * 1024 * 1024;
+
+static HRESULT WaitForQueue(IDStorageQueue1* queue)
+{
+    Microsoft::WRL::Wrappers::Event event(CreateEventW(nullptr, FALSE, FALSE, nullptr));
+    if (!event.IsValid())
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    queue->EnqueueSetEvent(event.Get());
+    queue->Submit();
+    WaitForSingleObject(event.Get(), INFINITE);
+
+    DSTORAGE_ERROR_RECORD errorRecord{};
+    queue->RetrieveErrorRecord(&errorRecord);
+    return errorRecord.FirstFailure.HResult;
+}
+
+//
+// Reads the rows [firstRow, firstRow + numRows) of a subresource into the box
+// that they cover.
+//
+static void EnqueueReadRows(
+    IDStorageFile* file,
+    ID3D12Resource* resource,
+    DDS_TEXTURE_LAYOUT const& layout,
+    uint32_t subresourceIndex,
+    uint32_t firstRow,
+    uint32_t numRows)
+{
+    DDS_SUBRESOURCE_LAYOUT const& subresource = layout.Subresources[subresourceIndex];
+
+    DSTORAGE_REQUEST r{};
+    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION;
+    r.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+    r.Source.File.Source = file;
+    r.Source.File.Offset = subresource.Offset + static_cast<uint64_t>(firstRow) * subresource.RowPitch;
+    r.Source.File.Size = numRows * subresource.RowPitch;
+    r.UncompressedSize = r.Source.File.Size;
+    r.Destination.Texture.Resource = resource;
+    r.Destination.Texture.SubresourceIndex = subresourceIndex;
+
+    D3D12_BOX destBox{};
+    destBox.top = firstRow * layout.BlockHeight;
+    destBox.right = subresource.Width;
+    destBox.bottom = std::min(subresource.Height, (firstRow + numRows) * layout.BlockHeight);
+    destBox.back = 1;
+
+    r.Destination.Texture.Region = destBox;
+
+    g_dsGpuQueue->EnqueueRequest(&r);
+}
+
+//
+// Reads a chunk of a packed file, which is already laid out as
+// DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES expects.
+//
+static void EnqueueReadChunk(
+    IDStorageFile* file,
+    ID3D12Resource* resource,
+    DDS_TEXTURE_LAYOUT const& layout,
+    DDS_PACKED_CHUNK const& chunk)
+{
+    DSTORAGE_REQUEST r{};
+    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES;
+    r.Options.CompressionFormat = static_cast<DSTORAGE_COMPRESSION_FORMAT>(layout.PackedCompressionFormat);
+    r.Source.File.Source = file;
+    r.Source.File.Offset = chunk.Offset;
+    r.Source.File.Size = chunk.Size;
+    r.UncompressedSize = chunk.UncompressedSize;
+    r.Destination.MultipleSubresources.Resource = resource;
+    r.Destination.MultipleSubresources.FirstSubresource = chunk.FirstSubresource;
+
+    RouteDecompression(r);
+    g_dsGpuQueue->EnqueueRequest(&r);
+}
+
+HRESULT LoadDDSTextureWithDStorage(
+    wchar_t const* fileName,
+    bool forceSRGB,
+    ID3D12Resource** texture,
+    D3D12_CPU_DESCRIPTOR_HANDLE textureView)
+{
+    *texture = nullptr;
+
+    if (!g_dsFactory)
+        return E_NOT_VALID_STATE;
+
+    ComPtr<IDStorageFile> file;
+    HRESULT hr = g_dsFactory->OpenFile(fileName, IID_PPV_ARGS(&file));
+    if (FAILED(hr))
+        return hr;
+
+    BY_HANDLE_FILE_INFORMATION info{};
+    hr = file->GetFileInformation(&info);
+    if (FAILED(hr))
+        return hr;
+
+    uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+
+    // Read just the header, to find out what to create and where its data is.
+    // That's enough to include a packed file's chunks too.
+    uint8_t header[DDS_PACKED_MAX_HEADER_SIZE];
+    uint32_t headerSize = static_cast<uint32_t>(std::min<uint64_t>(fileSize, sizeof(header)));
+
+    DSTORAGE_REQUEST r{};
+    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+    r.Source.File.Source = file.Get();
+    r.Source.File.Size = headerSize;
+    r.UncompressedSize = headerSize;
+    r.Destination.Memory.Buffer = header;
+    r.Destination.Memory.Size = headerSize;
+    g_dsSystemMemoryQueue->EnqueueRequest(&r);
+
+    hr = WaitForQueue(g_dsSystemMemoryQueue.Get());
+    if (FAILED(hr))
+        return hr;
+
+    DDS_TEXTURE_LAYOUT layout;
+    hr = GetDDSTextureLayout(header, headerSize, fileSize, forceSRGB, &layout);
+    if (FAILED(hr))
+        return hr;
+
+    D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+    ComPtr<ID3D12Resource> resource;
+    hr = Graphics::g_Device->CreateCommittedResource(
+        &heapProperties,
+        D3D12_HEAP_FLAG_NONE,
+        &layout.Desc,
+        D3D12_RESOURCE_STATE_COMMON,
+        nullptr,
+        IID_PPV_ARGS(&resource));
+    if (FAILED(hr))
+        return hr;
+
+    if (!layout.PackedChunks.empty())
+    {
+        for (DDS_PACKED_CHUNK const& chunk : layout.PackedChunks)
+            EnqueueReadChunk(file.Get(), resource.Get(), layout, chunk);
+    }
+    else
+    {
+        // DirectStorage expects the rows of a region to be
+        // D3D12_TEXTURE_DATA_PITCH_ALIGNMENT apart, but a DDS file packs them
+        // tightly.  Subresources whose rows happen to line up are read in bands;
+        // the rest, which are only the small mips, are read a row at a time.
+        for (uint32_t i = 0; i < layout.Subresources.size(); ++i)
+        {
+            DDS_SUBRESOURCE_LAYOUT const& subresource = layout.Subresources[i];
+
+            uint32_t rowsPerRequest = 1;
+            if (subresource.RowPitch % D3D12_TEXTURE_DATA_PITCH_ALIGNMENT == 0)
+                rowsPerRequest = std::max(1u, MaxRequestSize / subresource.RowPitch);
+
+            for (uint32_t row = 0; row < subresource.NumRows; row += rowsPerRequest)
+            {
+                uint32_t numRows = std::min(rowsPerRequest, subresource.NumRows - row);
+                EnqueueReadRows(file.Get(), resource.Get(), layout, i, row, numRows);
+            }
+        }
+    }
+
+    hr = WaitForQueue(g_dsGpuQueue.Get());
+    if (FAILED(hr))
+        return hr;
+
+    resource->SetName(fileName);
+    Graphics::g_Device->CreateShaderResourceView(resource.Get(), &layout.SRVDesc, textureView);
+
+    *texture = resource.Detach();
+    return S_OK;
+}
+
+HRESULT LoadGeometryWithDStorage(wchar_t const* fileName, uint64_t offset, uint32_t size, ID3D12Resource* buffer)
+{
+    if (!g_dsFactory)
+        return E_NOT_VALID_STATE;
+
+    ComPtr<IDStorageFile> file;
+    HRESULT hr = g_dsFactory->OpenFile(fileName, IID_PPV_ARGS(&file));
+    if (FAILED(hr))
+        return hr;
+
+    uint32_t const maxRequestSize = GetStagingBufferSize();
+    for (uint32_t done = 0; done < size;)
+    {
+        uint32_t const requestSize = std::min(size - done, maxRequestSize);
+
+        DSTORAGE_REQUEST r{};
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+        r.Source.File.Source = file.Get();
+        r.Source.File.Offset = offset + done;
+        r.Source.File.Size = requestSize;
+        r.UncompressedSize = requestSize;
+        r.Destination.Buffer.Resource = buffer;
+        r.Destination.Buffer.Offset = done;
+        r.Destination.Buffer.Size = requestSize;
+        g_dsGpuQueue->EnqueueRequest(&r);
+
+        done += requestSize;
+    }
+
+    return WaitForQueue(g_dsGpuQueue.Get());
+}
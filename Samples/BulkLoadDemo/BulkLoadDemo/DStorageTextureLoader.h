@@ -0,0 +1,33 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <d3d12.h>
+
+//
+// Loads a DDS file with DirectStorage, for TextureManager::SetDDSFileLoader.
+// Only the header is read into memory; the texture data is read by g_dsGpuQueue
+// straight into the texture, so there's no upload heap copy.  Files packed by
+// MiniArchive's -dds option are read with one request per chunk, and
+// decompressed by DirectStorage.  Returns once the texture has loaded.
+//
+HRESULT LoadDDSTextureWithDStorage(
+    wchar_t const* fileName,
+    bool forceSRGB,
+    ID3D12Resource** texture,
+    D3D12_CPU_DESCRIPTOR_HANDLE textureView);
+
+//
+// Reads the geometry of a .mini or .h3d model with DirectStorage, for
+// Renderer::SetGeometryFileLoader.  The bytes are read by g_dsGpuQueue straight
+// into the buffer, with one request unless they don't fit in the staging
+// buffer.  Returns once they have loaded.
+//
+HRESULT LoadGeometryWithDStorage(wchar_t const* fileName, uint64_t offset, uint32_t size, ID3D12Resource* buffer);
@@ -0,0 +1,91 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <GraphicsCore.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+//
+// Holds on to things that frames already submitted may still be using - GPU
+// resources, heap ranges and descriptor ranges - and releases them once the
+// graphics queue has passed the fence they were pushed with, so that the
+// caller doesn't have to wait for the GPU before unloading.  Each release is a
+// function that frees what it holds; anything it captures is destroyed along
+// with it.
+//
+// Waiting releases run in the order they were pushed, from Update, which is
+// called once per frame on the main thread.
+//
+class DeferredReleaseQueue
+{
+    struct Entry
+    {
+        uint64_t Fence;
+        std::function<void()> Release;
+    };
+
+    std::deque<Entry> m_entries;
+
+public:
+    ~DeferredReleaseQueue()
+    {
+        Flush();
+    }
+
+    // A fence that completes once the GPU has finished everything submitted to
+    // the graphics queue so far
+    static uint64_t SignalGraphicsQueue()
+    {
+        return Graphics::g_CommandManager.GetGraphicsQueue().IncrementFence();
+    }
+
+    // The release runs straight away if the fence has already completed
+    void Push(uint64_t fence, std::function<void()> release)
+    {
+        if (Graphics::g_CommandManager.GetGraphicsQueue().IsFenceComplete(fence))
+        {
+            release();
+            return;
+        }
+
+        m_entries.push_back({fence, std::move(release)});
+    }
+
+    void Update()
+    {
+        auto& queue = Graphics::g_CommandManager.GetGraphicsQueue();
+
+        while (!m_entries.empty() && queue.IsFenceComplete(m_entries.front().Fence))
+        {
+            // The release may push more entries
+            std::function<void()> release = std::move(m_entries.front().Release);
+            m_entries.pop_front();
+            release();
+        }
+    }
+
+    // Waits for the GPU to finish with everything queued, and releases it
+    void Flush()
+    {
+        while (!m_entries.empty())
+        {
+            Graphics::g_CommandManager.GetGraphicsQueue().WaitForFence(m_entries.back().Fence);
+            Update();
+        }
+    }
+
+    bool IsEmpty() const
+    {
+        return m_entries.empty();
+    }
+};
@@ -58,6 +58,13 @@ public:
         ::SetThreadpoolWait(m_wait, m_event.Get(), nullptr);
     }
 
+    // Waits for the event to be set and for the callback to have run
+    void Wait()
+    {
+        WaitForSingleObject(m_event.Get(), INFINITE);
+        WaitForThreadpoolWaitCallbacks(m_wait, FALSE);
+    }
+
     bool IsSet() const
     {
         return WaitForSingleObject(m_event.Get(), 0) == WAIT_OBJECT_0;
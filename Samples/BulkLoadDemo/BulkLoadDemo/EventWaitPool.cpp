@@ -0,0 +1,135 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "EventWaitPool.h"
+
+#include <algorithm>
+
+EventWaitPool::~EventWaitPool()
+{
+    for (auto& slot : m_slots)
+    {
+        ::SetThreadpoolWait(slot->Wait, nullptr, nullptr);
+        WaitForThreadpoolWaitCallbacks(slot->Wait, TRUE);
+        CloseThreadpoolWait(slot->Wait);
+    }
+}
+
+HANDLE EventWaitPool::Arm(Callback const& callback)
+{
+    std::unique_lock lock{m_mutex};
+
+    Slot* slot;
+    if (m_freeSlots.empty())
+    {
+        auto newSlot = std::make_unique<Slot>();
+        newSlot->Pool = this;
+        newSlot->Wait = CreateThreadpoolWait(&OnEventSet, newSlot.get(), nullptr);
+        if (!newSlot->Wait)
+            std::abort();
+
+        constexpr BOOL manualReset = TRUE;
+        constexpr BOOL initialState = FALSE;
+        newSlot->Event.Attach(CreateEventW(nullptr, manualReset, initialState, nullptr));
+        if (!newSlot->Event.IsValid())
+            std::abort();
+
+        slot = newSlot.get();
+        m_slots.push_back(std::move(newSlot));
+    }
+    else
+    {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+    }
+
+    slot->Target = callback;
+    slot->Armed = true;
+
+    ResetEvent(slot->Event.Get());
+    ::SetThreadpoolWait(slot->Wait, slot->Event.Get(), nullptr);
+    return slot->Event.Get();
+}
+
+void EventWaitPool::Wait(Callback const& callback)
+{
+    std::unique_lock lock{m_mutex};
+
+    m_callbackReturned.wait(
+        lock,
+        [&]
+        {
+            return std::none_of(
+                m_slots.begin(),
+                m_slots.end(),
+                [&](auto const& slot)
+                {
+                    return (slot->Armed || slot->Running) && slot->Target.Function == callback.Function &&
+                           slot->Target.Context == callback.Context;
+                });
+        });
+}
+
+void EventWaitPool::Cancel(void* context)
+{
+    std::unique_lock lock{m_mutex};
+
+    // The events have been enqueued, and will still be set, so the slots stay
+    // armed until they are rather than going back to the pool now
+    for (auto& slot : m_slots)
+    {
+        if (slot->Armed && slot->Target.Context == context)
+            slot->Target = {};
+    }
+
+    m_callbackReturned.wait(
+        lock,
+        [&]
+        {
+            return std::none_of(
+                m_slots.begin(),
+                m_slots.end(),
+                [&](auto const& slot) { return slot->Running && slot->Target.Context == context; });
+        });
+}
+
+//
+// The slot goes back to the pool before this returns, so it may be armed again
+// while the callback is still finishing; SetThreadpoolWait allows that.
+//
+void CALLBACK EventWaitPool::OnEventSet(TP_CALLBACK_INSTANCE*, void* context, TP_WAIT*, TP_WAIT_RESULT)
+{
+    Slot* slot = static_cast<Slot*>(context);
+    EventWaitPool& pool = *slot->Pool;
+
+    std::unique_lock lock{pool.m_mutex};
+
+    Callback callback = slot->Target;
+    slot->Armed = false;
+
+    // Cancelled
+    if (!callback.Function)
+    {
+        pool.m_freeSlots.push_back(slot);
+        return;
+    }
+
+    slot->Running = true;
+    lock.unlock();
+
+    callback.Function(callback.Context);
+
+    lock.lock();
+    slot->Running = false;
+    slot->Target = {};
+    pool.m_freeSlots.push_back(slot);
+    pool.m_callbackReturned.notify_all();
+}
@@ -0,0 +1,69 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include "CompletionFences.h"
+
+#include <wrl/wrappers/corewrappers.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//
+// EventWaitPool hands out the events, and their threadpool waits, that
+// completions are signaled with.  An event is taken from the pool when a
+// completion is enqueued and goes back to it once the callback has returned,
+// so the number of events and waits grows with the completions in flight
+// rather than with the number of files that might wait for one.
+//
+class EventWaitPool
+{
+public:
+    using Callback = CompletionFences::Callback;
+
+    EventWaitPool() = default;
+    ~EventWaitPool();
+
+    EventWaitPool(EventWaitPool const&) = delete;
+    EventWaitPool& operator=(EventWaitPool const&) = delete;
+
+    // Returns an event that has the callback called on the threadpool once
+    // it's set.  The caller enqueues the event, eg. with EnqueueSetEvent.
+    HANDLE Arm(Callback const& callback);
+
+    // Waits for the events armed with the callback to be set and for the
+    // callback to have returned.  Must not be called from that callback.
+    void Wait(Callback const& callback);
+
+    // Drops the callbacks that have yet to be called for the context, and
+    // waits for one that is being called to return.  Their events go back to
+    // the pool once they're set.  Must not be called from a callback.
+    void Cancel(void* context);
+
+private:
+    struct Slot
+    {
+        EventWaitPool* Pool = nullptr;
+        Microsoft::WRL::Wrappers::Event Event;
+        TP_WAIT* Wait = nullptr;
+        Callback Target; // empty once cancelled
+        bool Armed = false;
+        bool Running = false;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_callbackReturned;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    std::vector<Slot*> m_freeSlots;
+
+    static void CALLBACK OnEventSet(TP_CALLBACK_INSTANCE*, void* context, TP_WAIT*, TP_WAIT_RESULT);
+};
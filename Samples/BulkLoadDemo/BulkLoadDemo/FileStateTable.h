@@ -0,0 +1,229 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//
+// Indexes MarcFileManager's files by what the manager is doing with them, and
+// by name, so that a catalog of many files can be streamed from without
+// looking at every file each time the loaded ones change.
+//
+// The files in each state are kept in a list, in the order they entered it,
+// that's threaded through an entry per file, so a file moves between states in
+// constant time and a state's files can be gone through without touching the
+// rest.  Names are found through an open-addressing table, probed linearly,
+// that's kept at most half full.
+//
+class FileStateTable
+{
+public:
+    using FileId = size_t;
+    static constexpr FileId NoFile = ~FileId(0);
+
+    enum class State : uint8_t
+    {
+        Unloaded, // holds no memory
+        Loading,  // includes cancelled loads that are still finishing
+        Loaded,
+        Departed, // loaded, but has left the continuous loading target set, so may be evicted
+        Failed,   // the content load failed, but the file holds its memory until it's unloaded
+        Count
+    };
+
+    // Files are given ids in the order they're added, starting Unloaded.  The
+    // first file added with a name is the one Find returns for it.
+    FileId Add(std::wstring_view name)
+    {
+        FileId id = m_entries.size();
+        m_entries.emplace_back();
+        Link(id, State::Unloaded);
+        InsertName(name, id);
+        return id;
+    }
+
+    FileId Find(std::wstring_view name) const
+    {
+        if (m_nameSlots.empty())
+            return NoFile;
+
+        size_t const hash = std::hash<std::wstring_view>{}(name);
+        size_t const mask = m_nameSlots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            NameSlot const& slot = m_nameSlots[i];
+            if (slot.Id == NoFile)
+                return NoFile;
+            if (slot.Hash == hash && slot.Name == name)
+                return slot.Id;
+        }
+    }
+
+    State GetState(FileId id) const
+    {
+        return m_entries[id].Current;
+    }
+
+    // Moves the file to the end of the state's list, unless it's already in it
+    void SetState(FileId id, State state)
+    {
+        if (m_entries[id].Current == state)
+            return;
+
+        Unlink(id);
+        Link(id, state);
+    }
+
+    size_t GetCount(State state) const
+    {
+        return m_lists[static_cast<size_t>(state)].Count;
+    }
+
+    // The file that has been in the state longest, or NoFile
+    FileId GetFirst(State state) const
+    {
+        return m_lists[static_cast<size_t>(state)].First;
+    }
+
+    // The files in the state, in the order they entered it.  This is a copy,
+    // so the files can be moved to other states while it's gone through.
+    std::vector<FileId> GetFiles(State state) const
+    {
+        std::vector<FileId> ids;
+        ids.reserve(GetCount(state));
+        for (FileId id = GetFirst(state); id != NoFile; id = m_entries[id].Next)
+            ids.push_back(id);
+        return ids;
+    }
+
+private:
+    struct Entry
+    {
+        FileId Prev = NoFile;
+        FileId Next = NoFile;
+        State Current = State::Unloaded;
+    };
+
+    struct List
+    {
+        FileId First = NoFile;
+        FileId Last = NoFile;
+        size_t Count = 0;
+    };
+
+    struct NameSlot
+    {
+        size_t Hash = 0;
+        FileId Id = NoFile;
+        std::wstring Name;
+    };
+
+    void Link(FileId id, State state)
+    {
+        List& list = m_lists[static_cast<size_t>(state)];
+        Entry& entry = m_entries[id];
+
+        entry.Current = state;
+        entry.Prev = list.Last;
+        entry.Next = NoFile;
+
+        if (list.Last != NoFile)
+            m_entries[list.Last].Next = id;
+        else
+            list.First = id;
+
+        list.Last = id;
+        ++list.Count;
+    }
+
+    void Unlink(FileId id)
+    {
+        Entry& entry = m_entries[id];
+        List& list = m_lists[static_cast<size_t>(entry.Current)];
+
+        if (entry.Prev != NoFile)
+            m_entries[entry.Prev].Next = entry.Next;
+        else
+            list.First = entry.Next;
+
+        if (entry.Next != NoFile)
+            m_entries[entry.Next].Prev = entry.Prev;
+        else
+            list.Last = entry.Prev;
+
+        entry.Prev = NoFile;
+        entry.Next = NoFile;
+        assert(list.Count > 0);
+        --list.Count;
+    }
+
+    void InsertName(std::wstring_view name, FileId id)
+    {
+        if ((m_numNames + 1) * 2 > m_nameSlots.size())
+            GrowNames();
+
+        size_t const hash = std::hash<std::wstring_view>{}(name);
+        if (InsertSlot(hash, id, name))
+            ++m_numNames;
+    }
+
+    // Returns false if the name is already in the table
+    bool InsertSlot(size_t hash, FileId id, std::wstring_view name)
+    {
+        size_t const mask = m_nameSlots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            NameSlot& slot = m_nameSlots[i];
+            if (slot.Id == NoFile)
+            {
+                slot.Hash = hash;
+                slot.Id = id;
+                slot.Name = name;
+                return true;
+            }
+
+            if (slot.Hash == hash && slot.Name == name)
+                return false;
+        }
+    }
+
+    void GrowNames()
+    {
+        std::vector<NameSlot> oldSlots = std::exchange(m_nameSlots, {});
+        m_nameSlots.resize(std::max<size_t>(oldSlots.size() * 2, 64));
+
+        // The slots are moved rather than their names copied
+        size_t const mask = m_nameSlots.size() - 1;
+        for (NameSlot& oldSlot : oldSlots)
+        {
+            if (oldSlot.Id == NoFile)
+                continue;
+
+            size_t i = oldSlot.Hash & mask;
+            while (m_nameSlots[i].Id != NoFile)
+                i = (i + 1) & mask;
+            m_nameSlots[i] = std::move(oldSlot);
+        }
+    }
+
+    std::vector<Entry> m_entries;
+    std::array<List, static_cast<size_t>(State::Count)> m_lists;
+
+    std::vector<NameSlot> m_nameSlots;
+    size_t m_numNames = 0;
+};
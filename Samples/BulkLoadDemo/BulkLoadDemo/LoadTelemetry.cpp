@@ -0,0 +1,417 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "LoadTelemetry.h"
+
+#include "DStorageLoader.h"
+
+#include <GraphRenderer.h>
+#include <SystemTime.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+
+using TelemetryClock = LoadTelemetryBatch::clock;
+
+namespace
+{
+    BoolVar GraphQueueDepth("DirectStorage/Telemetry/Graph Queue Depth", false);
+    BoolVar GraphBandwidth("DirectStorage/Telemetry/Graph Bandwidth", false);
+    BoolVar GraphDecompression("DirectStorage/Telemetry/Graph Decompression", false);
+    BoolVar GraphMemory("DirectStorage/Telemetry/Graph Staging and Heaps", false);
+    CallbackTrigger ExportCsv(
+        "DirectStorage/Telemetry/Export CSV", [](void*) { ExportLoadTelemetry(std::filesystem::current_path()); });
+
+    // Only the most recent records are kept, so a long run doesn't grow without
+    // bound.
+    constexpr size_t MaxRecords = 64 * 1024;
+
+    struct BatchRecord
+    {
+        TelemetryQueue Queue;
+        TelemetryClock::time_point EnqueueTime;
+        TelemetryClock::time_point SubmitTime;
+        TelemetryClock::time_point CompleteTime;
+        uint32_t NumRequests;
+        uint64_t ByteCount[static_cast<size_t>(TelemetryFormat::Count)];
+    };
+
+    // The totals that the graphed bandwidths are taken from, and the bytes
+    // of the batches that are in flight
+    struct LiveTotals
+    {
+        uint64_t ByteCount;
+        uint64_t UncompressedByteCount[static_cast<size_t>(TelemetryFormat::Count)];
+        uint64_t InFlightByteCount;
+        uint64_t HeapUsedBytes[static_cast<size_t>(TelemetryHeap::Count)];
+        uint64_t HeapTotalBytes[static_cast<size_t>(TelemetryHeap::Count)];
+    };
+
+    struct QueueDepthSample
+    {
+        TelemetryClock::time_point Time;
+        uint32_t Depth[static_cast<size_t>(TelemetryQueue::Count)];
+    };
+
+    std::mutex g_mutex;
+    TelemetryClock::time_point g_startTime;
+    std::deque<BatchRecord> g_batches;
+    std::deque<QueueDepthSample> g_queueDepths;
+    LoadTelemetrySummary g_summary;
+    LiveTotals g_totals;
+
+    std::atomic<uint32_t> g_numCustomDecompressions;
+    std::atomic<uint64_t> g_customDecompressionByteCount;
+    std::atomic<int64_t> g_customDecompressionTime; // nanoseconds
+    std::atomic<uint64_t> g_customDecompressionCycles;
+
+    // Only UpdateLoadTelemetry uses these
+    LiveTotals g_lastTotals;
+    TelemetryClock::time_point g_lastUpdateTime;
+    LoadTelemetryCounters g_counters;
+
+    // Each of the profile graphs plots two values
+    struct Graph
+    {
+        BoolVar& Enabled;
+        GraphRenderer::GraphHandle Handle;
+        bool IsGraphed;
+    };
+
+    Graph g_graphs[] = {
+        {GraphQueueDepth, 0, false},
+        {GraphBandwidth, 0, false},
+        {GraphDecompression, 0, false},
+        {GraphMemory, 0, false}};
+}
+
+static TelemetryFormat ToTelemetryFormat(DSTORAGE_COMPRESSION_FORMAT format)
+{
+    switch (format)
+    {
+    case DSTORAGE_COMPRESSION_FORMAT_GDEFLATE:
+    case CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU:
+        return TelemetryFormat::GDeflate;
+
+    case CUSTOM_COMPRESSION_FORMAT_ZLIB:
+    case CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT:
+        return TelemetryFormat::ZLib;
+
+    default:
+        return TelemetryFormat::Uncompressed;
+    }
+}
+
+static float ToMilliseconds(TelemetryClock::duration duration)
+{
+    return std::chrono::duration<float, std::milli>(duration).count();
+}
+
+template<typename T>
+static void AppendRecord(std::deque<T>& records, T const& record)
+{
+    if (records.size() == MaxRecords)
+        records.pop_front();
+    records.push_back(record);
+}
+
+void InitializeLoadTelemetry()
+{
+    g_startTime = TelemetryClock::now();
+    g_lastUpdateTime = g_startTime;
+    for (Graph& graph : g_graphs)
+        graph.Handle = GraphRenderer::InitGraph(GraphRenderer::GraphType::Profile);
+    ResetLoadTelemetry();
+}
+
+void ShutdownLoadTelemetry()
+{
+    std::unique_lock lock(g_mutex);
+    g_batches.clear();
+    g_queueDepths.clear();
+}
+
+void RecordEnqueue(LoadTelemetryBatch& batch, DSTORAGE_REQUEST const& request)
+{
+    if (batch.NumRequests == 0)
+        batch.EnqueueTime = TelemetryClock::now();
+
+    // Uncompressed requests needn't give their uncompressed size
+    size_t format = static_cast<size_t>(ToTelemetryFormat(request.Options.CompressionFormat));
+    ++batch.NumRequests;
+    batch.ByteCount[format] += request.Source.File.Size;
+    batch.UncompressedByteCount[format] +=
+        format == static_cast<size_t>(TelemetryFormat::Uncompressed) ? request.Source.File.Size
+                                                                       : request.UncompressedSize;
+}
+
+void RecordSubmit(LoadTelemetryBatch& batch)
+{
+    batch.SubmitTime = TelemetryClock::now();
+
+    // A batch may be submitted again after more requests were enqueued
+    uint64_t byteCount = 0;
+    for (uint64_t count : batch.ByteCount)
+        byteCount += count;
+
+    std::unique_lock lock(g_mutex);
+    g_totals.InFlightByteCount += byteCount - batch.SubmittedByteCount;
+    batch.SubmittedByteCount = byteCount;
+}
+
+void RecordCompletion(LoadTelemetryBatch& batch)
+{
+    BatchRecord record{batch.Queue, batch.EnqueueTime, batch.SubmitTime, TelemetryClock::now(), batch.NumRequests};
+    std::copy(std::begin(batch.ByteCount), std::end(batch.ByteCount), std::begin(record.ByteCount));
+
+    uint64_t uncompressedByteCount[std::size(batch.UncompressedByteCount)];
+    std::copy(
+        std::begin(batch.UncompressedByteCount),
+        std::end(batch.UncompressedByteCount),
+        std::begin(uncompressedByteCount));
+    uint64_t submittedByteCount = batch.SubmittedByteCount;
+
+    batch = LoadTelemetryBatch(batch.Queue);
+
+    // The batch's time in the queue and in flight go on the profiler's trace,
+    // converted to ticks back from now
+    static char const* const TraceTracks[] = {"DirectStorage System Memory Queue", "DirectStorage GPU Queue"};
+    static_assert(std::size(TraceTracks) == static_cast<size_t>(TelemetryQueue::Count));
+
+    int64_t const completeTick = SystemTime::GetCurrentTick();
+    auto toTick = [&](TelemetryClock::time_point time)
+    {
+        double seconds = std::chrono::duration<double>(record.CompleteTime - time).count();
+        return completeTick - static_cast<int64_t>(seconds / SystemTime::TicksToSeconds(1));
+    };
+
+    if (record.NumRequests > 0)
+    {
+        char const* track = TraceTracks[static_cast<size_t>(record.Queue)];
+        EngineProfiling::RecordInterval(track, "Queued", toTick(record.EnqueueTime), toTick(record.SubmitTime));
+        EngineProfiling::RecordInterval(track, "In flight", toTick(record.SubmitTime), completeTick);
+    }
+
+    std::unique_lock lock(g_mutex);
+    AppendRecord(g_batches, record);
+
+    // AverageLatency holds the sum until GetLoadTelemetrySummary divides it
+    auto& queue = g_summary.Queues[static_cast<size_t>(record.Queue)];
+    float latency = ToMilliseconds(record.CompleteTime - record.SubmitTime);
+    ++queue.NumBatches;
+    queue.NumRequests += record.NumRequests;
+    queue.AverageLatency += latency;
+    queue.MaxLatency = std::max(queue.MaxLatency, latency);
+
+    for (size_t i = 0; i < std::size(record.ByteCount); ++i)
+    {
+        g_summary.ByteCount[i] += record.ByteCount[i];
+        g_summary.UncompressedByteCount[i] += uncompressedByteCount[i];
+        g_totals.ByteCount += record.ByteCount[i];
+        g_totals.UncompressedByteCount[i] += uncompressedByteCount[i];
+    }
+    g_totals.InFlightByteCount -= submittedByteCount;
+}
+
+void RecordCustomDecompression(uint64_t uncompressedSize, std::chrono::nanoseconds duration, uint64_t cycles)
+{
+    g_numCustomDecompressions.fetch_add(1, std::memory_order_relaxed);
+    g_customDecompressionByteCount.fetch_add(uncompressedSize, std::memory_order_relaxed);
+    g_customDecompressionTime.fetch_add(duration.count(), std::memory_order_relaxed);
+    g_customDecompressionCycles.fetch_add(cycles, std::memory_order_relaxed);
+}
+
+void RecordHeapUsage(TelemetryHeap heap, uint64_t usedBytes, uint64_t totalBytes)
+{
+    std::unique_lock lock(g_mutex);
+    g_totals.HeapUsedBytes[static_cast<size_t>(heap)] = usedBytes;
+    g_totals.HeapTotalBytes[static_cast<size_t>(heap)] = totalBytes;
+}
+
+void UpdateLoadTelemetry()
+{
+    QueueDepthSample sample{TelemetryClock::now(), {}};
+
+    // Each depth covers the queues of every priority
+    for (uint32_t i = 0; i < DSTORAGE_PRIORITY_COUNT; ++i)
+    {
+        DSTORAGE_PRIORITY priority = GetPriorityFromIndex(i);
+        IDStorageQueue* queues[] = {GetSystemMemoryQueue(priority), GetGpuQueue(priority)};
+        for (size_t j = 0; j < std::size(queues); ++j)
+        {
+            DSTORAGE_QUEUE_INFO info{};
+            queues[j]->Query(&info);
+            sample.Depth[j] += info.Desc.Capacity - info.EmptySlotCount;
+        }
+    }
+
+    LiveTotals totals;
+    {
+        std::unique_lock lock(g_mutex);
+        AppendRecord(g_queueDepths, sample);
+
+        for (size_t i = 0; i < std::size(sample.Depth); ++i)
+            g_summary.Queues[i].MaxDepth = std::max(g_summary.Queues[i].MaxDepth, sample.Depth[i]);
+
+        totals = g_totals;
+    }
+
+    // The bandwidths are smoothed over about a quarter of a second, since the
+    // bytes of a whole batch arrive in a single frame
+    float seconds = std::chrono::duration<float>(sample.Time - g_lastUpdateTime).count();
+    float weight = seconds > 0.0f ? 1.0f - std::exp(-seconds / 0.25f) : 0.0f;
+    auto smooth = [&](float& value, uint64_t byteCount, uint64_t lastByteCount)
+    {
+        float bandwidth = seconds > 0.0f ? (byteCount - lastByteCount) / seconds / 1000.0f / 1000.0f : 0.0f;
+        value += (bandwidth - value) * weight;
+    };
+
+    smooth(g_counters.ReadBandwidth, totals.ByteCount, g_lastTotals.ByteCount);
+    for (size_t i = 0; i < std::size(totals.UncompressedByteCount); ++i)
+    {
+        smooth(
+            g_counters.DecompressionBandwidth[i],
+            totals.UncompressedByteCount[i],
+            g_lastTotals.UncompressedByteCount[i]);
+    }
+
+    std::copy(std::begin(sample.Depth), std::end(sample.Depth), std::begin(g_counters.RequestsInFlight));
+
+    uint32_t stagingBufferSize = GetStagingBufferSize();
+    g_counters.StagingOccupancy =
+        stagingBufferSize > 0
+            ? std::min(1.0f, static_cast<float>(totals.InFlightByteCount) / stagingBufferSize)
+            : 0.0f;
+
+    for (size_t i = 0; i < std::size(totals.HeapUsedBytes); ++i)
+    {
+        g_counters.HeapUsage[i] =
+            totals.HeapTotalBytes[i] > 0
+                ? static_cast<float>(totals.HeapUsedBytes[i]) / static_cast<float>(totals.HeapTotalBytes[i])
+                : 0.0f;
+    }
+
+    g_lastTotals = totals;
+    g_lastUpdateTime = sample.Time;
+
+    // The profile graphs plot two values, drawn as the first ("CPU") and
+    // second ("GPU") graph:
+    //
+    //   Queue Depth:          system memory queue, GPU queue
+    //   Bandwidth:            MB/s read, MB/s of output in every format
+    //   Decompression:        MB/s of GDeflate output, MB/s of ZLib output
+    //   Staging and Heaps:    % of the staging buffer, % of both heaps
+    //
+    LoadTelemetryCounters const& c = g_counters;
+    uint64_t heapUsedBytes = totals.HeapUsedBytes[0] + totals.HeapUsedBytes[1];
+    uint64_t heapTotalBytes = totals.HeapTotalBytes[0] + totals.HeapTotalBytes[1];
+    float decompressionBandwidth = std::accumulate(
+        std::begin(c.DecompressionBandwidth), std::end(c.DecompressionBandwidth), 0.0f);
+    size_t const gdeflate = static_cast<size_t>(TelemetryFormat::GDeflate);
+    size_t const zlib = static_cast<size_t>(TelemetryFormat::ZLib);
+
+    XMFLOAT2 const values[] = {
+        XMFLOAT2(static_cast<float>(sample.Depth[0]), static_cast<float>(sample.Depth[1])),
+        XMFLOAT2(c.ReadBandwidth, decompressionBandwidth),
+        XMFLOAT2(c.DecompressionBandwidth[gdeflate], c.DecompressionBandwidth[zlib]),
+        XMFLOAT2(
+            100.0f * c.StagingOccupancy,
+            heapTotalBytes > 0 ? 100.0f * static_cast<float>(heapUsedBytes) / static_cast<float>(heapTotalBytes)
+                               : 0.0f)};
+    static_assert(std::size(values) == std::size(g_graphs));
+
+    for (size_t i = 0; i < std::size(g_graphs); ++i)
+    {
+        Graph& graph = g_graphs[i];
+        if (graph.Enabled != graph.IsGraphed)
+            graph.IsGraphed = GraphRenderer::ManageGraphs(graph.Handle, GraphRenderer::GraphType::Profile);
+
+        GraphRenderer::Update(values[i], graph.Handle, GraphRenderer::GraphType::Profile);
+    }
+}
+
+void ResetLoadTelemetry()
+{
+    std::unique_lock lock(g_mutex);
+    g_summary = LoadTelemetrySummary{};
+
+    g_numCustomDecompressions = 0;
+    g_customDecompressionByteCount = 0;
+    g_customDecompressionTime = 0;
+    g_customDecompressionCycles = 0;
+}
+
+LoadTelemetryCounters GetLoadTelemetryCounters()
+{
+    return g_counters;
+}
+
+LoadTelemetrySummary GetLoadTelemetrySummary()
+{
+    LoadTelemetrySummary summary;
+    {
+        std::unique_lock lock(g_mutex);
+        summary = g_summary;
+    }
+
+    for (auto& queue : summary.Queues)
+    {
+        if (queue.NumBatches > 0)
+            queue.AverageLatency /= queue.NumBatches;
+    }
+
+    summary.NumCustomDecompressions = g_numCustomDecompressions;
+    summary.CustomDecompressionByteCount = g_customDecompressionByteCount;
+    summary.CustomDecompressionTime = g_customDecompressionTime / 1000000.0f;
+    summary.CustomDecompressionCycles = g_customDecompressionCycles;
+
+    return summary;
+}
+
+bool ExportLoadTelemetry(std::filesystem::path const& directory)
+{
+    static char const* queueNames[] = {"SystemMemory", "Gpu"};
+
+    std::unique_lock lock(g_mutex);
+
+    std::ofstream batches(directory / "LoadTelemetryBatches.csv");
+    batches << "Queue,EnqueueMs,SubmitMs,CompleteMs,Requests,UncompressedBytes,GDeflateBytes,ZLibBytes\n";
+    for (BatchRecord const& record : g_batches)
+    {
+        batches << queueNames[static_cast<size_t>(record.Queue)] << ','
+                << ToMilliseconds(record.EnqueueTime - g_startTime) << ','
+                << ToMilliseconds(record.SubmitTime - g_startTime) << ','
+                << ToMilliseconds(record.CompleteTime - g_startTime) << ',' << record.NumRequests;
+        for (uint64_t byteCount : record.ByteCount)
+            batches << ',' << byteCount;
+        batches << '\n';
+    }
+
+    std::ofstream queueDepths(directory / "LoadTelemetryQueueDepth.csv");
+    queueDepths << "TimeMs,SystemMemoryDepth,GpuDepth\n";
+    for (QueueDepthSample const& sample : g_queueDepths)
+    {
+        queueDepths << ToMilliseconds(sample.Time - g_startTime) << ',' << sample.Depth[0] << ',' << sample.Depth[1]
+                    << '\n';
+    }
+
+    bool succeeded = batches.good() && queueDepths.good();
+    Utility::Printf(
+        "%s load telemetry to %ls\n",
+        succeeded ? "Exported" : "Failed to export",
+        directory.c_str());
+    return succeeded;
+}
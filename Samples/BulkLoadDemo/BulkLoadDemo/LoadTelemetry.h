@@ -0,0 +1,144 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <dstorage.h>
+
+#include <chrono>
+#include <filesystem>
+
+//
+// LoadTelemetry records what the DirectStorage queues are doing: when each
+// batch of requests was enqueued, submitted and completed, how many bytes of
+// each compression format were read, how deep the queues are and how long the
+// custom ZLib decompression takes.
+//
+// A batch is the set of requests enqueued before a Submit whose completion is
+// signaled by a single event, eg. the CPU data of a MarcFile.  DirectStorage
+// only reports completion through events and fences, so every request in a
+// batch shares its completion time.
+//
+
+enum class TelemetryQueue
+{
+    SystemMemory,
+    Gpu,
+    Count
+};
+
+enum class TelemetryFormat
+{
+    Uncompressed,
+    GDeflate,
+    ZLib,
+    Count
+};
+
+enum class TelemetryHeap
+{
+    Textures,
+    Buffers,
+    Count
+};
+
+struct LoadTelemetryBatch
+{
+    using clock = std::chrono::high_resolution_clock;
+
+    explicit LoadTelemetryBatch(TelemetryQueue queue)
+        : Queue(queue)
+    {
+    }
+
+    TelemetryQueue Queue;
+    clock::time_point EnqueueTime;
+    clock::time_point SubmitTime;
+    uint32_t NumRequests = 0;
+
+    // Bytes read from the file, and the bytes they decompress to, by
+    // compression format
+    uint64_t ByteCount[static_cast<size_t>(TelemetryFormat::Count)] = {};
+    uint64_t UncompressedByteCount[static_cast<size_t>(TelemetryFormat::Count)] = {};
+
+    // The bytes counted as in flight by RecordSubmit
+    uint64_t SubmittedByteCount = 0;
+};
+
+void InitializeLoadTelemetry();
+void ShutdownLoadTelemetry();
+
+// These are safe to call from any thread, as long as each batch is only used
+// by one thread at a time.
+void RecordEnqueue(LoadTelemetryBatch& batch, DSTORAGE_REQUEST const& request);
+void RecordSubmit(LoadTelemetryBatch& batch);
+void RecordCompletion(LoadTelemetryBatch& batch);
+void RecordCustomDecompression(uint64_t uncompressedSize, std::chrono::nanoseconds duration, uint64_t cycles);
+
+// Called by MarcFileManager each frame, for the heap fill graph.
+void RecordHeapUsage(TelemetryHeap heap, uint64_t usedBytes, uint64_t totalBytes);
+
+// Samples the queue depths and bandwidths and updates the graphs; call once
+// per frame.
+void UpdateLoadTelemetry();
+
+// Starts a new summary, eg. at the start of loading a set.
+void ResetLoadTelemetry();
+
+struct LoadTelemetrySummary
+{
+    struct Queue
+    {
+        uint32_t NumBatches;
+        uint32_t NumRequests;
+        float AverageLatency; // milliseconds from submit to completion
+        float MaxLatency;
+        uint32_t MaxDepth;
+    };
+
+    Queue Queues[static_cast<size_t>(TelemetryQueue::Count)];
+    uint64_t ByteCount[static_cast<size_t>(TelemetryFormat::Count)];
+    uint64_t UncompressedByteCount[static_cast<size_t>(TelemetryFormat::Count)];
+
+    uint32_t NumCustomDecompressions;
+    uint64_t CustomDecompressionByteCount;
+    float CustomDecompressionTime; // milliseconds, summed over all workers
+    uint64_t CustomDecompressionCycles; // thread cycles, summed over all workers
+};
+
+LoadTelemetrySummary GetLoadTelemetrySummary();
+
+//
+// The values graphed by UpdateLoadTelemetry, as of the last frame.  The
+// bandwidths are averaged over the last quarter of a second or so, since
+// a whole batch completes at once.
+//
+// DirectStorage doesn't report how full its staging buffer is, so the
+// occupancy is estimated from the bytes read by the batches that have been
+// submitted but haven't completed, as a fraction of the staging buffer size.
+// It's an upper bound, since a batch's bytes are only released when all of
+// its requests have completed.
+//
+// GetLoadTelemetryCounters must be called on the thread that calls
+// UpdateLoadTelemetry.
+//
+struct LoadTelemetryCounters
+{
+    float ReadBandwidth; // MB/s read from files
+    float DecompressionBandwidth[static_cast<size_t>(TelemetryFormat::Count)]; // MB/s of output
+    uint32_t RequestsInFlight[static_cast<size_t>(TelemetryQueue::Count)];
+    float StagingOccupancy; // 0 to 1
+    float HeapUsage[static_cast<size_t>(TelemetryHeap::Count)]; // 0 to 1
+};
+
+LoadTelemetryCounters GetLoadTelemetryCounters();
+
+// Writes LoadTelemetryBatches.csv and LoadTelemetryQueueDepth.csv into the
+// given directory.
+bool ExportLoadTelemetry(std::filesystem::path const& directory);
@@ -0,0 +1,162 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "LoadTrace.h"
+
+#include "DStorageLoader.h"
+#include "LoadTraceFormat.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using TraceClock = std::chrono::high_resolution_clock;
+
+namespace
+{
+    CallbackTrigger StartCapture("DirectStorage/Trace/Start Capture", [](void*) { StartLoadTraceCapture(); });
+    CallbackTrigger SaveCapture(
+        "DirectStorage/Trace/Save Capture",
+        [](void*) { SaveLoadTraceCapture(std::filesystem::current_path() / "LoadTrace.bin"); });
+
+    std::atomic<bool> g_capturing;
+
+    std::mutex g_mutex;
+    TraceClock::time_point g_startTime;
+    std::vector<std::wstring> g_files;
+    std::unordered_map<std::wstring, uint32_t> g_fileIndices;
+    std::vector<loadtrace::Request> g_requests;
+}
+
+static loadtrace::Compression ToTraceCompression(DSTORAGE_COMPRESSION_FORMAT format)
+{
+    switch (format)
+    {
+    case DSTORAGE_COMPRESSION_FORMAT_GDEFLATE:
+        return loadtrace::Compression::GDeflate;
+
+    case CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU:
+        return loadtrace::Compression::GDeflateCpu;
+
+    case CUSTOM_COMPRESSION_FORMAT_ZLIB:
+        return loadtrace::Compression::ZLib;
+
+    case CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT:
+        return loadtrace::Compression::ZLibBcSplit;
+
+    default:
+        return loadtrace::Compression::None;
+    }
+}
+
+static loadtrace::Destination ToTraceDestination(DSTORAGE_REQUEST_DESTINATION_TYPE type)
+{
+    switch (type)
+    {
+    case DSTORAGE_REQUEST_DESTINATION_MEMORY:
+        return loadtrace::Destination::Memory;
+
+    case DSTORAGE_REQUEST_DESTINATION_BUFFER:
+        return loadtrace::Destination::Buffer;
+
+    default:
+        return loadtrace::Destination::Texture;
+    }
+}
+
+void StartLoadTraceCapture()
+{
+    std::unique_lock lock(g_mutex);
+    g_startTime = TraceClock::now();
+    g_files.clear();
+    g_fileIndices.clear();
+    g_requests.clear();
+    g_capturing = true;
+
+    Utility::Printf("Started capturing a load trace\n");
+}
+
+bool SaveLoadTraceCapture(std::filesystem::path const& path)
+{
+    std::unique_lock lock(g_mutex);
+    g_capturing = false;
+
+    loadtrace::Header header{};
+    header.Id = loadtrace::Id;
+    header.Version = loadtrace::CurrentVersion;
+    header.NumFiles = static_cast<uint32_t>(g_files.size());
+    header.NumRequests = static_cast<uint32_t>(g_requests.size());
+
+    std::ofstream s(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    s.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    for (std::wstring const& file : g_files)
+    {
+        uint32_t length = static_cast<uint32_t>(file.size());
+        s.write(reinterpret_cast<char const*>(&length), sizeof(length));
+        s.write(reinterpret_cast<char const*>(file.data()), length * sizeof(wchar_t));
+    }
+    s.write(
+        reinterpret_cast<char const*>(g_requests.data()),
+        static_cast<std::streamsize>(g_requests.size() * sizeof(loadtrace::Request)));
+
+    bool succeeded = s.good();
+    Utility::Printf(
+        "%s a load trace of %u requests to %ls\n",
+        succeeded ? "Saved" : "Failed to save",
+        header.NumRequests,
+        path.c_str());
+    return succeeded;
+}
+
+bool IsCapturingLoadTrace()
+{
+    return g_capturing;
+}
+
+void RecordTraceRequest(std::filesystem::path const& file, uint64_t fileOffset, DSTORAGE_REQUEST const& request)
+{
+    if (!g_capturing)
+        return;
+
+    auto enqueueTime = TraceClock::now();
+
+    bool const fromMemory = request.Options.SourceType == DSTORAGE_REQUEST_SOURCE_MEMORY;
+
+    loadtrace::Request r{};
+    r.Format = ToTraceCompression(request.Options.CompressionFormat);
+    r.SourceType = fromMemory ? loadtrace::Source::Memory : loadtrace::Source::File;
+    r.DestinationType = ToTraceDestination(request.Options.DestinationType);
+    r.FileOffset = fileOffset;
+    r.CompressedSize = fromMemory ? request.Source.Memory.Size : request.Source.File.Size;
+
+    // Uncompressed requests needn't give their uncompressed size
+    r.UncompressedSize = r.Format == loadtrace::Compression::None ? r.CompressedSize : request.UncompressedSize;
+
+    std::unique_lock lock(g_mutex);
+
+    // The capture may have been saved since the flag was checked
+    if (!g_capturing)
+        return;
+
+    auto [it, inserted] = g_fileIndices.try_emplace(file.native(), static_cast<uint32_t>(g_files.size()));
+    // The replay may be run from somewhere else
+    if (inserted)
+        g_files.push_back(std::filesystem::absolute(file).native());
+
+    r.FileIndex = it->second;
+    r.EnqueueTime = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(enqueueTime - g_startTime).count());
+    g_requests.push_back(r);
+}
@@ -0,0 +1,37 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <dstorage.h>
+
+#include <filesystem>
+
+//
+// LoadTrace captures the DirectStorage requests that the MarcFiles enqueue, so
+// that a load can be replayed outside of the demo by
+// GpuDecompressionBenchmark -replay.  The format is described in
+// LoadTraceFormat.h.
+//
+// The capture is started and saved from the DirectStorage/Trace group of the
+// in-game variables, and only costs a flag check per request while it isn't
+// running.
+//
+
+void StartLoadTraceCapture();
+
+// Stops the capture and writes what it recorded to the given file
+bool SaveLoadTraceCapture(std::filesystem::path const& path);
+
+bool IsCapturingLoadTrace();
+
+// fileOffset is where the request's data is in the file, which for a request
+// read from memory is where that memory was read from.  Safe to call from any
+// thread.
+void RecordTraceRequest(std::filesystem::path const& file, uint64_t fileOffset, DSTORAGE_REQUEST const& request);
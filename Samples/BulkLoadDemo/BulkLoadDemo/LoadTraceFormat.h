@@ -0,0 +1,84 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <cstdint>
+
+//
+// This describes the format of a load trace: the DirectStorage requests that
+// the MarcFiles enqueued while a capture was running (see LoadTrace.h), in the
+// order they were enqueued.  GpuDecompressionBenchmark's -replay option reads
+// these, so this header doesn't depend on anything else in BulkLoadDemo.
+//
+// The file is laid out as follows:
+//
+// Header
+// NumFiles file names, each a uint32_t length followed by that many wchar_t's
+// NumRequests Requests
+//
+// Requests that were read from memory, eg. from a prefetched range, record
+// where in the file that memory was read from, so a replay can read it into
+// memory first.
+//
+
+namespace loadtrace
+{
+    constexpr uint32_t Id = 0x4352544C; // "LTRC"
+    constexpr uint32_t CurrentVersion = 1;
+
+    // The custom compression formats are BulkLoadDemo's own (see
+    // DStorageLoader.h), so they're recorded by what they are rather than by
+    // their DSTORAGE_COMPRESSION_FORMAT value.
+    enum class Compression : uint8_t
+    {
+        None,
+        GDeflate,
+        GDeflateCpu,
+        ZLib,
+        ZLibBcSplit,
+    };
+
+    enum class Source : uint8_t
+    {
+        File,
+        Memory,
+    };
+
+    // Texture covers all of the texture destination types
+    enum class Destination : uint8_t
+    {
+        Memory,
+        Buffer,
+        Texture,
+    };
+
+    struct Header
+    {
+        uint32_t Id;
+        uint32_t Version;
+        uint32_t NumFiles;
+        uint32_t NumRequests;
+    };
+
+    struct Request
+    {
+        uint32_t FileIndex;
+        Compression Format;
+        Source SourceType;
+        Destination DestinationType;
+        uint8_t Reserved;
+        uint64_t FileOffset;
+        uint32_t CompressedSize;
+        uint32_t UncompressedSize;
+        uint64_t EnqueueTime; // microseconds since the capture started
+    };
+
+    static_assert(sizeof(Request) == 32);
+}
@@ -10,73 +10,279 @@
 #include "MarcFile.h"
 
 #include "DStorageLoader.h"
+#include "LoadTrace.h"
 #include "MultiHeap.h"
 
+#include <CommandContext.h>
 #include <GraphicsCommon.h>
 #include <Renderer.h>
 #include <d3dx12.h>
 #include <wrl/wrappers/corewrappers.h>
 
+#include <algorithm>
+#include <array>
+#include <execution>
+#include <map>
+#include <numeric>
+
 using Graphics::g_Device;
 using namespace Math;
 
+// Indexed by marc::Compression.  The loops over a file's regions look a format
+// up for each of them, so this is a table rather than a switch.
+static constexpr std::array<DSTORAGE_COMPRESSION_FORMAT, 4> CompressionFormats = {
+    DSTORAGE_COMPRESSION_FORMAT_NONE,
+    DSTORAGE_COMPRESSION_FORMAT_GDEFLATE,
+    CUSTOM_COMPRESSION_FORMAT_ZLIB,
+    CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT};
+
+static_assert(CompressionFormats[static_cast<size_t>(marc::Compression::ZlibBcSplit)] ==
+              CUSTOM_COMPRESSION_FORMAT_ZLIB_BC_SPLIT);
+
 static DSTORAGE_COMPRESSION_FORMAT ToCompressionFormat(marc::Compression compression)
 {
-    using marc::Compression;
+    size_t const index = static_cast<size_t>(compression);
+    if (index >= CompressionFormats.size())
+        throw std::runtime_error("Unknown marc::Compression value");
 
-    switch (compression)
-    {
-    case Compression::None:
-        return DSTORAGE_COMPRESSION_FORMAT_NONE;
+    return CompressionFormats[index];
+}
+
+// The size of the read of the end of the file that is made along with the
+// header, in the hope that the CPU metadata is inside it.
+static constexpr uint64_t SpeculativeMetadataReadSize = 64 * 1024;
+
+// Tiled textures are written out with this layout, and are loaded into
+// reserved resources.
+static bool IsTiled(D3D12_RESOURCE_DESC const& desc)
+{
+    return desc.Layout == D3D12_TEXTURE_LAYOUT_64KB_UNDEFINED_SWIZZLE;
+}
 
-    case Compression::GDeflate:
-        return DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+// Swizzled textures are given this layout by ApplySwizzledLayouts, and are
+// read through a buffer placed over them.
+static bool IsSwizzled(D3D12_RESOURCE_DESC const& desc)
+{
+    return desc.Layout == D3D12_TEXTURE_LAYOUT_64KB_STANDARD_SWIZZLE;
+}
 
-    case Compression::Zlib:
-        return CUSTOM_COMPRESSION_FORMAT_ZLIB;
+// Textures that are small enough can be placed at 4KB, rather than 64KB,
+// alignment.  GetResourceAllocationInfo reports the small alignment only for
+// the textures that are eligible; the rest go back to the default.  The desc's
+// alignment is left as the one that was used.
+static D3D12_RESOURCE_ALLOCATION_INFO GetTextureAllocationInfo(ID3D12Device* device, D3D12_RESOURCE_DESC& desc)
+{
+    desc.Alignment = D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT;
 
-    default:
-        throw std::runtime_error("Unknown marc::Compression value");
+    D3D12_RESOURCE_ALLOCATION_INFO info = device->GetResourceAllocationInfo(0, 1, &desc);
+    if (info.Alignment != D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT)
+    {
+        desc.Alignment = 0;
+        info = device->GetResourceAllocationInfo(0, 1, &desc);
     }
+
+    return info;
+}
+
+// The adapter and driver that g_Device runs on, or nullopt if they aren't
+// known, in which case no file's texture layouts are used
+static std::optional<marc::AdapterId> const& GetDeviceAdapterId()
+{
+    static std::optional<marc::AdapterId> const adapterId = []() -> std::optional<marc::AdapterId>
+    {
+        ComPtr<IDXGIFactory4> dxgiFactory;
+        ComPtr<IDXGIAdapter> adapter;
+        marc::AdapterId id;
+        if (FAILED(CreateDXGIFactory(IID_PPV_ARGS(&dxgiFactory))) ||
+            FAILED(dxgiFactory->EnumAdapterByLuid(Graphics::g_Device->GetAdapterLuid(), IID_PPV_ARGS(&adapter))) ||
+            !marc::GetAdapterId(adapter.Get(), id))
+        {
+            return std::nullopt;
+        }
+
+        return id;
+    }();
+
+    return adapterId;
 }
 
-// Converts a given Ptr inside a region from an Offset to a pointer.
+// Converts a given Ptr inside a region of a file older than version 8 from an
+// offset relative to the start of the region to a self-relative one.  The mask
+// comes from marc::GetOffsetMask for the file's version.
 template<typename T1, typename T2>
-void Fixup(MemoryRegion<T1>& region, marc::Ptr<T2>& ptr)
+void MakeSelfRelative(MemoryRegion<T1>& region, marc::Ptr<T2>& ptr, uint64_t offsetMask)
 {
-    auto offset = ptr.Offset;
-    char* data = region.Data() + offset;
+    auto offset = ptr.Offset & offsetMask;
+    if (offset == 0)
+    {
+        ptr.Offset = 0;
+        return;
+    }
 
-    ptr.Ptr = reinterpret_cast<T2*>(data);
+    char* data = region.Data() + offset;
+    ptr.Offset = static_cast<uint64_t>(data - reinterpret_cast<char*>(&ptr));
 }
 
 MarcFile::MarcFile(std::filesystem::path const& path)
-    : m_headerLoaded(EventWait::Create<MarcFile, &MarcFile::OnHeaderLoaded>(this))
-    , m_cpuMetadataLoaded(EventWait::Create<MarcFile, &MarcFile::OnCpuMetadataLoaded>(this))
-    , m_cpuDataLoaded(EventWait::Create<MarcFile, &MarcFile::OnCpuDataLoaded>(this))
-    , m_gpuDataLoaded(EventWait::Create<MarcFile, &MarcFile::OnGpuDataLoaded>(this))
+    : MarcFile(nullptr, path, 0, 0)
 {
     CheckHR(g_dsFactory->OpenFile(path.wstring().c_str(), IID_PPV_ARGS(&m_file)));
+
+    BY_HANDLE_FILE_INFORMATION fileInformation{};
+    if (IsOk())
+        CheckHR(m_file->GetFileInformation(&fileInformation));
+    m_fileSize = (uint64_t(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow;
+}
+
+MarcFile::MarcFile(
+    ComPtr<IDStorageFile> bundle,
+    std::filesystem::path const& bundlePath,
+    uint64_t offset,
+    uint64_t size)
+    : m_path(bundlePath)
+    , m_file(std::move(bundle))
+    , m_fileOffset(offset)
+    , m_fileSize(size)
+{
+}
+
+MarcFile::~MarcFile()
+{
+    GetEventWaitPool().Cancel(this);
+    if (m_completionFences)
+        m_completionFences->Cancel(this);
+
+    CancelRequests();
+}
+
+//
+// All requests created for this instance are tagged with 'this', so we can
+// cancel any outstanding requests.
+//
+void MarcFile::CancelRequests()
+{
+    for (uint32_t i = 0; i < DSTORAGE_PRIORITY_COUNT; ++i)
+    {
+        DSTORAGE_PRIORITY priority = GetPriorityFromIndex(i);
+        for (DSTORAGE_REQUEST_SOURCE_TYPE sourceType : {DSTORAGE_REQUEST_SOURCE_FILE, DSTORAGE_REQUEST_SOURCE_MEMORY})
+        {
+            GetSystemMemoryQueue(priority, sourceType)
+                ->CancelRequestsWithTag(0xFFFFFFFFFFFFll, reinterpret_cast<uint64_t>(this));
+            GetGpuQueue(priority, sourceType)
+                ->CancelRequestsWithTag(0xFFFFFFFFFFFFll, reinterpret_cast<uint64_t>(this));
+        }
+    }
+}
+
+bool MarcFile::CanLoadSwizzledTextures()
+{
+    static bool const supported = []
+    {
+        D3D12_FEATURE_DATA_D3D12_OPTIONS options{};
+        if (FAILED(g_Device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options))))
+            return false;
+
+        return options.StandardSwizzle64KBSupported && options.ResourceHeapTier >= D3D12_RESOURCE_HEAP_TIER_2;
+    }();
+
+    return supported;
+}
+
+void MarcFile::SetCompletionQueue(CompletionQueue* queue, size_t id)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    m_completionQueue = queue;
+    m_completionId = id;
+}
+
+void MarcFile::SetCompletionFences(CompletionFences* fences)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    m_completionFences = fences;
+}
+
+void MarcFile::SetEventWaitPool(EventWaitPool* pool)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    m_eventWaitPool = pool;
+}
+
+//
+// Files that weren't given a pool share one.
+//
+EventWaitPool& MarcFile::GetEventWaitPool()
+{
+    static EventWaitPool sharedPool;
+    return m_eventWaitPool ? *m_eventWaitPool : sharedPool;
+}
+
+void MarcFile::SetSubmitBatcher(SubmitBatcher* batcher)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    m_submitBatcher = batcher;
+}
+
+void MarcFile::SetStatusArrayPool(StatusArrayPool& pool)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    auto range = pool.Allocate(static_cast<uint32_t>(StatusArrayEntry::NumEntries));
+    m_statusArray = std::move(range.StatusArray);
+    m_firstStatusEntry = range.FirstEntry;
+}
+
+void MarcFile::SetMappedMetadataReads(uint32_t limit)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::FileOpen);
+
+    m_mappedMetadataLimit = limit;
+}
+
+//
+// Files that weren't given entries from a pool create their own status array
+// the first time they need one.
+//
+void MarcFile::EnsureStatusArray()
+{
+    // assumes mutex is locked
+
+    if (m_statusArray)
+        return;
+
     CheckHR(g_dsFactory->CreateStatusArray(
         static_cast<uint32_t>(StatusArrayEntry::NumEntries),
         nullptr,
         IID_PPV_ARGS(&m_statusArray)));
+    m_firstStatusEntry = 0;
 }
 
-MarcFile::~MarcFile()
+uint32_t MarcFile::GetStatusIndex(StatusArrayEntry entry) const
 {
-    m_cpuDataLoaded.Close();
-    m_gpuDataLoaded.Close();
-
-    // All requests created for this instance are tagged with 'this', so we can
-    // cancel any outstanding requests.
-    g_dsSystemMemoryQueue->CancelRequestsWithTag(0xFFFFFFFFFFFFll, reinterpret_cast<uint64_t>(this));
-    g_dsGpuQueue->CancelRequestsWithTag(0xFFFFFFFFFFFFll, reinterpret_cast<uint64_t>(this));
+    return m_firstStatusEntry + static_cast<uint32_t>(entry);
 }
 
 //
 // Starts the metadata loading process.  To load the metadata we need to load
-// the header and then the CPU metadata region.
+// the header and then the CPU metadata region.  MiniArchive writes the CPU
+// metadata at the end of the file, so the end of the file is read along with
+// the header; usually this means that the metadata doesn't need a second read
+// from the file.
 //
 void MarcFile::StartMetadataLoad()
 {
@@ -84,223 +290,775 @@ void MarcFile::StartMetadataLoad()
 
     ValidateState(InternalState::FileOpen);
 
-    EnqueueRead(0, &m_header);
+    if (m_mappedMetadataLimit > 0 && LoadMetadataFromMapping())
+        return;
+
+    EnsureStatusArray();
+
+    EnqueueRead(0, &m_header, RegionClass::Metadata);
+
+    if (IsOk())
+    {
+        m_fileTailSize = std::min<uint64_t>(m_fileSize, SpeculativeMetadataReadSize);
+        m_fileTailOffset = m_fileSize - m_fileTailSize;
+        m_fileTail = std::make_unique<char[]>(m_fileTailSize);
+
+        DSTORAGE_REQUEST r{};
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+        r.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+        r.Source.File.Source = m_file.Get();
+        r.Source.File.Offset = m_fileOffset + m_fileTailOffset;
+        r.Source.File.Size = static_cast<uint32_t>(m_fileTailSize);
+        r.Destination.Memory.Buffer = m_fileTail.get();
+        r.Destination.Memory.Size = r.Source.File.Size;
+        r.UncompressedSize = r.Destination.Memory.Size;
+        r.CancellationTag = reinterpret_cast<uint64_t>(this);
+
+        EnqueueRequest(RegionClass::Metadata, r);
+    }
+
+    IDStorageQueue1* queue = GetQueue(RegionClass::Metadata);
+    queue->EnqueueStatus(m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::Metadata));
+    EnqueueCompletion<&MarcFile::OnHeaderLoaded>(queue);
+    RecordSubmit(m_metadataBatch);
+    Submit(queue);
+
+    SetState(InternalState::LoadingHeader);
+}
+
+//
+// The header and CPU metadata are only a few KB, so a DirectStorage round trip
+// and a threadpool callback for each of them is mostly latency.  When the CPU
+// metadata is small enough it's read, and decompressed, on this thread through
+// a mapping of the file instead, leaving DirectStorage to the bulk data.
+// Returns false, having changed nothing, if the metadata must be loaded
+// through DirectStorage after all.
+//
+bool MarcFile::LoadMetadataFromMapping()
+{
+    // assumes mutex is locked
+
+    using namespace Microsoft::WRL::Wrappers;
 
-    m_headerLoaded.SetThreadpoolWait();
-    g_dsSystemMemoryQueue->EnqueueStatus(m_statusArray.Get(), static_cast<uint32_t>(StatusArrayEntry::Metadata));
-    g_dsSystemMemoryQueue->EnqueueSetEvent(m_headerLoaded);
-    g_dsSystemMemoryQueue->Submit();
+    FileHandle file(CreateFileW(
+        m_path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER fileSize{};
+    if (!file.IsValid() || !GetFileSizeEx(file.Get(), &fileSize) || m_fileSize < sizeof(marc::Header) ||
+        m_fileOffset + m_fileSize > static_cast<uint64_t>(fileSize.QuadPart))
+    {
+        return false;
+    }
+
+    HandleT<HandleTraits::HANDLENullTraits> mapping(
+        CreateFileMappingW(file.Get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping.IsValid())
+        return false;
+
+    std::unique_ptr<void, decltype(&UnmapViewOfFile)> view(
+        MapViewOfFile(mapping.Get(), FILE_MAP_READ, 0, 0, 0),
+        &UnmapViewOfFile);
+    if (!view)
+        return false;
+
+    auto data = static_cast<char const*>(view.get()) + m_fileOffset;
+
+    marc::Header header;
+    memcpy(&header, data, sizeof(header));
+    if (!marc::IsSupportedVersion(header.Version))
+        return false;
+
+    uint64_t const offsetMask = marc::GetOffsetMask(header.Version);
+    marc::Region<marc::CpuMetadataHeader> const& region = header.CpuMetadata;
+    uint64_t const metadataOffset = region.Data.Offset & offsetMask;
+    if (region.CompressedSize > m_mappedMetadataLimit ||
+        metadataOffset + region.CompressedSize > m_fileSize)
+    {
+        return false;
+    }
+
+    auto metadata = std::make_unique<char[]>(region.UncompressedSize);
+    if (!DecompressOnCpu(
+            ToCompressionFormat(region.Compression),
+            data + metadataOffset,
+            region.CompressedSize,
+            metadata.get(),
+            region.UncompressedSize))
+    {
+        return false;
+    }
+
+    m_header = header;
+    m_offsetMask = offsetMask;
+    MaskOffset(m_header.CpuMetadata);
+    MaskOffset(m_header.CpuData);
+    MaskOffset(m_header.GpuData);
 
-    m_state = InternalState::LoadingHeader;
+    m_cpuMetadataImage.assign(metadata.get(), metadata.get() + region.UncompressedSize);
+    m_cpuMetadata = MemoryRegion<marc::CpuMetadataHeader>(std::move(metadata));
+
+    PrepareMetadata(nullptr);
+    return true;
 }
 
 //
-// This is called on the threadpool when the m_headerLoaded event is set.  Now
+// This is called on the threadpool once the header has loaded.  Now
 // that the header is loaded we have enough data to load the metadata
 // region.
 //
 void MarcFile::OnHeaderLoaded()
 {
+    ScopedTraceEvent traceEvent("MarcFile::OnHeaderLoaded");
     std::unique_lock lock{m_mutex};
 
     ValidateState(InternalState::LoadingHeader);
 
-    m_status = m_statusArray->GetHResult(static_cast<uint32_t>(StatusArrayEntry::Metadata));
+    RecordCompletion(m_metadataBatch);
+
+    m_status = m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::Metadata));
 
-    if (m_header.Version != marc::CURRENT_MARC_FILE_VERSION || FAILED(m_status))
+    if (!marc::IsSupportedVersion(m_header.Version) || FAILED(m_status))
     {
-        m_state = InternalState::Error;
+        SetState(InternalState::Error);
         return;
     }
 
-    m_cpuMetadata = EnqueueReadMemoryRegion<marc::CpuMetadataHeader>(m_header.CpuMetadata);
+    m_offsetMask = marc::GetOffsetMask(m_header.Version);
+    MaskOffset(m_header.CpuMetadata);
+    MaskOffset(m_header.CpuData);
+    MaskOffset(m_header.GpuData);
+
+    // If the metadata was in the end of the file then the request only has to
+    // copy, or decompress, it from memory.
+    char const* source = nullptr;
+    uint64_t metadataOffset = m_header.CpuMetadata.Data.Offset;
+    if (metadataOffset >= m_fileTailOffset &&
+        metadataOffset + m_header.CpuMetadata.CompressedSize <= m_fileTailOffset + m_fileTailSize)
+    {
+        source = m_fileTail.get() + (metadataOffset - m_fileTailOffset);
+    }
 
-    m_cpuMetadataLoaded.SetThreadpoolWait();
-    g_dsSystemMemoryQueue->EnqueueSetEvent(m_cpuMetadataLoaded);
-    g_dsSystemMemoryQueue->Submit();
+    m_cpuMetadata =
+        EnqueueReadMemoryRegion<marc::CpuMetadataHeader>(m_header.CpuMetadata, RegionClass::Metadata, source);
 
-    m_state = InternalState::LoadingCpuMetadata;
+    IDStorageQueue1* queue =
+        GetQueue(RegionClass::Metadata, source ? DSTORAGE_REQUEST_SOURCE_MEMORY : DSTORAGE_REQUEST_SOURCE_FILE);
+    EnqueueCompletion<&MarcFile::OnCpuMetadataLoaded>(queue);
+    RecordSubmit(m_metadataBatch);
+    Submit(queue);
+
+    SetState(InternalState::LoadingCpuMetadata);
 }
 
 //
-// This is called on the threadpool once the m_cpuMetadataLoaded event is set.
-// The various Ptr's within need to be fixed up, and we can calculate some
+// This is called on the threadpool once the CPU metadata has loaded.
+// The Ptr's within are usable as loaded (unless the file predates self-relative
+// Ptrs, see ConvertLegacyCpuMetadata), and we can calculate some
 // device-specific information (eg allocation infos) and allocate some scratch
 // memory (the non-shader visible descriptor heap) that will be kept resident
 // with the MarcFile.
 //
 void MarcFile::OnCpuMetadataLoaded()
 {
+    ScopedTraceEvent traceEvent("MarcFile::OnCpuMetadataLoaded");
     std::unique_lock lock{m_mutex};
 
     ValidateState(InternalState::LoadingCpuMetadata);
 
-    Fixup(m_cpuMetadata, m_cpuMetadata->Textures.Data);
-    Fixup(m_cpuMetadata, m_cpuMetadata->TextureDescs.Data);
-
-    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
-    {
-        Fixup(m_cpuMetadata, m_cpuMetadata->Textures[i].Name);
-        Fixup(m_cpuMetadata, m_cpuMetadata->Textures[i].SingleMips.Data);
-    }
-
-    ComPtr<ID3D12Device4> device4;
-    CheckHR(Graphics::g_Device->QueryInterface(IID_PPV_ARGS(&device4)));
-    if (!IsOk())
-        return;
-
-    m_textureAllocationInfos.resize(m_cpuMetadata->NumTextures);
+    RecordCompletion(m_metadataBatch);
 
-    m_overallTextureAllocationInfo = device4->GetResourceAllocationInfo1(
-        0,
-        m_cpuMetadata->NumTextures,
-        m_cpuMetadata->TextureDescs.Data.Ptr,
-        m_textureAllocationInfos.data());
+    m_fileTail.reset();
 
-    D3D12_DESCRIPTOR_HEAP_DESC desc{};
-    desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
-    desc.NumDescriptors = m_cpuMetadata->NumTextures;
-
-    CheckHR(g_Device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&m_descriptorHeap)));
-    if (!IsOk())
-        std::abort();
+    m_cpuMetadataImage.assign(m_cpuMetadata.Data(), m_cpuMetadata.Data() + m_header.CpuMetadata.UncompressedSize);
 
-    m_state = InternalState::MetadataReady;
+    PrepareMetadata(nullptr);
 }
 
 //
-// Starts the content loading process.  All of the DirectStorage requests can be
-// enqueued immediately.  Once both sets of work have been completed the final
-// fixups can be applied to the data, and a MiniEngine Model class can be
-// instantiated.
+// Loads the metadata from what a previous run of OnCpuMetadataLoaded computed
+// for the same file.
 //
-void MarcFile::StartContentLoad(
-    std::vector<MultiHeapAllocation> const& texturesAllocations,
-    DescriptorHandle textureHandles,
-    MultiHeapAllocation buffersAllocation)
+void MarcFile::LoadCachedMetadata(CachedMetadata const& metadata)
 {
     std::unique_lock lock{m_mutex};
 
-    ValidateState(InternalState::MetadataReady);
-
-    m_state = InternalState::LoadingContent;
-
-    m_textureHandles = textureHandles;
-
-    LoadCpuData();
-    LoadGpuData(texturesAllocations, buffersAllocation);
-}
+    ValidateState(InternalState::FileOpen);
 
-void MarcFile::LoadCpuData()
-{
-    // assumes mutex is locked
+    if (!marc::IsSupportedVersion(metadata.Header.Version) ||
+        metadata.CpuMetadata.size() != metadata.Header.CpuMetadata.UncompressedSize)
+    {
+        SetState(InternalState::Error);
+        return;
+    }
 
-    m_cpuData = EnqueueReadMemoryRegion<marc::CpuDataHeader>(m_header.CpuData);
-    g_dsSystemMemoryQueue->EnqueueStatus(m_statusArray.Get(), static_cast<uint32_t>(StatusArrayEntry::CpuData));
+    // The cached header's offsets were masked when the header was first
+    // loaded.
+    m_header = metadata.Header;
+    m_offsetMask = marc::GetOffsetMask(m_header.Version);
 
-    m_cpuDataLoaded.SetThreadpoolWait();
-    g_dsSystemMemoryQueue->EnqueueSetEvent(m_cpuDataLoaded);
+    m_cpuMetadata = MemoryRegion<marc::CpuMetadataHeader>(std::make_unique<char[]>(metadata.CpuMetadata.size()));
+    std::copy(metadata.CpuMetadata.begin(), metadata.CpuMetadata.end(), m_cpuMetadata.Data());
 
-    g_dsSystemMemoryQueue->Submit();
+    PrepareMetadata(&metadata);
 }
 
-void MarcFile::LoadGpuData(
-    std::vector<MultiHeapAllocation> const& texturesAllocations,
-    MultiHeapAllocation buffersAllocation)
+//
+// Makes the Ptrs in an older file's CPU metadata self-relative, so that the
+// rest of the code can treat it like a current one.
+//
+void MarcFile::ConvertLegacyCpuMetadata()
 {
-    m_textures.reserve(m_cpuMetadata->NumTextures);
+    MakeSelfRelative(m_cpuMetadata, m_cpuMetadata->Textures.Data, m_offsetMask);
+    MakeSelfRelative(m_cpuMetadata, m_cpuMetadata->TextureDescs.Data, m_offsetMask);
+
     for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
     {
-        m_textures.push_back(EnqueueReadTexture(
-            texturesAllocations[i].Heap.Get(),
-            texturesAllocations[i].Offset,
-            m_cpuMetadata->TextureDescs[i],
-            m_cpuMetadata->Textures[i]));
+        marc::TextureMetadata& texture = m_cpuMetadata->Textures[i];
+        MakeSelfRelative(m_cpuMetadata, texture.Name, m_offsetMask);
+        MakeSelfRelative(m_cpuMetadata, texture.SingleMips.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuMetadata, texture.Tiles.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuMetadata, texture.MipBands.Data, m_offsetMask);
+
+        // The GPU regions are file offsets, so they're only masked
+        for (uint32_t mip = 0; mip < texture.NumSingleMips; ++mip)
+            MaskOffset(texture.SingleMips[mip]);
+        MaskOffset(texture.RemainingMips);
+        for (uint32_t tile = 0; tile < texture.NumTiles; ++tile)
+            MaskOffset(texture.Tiles[tile].Data);
+        for (uint32_t band = 0; band < texture.NumMipBands; ++band)
+            MaskOffset(texture.MipBands[band].Data);
     }
 
-    m_gpuBuffer = EnqueueReadBufferRegion(
-        buffersAllocation.Heap.Get(),
-        buffersAllocation.Offset,
-        m_header.UnstructuredGpuData);
+    MakeSelfRelative(m_cpuMetadata, m_cpuMetadata->TextureStoreName, m_offsetMask);
+}
+
+std::optional<CachedMetadata> MarcFile::TakeMetadataForCache()
+{
+    std::unique_lock lock{m_mutex};
 
-    g_dsGpuQueue->EnqueueStatus(m_statusArray.Get(), static_cast<uint32_t>(StatusArrayEntry::GpuData));
+    if (m_cpuMetadataImage.empty() || !IsMetadataReady())
+        return std::nullopt;
 
-    m_gpuDataLoaded.SetThreadpoolWait();
-    g_dsGpuQueue->EnqueueSetEvent(m_gpuDataLoaded);
+    CachedMetadata metadata;
+    metadata.Header = m_header;
+    metadata.CpuMetadata = std::move(m_cpuMetadataImage);
+    metadata.TextureAllocationInfos = m_textureAllocationInfos;
+    metadata.OverallTextureAllocationInfo = m_overallTextureAllocationInfo;
 
-    g_dsGpuQueue->Submit();
+    m_cpuMetadataImage.clear();
+    return metadata;
 }
 
-void MarcFile::OnCpuDataLoaded()
+//
+// Converts an older file's Ptrs and gets the CPU metadata ready for content
+// loading.
+// The allocation infos are computed, unless they're provided by the cache.
+//
+void MarcFile::PrepareMetadata(CachedMetadata const* cached)
 {
-    Fixup(m_cpuData, m_cpuData->SceneGraph.Data);
-    Fixup(m_cpuData, m_cpuData->Meshes);
-    Fixup(m_cpuData, m_cpuData->Materials.Data);
-    Fixup(m_cpuData, m_cpuData->Animations.Data);
-    Fixup(m_cpuData, m_cpuData->AnimationCurves.Data);
-    Fixup(m_cpuData, m_cpuData->KeyFrameData);
-    Fixup(m_cpuData, m_cpuData->JointIndices.Data);
-    Fixup(m_cpuData, m_cpuData->JointIBMs.Data);
+    // assumes mutex is locked
 
-    std::unique_lock lock{m_mutex};
-    if (!IsOk())
-        return;
+    if (!marc::HasSelfRelativePtrs(m_header.Version))
+        ConvertLegacyCpuMetadata();
 
-    ValidateState(InternalState::LoadingContent, InternalState::GpuDataLoaded);
+    ApplySwizzledLayouts();
 
-    for (uint32_t i = 0; i < m_cpuData->NumAnimationCurves; ++i)
+    if (cached)
     {
-        if (m_cpuData->AnimationCurves[i].targetPath == AnimationCurve::kWeights)
+        // The alignments in the descs were chosen along with the allocation
+        // infos, so they're recovered from them.
+        m_textureAllocationInfos = cached->TextureAllocationInfos;
+        m_overallTextureAllocationInfo = cached->OverallTextureAllocationInfo;
+
+        if (m_textureAllocationInfos.size() != m_cpuMetadata->NumTextures)
         {
-            // Blend shape weights are not supported
-            m_status = E_NOTIMPL;
-            m_state = InternalState::Error;
+            SetState(InternalState::Error);
             return;
         }
-    }
 
-    if (m_state == InternalState::GpuDataLoaded)
-        OnAllDataLoaded();
+        for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+        {
+            D3D12_RESOURCE_DESC& textureDesc = m_cpuMetadata->TextureDescs[i];
+            if (!IsTiled(textureDesc) && !IsSwizzled(textureDesc) &&
+                m_textureAllocationInfos[i].Alignment == D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT)
+            {
+                textureDesc.Alignment = D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT;
+            }
+        }
+    }
     else
-        m_state = InternalState::CpuDataLoaded;
-}
+    {
+        ComputeTextureAllocationInfos();
+        if (!IsOk())
+            return;
+    }
 
-void MarcFile::OnGpuDataLoaded()
-{
-    std::unique_lock lock{m_mutex};
-    if (!IsOk())
-        return;
+    D3D12_DESCRIPTOR_HEAP_DESC desc{};
+    desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+    desc.NumDescriptors = m_cpuMetadata->NumTextures;
 
-    ValidateState(InternalState::LoadingContent, InternalState::CpuDataLoaded);
+    CheckHR(g_Device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&m_descriptorHeap)));
+    if (!IsOk())
+        std::abort();
 
-    if (m_state == InternalState::CpuDataLoaded)
-        OnAllDataLoaded();
-    else
-        m_state = InternalState::GpuDataLoaded;
+    SetState(InternalState::MetadataReady);
 }
 
-//
-// This is called when both the CPU and GPU data has finished loading.  At this
-// point all of the data is there and we just need to fix it up and create the
-// Model instance.
-//
-void MarcFile::OnAllDataLoaded()
+void MarcFile::ComputeTextureAllocationInfos()
 {
-    // assumes that m_mutex is already locked.
+    // assumes mutex is locked
 
-    CheckHR(m_statusArray->GetHResult(static_cast<uint32_t>(StatusArrayEntry::CpuData)));
-    if (!IsOk())
-        return;
+    // Each texture's allocation info comes from the file's texture layouts if
+    // they can be trusted, and otherwise from GetTextureAllocationInfo.
+    //
+    // Tiled textures are reserved resources, which GetResourceAllocationInfo
+    // doesn't describe; they need one 64KB tile of heap for each of their
+    // tiles.
+    //
+    // Shared textures belong to the texture store, so they take up no space.
+    //
+    // The allocation infos are laid out the same way GetResourceAllocationInfo1
+    // would do it.
+    marc::TextureLayout const* layouts = GetValidTextureLayouts(Graphics::g_Device);
 
-    CheckHR(m_statusArray->GetHResult(static_cast<uint32_t>(StatusArrayEntry::GpuData)));
-    if (!IsOk())
-        return;
+    m_textureAllocationInfos.resize(m_cpuMetadata->NumTextures);
+    m_overallTextureAllocationInfo = {0, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT};
 
-    FixupMaterials();
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        D3D12_RESOURCE_DESC& textureDesc = m_cpuMetadata->TextureDescs[i];
+        D3D12_RESOURCE_ALLOCATION_INFO info;
 
-    m_state = InternalState::ContentLoaded;
+        if (IsShared(i))
+        {
+            info = {0, D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT};
+        }
+        else if (IsTiled(textureDesc))
+        {
+            info.SizeInBytes =
+                uint64_t(m_cpuMetadata->Textures[i].NumHeapTiles) * D3D12_TILED_RESOURCE_TILE_SIZE_IN_BYTES;
+            info.Alignment = D3D12_TILED_RESOURCE_TILE_SIZE_IN_BYTES;
+        }
+        else if (IsSwizzled(textureDesc))
+        {
+            // The standard swizzle's size is the same on every adapter, so
+            // the one MiniArchive wrote is used as it is
+            info.SizeInBytes = GetSwizzledTexture(i)->SizeInBytes;
+            info.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+        }
+        else if (layouts)
+        {
+            info = {layouts[i].SizeInBytes, layouts[i].Alignment};
+            bool const smallAlignment = info.Alignment == D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT;
+            textureDesc.Alignment = smallAlignment ? D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT : 0;
+        }
+        else
+        {
+            info = GetTextureAllocationInfo(Graphics::g_Device, textureDesc);
+        }
 
-    m_model = std::make_shared<Model>();
+        D3D12_RESOURCE_ALLOCATION_INFO1& textureInfo = m_textureAllocationInfos[i];
+        textureInfo.Offset = AlignUp(m_overallTextureAllocationInfo.SizeInBytes, info.Alignment);
+        textureInfo.Alignment = info.Alignment;
+        textureInfo.SizeInBytes = info.SizeInBytes;
+
+        m_overallTextureAllocationInfo.SizeInBytes = textureInfo.Offset + textureInfo.SizeInBytes;
+        m_overallTextureAllocationInfo.Alignment = std::max(m_overallTextureAllocationInfo.Alignment, info.Alignment);
+    }
+}
+
+//
+// Returns the file's texture layouts if MiniArchive computed them on this
+// adapter and driver, or nullptr.  As a check against the layouts having been
+// computed differently, the device is still asked about the first texture
+// that it would have been asked about.
+//
+marc::TextureLayout const* MarcFile::GetValidTextureLayouts(ID3D12Device* device)
+{
+    // assumes mutex is locked
+
+    if (!marc::HasTextureLayouts(m_header.Version) || !m_cpuMetadata->TextureLayouts.Data.Get())
+        return nullptr;
+
+    std::optional<marc::AdapterId> const& adapterId = GetDeviceAdapterId();
+    if (!adapterId || *adapterId != m_cpuMetadata->LayoutAdapter)
+        return nullptr;
+
+    marc::TextureLayout const* layouts = &m_cpuMetadata->TextureLayouts[0];
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        D3D12_RESOURCE_DESC& textureDesc = m_cpuMetadata->TextureDescs[i];
+        if (IsShared(i) || IsTiled(textureDesc) || IsSwizzled(textureDesc))
+            continue;
+
+        D3D12_RESOURCE_ALLOCATION_INFO info = GetTextureAllocationInfo(device, textureDesc);
+        if (info.SizeInBytes != layouts[i].SizeInBytes || info.Alignment != layouts[i].Alignment)
+            return nullptr;
+
+        break;
+    }
+
+    return layouts;
+}
+
+//
+// Gives each swizzled texture the standard swizzle layout, if the device can
+// load it that way.  Otherwise the texture is loaded from its other regions,
+// like any other.
+//
+void MarcFile::ApplySwizzledLayouts()
+{
+    // assumes mutex is locked
+
+    if (!CanLoadSwizzledTextures())
+        return;
+
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        if (IsShared(i) || !GetSwizzledTexture(i))
+            continue;
+
+        D3D12_RESOURCE_DESC& textureDesc = m_cpuMetadata->TextureDescs[i];
+        textureDesc.Layout = D3D12_TEXTURE_LAYOUT_64KB_STANDARD_SWIZZLE;
+        textureDesc.Alignment = 0;
+    }
+}
+
+//
+// Starts the content loading process.  All of the DirectStorage requests can be
+// enqueued immediately, through the scheduler.  Once both sets of work have
+// been completed the final fixups can be applied to the data, and a MiniEngine
+// Model class can be instantiated.
+//
+void MarcFile::StartContentLoad(
+    std::vector<MultiHeapAllocation> const& texturesAllocations,
+    DescriptorHandle textureHandles,
+    BufferDestination const& buffers,
+    RequestScheduler& scheduler,
+    MemoryArena* cpuDataArena)
+{
+    std::unique_lock lock{m_mutex};
+
+    ValidateState(InternalState::MetadataReady);
+
+    SetState(InternalState::LoadingContent);
+
+    EnsureStatusArray();
+
+    m_textureHandles = textureHandles;
+
+    m_cpuDataRequests.clear();
+    for (auto& requests : m_gpuDataRequests)
+        requests.clear();
+    m_cpuDataRetried = false;
+    m_gpuQueuesRetried = 0;
+
+    // A prefetch that hasn't completed yet can't be read from, so it's
+    // released once it completes and the content is read from the file.
+    m_usePrefetch = m_prefetchState == PrefetchState::Ready;
+    if (m_prefetchState == PrefetchState::Loading)
+        m_prefetchDiscarded = true;
+
+    m_scheduler = &scheduler;
+    LoadCpuData(cpuDataArena);
+    LoadGpuData(texturesAllocations, buffers);
+    m_scheduler = nullptr;
+}
+
+void MarcFile::LoadCpuData(MemoryArena* arena)
+{
+    // assumes mutex is locked
+
+    m_cpuData = EnqueueReadMemoryRegion<marc::CpuDataHeader>(m_header.CpuData, RegionClass::CpuData, nullptr, arena);
+
+    IDStorageQueue1* queue = m_cpuDataQueue;
+    m_scheduler->EnqueueStatus(queue, m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::CpuData));
+
+    EnqueueCompletion<&MarcFile::OnCpuDataLoaded>(queue);
+
+    RecordSubmit(m_cpuDataBatch);
+}
+
+void MarcFile::LoadGpuData(
+    std::vector<MultiHeapAllocation> const& texturesAllocations,
+    BufferDestination const& buffers)
+{
+    m_gpuQueuesUsed = 0;
+    m_swizzledBuffers.clear();
+
+    m_loadedMips.assign(m_cpuMetadata->NumTextures, 0);
+    m_mipsLoading = false;
+
+    // The store's resources are created when its content load starts, and are
+    // still being loaded; this file's models aren't shown until the store has
+    // finished.
+    std::unique_lock<std::mutex> storeLock;
+    if (m_textureStore)
+        storeLock = std::unique_lock{m_textureStore->m_mutex};
+
+    bool anyTiled = false;
+    m_textures.reserve(m_cpuMetadata->NumTextures);
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        if (IsShared(i))
+        {
+            uint32_t const sharedIndex = m_cpuMetadata->Textures[i].SharedIndex;
+            if (!m_textureStore || sharedIndex >= m_textureStore->m_textures.size())
+            {
+                CheckHR(E_INVALIDARG);
+                m_textures.emplace_back();
+                continue;
+            }
+
+            m_textures.push_back(m_textureStore->m_textures[sharedIndex]);
+            continue;
+        }
+
+        m_textures.push_back(CreateResourceAt(
+            texturesAllocations[i].Heap.Get(),
+            texturesAllocations[i].Offset,
+            m_cpuMetadata->TextureDescs[i]));
+        anyTiled |= IsTiled(m_cpuMetadata->TextureDescs[i]);
+    }
+
+    // DirectStorage can't wait on a fence, so the tile mappings must have been
+    // applied before any requests for the tiled textures are enqueued.
+    if (anyTiled)
+    {
+        CommandQueue& queue = Graphics::g_CommandManager.GetGraphicsQueue();
+        queue.WaitForFence(queue.IncrementFence());
+    }
+
+    storeLock = {};
+
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        if (IsShared(i))
+            continue;
+
+        if (IsSwizzled(m_cpuMetadata->TextureDescs[i]))
+        {
+            EnqueueReadSwizzledTexture(texturesAllocations[i], *GetSwizzledTexture(i));
+            continue;
+        }
+
+        uint32_t const numDetailedMips = GetNumDetailedMips(m_cpuMetadata->Textures[i]);
+        if (m_streamMips && CanStreamMips(i))
+            m_loadedMips[i] = numDetailedMips;
+
+        // Without an expected screen size every detailed mip is left at the
+        // priority of the high resolution mips
+        uint32_t visibleMip = numDetailedMips;
+        if (m_expectedScreenSize > 0.0f)
+            visibleMip = GetNeededMip(m_cpuMetadata->TextureDescs[i], m_expectedScreenSize);
+
+        EnqueueReadTexture(
+            m_textures[i].Get(),
+            m_cpuMetadata->TextureDescs[i],
+            m_cpuMetadata->Textures[i],
+            m_loadedMips[i],
+            visibleMip);
+    }
+    m_requestedMips = m_loadedMips;
+    m_visibleMips = m_loadedMips;
+
+    // A texture store has no GPU data besides its textures
+    if (m_header.UnstructuredGpuData.UncompressedSize > 0)
+        m_gpuBuffer = EnqueueReadBufferRegion(buffers, m_header.UnstructuredGpuData);
+    m_gpuBufferOffset = buffers.SharedBuffer ? buffers.SharedBufferOffset : 0;
+
+    // Each queue that was used reports its own status and completion;
+    // OnGpuDataLoaded waits for all of them.
+    m_numPendingGpuQueues = 0;
+    for (uint32_t i = 0; i < NumGpuQueues; ++i)
+    {
+        if ((m_gpuQueuesUsed & (1u << i)) == 0)
+            continue;
+
+        IDStorageQueue1* queue = GetGpuQueueFromIndex(i);
+        m_scheduler->EnqueueStatus(
+            queue,
+            m_statusArray.Get(),
+            GetStatusIndex(StatusArrayEntry::GpuData) + i);
+
+        EnqueueCompletion<&MarcFile::OnGpuDataLoaded>(queue);
+        ++m_numPendingGpuQueues;
+    }
+
+    RecordSubmit(m_gpuDataBatch);
+}
+
+void MarcFile::OnCpuDataLoaded()
+{
+    ScopedTraceEvent traceEvent("MarcFile::OnCpuDataLoaded");
+    RecordCompletion(m_cpuDataBatch);
+
+    std::unique_lock lock{m_mutex};
+
+    // The CPU data of a cancelled load may be incomplete, so it isn't fixed up
+    if (m_contentCancelled)
+    {
+        OnCancelledDataLoaded(InternalState::GpuDataLoaded, InternalState::CpuDataLoaded);
+        return;
+    }
+
+    if (FAILED(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::CpuData))))
+    {
+        if (!m_cpuDataRetried && IsOk())
+        {
+            m_cpuDataRetried = true;
+
+            IDStorageQueue1* queue = m_cpuDataQueue;
+            RetryRequests(queue, m_cpuDataRequests);
+            queue->EnqueueStatus(m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::CpuData));
+            EnqueueCompletion<&MarcFile::OnCpuDataLoaded>(queue);
+            Submit(queue);
+            return;
+        }
+
+        // Failed again, so the data can't be fixed up
+        CheckHR(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::CpuData)));
+        return;
+    }
+
+    // Current files' Ptrs are self-relative, so the data is used as loaded
+    if (!marc::HasSelfRelativePtrs(m_header.Version))
+    {
+        MakeSelfRelative(m_cpuData, m_cpuData->SceneGraph.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->Meshes, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->Materials.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->Animations.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->AnimationCurves.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->KeyFrameData, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->JointIndices.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->JointIBMs.Data, m_offsetMask);
+        MakeSelfRelative(m_cpuData, m_cpuData->PositionQuantizations.Data, m_offsetMask);
+    }
+
+    if (!IsOk())
+        return;
+
+    ValidateState(InternalState::LoadingContent, InternalState::GpuDataLoaded);
+
+    for (uint32_t i = 0; i < m_cpuData->NumAnimationCurves; ++i)
+    {
+        if (m_cpuData->AnimationCurves[i].targetPath == AnimationCurve::kWeights)
+        {
+            // Blend shape weights are not supported
+            m_status = E_NOTIMPL;
+            SetState(InternalState::Error);
+            return;
+        }
+    }
+
+    if (m_state == InternalState::GpuDataLoaded)
+        OnAllDataLoaded();
+    else
+        SetState(InternalState::CpuDataLoaded);
+}
+
+void MarcFile::OnGpuDataLoaded()
+{
+    ScopedTraceEvent traceEvent("MarcFile::OnGpuDataLoaded");
+    std::unique_lock lock{m_mutex};
+    if (--m_numPendingGpuQueues > 0)
+        return;
+
+    RecordCompletion(m_gpuDataBatch);
+
+    if (m_contentCancelled)
+    {
+        OnCancelledDataLoaded(InternalState::CpuDataLoaded, InternalState::GpuDataLoaded);
+        return;
+    }
+
+    if (!IsOk())
+        return;
+
+    // Each queue that failed for the first time is retried, and this is called
+    // again once the retries have completed.  A queue that fails again is
+    // reported by OnAllDataLoaded.
+    for (uint32_t i = 0; i < NumGpuQueues; ++i)
+    {
+        uint32_t const queueBit = 1u << i;
+        if ((m_gpuQueuesUsed & queueBit) == 0 || (m_gpuQueuesRetried & queueBit) != 0 ||
+            SUCCEEDED(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::GpuData) + i)))
+            continue;
+
+        m_gpuQueuesRetried |= queueBit;
+
+        IDStorageQueue1* queue = GetGpuQueueFromIndex(i);
+        RetryRequests(queue, m_gpuDataRequests[i]);
+        queue->EnqueueStatus(m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::GpuData) + i);
+        EnqueueCompletion<&MarcFile::OnGpuDataLoaded>(queue);
+        Submit(queue);
+        ++m_numPendingGpuQueues;
+    }
+
+    if (m_numPendingGpuQueues > 0)
+        return;
+
+    ValidateState(InternalState::LoadingContent, InternalState::CpuDataLoaded);
+
+    if (m_state == InternalState::CpuDataLoaded)
+        OnAllDataLoaded();
+    else
+        SetState(InternalState::GpuDataLoaded);
+}
+
+//
+// This is called when both the CPU and GPU data has finished loading.  At this
+// point all of the data is there and we just need to fix it up and create the
+// Model instance.
+//
+void MarcFile::OnAllDataLoaded()
+{
+    // assumes that m_mutex is already locked.
+
+    CheckHR(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::CpuData)));
+    if (!IsOk())
+        return;
+
+    for (uint32_t i = 0; i < NumGpuQueues; ++i)
+    {
+        if ((m_gpuQueuesUsed & (1u << i)) == 0)
+            continue;
+
+        CheckHR(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::GpuData) + i));
+        if (!IsOk())
+            return;
+    }
+
+    // The swizzled textures were written through the buffers placed over
+    // them.  The standard swizzle is a defined layout, so the textures inherit
+    // the data once the memory is handed over to them.
+    if (!m_swizzledBuffers.empty())
+    {
+        std::vector<D3D12_RESOURCE_BARRIER> barriers;
+        size_t nextBuffer = 0;
+        for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+        {
+            if (!IsShared(i) && IsSwizzled(m_cpuMetadata->TextureDescs[i]))
+            {
+                barriers.push_back(
+                    CD3DX12_RESOURCE_BARRIER::Aliasing(m_swizzledBuffers[nextBuffer++].Get(), m_textures[i].Get()));
+            }
+        }
+
+        CommandContext& context = CommandContext::Begin(L"Swizzled Textures");
+        context.GetCommandList()->ResourceBarrier(static_cast<UINT>(barriers.size()), barriers.data());
+        context.Finish();
+    }
+
+    FixupMaterials();
+
+    m_model = std::make_shared<Model>();
     m_model->m_BoundingSphere = BoundingSphere(*(XMFLOAT4*)&m_header.BoundingSphere);
     m_model->m_BoundingBox = AxisAlignedBox(Vector3(*(XMFLOAT3*)m_header.MinPos), Vector3(*(XMFLOAT3*)m_header.MaxPos));
     m_model->m_NumNodes = m_cpuData->NumSceneGraphNodes;
@@ -308,154 +1066,751 @@ void MarcFile::OnAllDataLoaded()
     m_model->m_NumAnimations = m_cpuData->NumAnimations;
     m_model->m_NumJoints = m_cpuData->NumJoints;
 
-    m_model->m_MaterialConstants = m_gpuBuffer->GetGPUVirtualAddress() + m_cpuData->MaterialConstantsGpuOffset;
-    m_model->m_DataBuffer = m_gpuBuffer->GetGPUVirtualAddress();
+    if (m_gpuBuffer)
+    {
+        m_model->m_MaterialConstants =
+            m_gpuBuffer->GetGPUVirtualAddress() + m_gpuBufferOffset + m_cpuData->MaterialConstantsGpuOffset;
+        m_model->m_DataBuffer = m_gpuBuffer->GetGPUVirtualAddress() + m_gpuBufferOffset;
+    }
+
+    m_model->m_MeshData = m_cpuData->Meshes.Get();
+    m_model->m_SceneGraph = m_cpuData->SceneGraph.Data.Get();
+    m_model->m_KeyFrameData = m_cpuData->KeyFrameData.Get();
+    m_model->m_CurveData = m_cpuData->AnimationCurves.Data.Get();
+    m_model->m_Animations = m_cpuData->Animations.Data.Get();
+    m_model->m_JointIndices = m_cpuData->JointIndices.Data.Get();
+    m_model->m_JointIBMs = m_cpuData->JointIBMs.Data.Get();
+    if (m_cpuData->NumPositionQuantizations > 0)
+        m_model->m_PositionQuantization = m_cpuData->PositionQuantizations.Data.Get();
+    if (marc::HasMeshlets(m_header.Version) && m_cpuData->NumMeshlets > 0)
+        m_model->m_Meshlets = m_cpuData->Meshlets.Data.Get();
+
+    m_cpuDataRequests.clear();
+    for (auto& requests : m_gpuDataRequests)
+        requests.clear();
+
+    if (m_usePrefetch)
+        ReleasePrefetch();
+
+    SetState(InternalState::ContentLoaded);
+}
+
+//
+// Re-enqueues the requests a file made on a queue that reported a failure.
+// The queue's error record has the first request that failed since it was
+// last retrieved; if that was the only failure and it was one of this file's
+// requests, only it has to be read again.  Otherwise all of the file's
+// requests on the queue are.
+//
+void MarcFile::RetryRequests(IDStorageQueue1* queue, std::vector<DSTORAGE_REQUEST> const& requests)
+{
+    // assumes that m_mutex is already locked.
+
+    DSTORAGE_ERROR_RECORD errorRecord{};
+    queue->RetrieveErrorRecord(&errorRecord);
+
+    DSTORAGE_ERROR_FIRST_FAILURE const& failure = errorRecord.FirstFailure;
+    if (errorRecord.FailureCount == 1 && failure.CommandType == DSTORAGE_COMMAND_TYPE_REQUEST &&
+        failure.Request.Request.CancellationTag == reinterpret_cast<uint64_t>(this))
+    {
+        queue->EnqueueRequest(&failure.Request.Request);
+        return;
+    }
+
+    for (DSTORAGE_REQUEST const& request : requests)
+        queue->EnqueueRequest(&request);
+}
+
+bool MarcFile::CancelContentLoad()
+{
+    std::unique_lock lock{m_mutex};
+
+    if (m_contentCancelled ||
+        !StateIsOneOf(InternalState::LoadingContent, InternalState::CpuDataLoaded, InternalState::GpuDataLoaded))
+        return false;
+
+    m_contentCancelled = true;
+    CancelRequests();
+    return true;
+}
+
+//
+// Called as the CPU or GPU data of a cancelled load completes, in place of the
+// usual transitions.  Once both have completed nothing is writing to the
+// content any more, so it is released and the file can be loaded again.
+//
+void MarcFile::OnCancelledDataLoaded(InternalState otherDataLoaded, InternalState thisDataLoaded)
+{
+    // assumes that m_mutex is already locked.
+
+    if (m_state != otherDataLoaded)
+    {
+        SetState(thisDataLoaded);
+        return;
+    }
+
+    m_cpuData = {};
+    m_textures.clear();
+    m_gpuBuffer.Reset();
+    m_swizzledBuffers.clear();
+
+    if (m_usePrefetch)
+        ReleasePrefetch();
+
+    m_contentCancelled = false;
+    SetState(InternalState::MetadataReady);
+}
+
+//
+// The prefetch reads the regions a content load needs first, still compressed,
+// into a single buffer.  The reads are made on the CPU data queue and submitted
+// straight away; they aren't part of the content load's telemetry.
+//
+size_t MarcFile::StartPrefetch()
+{
+    std::unique_lock lock{m_mutex};
+
+    if (m_state != InternalState::MetadataReady || m_prefetchState != PrefetchState::None)
+        return 0;
+
+    EnsureStatusArray();
+
+    m_prefetchedRanges.clear();
+    m_prefetchSize = 0;
+
+    auto addRange = [&](auto const& region)
+    {
+        if (region.CompressedSize == 0)
+            return;
+        m_prefetchedRanges.push_back({region.Data.Offset, region.CompressedSize, nullptr});
+        m_prefetchSize += region.CompressedSize;
+    };
+
+    addRange(m_header.CpuData);
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+        addRange(m_cpuMetadata->Textures[i].RemainingMips);
+
+    if (m_prefetchSize == 0)
+        return 0;
+
+    std::sort(
+        m_prefetchedRanges.begin(),
+        m_prefetchedRanges.end(),
+        [](PrefetchedRange const& a, PrefetchedRange const& b) { return a.FileOffset < b.FileOffset; });
+
+    m_prefetchBuffer = std::make_unique<char[]>(m_prefetchSize);
+
+    IDStorageQueue1* queue = GetQueue(RegionClass::CpuData);
+
+    char* dest = m_prefetchBuffer.get();
+    for (PrefetchedRange& range : m_prefetchedRanges)
+    {
+        range.Data = dest;
+
+        DSTORAGE_REQUEST r{};
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+        r.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+        r.Source.File.Source = m_file.Get();
+        r.Source.File.Offset = m_fileOffset + range.FileOffset;
+        r.Source.File.Size = range.Size;
+        r.Destination.Memory.Buffer = dest;
+        r.Destination.Memory.Size = range.Size;
+        r.UncompressedSize = range.Size;
+        r.CancellationTag = reinterpret_cast<uint64_t>(this);
+        RecordTraceRequest(m_path, r.Source.File.Offset, r);
+        queue->EnqueueRequest(&r);
+
+        dest += range.Size;
+    }
+
+    queue->EnqueueStatus(m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::Prefetch));
+    EnqueueCompletion<&MarcFile::OnPrefetchLoaded>(queue);
+    Submit(queue);
+
+    m_prefetchState = PrefetchState::Loading;
+    m_prefetchDiscarded = false;
+    return m_prefetchSize;
+}
+
+void MarcFile::OnPrefetchLoaded()
+{
+    ScopedTraceEvent traceEvent("MarcFile::OnPrefetchLoaded");
+    std::unique_lock lock{m_mutex};
+
+    // A failed prefetch isn't an error for the file; its content is read from
+    // the file as if there had been no prefetch.
+    if (m_prefetchDiscarded || FAILED(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::Prefetch))))
+    {
+        ReleasePrefetch();
+        return;
+    }
+
+    m_prefetchState = PrefetchState::Ready;
+}
+
+void MarcFile::DiscardPrefetch()
+{
+    std::unique_lock lock{m_mutex};
+
+    if (m_usePrefetch)
+        return;
+
+    if (m_prefetchState == PrefetchState::Loading)
+        m_prefetchDiscarded = true;
+    else if (m_prefetchState == PrefetchState::Ready)
+        ReleasePrefetch();
+}
+
+size_t MarcFile::GetPrefetchSize() const
+{
+    std::unique_lock lock{m_mutex};
+    return m_prefetchState == PrefetchState::None ? 0 : m_prefetchSize;
+}
+
+void MarcFile::ReleasePrefetch()
+{
+    // assumes that m_mutex is already locked.
+
+    m_prefetchBuffer.reset();
+    m_prefetchedRanges.clear();
+    m_prefetchSize = 0;
+    m_prefetchState = PrefetchState::None;
+    m_prefetchDiscarded = false;
+    m_usePrefetch = false;
+}
+
+//
+// Returns where a region of the file was prefetched to, or nullptr if it
+// wasn't.
+//
+char const* MarcFile::FindPrefetched(uint64_t fileOffset, uint32_t size) const
+{
+    auto it = std::lower_bound(
+        m_prefetchedRanges.begin(),
+        m_prefetchedRanges.end(),
+        fileOffset,
+        [](PrefetchedRange const& range, uint64_t offset) { return range.FileOffset < offset; });
+
+    if (it == m_prefetchedRanges.end() || it->FileOffset != fileOffset || it->Size != size)
+        return nullptr;
+    return it->Data;
+}
+
+//
+// Returns where in m_file a request's data is.  A request read from memory is
+// reading either a prefetched range or the speculatively read end of the file,
+// so this is where that was read from.
+//
+uint64_t MarcFile::GetSourceFileOffset(DSTORAGE_REQUEST const& request) const
+{
+    if (request.Options.SourceType == DSTORAGE_REQUEST_SOURCE_FILE)
+        return request.Source.File.Offset;
+
+    auto source = static_cast<char const*>(request.Source.Memory.Source);
+    for (PrefetchedRange const& range : m_prefetchedRanges)
+    {
+        if (source >= range.Data && source < range.Data + range.Size)
+            return m_fileOffset + range.FileOffset + (source - range.Data);
+    }
+
+    assert(m_fileTail && source >= m_fileTail.get() && source < m_fileTail.get() + m_fileTailSize);
+    return m_fileOffset + m_fileTailOffset + (source - m_fileTail.get());
+}
+
+// MarcFiles are fixed up on the threadpool, so more than one may be looking up
+// or adding sampler tables at once.
+static std::mutex g_SamplerPermutationsMutex;
+static std::unordered_map<uint32_t, uint32_t> g_SamplerPermutations;
+
+static D3D12_CPU_DESCRIPTOR_HANDLE GetSampler(uint32_t addressModes)
+{
+    SamplerDesc samplerDesc;
+    samplerDesc.AddressU = D3D12_TEXTURE_ADDRESS_MODE(addressModes & 0x3);
+    samplerDesc.AddressV = D3D12_TEXTURE_ADDRESS_MODE(addressModes >> 2);
+    return samplerDesc.CreateDescriptor();
+}
+
+//
+// Returns the offset of the sampler table for this combination of address
+// modes.  If it hasn't been used before, more samplers are allocated from the
+// heap and the descriptors copied in.
+//
+static uint32_t GetSamplerTable(uint32_t addressModes)
+{
+    std::unique_lock lock(g_SamplerPermutationsMutex);
+
+    auto samplerMapLookup = g_SamplerPermutations.find(addressModes);
+    if (samplerMapLookup != g_SamplerPermutations.end())
+        return samplerMapLookup->second;
+
+    DescriptorHandle samplerHandles = Renderer::s_SamplerHeap.Alloc(kNumTextures);
+    uint32_t samplerDescriptorTable = Renderer::s_SamplerHeap.GetOffsetOfHandle(samplerHandles);
+    g_SamplerPermutations[addressModes] = samplerDescriptorTable;
+
+    uint32_t destCount = kNumTextures;
+    uint32_t sourceCounts[kNumTextures] = {1, 1, 1, 1, 1};
+    D3D12_CPU_DESCRIPTOR_HANDLE sourceSamplers[kNumTextures];
+    for (uint32_t j = 0; j < kNumTextures; ++j)
+    {
+        sourceSamplers[j] = GetSampler(addressModes & 0xF);
+        addressModes >>= 4;
+    }
+
+    D3D12_CPU_DESCRIPTOR_HANDLE destHandle = samplerHandles;
+    g_Device->CopyDescriptors(
+        1,
+        &destHandle,
+        &destCount,
+        destCount,
+        sourceSamplers,
+        sourceCounts,
+        D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER);
+
+    return samplerDescriptorTable;
+}
+
+//
+// Each material has a table of kNumTextures descriptors, and the tables are
+// consecutive from m_textureHandles, so all of the texture descriptors are
+// copied into them with a single CopyDescriptors call.
+//
+void MarcFile::FixupMaterials()
+{
+    using namespace Graphics;
+
+    CreateTextureDescriptors();
+    auto increment = g_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    D3D12_CPU_DESCRIPTOR_HANDLE cpuDescriptors = m_descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+
+    uint32_t const numMaterials = m_cpuMetadata->NumMaterials;
+    std::vector<uint32_t> tableOffsets(numMaterials);
+
+    static D3D12_CPU_DESCRIPTOR_HANDLE defaultTextures[kNumTextures] = {
+        GetDefaultTexture(kWhiteOpaque2D),
+        GetDefaultTexture(kWhiteOpaque2D),
+        GetDefaultTexture(kWhiteOpaque2D),
+        GetDefaultTexture(kBlackTransparent2D),
+        GetDefaultTexture(kDefaultNormalMap)};
+
+    std::vector<D3D12_CPU_DESCRIPTOR_HANDLE> sourceTextures;
+    sourceTextures.reserve(numMaterials * kNumTextures);
+    uint32_t const srvDescriptorTableStart = Renderer::s_TextureHeap.GetOffsetOfHandle(m_textureHandles);
+
+    // Materials that only differ in their constants use the same textures, so
+    // they share a descriptor table.  The meshes that share one then don't
+    // change the table between their draws.
+    std::map<std::array<uint16_t, kNumTextures>, uint32_t> srvTables;
+
+    for (uint32_t matIdx = 0; matIdx < numMaterials; ++matIdx)
+    {
+        marc::Material const& srcMat = m_cpuData->Materials[matIdx];
+
+        std::array<uint16_t, kNumTextures> textureIndices;
+        std::copy(std::begin(srcMat.TextureIndex), std::end(srcMat.TextureIndex), textureIndices.begin());
+
+        auto [table, inserted] = srvTables.try_emplace(
+            textureIndices,
+            srvDescriptorTableStart + static_cast<uint32_t>(sourceTextures.size()));
+        if (inserted)
+        {
+            for (uint32_t j = 0; j < kNumTextures; ++j)
+            {
+                if (srcMat.TextureIndex[j] == 0xffff)
+                    sourceTextures.push_back(defaultTextures[j]);
+                else
+                    sourceTextures.push_back(
+                        CD3DX12_CPU_DESCRIPTOR_HANDLE(cpuDescriptors, srcMat.TextureIndex[j], increment));
+            }
+        }
+
+        tableOffsets[matIdx] = table->second | GetSamplerTable(srcMat.AddressModes) << 16;
+    }
+
+    if (!sourceTextures.empty())
+    {
+        D3D12_CPU_DESCRIPTOR_HANDLE destHandle = m_textureHandles;
+        uint32_t destCount = static_cast<uint32_t>(sourceTextures.size());
+        std::vector<uint32_t> sourceCounts(sourceTextures.size(), 1);
+
+        g_Device->CopyDescriptors(
+            1,
+            &destHandle,
+            &destCount,
+            static_cast<uint32_t>(sourceTextures.size()),
+            sourceTextures.data(),
+            sourceCounts.data(),
+            D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    }
+
+    // Update table offsets for each mesh
+    uint8_t* meshPtr = m_cpuData->Meshes.Get();
+    for (uint32_t i = 0; i < m_cpuData->NumMeshes; ++i)
+    {
+        Mesh& mesh = *(Mesh*)meshPtr;
+        uint32_t offsetPair = tableOffsets[mesh.materialCBV];
+        mesh.srvTable = offsetPair & 0xFFFF;
+        mesh.samplerTable = offsetPair >> 16;
+        mesh.pso = Renderer::GetPSO(mesh.psoFlags);
+        meshPtr += sizeof(Mesh) + (mesh.numDraws - 1) * sizeof(Mesh::Draw);
+    }
+}
+
+//
+// Creating the views is the bulk of the fixup work for models with many
+// textures, so they are created in parallel.  The device's descriptor
+// creation methods are free-threaded.
+//
+void MarcFile::CreateTextureDescriptors()
+{
+    auto increment = g_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    D3D12_CPU_DESCRIPTOR_HANDLE descriptors = m_descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+
+    std::vector<uint32_t> textureIndices(m_cpuMetadata->NumTextures);
+    std::iota(textureIndices.begin(), textureIndices.end(), 0);
+
+    std::for_each(std::execution::par, textureIndices.begin(), textureIndices.end(), [&](uint32_t i) {
+        auto descriptor = CD3DX12_CPU_DESCRIPTOR_HANDLE(descriptors, i, increment);
+
+        if (m_visibleMips[i] == 0)
+        {
+            g_Device->CreateShaderResourceView(m_textures[i].Get(), nullptr, descriptor);
+            return;
+        }
+
+        // Clamp the view so that the mips that haven't been loaded yet are
+        // never sampled.
+        D3D12_RESOURCE_DESC const& desc = m_cpuMetadata->TextureDescs[i];
+
+        D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc{};
+        srvDesc.Format = desc.Format;
+        srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+        srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+        srvDesc.Texture2D.MipLevels = static_cast<UINT>(-1);
+        srvDesc.Texture2D.ResourceMinLODClamp = static_cast<float>(m_visibleMips[i]);
+
+        g_Device->CreateShaderResourceView(m_textures[i].Get(), &srvDesc, descriptor);
+    });
+}
+
+void MarcFile::SetMipStreaming(bool enabled, DescriptorHandle spareTextureHandles)
+{
+    std::unique_lock lock{m_mutex};
+
+    m_streamMips = enabled && !spareTextureHandles.IsNull();
+    m_spareTextureHandles = spareTextureHandles;
+}
+
+bool MarcFile::IsShared(uint32_t textureIndex) const
+{
+    return m_cpuMetadata->Textures[textureIndex].SharedIndex != marc::NotShared;
+}
+
+//
+// The texture's swizzled parts, or nullptr if it wasn't swizzled.
+//
+marc::SwizzledTexture const* MarcFile::GetSwizzledTexture(uint32_t textureIndex) const
+{
+    if (!marc::HasSwizzledTextures(m_header.Version) || !m_cpuMetadata->SwizzledTextures.Data.Get())
+        return nullptr;
+
+    marc::SwizzledTexture const& swizzled = m_cpuMetadata->SwizzledTextures[textureIndex];
+    return swizzled.NumParts > 0 ? &swizzled : nullptr;
+}
+
+//
+// Only plain 2D textures, whose detailed mips are stored individually or as
+// tiles, are streamed; the rest are always loaded in full.  Shared textures
+// are loaded in full by their store, and swizzled ones in a single pass.
+//
+bool MarcFile::CanStreamMips(uint32_t textureIndex) const
+{
+    if (IsShared(textureIndex))
+        return false;
+
+    D3D12_RESOURCE_DESC const& desc = m_cpuMetadata->TextureDescs[textureIndex];
+    if (IsSwizzled(desc))
+        return false;
+
+    marc::TextureMetadata const& textureMetadata = m_cpuMetadata->Textures[textureIndex];
+
+    return desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE2D && desc.DepthOrArraySize == 1 &&
+           GetNumDetailedMips(textureMetadata) > 0 && textureMetadata.RemainingMips.UncompressedSize != 0;
+}
+
+void MarcFile::RequestMips(float pixelsAcross)
+{
+    std::unique_lock lock{m_mutex};
+
+    if (!m_streamMips || m_state != InternalState::ContentLoaded || m_mipsLoading)
+        return;
+
+    bool anyRequested = false;
+    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    {
+        if (m_loadedMips[i] == 0)
+            continue;
+
+        D3D12_RESOURCE_DESC const& desc = m_cpuMetadata->TextureDescs[i];
+        uint32_t neededMip = GetNeededMip(desc, pixelsAcross);
+
+        if (neededMip >= m_loadedMips[i])
+            continue;
+
+        EnqueueReadDetailedMips(
+            m_textures[i].Get(),
+            desc,
+            m_cpuMetadata->Textures[i],
+            neededMip,
+            m_loadedMips[i],
+            RegionClass::HighResolutionMips);
+
+        m_requestedMips[i] = neededMip;
+        anyRequested = true;
+    }
+
+    if (!anyRequested)
+        return;
+
+    IDStorageQueue1* queue = GetQueue(RegionClass::HighResolutionMips);
+    queue->EnqueueStatus(m_statusArray.Get(), GetStatusIndex(StatusArrayEntry::Mips));
+    auto mipsLoaded = EventWaitPool::Callback::Create<MarcFile, &MarcFile::OnMipsLoaded>(this);
+    queue->EnqueueSetEvent(GetEventWaitPool().Arm(mipsLoaded));
+    RecordSubmit(m_mipsBatch);
+    Submit(queue);
+
+    m_mipsLoading = true;
+}
+
+void MarcFile::OnMipsLoaded()
+{
+    ScopedTraceEvent traceEvent("MarcFile::OnMipsLoaded");
+    std::unique_lock lock{m_mutex};
+
+    RecordCompletion(m_mipsBatch);
+    m_mipsLoading = false;
+
+    // If the mips failed to load the textures just stay at the detail they had
+    if (FAILED(m_statusArray->GetHResult(GetStatusIndex(StatusArrayEntry::Mips))))
+    {
+        m_requestedMips = m_loadedMips;
+        return;
+    }
+
+    m_loadedMips = m_requestedMips;
+
+    if (m_completionQueue)
+        m_completionQueue->Push(m_completionId);
+}
+
+void MarcFile::WaitForStreamedMips()
+{
+    bool mipsLoading;
+    {
+        std::unique_lock lock{m_mutex};
+        mipsLoading = m_mipsLoading;
+    }
+
+    if (mipsLoading)
+        GetEventWaitPool().Wait(EventWaitPool::Callback::Create<MarcFile, &MarcFile::OnMipsLoaded>(this));
+}
+
+bool MarcFile::UpdateStreamedMips()
+{
+    std::unique_lock lock{m_mutex};
+
+    if (!m_streamMips || m_state != InternalState::ContentLoaded || m_visibleMips == m_loadedMips)
+        return true;
+
+    if (!Graphics::g_CommandManager.IsFenceComplete(m_spareTablesFence))
+        return false;
+
+    m_visibleMips = m_loadedMips;
+
+    // Frames that have already been submitted may still be using the current
+    // tables, so the new descriptors go into the spare ones.
+    std::swap(m_textureHandles, m_spareTextureHandles);
+    FixupMaterials();
+
+    m_spareTablesFence = Graphics::g_CommandManager.GetGraphicsQueue().IncrementFence();
+    return true;
+}
+
+void MarcFile::SetPriority(RegionClass regionClass, DSTORAGE_PRIORITY priority)
+{
+    std::unique_lock lock(m_mutex);
+    m_priorities[static_cast<size_t>(regionClass)] = priority;
+}
+
+Math::BoundingSphere MarcFile::GetBoundingSphere() const
+{
+    std::unique_lock lock(m_mutex);
+    if (!IsMetadataReady())
+        return Math::BoundingSphere(Math::kZero);
+    return Math::BoundingSphere(*reinterpret_cast<XMFLOAT4 const*>(&m_header.BoundingSphere));
+}
+
+void MarcFile::SetExpectedScreenSize(float pixelsAcross)
+{
+    std::unique_lock lock(m_mutex);
+    m_expectedScreenSize = pixelsAcross;
+}
+
+bool MarcFile::IsTextureStore() const
+{
+    std::unique_lock lock(m_mutex);
+    return IsMetadataReady() && m_cpuMetadata->IsTextureStore != 0;
+}
+
+std::string MarcFile::GetTextureStoreName() const
+{
+    std::unique_lock lock(m_mutex);
+    if (!IsMetadataReady() || m_cpuMetadata->TextureStoreName.Offset == 0)
+        return {};
+    return m_cpuMetadata->TextureStoreName.Get();
+}
+
+void MarcFile::SetTextureStore(MarcFile* store)
+{
+    std::unique_lock lock(m_mutex);
+    m_textureStore = store;
+}
+
+//
+// Returns the queue that requests for the given class of region are enqueued
+// on.  Metadata and CPU data are read into system memory, everything else into
+// GPU resources.  A queue only takes requests of one source type, so requests
+// that read from memory have queues of their own.
+//
+IDStorageQueue1* MarcFile::GetQueue(RegionClass regionClass, DSTORAGE_REQUEST_SOURCE_TYPE sourceType)
+{
+    DSTORAGE_PRIORITY priority = m_priorities[static_cast<size_t>(regionClass)];
 
-    m_model->m_MeshData = m_cpuData->Meshes.Ptr;
-    m_model->m_SceneGraph = m_cpuData->SceneGraph.Data.Ptr;
-    m_model->m_KeyFrameData = m_cpuData->KeyFrameData.Ptr;
-    m_model->m_CurveData = m_cpuData->AnimationCurves.Data.Ptr;
-    m_model->m_Animations = m_cpuData->Animations.Data.Ptr;
-    m_model->m_JointIndices = m_cpuData->JointIndices.Data.Ptr;
-    m_model->m_JointIBMs = m_cpuData->JointIBMs.Data.Ptr;
+    if (regionClass == RegionClass::Metadata || regionClass == RegionClass::CpuData)
+        return GetSystemMemoryQueue(priority, sourceType);
+    else
+        return GetGpuQueue(priority, sourceType);
 }
 
-static std::unordered_map<uint32_t, uint32_t> g_SamplerPermutations;
-
-static D3D12_CPU_DESCRIPTOR_HANDLE GetSampler(uint32_t addressModes)
+uint32_t MarcFile::GetGpuQueueIndex(RegionClass regionClass, DSTORAGE_REQUEST_SOURCE_TYPE sourceType) const
 {
-    SamplerDesc samplerDesc;
-    samplerDesc.AddressU = D3D12_TEXTURE_ADDRESS_MODE(addressModes & 0x3);
-    samplerDesc.AddressV = D3D12_TEXTURE_ADDRESS_MODE(addressModes >> 2);
-    return samplerDesc.CreateDescriptor();
+    uint32_t index = GetPriorityIndex(m_priorities[static_cast<size_t>(regionClass)]);
+    return sourceType == DSTORAGE_REQUEST_SOURCE_MEMORY ? index + DSTORAGE_PRIORITY_COUNT : index;
 }
 
-void MarcFile::FixupMaterials()
+IDStorageQueue1* MarcFile::GetGpuQueueFromIndex(uint32_t index)
 {
-    using namespace Graphics;
-
-    CreateTextureDescriptors();
-    auto increment = g_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-    D3D12_CPU_DESCRIPTOR_HANDLE cpuDescriptors = m_descriptorHeap->GetCPUDescriptorHandleForHeapStart();
-
-    std::vector<uint32_t> tableOffsets(m_cpuMetadata->NumMaterials);
-    DescriptorHandle textureHandles = m_textureHandles;
+    DSTORAGE_PRIORITY priority = GetPriorityFromIndex(index % DSTORAGE_PRIORITY_COUNT);
+    return GetGpuQueue(
+        priority,
+        index < DSTORAGE_PRIORITY_COUNT ? DSTORAGE_REQUEST_SOURCE_FILE : DSTORAGE_REQUEST_SOURCE_MEMORY);
+}
 
-    for (uint32_t matIdx = 0; matIdx < m_cpuMetadata->NumMaterials; ++matIdx)
+LoadTelemetryBatch& MarcFile::GetTelemetryBatch(RegionClass regionClass)
+{
+    switch (regionClass)
     {
-        marc::Material const& srcMat = m_cpuData->Materials[matIdx];
+    case RegionClass::Metadata:
+        return m_metadataBatch;
 
-        uint32_t srvDescriptorTable = Renderer::s_TextureHeap.GetOffsetOfHandle(textureHandles);
+    case RegionClass::CpuData:
+        return m_cpuDataBatch;
 
-        uint32_t destCount = kNumTextures;
-        uint32_t sourceCounts[kNumTextures] = {1, 1, 1, 1, 1};
+    default:
+        // Mips requested once the content has loaded are tracked separately
+        return m_state == InternalState::ContentLoaded ? m_mipsBatch : m_gpuDataBatch;
+    }
+}
 
-        static D3D12_CPU_DESCRIPTOR_HANDLE defaultTextures[kNumTextures] = {
-            GetDefaultTexture(kWhiteOpaque2D),
-            GetDefaultTexture(kWhiteOpaque2D),
-            GetDefaultTexture(kWhiteOpaque2D),
-            GetDefaultTexture(kBlackTransparent2D),
-            GetDefaultTexture(kDefaultNormalMap)};
+void MarcFile::EnqueueRequest(RegionClass regionClass, DSTORAGE_REQUEST const& unroutedRequest)
+{
+    // assumes mutex is locked
 
-        D3D12_CPU_DESCRIPTOR_HANDLE sourceTextures[kNumTextures];
-        for (uint32_t j = 0; j < kNumTextures; ++j)
-        {
-            if (srcMat.TextureIndex[j] == 0xffff)
-                sourceTextures[j] = defaultTextures[j];
-            else
-                sourceTextures[j] = CD3DX12_CPU_DESCRIPTOR_HANDLE(cpuDescriptors, srcMat.TextureIndex[j], increment);
-        }
+    // A retried request keeps the route it was first given
+    DSTORAGE_REQUEST request = unroutedRequest;
+    RouteDecompression(request);
 
-        g_Device->CopyDescriptors(
-            1,
-            &textureHandles,
-            &destCount,
-            destCount,
-            sourceTextures,
-            sourceCounts,
-            D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    DSTORAGE_REQUEST_SOURCE_TYPE const sourceType = request.Options.SourceType;
+    bool const isGpuRequest = request.Options.DestinationType != DSTORAGE_REQUEST_DESTINATION_MEMORY;
+    if (isGpuRequest)
+        m_gpuQueuesUsed |= 1u << GetGpuQueueIndex(regionClass, sourceType);
 
-        // See if this combination of samplers has been used before.  If not,
-        // allocate more from the heap and copy in the descriptors.
-        uint32_t addressModes = srcMat.AddressModes;
-        auto samplerMapLookup = g_SamplerPermutations.find(addressModes);
+    IDStorageQueue1* queue = GetQueue(regionClass, sourceType);
+    if (regionClass == RegionClass::CpuData)
+        m_cpuDataQueue = queue;
 
-        if (samplerMapLookup == g_SamplerPermutations.end())
-        {
-            DescriptorHandle SamplerHandles = Renderer::s_SamplerHeap.Alloc(kNumTextures);
-            uint32_t SamplerDescriptorTable = Renderer::s_SamplerHeap.GetOffsetOfHandle(SamplerHandles);
-            g_SamplerPermutations[addressModes] = SamplerDescriptorTable;
-            tableOffsets[matIdx] = srvDescriptorTable | SamplerDescriptorTable << 16;
+    RecordEnqueue(GetTelemetryBatch(regionClass), request);
+    if (IsCapturingLoadTrace())
+        RecordTraceRequest(m_path, GetSourceFileOffset(request), request);
 
-            D3D12_CPU_DESCRIPTOR_HANDLE SourceSamplers[kNumTextures];
-            for (uint32_t j = 0; j < kNumTextures; ++j)
-            {
-                SourceSamplers[j] = GetSampler(addressModes & 0xF);
-                addressModes >>= 4;
-            }
-            g_Device->CopyDescriptors(
-                1,
-                &SamplerHandles,
-                &destCount,
-                destCount,
-                SourceSamplers,
-                sourceCounts,
-                D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER);
-        }
+    if (m_scheduler)
+    {
+        // Content requests are kept in case they have to be retried
+        if (isGpuRequest)
+            m_gpuDataRequests[GetGpuQueueIndex(regionClass, sourceType)].push_back(request);
         else
-        {
-            tableOffsets[matIdx] = srvDescriptorTable | samplerMapLookup->second << 16;
-        }
+            m_cpuDataRequests.push_back(request);
 
-        textureHandles += increment * kNumTextures;
+        m_scheduler->EnqueueRequest(queue, request);
     }
+    else
+        queue->EnqueueRequest(&request);
+}
 
-    // Update table offsets for each mesh
-    uint8_t* meshPtr = m_cpuData->Meshes.Ptr;
-    for (uint32_t i = 0; i < m_cpuData->NumMeshes; ++i)
-    {
-        Mesh& mesh = *(Mesh*)meshPtr;
-        uint32_t offsetPair = tableOffsets[mesh.materialCBV];
-        mesh.srvTable = offsetPair & 0xFFFF;
-        mesh.samplerTable = offsetPair >> 16;
-        mesh.pso = Renderer::GetPSO(mesh.psoFlags);
-        meshPtr += sizeof(Mesh) + (mesh.numDraws - 1) * sizeof(Mesh::Draw);
-    }
+void MarcFile::Submit(IDStorageQueue1* queue)
+{
+    if (m_submitBatcher)
+        m_submitBatcher->Submit(queue);
+    else
+        queue->Submit();
 }
 
-void MarcFile::CreateTextureDescriptors()
+//
+// Has FN called once the requests already enqueued on the queue have
+// completed, either by a signal on the completion fences or by setting an
+// event from the pool.
+//
+template<void (MarcFile::*FN)()>
+void MarcFile::EnqueueCompletion(IDStorageQueue1* queue)
 {
-    auto increment = g_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-    D3D12_CPU_DESCRIPTOR_HANDLE descriptors = m_descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+    // assumes mutex is locked
 
-    for (uint32_t i = 0; i < m_cpuMetadata->NumTextures; ++i)
+    if (m_completionFences)
     {
-        g_Device->CreateShaderResourceView(
-            m_textures[i].Get(),
-            nullptr,
-            CD3DX12_CPU_DESCRIPTOR_HANDLE(descriptors, i, increment));
+        auto callback = CompletionFences::Callback::Create<MarcFile, FN>(this);
+        if (m_scheduler)
+            m_scheduler->EnqueueSignal(queue, *m_completionFences, callback);
+        else
+            m_completionFences->EnqueueSignal(queue, callback);
+        return;
     }
+
+    HANDLE event = GetEventWaitPool().Arm(EventWaitPool::Callback::Create<MarcFile, FN>(this));
+    if (m_scheduler)
+        m_scheduler->EnqueueSetEvent(queue, event);
+    else
+        queue->EnqueueSetEvent(event);
 }
 
 //
 // Enqueues a read of a single, fixed-size, uncompressed piece of data.
 //
 template<typename T>
-void MarcFile::EnqueueRead(uint64_t offset, T* dest)
+void MarcFile::EnqueueRead(uint64_t offset, T* dest, RegionClass regionClass)
 {
     DSTORAGE_REQUEST r{};
     r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
     r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
     r.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
     r.Source.File.Source = m_file.Get();
-    r.Source.File.Offset = offset;
+    r.Source.File.Offset = m_fileOffset + offset;
     r.Source.File.Size = static_cast<uint32_t>(sizeof(T));
     r.Destination.Memory.Buffer = dest;
     r.Destination.Memory.Size = r.Source.File.Size;
     r.UncompressedSize = r.Destination.Memory.Size;
     r.CancellationTag = reinterpret_cast<uint64_t>(this);
 
-    g_dsSystemMemoryQueue->EnqueueRequest(&r);
+    EnqueueRequest(regionClass, r);
 }
 
 //
@@ -465,87 +1820,157 @@ void MarcFile::EnqueueRead(uint64_t offset, T* dest)
 // The T template parameters specifies the type of the header of the region.
 // Regions may be larger than sizeof(T).
 //
+// If source is provided then the region's (possibly compressed) data has
+// already been read into memory there, and is read from there instead of from
+// the file.
+//
+// If an arena is provided the buffer is allocated from it, unless it is full.
+//
 template<typename T>
-MemoryRegion<T> MarcFile::EnqueueReadMemoryRegion(marc::Region<T> const& region)
+MemoryRegion<T> MarcFile::EnqueueReadMemoryRegion(
+    marc::Region<T> const& region,
+    RegionClass regionClass,
+    char const* source,
+    MemoryArena* arena)
 {
-    MemoryRegion<T> dest(std::make_unique<char[]>(region.UncompressedSize));
+    if (!source && m_usePrefetch)
+        source = FindPrefetched(region.Data.Offset, region.CompressedSize);
+
+    char* arenaBuffer = arena ? arena->Allocate(region.UncompressedSize) : nullptr;
+    MemoryRegion<T> dest = arenaBuffer ? MemoryRegion<T>(arenaBuffer)
+                                       : MemoryRegion<T>(std::make_unique<char[]>(region.UncompressedSize));
 
     DSTORAGE_REQUEST r{};
-    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
     r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
     r.Options.CompressionFormat = ToCompressionFormat(region.Compression);
-    r.Source.File.Source = m_file.Get();
-    r.Source.File.Offset = region.Data.Offset;
-    r.Source.File.Size = region.CompressedSize;
+    if (source)
+    {
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+        r.Source.Memory.Source = source;
+        r.Source.Memory.Size = region.CompressedSize;
+    }
+    else
+    {
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        r.Source.File.Source = m_file.Get();
+        r.Source.File.Offset = m_fileOffset + region.Data.Offset;
+        r.Source.File.Size = region.CompressedSize;
+    }
     r.Destination.Memory.Buffer = dest.Data();
     r.Destination.Memory.Size = region.UncompressedSize;
     r.UncompressedSize = r.Destination.Memory.Size;
     r.CancellationTag = reinterpret_cast<uint64_t>(this);
 
-    g_dsSystemMemoryQueue->EnqueueRequest(&r);
+    EnqueueRequest(regionClass, r);
 
     return dest;
 }
 
 //
-// Reads a given region into a D3D12 Buffer.  This buffer is placed at the
-// specified heap+offest.
+// Reads a given region into a D3D12 Buffer.  This is either the shared buffer
+// or a buffer placed at the allocation's heap+offset.
 //
 ComPtr<ID3D12Resource> MarcFile::EnqueueReadBufferRegion(
-    ID3D12Heap* heap,
-    uint64_t offset,
+    BufferDestination const& buffers,
     marc::GpuRegion const& region)
 {
-    ComPtr<ID3D12Resource> resource;
+    ComPtr<ID3D12Resource> resource = buffers.SharedBuffer;
+    uint64_t bufferOffset = buffers.SharedBufferOffset;
 
-    D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(m_header.UnstructuredGpuData.UncompressedSize);
-    CheckHR(g_Device->CreatePlacedResource(heap, offset, &bufferDesc, 
-        D3D12_RESOURCE_STATE_COMMON,
-        nullptr,
-        IID_PPV_ARGS(&resource)));
-    if (!IsOk())
-        std::abort();
+    if (!resource)
+    {
+        D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(m_header.UnstructuredGpuData.UncompressedSize);
+        CheckHR(g_Device->CreatePlacedResource(
+            buffers.Allocation.Heap.Get(),
+            buffers.Allocation.Offset,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(&resource)));
+        if (!IsOk())
+            std::abort();
 
-    DSTORAGE_REQUEST r{};
-    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-    r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
-    r.Options.CompressionFormat = ToCompressionFormat(region.Compression);
-    r.Source.File.Source = m_file.Get();
-    r.Source.File.Offset = region.Data.Offset;
-    r.Source.File.Size = region.CompressedSize;
-    r.Destination.Buffer.Offset = 0;
+        bufferOffset = 0;
+    }
+
+    DSTORAGE_REQUEST& r = AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_BUFFER>(region);
+    r.Destination.Buffer.Offset = bufferOffset;
     r.Destination.Buffer.Resource = resource.Get();
     r.Destination.Buffer.Size = region.UncompressedSize;
-    r.UncompressedSize = r.Destination.Buffer.Size;
-    r.CancellationTag = reinterpret_cast<uint64_t>(this);
-
-    g_dsGpuQueue->EnqueueRequest(&r);
+    EnqueueRegionRequests(RegionClass::Buffers);
 
     return resource;
 }
 
 //
-// Reads a texture, as described by the desc and textureMetadata.  The texture
-// is placed at the giveen heap+offset.
+// Creates a resource at the given heap+offset.  Tiled textures are created as
+// reserved resources, with all of their tiles mapped contiguously from the
+// offset.  The mappings are updated on the graphics queue, so anything else
+// that writes to the resource must be ordered after that.
 //
-ComPtr<ID3D12Resource> MarcFile::EnqueueReadTexture(
-    ID3D12Heap* heap,
-    uint64_t offset,
-    D3D12_RESOURCE_DESC const& desc,
-    marc::TextureMetadata const& textureMetadata)
+ComPtr<ID3D12Resource> MarcFile::CreateResourceAt(ID3D12Heap* heap, uint64_t offset, D3D12_RESOURCE_DESC const& desc)
 {
     ComPtr<ID3D12Resource> resource;
 
-    CheckHR(g_Device->CreatePlacedResource(
-        heap, 
-        offset,
-        &desc,
-        D3D12_RESOURCE_STATE_COMMON, nullptr, IID_PPV_ARGS(&resource)));
+    if (!IsTiled(desc))
+    {
+        CheckHR(g_Device->CreatePlacedResource(
+            heap,
+            offset,
+            &desc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(&resource)));
+        if (!IsOk())
+            std::abort();
+
+        return resource;
+    }
+
+    CheckHR(g_Device->CreateReservedResource(&desc, D3D12_RESOURCE_STATE_COMMON, nullptr, IID_PPV_ARGS(&resource)));
     if (!IsOk())
         std::abort();
 
+    UINT numTiles = 0;
+    g_Device->GetResourceTiling(resource.Get(), &numTiles, nullptr, nullptr, nullptr, 0, nullptr);
+
+    D3D12_TILED_RESOURCE_COORDINATE startCoordinate{};
+    D3D12_TILE_REGION_SIZE regionSize{};
+    regionSize.NumTiles = numTiles;
+
+    D3D12_TILE_RANGE_FLAGS rangeFlags = D3D12_TILE_RANGE_FLAG_NONE;
+    UINT heapRangeStartOffset = static_cast<UINT>(offset / D3D12_TILED_RESOURCE_TILE_SIZE_IN_BYTES);
+
+    Graphics::g_CommandManager.GetCommandQueue()->UpdateTileMappings(
+        resource.Get(),
+        1,
+        &startCoordinate,
+        &regionSize,
+        heap,
+        1,
+        &rangeFlags,
+        &heapRangeStartOffset,
+        &numTiles,
+        D3D12_TILE_MAPPING_FLAG_NONE);
+
+    return resource;
+}
+
+//
+// Reads a texture, as described by the desc and textureMetadata, into the
+// resource.  The detailed mips from mostDetailedVisibleMip on are the ones the
+// model needs at its expected size on screen, so they are read as VisibleMips
+// and only the finer ones at the priority of the high resolution mips.
+//
+void MarcFile::EnqueueReadTexture(
+    ID3D12Resource* resource,
+    D3D12_RESOURCE_DESC const& desc,
+    marc::TextureMetadata const& textureMetadata,
+    uint32_t mostDetailedMip,
+    uint32_t mostDetailedVisibleMip)
+{
 #ifdef DEBUG
-    std::string nname = textureMetadata.Name.Ptr;
+    std::string nname = textureMetadata.Name.Get();
     std::wstring name(nname.begin(), nname.end());
     resource->SetName(name.c_str());
 #endif
@@ -553,13 +1978,118 @@ ComPtr<ID3D12Resource> MarcFile::EnqueueReadTexture(
     // See comment around TextureMetadata in MarcFileFormat.h for more
     // information on this structure.
 
-    for (uint32_t i = 0; i < textureMetadata.NumSingleMips; ++i)
+    uint32_t const numDetailedMips = GetNumDetailedMips(textureMetadata);
+    uint32_t const visibleMip = std::clamp(mostDetailedVisibleMip, mostDetailedMip, numDetailedMips);
+
+    EnqueueReadDetailedMips(
+        resource,
+        desc,
+        textureMetadata,
+        mostDetailedMip,
+        visibleMip,
+        RegionClass::HighResolutionMips);
+    EnqueueReadDetailedMips(resource, desc, textureMetadata, visibleMip, numDetailedMips, RegionClass::VisibleMips);
+
+    if (textureMetadata.RemainingMips.UncompressedSize != 0)
+    {
+        DSTORAGE_REQUEST& r =
+            AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES>(textureMetadata.RemainingMips);
+        r.Destination.MultipleSubresources.Resource = resource;
+        r.Destination.MultipleSubresources.FirstSubresource = numDetailedMips;
+        EnqueueRegionRequests(RegionClass::LowResolutionMips);
+    }
+}
+
+//
+// Reads a swizzled texture's parts into a buffer placed at the same heap+offset
+// as the texture, so that they land in the texture's memory as they
+// are.  OnAllDataLoaded hands the memory over to the texture.
+//
+void MarcFile::EnqueueReadSwizzledTexture(MultiHeapAllocation const& allocation, marc::SwizzledTexture const& swizzled)
+{
+    ComPtr<ID3D12Resource> buffer;
+    D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(swizzled.SizeInBytes);
+    CheckHR(g_Device->CreatePlacedResource(
+        allocation.Heap.Get(),
+        allocation.Offset,
+        &bufferDesc,
+        D3D12_RESOURCE_STATE_COMMON,
+        nullptr,
+        IID_PPV_ARGS(&buffer)));
+    if (!IsOk())
+        std::abort();
+
+    uint64_t bufferOffset = 0;
+    for (uint32_t i = 0; i < swizzled.NumParts; ++i)
+    {
+        marc::GpuRegion const& part = swizzled.Parts[i];
+
+        DSTORAGE_REQUEST& r = AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_BUFFER>(part);
+        r.Destination.Buffer.Resource = buffer.Get();
+        r.Destination.Buffer.Offset = bufferOffset;
+        r.Destination.Buffer.Size = part.UncompressedSize;
+
+        bufferOffset += part.UncompressedSize;
+    }
+    EnqueueRegionRequests(RegionClass::VisibleMips);
+
+    m_swizzledBuffers.push_back(std::move(buffer));
+}
+
+//
+// The detailed mips are the ones stored before RemainingMips; either as
+// single mips, or, for tiled textures, as tiles.
+//
+uint32_t MarcFile::GetNumDetailedMips(marc::TextureMetadata const& textureMetadata)
+{
+    return textureMetadata.NumSingleMips + textureMetadata.NumTiledMips;
+}
+
+//
+// A texture that covers the model needs about as many texels across as the
+// model has pixels on screen, so this picks the smallest mip that is at least
+// that wide.
+//
+uint32_t MarcFile::GetNeededMip(D3D12_RESOURCE_DESC const& desc, float pixelsAcross)
+{
+    float texelsPerPixel = static_cast<float>(desc.Width) / std::max(pixelsAcross, 1.0f);
+    return texelsPerPixel > 1.0f ? static_cast<uint32_t>(std::floor(std::log2(texelsPerPixel))) : 0;
+}
+
+//
+// Reads the detailed mips in the range [firstMip, endMip), as regions of the
+// given class.
+//
+void MarcFile::EnqueueReadDetailedMips(
+    ID3D12Resource* resource,
+    D3D12_RESOURCE_DESC const& desc,
+    marc::TextureMetadata const& textureMetadata,
+    uint32_t firstMip,
+    uint32_t endMip,
+    RegionClass regionClass)
+{
+    if (firstMip >= endMip)
+        return;
+
+    if (textureMetadata.NumTiledMips > 0)
+    {
+        EnqueueReadTiles(resource, desc, textureMetadata, firstMip, endMip, regionClass);
+        return;
+    }
+
+    for (uint32_t i = firstMip; i < endMip; ++i)
     {
         marc::GpuRegion const& region = textureMetadata.SingleMips[i];
 
-        DSTORAGE_REQUEST r = BuildRequestForRegion(region);
-        r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION;
-        r.Destination.Texture.Resource = resource.Get();
+        // Mips too large for one request are read in bands
+        if (region.UncompressedSize == 0)
+        {
+            EnqueueReadMipBands(resource, desc, textureMetadata, i, regionClass);
+            continue;
+        }
+
+        DSTORAGE_REQUEST& r = AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION>(region);
+        r.Destination.Texture.Resource = resource;
         r.Destination.Texture.SubresourceIndex = i;
 
         D3D12_BOX destBox{};
@@ -568,71 +2098,251 @@ ComPtr<ID3D12Resource> MarcFile::EnqueueReadTexture(
         destBox.back = 1;
 
         r.Destination.Texture.Region = destBox;
-
-        g_dsGpuQueue->EnqueueRequest(&r);
     }
+    EnqueueRegionRequests(regionClass);
+}
 
-    if (textureMetadata.RemainingMips.UncompressedSize != 0)
+//
+// Reads each band of rows of a mip that was split, into its own box of the
+// mip.
+//
+void MarcFile::EnqueueReadMipBands(
+    ID3D12Resource* resource,
+    D3D12_RESOURCE_DESC const& desc,
+    marc::TextureMetadata const& textureMetadata,
+    uint32_t mip,
+    RegionClass regionClass)
+{
+    uint32_t mipWidth = std::max(1u, static_cast<uint32_t>(desc.Width >> mip));
+
+    for (uint32_t i = 0; i < textureMetadata.NumMipBands; ++i)
     {
-        DSTORAGE_REQUEST r = BuildRequestForRegion(textureMetadata.RemainingMips);
-        r.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES;
-        r.Destination.MultipleSubresources.Resource = resource.Get();
-        r.Destination.MultipleSubresources.FirstSubresource = textureMetadata.NumSingleMips;
-        g_dsGpuQueue->EnqueueRequest(&r);
+        marc::TextureMipBand const& band = textureMetadata.MipBands[i];
+        if (band.Mip != mip)
+            continue;
+
+        DSTORAGE_REQUEST& r = AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION>(band.Data);
+        r.Destination.Texture.Resource = resource;
+        r.Destination.Texture.SubresourceIndex = mip;
+
+        D3D12_BOX destBox{};
+        destBox.top = band.Top;
+        destBox.right = mipWidth;
+        destBox.bottom = band.Bottom;
+        destBox.back = 1;
+
+        r.Destination.Texture.Region = destBox;
     }
+    EnqueueRegionRequests(regionClass);
+}
 
-    return resource;
+//
+// Reads the tiles of the mips in the range [firstMip, endMip).  Each tile is
+// read into its own box of the mip.
+//
+void MarcFile::EnqueueReadTiles(
+    ID3D12Resource* resource,
+    D3D12_RESOURCE_DESC const& desc,
+    marc::TextureMetadata const& textureMetadata,
+    uint32_t firstMip,
+    uint32_t endMip,
+    RegionClass regionClass)
+{
+    D3D12_TILE_SHAPE tileShape{};
+    g_Device->GetResourceTiling(resource, nullptr, nullptr, &tileShape, nullptr, 0, nullptr);
+
+    for (uint32_t i = 0; i < textureMetadata.NumTiles; ++i)
+    {
+        marc::TextureTile const& tile = textureMetadata.Tiles[i];
+        if (tile.Mip < firstMip || tile.Mip >= endMip)
+            continue;
+
+        DSTORAGE_REQUEST& r = AddRegionRequest<DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION>(tile.Data);
+        r.Destination.Texture.Resource = resource;
+        r.Destination.Texture.SubresourceIndex = tile.Mip;
+
+        uint32_t mipWidth = std::max(1u, static_cast<uint32_t>(desc.Width >> tile.Mip));
+        uint32_t mipHeight = std::max(1u, desc.Height >> tile.Mip);
+
+        D3D12_BOX destBox{};
+        destBox.left = tile.X * tileShape.WidthInTexels;
+        destBox.top = tile.Y * tileShape.HeightInTexels;
+        destBox.right = std::min(destBox.left + tileShape.WidthInTexels, mipWidth);
+        destBox.bottom = std::min(destBox.top + tileShape.HeightInTexels, mipHeight);
+        destBox.back = 1;
+
+        r.Destination.Texture.Region = destBox;
+    }
+    EnqueueRegionRequests(regionClass);
 }
 
 //
-// This constructs a DSTORAGE_REQUEST that will read all the data from the
-// region, ready for the destination fields to be filled in.
+// Adds a request that will read all the data from the region to
+// m_regionRequests, ready for the destination fields to be filled in, and
+// returns it.  If the region has been prefetched it's read from memory.
 //
-template<typename T>
-DSTORAGE_REQUEST MarcFile::BuildRequestForRegion(marc::Region<T> const& region)
+// The destination type is a template parameter so that each loop over a
+// texture's regions sets it as a constant.  The requests are built in place,
+// in an array that keeps its capacity from one texture to the next, and stay
+// there until EnqueueRegionRequests enqueues them together.
+//
+template<DSTORAGE_REQUEST_DESTINATION_TYPE DestinationType, typename T>
+DSTORAGE_REQUEST& MarcFile::AddRegionRequest(marc::Region<T> const& region)
 {
-    DSTORAGE_REQUEST r{};
-    r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    static_assert(
+        DestinationType == DSTORAGE_REQUEST_DESTINATION_BUFFER ||
+            DestinationType == DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION ||
+            DestinationType == DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES,
+        "Regions are only read into GPU resources this way");
+
+    char const* prefetched = m_usePrefetch ? FindPrefetched(region.Data.Offset, region.CompressedSize) : nullptr;
+
+    DSTORAGE_REQUEST& r = m_regionRequests.emplace_back();
+    r.Options.DestinationType = DestinationType;
     r.Options.CompressionFormat = ToCompressionFormat(region.Compression);
-    r.Source.File.Source = m_file.Get();
-    r.Source.File.Offset = region.Data.Offset;
-    r.Source.File.Size = region.CompressedSize;
+    if (prefetched)
+    {
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+        r.Source.Memory.Source = prefetched;
+        r.Source.Memory.Size = region.CompressedSize;
+    }
+    else
+    {
+        r.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        r.Source.File.Source = m_file.Get();
+        r.Source.File.Offset = m_fileOffset + region.Data.Offset;
+        r.Source.File.Size = region.CompressedSize;
+    }
     r.UncompressedSize = region.UncompressedSize;
     r.CancellationTag = reinterpret_cast<uint64_t>(this);
 
     return r;
 }
 
+void MarcFile::EnqueueRegionRequests(RegionClass regionClass)
+{
+    // assumes mutex is locked
+
+    for (DSTORAGE_REQUEST const& request : m_regionRequests)
+        EnqueueRequest(regionClass, request);
+    m_regionRequests.clear();
+}
+
 //
-// Releases all memory/resources used by the content of this MarcFile.  It is
-// the caller's responsability to ensure that none of these resources are
-// currently in use by the GPU.
+// Releases all memory/resources used by the content of this MarcFile.  The CPU
+// data is freed straight away, but the textures and buffer are returned to the
+// caller, which must keep them until the GPU is no longer using them.
 //
-void MarcFile::UnloadContent()
+std::vector<ComPtr<ID3D12Resource>> MarcFile::UnloadContent()
 {
+    WaitForStreamedMips();
+
+    std::vector<ComPtr<ID3D12Resource>> resources;
+
     std::unique_lock lock(m_mutex);
     if (!IsOk())
-        return;
+        return resources;
 
     ValidateState(InternalState::MetadataReady, InternalState::ContentLoaded);
 
     if (m_state == InternalState::ContentLoaded)
     {
         m_cpuData = {};
+        resources = std::move(m_textures);
         m_textures.clear();
-        m_gpuBuffer.Reset();
+        if (m_gpuBuffer)
+            resources.push_back(std::move(m_gpuBuffer));
+        for (ComPtr<ID3D12Resource>& buffer : m_swizzledBuffers)
+            resources.push_back(std::move(buffer));
+        m_swizzledBuffers.clear();
+    }
+    SetState(InternalState::MetadataReady);
+
+    return resources;
+}
+
+ComPtr<ID3D12Resource> MarcFile::RelocateTexture(
+    uint32_t index,
+    MultiHeapAllocation const& allocation,
+    CommandContext& context)
+{
+    std::unique_lock lock(m_mutex);
+    ValidateState(InternalState::ContentLoaded);
+
+    ComPtr<ID3D12Resource> oldTexture = std::move(m_textures[index]);
+    m_textures[index] = CopyToPlacedResource(oldTexture.Get(), allocation, context);
+    return oldTexture;
+}
+
+ComPtr<ID3D12Resource> MarcFile::RelocateBuffer(MultiHeapAllocation const& allocation, CommandContext& context)
+{
+    std::unique_lock lock(m_mutex);
+    ValidateState(InternalState::ContentLoaded);
+
+    ComPtr<ID3D12Resource> oldBuffer = std::move(m_gpuBuffer);
+    m_gpuBuffer = CopyToPlacedResource(oldBuffer.Get(), allocation, context);
+    return oldBuffer;
+}
+
+void MarcFile::CompleteRelocation()
+{
+    std::unique_lock lock(m_mutex);
+    ValidateState(InternalState::ContentLoaded);
+
+    // FixupMaterials recreates the texture descriptors and copies them into
+    // each material's table; everything else it sets is unchanged.
+    FixupMaterials();
+
+    m_model->m_MaterialConstants =
+        m_gpuBuffer->GetGPUVirtualAddress() + m_gpuBufferOffset + m_cpuData->MaterialConstantsGpuOffset;
+    m_model->m_DataBuffer = m_gpuBuffer->GetGPUVirtualAddress() + m_gpuBufferOffset;
+}
+
+//
+// Creates a resource like the source at the given heap+offset, and records a
+// copy of the source into it.
+//
+ComPtr<ID3D12Resource> MarcFile::CopyToPlacedResource(
+    ID3D12Resource* source,
+    MultiHeapAllocation const& allocation,
+    CommandContext& context)
+{
+    D3D12_RESOURCE_DESC desc = source->GetDesc();
+
+    // The context is executed on the graphics queue, after any tile mappings
+    // CreateResourceAt makes.
+    ComPtr<ID3D12Resource> resource = CreateResourceAt(allocation.Heap.Get(), allocation.Offset, desc);
+
+    // Both resources are implicitly promoted from the COMMON state for the
+    // copy.  The source decays back to COMMON afterwards, as does the
+    // destination if it's a buffer, but a texture has to be returned to COMMON
+    // explicitly.
+    ID3D12GraphicsCommandList* commandList = context.GetCommandList();
+    commandList->CopyResource(resource.Get(), source);
+
+    if (desc.Dimension != D3D12_RESOURCE_DIMENSION_BUFFER)
+    {
+        auto barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+            resource.Get(),
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            D3D12_RESOURCE_STATE_COMMON);
+        commandList->ResourceBarrier(1, &barrier);
     }
-    m_state = InternalState::MetadataReady;
+
+    return resource;
 }
 
 //
 // MarcFile exposes a more limited set of states through its public interface.
 // This function converts between the internal and external states.
 //
+// This doesn't take the mutex, since it's called for every file each frame.
+// The acquire pairs with the release in SetState, so everything written before
+// a transition is visible to a caller that sees the new state.
+//
 MarcFile::State MarcFile::GetState() const
 {
-    std::unique_lock lock(m_mutex);
-    switch (m_state)
+    switch (m_state.load(std::memory_order_acquire))
     {
     case InternalState::FileOpen:
     case InternalState::LoadingHeader:
@@ -656,6 +2366,12 @@ MarcFile::State MarcFile::GetState() const
     }
 }
 
+HRESULT MarcFile::GetErrorStatus() const
+{
+    std::unique_lock lock{m_mutex};
+    return m_status;
+}
+
 bool MarcFile::IsMetadataReady() const
 {
     // assumes mutex is locked
@@ -696,6 +2412,7 @@ MarcFile::DataSize MarcFile::GetRequiredDataSize() const
             break;
 
         case marc::Compression::Zlib:
+        case marc::Compression::ZlibBcSplit:
             size.ZLibByteCount += region.UncompressedSize;
             break;
 
@@ -719,6 +2436,18 @@ MarcFile::DataSize MarcFile::GetRequiredDataSize() const
             size.TexturesByteCount += texture.SingleMips[singleMipIndex].UncompressedSize;
         }
 
+        for (uint32_t tileIndex = 0; tileIndex < texture.NumTiles; ++tileIndex)
+        {
+            accumulateSize(texture.Tiles[tileIndex].Data);
+            size.TexturesByteCount += texture.Tiles[tileIndex].Data.UncompressedSize;
+        }
+
+        for (uint32_t bandIndex = 0; bandIndex < texture.NumMipBands; ++bandIndex)
+        {
+            accumulateSize(texture.MipBands[bandIndex].Data);
+            size.TexturesByteCount += texture.MipBands[bandIndex].Data.UncompressedSize;
+        }
+
         accumulateSize(texture.RemainingMips);
         size.TexturesByteCount += texture.RemainingMips.UncompressedSize;
     }
@@ -743,7 +2472,7 @@ void MarcFile::CheckHR(HRESULT hr)
 {
     if (FAILED(hr))
     {
-        m_state = InternalState::Error;
+        SetState(InternalState::Error);
         m_status = hr;
     }
 }
@@ -767,6 +2496,18 @@ bool MarcFile::StateIsOneOf(States... states) const
     return false;
 }
 
+void MarcFile::SetState(InternalState state)
+{
+    // assumes mutex is locked; transitions are still serialized by it
+    m_state.store(state, std::memory_order_release);
+
+    // These are the states that callbacks move files into
+    bool const completed = state == InternalState::MetadataReady || state == InternalState::ContentLoaded ||
+                           state == InternalState::Error;
+    if (completed && m_completionQueue)
+        m_completionQueue->Push(m_completionId);
+}
+
 bool MarcFile::IsOk() const
 {
     return m_state != InternalState::Error;
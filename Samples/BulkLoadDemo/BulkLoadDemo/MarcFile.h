@@ -9,47 +9,138 @@
 
 #pragma once
 
-#include "EventWait.h"
+#include "CompletionFences.h"
+#include "CompletionQueue.h"
+#include "EventWaitPool.h"
+#include "LoadTelemetry.h"
 #include "MultiHeap.h"
 #include "MarcFileFormat.h"
+#include "MemoryArena.h"
 #include "MemoryRegion.h"
+#include "MetadataCache.h"
+#include "RequestScheduler.h"
+#include "StatusArrayPool.h"
+#include "SubmitBatcher.h"
 
 #include <dstorage.h>
 #include <wrl/client.h>
 
+#include <atomic>
 #include <filesystem>
 #include <memory>
+#include <optional>
 
 using Microsoft::WRL::ComPtr;
 
+class CommandContext;
+
 class MarcFile
 {
     mutable std::mutex m_mutex;
 
+    std::filesystem::path m_path;
     ComPtr<IDStorageFile> m_file;
+
+    // Where the marc file is in m_file, which is a bundle of files if the
+    // offset isn't 0 (see marc::BundleHeader).  Offsets in the marc file are
+    // relative to m_fileOffset.
+    uint64_t m_fileOffset = 0;
+    uint64_t m_fileSize = 0;
+    // The file's entries in the status array start at m_firstStatusEntry
     ComPtr<IDStorageStatusArray> m_statusArray;
+    uint32_t m_firstStatusEntry = 0;
+
+    // Told when the metadata or content finish loading (or fail), and when
+    // streamed mips have loaded.
+    CompletionQueue* m_completionQueue = nullptr;
+    size_t m_completionId = 0;
+
+    // If set, the metadata, CPU data and GPU data callbacks are called by
+    // signals on these fences rather than by events from the pool.
+    CompletionFences* m_completionFences = nullptr;
+
+    // Hands out the events that the callbacks are signaled with, see
+    // GetEventWaitPool
+    EventWaitPool* m_eventWaitPool = nullptr;
+
+    // If set, queues are submitted through this, so that the submits of many
+    // files can be batched.
+    SubmitBatcher* m_submitBatcher = nullptr;
 
     // Metadata
     marc::Header m_header{};
+
+    // Masks the offsets read from the file; see marc::GetOffsetMask.
+    uint64_t m_offsetMask = ~0ull;
     MemoryRegion<marc::CpuMetadataHeader> m_cpuMetadata;
+
+    // If non-zero, StartMetadataLoad reads the header and a CPU metadata
+    // region of up to this many compressed bytes through a mapping of the
+    // file, rather than through DirectStorage.
+    uint32_t m_mappedMetadataLimit = 0;
+
+    // A copy of the CPU metadata from before it was fixed up, kept until it is
+    // taken by TakeMetadataForCache.
+    std::vector<char> m_cpuMetadataImage;
+
+    // The end of the file, read along with the header.  If the CPU metadata is
+    // inside this, it's decompressed from here rather than read from the file.
+    std::unique_ptr<char[]> m_fileTail;
+    uint64_t m_fileTailOffset = 0;
+    uint64_t m_fileTailSize = 0;
     std::vector<D3D12_RESOURCE_ALLOCATION_INFO1> m_textureAllocationInfos;
     D3D12_RESOURCE_ALLOCATION_INFO m_overallTextureAllocationInfo;
     ComPtr<ID3D12DescriptorHeap> m_descriptorHeap;
 
+    // The store that the shared textures are taken from
+    MarcFile* m_textureStore = nullptr;
+
     // Content
     MemoryRegion<marc::CpuDataHeader> m_cpuData;
     std::vector<ComPtr<ID3D12Resource>> m_textures;
     ComPtr<ID3D12Resource> m_gpuBuffer;
+
+    // A buffer placed over each swizzled texture, that its parts are read
+    // into.  They're kept as long as the textures, since the aliasing barriers
+    // that hand the memory over to the textures refer to them.
+    std::vector<ComPtr<ID3D12Resource>> m_swizzledBuffers;
+
+    // The requests built by AddRegionRequest that have yet to be enqueued
+    std::vector<DSTORAGE_REQUEST> m_regionRequests;
+    uint64_t m_gpuBufferOffset = 0;
     DescriptorHandle m_textureHandles;
 
+    // Mip streaming.  For each texture, the most detailed mip that has been
+    // loaded, that is being loaded, and that the descriptors allow to be
+    // sampled.  The descriptor tables are double buffered: new descriptors are
+    // written to the spare tables, which are then swapped in, and the tables
+    // swapped out may only be rewritten once m_spareTablesFence completes.
+    bool m_streamMips = false;
+    DescriptorHandle m_spareTextureHandles;
+    uint64_t m_spareTablesFence = 0;
+    std::vector<uint32_t> m_loadedMips;
+    std::vector<uint32_t> m_requestedMips;
+    std::vector<uint32_t> m_visibleMips;
+    bool m_mipsLoading = false;
+
     // Model
     std::shared_ptr<Model> m_model;
 
+    // GPU data may be read from the file or, once prefetched, from memory, on
+    // the GPU queues of several priorities.  Each of these queues has an
+    // index: the priority's index, plus DSTORAGE_PRIORITY_COUNT for the queues
+    // that read from memory.
+    static constexpr uint32_t NumGpuQueues = DSTORAGE_PRIORITY_COUNT * 2;
+
+    // GPU data may be split over several GPU queues, so it has an entry for
+    // each.
     enum class StatusArrayEntry : uint32_t
     {
         Metadata,
         CpuData,
+        Prefetch,
         GpuData,
+        Mips = GpuData + NumGpuQueues,
         NumEntries
     };
 
@@ -65,28 +156,234 @@ class MarcFile
         ContentLoaded,
         Error
     };
-    InternalState m_state = InternalState::FileOpen;
+    std::atomic<InternalState> m_state = InternalState::FileOpen;
 
     HRESULT m_status = S_OK;
 
-    EventWait m_headerLoaded;
-    EventWait m_cpuMetadataLoaded;
-    EventWait m_cpuDataLoaded;
-    EventWait m_gpuDataLoaded;
+    // Bit N is set if GPU data was enqueued on the GPU queue with index N
+    uint32_t m_gpuQueuesUsed = 0;
+    uint32_t m_numPendingGpuQueues = 0;
+
+    // The queue the CPU data was enqueued on, which depends on whether it is
+    // read from the file or from the prefetched data
+    IDStorageQueue1* m_cpuDataQueue = nullptr;
+
+    // The content requests are kept until the load completes, so that the
+    // requests of a queue that reports a failure can be retried, once.
+    std::vector<DSTORAGE_REQUEST> m_cpuDataRequests;
+    std::vector<DSTORAGE_REQUEST> m_gpuDataRequests[NumGpuQueues];
+    bool m_cpuDataRetried = false;
+    uint32_t m_gpuQueuesRetried = 0;
+
+    // Set by CancelContentLoad until the CPU and GPU data of the cancelled
+    // load have both completed
+    bool m_contentCancelled = false;
+
+    // Set while content requests are being enqueued
+    RequestScheduler* m_scheduler = nullptr;
+
+    // Prefetching.  The compressed bytes of the CPU data and of each texture's
+    // RemainingMips are read into m_prefetchBuffer ahead of a content load,
+    // which then reads these regions from memory rather than from the file.
+    // The buffer is kept until the requests reading from it have completed.
+    enum class PrefetchState
+    {
+        None,
+        Loading,
+        Ready
+    };
+    PrefetchState m_prefetchState = PrefetchState::None;
+    bool m_prefetchDiscarded = false;
+    bool m_usePrefetch = false;
+
+    struct PrefetchedRange
+    {
+        uint64_t FileOffset;
+        uint32_t Size;
+        char const* Data;
+    };
+    std::unique_ptr<char[]> m_prefetchBuffer;
+    size_t m_prefetchSize = 0;
+    std::vector<PrefetchedRange> m_prefetchedRanges; // sorted by FileOffset
+
+    LoadTelemetryBatch m_metadataBatch{TelemetryQueue::SystemMemory};
+    LoadTelemetryBatch m_cpuDataBatch{TelemetryQueue::SystemMemory};
+    LoadTelemetryBatch m_gpuDataBatch{TelemetryQueue::Gpu};
+    LoadTelemetryBatch m_mipsBatch{TelemetryQueue::Gpu};
 
 public:
     explicit MarcFile(std::filesystem::path const& path);
+
+    // A marc file packed into a bundle, of size bytes at offset.  The bundle
+    // is at bundlePath, and has already been opened as bundle.
+    MarcFile(ComPtr<IDStorageFile> bundle, std::filesystem::path const& bundlePath, uint64_t offset, uint64_t size);
     ~MarcFile();
 
+    // True if the device can create 64KB_STANDARD_SWIZZLE textures and place
+    // buffers over them in the textures heap, which loading a swizzled texture
+    // (see marc::SwizzledTexture) needs.  The textures heap must then allow
+    // buffers.
+    static bool CanLoadSwizzledTextures();
+
+    // The id is pushed to the queue whenever the file's state may have changed
+    // in a callback.  Must be called before StartMetadataLoad.
+    void SetCompletionQueue(CompletionQueue* queue, size_t id);
+
+    // Has the loading callbacks called from the fences' waiter thread instead
+    // of from threadpool waits.  Must be called before StartMetadataLoad.
+    void SetCompletionFences(CompletionFences* fences);
+
+    // Takes the events that signal the callbacks from the pool, which must
+    // outlive the file.  Must be called before StartMetadataLoad.
+    void SetEventWaitPool(EventWaitPool* pool);
+
+    // Has the queues the file enqueues to directly submitted by the batcher.
+    // Must be called before StartMetadataLoad.
+    void SetSubmitBatcher(SubmitBatcher* batcher);
+
+    // Takes the file's status array entries from the pool, instead of the
+    // file creating a status array of its own.  Must be called before
+    // StartMetadataLoad.
+    void SetStatusArrayPool(StatusArrayPool& pool);
+
+    // Has StartMetadataLoad read the metadata synchronously, from a mapping of
+    // the file, if the CPU metadata region is no bigger than limit bytes.
+    // Must be called before StartMetadataLoad.
+    void SetMappedMetadataReads(uint32_t limit);
+
     void StartMetadataLoad();
+
+    // Instead of StartMetadataLoad, this takes the metadata from a previous
+    // run.  The file moves straight to ReadyToLoadContent.
+    void LoadCachedMetadata(CachedMetadata const& metadata);
+
+    // Once the metadata has been loaded from the file, this returns what the
+    // MetadataCache needs to skip loading it next time.  Only returns it once.
+    std::optional<CachedMetadata> TakeMetadataForCache();
+
+    // Where the unstructured GPU data is loaded: either a buffer of its own,
+    // placed at the allocation, or a range of a buffer shared with other
+    // files.
+    struct BufferDestination
+    {
+        MultiHeapAllocation Allocation;
+        ComPtr<ID3D12Resource> SharedBuffer;
+        uint64_t SharedBufferOffset = 0;
+    };
+
+    // The content requests are added to the scheduler, which the caller
+    // flushes once it has started every file it wants to load.  If an arena is
+    // given the CPU data is loaded into it, and it must not be reset until the
+    // content has been unloaded.
     void StartContentLoad(
         std::vector<MultiHeapAllocation> const& texturesAllocations,
         DescriptorHandle textureHandles,
-        MultiHeapAllocation buffersAllocation);
+        BufferDestination const& buffers,
+        RequestScheduler& scheduler,
+        MemoryArena* cpuDataArena = nullptr);
+
+    // Releases all data loaded.  The GPU resources are handed back rather than
+    // destroyed, since frames already submitted may still be using them; the
+    // caller keeps them alive until the GPU has finished with them.
+    std::vector<ComPtr<ID3D12Resource>> UnloadContent();
+
+    // Reads the compressed CPU data and low resolution mips into system memory,
+    // so that a content load started later doesn't have to wait for them to be
+    // read from the file.  Only the file's own buffer is allocated: nothing is
+    // taken from the heaps.  Returns the number of bytes being prefetched, or 0
+    // if the file isn't in ReadyToLoadContent or is already prefetched.
+    size_t StartPrefetch();
+
+    // Releases the prefetched data of a file that no longer needs it.  Does
+    // nothing if a content load is reading from it; it's released once the load
+    // has completed.
+    void DiscardPrefetch();
+
+    // The size of the prefetched data, while it is held
+    size_t GetPrefetchSize() const;
+
+    // Cancels the requests of a content load that is in progress.  Requests
+    // that DirectStorage has already started still complete, so the memory
+    // being loaded into mustn't be reused until the file is back in
+    // ReadyToLoadContent; its id is pushed to the completion queue then.
+    // Returns false if there was no content load to cancel.
+    bool CancelContentLoad();
+
+    // Used when defragmenting the heaps.  These record a copy of a texture, or
+    // the buffer, to a new placed resource on the context and return the old
+    // resource, which must be kept alive until the copy has completed.
+    // RelocateBuffer is only used for a buffer of the file's own.
+    // CompleteRelocation must then be called, once the GPU has finished with
+    // the old resources, to point the descriptors and model at the new ones.
+    ComPtr<ID3D12Resource> RelocateTexture(
+        uint32_t index,
+        MultiHeapAllocation const& allocation,
+        CommandContext& context);
+    ComPtr<ID3D12Resource> RelocateBuffer(MultiHeapAllocation const& allocation, CommandContext& context);
+    void CompleteRelocation();
+
+    // The classes of region in a file.  The requests for each class are
+    // enqueued on the queue of its priority.  By default the metadata and the
+    // low resolution mips, which are small and needed first, are high
+    // priority, and the high resolution mips are low priority.  When the size
+    // the model will be on screen is known, the high resolution mips that it
+    // needs at that size are VisibleMips, which are normal priority, and only
+    // the ones finer than that are left at low priority.
+    enum class RegionClass
+    {
+        Metadata,
+        CpuData,
+        Buffers,
+        HighResolutionMips,
+        LowResolutionMips,
+        VisibleMips,
+        NumClasses
+    };
 
-    // immediately destroys all data loaded - it is up to the caller to ensure
-    // that the GPU isn't using it
-    void UnloadContent();
+    // Takes effect for the loads started after it is called.
+    void SetPriority(RegionClass regionClass, DSTORAGE_PRIORITY priority);
+
+    // The model's bounding sphere, from the header, in model space
+    Math::BoundingSphere GetBoundingSphere() const;
+
+    // How large the model is expected to be on screen, in pixels, while its
+    // content loads, which decides which of its high resolution mips are
+    // VisibleMips.  Zero, the default, when it isn't known.  Takes effect for
+    // the loads started after it is called.
+    void SetExpectedScreenSize(float pixelsAcross);
+
+    // A texture store holds the textures shared by the files of a batch.  Once
+    // the metadata is ready these say whether this file is a store, and the
+    // name of the store this file shares textures from, relative to its own
+    // directory, which is empty if it doesn't share any.
+    bool IsTextureStore() const;
+    std::string GetTextureStoreName() const;
+
+    // The store that the file's shared textures are taken from.  The store's
+    // content load must have been started before this file's, and the store
+    // must stay loaded until this file's content has been unloaded.  Takes
+    // effect for the loads started after it is called.
+    void SetTextureStore(MarcFile* store);
+
+    // When mip streaming is enabled a content load only reads the packed tail
+    // of each texture's mips (the RemainingMips region), and RequestMips reads
+    // the more detailed mips as they are needed.  The spare texture handles
+    // must be as many as the file's NumTextureHandles.  Takes effect for the
+    // loads started after it is called.
+    void SetMipStreaming(bool enabled, DescriptorHandle spareTextureHandles);
+
+    // Reads the mips needed to show the model at the given size on screen, in
+    // pixels.  Does nothing while a previous request is still loading.
+    void RequestMips(float pixelsAcross);
+
+    // Once requested mips have loaded, allows the descriptors to sample them.
+    // Returns false if this has to be called again later, as the spare
+    // descriptor tables are still in use.
+    bool UpdateStreamedMips();
+
+    // Requested mips are written into the textures, so this must be called
+    // before the textures are moved or destroyed.
+    void WaitForStreamedMips();
 
     enum class State
     {
@@ -99,6 +396,9 @@ public:
 
     State GetState() const;
 
+    // Once the file is in the Error state, the failure that put it there
+    HRESULT GetErrorStatus() const;
+
     // The DataSize is used to determine how much memory / how many descriptor
     // handles need to be allocated, as well as some interesting statistics for
     // the demo.
@@ -121,51 +421,145 @@ public:
     std::shared_ptr<Model> GetModel();
 
 private:
+    DSTORAGE_PRIORITY m_priorities[static_cast<size_t>(RegionClass::NumClasses)] = {
+        DSTORAGE_PRIORITY_HIGH,
+        DSTORAGE_PRIORITY_NORMAL,
+        DSTORAGE_PRIORITY_NORMAL,
+        DSTORAGE_PRIORITY_LOW,
+        DSTORAGE_PRIORITY_HIGH,
+        DSTORAGE_PRIORITY_NORMAL};
+
+    float m_expectedScreenSize = 0.0f;
+
     bool IsMetadataReady() const;
 
     void OnHeaderLoaded();
     void OnCpuMetadataLoaded();
 
-    void LoadCpuData();
+    void LoadCpuData(MemoryArena* arena);
     void LoadGpuData(
         std::vector<MultiHeapAllocation> const& texturesAllocations,
-        MultiHeapAllocation buffersAllocation);
+        BufferDestination const& buffers);
 
     void OnCpuDataLoaded();
     void OnGpuDataLoaded();
+    void OnMipsLoaded();
+    void OnPrefetchLoaded();
+
+    void ReleasePrefetch();
+    char const* FindPrefetched(uint64_t fileOffset, uint32_t size) const;
+    uint64_t GetSourceFileOffset(DSTORAGE_REQUEST const& request) const;
+
+    void PrepareMetadata(CachedMetadata const* cached);
+    void ComputeTextureAllocationInfos();
+    marc::TextureLayout const* GetValidTextureLayouts(ID3D12Device* device);
+    void ApplySwizzledLayouts();
 
     void OnAllDataLoaded();
+    void OnCancelledDataLoaded(InternalState otherDataLoaded, InternalState thisDataLoaded);
+
+    void CancelRequests();
 
     void CreateTextureDescriptors();
     void FixupMaterials();
+    void ConvertLegacyCpuMetadata();
+    bool LoadMetadataFromMapping();
+
+    template<typename T>
+    void MaskOffset(marc::Region<T>& region)
+    {
+        region.Data.Offset &= m_offsetMask;
+    }
 
     void CheckHR(HRESULT hr);
 
+    void EnsureStatusArray();
+    uint32_t GetStatusIndex(StatusArrayEntry entry) const;
+    void RetryRequests(IDStorageQueue1* queue, std::vector<DSTORAGE_REQUEST> const& requests);
+
+    void SetState(InternalState state);
+
     template<typename... States>
     void ValidateState(States... states) const;
 
     template<typename... States>
     bool StateIsOneOf(States... states) const;
 
+    IDStorageQueue1* GetQueue(
+        RegionClass regionClass,
+        DSTORAGE_REQUEST_SOURCE_TYPE sourceType = DSTORAGE_REQUEST_SOURCE_FILE);
+    uint32_t GetGpuQueueIndex(RegionClass regionClass, DSTORAGE_REQUEST_SOURCE_TYPE sourceType) const;
+    static IDStorageQueue1* GetGpuQueueFromIndex(uint32_t index);
+    LoadTelemetryBatch& GetTelemetryBatch(RegionClass regionClass);
+    void EnqueueRequest(RegionClass regionClass, DSTORAGE_REQUEST const& request);
+    void Submit(IDStorageQueue1* queue);
+
     template<typename T>
-    void EnqueueRead(uint64_t offset, T* dest);
+    void EnqueueRead(uint64_t offset, T* dest, RegionClass regionClass);
 
     template<typename T>
-    MemoryRegion<T> EnqueueReadMemoryRegion(marc::Region<T> const& region);
+    MemoryRegion<T> EnqueueReadMemoryRegion(
+        marc::Region<T> const& region,
+        RegionClass regionClass,
+        char const* source = nullptr,
+        MemoryArena* arena = nullptr);
+
+    ComPtr<ID3D12Resource> CopyToPlacedResource(
+        ID3D12Resource* source,
+        MultiHeapAllocation const& allocation,
+        CommandContext& context);
 
-    ComPtr<ID3D12Resource> EnqueueReadBufferRegion(ID3D12Heap* heap, uint64_t offset, marc::GpuRegion const& region);
+    ComPtr<ID3D12Resource> EnqueueReadBufferRegion(BufferDestination const& buffers, marc::GpuRegion const& region);
 
-    ComPtr<ID3D12Resource> EnqueueReadTexture(
-        ID3D12Heap* heap,
-        uint64_t offset,
+    ComPtr<ID3D12Resource> CreateResourceAt(ID3D12Heap* heap, uint64_t offset, D3D12_RESOURCE_DESC const& desc);
+
+    void EnqueueReadTexture(
+        ID3D12Resource* resource,
         D3D12_RESOURCE_DESC const& desc,
-        marc::TextureMetadata const& textureMetadata);
+        marc::TextureMetadata const& textureMetadata,
+        uint32_t mostDetailedMip,
+        uint32_t mostDetailedVisibleMip);
 
-    template<typename T>
-    DSTORAGE_REQUEST BuildRequestForRegion(marc::Region<T> const& region);
+    void EnqueueReadSwizzledTexture(MultiHeapAllocation const& allocation, marc::SwizzledTexture const& swizzled);
+
+    static uint32_t GetNumDetailedMips(marc::TextureMetadata const& textureMetadata);
+    static uint32_t GetNeededMip(D3D12_RESOURCE_DESC const& desc, float pixelsAcross);
+
+    void EnqueueReadDetailedMips(
+        ID3D12Resource* resource,
+        D3D12_RESOURCE_DESC const& desc,
+        marc::TextureMetadata const& textureMetadata,
+        uint32_t firstMip,
+        uint32_t endMip,
+        RegionClass regionClass);
+
+    void EnqueueReadMipBands(
+        ID3D12Resource* resource,
+        D3D12_RESOURCE_DESC const& desc,
+        marc::TextureMetadata const& textureMetadata,
+        uint32_t mip,
+        RegionClass regionClass);
+
+    void EnqueueReadTiles(
+        ID3D12Resource* resource,
+        D3D12_RESOURCE_DESC const& desc,
+        marc::TextureMetadata const& textureMetadata,
+        uint32_t firstMip,
+        uint32_t endMip,
+        RegionClass regionClass);
+
+    bool CanStreamMips(uint32_t textureIndex) const;
+    bool IsShared(uint32_t textureIndex) const;
+    marc::SwizzledTexture const* GetSwizzledTexture(uint32_t textureIndex) const;
+
+    template<DSTORAGE_REQUEST_DESTINATION_TYPE DestinationType, typename T>
+    DSTORAGE_REQUEST& AddRegionRequest(marc::Region<T> const& region);
+    void EnqueueRegionRequests(RegionClass regionClass);
+
+    EventWaitPool& GetEventWaitPool();
 
     template<void (MarcFile::*FN)()>
-    EventWait CreateEventWait();
+    void EnqueueCompletion(IDStorageQueue1* queue);
 
     // assumes lock is held
     bool IsOk() const;
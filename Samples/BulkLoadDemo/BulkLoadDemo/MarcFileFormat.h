@@ -12,6 +12,8 @@
 #include "../Core/Math/Common.h"
 #include "../Model/ModelLoader.h"
 
+#include <dxgi.h>
+
 //
 // This describes the on-disk format of a .marc file.
 //
@@ -21,6 +23,16 @@
 // Textures
 // Unstructured GPU Data
 // CPU Data
+// CPU Metadata
+//
+// The CPU metadata is placed at the end of the file so that it can usually be
+// read at the same time as the header, by reading the end of the file before
+// the header has been loaded.
+//
+// Files written together in a batch can share the textures that more than one
+// of them uses.  The shared textures are written once, to a texture store: a
+// .marc file that has only textures, and no meshes or materials.  The other
+// files name the store and refer to its textures by index.
 //
 
 namespace marc
@@ -28,7 +40,61 @@ namespace marc
     using Math::Matrix4;
     using Renderer::MaterialConstantData;
 
-    constexpr uint16_t CURRENT_MARC_FILE_VERSION = 1u;
+    constexpr uint16_t CURRENT_MARC_FILE_VERSION = 11u;
+
+    //
+    // Version 6 files are still readable.  Their layout is identical, but
+    // their offsets were 32-bit: only the low half of each Ptr was written, so
+    // the upper half has to be ignored when fixing them up.
+    //
+    constexpr uint16_t OLDEST_MARC_FILE_VERSION = 6u;
+
+    constexpr bool IsSupportedVersion(uint16_t version)
+    {
+        return version >= OLDEST_MARC_FILE_VERSION && version <= CURRENT_MARC_FILE_VERSION;
+    }
+
+    constexpr uint64_t GetOffsetMask(uint16_t version)
+    {
+        return version < 7u ? 0xFFFFFFFFull : ~0ull;
+    }
+
+    //
+    // From version 8, the Ptrs inside the CPU regions are self-relative (see
+    // Ptr).  Older files have offsets relative to the start of the region,
+    // which have to be converted after loading.
+    //
+    constexpr bool HasSelfRelativePtrs(uint16_t version)
+    {
+        return version >= 8u;
+    }
+
+    //
+    // From version 9, CpuDataHeader ends with the meshlets.  Older headers
+    // stop before them.
+    //
+    constexpr bool HasMeshlets(uint16_t version)
+    {
+        return version >= 9u;
+    }
+
+    //
+    // From version 10, CpuMetadataHeader ends with the texture layouts.  Older
+    // headers stop before them.
+    //
+    constexpr bool HasTextureLayouts(uint16_t version)
+    {
+        return version >= 10u;
+    }
+
+    //
+    // From version 11, CpuMetadataHeader ends with the swizzled textures.
+    // Older headers stop before them.
+    //
+    constexpr bool HasSwizzledTextures(uint16_t version)
+    {
+        return version >= 11u;
+    }
 
     //
     // Supported compression formats.  See Region.
@@ -38,19 +104,46 @@ namespace marc
         None = 0,
         GDeflate = 1,
         Zlib = 2,
+        ZlibBcSplit = 3, // see BcSplitHeader
     };
 
     //
-    // A pointer/offset.  On disk, this is an offset relative to the containing
-    // region (or the start of the file if this Ptr is stored in the header.)
-    // After the data has been loaded, the offsets are fixed up and converted
-    // into typed pointers.
+    // ZlibBcSplit regions hold BCn texture data with each block split into its
+    // endpoint and index bytes, which compress better apart than interleaved.
+    // The region starts with this header, followed by a Zlib stream of the
+    // endpoint bytes of every block, in block order, then the index bytes.
+    // Bit N of EndpointMask is set if byte N of a block is an endpoint byte.
+    //
+    struct BcSplitHeader
+    {
+        uint8_t BlockSize; // 8 or 16
+        uint8_t Reserved;
+        uint16_t EndpointMask;
+    };
+
+    //
+    // A pointer/offset.  Inside a region, this is the (two's complement)
+    // distance in bytes from the Ptr to the data it points to, or 0 for null,
+    // so a loaded region can be used in place without fixing anything up.  In
+    // the header it's the offset of a region from the start of the file.
+    // Offsets are 64-bit so that files can be larger than 4GB.
     //
     template<typename T>
-    union Ptr
+    struct Ptr
     {
-        uint32_t Offset;
-        T* Ptr;
+        uint64_t Offset;
+
+        T* Get()
+        {
+            if (Offset == 0)
+                return nullptr;
+            return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + static_cast<int64_t>(Offset));
+        }
+
+        T const* Get() const
+        {
+            return const_cast<Ptr*>(this)->Get();
+        }
     };
 
     //
@@ -63,12 +156,12 @@ namespace marc
 
         T& operator[] (size_t index)
         {
-            return Data.Ptr[index];
+            return Data.Get()[index];
         }
 
         T const& operator[] (size_t index) const
         {
-            return Data.Ptr[index];
+            return Data.Get()[index];
         }
     };
 
@@ -120,6 +213,32 @@ namespace marc
     // chain will not fit in the staging buffer, and so each texture is stored
     // as a number of single MIPs, and then the remaining MIPs.
     //
+    // Tiled textures are created as reserved resources (their TextureDesc has
+    // the 64KB_UNDEFINED_SWIZZLE layout).  Rather than single MIPs they store
+    // each 64KB tile of their standard MIPs as a separate region, so they can
+    // be loaded one tile at a time.  The packed MIPs are stored in
+    // RemainingMips.
+    //
+    // A single MIP that is larger than the staging buffer by itself is split
+    // into bands of rows, each of which fits.  Its SingleMips region is empty,
+    // and its bands are in MipBands.
+    //
+    struct TextureTile
+    {
+        uint32_t Mip;
+        uint32_t X; // in tiles
+        uint32_t Y; // in tiles
+        GpuRegion Data;
+    };
+
+    struct TextureMipBand
+    {
+        uint32_t Mip;
+        uint32_t Top;    // in texels
+        uint32_t Bottom; // in texels
+        GpuRegion Data;
+    };
+
     struct TextureMetadata
     {
         // The name of the file the texture was generated from.
@@ -127,6 +246,91 @@ namespace marc
         uint32_t NumSingleMips;
         Array<GpuRegion> SingleMips;
         GpuRegion RemainingMips;
+
+        // Only used for tiled textures; RemainingMips starts at MIP
+        // NumSingleMips + NumTiledMips.  NumHeapTiles is the number of tiles
+        // in the whole resource, including the packed MIPs.
+        uint32_t NumTiledMips;
+        uint32_t NumTiles;
+        Array<TextureTile> Tiles;
+        uint32_t NumHeapTiles;
+
+        uint32_t NumMipBands;
+        Array<TextureMipBand> MipBands;
+
+        // The index of the texture in the file's texture store, or NotShared.
+        // A shared texture has no regions of its own; its TextureDesc is the
+        // same as the store's.
+        uint32_t SharedIndex;
+    };
+
+    constexpr uint32_t NotShared = ~0u;
+
+    //
+    // Identifies an adapter and the version of its driver, which between them
+    // decide how much heap space each texture needs.
+    //
+    struct AdapterId
+    {
+        uint32_t VendorId;
+        uint32_t DeviceId;
+        uint32_t SubSysId;
+        uint32_t Revision;
+        int64_t DriverVersion;
+
+        bool operator==(AdapterId const& other) const
+        {
+            return VendorId == other.VendorId && DeviceId == other.DeviceId && SubSysId == other.SubSysId &&
+                   Revision == other.Revision && DriverVersion == other.DriverVersion;
+        }
+
+        bool operator!=(AdapterId const& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    inline bool GetAdapterId(IDXGIAdapter* adapter, AdapterId& id)
+    {
+        DXGI_ADAPTER_DESC desc{};
+        LARGE_INTEGER driverVersion{};
+        if (FAILED(adapter->GetDesc(&desc)) ||
+            FAILED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion)))
+        {
+            return false;
+        }
+
+        id = {desc.VendorId, desc.DeviceId, desc.SubSysId, desc.Revision, driverVersion.QuadPart};
+        return true;
+    }
+
+    //
+    // The heap space that a texture needs, as GetResourceAllocationInfo
+    // reported it.  Alignment is D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT if
+    // the texture can be placed at it; see MarcFile::ComputeTextureAllocationInfos.
+    // Shared and tiled textures have a layout of {0, 0}, since the loader
+    // doesn't ask the device about them.
+    //
+    struct TextureLayout
+    {
+        uint64_t SizeInBytes;
+        uint64_t Alignment;
+    };
+
+    //
+    // A texture exported with -swizzle also stores the whole of its resource's
+    // memory in the 64KB_STANDARD_SWIZZLE layout, which is the same on every
+    // adapter that supports it.  A loader on such an adapter creates the
+    // texture with that layout, and reads the parts, in order, into a buffer
+    // placed over it instead of reading the texture's other regions.  Each part
+    // fits in the staging buffer.  NumParts is 0 if the texture wasn't
+    // swizzled.
+    //
+    struct SwizzledTexture
+    {
+        uint64_t SizeInBytes;
+        uint32_t NumParts;
+        Array<GpuRegion> Parts;
     };
 
     //
@@ -140,6 +344,23 @@ namespace marc
         Array<D3D12_RESOURCE_DESC> TextureDescs;
 
         uint32_t NumMaterials;
+
+        // Set in a texture store.  Other files that share textures have the
+        // store's filename, relative to their own directory, in
+        // TextureStoreName; its Offset is 0 if they don't.
+        uint32_t IsTextureStore;
+        Ptr<char> TextureStoreName;
+
+        // One entry per texture, as computed by MiniArchive on LayoutAdapter,
+        // or empty if there was no adapter to ask.  A loader running on the
+        // same adapter and driver can use them instead of asking the device
+        // about every texture.  Only present if HasTextureLayouts(version).
+        AdapterId LayoutAdapter;
+        Array<TextureLayout> TextureLayouts;
+
+        // One entry per texture, or empty if none were swizzled.  Only present
+        // if HasSwizzledTextures(version).
+        Array<SwizzledTexture> SwizzledTextures;
     };
 
     //
@@ -183,5 +404,46 @@ namespace marc
         uint32_t NumJoints;
         Array<uint16_t> JointIndices;
         Array<Matrix4> JointIBMs;
+
+        // One entry per scene graph node if any mesh has
+        // PSOFlags::kQuantizedPos, otherwise empty.
+        uint32_t NumPositionQuantizations;
+        Array<PositionQuantization> PositionQuantizations;
+
+        // One entry per mesh if any mesh was split into meshlets, otherwise
+        // empty.  Only present if HasMeshlets(version).
+        uint32_t NumMeshlets;
+        Array<MeshletMesh> Meshlets;
+    };
+
+    //
+    // A bundle packs many marc files into one, so that they can all be loaded
+    // through a single IDStorageFile.  It starts with a BundleHeader, followed
+    // by NumEntries BundleEntry's and then the entries' names.  Each marc file
+    // is stored unchanged, its offsets relative to its own start, which is
+    // aligned to BundleAlignment so that its regions keep their alignment.
+    //
+    constexpr uint16_t CURRENT_BUNDLE_FILE_VERSION = 1u;
+    constexpr uint64_t BundleAlignment = 4096;
+
+    struct BundleHeader
+    {
+        char Id[4];       // "MBDL"
+        uint16_t Version; // CURRENT_BUNDLE_FILE_VERSION
+        uint16_t Reserved;
+        uint32_t NumEntries;
+        uint32_t NamesSize; // in bytes
+    };
+
+    struct BundleEntry
+    {
+        uint64_t Offset; // from the start of the bundle
+        uint64_t Size;
+
+        // The file's path relative to the bundle's directory when it was
+        // packed, not null terminated.  NameOffset is from the start of the
+        // names.
+        uint32_t NameOffset;
+        uint32_t NameLength;
     };
 } // namespace marc
\ No newline at end of file
@@ -7,16 +7,97 @@
 // PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
 //
 
+#include "pch.h"
+
 #include "MarcFileManager.h"
 
 #include "DStorageLoader.h"
 
+#include <BufferManager.h>
+#include <CommandContext.h>
 #include <Renderer.h>
+#include <d3dx12.h>
 
 #include <algorithm>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <unordered_map>
+
+namespace
+{
+    // When set, the unstructured GPU data of every file in a set is loaded
+    // into one shared buffer, rather than a buffer per file.
+    BoolVar SharedSetBuffer("DirectStorage/Shared Set Buffer", false);
+
+    // When set, textures are loaded with only their least detailed mips, and
+    // the rest are read on demand as the models are shown.
+    BoolVar StreamMips("DirectStorage/Stream Mips", false);
+
+    // When set, the CPU data arena is committed with large pages before each
+    // set loads, so that decompressing hundreds of MiB of CPU data doesn't
+    // fault in and walk the TLB for every 4 KiB page.  This needs the "Lock
+    // pages in memory" privilege; without it, or if the OS can't find the
+    // physical memory, the arena is committed up front with normal pages.
+    BoolVar LargePageCpuData("DirectStorage/Large Page CPU Data", false);
+
+    // When set, files added are told that their loads have completed by
+    // signals on a fence per queue, which one thread waits for, rather than by
+    // an event and threadpool wait for each load.  The callbacks then run one
+    // at a time on that thread.
+    BoolVar FenceCompletions("DirectStorage/Fence Completions", false);
+
+    // The number of files whose content may be loading at once in continuous
+    // loading mode.  Each has a few requests on each queue, so this bounds the
+    // work queued up behind a change to the target set.
+    IntVar ContinuousLoadsInFlight("DirectStorage/Continuous Loads In Flight", 16, 1, 1024);
+
+    // How much system memory PrefetchFiles may hold the next files' data in
+    IntVar PrefetchBudgetMiB("DirectStorage/Prefetch Budget (MiB)", 512, 0, 16384);
+
+    // Files whose compressed CPU metadata is no bigger than this have their
+    // metadata read synchronously through a mapping of the file, rather than
+    // through DirectStorage.  0 reads every file's metadata with DirectStorage.
+    IntVar MappedMetadataLimitKiB("DirectStorage/Mapped Metadata Limit (KiB)", 0, 0, 1024);
+
+    // When set, the heaps are given residency priorities from the files in
+    // them, so that the memory of the files being shown is paged out last
+    // when video memory is oversubscribed.  Files whose models are at least
+    // this many pixels across on screen are given a high priority.
+    BoolVar ResidencyPriorities("DirectStorage/Residency/Priorities", true);
+    IntVar HighPriorityPixels("DirectStorage/Residency/High Priority Pixels", 256, 0, 16384, 32);
+
+    constexpr wchar_t MetadataCacheFilename[] = L"BulkLoadDemo.metadatacache";
+
+    // Limits on how long a batch may hold back the requests enqueued in it
+    constexpr uint32_t MaxDeferredSubmits = 256;
+    constexpr std::chrono::milliseconds MaxSubmitDelay{2};
+
+    void AccumulateDataSize(MarcFile::DataSize& total, MarcFile::DataSize const& size)
+    {
+        total.CpuByteCount += size.CpuByteCount;
+        total.TexturesByteCount += size.TexturesByteCount;
+        total.BuffersByteCount += size.BuffersByteCount;
+        total.NumTextureHandles += size.NumTextureHandles;
+        total.GDeflateByteCount += size.GDeflateByteCount;
+        total.ZLibByteCount += size.ZLibByteCount;
+        total.UncompressedByteCount += size.UncompressedByteCount;
+    }
+}
 
 MarcFileManager::MarcFileManager()
-    : m_loadComplete(EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this))
+    : m_submitBatcher(MaxDeferredSubmits, MaxSubmitDelay)
+    , m_statusArrayPool(g_dsFactory.Get())
+    , m_loadComplete{
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this),
+          EventWait::Create<MarcFileManager, &MarcFileManager::OnLoadComplete>(this)}
 {
     ComPtr<IDXGIFactory4> dxgiFactory;
     if (FAILED(CreateDXGIFactory(IID_PPV_ARGS(&dxgiFactory))))
@@ -24,25 +105,25 @@ MarcFileManager::MarcFileManager()
         std::abort();
     }
 
-    ComPtr<IDXGIAdapter3> dxgiAdapter;
-    if (FAILED(dxgiFactory->EnumAdapterByLuid(Graphics::g_Device->GetAdapterLuid(), IID_PPV_ARGS(&dxgiAdapter))))
+    if (FAILED(dxgiFactory->EnumAdapterByLuid(Graphics::g_Device->GetAdapterLuid(), IID_PPV_ARGS(&m_dxgiAdapter))))
     {
         std::abort();
     }
 
-    DXGI_QUERY_VIDEO_MEMORY_INFO videoMemoryInfo{};
-    if (FAILED(dxgiAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &videoMemoryInfo)))
-    {
-        dxgiAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_NON_LOCAL, &videoMemoryInfo);
-    }
+    m_metadataCache = std::make_unique<MetadataCache>(MetadataCacheFilename, m_dxgiAdapter.Get());
+    m_completionFences = std::make_unique<CompletionFences>(Graphics::g_Device);
 
-    UINT64 maxAllocationSize = ((videoMemoryInfo.Budget * 3) / 4); // 3/4 total gpu memory budget
+    UINT64 maxAllocationSize = GetHeapBudget();
 
     UINT64 totalTexturesMemorySize = ((maxAllocationSize * 3) / 4); // 3/4 of gpu budget for textures
     Utility::Printf("Using %f GiB of heap(s) for textures\n", totalTexturesMemorySize / 1024.0 / 1024.0 / 1024.0);
 
-    m_texturesHeap =
-        std::make_unique<MultiHeap>(D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES, totalTexturesMemorySize);
+    // Swizzled textures are read through buffers placed over them, so the
+    // textures heap has to allow buffers when they can be loaded
+    D3D12_HEAP_FLAGS const texturesHeapFlags = MarcFile::CanLoadSwizzledTextures()
+                                                   ? D3D12_HEAP_FLAG_ALLOW_ALL_BUFFERS_AND_TEXTURES
+                                                   : D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES;
+    m_texturesHeap = std::make_unique<MultiHeap>(texturesHeapFlags, totalTexturesMemorySize);
 
     UINT64 totalBuffersMemorySize = (maxAllocationSize / 4); // 1/4 of gpu budget for buffers
     Utility::Printf("Using %f GiB of heap(s) for buffers\n", totalBuffersMemorySize / 1024.0 / 1024.0 / 1024.0);
@@ -52,61 +133,222 @@ MarcFileManager::MarcFileManager()
     m_state = State::LoadingMetadata;
 }
 
+DXGI_QUERY_VIDEO_MEMORY_INFO MarcFileManager::QueryVideoMemoryInfo() const
+{
+    DXGI_QUERY_VIDEO_MEMORY_INFO videoMemoryInfo{};
+    if (FAILED(m_dxgiAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &videoMemoryInfo)))
+    {
+        m_dxgiAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_NON_LOCAL, &videoMemoryInfo);
+    }
+    return videoMemoryInfo;
+}
+
+//
+// Returns how much memory the heaps may use.  This is 3/4 of the budget the OS
+// currently gives the process, less whatever the rest of the process is
+// already using, so it shrinks when other applications need memory.
+//
+UINT64 MarcFileManager::GetHeapBudget() const
+{
+    DXGI_QUERY_VIDEO_MEMORY_INFO videoMemoryInfo = QueryVideoMemoryInfo();
+
+    UINT64 heapsSize = 0;
+    if (m_texturesHeap && !m_heapsEvicted)
+        heapsSize = m_texturesHeap->GetTotalSize() + m_buffersHeap->GetTotalSize();
+
+    UINT64 otherUsage = videoMemoryInfo.CurrentUsage - std::min(videoMemoryInfo.CurrentUsage, heapsSize);
+    UINT64 available = videoMemoryInfo.Budget - std::min(videoMemoryInfo.Budget, otherUsage);
+
+    return std::min((videoMemoryInfo.Budget * 3) / 4, available);
+}
+
+//
+// Called between sets, while nothing is allocated from the heaps, to fit them
+// to the current budget.  They are always shrunk to fit, but only grown when
+// the budget has risen noticeably, since recreating heaps is expensive.
+//
+void MarcFileManager::ResizeHeapsToBudget()
+{
+    if (m_heapsEvicted)
+    {
+        m_texturesHeap->MakeResident();
+        m_buffersHeap->MakeResident();
+        m_heapsEvicted = false;
+    }
+
+    UINT64 budget = GetHeapBudget();
+    UINT64 currentSize = m_texturesHeap->GetTotalSize() + m_buffersHeap->GetTotalSize();
+
+    if (budget < currentSize || budget > currentSize + currentSize / 10)
+    {
+        Utility::Printf("Resizing heaps to %f GiB\n", budget / 1024.0 / 1024.0 / 1024.0);
+        m_texturesHeap->Resize((budget * 3) / 4);
+        m_buffersHeap->Resize(budget / 4);
+    }
+}
+
 MarcFileManager::~MarcFileManager()
 {
 }
 
 MarcFileManager::FileId MarcFileManager::Add(std::wstring const& filename)
+{
+    return Add(filename, std::make_unique<MarcFile>(filename));
+}
+
+//
+// The bundle's directory is read here, synchronously; it's small, and nothing
+// can be loaded from the bundle without it.  Its files are named as if the
+// bundle were a directory holding them, so that the texture stores they refer
+// to are found in the same bundle.
+//
+std::vector<MarcFileManager::FileId> MarcFileManager::AddBundle(std::wstring const& filename)
+{
+    std::vector<FileId> ids;
+
+    std::ifstream s(filename, std::ios::in | std::ios::binary);
+
+    marc::BundleHeader header{};
+    s.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!s || memcmp(header.Id, "MBDL", 4) != 0 || header.Version != marc::CURRENT_BUNDLE_FILE_VERSION)
+    {
+        Utility::Printf(L"Unable to read bundle %s\n", filename.c_str());
+        return ids;
+    }
+
+    std::vector<marc::BundleEntry> entries(header.NumEntries);
+    std::vector<char> names(header.NamesSize);
+    s.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(marc::BundleEntry));
+    s.read(names.data(), names.size());
+    if (!s)
+    {
+        Utility::Printf(L"Unable to read bundle %s\n", filename.c_str());
+        return ids;
+    }
+
+    ComPtr<IDStorageFile> bundle;
+    if (FAILED(g_dsFactory->OpenFile(filename.c_str(), IID_PPV_ARGS(&bundle))))
+    {
+        Utility::Printf(L"Unable to open bundle %s\n", filename.c_str());
+        return ids;
+    }
+
+    for (marc::BundleEntry const& entry : entries)
+    {
+        if (uint64_t(entry.NameOffset) + entry.NameLength > names.size())
+            continue;
+
+        std::string name(names.data() + entry.NameOffset, entry.NameLength);
+        std::filesystem::path path = (std::filesystem::path(filename) / name).lexically_normal();
+
+        ids.push_back(
+            Add(path.wstring(), std::make_unique<MarcFile>(bundle, filename, entry.Offset, entry.Size)));
+    }
+
+    return ids;
+}
+
+MarcFileManager::FileId MarcFileManager::Add(std::wstring const& filename, std::unique_ptr<MarcFile> marcFile)
 {
     File f;
 
     f.Filename = filename;
-    f.MarcFile = std::make_unique<MarcFile>(filename);
-    f.MarcFile->StartMetadataLoad();
+    f.MarcFile = std::move(marcFile);
 
     auto id = m_files.size();
+    f.Id = id;
+    f.MarcFile->SetCompletionQueue(&m_completionQueue, id);
+    if (FenceCompletions)
+        f.MarcFile->SetCompletionFences(m_completionFences.get());
+    f.MarcFile->SetEventWaitPool(&m_eventWaitPool);
+    f.MarcFile->SetSubmitBatcher(&m_submitBatcher);
+    f.MarcFile->SetStatusArrayPool(m_statusArrayPool);
+    f.MarcFile->SetMappedMetadataReads(static_cast<uint32_t>(static_cast<int32_t>(MappedMetadataLimitKiB)) * 1024);
+
+    if (CachedMetadata const* cached = m_metadataCache->Find(filename))
+        f.MarcFile->LoadCachedMetadata(*cached);
+    else
+        f.MarcFile->StartMetadataLoad();
+
+    f.MetadataPending = true;
+    ++m_numPendingMetadata;
+
+    // Files are added to both in the same order, so they have the same ids
+    m_fileStates.Add(std::filesystem::path(filename).lexically_normal().wstring());
     m_files.push_back(std::move(f));
 
     return id;
 }
 
+void MarcFileManager::BeginBatch()
+{
+    m_submitBatcher.Begin();
+}
+
+void MarcFileManager::EndBatch()
+{
+    m_submitBatcher.End();
+}
+
 //
 // SetNextSet attempts to load the content for all of the passed in files, in
-// order.  If there's not enough space in the heap then the file is silently
-// skipped.
+// order.  If there's not enough space in the heap then the file is skipped
+// and added to the deferred files.
 //
 void MarcFileManager::SetNextSet(std::vector<FileId> const& ids)
 {
     assert(m_state == State::ReadyToLoad);
 
-    m_nextDescriptorHandleIndex = 0;
+    // UnloadSet has freed everything, so the heaps can be resized
+    assert(m_deferredReleases.IsEmpty());
+    ResizeHeapsToBudget();
+
+    if (SharedSetBuffer)
+        CreateSetBuffer(ids);
+
+    PrecommitCpuData(ids);
 
-    m_buffersHeap->Clear();
-    m_texturesHeap->Clear();
+    m_deferredFiles.clear();
+    m_newlyLoadedFiles.clear();
 
     m_currentSetSize = MarcFile::DataSize{};
     m_numLoadedModels = 0;
     m_startLoadTime = std::chrono::high_resolution_clock::now();
 
+    // Every file's requests go through one scheduler, so that they are read in
+    // file and offset order rather than in the order the files were started.
+    RequestScheduler scheduler;
+
     for (auto id : ids)
     {
-        auto size = TryStartLoad(m_files[id]);
+        bool outOfSpace = false;
+        auto size = TryStartLoad(m_files[id], scheduler, outOfSpace);
+
+        if (outOfSpace)
+            m_deferredFiles.push_back(id);
 
         if ((size.TexturesByteCount + m_currentSetSize.BuffersByteCount) > 0)
             m_numLoadedModels++;
 
-        m_currentSetSize.CpuByteCount += size.CpuByteCount;
-        m_currentSetSize.TexturesByteCount += size.TexturesByteCount;
-        m_currentSetSize.BuffersByteCount += size.BuffersByteCount;
-        m_currentSetSize.NumTextureHandles += size.NumTextureHandles;
-        m_currentSetSize.GDeflateByteCount += size.GDeflateByteCount;
-        m_currentSetSize.ZLibByteCount += size.ZLibByteCount;
-        m_currentSetSize.UncompressedByteCount += size.UncompressedByteCount;
+        AccumulateDataSize(m_currentSetSize, size);
     }
 
-    m_loadComplete.SetThreadpoolWait();
-    g_dsGpuQueue->EnqueueSetEvent(m_loadComplete);
-    g_dsGpuQueue->Submit();
+    // The files that were prefetched have started loading from their
+    // prefetched data, and release it once they're loaded.
+    m_prefetchedFiles.clear();
+
+    m_numPendingQueues = NumLoadQueues;
+    for (uint32_t i = 0; i < NumLoadQueues; ++i)
+    {
+        IDStorageQueue1* queue = GetGpuQueue(
+            GetPriorityFromIndex(i % DSTORAGE_PRIORITY_COUNT),
+            i < DSTORAGE_PRIORITY_COUNT ? DSTORAGE_REQUEST_SOURCE_FILE : DSTORAGE_REQUEST_SOURCE_MEMORY);
+
+        m_loadComplete[i].SetThreadpoolWait();
+        scheduler.EnqueueSetEvent(queue, m_loadComplete[i]);
+    }
+
+    scheduler.Flush();
 
     m_state = State::Loading;
 }
@@ -115,29 +357,105 @@ void MarcFileManager::OnLoadComplete()
 {
     using namespace std::chrono;
 
+    if (--m_numPendingQueues > 0)
+        return;
+
     auto loadTime = high_resolution_clock::now() - m_startLoadTime;
     m_loadTime = duration_cast<milliseconds>(loadTime);
 }
 
-void MarcFileManager::Update()
+//
+// Looks at the files that have pushed to the completion queue since the last
+// call.  A file may have been pushed several times, or for a change that has
+// already been accounted for, so the pending flags make sure it is only
+// counted once.
+//
+void MarcFileManager::ProcessCompletions()
 {
-    bool allMetadataReady = true;
-    bool allLoaded = true;
+    // May add texture stores, so these are looked at once the loop is done
+    std::vector<FileId> metadataReadyFiles;
 
-    for (auto& file : m_files)
+    for (size_t id : m_completionQueue.TakeAll())
     {
-        switch (file.MarcFile->GetState())
+        File& file = m_files[id];
+        auto state = file.MarcFile->GetState();
+
+        // Files that fail are reported, and are then just never shown
+        if (state == MarcFile::State::Error && (file.MetadataPending || file.ContentPending))
         {
-        case MarcFile::State::Initializing:
-            allMetadataReady = allLoaded = false;
-            break;
+            Utility::Printf(
+                "Failed to load %ls (0x%08X)\n",
+                file.Filename.c_str(),
+                static_cast<uint32_t>(file.MarcFile->GetErrorStatus()));
+        }
 
-        case MarcFile::State::ContentLoading:
-            allLoaded = false;
-            break;
+        if (file.MetadataPending && state != MarcFile::State::Initializing)
+        {
+            file.MetadataPending = false;
+            --m_numPendingMetadata;
+
+            if (auto metadata = file.MarcFile->TakeMetadataForCache())
+                m_metadataCache->Store(file.Filename, std::move(*metadata));
+
+            if (state == MarcFile::State::ReadyToLoadContent)
+                metadataReadyFiles.push_back(id);
+
+            if (m_numPendingMetadata == 0)
+                m_metadataCache->Save();
         }
+
+        if (file.ContentPending && state != MarcFile::State::ContentLoading)
+        {
+            file.ContentPending = false;
+            --m_numPendingContent;
+
+            if (state == MarcFile::State::ContentLoaded && !file.IsTextureStore)
+                m_newlyLoadedFiles.push_back(id);
+
+            // Nothing is writing to a cancelled file's memory any more, and it
+            // was never rendered, but the store it held may have been
+            if (file.Cancelling)
+            {
+                file.Cancelling = false;
+                FreeAllocations(file, 0);
+                ReleaseTextureStore(file, DeferredReleaseQueue::SignalGraphicsQueue());
+                m_fileStates.SetState(id, FileState::Unloaded);
+            }
+            else
+            {
+                // A file that failed keeps its memory until it's unloaded
+                bool const loaded = state == MarcFile::State::ContentLoaded;
+                m_fileStates.SetState(id, loaded ? FileState::Loaded : FileState::Failed);
+            }
+        }
+
+        if (state == MarcFile::State::ContentLoaded)
+            m_pendingMipUpdates.push_back(id);
     }
 
+    for (FileId id : metadataReadyFiles)
+        ResolveTextureStore(id);
+
+    // Streamed mips may have to wait for the spare descriptor tables to be
+    // free, in which case they're tried again next frame.
+    std::erase_if(m_pendingMipUpdates, [&](size_t id) { return m_files[id].MarcFile->UpdateStreamedMips(); });
+}
+
+void MarcFileManager::Update()
+{
+    m_deferredReleases.Update();
+
+    ProcessCompletions();
+
+    if (m_texturesHeap)
+    {
+        RecordHeapUsage(TelemetryHeap::Textures, m_texturesHeap->GetUsedSize(), m_texturesHeap->GetTotalSize());
+        RecordHeapUsage(TelemetryHeap::Buffers, m_buffersHeap->GetUsedSize(), m_buffersHeap->GetTotalSize());
+    }
+
+    bool allMetadataReady = m_numPendingMetadata == 0;
+    bool allLoaded = m_numPendingMetadata == 0 && m_numPendingContent == 0;
+
     using namespace std::chrono_literals;
 
     switch (m_state)
@@ -145,7 +463,7 @@ void MarcFileManager::Update()
     case State::LoadingMetadata:
         if (allMetadataReady)
         {
-            AllocateDescriptors();
+            CreateDescriptorPool();
             m_state = State::ReadyToLoad;
         }
         break;
@@ -155,6 +473,7 @@ void MarcFileManager::Update()
         break;
 
     case State::Loading:
+    case State::Cancelling:
         if (allLoaded)
         {
             m_state = State::Loaded;
@@ -163,50 +482,300 @@ void MarcFileManager::Update()
 
     case State::Loaded:
         break;
+
+    case State::Continuous:
+        UpdateContinuousLoading();
+        break;
+    }
+
+    UpdateResidencyPriorities();
+}
+
+//
+// Each heap is given the highest priority of the files that have memory in
+// it.  A texture store's memory is as important as the most important file
+// that holds it, and the shared set buffer is part of the set.  With
+// ResidencyPriorities off, every heap is put back to the default priority.
+//
+void MarcFileManager::UpdateResidencyPriorities()
+{
+    if (!m_texturesHeap)
+        return;
+
+    if (!ResidencyPriorities)
+    {
+        m_texturesHeap->SetResidencyPriorities(
+            std::vector(m_texturesHeap->GetNumHeaps(), D3D12_RESIDENCY_PRIORITY_NORMAL));
+        m_buffersHeap->SetResidencyPriorities(
+            std::vector(m_buffersHeap->GetNumHeaps(), D3D12_RESIDENCY_PRIORITY_NORMAL));
+        return;
+    }
+
+    // Only the files holding memory are given priorities, and stores are added
+    // by the files that hold them
+    std::unordered_map<FileId, D3D12_RESIDENCY_PRIORITY> filePriorities;
+    for (FileId id : GetFilesHoldingMemory())
+    {
+        File const& file = m_files[id];
+        if (!file.MarcFile || file.IsTextureStore || (file.TextureAllocations.empty() && !file.BuffersAllocation))
+            continue;
+
+        D3D12_RESIDENCY_PRIORITY const priority = GetResidencyPriority(file);
+        filePriorities[id] = std::max(filePriorities[id], priority);
+        if (file.HoldsTextureStore)
+            filePriorities[file.TextureStore] = std::max(filePriorities[file.TextureStore], priority);
     }
+
+    std::vector<D3D12_RESIDENCY_PRIORITY> texturesPriorities(
+        m_texturesHeap->GetNumHeaps(),
+        D3D12_RESIDENCY_PRIORITY_MINIMUM);
+    std::vector<D3D12_RESIDENCY_PRIORITY> buffersPriorities(
+        m_buffersHeap->GetNumHeaps(),
+        D3D12_RESIDENCY_PRIORITY_MINIMUM);
+
+    auto raise = [](std::vector<D3D12_RESIDENCY_PRIORITY>& heapPriorities,
+                    MultiHeapAllocation const& allocation,
+                    D3D12_RESIDENCY_PRIORITY priority)
+    {
+        if (allocation.Block == TlsfAllocator::InvalidBlock)
+            return;
+
+        heapPriorities[allocation.HeapIndex] = std::max(heapPriorities[allocation.HeapIndex], priority);
+    };
+
+    for (auto const& [id, priority] : filePriorities)
+    {
+        File const& file = m_files[id];
+        for (MultiHeapAllocation const& allocation : file.TextureAllocations)
+            raise(texturesPriorities, allocation, priority);
+        if (file.BuffersAllocation)
+            raise(buffersPriorities, *file.BuffersAllocation, priority);
+    }
+
+    if (m_setBuffer)
+        raise(buffersPriorities, m_setBufferAllocation, D3D12_RESIDENCY_PRIORITY_NORMAL);
+
+    m_texturesHeap->SetResidencyPriorities(texturesPriorities);
+    m_buffersHeap->SetResidencyPriorities(buffersPriorities);
 }
 
-void MarcFileManager::AllocateDescriptors()
+//
+// Files that have left the target set are only kept in case they're needed
+// again, so they go first.  Of the rest, the ones close enough to the camera
+// to be large on screen are kept over the others.
+//
+D3D12_RESIDENCY_PRIORITY MarcFileManager::GetResidencyPriority(File const& file) const
+{
+    if (m_state == State::Continuous && !file.Targeted)
+        return D3D12_RESIDENCY_PRIORITY_LOW;
+
+    float const screenSize = file.ScreenSize > 0.0f ? file.ScreenSize : file.ExpectedScreenSize;
+    if (screenSize >= static_cast<float>(static_cast<int32_t>(HighPriorityPixels)))
+        return D3D12_RESIDENCY_PRIORITY_HIGH;
+
+    return D3D12_RESIDENCY_PRIORITY_NORMAL;
+}
+
+//
+// The pool is large enough for every file to be loaded at once with a spare
+// set of descriptors for mip streaming.  When the heap doesn't have that many
+// left the pool takes what there is, and only as many files as fit in it can
+// be loaded at once.
+//
+void MarcFileManager::CreateDescriptorPool()
 {
     uint32_t descriptorCount = 0;
     for (auto& file : m_files)
     {
         if (file.MarcFile)
-            descriptorCount += file.MarcFile->GetRequiredDataSize().NumTextureHandles;
+            descriptorCount += file.MarcFile->GetRequiredDataSize().NumTextureHandles * 2;
     }
 
-    m_baseTextureHandle = Renderer::s_TextureHeap.Alloc(descriptorCount);
-    m_nextDescriptorHandleIndex = 0;
+    if (!Renderer::s_TextureHeap.HasAvailableSpace(descriptorCount))
+    {
+        uint32_t available = 0;
+        for (uint32_t step = std::bit_floor(descriptorCount); step > 0; step /= 2)
+        {
+            if (Renderer::s_TextureHeap.HasAvailableSpace(available + step))
+                available += step;
+        }
+
+        Utility::Printf("Only %u of %u descriptors are available\n", available, descriptorCount);
+        descriptorCount = available;
+    }
+
+    if (descriptorCount == 0)
+        return;
+
+    m_descriptorPool = Renderer::s_TextureHeap.Alloc(descriptorCount);
+    m_descriptorAllocator = TlsfAllocator(descriptorCount, 1);
 }
 
-std::vector<ModelInstance> MarcFileManager::CreateInstancesForSet()
+std::vector<std::shared_ptr<const Model>> MarcFileManager::GetModelsForSet()
 {
-    std::vector<ModelInstance> instances;
-    instances.reserve(m_files.size());
+    std::vector<FileId> ids = GetFilesForSet();
 
-    for (auto& file : m_files)
-    {
-        if (file.MarcFile->GetState() != MarcFile::State::ContentLoaded)
-            continue;
+    std::vector<std::shared_ptr<const Model>> models;
+    models.reserve(ids.size());
+
+    for (FileId id : ids)
+        models.push_back(m_files[id].MarcFile->GetModel());
+
+    return models;
+}
+
+std::vector<MarcFileManager::FileId> MarcFileManager::TakeNewlyLoadedFiles()
+{
+    // Files unloaded since they loaded are dropped; files waiting for their
+    // texture store are kept for a later call.
+    std::vector<FileId> ids;
+    std::erase_if(
+        m_newlyLoadedFiles,
+        [&](FileId id)
+        {
+            File const& file = m_files[id];
+            if (file.MarcFile->GetState() != MarcFile::State::ContentLoaded)
+                return true;
+
+            if (!IsShowable(file))
+                return false;
+
+            ids.push_back(id);
+            return true;
+        });
+    return ids;
+}
+
+bool MarcFileManager::IsTextureStore(FileId id) const
+{
+    return m_files[id].IsTextureStore;
+}
+
+ModelInstance MarcFileManager::CreateInstance(FileId id)
+{
+    return ModelInstance(m_files[id].MarcFile->GetModel());
+}
+
+//
+// Only the loaded files are looked at, but they're put back in the order they
+// were added, so that a set is laid out the same way however it loaded.
+//
+std::vector<MarcFileManager::FileId> MarcFileManager::GetFilesForSet() const
+{
+    std::vector<FileId> ids = m_fileStates.GetFiles(FileState::Loaded);
+    std::vector<FileId> departed = m_fileStates.GetFiles(FileState::Departed);
+    ids.insert(ids.end(), departed.begin(), departed.end());
+
+    std::erase_if(ids, [&](FileId id) { return !IsShowable(m_files[id]); });
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
 
-        instances.emplace_back(file.MarcFile->GetModel());
+std::vector<MarcFileManager::FileId> MarcFileManager::GetFilesInState(FileState state) const
+{
+    return m_fileStates.GetFiles(state);
+}
+
+size_t MarcFileManager::GetNumFilesInState(FileState state) const
+{
+    return m_fileStates.GetCount(state);
+}
+
+// Every file that isn't Unloaded has content, or a failed load's memory, to unload
+std::vector<MarcFileManager::FileId> MarcFileManager::GetFilesHoldingMemory() const
+{
+    std::vector<FileId> ids;
+    for (FileState state : {FileState::Loading, FileState::Loaded, FileState::Departed, FileState::Failed})
+    {
+        std::vector<FileId> inState = m_fileStates.GetFiles(state);
+        ids.insert(ids.end(), inState.begin(), inState.end());
     }
+    return ids;
+}
+
+void MarcFileManager::RequestMips(FileId id, float pixelsAcross)
+{
+    m_files[id].ScreenSize = pixelsAcross;
+    m_files[id].MarcFile->RequestMips(pixelsAcross);
+}
+
+float MarcFileManager::EstimateScreenSize(Math::BoundingSphere const& sphere, Math::Camera const& camera)
+{
+    float distance = Math::Length(sphere.GetCenter() - camera.GetPosition());
+    float radius = sphere.GetRadius();
+    float pixelsAcross = static_cast<float>(Graphics::g_SceneColorBuffer.GetHeight());
+    if (distance > radius)
+        pixelsAcross *= radius / (distance * std::tan(camera.GetFOV() * 0.5f));
+
+    return pixelsAcross;
+}
+
+Math::BoundingSphere MarcFileManager::GetBoundingSphere(FileId id) const
+{
+    return m_files[id].MarcFile->GetBoundingSphere();
+}
 
-    return instances;
+void MarcFileManager::SetExpectedPlacement(
+    FileId id,
+    Math::UniformTransform const& locator,
+    Math::Camera const& camera)
+{
+    File& file = m_files[id];
+
+    file.ExpectedScreenSize = EstimateScreenSize(locator * file.MarcFile->GetBoundingSphere(), camera);
+    file.MarcFile->SetExpectedScreenSize(file.ExpectedScreenSize);
 }
 
 void MarcFileManager::UnloadSet()
 {
+    assert(m_state != State::Cancelling);
+
+    // The frames that have already been submitted may still be drawing the
+    // set, so its memory is released once the GPU has finished them rather
+    // than waiting for that here.
+    uint64_t releaseFence = DeferredReleaseQueue::SignalGraphicsQueue();
+
     // Unload anything already loaded
-    for (auto& file : m_files)
+    for (FileId id : GetFilesHoldingMemory())
+    {
+        UnloadFile(id, releaseFence);
+    }
+
+    if (m_setBuffer)
     {
-        file.MarcFile->UnloadContent();
+        m_deferredReleases.Push(
+            releaseFence,
+            [this, buffer = std::move(m_setBuffer), allocation = m_setBufferAllocation]
+            { m_buffersHeap->Free(allocation); });
     }
 
+    // Every file's content has been unloaded, so nothing refers to the arena
+    m_cpuDataArena.Reset();
+
+    for (FileId id : m_targetFiles)
+        m_files[id].Targeted = false;
+    m_targetFiles.clear();
+
+    // Nothing is using the heaps until the next set starts loading, so if the
+    // process is over budget give their memory back to the OS until then.
+    // This is pushed last, so it runs once everything above has been freed.
+    m_deferredReleases.Push(
+        releaseFence,
+        [this]
+        {
+            DXGI_QUERY_VIDEO_MEMORY_INFO videoMemoryInfo = QueryVideoMemoryInfo();
+            if (videoMemoryInfo.CurrentUsage > videoMemoryInfo.Budget)
+            {
+                m_texturesHeap->Evict();
+                m_buffersHeap->Evict();
+                m_heapsEvicted = true;
+            }
+        });
+
     m_state = State::ReadyToLoad;
 }
 
-MarcFile::DataSize MarcFileManager::TryStartLoad(File& file)
+MarcFile::DataSize MarcFileManager::TryStartLoad(File& file, RequestScheduler& scheduler, bool& outOfSpace)
 {
     if (file.MarcFile->GetState() != MarcFile::State::ReadyToLoadContent)
     {
@@ -214,34 +783,639 @@ MarcFile::DataSize MarcFileManager::TryStartLoad(File& file)
         return {};
     }
 
-    // Is there enough space to store the contents of this file?
-    auto allocationInfos = file.MarcFile->GetTextureAllocationInfos();
+    // A store is only loaded for the files that hold it
+    if (file.IsTextureStore && file.TextureStoreRefs == 0)
+        return {};
+
+    MarcFile::DataSize storeSize{};
+    if (file.TextureStore != NoTextureStore && !AcquireTextureStore(file, scheduler, outOfSpace, storeSize))
+        return {};
+
+    // Is there enough space to store the contents of this file?  The largest
+    // textures are placed first, since that packs them more tightly.
+    auto const& allocationInfos = file.MarcFile->GetTextureAllocationInfos();
     auto requiredDataSize = file.MarcFile->GetRequiredDataSize();
-    if (!m_texturesHeap->CanAllocate(allocationInfos) ||
-        !m_buffersHeap->CanAllocate(requiredDataSize.BuffersByteCount))
+
+    std::vector<uint32_t> placementOrder(allocationInfos.size());
+    std::iota(placementOrder.begin(), placementOrder.end(), 0);
+    std::stable_sort(
+        placementOrder.begin(),
+        placementOrder.end(),
+        [&](uint32_t a, uint32_t b) { return allocationInfos[a].SizeInBytes > allocationInfos[b].SizeInBytes; });
+
+    m_texturesHeap->BeginReservation();
+    m_buffersHeap->BeginReservation();
+
+    std::vector<MultiHeapAllocation> textureAllocations(allocationInfos.size());
+    bool fits = true;
+    for (uint32_t i : placementOrder)
+    {
+        // Shared textures are the store's
+        if (allocationInfos[i].SizeInBytes == 0)
+            continue;
+
+        auto allocation = m_texturesHeap->Reserve(allocationInfos[i].SizeInBytes, allocationInfos[i].Alignment);
+        if (!allocation)
+        {
+            fits = false;
+            break;
+        }
+        textureAllocations[i] = std::move(*allocation);
+    }
+
+    MarcFile::BufferDestination buffers;
+    if (fits && m_setBuffer)
+    {
+        uint64_t offset = Math::AlignUp(m_setBufferUsed, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+        fits = (offset + requiredDataSize.BuffersByteCount) <= m_setBufferSize;
+        buffers.SharedBuffer = m_setBuffer;
+        buffers.SharedBufferOffset = offset;
+    }
+    else if (fits && requiredDataSize.BuffersByteCount > 0)
+    {
+        auto allocation = m_buffersHeap->Reserve(requiredDataSize.BuffersByteCount);
+        fits = allocation.has_value();
+        if (fits)
+            buffers.Allocation = std::move(*allocation);
+    }
+
+    // Mip streaming needs a second set of descriptors, so the file is loaded
+    // without it if there isn't room for both.
+    uint32_t numHandles = requiredDataSize.NumTextureHandles;
+    std::optional<TlsfAllocator::Allocation> descriptors;
+    bool spareHandles = false;
+    if (fits && numHandles > 0)
+    {
+        if (StreamMips)
+        {
+            descriptors = m_descriptorAllocator.Allocate(numHandles * 2);
+            spareHandles = descriptors.has_value();
+        }
+
+        if (!descriptors)
+            descriptors = m_descriptorAllocator.Allocate(numHandles);
+
+        fits = descriptors.has_value();
+    }
+
+    if (!fits)
     {
         // out of space
+        m_texturesHeap->Rollback();
+        m_buffersHeap->Rollback();
+
+        // If this file was the store's only holder, the store's load was only
+        // started for it, so nothing has drawn with the store yet
+        ReleaseTextureStore(file, 0);
+        outOfSpace = true;
         return {};
     }
 
-    auto increment = Graphics::g_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-    DescriptorHandle textureHandles = m_baseTextureHandle + m_nextDescriptorHandleIndex * increment;
-    m_nextDescriptorHandleIndex += requiredDataSize.NumTextureHandles;
+    m_texturesHeap->Commit();
+    m_buffersHeap->Commit();
 
-    auto textureAllocations = m_texturesHeap->Allocate(allocationInfos);
-    auto buffersAllocation = m_buffersHeap->Allocate(requiredDataSize.BuffersByteCount);
+    file.TextureAllocations = std::move(textureAllocations);
+    if (buffers.SharedBuffer)
+        m_setBufferUsed = buffers.SharedBufferOffset + requiredDataSize.BuffersByteCount;
+    else
+        file.BuffersAllocation = buffers.Allocation;
 
+    if (descriptors)
+    {
+        uint32_t descriptorSize = Renderer::s_TextureHeap.GetDescriptorSize();
+
+        file.DescriptorBlock = descriptors->Block;
+        file.TextureHandles = m_descriptorPool + static_cast<INT>(descriptors->Offset * descriptorSize);
+        if (spareHandles)
+            file.SpareTextureHandles = file.TextureHandles + static_cast<INT>(numHandles * descriptorSize);
+    }
+
+    // Files come and go individually when loading continuously, so the arena,
+    // which is only reset between sets, isn't used.
+    MemoryArena* cpuDataArena = m_state == State::Continuous ? nullptr : &m_cpuDataArena;
+
+    // The store's textures are loaded whole, as other files may need the mips
+    // that this one doesn't
+    file.MarcFile->SetMipStreaming(StreamMips && !file.IsTextureStore, file.SpareTextureHandles);
+    file.MarcFile->SetTextureStore(file.HoldsTextureStore ? m_files[file.TextureStore].MarcFile.get() : nullptr);
     file.MarcFile->StartContentLoad(
-        textureAllocations,
-        textureHandles,
-        buffersAllocation);
+        file.TextureAllocations,
+        file.TextureHandles,
+        buffers,
+        scheduler,
+        cpuDataArena);
 
+    file.ContentPending = true;
+    ++m_numPendingContent;
+    m_fileStates.SetState(file.Id, FileState::Loading);
+
+    AccumulateDataSize(requiredDataSize, storeSize);
     return requiredDataSize;
 }
 
+//
+// Commits the CPU data arena for every file in the set at once, rather than as
+// each file's CPU data is allocated.  Files that don't fit in the heaps are
+// loaded later in the set, and are counted too.
+//
+void MarcFileManager::PrecommitCpuData(std::vector<FileId> const& ids)
+{
+    uint64_t size = 0;
+    for (auto id : ids)
+    {
+        auto const& marcFile = m_files[id].MarcFile;
+        if (marcFile->GetState() != MarcFile::State::ReadyToLoadContent)
+            continue;
+
+        // The arena's default alignment
+        size = Math::AlignUp(size, 16);
+        size += marcFile->GetRequiredDataSize().CpuByteCount;
+    }
+
+    m_cpuDataArena.Precommit(size, LargePageCpuData);
+}
+
+//
+// Creates a buffer that is large enough for the unstructured GPU data of all
+// the files in the set, or as large as the heap allows.  The files are loaded
+// into consecutive ranges of it, so one resource replaces a buffer per file.
+// The space used by a file is only reclaimed when the set is unloaded.
+//
+void MarcFileManager::CreateSetBuffer(std::vector<FileId> const& ids)
+{
+    uint64_t size = 0;
+    for (auto id : ids)
+    {
+        auto const& marcFile = m_files[id].MarcFile;
+        if (marcFile->GetState() != MarcFile::State::ReadyToLoadContent)
+            continue;
+
+        size = Math::AlignUp(size, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+        size += marcFile->GetRequiredDataSize().BuffersByteCount;
+    }
+
+    size = std::min<uint64_t>(size, D3D12_REQ_RESOURCE_SIZE_IN_MEGABYTES_EXPRESSION_C_TERM * 1024ull * 1024ull);
+
+    // Halve the size until both the allocation and the resource succeed
+    for (; size >= D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT; size /= 2)
+    {
+        m_buffersHeap->BeginReservation();
+        auto allocation = m_buffersHeap->Reserve(size);
+        if (!allocation)
+        {
+            m_buffersHeap->Rollback();
+            continue;
+        }
+
+        D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(size);
+        HRESULT hr = Graphics::g_Device->CreatePlacedResource(
+            allocation->Heap.Get(),
+            allocation->Offset,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(&m_setBuffer));
+        if (FAILED(hr))
+        {
+            m_buffersHeap->Rollback();
+            continue;
+        }
+
+        m_buffersHeap->Commit();
+        m_setBufferAllocation = std::move(*allocation);
+        m_setBufferSize = size;
+        m_setBufferUsed = 0;
+        return;
+    }
+}
+
+bool MarcFileManager::TryLoadFile(FileId id)
+{
+    assert(m_state != State::LoadingMetadata);
+
+    File& file = m_files[id];
+
+    RequestScheduler scheduler;
+    bool outOfSpace = false;
+    TryStartLoad(file, scheduler, outOfSpace);
+    scheduler.Flush();
+
+    auto state = file.MarcFile->GetState();
+    return state == MarcFile::State::ContentLoading || state == MarcFile::State::ContentLoaded;
+}
+
+void MarcFileManager::UnloadFile(FileId id, uint64_t releaseFence)
+{
+    File& file = m_files[id];
+    assert(!file.Cancelling);
+
+    // A store is unloaded along with the last file that holds it
+    if (file.IsTextureStore)
+        return;
+
+    UnloadContent(file, releaseFence);
+    ReleaseTextureStore(file, releaseFence);
+}
+
+void MarcFileManager::UnloadContent(File& file, uint64_t releaseFence)
+{
+    // The release just holds the resources until the fence completes
+    m_deferredReleases.Push(releaseFence, [resources = file.MarcFile->UnloadContent()] {});
+
+    FreeAllocations(file, releaseFence);
+    file.ScreenSize = 0.0f;
+    m_fileStates.SetState(file.Id, FileState::Unloaded);
+}
+
+bool MarcFileManager::CancelFile(FileId id)
+{
+    File& file = m_files[id];
+
+    if (!file.ContentPending || !file.MarcFile->CancelContentLoad())
+        return false;
+
+    file.Cancelling = true;
+    return true;
+}
+
+//
+// A file that shares textures names its store once its metadata has loaded.
+// The store is added if no other file has added it yet, and its metadata loads
+// along with everything else's.
+//
+void MarcFileManager::ResolveTextureStore(FileId id)
+{
+    if (m_files[id].MarcFile->IsTextureStore())
+    {
+        m_files[id].IsTextureStore = true;
+        return;
+    }
+
+    std::string storeName = m_files[id].MarcFile->GetTextureStoreName();
+    if (storeName.empty())
+        return;
+
+    std::filesystem::path storePath = std::filesystem::path(m_files[id].Filename).parent_path() / storeName;
+    std::wstring storeFilename = storePath.lexically_normal().wstring();
+
+    FileId storeId = m_fileStates.Find(storeFilename);
+    if (storeId == FileStateTable::NoFile)
+        storeId = Add(storeFilename);
+
+    m_files[id].TextureStore = storeId;
+}
+
+//
+// Called as a file that shares textures starts loading.  The first file to
+// hold the store starts its content load through the same scheduler, and its
+// size is returned in size.  Returns false if the file can't load yet; a store
+// that doesn't fit, or that's still finishing a cancelled load, sets outOfSpace
+// so that the file is tried again later.
+//
+bool MarcFileManager::AcquireTextureStore(
+    File& file,
+    RequestScheduler& scheduler,
+    bool& outOfSpace,
+    MarcFile::DataSize& size)
+{
+    File& store = m_files[file.TextureStore];
+    if (!store.IsTextureStore)
+        return false;
+
+    if (store.Cancelling)
+    {
+        outOfSpace = true;
+        return false;
+    }
+
+    ++store.TextureStoreRefs;
+
+    auto state = store.MarcFile->GetState();
+    if (state == MarcFile::State::ReadyToLoadContent)
+    {
+        store.MarcFile->SetExpectedScreenSize(file.ExpectedScreenSize);
+        size = TryStartLoad(store, scheduler, outOfSpace);
+        state = store.MarcFile->GetState();
+    }
+
+    if (state != MarcFile::State::ContentLoading && state != MarcFile::State::ContentLoaded)
+    {
+        --store.TextureStoreRefs;
+        return false;
+    }
+
+    file.HoldsTextureStore = true;
+    return true;
+}
+
+//
+// The store is unloaded, or its load cancelled, once nothing holds it.
+//
+void MarcFileManager::ReleaseTextureStore(File& file, uint64_t releaseFence)
+{
+    if (!file.HoldsTextureStore)
+        return;
+
+    file.HoldsTextureStore = false;
+
+    File& store = m_files[file.TextureStore];
+    assert(store.TextureStoreRefs > 0);
+    if (--store.TextureStoreRefs > 0)
+        return;
+
+    if (CancelFile(file.TextureStore))
+        return;
+
+    UnloadContent(store, releaseFence);
+}
+
+bool MarcFileManager::IsShowable(File const& file) const
+{
+    if (file.IsTextureStore || file.MarcFile->GetState() != MarcFile::State::ContentLoaded)
+        return false;
+
+    if (file.TextureStore == NoTextureStore)
+        return true;
+
+    return m_files[file.TextureStore].MarcFile->GetState() == MarcFile::State::ContentLoaded;
+}
+
+void MarcFileManager::CancelSet()
+{
+    assert(m_state == State::Loading || m_state == State::Continuous);
+
+    for (FileId id : m_fileStates.GetFiles(FileState::Loading))
+    {
+        // Stores are cancelled once the files holding them have been
+        if (m_files[id].IsTextureStore)
+            continue;
+
+        if (CancelFile(id))
+            m_deferredFiles.push_back(id);
+    }
+
+    m_state = State::Cancelling;
+}
+
+void MarcFileManager::StartContinuousLoading()
+{
+    assert(m_state == State::ReadyToLoad);
+
+    ResizeHeapsToBudget();
+
+    m_deferredFiles.clear();
+    m_newlyLoadedFiles.clear();
+    m_currentSetSize = MarcFile::DataSize{};
+    m_numLoadedModels = 0;
+    m_startLoadTime = std::chrono::high_resolution_clock::now();
+
+    m_state = State::Continuous;
+}
+
+//
+// The files that have left are only recorded here; UpdateContinuousLoading
+// cancels or unloads them as needed.  The fence taken for a departing file
+// covers every frame submitted so far, which is the last that may render it.
+//
+void MarcFileManager::SetTargetFiles(std::vector<FileId> const& ids)
+{
+    assert(m_state == State::Continuous);
+
+    for (FileId id : ids)
+        m_files[id].Targeted = false;
+
+    uint64_t releaseFence = 0;
+    for (FileId id : m_targetFiles)
+    {
+        File& file = m_files[id];
+        if (!file.Targeted)
+        {
+            // Still in the new target set
+            file.Targeted = true;
+            continue;
+        }
+
+        file.Targeted = false;
+
+        if (CancelFile(id))
+            continue;
+
+        // Stores stay loaded for the files that hold them
+        if (file.MarcFile->GetState() == MarcFile::State::ContentLoaded && !file.IsTextureStore)
+        {
+            if (releaseFence == 0)
+                releaseFence = Graphics::g_CommandManager.GetGraphicsQueue().IncrementFence();
+
+            file.ReleaseFence = releaseFence;
+            m_fileStates.SetState(id, FileState::Departed);
+        }
+    }
+
+    // Files in both sets were set back to true above.  The rest of the new
+    // set is newly targeted, and may be coming back before it was unloaded.
+    for (FileId id : ids)
+    {
+        File& file = m_files[id];
+        if (file.Targeted)
+            continue;
+
+        file.Targeted = true;
+        if (m_fileStates.GetState(id) == FileState::Departed)
+            m_fileStates.SetState(id, FileState::Loaded);
+    }
+
+    m_targetFiles = ids;
+}
+
+void MarcFileManager::UpdateContinuousLoading()
+{
+    size_t const maxLoadsInFlight = static_cast<int32_t>(ContinuousLoadsInFlight);
+
+    RequestScheduler scheduler;
+
+    for (FileId id : m_targetFiles)
+    {
+        if (m_numPendingContent >= maxLoadsInFlight)
+            break;
+
+        File& file = m_files[id];
+        if (file.Cancelling || file.MarcFile->GetState() != MarcFile::State::ReadyToLoadContent)
+            continue;
+
+        // Make room by unloading departed files until the file fits
+        bool outOfSpace;
+        do
+        {
+            outOfSpace = false;
+            TryStartLoad(file, scheduler, outOfSpace);
+        } while (outOfSpace && UnloadDepartedFile());
+
+        // The target files are in priority order, so the rest wait until
+        // there's room for this one.
+        if (outOfSpace)
+            break;
+    }
+
+    scheduler.Flush();
+}
+
+//
+// Unloads the least recently targeted departed file, if the GPU has finished
+// with it.  Returns false if there's no file that can be unloaded yet.
+//
+bool MarcFileManager::UnloadDepartedFile()
+{
+    FileId id = m_fileStates.GetFirst(FileState::Departed);
+    if (id == FileStateTable::NoFile)
+        return false;
+
+    if (!Graphics::g_CommandManager.GetGraphicsQueue().IsFenceComplete(m_files[id].ReleaseFence))
+        return false;
+
+    // The fence has completed, so the file's space is free again straight away
+    UnloadFile(id, m_files[id].ReleaseFence);
+    return true;
+}
+
+//
+// The file's ranges are taken from it now, so that it can be loaded again, but
+// they're only returned to the heaps and the descriptor pool once the fence
+// has completed; until then the GPU may still be reading what's in them.
+//
+void MarcFileManager::FreeAllocations(File& file, uint64_t releaseFence)
+{
+    m_deferredReleases.Push(
+        releaseFence,
+        [this,
+         textureAllocations = std::move(file.TextureAllocations),
+         buffersAllocation = std::move(file.BuffersAllocation),
+         descriptorBlock = file.DescriptorBlock]
+        {
+            m_texturesHeap->Free(textureAllocations);
+
+            if (buffersAllocation)
+                m_buffersHeap->Free(*buffersAllocation);
+
+            if (descriptorBlock != TlsfAllocator::InvalidBlock)
+                m_descriptorAllocator.Free(descriptorBlock);
+        });
+
+    file.TextureAllocations.clear();
+    file.BuffersAllocation.reset();
+    file.DescriptorBlock = TlsfAllocator::InvalidBlock;
+    file.TextureHandles = DescriptorHandle();
+    file.SpareTextureHandles = DescriptorHandle();
+}
+
+//
+// Each relocation allocates new space before the old space is freed, so a
+// single pass won't always close every gap; calling this again continues
+// where the last pass left off.
+//
+void MarcFileManager::Defragment()
+{
+    assert(m_state == State::Loaded || m_state == State::ReadyToLoad);
+
+    struct Entry
+    {
+        File* Owner;
+        uint32_t TextureIndex; // or Buffers
+        MultiHeapAllocation* Allocation;
+        uint64_t SizeInBytes;
+        uint64_t Alignment;
+    };
+    constexpr uint32_t Buffers = ~0u;
+
+    std::vector<Entry> textureEntries;
+    std::vector<Entry> bufferEntries;
+
+    for (FileId id : GetFilesHoldingMemory())
+    {
+        // The descriptors of the files that share a store's textures would
+        // have to be rewritten too, so stores aren't moved
+        File& file = m_files[id];
+        if (file.IsTextureStore || file.MarcFile->GetState() != MarcFile::State::ContentLoaded)
+            continue;
+
+        file.MarcFile->WaitForStreamedMips();
+
+        auto const& allocationInfos = file.MarcFile->GetTextureAllocationInfos();
+        for (uint32_t i = 0; i < file.TextureAllocations.size(); ++i)
+        {
+            if (!file.TextureAllocations[i].Heap)
+                continue;
+
+            textureEntries.push_back(
+                {&file, i, &file.TextureAllocations[i], allocationInfos[i].SizeInBytes, allocationInfos[i].Alignment});
+        }
+
+        // Files in the shared set buffer don't have a buffer of their own to move
+        if (!file.BuffersAllocation)
+            continue;
+
+        auto buffersByteCount = file.MarcFile->GetRequiredDataSize().BuffersByteCount;
+        bufferEntries.push_back(
+            {&file, Buffers, &*file.BuffersAllocation, buffersByteCount, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT});
+    }
+
+    CommandContext& context = CommandContext::Begin(L"Defragment");
+
+    std::vector<ComPtr<ID3D12Resource>> oldResources;
+    std::vector<MultiHeapAllocation> oldTextureAllocations;
+    std::vector<MultiHeapAllocation> oldBufferAllocations;
+    std::vector<File*> relocatedFiles;
+
+    auto relocate = [&](MultiHeap& heap, std::vector<Entry>& entries, std::vector<MultiHeapAllocation>& oldAllocations)
+    {
+        // Move the allocations furthest into the heaps first
+        std::sort(
+            entries.begin(),
+            entries.end(),
+            [](Entry const& a, Entry const& b)
+            {
+                if (a.Allocation->HeapIndex != b.Allocation->HeapIndex)
+                    return a.Allocation->HeapIndex > b.Allocation->HeapIndex;
+                return a.Allocation->Offset > b.Allocation->Offset;
+            });
+
+        for (auto& entry : entries)
+        {
+            auto newAllocation = heap.TryRelocate(*entry.Allocation, entry.SizeInBytes, entry.Alignment);
+            if (!newAllocation)
+                continue;
+
+            if (entry.TextureIndex == Buffers)
+                oldResources.push_back(entry.Owner->MarcFile->RelocateBuffer(*newAllocation, context));
+            else
+                oldResources.push_back(
+                    entry.Owner->MarcFile->RelocateTexture(entry.TextureIndex, *newAllocation, context));
+
+            oldAllocations.push_back(*entry.Allocation);
+            *entry.Allocation = *newAllocation;
+
+            if (std::find(relocatedFiles.begin(), relocatedFiles.end(), entry.Owner) == relocatedFiles.end())
+                relocatedFiles.push_back(entry.Owner);
+        }
+    };
+
+    relocate(*m_texturesHeap, textureEntries, oldTextureAllocations);
+    relocate(*m_buffersHeap, bufferEntries, oldBufferAllocations);
+
+    // Rendering happens on the same queue, so once this has completed nothing
+    // is using the old resources or descriptors.
+    context.Finish(true);
+
+    for (File* file : relocatedFiles)
+        file->MarcFile->CompleteRelocation();
+
+    oldResources.clear();
+    m_texturesHeap->Free(oldTextureAllocations);
+    m_buffersHeap->Free(oldBufferAllocations);
+}
+
 bool MarcFileManager::IsReadyToLoad() const
 {
-    return m_state == State::ReadyToLoad;
+    return m_state == State::ReadyToLoad && m_deferredReleases.IsEmpty();
 }
 
 bool MarcFileManager::IsLoading() const
@@ -249,11 +1423,66 @@ bool MarcFileManager::IsLoading() const
     return m_state == State::Loading;
 }
 
+bool MarcFileManager::IsLoadingContinuously() const
+{
+    return m_state == State::Continuous;
+}
+
+bool MarcFileManager::IsCancelling() const
+{
+    return m_state == State::Cancelling;
+}
+
 bool MarcFileManager::SetIsLoaded() const
 {
     return m_state == State::Loaded;
 }
 
+std::vector<MarcFileManager::FileId> const& MarcFileManager::GetDeferredFiles() const
+{
+    return m_deferredFiles;
+}
+
+//
+// Files that are still prefetched from an earlier call count towards the
+// budget, so each call only starts the prefetches the last one didn't get to.
+//
+void MarcFileManager::PrefetchFiles(std::vector<FileId> const& ids)
+{
+    for (FileId id : m_prefetchedFiles)
+    {
+        if (std::find(ids.begin(), ids.end(), id) == ids.end())
+            m_files[id].MarcFile->DiscardPrefetch();
+    }
+    m_prefetchedFiles.clear();
+
+    size_t const budget = static_cast<size_t>(static_cast<int32_t>(PrefetchBudgetMiB)) * 1024 * 1024;
+    size_t used = 0;
+    for (FileId id : ids)
+    {
+        MarcFile& marcFile = *m_files[id].MarcFile;
+        size_t size = marcFile.GetPrefetchSize();
+
+        if (size == 0)
+        {
+            if (used >= budget || marcFile.GetState() != MarcFile::State::ReadyToLoadContent)
+                continue;
+            size = marcFile.StartPrefetch();
+        }
+        else if (used >= budget)
+        {
+            marcFile.DiscardPrefetch();
+            continue;
+        }
+
+        if (size > 0)
+        {
+            used += size;
+            m_prefetchedFiles.push_back(id);
+        }
+    }
+}
+
 MarcFileManager::LoadedDataSize MarcFileManager::GetCurrentSetSize() const
 {
     LoadedDataSize s = {m_currentSetSize, m_numLoadedModels};
@@ -269,3 +1498,11 @@ MarcFileManager::float_seconds MarcFileManager::GetTimeSinceLoad() const
 {
     return std::chrono::high_resolution_clock::now() - m_startLoadTime;
 }
+
+MarcFileManager::HeapUsage MarcFileManager::GetHeapUsage() const
+{
+    if (!m_texturesHeap)
+        return {};
+
+    return {m_texturesHeap->GetUsedSize(), m_buffersHeap->GetUsedSize()};
+}
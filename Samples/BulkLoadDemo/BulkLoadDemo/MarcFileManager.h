@@ -9,53 +9,184 @@
 
 #pragma once
 
+#include "CompletionFences.h"
+#include "DeferredReleaseQueue.h"
 #include "EventWait.h"
+#include "EventWaitPool.h"
+#include "FileStateTable.h"
 #include "MultiHeap.h"
 #include "MarcFile.h"
+#include "MetadataCache.h"
+#include "StatusArrayPool.h"
+#include "SubmitBatcher.h"
+#include "TlsfAllocator.h"
 
+#include <Camera.h>
 #include <Model.h>
 
+#include <atomic>
 #include <chrono>
+#include <optional>
 
 //
 // MarcFileManager keeps track of MarcFiles.
 //
 // It manages a single D3D12 heap that the MarcFiles use for storing their GPU
-// data as well as a range of GPU descriptors.
+// data as well as a pool of GPU descriptors, that loaded files are given
+// ranges of.
 //
-// Sets of MarcFiles can be loaded or unloaded.
+// Texture stores, which hold the textures shared by files archived together,
+// are loaded along with the first file that uses them and unloaded with the
+// last, so each shared texture is only loaded once.  They aren't part of a
+// set themselves.
+//
+// Sets of MarcFiles can be loaded or unloaded, as can individual files.
+// Alternatively, in continuous loading mode the caller updates a target set as
+// it goes and the manager loads and unloads files to follow it.
 //
 
 class MarcFileManager
 {
+public:
+    using FileId = size_t;
+
+private:
+    static constexpr FileId NoTextureStore = ~FileId(0);
+
     struct File
     {
+        FileId Id = 0;
         std::wstring Filename;
         std::unique_ptr<MarcFile> MarcFile;
+
+        // Each file has its own range of descriptors, so that it can be loaded
+        // and unloaded independently of the others.  The range is allocated
+        // from the pool when the content starts loading and freed when it's
+        // unloaded.
+        TlsfAllocator::BlockId DescriptorBlock = TlsfAllocator::InvalidBlock;
+        DescriptorHandle TextureHandles;
+        DescriptorHandle SpareTextureHandles; // used for mip streaming
+
+        // Set by SetExpectedPlacement; a store is given the size of the file
+        // that starts its load
+        float ExpectedScreenSize = 0.0f;
+
+        // The size on screen RequestMips was last given, once the file's model
+        // is shown.  Used for the residency priority of the file's memory.
+        float ScreenSize = 0.0f;
+
+        // Valid while the file's content is loaded
+        std::vector<MultiHeapAllocation> TextureAllocations;
+        std::optional<MultiHeapAllocation> BuffersAllocation;
+
+        // Whether the file is counted in m_numPendingMetadata /
+        // m_numPendingContent
+        bool MetadataPending = false;
+        bool ContentPending = false;
+
+        // Set while a cancelled content load finishes.  Its allocations are
+        // freed once the file is ready to load again.
+        bool Cancelling = false;
+
+        // Continuous loading: whether the file is in the target set, and, once
+        // it has left, the graphics queue fence after which it may be unloaded
+        bool Targeted = false;
+        uint64_t ReleaseFence = 0;
+
+        // A store counts the loaded files that hold it.  A file that shares
+        // textures holds its store while its content is loading or loaded.
+        bool IsTextureStore = false;
+        uint32_t TextureStoreRefs = 0;
+        FileId TextureStore = NoTextureStore;
+        bool HoldsTextureStore = false;
     };
 
+    // m_completionFences is used by the files added while FenceCompletions is
+    // set.  These are declared before m_files, since the files use them until
+    // they're destroyed.
+    std::unique_ptr<CompletionFences> m_completionFences;
+    EventWaitPool m_eventWaitPool;
+    SubmitBatcher m_submitBatcher;
+    StatusArrayPool m_statusArrayPool;
+
     std::vector<File> m_files;
 
+    // Which files are loading, loaded and so on, so that those can be gone
+    // through without looking at every file.  It also finds the first file
+    // added with each filename, so that the files that name a texture store
+    // can find it, or add it if they're the first.
+    FileStateTable m_fileStates;
+
+    // Files push their ids here from their callbacks, so that Update only has
+    // to look at the files whose state has changed.
+    CompletionQueue m_completionQueue;
+    size_t m_numPendingMetadata = 0;
+    size_t m_numPendingContent = 0;
+    std::vector<size_t> m_pendingMipUpdates;
+    std::vector<size_t> m_newlyLoadedFiles;
+
+    // Files whose metadata is in the cache don't have to load it.  Metadata
+    // loaded from the files is added to the cache, which is saved once all
+    // the files' metadata is ready.
+    std::unique_ptr<MetadataCache> m_metadataCache;
+
+    Microsoft::WRL::ComPtr<IDXGIAdapter3> m_dxgiAdapter;
     std::unique_ptr<MultiHeap> m_texturesHeap;
     std::unique_ptr<MultiHeap> m_buffersHeap;
+    bool m_heapsEvicted = false;
+
+    // Renderer::s_TextureHeap can't free descriptors, so the pool is taken
+    // from it once and the files' ranges are sub-allocated from that.
+    DescriptorHandle m_descriptorPool;
+    TlsfAllocator m_descriptorAllocator;
+
+    // The CPU data of the files in a set is loaded into this, and it's reset
+    // by UnloadSet.  Files unloaded individually don't give their space back
+    // until then.  The capacity is only reserved address space.
+    static constexpr uint64_t CpuDataArenaCapacity = 64ull * 1024 * 1024 * 1024;
+    MemoryArena m_cpuDataArena{CpuDataArenaCapacity};
+
+    // Used while SharedSetBuffer is set
+    ComPtr<ID3D12Resource> m_setBuffer;
+    MultiHeapAllocation m_setBufferAllocation;
+    uint64_t m_setBufferSize = 0;
+    uint64_t m_setBufferUsed = 0;
 
-    DescriptorHandle m_baseTextureHandle;
-    uint32_t m_nextDescriptorHandleIndex = 0;
+    // Unloaded files' resources, and the heap and descriptor ranges they were
+    // in, wait here for the frames that may still be using them.  Declared
+    // after the heaps and allocators, since its releases free into them.
+    DeferredReleaseQueue m_deferredReleases;
 
     enum class State
     {
         LoadingMetadata,
         ReadyToLoad,
         Loading,
+        Cancelling,
         Loaded,
+        Continuous,
     };
 
     State m_state = State::LoadingMetadata;
 
     MarcFile::DataSize m_currentSetSize{};
     size_t m_numLoadedModels;
+    std::vector<size_t> m_deferredFiles;
 
-    EventWait m_loadComplete;
+    // Continuous loading.  Departed files are loaded files that have left the
+    // target set, which m_fileStates keeps oldest first; they stay loaded
+    // until their memory is needed.
+    std::vector<size_t> m_targetFiles;
+
+    // Files whose prefetches were started by PrefetchFiles
+    std::vector<size_t> m_prefetchedFiles;
+
+    // The set's GPU data is spread over the GPU queues of every priority, both
+    // those reading from files and, for prefetched data, those reading from
+    // memory, so the load is complete once each of them has signaled.
+    static constexpr uint32_t NumLoadQueues = DSTORAGE_PRIORITY_COUNT * 2;
+    EventWait m_loadComplete[NumLoadQueues];
+    std::atomic<uint32_t> m_numPendingQueues;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> m_startLoadTime;
     std::chrono::microseconds m_loadTime;
@@ -64,18 +195,127 @@ public:
     MarcFileManager();
     ~MarcFileManager();
 
-    using FileId = size_t;
-
     FileId Add(std::wstring const& filename);
+
+    // Adds every file in a bundle made by MiniArchive -bundle, which are all
+    // read through the one IDStorageFile.  Returns no ids if the bundle can't
+    // be read.
+    std::vector<FileId> AddBundle(std::wstring const& filename);
+
+    // Between BeginBatch and EndBatch the files' queue submits are deferred,
+    // so that adding many files submits each queue a few times rather than
+    // once or twice per file.  The deferred submits are made by EndBatch, or
+    // earlier once enough have built up.
+    void BeginBatch();
+    void EndBatch();
+
+    // Texture stores that were added directly, for example by scanning a
+    // directory, can be told apart once IsReadyToLoad.  They're loaded for
+    // the files that share their textures, never on their own.
+    bool IsTextureStore(FileId id) const;
+
+    // Loads as many of the files as fit in the current memory budget.  The
+    // files that didn't fit are returned by GetDeferredFiles.
     void SetNextSet(std::vector<FileId> const& ids);
-    std::vector<ModelInstance> CreateInstancesForSet();
+    std::vector<FileId> const& GetDeferredFiles() const;
+
+    // Reads the CPU data and least detailed mips of the files that are
+    // expected to be loaded next into system memory, in order, until the
+    // prefetch budget is used, so that their loads don't have to wait for the
+    // disk.  Takes system memory and bandwidth only; nothing is allocated from
+    // the heaps.  Prefetches of files that are no longer in the list are
+    // discarded.
+    void PrefetchFiles(std::vector<FileId> const& ids);
+    // The models of the set, for creating their instances.  The models are
+    // shared, so the instances can be created on another thread.
+    std::vector<std::shared_ptr<const Model>> GetModelsForSet();
+    // For showing the models of a set as they load: returns the files that
+    // have finished loading their content since the last call.  Files whose
+    // texture store is still loading are returned once it has loaded.
+    std::vector<FileId> TakeNewlyLoadedFiles();
+    ModelInstance CreateInstance(FileId id);
+    // The files of the models returned by GetModelsForSet, in the
+    // same order.
+    std::vector<FileId> GetFilesForSet() const;
+
+    // Unloads the set without waiting for the GPU to finish the frames that
+    // drew it.  Its memory is released as the GPU catches up, and the next
+    // set can be loaded once IsReadyToLoad returns true.
     void UnloadSet();
 
+    // When mip streaming is enabled, this loads the detail that file's model
+    // needs to be shown at the given size on screen, in pixels.
+    void RequestMips(FileId id, float pixelsAcross);
+
+    // Estimates how many pixels across a model within the sphere is on screen
+    // when seen from the camera.
+    static float EstimateScreenSize(Math::BoundingSphere const& sphere, Math::Camera const& camera);
+
+    // The bounding sphere of the file's model, in model space, from the
+    // file's header.  Available once the metadata is ready.
+    Math::BoundingSphere GetBoundingSphere(FileId id) const;
+
+    // Says where the file's model will be placed, and the camera it will be
+    // seen from, while its content loads.  The projected size of the model's
+    // bounding sphere decides which of its detailed mips are read ahead of
+    // the rest: everything's low resolution mips are read first, then the
+    // detailed mips each model needs at its size on screen, and only then the
+    // finer ones.  Takes effect for the loads started after it is called.
+    void SetExpectedPlacement(FileId id, Math::UniformTransform const& locator, Math::Camera const& camera);
+
+    // Starts loading a single file, alongside whatever is already loaded.
+    // Returns false if there isn't room for it.
+    bool TryLoadFile(FileId id);
+
+    // Unloads a single file.  Its resources and memory are released once the
+    // graphics queue has passed releaseFence, which must cover every frame
+    // that rendered it.
+    void UnloadFile(FileId id, uint64_t releaseFence);
+
+    // Cancels the content load of a file that is still loading, and frees its
+    // memory once the requests DirectStorage had already started complete.
+    // Returns false if the file wasn't loading.
+    bool CancelFile(FileId id);
+
+    // Cancels the files of the current set that are still loading, and
+    // defers them so that they come first in the next set.  The set counts as
+    // loaded, with just the files that had finished, once the cancelled loads
+    // have completed; until then IsCancelling returns true.
+    void CancelSet();
+
+    // Instead of loading discrete sets, continuous loading keeps the loaded
+    // files following a target set that the caller updates as it goes.  Each
+    // Update starts loading the target files, in order, while the number of
+    // content loads in flight is below a limit.  Files that leave the target
+    // set stay loaded until space is needed for a target file, and are then
+    // unloaded least recently targeted first; files still loading when they
+    // leave are cancelled.  Once a file has left the target set the caller
+    // must not render it again until it is back in the set and loaded.
+    //
+    // Continuous loading starts from ReadyToLoad and is stopped with CancelSet
+    // followed by UnloadSet, as for a set.
+    void StartContinuousLoading();
+    void SetTargetFiles(std::vector<FileId> const& ids);
+    bool IsLoadingContinuously() const;
+
+    // The files that are loading, loaded, or, when loading continuously, have
+    // left the target set and may be evicted, in the order they got there.
+    // These only look at the files in the state, however many there are.
+    using FileState = FileStateTable::State;
+    std::vector<FileId> GetFilesInState(FileState state) const;
+    size_t GetNumFilesInState(FileState state) const;
+
+    // Moves loaded files' resources towards the start of the heaps, so that
+    // the free space left by unloading files can be used for larger
+    // allocations.  This waits for the GPU to finish the copies.
+    void Defragment();
+
     void Update();
 
     bool IsReadyToLoad() const;
     bool SetIsLoaded() const;
     bool IsLoading() const;
+    bool IsCancelling() const;
 
     struct LoadedDataSize : MarcFile::DataSize
     {
@@ -89,10 +329,44 @@ public:
     float_seconds GetLoadTime() const;
     float_seconds GetTimeSinceLoad() const;
 
+    // The bytes allocated from the textures and buffers heaps
+    struct HeapUsage
+    {
+        uint64_t TexturesByteCount;
+        uint64_t BuffersByteCount;
+    };
+    HeapUsage GetHeapUsage() const;
+
 private:
-    MarcFile::DataSize TryStartLoad(File& file);
+    FileId Add(std::wstring const& filename, std::unique_ptr<MarcFile> marcFile);
+
+    MarcFile::DataSize TryStartLoad(File& file, RequestScheduler& scheduler, bool& outOfSpace);
+
+    DXGI_QUERY_VIDEO_MEMORY_INFO QueryVideoMemoryInfo() const;
+    UINT64 GetHeapBudget() const;
+    void ResizeHeapsToBudget();
+    void CreateSetBuffer(std::vector<FileId> const& ids);
+    void PrecommitCpuData(std::vector<FileId> const& ids);
 
     void OnLoadComplete();
 
-    void AllocateDescriptors();
+    void ProcessCompletions();
+
+    void UnloadContent(File& file, uint64_t releaseFence);
+    void FreeAllocations(File& file, uint64_t releaseFence);
+
+    void ResolveTextureStore(FileId id);
+    bool AcquireTextureStore(File& file, RequestScheduler& scheduler, bool& outOfSpace, MarcFile::DataSize& size);
+    void ReleaseTextureStore(File& file, uint64_t releaseFence);
+    bool IsShowable(File const& file) const;
+
+    std::vector<FileId> GetFilesHoldingMemory() const;
+
+    void UpdateContinuousLoading();
+    bool UnloadDepartedFile();
+
+    void UpdateResidencyPriorities();
+    D3D12_RESIDENCY_PRIORITY GetResidencyPriority(File const& file) const;
+
+    void CreateDescriptorPool();
 };
\ No newline at end of file
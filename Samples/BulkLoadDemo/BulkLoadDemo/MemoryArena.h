@@ -0,0 +1,186 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <Windows.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+//
+// A bump allocator over a single reservation of virtual memory.  Pages are
+// committed as the allocations reach them, and everything is released at
+// once by Reset, which decommits the pages but keeps the reservation.
+//
+// MarcFileManager uses one of these for the CPU data of the files in a set,
+// so that thousands of small regions don't each need a heap allocation.
+//
+// Precommit commits the memory a set needs before it starts loading.  Large
+// pages can't be committed into an existing reservation, so with large pages
+// it allocates a separate block of them, which is used before the
+// reservation.  Allocations continue in the reservation once it's full.
+//
+class MemoryArena
+{
+    char* m_base = nullptr;
+    uint64_t m_capacity = 0;
+    uint64_t m_used = 0;
+    uint64_t m_committed = 0;
+
+    char* m_largePages = nullptr;
+    uint64_t m_largePagesSize = 0;
+    uint64_t m_largePagesUsed = 0;
+
+public:
+    // Memory is committed in steps of this size
+    static constexpr uint64_t CommitGranularity = 2 * 1024 * 1024;
+
+    explicit MemoryArena(uint64_t capacity)
+        : m_capacity(capacity)
+    {
+        m_base = static_cast<char*>(VirtualAlloc(nullptr, m_capacity, MEM_RESERVE, PAGE_READWRITE));
+        if (!m_base)
+            std::abort();
+    }
+
+    ~MemoryArena()
+    {
+        if (m_largePages)
+            VirtualFree(m_largePages, 0, MEM_RELEASE);
+        VirtualFree(m_base, 0, MEM_RELEASE);
+    }
+
+    MemoryArena(MemoryArena const&) = delete;
+    MemoryArena& operator=(MemoryArena const&) = delete;
+
+    // Returns nullptr if the arena is full, or the memory can't be committed.
+    char* Allocate(uint64_t size, uint64_t alignment = 16)
+    {
+        if (m_largePages)
+        {
+            uint64_t offset = (m_largePagesUsed + alignment - 1) & ~(alignment - 1);
+            if (offset + size <= m_largePagesSize)
+            {
+                m_largePagesUsed = offset + size;
+                return m_largePages + offset;
+            }
+        }
+
+        uint64_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+        if (offset + size > m_capacity)
+            return nullptr;
+
+        if (offset + size > m_committed)
+        {
+            uint64_t newCommitted = (offset + size + CommitGranularity - 1) & ~(CommitGranularity - 1);
+            if (newCommitted > m_capacity)
+                newCommitted = m_capacity;
+
+            if (!VirtualAlloc(m_base + m_committed, newCommitted - m_committed, MEM_COMMIT, PAGE_READWRITE))
+                return nullptr;
+
+            m_committed = newCommitted;
+        }
+
+        m_used = offset + size;
+        return m_base + offset;
+    }
+
+    //
+    // Commits size bytes up front, so that allocations up to that size don't
+    // commit anything as they go.  With useLargePages they come from large
+    // pages if they're available, which the OS never pages out and which take
+    // far fewer TLB entries; otherwise the reservation is committed as usual.
+    // Returns whether large pages were used.  The arena must be empty.
+    //
+    bool Precommit(uint64_t size, bool useLargePages)
+    {
+        if (m_used > 0 || m_largePages || size == 0)
+            return false;
+
+        if (useLargePages && EnableLargePages())
+        {
+            uint64_t const largePageSize = GetLargePageMinimum();
+            uint64_t const largePagesSize = (size + largePageSize - 1) & ~(largePageSize - 1);
+
+            // This fails if the OS can't find enough contiguous physical
+            // memory, in which case it's committed the usual way
+            m_largePages = static_cast<char*>(VirtualAlloc(
+                nullptr,
+                largePagesSize,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                PAGE_READWRITE));
+            if (m_largePages)
+            {
+                m_largePagesSize = largePagesSize;
+                return true;
+            }
+        }
+
+        uint64_t const committed = std::min((size + CommitGranularity - 1) & ~(CommitGranularity - 1), m_capacity);
+        if (committed > m_committed && VirtualAlloc(m_base, committed, MEM_COMMIT, PAGE_READWRITE))
+            m_committed = committed;
+
+        return false;
+    }
+
+    // Everything allocated from the arena must no longer be in use.  The
+    // large pages are released rather than kept for the next set, like the
+    // rest of the committed memory.
+    void Reset()
+    {
+        if (m_committed > 0)
+            VirtualFree(m_base, m_committed, MEM_DECOMMIT);
+
+        if (m_largePages)
+            VirtualFree(m_largePages, 0, MEM_RELEASE);
+
+        m_used = 0;
+        m_committed = 0;
+        m_largePages = nullptr;
+        m_largePagesSize = 0;
+        m_largePagesUsed = 0;
+    }
+
+private:
+    //
+    // Large pages need SeLockMemoryPrivilege, which the user has to have been
+    // granted (the "Lock pages in memory" policy), and which then has to be
+    // enabled in the process's token.  This is only tried once.
+    //
+    static bool EnableLargePages()
+    {
+        static bool const enabled = []()
+        {
+            if (GetLargePageMinimum() == 0)
+                return false;
+
+            HANDLE token = nullptr;
+            if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+                return false;
+
+            TOKEN_PRIVILEGES privileges{};
+            privileges.PrivilegeCount = 1;
+            privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+            // AdjustTokenPrivileges succeeds without enabling a privilege
+            // the token doesn't hold, so GetLastError says whether it did
+            bool const adjusted = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+                                  AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+                                  GetLastError() == ERROR_SUCCESS;
+
+            CloseHandle(token);
+            return adjusted;
+        }();
+
+        return enabled;
+    }
+};
@@ -12,38 +12,47 @@
 #include <memory>
 
 //
-// This corresponds to a marc::Region that owns the memory it is loaded to.
+// This corresponds to a marc::Region that owns the memory it is loaded to, or
+// that has been loaded into memory owned by someone else (eg a MemoryArena).
 //
 template<typename T>
 class MemoryRegion
 {
     std::unique_ptr<char[]> m_buffer;
+    char* m_data = nullptr;
 
 public:
     MemoryRegion() = default;
 
     MemoryRegion(std::unique_ptr<char[]> buffer)
         : m_buffer(std::move(buffer))
+        , m_data(m_buffer.get())
+    {
+    }
+
+    // The memory must outlive the region
+    explicit MemoryRegion(char* unownedData)
+        : m_data(unownedData)
     {
     }
 
     char* Data()
     {
-        return m_buffer.get();
+        return m_data;
     }
 
     T* Get()
     {
-        return reinterpret_cast<T*>(m_buffer.get());
+        return reinterpret_cast<T*>(m_data);
     }
 
     T* operator->()
     {
-        return reinterpret_cast<T*>(m_buffer.get());
+        return reinterpret_cast<T*>(m_data);
     }
 
     T const* operator->() const
     {
-        return reinterpret_cast<T const*>(m_buffer.get());
+        return reinterpret_cast<T const*>(m_data);
     }
 };
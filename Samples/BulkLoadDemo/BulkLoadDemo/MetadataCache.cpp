@@ -0,0 +1,174 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "pch.h"
+
+#include "MetadataCache.h"
+
+#include <fstream>
+
+namespace
+{
+    constexpr char CacheFileId[4] = {'M', 'D', 'C', 'A'};
+    constexpr uint32_t CacheFileVersion = 1;
+
+    template<typename T>
+    void Write(std::ostream& s, T const& value)
+    {
+        s.write(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    void WriteVector(std::ostream& s, std::vector<T> const& values)
+    {
+        Write(s, static_cast<uint64_t>(values.size()));
+        s.write(reinterpret_cast<char const*>(values.data()), values.size() * sizeof(T));
+    }
+
+    template<typename T>
+    bool Read(std::istream& s, T& value)
+    {
+        s.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return s.good();
+    }
+
+    template<typename T>
+    bool ReadVector(std::istream& s, std::vector<T>& values)
+    {
+        uint64_t size;
+        if (!Read(s, size))
+            return false;
+
+        values.resize(size);
+        s.read(reinterpret_cast<char*>(values.data()), size * sizeof(T));
+        return s.good();
+    }
+}
+
+MetadataCache::MetadataCache(std::filesystem::path cachePath, IDXGIAdapter* adapter)
+    : m_cachePath(std::move(cachePath))
+{
+    if (!marc::GetAdapterId(adapter, m_adapterId))
+    {
+        // Without knowing the adapter the cache can't be trusted, so it's
+        // rebuilt from scratch
+        m_dirty = true;
+        return;
+    }
+
+    std::ifstream s(m_cachePath, std::ios::in | std::ios::binary);
+    if (!s)
+        return;
+
+    char id[4];
+    uint32_t version;
+    marc::AdapterId adapterId;
+    uint64_t numEntries;
+    if (!Read(s, id) || memcmp(id, CacheFileId, sizeof(id)) != 0 || !Read(s, version) ||
+        version != CacheFileVersion || !Read(s, adapterId) || adapterId != m_adapterId || !Read(s, numEntries))
+    {
+        Utility::Printf("Metadata cache is out of date\n");
+        return;
+    }
+
+    for (uint64_t i = 0; i < numEntries; ++i)
+    {
+        std::vector<wchar_t> path;
+        Entry entry;
+        if (!ReadVector(s, path) || !Read(s, entry.FileSize) || !Read(s, entry.LastWriteTime) ||
+            !Read(s, entry.Metadata.Header) || !ReadVector(s, entry.Metadata.CpuMetadata) ||
+            !ReadVector(s, entry.Metadata.TextureAllocationInfos) ||
+            !Read(s, entry.Metadata.OverallTextureAllocationInfo))
+        {
+            Utility::Printf("Metadata cache is truncated\n");
+            m_entries.clear();
+            return;
+        }
+
+        m_entries.emplace(std::wstring(path.begin(), path.end()), std::move(entry));
+    }
+}
+
+CachedMetadata const* MetadataCache::Find(std::filesystem::path const& path) const
+{
+    auto it = m_entries.find(path.wstring());
+    if (it == m_entries.end())
+        return nullptr;
+
+    uint64_t fileSize;
+    int64_t lastWriteTime;
+    if (!GetFileStamp(path, fileSize, lastWriteTime))
+        return nullptr;
+
+    Entry const& entry = it->second;
+    if (entry.FileSize != fileSize || entry.LastWriteTime != lastWriteTime ||
+        !marc::IsSupportedVersion(entry.Metadata.Header.Version))
+    {
+        return nullptr;
+    }
+
+    return &entry.Metadata;
+}
+
+void MetadataCache::Store(std::filesystem::path const& path, CachedMetadata metadata)
+{
+    Entry entry;
+    if (!GetFileStamp(path, entry.FileSize, entry.LastWriteTime))
+        return;
+
+    entry.Metadata = std::move(metadata);
+    m_entries.insert_or_assign(path.wstring(), std::move(entry));
+    m_dirty = true;
+}
+
+void MetadataCache::Save()
+{
+    if (!m_dirty)
+        return;
+
+    std::ofstream s(m_cachePath, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!s)
+    {
+        Utility::Printf("Unable to write metadata cache\n");
+        return;
+    }
+
+    Write(s, CacheFileId);
+    Write(s, CacheFileVersion);
+    Write(s, m_adapterId);
+    Write(s, static_cast<uint64_t>(m_entries.size()));
+
+    for (auto const& [path, entry] : m_entries)
+    {
+        WriteVector(s, std::vector<wchar_t>(path.begin(), path.end()));
+        Write(s, entry.FileSize);
+        Write(s, entry.LastWriteTime);
+        Write(s, entry.Metadata.Header);
+        WriteVector(s, entry.Metadata.CpuMetadata);
+        WriteVector(s, entry.Metadata.TextureAllocationInfos);
+        Write(s, entry.Metadata.OverallTextureAllocationInfo);
+    }
+
+    m_dirty = false;
+}
+
+bool MetadataCache::GetFileStamp(std::filesystem::path const& path, uint64_t& fileSize, int64_t& lastWriteTime)
+{
+    std::error_code ec;
+    fileSize = std::filesystem::file_size(path, ec);
+    if (ec)
+        return false;
+
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return false;
+
+    lastWriteTime = time.time_since_epoch().count();
+    return true;
+}
@@ -0,0 +1,70 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include "MarcFileFormat.h"
+
+#include <d3d12.h>
+#include <dxgi.h>
+
+#include <filesystem>
+#include <map>
+#include <vector>
+
+//
+// Everything a MarcFile computes while loading its metadata.  The CPU metadata
+// is stored as it was decompressed, before its pointers were fixed up.
+//
+struct CachedMetadata
+{
+    marc::Header Header;
+    std::vector<char> CpuMetadata;
+    std::vector<D3D12_RESOURCE_ALLOCATION_INFO1> TextureAllocationInfos;
+    D3D12_RESOURCE_ALLOCATION_INFO OverallTextureAllocationInfo;
+};
+
+//
+// MetadataCache persists the metadata of .marc files between runs, so that a
+// warm startup doesn't have to read and decompress the metadata or query the
+// device for the textures' allocation infos.
+//
+// Entries are keyed by the file's path, and are only used while the file's
+// size and last write time match.  The allocation infos depend on the adapter
+// and driver, so the whole cache is discarded if either has changed.
+//
+class MetadataCache
+{
+    struct Entry
+    {
+        uint64_t FileSize;
+        int64_t LastWriteTime;
+        CachedMetadata Metadata;
+    };
+
+    std::filesystem::path m_cachePath;
+    marc::AdapterId m_adapterId{};
+    std::map<std::wstring, Entry> m_entries;
+    bool m_dirty = false;
+
+public:
+    // Reads the cache file, if it exists and was written for this adapter.
+    MetadataCache(std::filesystem::path cachePath, IDXGIAdapter* adapter);
+
+    // Returns nullptr if there is no up to date entry for the file.
+    CachedMetadata const* Find(std::filesystem::path const& path) const;
+
+    void Store(std::filesystem::path const& path, CachedMetadata metadata);
+
+    // Writes the cache file if anything has been stored since it was read.
+    void Save();
+
+private:
+    static bool GetFileStamp(std::filesystem::path const& path, uint64_t& fileSize, int64_t& lastWriteTime);
+};
@@ -10,6 +10,7 @@
 #pragma once
 
 #include "GraphicsCore.h"
+#include "TlsfAllocator.h"
 
 #include <d3d12.h>
 #include <wrl/client.h>
@@ -27,123 +28,273 @@ struct MultiHeapAllocation
 {
     Microsoft::WRL::ComPtr<ID3D12Heap> Heap;
     uint64_t Offset = 0;
+
+    // Identifies the allocation to MultiHeap::Free
+    uint32_t HeapIndex = 0;
+    TlsfAllocator::BlockId Block = TlsfAllocator::InvalidBlock;
 };
 
 class MultiHeap
 {
     const uint64_t PerHeapAllocationSize = (4u * 1024u * 1024u * 1024u) - (1024u * 1024u); // 4GB - 1MB allocation
 
-    uint64_t m_totalSize;
+    D3D12_HEAP_FLAGS m_flags = D3D12_HEAP_FLAG_NONE;
+    uint64_t m_totalSize = 0;
     struct HeapEntry
     {
         Microsoft::WRL::ComPtr<ID3D12Heap> Heap;
         uint64_t HeapSizeInBytes = 0;
-        uint64_t NextLocalOffset = 0;
+        TlsfAllocator Allocator;
+        D3D12_RESIDENCY_PRIORITY ResidencyPriority = D3D12_RESIDENCY_PRIORITY_NORMAL;
     };
 
     std::vector<HeapEntry> m_heaps;
 
+    // The allocations made since BeginReservation
+    bool m_reserving = false;
+    std::vector<MultiHeapAllocation> m_reserved;
+
 public:
     MultiHeap() = default;
 
     MultiHeap(D3D12_HEAP_FLAGS flags, uint64_t totalSize)
-        : m_totalSize(totalSize)
+        : m_flags(flags)
+        , m_totalSize(totalSize)
     {
-        // Create multiple heaps each <= PerHeapAllocationSize up to
-        // the configured total size specfied
-        D3D12_HEAP_DESC heapDesc{};
-        heapDesc.Alignment = 64 * 1024;
-        heapDesc.Flags = flags;
-        heapDesc.Properties.Type = D3D12_HEAP_TYPE_DEFAULT;
+        if (!CreateHeaps(0))
+            std::abort();
+    }
+
+    uint64_t GetTotalSize() const
+    {
+        return m_totalSize;
+    }
+
+    uint64_t GetUsedSize() const
+    {
+        uint64_t usedSize = 0;
+        for (auto const& heapEntry : m_heaps)
+            usedSize += heapEntry.HeapSizeInBytes - heapEntry.Allocator.GetFreeBytes();
+        return usedSize;
+    }
+
+    size_t GetNumHeaps() const
+    {
+        return m_heaps.size();
+    }
+
+    //
+    // Changes the total size of the heaps.  Heaps that still fit entirely are
+    // kept, so a small change doesn't recreate everything.  This may only be
+    // called while nothing is allocated from the heaps.  If the device runs out
+    // of memory the total size ends up smaller than requested.
+    //
+    void Resize(uint64_t totalSize)
+    {
+        Clear();
+
+        uint64_t bytesKept = 0;
+        size_t heapsKept = 0;
+        while (heapsKept < m_heaps.size() && bytesKept + m_heaps[heapsKept].HeapSizeInBytes <= totalSize)
+            bytesKept += m_heaps[heapsKept++].HeapSizeInBytes;
+
+        m_heaps.resize(heapsKept);
+        m_totalSize = totalSize;
+        CreateHeaps(bytesKept);
+    }
+
+    void Evict()
+    {
+        std::vector<ID3D12Pageable*> pageables = GetPageables();
+        g_Device->Evict(static_cast<UINT>(pageables.size()), pageables.data());
+    }
+
+    void MakeResident()
+    {
+        std::vector<ID3D12Pageable*> pageables = GetPageables();
+        g_Device->MakeResident(static_cast<UINT>(pageables.size()), pageables.data());
+    }
 
-        size_t totalHeaps = (totalSize / PerHeapAllocationSize) + 1;
-        m_heaps.reserve(totalHeaps);
+    //
+    // Gives each heap, by index, the priority the video memory manager pages
+    // it out by when memory is oversubscribed.  Placed resources are paged
+    // with their heap, so this is the granularity priorities can be set at.
+    // Only the heaps whose priority has changed are updated.
+    //
+    void SetResidencyPriorities(std::vector<D3D12_RESIDENCY_PRIORITY> const& priorities)
+    {
+        assert(priorities.size() == m_heaps.size());
 
-        uint64_t bytesAllocated = 0;
-        for (size_t heapIndex = 0; heapIndex < totalHeaps; ++heapIndex)
+        std::vector<ID3D12Pageable*> pageables;
+        std::vector<D3D12_RESIDENCY_PRIORITY> changedPriorities;
+        for (size_t i = 0; i < m_heaps.size(); ++i)
         {
-            heapDesc.SizeInBytes = std::min<uint64_t>(PerHeapAllocationSize, (m_totalSize - bytesAllocated));
-            Microsoft::WRL::ComPtr<ID3D12Heap> heap;
-            if (FAILED(g_Device->CreateHeap(&heapDesc, IID_PPV_ARGS(&heap))))
-            {
-                std::abort();
-            }
+            if (m_heaps[i].ResidencyPriority == priorities[i])
+                continue;
 
-            m_heaps.push_back({std::move(heap), heapDesc.SizeInBytes, 0});
-            bytesAllocated += heapDesc.SizeInBytes;
+            m_heaps[i].ResidencyPriority = priorities[i];
+            pageables.push_back(m_heaps[i].Heap.Get());
+            changedPriorities.push_back(priorities[i]);
+        }
+
+        if (pageables.empty())
+            return;
+
+        Microsoft::WRL::ComPtr<ID3D12Device1> device1;
+        if (SUCCEEDED(g_Device->QueryInterface(IID_PPV_ARGS(&device1))))
+        {
+            device1->SetResidencyPriority(
+                static_cast<UINT>(pageables.size()),
+                pageables.data(),
+                changedPriorities.data());
         }
     }
 
+    //
+    // Frees every allocation at once.
+    //
     void Clear()
     {
         for (auto& heapEntry : m_heaps)
         {
-            heapEntry.NextLocalOffset = 0;
+            heapEntry.Allocator.Reset(heapEntry.HeapSizeInBytes);
         }
     }
 
-    bool CanAllocate(std::vector<D3D12_RESOURCE_ALLOCATION_INFO1> allocations)
+    //
+    // Allocations are made as part of a reservation, so that all of the
+    // allocations for something can be attempted and then either kept, with
+    // Commit, or undone, with Rollback, if any of them don't fit.
+    //
+    void BeginReservation()
     {
-        auto heaps = m_heaps;
-        for (auto& allocation : allocations)
-        {
-            if (!TryAllocate(heaps, allocation.SizeInBytes))
-                return false;
-        }
-        return true;
+        assert(!m_reserving);
+        m_reserving = true;
+        m_reserved.clear();
     }
 
-    bool CanAllocate(uint64_t sizeInBytes)
+    std::optional<MultiHeapAllocation> Reserve(
+        uint64_t sizeInBytes,
+        uint64_t alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT)
     {
-        auto heaps = m_heaps;
-        auto allocation = TryAllocate(heaps, sizeInBytes);
-        return (allocation != std::nullopt);
+        assert(m_reserving);
+        auto allocation = TryAllocate(m_heaps, sizeInBytes, alignment);
+        if (allocation)
+            m_reserved.push_back(*allocation);
+        return allocation;
     }
 
-    std::vector<MultiHeapAllocation> Allocate(std::vector<D3D12_RESOURCE_ALLOCATION_INFO1> const& allocations)
+    void Commit()
     {
-        std::vector<MultiHeapAllocation> heapAllocations;
-        heapAllocations.reserve(allocations.size());
-        for (auto& allocation : allocations)
-        {
-            auto alloc = TryAllocate(m_heaps, allocation.SizeInBytes);
-            assert(alloc); // It is assumed that CanAllocate( ) was called so allocations must succeed.
-            heapAllocations.push_back(std::move(*alloc));
-        }
+        assert(m_reserving);
+        m_reserving = false;
+        m_reserved.clear();
+    }
 
-        return heapAllocations;
+    void Rollback()
+    {
+        assert(m_reserving);
+        m_reserving = false;
+        Free(m_reserved);
+        m_reserved.clear();
     }
 
-    MultiHeapAllocation Allocate(uint64_t sizeInBytes)
+    void Free(MultiHeapAllocation const& allocation)
     {
-        auto allocation = TryAllocate(m_heaps, sizeInBytes);
-        assert(allocation); // It is assumed that CanAllocate( ) was called so allocations must succeed.
-        return *allocation;
+        // Nothing was allocated for this, for example a shared texture
+        if (allocation.Block == TlsfAllocator::InvalidBlock)
+            return;
+
+        assert(allocation.HeapIndex < m_heaps.size());
+        m_heaps[allocation.HeapIndex].Allocator.Free(allocation.Block);
+    }
+
+    void Free(std::vector<MultiHeapAllocation> const& allocations)
+    {
+        for (auto& allocation : allocations)
+            Free(allocation);
+    }
+
+    //
+    // Used when defragmenting.  If there's room for an allocation of this size
+    // earlier in the heaps than the given allocation, then a new allocation is
+    // returned there.  The caller moves the data and then frees the old
+    // allocation.
+    //
+    std::optional<MultiHeapAllocation> TryRelocate(
+        MultiHeapAllocation const& allocation,
+        uint64_t sizeInBytes,
+        uint64_t alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT)
+    {
+        auto newAllocation = TryAllocate(m_heaps, sizeInBytes, alignment);
+        if (!newAllocation)
+            return std::nullopt;
+
+        if (newAllocation->HeapIndex < allocation.HeapIndex ||
+            (newAllocation->HeapIndex == allocation.HeapIndex && newAllocation->Offset < allocation.Offset))
+            return newAllocation;
+
+        Free(*newAllocation);
+        return std::nullopt;
     }
 
 private:
-    static HeapEntry* TryGetHeapEntryForAllocation(std::vector<HeapEntry>& heaps, uint64_t sizeInBytes)
+    //
+    // Create multiple heaps each <= PerHeapAllocationSize, after the
+    // bytesAllocated already held, up to the configured total size.
+    //
+    bool CreateHeaps(uint64_t bytesAllocated)
     {
-        for (auto& heapEntry : heaps)
+        D3D12_HEAP_DESC heapDesc{};
+        heapDesc.Alignment = 64 * 1024;
+        heapDesc.Flags = m_flags;
+        heapDesc.Properties.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+        while (bytesAllocated < m_totalSize)
         {
-            if (Math::AlignUp(heapEntry.NextLocalOffset + sizeInBytes, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT) <
-                heapEntry.HeapSizeInBytes)
-                return &heapEntry;
+            heapDesc.SizeInBytes = std::min<uint64_t>(PerHeapAllocationSize, (m_totalSize - bytesAllocated));
+            Microsoft::WRL::ComPtr<ID3D12Heap> heap;
+            if (FAILED(g_Device->CreateHeap(&heapDesc, IID_PPV_ARGS(&heap))))
+            {
+                m_totalSize = bytesAllocated;
+                return false;
+            }
+
+            // Small textures may be placed at 4KB alignment; everything else
+            // asks for the default 64KB alignment.
+            TlsfAllocator allocator(heapDesc.SizeInBytes, D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT);
+            m_heaps.push_back({std::move(heap), heapDesc.SizeInBytes, std::move(allocator)});
+            bytesAllocated += heapDesc.SizeInBytes;
         }
-        return nullptr;
+        return true;
     }
 
-    static std::optional<MultiHeapAllocation> TryAllocate(std::vector<HeapEntry>& heaps, uint64_t sizeInBytes)
+    std::vector<ID3D12Pageable*> GetPageables() const
     {
-        MultiHeapAllocation allocation{};
-        auto* heapEntry = TryGetHeapEntryForAllocation(heaps, sizeInBytes);
-        if (heapEntry)
+        std::vector<ID3D12Pageable*> pageables;
+        for (auto const& heapEntry : m_heaps)
+            pageables.push_back(heapEntry.Heap.Get());
+        return pageables;
+    }
+
+    static std::optional<MultiHeapAllocation> TryAllocate(
+        std::vector<HeapEntry>& heaps,
+        uint64_t sizeInBytes,
+        uint64_t alignment)
+    {
+        for (uint32_t heapIndex = 0; heapIndex < heaps.size(); ++heapIndex)
         {
-            allocation.Heap = heapEntry->Heap;
-            allocation.Offset = heapEntry->NextLocalOffset;
-            heapEntry->NextLocalOffset =
-                Math::AlignUp(heapEntry->NextLocalOffset + sizeInBytes, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT);
-            return allocation;
+            auto& heapEntry = heaps[heapIndex];
+            auto block = heapEntry.Allocator.Allocate(sizeInBytes, alignment);
+            if (block)
+            {
+                MultiHeapAllocation allocation{};
+                allocation.Heap = heapEntry.Heap;
+                allocation.Offset = block->Offset;
+                allocation.HeapIndex = heapIndex;
+                allocation.Block = block->Block;
+                return allocation;
+            }
         }
 
         return std::nullopt;
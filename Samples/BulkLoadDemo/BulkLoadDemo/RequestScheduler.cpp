@@ -0,0 +1,152 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "RequestScheduler.h"
+
+#include <algorithm>
+
+void RequestScheduler::EnqueueRequest(IDStorageQueue1* queue, DSTORAGE_REQUEST const& request)
+{
+    GetPendingQueue(queue).Requests.push_back(request);
+}
+
+void RequestScheduler::EnqueueStatus(IDStorageQueue1* queue, IDStorageStatusArray* statusArray, uint32_t index)
+{
+    GetPendingQueue(queue).Commands.push_back({CommandType::Status, statusArray, index, nullptr});
+}
+
+void RequestScheduler::EnqueueSetEvent(IDStorageQueue1* queue, HANDLE handle)
+{
+    GetPendingQueue(queue).Commands.push_back({CommandType::SetEvent, nullptr, 0, handle});
+}
+
+void RequestScheduler::EnqueueSignal(
+    IDStorageQueue1* queue,
+    CompletionFences& fences,
+    CompletionFences::Callback const& callback)
+{
+    GetPendingQueue(queue).Commands.push_back({CommandType::Signal, nullptr, 0, nullptr, &fences, callback});
+}
+
+void RequestScheduler::Flush()
+{
+    for (PendingQueue& queue : m_queues)
+    {
+        auto& requests = queue.Requests;
+
+        std::stable_sort(
+            requests.begin(),
+            requests.end(),
+            [](DSTORAGE_REQUEST const& a, DSTORAGE_REQUEST const& b)
+            {
+                if (a.Source.File.Source != b.Source.File.Source)
+                    return a.Source.File.Source < b.Source.File.Source;
+                return a.Source.File.Offset < b.Source.File.Offset;
+            });
+
+        // Merge each run of requests that continue on from each other in both
+        // the file and the destination.
+        size_t merged = 0;
+        for (size_t i = 1; i < requests.size(); ++i)
+        {
+            if (!TryMerge(requests[merged], requests[i]))
+                requests[++merged] = requests[i];
+        }
+        if (!requests.empty())
+            requests.resize(merged + 1);
+
+        for (DSTORAGE_REQUEST const& request : requests)
+            queue.Queue->EnqueueRequest(&request);
+
+        for (Command const& command : queue.Commands)
+        {
+            switch (command.Type)
+            {
+            case CommandType::Status:
+                queue.Queue->EnqueueStatus(command.StatusArray, command.StatusIndex);
+                break;
+
+            case CommandType::SetEvent:
+                queue.Queue->EnqueueSetEvent(command.Event);
+                break;
+
+            case CommandType::Signal:
+                command.Fences->EnqueueSignal(queue.Queue, command.Callback);
+                break;
+            }
+        }
+
+        queue.Queue->Submit();
+    }
+
+    m_queues.clear();
+}
+
+RequestScheduler::PendingQueue& RequestScheduler::GetPendingQueue(IDStorageQueue1* queue)
+{
+    auto it = std::find_if(
+        m_queues.begin(),
+        m_queues.end(),
+        [queue](PendingQueue const& pending) { return pending.Queue == queue; });
+    if (it != m_queues.end())
+        return *it;
+
+    m_queues.push_back({queue});
+    return m_queues.back();
+}
+
+//
+// Extends request to also cover next, if next reads the bytes straight after
+// request's into the memory straight after request's.  Compressed requests are
+// never merged, since each is decompressed as a single stream.
+//
+bool RequestScheduler::TryMerge(DSTORAGE_REQUEST& request, DSTORAGE_REQUEST const& next)
+{
+    if (request.Options.CompressionFormat != DSTORAGE_COMPRESSION_FORMAT_NONE ||
+        next.Options.CompressionFormat != DSTORAGE_COMPRESSION_FORMAT_NONE ||
+        request.Options.SourceType != DSTORAGE_REQUEST_SOURCE_FILE ||
+        next.Options.SourceType != DSTORAGE_REQUEST_SOURCE_FILE ||
+        request.Options.DestinationType != next.Options.DestinationType ||
+        request.CancellationTag != next.CancellationTag)
+        return false;
+
+    if (request.Source.File.Source != next.Source.File.Source ||
+        request.Source.File.Offset + request.Source.File.Size != next.Source.File.Offset)
+        return false;
+
+    uint64_t mergedSize = static_cast<uint64_t>(request.Source.File.Size) + next.Source.File.Size;
+    if (mergedSize > MaxMergedRequestSize)
+        return false;
+
+    switch (request.Options.DestinationType)
+    {
+    case DSTORAGE_REQUEST_DESTINATION_MEMORY:
+        if (static_cast<char*>(request.Destination.Memory.Buffer) + request.Destination.Memory.Size !=
+            next.Destination.Memory.Buffer)
+            return false;
+        request.Destination.Memory.Size += next.Destination.Memory.Size;
+        break;
+
+    case DSTORAGE_REQUEST_DESTINATION_BUFFER:
+        if (request.Destination.Buffer.Resource != next.Destination.Buffer.Resource ||
+            request.Destination.Buffer.Offset + request.Destination.Buffer.Size != next.Destination.Buffer.Offset)
+            return false;
+        request.Destination.Buffer.Size += next.Destination.Buffer.Size;
+        break;
+
+    default:
+        // Texture destinations describe a single subresource or region, so
+        // they can't be extended.
+        return false;
+    }
+
+    request.Source.File.Size = static_cast<uint32_t>(mergedSize);
+    request.UncompressedSize += next.UncompressedSize;
+    return true;
+}
@@ -0,0 +1,74 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include "CompletionFences.h"
+
+#include <dstorage.h>
+
+#include <vector>
+
+//
+// RequestScheduler collects the requests for a whole set before any of them
+// are enqueued.  On Flush, each queue's requests are sorted by file and
+// offset, adjacent uncompressed reads into contiguous destinations are merged
+// into a single request, and everything is enqueued and submitted.  This
+// turns the interleaved reads of many MarcFiles into long sequential runs,
+// which matters most on SATA SSDs and hard drives.
+//
+// Status, event and signal commands are enqueued after all of the requests on
+// their queue, so they still signal only once the requests before them have
+// completed.
+//
+
+class RequestScheduler
+{
+    enum class CommandType
+    {
+        Status,
+        SetEvent,
+        Signal
+    };
+
+    struct Command
+    {
+        CommandType Type;
+        IDStorageStatusArray* StatusArray;
+        uint32_t StatusIndex;
+        HANDLE Event;
+        CompletionFences* Fences = nullptr;
+        CompletionFences::Callback Callback{};
+    };
+
+    struct PendingQueue
+    {
+        IDStorageQueue1* Queue;
+        std::vector<DSTORAGE_REQUEST> Requests;
+        std::vector<Command> Commands;
+    };
+
+    std::vector<PendingQueue> m_queues;
+
+public:
+    // Reads are only merged while the result is no larger than this
+    static constexpr uint32_t MaxMergedRequestSize = 1024 * 1024;
+
+    void EnqueueRequest(IDStorageQueue1* queue, DSTORAGE_REQUEST const& request);
+    void EnqueueStatus(IDStorageQueue1* queue, IDStorageStatusArray* statusArray, uint32_t index);
+    void EnqueueSetEvent(IDStorageQueue1* queue, HANDLE handle);
+    void EnqueueSignal(IDStorageQueue1* queue, CompletionFences& fences, CompletionFences::Callback const& callback);
+
+    void Flush();
+
+private:
+    PendingQueue& GetPendingQueue(IDStorageQueue1* queue);
+
+    static bool TryMerge(DSTORAGE_REQUEST& request, DSTORAGE_REQUEST const& next);
+};
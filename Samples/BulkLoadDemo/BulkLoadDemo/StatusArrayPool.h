@@ -0,0 +1,61 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <dstorage.h>
+#include <wrl/client.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+//
+// Hands out ranges of entries in a few large status arrays, rather than each
+// MarcFile creating an array of its own.  Ranges are never freed; they're
+// held by the files, which live as long as the pool.
+//
+class StatusArrayPool
+{
+public:
+    struct Range
+    {
+        Microsoft::WRL::ComPtr<IDStorageStatusArray> StatusArray;
+        uint32_t FirstEntry = 0;
+    };
+
+    static constexpr uint32_t EntriesPerArray = 4096;
+
+    explicit StatusArrayPool(IDStorageFactory* factory)
+        : m_factory(factory)
+    {
+    }
+
+    Range Allocate(uint32_t numEntries)
+    {
+        if (m_arrays.empty() || m_numUsed + numEntries > EntriesPerArray)
+        {
+            Microsoft::WRL::ComPtr<IDStorageStatusArray> statusArray;
+            if (FAILED(m_factory->CreateStatusArray(EntriesPerArray, nullptr, IID_PPV_ARGS(&statusArray))))
+                std::abort();
+
+            m_arrays.push_back(std::move(statusArray));
+            m_numUsed = 0;
+        }
+
+        Range range{m_arrays.back(), m_numUsed};
+        m_numUsed += numEntries;
+        return range;
+    }
+
+private:
+    Microsoft::WRL::ComPtr<IDStorageFactory> m_factory;
+    std::vector<Microsoft::WRL::ComPtr<IDStorageStatusArray>> m_arrays;
+    uint32_t m_numUsed = 0;
+};
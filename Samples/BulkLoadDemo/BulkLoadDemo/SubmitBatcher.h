@@ -0,0 +1,96 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <dstorage.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+//
+// Defers queue submits while a batch is open.  Each Submit wakes the
+// DirectStorage runtime, so when many files enqueue their requests one after
+// another it's cheaper to submit each queue once they all have.  Outside a
+// batch, Submit submits the queue straight away.
+//
+// A batch may be flushed early, once a number of submits have been deferred
+// or the oldest of them has waited too long, so that a long batch doesn't hold
+// back the first requests.  Zero disables either limit.
+//
+class SubmitBatcher
+{
+    using clock = std::chrono::steady_clock;
+
+    std::mutex m_mutex;
+    uint32_t m_depth = 0;
+    std::vector<IDStorageQueue1*> m_queues;
+    uint32_t m_numDeferred = 0;
+    clock::time_point m_firstDeferredTime;
+
+    uint32_t m_maxDeferred;
+    clock::duration m_maxDelay;
+
+public:
+    explicit SubmitBatcher(uint32_t maxDeferred = 0, clock::duration maxDelay = clock::duration::zero())
+        : m_maxDeferred(maxDeferred)
+        , m_maxDelay(maxDelay)
+    {
+    }
+
+    // Batches nest; the deferred submits are made when the outermost ends.
+    void Begin()
+    {
+        std::unique_lock lock(m_mutex);
+        ++m_depth;
+    }
+
+    void End()
+    {
+        std::unique_lock lock(m_mutex);
+        if (--m_depth == 0)
+            Flush();
+    }
+
+    void Submit(IDStorageQueue1* queue)
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (m_depth == 0)
+        {
+            queue->Submit();
+            return;
+        }
+
+        if (std::find(m_queues.begin(), m_queues.end(), queue) == m_queues.end())
+            m_queues.push_back(queue);
+
+        if (m_numDeferred++ == 0)
+            m_firstDeferredTime = clock::now();
+
+        bool const tooMany = m_maxDeferred != 0 && m_numDeferred >= m_maxDeferred;
+        bool const tooOld = m_maxDelay != clock::duration::zero() && clock::now() - m_firstDeferredTime >= m_maxDelay;
+        if (tooMany || tooOld)
+            Flush();
+    }
+
+private:
+    void Flush()
+    {
+        // assumes m_mutex is locked
+
+        for (IDStorageQueue1* queue : m_queues)
+            queue->Submit();
+
+        m_queues.clear();
+        m_numDeferred = 0;
+    }
+};
@@ -0,0 +1,312 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+//
+// A two-level segregated fit (TLSF) allocator that manages a range of offsets,
+// such as a D3D12 heap.  Allocate and Free are O(1): free blocks are kept in
+// lists segregated by size class, with bitmaps recording which lists are
+// non-empty, and a freed block is coalesced with its free neighbors.
+//
+// Sizes are rounded up to a multiple of the granularity, so every offset
+// returned is aligned to it.  Larger alignments, that are powers of two, can
+// be requested for individual allocations.
+//
+class TlsfAllocator
+{
+public:
+    using BlockId = uint32_t;
+    static constexpr BlockId InvalidBlock = ~0u;
+
+    struct Allocation
+    {
+        BlockId Block = InvalidBlock;
+        uint64_t Offset = 0;
+    };
+
+    TlsfAllocator() = default;
+
+    TlsfAllocator(uint64_t sizeInBytes, uint64_t granularity)
+        : m_granularity(granularity)
+    {
+        Reset(sizeInBytes);
+    }
+
+    //
+    // Frees every allocation.
+    //
+    void Reset(uint64_t sizeInBytes)
+    {
+        m_blocks.clear();
+        m_unusedBlocks.clear();
+        m_firstLevelBitmap = 0;
+        m_freeUnits = 0;
+        for (auto& bitmap : m_secondLevelBitmaps)
+            bitmap = 0;
+        for (auto& heads : m_freeHeads)
+        {
+            for (auto& head : heads)
+                head = InvalidBlock;
+        }
+
+        uint64_t units = sizeInBytes / m_granularity;
+        if (units == 0)
+            return;
+
+        BlockId block = NewBlock();
+        m_blocks[block].Offset = 0;
+        m_blocks[block].Size = units;
+        InsertFreeBlock(block);
+    }
+
+    std::optional<Allocation> Allocate(uint64_t sizeInBytes, uint64_t alignment = 0)
+    {
+        uint64_t units = std::max<uint64_t>(1, (sizeInBytes + m_granularity - 1) / m_granularity);
+        uint64_t alignmentUnits = std::max<uint64_t>(1, alignment / m_granularity);
+        assert(std::has_single_bit(alignmentUnits));
+
+        // Any block this large has room for the allocation wherever the
+        // aligned offset falls within it.
+        BlockId block = FindFreeBlock(units + alignmentUnits - 1);
+        if (block == InvalidBlock)
+            return std::nullopt;
+
+        RemoveFreeBlock(block);
+
+        uint64_t offset = m_blocks[block].Offset;
+        uint64_t padding = ((offset + alignmentUnits - 1) & ~(alignmentUnits - 1)) - offset;
+        if (padding > 0)
+        {
+            // The padding before the aligned offset stays free
+            BlockId aligned = Split(block, padding);
+            InsertFreeBlock(block);
+            block = aligned;
+        }
+
+        if (m_blocks[block].Size > units)
+            InsertFreeBlock(Split(block, units));
+
+        return Allocation{block, m_blocks[block].Offset * m_granularity};
+    }
+
+    void Free(BlockId block)
+    {
+        assert(block < m_blocks.size() && !m_blocks[block].IsFree);
+
+        BlockId prev = m_blocks[block].PrevPhysical;
+        if (prev != InvalidBlock && m_blocks[prev].IsFree)
+        {
+            RemoveFreeBlock(prev);
+            m_blocks[prev].Size += m_blocks[block].Size;
+            Unlink(block);
+            block = prev;
+        }
+
+        BlockId next = m_blocks[block].NextPhysical;
+        if (next != InvalidBlock && m_blocks[next].IsFree)
+        {
+            RemoveFreeBlock(next);
+            m_blocks[block].Size += m_blocks[next].Size;
+            Unlink(next);
+        }
+
+        InsertFreeBlock(block);
+    }
+
+    //
+    // The bytes in free blocks, including the padding left before aligned
+    // allocations.
+    //
+    uint64_t GetFreeBytes() const
+    {
+        return m_freeUnits * m_granularity;
+    }
+
+private:
+    static constexpr uint32_t SecondLevelBits = 4;
+    static constexpr uint32_t SecondLevelCount = 1u << SecondLevelBits;
+    static constexpr uint32_t FirstLevelCount = 64 - SecondLevelBits + 1;
+
+    struct Block
+    {
+        uint64_t Offset = 0; // in units of m_granularity
+        uint64_t Size = 0;   // in units of m_granularity
+        BlockId PrevPhysical = InvalidBlock;
+        BlockId NextPhysical = InvalidBlock;
+        BlockId PrevFree = InvalidBlock;
+        BlockId NextFree = InvalidBlock;
+        bool IsFree = false;
+    };
+
+    uint64_t m_granularity = 1;
+    std::vector<Block> m_blocks;
+    std::vector<BlockId> m_unusedBlocks;
+    uint64_t m_freeUnits = 0;
+
+    uint64_t m_firstLevelBitmap = 0;
+    uint32_t m_secondLevelBitmaps[FirstLevelCount] = {};
+    BlockId m_freeHeads[FirstLevelCount][SecondLevelCount];
+
+    //
+    // Sizes below SecondLevelCount each get their own list in the first
+    // level.  Above that, each power of two range is split into
+    // SecondLevelCount lists.
+    //
+    static void Mapping(uint64_t size, uint32_t& firstLevel, uint32_t& secondLevel)
+    {
+        if (size < SecondLevelCount)
+        {
+            firstLevel = 0;
+            secondLevel = static_cast<uint32_t>(size);
+        }
+        else
+        {
+            uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+            firstLevel = log2 - SecondLevelBits + 1;
+            secondLevel = static_cast<uint32_t>(size >> (log2 - SecondLevelBits)) ^ SecondLevelCount;
+        }
+    }
+
+    //
+    // Returns a block of at least the given size.  The size is rounded up to
+    // the next size class first, so that any block in the list found is large
+    // enough.
+    //
+    BlockId FindFreeBlock(uint64_t size) const
+    {
+        if (size >= SecondLevelCount)
+        {
+            uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+            size += (uint64_t(1) << (log2 - SecondLevelBits)) - 1;
+        }
+
+        uint32_t firstLevel;
+        uint32_t secondLevel;
+        Mapping(size, firstLevel, secondLevel);
+        if (firstLevel >= FirstLevelCount)
+            return InvalidBlock;
+
+        uint32_t secondLevelMap = m_secondLevelBitmaps[firstLevel] & (~0u << secondLevel);
+        if (secondLevelMap == 0)
+        {
+            uint64_t firstLevelMap = m_firstLevelBitmap & (~uint64_t(0) << (firstLevel + 1));
+            if (firstLevelMap == 0)
+                return InvalidBlock;
+
+            firstLevel = static_cast<uint32_t>(std::countr_zero(firstLevelMap));
+            secondLevelMap = m_secondLevelBitmaps[firstLevel];
+        }
+
+        secondLevel = static_cast<uint32_t>(std::countr_zero(secondLevelMap));
+        return m_freeHeads[firstLevel][secondLevel];
+    }
+
+    void InsertFreeBlock(BlockId block)
+    {
+        uint32_t firstLevel;
+        uint32_t secondLevel;
+        Mapping(m_blocks[block].Size, firstLevel, secondLevel);
+
+        Block& b = m_blocks[block];
+        b.IsFree = true;
+        b.PrevFree = InvalidBlock;
+        b.NextFree = m_freeHeads[firstLevel][secondLevel];
+        if (b.NextFree != InvalidBlock)
+            m_blocks[b.NextFree].PrevFree = block;
+        m_freeHeads[firstLevel][secondLevel] = block;
+        m_freeUnits += b.Size;
+
+        m_firstLevelBitmap |= uint64_t(1) << firstLevel;
+        m_secondLevelBitmaps[firstLevel] |= 1u << secondLevel;
+    }
+
+    void RemoveFreeBlock(BlockId block)
+    {
+        uint32_t firstLevel;
+        uint32_t secondLevel;
+        Mapping(m_blocks[block].Size, firstLevel, secondLevel);
+
+        Block& b = m_blocks[block];
+        if (b.PrevFree != InvalidBlock)
+            m_blocks[b.PrevFree].NextFree = b.NextFree;
+        else
+            m_freeHeads[firstLevel][secondLevel] = b.NextFree;
+
+        if (b.NextFree != InvalidBlock)
+            m_blocks[b.NextFree].PrevFree = b.PrevFree;
+
+        if (m_freeHeads[firstLevel][secondLevel] == InvalidBlock)
+        {
+            m_secondLevelBitmaps[firstLevel] &= ~(1u << secondLevel);
+            if (m_secondLevelBitmaps[firstLevel] == 0)
+                m_firstLevelBitmap &= ~(uint64_t(1) << firstLevel);
+        }
+
+        b.IsFree = false;
+        b.PrevFree = b.NextFree = InvalidBlock;
+        m_freeUnits -= b.Size;
+    }
+
+    //
+    // Splits the block after the given size, returning the new block that
+    // holds the remainder.
+    //
+    BlockId Split(BlockId block, uint64_t size)
+    {
+        BlockId remainder = NewBlock();
+        Block& b = m_blocks[block];
+        Block& r = m_blocks[remainder];
+        r.Offset = b.Offset + size;
+        r.Size = b.Size - size;
+        r.PrevPhysical = block;
+        r.NextPhysical = b.NextPhysical;
+        if (b.NextPhysical != InvalidBlock)
+            m_blocks[b.NextPhysical].PrevPhysical = remainder;
+        b.NextPhysical = remainder;
+        b.Size = size;
+        return remainder;
+    }
+
+    BlockId NewBlock()
+    {
+        if (!m_unusedBlocks.empty())
+        {
+            BlockId block = m_unusedBlocks.back();
+            m_unusedBlocks.pop_back();
+            m_blocks[block] = Block{};
+            return block;
+        }
+
+        m_blocks.emplace_back();
+        return static_cast<BlockId>(m_blocks.size() - 1);
+    }
+
+    //
+    // Removes a block, that has been merged into its previous physical
+    // neighbor, from the physical list.
+    //
+    void Unlink(BlockId block)
+    {
+        Block& b = m_blocks[block];
+        if (b.PrevPhysical != InvalidBlock)
+            m_blocks[b.PrevPhysical].NextPhysical = b.NextPhysical;
+        if (b.NextPhysical != InvalidBlock)
+            m_blocks[b.NextPhysical].PrevPhysical = b.PrevPhysical;
+
+        m_unusedBlocks.push_back(block);
+    }
+};
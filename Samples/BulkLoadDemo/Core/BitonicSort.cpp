@@ -48,7 +48,7 @@ namespace BitonicSort
 
 void BitonicSort::Initialize( void )
 {	
-    s_DispatchArgs.Create(L"Bitonic sort dispatch args", 22*23/2, 12);
+    CreateDispatchArgs(s_DispatchArgs, L"Bitonic sort dispatch args");
 
     s_RootSignature.Reset(4, 0);
     s_RootSignature[0].InitAsConstants(0, 2);
@@ -60,7 +60,7 @@ void BitonicSort::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(s_RootSignature); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO(s_BitonicIndirectArgsCS, g_pBitonicIndirectArgsCS);
     CreatePSO(s_Bitonic32PreSortCS,    g_pBitonic32PreSortCS);
@@ -78,15 +78,23 @@ void BitonicSort::Shutdown( void )
     s_DispatchArgs.Destroy();
 }
 
+void BitonicSort::CreateDispatchArgs( IndirectArgsBuffer& DispatchArgs, const std::wstring& Name )
+{
+    DispatchArgs.Create(Name, 22*23/2, 12);
+}
+
 void BitonicSort::Sort( 
     ComputeContext& Context,
     GpuBuffer& KeyIndexList,
     GpuBuffer& CounterBuffer,
     uint32_t CounterOffset,
     bool IsPartiallyPreSorted,
-    bool SortAscending
+    bool SortAscending,
+    IndirectArgsBuffer* DispatchArgs
 )
 {
+    IndirectArgsBuffer& Args = DispatchArgs != nullptr ? *DispatchArgs : s_DispatchArgs;
+
     const uint32_t ElementSizeBytes = KeyIndexList.GetElementSize();
     const uint32_t MaxNumElements = KeyIndexList.GetElementCount();
     const uint32_t AlignedMaxNumElements = Math::AlignPowerOfTwo(MaxNumElements);
@@ -103,15 +111,15 @@ void BitonicSort::Sort(
     // Generate execute indirect arguments
     Context.SetPipelineState(s_BitonicIndirectArgsCS);
     Context.TransitionResource(CounterBuffer, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
-    Context.TransitionResource(s_DispatchArgs, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    Context.TransitionResource(Args, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
     Context.SetConstants(0, MaxIterations);
     Context.SetDynamicDescriptor(1, 0, CounterBuffer.GetSRV());
-    Context.SetDynamicDescriptor(2, 0, s_DispatchArgs.GetUAV());
+    Context.SetDynamicDescriptor(2, 0, Args.GetUAV());
     Context.Dispatch(1, 1, 1);
 
     // Pre-Sort the buffer up to k = 2048.  This also pads the list with invalid indices
     // that will drift to the end of the sorted list.
-    Context.TransitionResource(s_DispatchArgs, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    Context.TransitionResource(Args, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
     Context.TransitionResource(KeyIndexList, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
     Context.InsertUAVBarrier(KeyIndexList);
     Context.SetDynamicDescriptor(2, 0, KeyIndexList.GetUAV());
@@ -119,7 +127,7 @@ void BitonicSort::Sort(
     if (!IsPartiallyPreSorted)
     {
         Context.SetPipelineState(ElementSizeBytes == 4 ? s_Bitonic32PreSortCS : s_Bitonic64PreSortCS);
-        Context.DispatchIndirect(s_DispatchArgs, 0);
+        Context.DispatchIndirect(Args, 0);
         Context.InsertUAVBarrier(KeyIndexList);
     }
 
@@ -136,13 +144,13 @@ void BitonicSort::Sort(
         for (uint32_t j = k / 2; j >= 2048; j /= 2)
         {
             Context.SetConstants(0, k, j);
-            Context.DispatchIndirect(s_DispatchArgs, IndirectArgsOffset);
+            Context.DispatchIndirect(Args, IndirectArgsOffset);
             Context.InsertUAVBarrier(KeyIndexList);
             IndirectArgsOffset += 12;
         }
 
         Context.SetPipelineState(ElementSizeBytes == 4 ? s_Bitonic32InnerSortCS : s_Bitonic64InnerSortCS);
-        Context.DispatchIndirect(s_DispatchArgs, IndirectArgsOffset);
+        Context.DispatchIndirect(Args, IndirectArgsOffset);
         Context.InsertUAVBarrier(KeyIndexList);
         IndirectArgsOffset += 12;
     }
@@ -95,9 +95,15 @@ namespace BitonicSort
         bool IsPartiallyPreSorted,
 
         // True to sort in ascending order (smallest to largest).  False to sort in descending order.
-        bool SortAscending
+        bool SortAscending,
+
+        // A buffer from CreateDispatchArgs() for the sort's indirect dispatch arguments.  By default
+        // a shared one is used, so lists sorted on several contexts at once each need their own.
+        IndirectArgsBuffer* DispatchArgs = nullptr
     );
 
+    void CreateDispatchArgs( IndirectArgsBuffer& DispatchArgs, const std::wstring& Name );
+
     void Test( void );
 
 } // namespace BitonicSort
@@ -61,6 +61,7 @@ BuddyAllocator::BuddyAllocator(kBuddyAllocationStrategy allocationStrategy, D3D1
     , m_maxBlockSize(maxBlockSize)
     , m_minBlockSize(MinBlockSize)
     , m_pBackingHeap(nullptr)
+    , m_freeOrders(0)
 #if defined(PROFILE) || defined(_DEBUG)
     , m_SpaceUsed(0)
     , m_InternalFragmentation(0)
@@ -70,6 +71,7 @@ BuddyAllocator::BuddyAllocator(kBuddyAllocationStrategy allocationStrategy, D3D1
     ASSERT(Math::IsPowerOfTwo(maxBlockSize / m_minBlockSize));
 
     m_maxOrder = UnitSizeToOrder(SizeToUnitSize(maxBlockSize));
+    ASSERT(m_maxOrder < 64, "The free orders mask has a bit per order");
 
     Reset();
 }
@@ -106,37 +108,95 @@ void BuddyAllocator::Destroy()
     }
 }
 
-size_t BuddyAllocator::AllocateBlock(UINT order)
+void BuddyAllocator::Reset()
 {
-    size_t offset;
+    // Size the bitmaps of each order, with no free blocks
+    m_freeBits.resize(m_maxOrder + 1);
+    m_freeWords.resize(m_maxOrder + 1);
+    m_freeCounts.assign(m_maxOrder + 1, 0);
+    m_freeOrders = 0;
 
-    if (order > m_maxOrder)
+    for (UINT order = 0; order <= m_maxOrder; ++order)
     {
-        throw(std::bad_alloc()); // Can't allocate a block that large  
+        const size_t numBlocks = OrderToUnitSize(m_maxOrder - order);
+        const size_t numWords = (numBlocks + 63) / 64;
+        m_freeBits[order].assign(numWords, 0);
+        m_freeWords[order].assign((numWords + 63) / 64, 0);
     }
 
-    auto it = m_freeBlocks[order].begin();
-
-    if (it == m_freeBlocks[order].end())
+    for (Shard& shard : m_shards)
     {
-        // No free nodes in the requested pool.  Try to find a higher-order block and split it.  
-        size_t left = AllocateBlock(order + 1);
+        for (uint32_t& count : shard.Counts)
+            count = 0;
+    }
 
-        size_t size = OrderToUnitSize(order);
+    // Initialize the pool with a free inner block of max inner block size
+    SetBlockFree(m_maxOrder, 0);
+}
 
-        size_t right = left + size;
+void BuddyAllocator::SetBlockFree(UINT order, size_t index)
+{
+    const size_t word = index >> 6;
+    m_freeBits[order][word] |= 1ull << (index & 63);
+    m_freeWords[order][word >> 6] |= 1ull << (word & 63);
+    m_freeOrders |= 1ull << order;
+    ++m_freeCounts[order];
+}
 
-        m_freeBlocks[order].insert(right); // Add the right block to the free pool  
+void BuddyAllocator::ClearBlockFree(UINT order, size_t index)
+{
+    const size_t word = index >> 6;
+    m_freeBits[order][word] &= ~(1ull << (index & 63));
+    if (m_freeBits[order][word] == 0)
+        m_freeWords[order][word >> 6] &= ~(1ull << (word & 63));
+    if (--m_freeCounts[order] == 0)
+        m_freeOrders &= ~(1ull << order);
+}
 
-        offset = left; // Return the left block  
+size_t BuddyAllocator::FindFreeBlock(UINT order) const
+{
+    // The summary has a word for every 4096 blocks, so this only loops for
+    // the lowest orders of very large allocators
+    const std::vector<uint64_t>& freeWords = m_freeWords[order];
+    for (size_t summary = 0; summary < freeWords.size(); ++summary)
+    {
+        if (freeWords[summary] != 0)
+        {
+            unsigned long wordBit, blockBit;
+            _BitScanForward64(&wordBit, freeWords[summary]);
+            const size_t word = summary * 64 + wordBit;
+            _BitScanForward64(&blockBit, m_freeBits[order][word]);
+            return word * 64 + blockBit;
+        }
     }
 
-    else
+    ASSERT(false, "The free counts and bitmaps of order %u disagree", order);
+    return 0;
+}
+
+size_t BuddyAllocator::AllocateBlock(UINT order)
+{
+    if (order > m_maxOrder)
+    {
+        throw(std::bad_alloc()); // Can't allocate a block that large  
+    }
+
+    // Take the smallest free block that is large enough
+    unsigned long freeOrder;
+    if (!_BitScanForward64(&freeOrder, m_freeOrders & ~(OrderToUnitSize(order) - 1)))
     {
-        offset = *it;
+        throw(std::bad_alloc());
+    }
+
+    const size_t index = FindFreeBlock(freeOrder);
+    ClearBlockFree(freeOrder, index);
+
+    const size_t offset = index << freeOrder;
 
-        // Remove the block from the free list  
-        m_freeBlocks[order].erase(it);
+    // Split it down to the requested order, freeing the right half each time
+    for (UINT splitOrder = freeOrder; splitOrder > order; --splitOrder)
+    {
+        SetBlockFree(splitOrder - 1, (offset >> (splitOrder - 1)) + 1);
     }
 
     return offset;
@@ -144,24 +204,87 @@ size_t BuddyAllocator::AllocateBlock(UINT order)
 
 void BuddyAllocator::DeallocateBlock(size_t offset, UINT order)
 {
-    // See if the buddy block is free  
-    size_t size = OrderToUnitSize(order);
+    // Merge with the buddy block for as long as it is free
+    while (order < m_maxOrder)
+    {
+        const size_t buddy = GetBuddyOffset(offset, OrderToUnitSize(order)) >> order;
+        if (!IsBlockFree(order, buddy))
+        {
+            break;
+        }
 
-    size_t buddy = GetBuddyOffset(offset, size);
+        ClearBlockFree(order, buddy);
+        offset &= ~OrderToUnitSize(order);
+        ++order;
+    }
 
-    auto it = m_freeBlocks[order].find(buddy);
+    // Add the block to the free list
+    SetBlockFree(order, offset >> order);
+}
+
+namespace
+{
+    // Threads are spread over the shards in the order they first use one
+    std::atomic<uint32_t> s_NextShard = 0;
 
-    if (it != m_freeBlocks[order].end())
+    uint32_t GetThreadShard()
     {
-        // Deallocate merged blocks  
-        DeallocateBlock(min(offset, buddy), order + 1);
-        // Remove the buddy from the free list  
-        m_freeBlocks[order].erase(it);
+        static thread_local const uint32_t t_Shard = s_NextShard++;
+        return t_Shard;
     }
-    else
+}
+
+bool BuddyAllocator::PopCachedBlock(UINT order, size_t& offset)
+{
+    if (order >= kNumCachedOrders)
     {
-        // Add the block to the free list  
-        m_freeBlocks[order].insert(offset); // throw(std::bad_alloc) 
+        return false;
+    }
+
+    Shard& shard = m_shards[GetThreadShard() % kNumShards];
+
+    std::lock_guard<std::mutex> lockGuard(shard.Mutex);
+    if (shard.Counts[order] == 0)
+    {
+        return false;
+    }
+
+    offset = shard.Offsets[order][--shard.Counts[order]];
+    return true;
+}
+
+bool BuddyAllocator::PushCachedBlock(UINT order, size_t offset)
+{
+    if (order >= kNumCachedOrders)
+    {
+        return false;
+    }
+
+    Shard& shard = m_shards[GetThreadShard() % kNumShards];
+
+    std::lock_guard<std::mutex> lockGuard(shard.Mutex);
+    if (shard.Counts[order] == kShardCapacity)
+    {
+        return false;
+    }
+
+    shard.Offsets[order][shard.Counts[order]++] = offset;
+    return true;
+}
+
+void BuddyAllocator::FlushCachedBlocks()
+{
+    for (Shard& shard : m_shards)
+    {
+        std::lock_guard<std::mutex> lockGuard(shard.Mutex);
+        for (UINT order = 0; order < kNumCachedOrders; ++order)
+        {
+            for (uint32_t i = 0; i < shard.Counts[order]; ++i)
+            {
+                DeallocateBlock(shard.Offsets[order][i], order);
+            }
+            shard.Counts[order] = 0;
+        }
     }
 }
 
@@ -173,7 +296,23 @@ BuddyBlock* BuddyAllocator::Allocate(uint32_t numElements, uint32_t elementSize,
 
     try
     {
-        size_t offset = AllocateBlock(order);
+        size_t offset;
+        if (!PopCachedBlock(order, offset))
+        {
+            std::lock_guard<std::mutex> lockGuard(m_mutex);
+            try
+            {
+                offset = AllocateBlock(order);
+            }
+            catch (std::bad_alloc&)
+            {
+                // The cached blocks may be all that keeps a large enough
+                // block from merging back together
+                FlushCachedBlocks();
+                offset = AllocateBlock(order);
+            }
+        }
+
         uint32_t paddedSize = uint32_t(OrderToUnitSize(order) * m_minBlockSize);
 
         uint32_t blockOffset = uint32_t(m_baseOffset + (offset * m_minBlockSize));
@@ -208,13 +347,18 @@ BuddyBlock* BuddyAllocator::Allocate(uint32_t numElements, uint32_t elementSize,
     }
 }
 
-/*
-void BuddyAllocator::Deallocate(BuddyBlock* pBlock)
+void BuddyAllocator::Deallocate(BuddyBlock* pBlock, uint64_t fenceValue)
 {
-    pBlock->m_fenceValue = g_CommandManager.GetNextFenceValue();
+    pBlock->m_fenceValue = fenceValue;
+
+    std::lock_guard<std::mutex> lockGuard(m_deferredDeletionMutex);
     m_deferredDeletionQueue.push(pBlock);
 }
-*/
+
+void BuddyAllocator::Deallocate(BuddyBlock* pBlock)
+{
+    Deallocate(pBlock, g_CommandManager.GetGraphicsQueue().GetNextFenceValue());
+}
 
 void BuddyAllocator::DeallocateInternal(BuddyBlock* pBlock)
 {
@@ -226,39 +370,40 @@ void BuddyAllocator::DeallocateInternal(BuddyBlock* pBlock)
 
     UINT order = UnitSizeToOrder(size);
 
-    try
+    if (!PushCachedBlock(order, offset))
     {
-        DeallocateBlock(offset, order); // throw(std::bad_alloc)
-
-        DECREASE_BUDDY_COUNTER(m_SpaceUsed, size);
-        DECREASE_BUDDY_COUNTER(m_InternalFragmentation, (size - pBlock->m_unpaddedSize));
-        
-        if (m_allocationStrategy == kBuddyAllocationStrategy::kPlacedResourceStrategy)
-        {
-            // Release the resource
-            pBlock->Destroy();
-        }
-        delete(pBlock);
+        std::lock_guard<std::mutex> lockGuard(m_mutex);
+        DeallocateBlock(offset, order);
     }
 
-    catch (std::bad_alloc&)
+    DECREASE_BUDDY_COUNTER(m_SpaceUsed, pBlock->GetSize());
+    DECREASE_BUDDY_COUNTER(m_InternalFragmentation, (pBlock->GetSize() - pBlock->m_unpaddedSize));
+
+    if (m_allocationStrategy == kBuddyAllocationStrategy::kPlacedResourceStrategy)
     {
-        // Deallocate failed trying to add the free block to the pool  
-        // resulting in a leak.  Unfortunately there is not much we can do.  
-        // Fortunately this is expected to be extremely rare as the storage  
-        // needed for each deallocate is very small.  
+        // Release the resource
+        pBlock->Destroy();
     }
+    delete(pBlock);
 };
 
-/*
 void BuddyAllocator::CleanUpAllocations()
 {
-    while (m_deferredDeletionQueue.empty() == false &&
-        g_CommandManager.IsFenceComplete(m_deferredDeletionQueue.front()->m_fenceValue))
+    // Take the blocks whose fences are complete, then free them without
+    // holding up other threads' deallocations
+    std::vector<BuddyBlock*> completedBlocks;
     {
-        BuddyBlock* pBlock = m_deferredDeletionQueue.front();
-        m_deferredDeletionQueue.pop();
+        std::lock_guard<std::mutex> lockGuard(m_deferredDeletionMutex);
+        while (m_deferredDeletionQueue.empty() == false &&
+            g_CommandManager.IsFenceComplete(m_deferredDeletionQueue.front()->m_fenceValue))
+        {
+            completedBlocks.push_back(m_deferredDeletionQueue.front());
+            m_deferredDeletionQueue.pop();
+        }
+    }
 
+    for (BuddyBlock* pBlock : completedBlocks)
+    {
         DeallocateInternal(pBlock);
     }
-}*/
+}
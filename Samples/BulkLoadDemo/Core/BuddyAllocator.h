@@ -16,7 +16,14 @@
 // When a block is de-allocated an attempt is made to merge it with it's 
 // neighbour (buddy) if it is contiguous and free.
 // Based on reference implementation by Bill Kristiansen
-//  
+//
+// The free blocks of each order are tracked by a bitmap, and the orders that
+// have any by a mask, so allocation finds the smallest free block that fits
+// with a few bit scans instead of searching and splitting recursively.
+// Allocate and Deallocate may be called from any thread.  Small blocks are
+// recycled through sharded caches before they reach the bitmaps, and blocks
+// are only returned once the GPU has passed the fence they were freed at.
+//
 
 #pragma once
 
@@ -24,14 +31,14 @@
 #include <vector>
 #include <queue>
 #include <mutex>
-#include <set>
+#include <atomic>
 
 // Unfortunately the api restricts the minimum size of a placed buffer resource to 64k
 #define MIN_PLACED_BUFFER_SIZE (64 * 1024)
 
 #if defined(PROFILE) || defined(_DEBUG)
-#define INCREASE_BUDDY_COUNTER(A, B) (A = A + B);
-#define DECREASE_BUDDY_COUNTER(A, B) (A = A - B);
+#define INCREASE_BUDDY_COUNTER(A, B) (A += B);
+#define DECREASE_BUDDY_COUNTER(A, B) (A -= B);
 #else
 #define INCREASE_BUDDY_COUNTER(A, B)
 #define DECREASE_BUDDY_COUNTER(A, B)
@@ -87,6 +94,9 @@ public:
 
     BuddyBlock* Allocate(uint32_t numElements, uint32_t elementSize, const void* initialData = nullptr);
 
+    // The block is returned to the allocator by CleanUpAllocations once the
+    // fence is complete.  Without one, the next fence of the graphics queue.
+    void Deallocate(BuddyBlock* pBlock, uint64_t fenceValue);
     void Deallocate(BuddyBlock* pBlock);
 
     inline bool IsOwner(const BuddyBlock &block)
@@ -94,15 +104,8 @@ public:
         return block.GetOffset() >= m_baseOffset && block.GetSize() <= m_maxBlockSize;
     }
 
-    inline void Reset()
-    {
-        // Clear the free blocks collection  
-        m_freeBlocks.clear();
-
-        // Initialize the pool with a free inner block of max inner block size  
-        m_freeBlocks.resize(m_maxOrder + 1);
-        m_freeBlocks[m_maxOrder].insert((size_t)0);
-    }
+    // Frees every block.  Not thread-safe.
+    void Reset();
 
     void CleanUpAllocations();
 
@@ -112,8 +115,18 @@ private:
 
     const D3D12_HEAP_TYPE m_heapType;
 
+    std::mutex m_deferredDeletionMutex;
     std::queue<BuddyBlock*> m_deferredDeletionQueue;
-    std::vector<std::set<size_t>> m_freeBlocks;
+
+    // Bit n of m_freeBits[order] is set when the block at offset (n << order)
+    // units is free.  Bit n of m_freeWords[order] is set when word n of
+    // m_freeBits[order] is non-zero, and bit n of m_freeOrders when order n
+    // has any free blocks.  All of them are guarded by m_mutex.
+    std::mutex m_mutex;
+    std::vector<std::vector<uint64_t>> m_freeBits;
+    std::vector<std::vector<uint64_t>> m_freeWords;
+    std::vector<size_t> m_freeCounts;
+    uint64_t m_freeOrders;
     UINT m_maxOrder;
     const size_t m_baseOffset;
     const size_t m_maxBlockSize;
@@ -142,8 +155,38 @@ private:
     size_t AllocateBlock(UINT order);
     void DeallocateBlock(size_t offset, UINT order);
 
+    inline bool IsBlockFree(UINT order, size_t index) const
+    {
+        return (m_freeBits[order][index >> 6] & (1ull << (index & 63))) != 0;
+    }
+
+    void SetBlockFree(UINT order, size_t index);
+    void ClearBlockFree(UINT order, size_t index);
+    size_t FindFreeBlock(UINT order) const;
+
+    // Freed blocks of the lowest orders wait in the calling thread's shard,
+    // unmerged, to be handed out again without taking m_mutex
+    static const UINT kNumCachedOrders = 4;
+    static const uint32_t kNumShards = 8;
+    static const uint32_t kShardCapacity = 16;
+
+    struct alignas(64) Shard
+    {
+        std::mutex Mutex;
+        uint32_t Counts[kNumCachedOrders];
+        size_t Offsets[kNumCachedOrders][kShardCapacity];
+    };
+
+    Shard m_shards[kNumShards];
+
+    bool PopCachedBlock(UINT order, size_t& offset);
+    bool PushCachedBlock(UINT order, size_t offset);
+
+    // Returns the cached blocks to the bitmaps, with m_mutex held
+    void FlushCachedBlocks();
+
 #if defined(PROFILE) || defined(_DEBUG)
-    size_t m_SpaceUsed;
-    size_t m_InternalFragmentation;
+    std::atomic<size_t> m_SpaceUsed;
+    std::atomic<size_t> m_InternalFragmentation;
 #endif
 };
@@ -14,10 +14,56 @@
 #include "pch.h"
 #include "CommandAllocatorPool.h"
 
+namespace
+{
+    // The allocators a thread discarded most recently, oldest first, for one
+    // of the pools it used.  A thread records for only a few queue types.
+    struct ThreadAllocatorCache
+    {
+        static const uint32_t kCapacity = 4;
+
+        const CommandAllocatorPool* Pool;
+        uint32_t Count;
+        uint64_t FenceValues[kCapacity];
+        ID3D12CommandAllocator* Allocators[kCapacity];
+    };
+
+    const uint32_t kMaxThreadCaches = 4;
+
+    // Trivially destructible, since threads may outlive the pools
+    thread_local ThreadAllocatorCache t_AllocatorCaches[kMaxThreadCaches];
+
+    ThreadAllocatorCache* GetThreadCache(const CommandAllocatorPool* Pool)
+    {
+        for (ThreadAllocatorCache& Cache : t_AllocatorCaches)
+        {
+            if (Cache.Pool == Pool)
+                return &Cache;
+
+            if (Cache.Pool == nullptr)
+            {
+                Cache.Pool = Pool;
+                return &Cache;
+            }
+        }
+
+        // This thread uses more pools than it has caches for, so it shares
+        // the FIFO only
+        return nullptr;
+    }
+}
+
 CommandAllocatorPool::CommandAllocatorPool(D3D12_COMMAND_LIST_TYPE Type) :
     m_cCommandListType(Type),
-    m_Device(nullptr)
+    m_Device(nullptr),
+    m_ReadyAllocators(new ReadyAllocator[kMaxAllocators]),
+    m_PushPosition(0),
+    m_PopPosition(0)
 {
+    static_assert((kMaxAllocators & (kMaxAllocators - 1)) == 0, "The FIFO's size must be a power of two");
+
+    for (uint32_t i = 0; i < kMaxAllocators; ++i)
+        m_ReadyAllocators[i].Sequence.store(i, std::memory_order_relaxed);
 }
 
 CommandAllocatorPool::~CommandAllocatorPool()
@@ -40,39 +86,131 @@ void CommandAllocatorPool::Shutdown()
 
 ID3D12CommandAllocator * CommandAllocatorPool::RequestAllocator(uint64_t CompletedFenceValue)
 {
-    std::lock_guard<std::mutex> LockGuard(m_AllocatorMutex);
-
     ID3D12CommandAllocator* pAllocator = nullptr;
 
-    if (!m_ReadyAllocators.empty())
+    // This thread's own allocators come first, then everyone else's
+    ThreadAllocatorCache* Cache = GetThreadCache(this);
+    if (Cache != nullptr && Cache->Count > 0 && Cache->FenceValues[0] <= CompletedFenceValue)
     {
-        std::pair<uint64_t, ID3D12CommandAllocator*>& AllocatorPair = m_ReadyAllocators.front();
-
-        if (AllocatorPair.first <= CompletedFenceValue)
+        pAllocator = Cache->Allocators[0];
+        --Cache->Count;
+        for (uint32_t i = 0; i < Cache->Count; ++i)
         {
-            pAllocator = AllocatorPair.second;
-            ASSERT_SUCCEEDED(pAllocator->Reset());
-            m_ReadyAllocators.pop();
+            Cache->FenceValues[i] = Cache->FenceValues[i + 1];
+            Cache->Allocators[i] = Cache->Allocators[i + 1];
         }
     }
+    else
+    {
+        pAllocator = PopReadyAllocator(CompletedFenceValue);
+    }
 
-    // If no allocator's were ready to be reused, create a new one
-    if (pAllocator == nullptr)
+    if (pAllocator != nullptr)
     {
-        ASSERT_SUCCEEDED(m_Device->CreateCommandAllocator(m_cCommandListType, MY_IID_PPV_ARGS(&pAllocator)));
-        wchar_t AllocatorName[32];
-        swprintf(AllocatorName, 32, L"CommandAllocator %zu", m_AllocatorPool.size());
-        pAllocator->SetName(AllocatorName);
-        m_AllocatorPool.push_back(pAllocator);
+        ASSERT_SUCCEEDED(pAllocator->Reset());
+        return pAllocator;
     }
 
+    // If no allocator's were ready to be reused, create a new one
+    std::lock_guard<std::mutex> LockGuard(m_AllocatorMutex);
+
+    ASSERT(m_AllocatorPool.size() < kMaxAllocators, "More than %u command allocators are in use", kMaxAllocators);
+
+    ASSERT_SUCCEEDED(m_Device->CreateCommandAllocator(m_cCommandListType, MY_IID_PPV_ARGS(&pAllocator)));
+    wchar_t AllocatorName[32];
+    swprintf(AllocatorName, 32, L"CommandAllocator %zu", m_AllocatorPool.size());
+    pAllocator->SetName(AllocatorName);
+    m_AllocatorPool.push_back(pAllocator);
+
     return pAllocator;
 }
 
 void CommandAllocatorPool::DiscardAllocator(uint64_t FenceValue, ID3D12CommandAllocator * Allocator)
 {
-    std::lock_guard<std::mutex> LockGuard(m_AllocatorMutex);
+    // That fence value indicates we are free to reset the allocator.  When
+    // this thread's cache is full, the allocator is shared instead.
+    ThreadAllocatorCache* Cache = GetThreadCache(this);
+    if (Cache != nullptr && Cache->Count < ThreadAllocatorCache::kCapacity)
+    {
+        Cache->FenceValues[Cache->Count] = FenceValue;
+        Cache->Allocators[Cache->Count] = Allocator;
+        ++Cache->Count;
+    }
+    else
+    {
+        PushReadyAllocator(FenceValue, Allocator);
+    }
+}
+
+//
+// The FIFO is a bounded ring in which producers and consumers each claim a
+// slot by advancing a position with compare-and-swap.  A consumer reads the
+// front slot's fence value before claiming it, and leaves it for later if the
+// GPU isn't done with it yet.
+//
+ID3D12CommandAllocator* CommandAllocatorPool::PopReadyAllocator(uint64_t CompletedFenceValue)
+{
+    uint64_t Position = m_PopPosition.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        ReadyAllocator& Slot = m_ReadyAllocators[Position & (kMaxAllocators - 1)];
+        int64_t Lap = (int64_t)Slot.Sequence.load(std::memory_order_acquire) - (int64_t)(Position + 1);
 
-    // That fence value indicates we are free to reset the allocator
-    m_ReadyAllocators.push(std::make_pair(FenceValue, Allocator));
+        if (Lap < 0)
+            return nullptr; // Nothing has been written there yet, so the FIFO is empty
+
+        if (Lap == 0)
+        {
+            if (Slot.FenceValue.load(std::memory_order_relaxed) > CompletedFenceValue)
+                return nullptr;
+
+            // If another thread took the slot first, the position will have
+            // moved on and the allocator read here is ignored
+            ID3D12CommandAllocator* Allocator = Slot.Allocator.load(std::memory_order_relaxed);
+            if (m_PopPosition.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed))
+            {
+                Slot.Sequence.store(Position + kMaxAllocators, std::memory_order_release);
+                return Allocator;
+            }
+        }
+        else
+        {
+            Position = m_PopPosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void CommandAllocatorPool::PushReadyAllocator(uint64_t FenceValue, ID3D12CommandAllocator* Allocator)
+{
+    uint64_t Position = m_PushPosition.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        ReadyAllocator& Slot = m_ReadyAllocators[Position & (kMaxAllocators - 1)];
+        int64_t Lap = (int64_t)Slot.Sequence.load(std::memory_order_acquire) - (int64_t)Position;
+
+        // There are never more allocators than slots.  If there were, this
+        // one is only released by Shutdown().
+        if (Lap < 0)
+        {
+            ASSERT(false, "The command allocator FIFO is full");
+            return;
+        }
+
+        if (Lap == 0)
+        {
+            if (m_PushPosition.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed))
+            {
+                Slot.FenceValue.store(FenceValue, std::memory_order_relaxed);
+                Slot.Allocator.store(Allocator, std::memory_order_relaxed);
+                Slot.Sequence.store(Position + 1, std::memory_order_release);
+                return;
+            }
+        }
+        else
+        {
+            Position = m_PushPosition.load(std::memory_order_relaxed);
+        }
+    }
 }
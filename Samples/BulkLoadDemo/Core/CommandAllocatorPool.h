@@ -14,10 +14,18 @@
 #pragma once
 
 #include <vector>
-#include <queue>
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <stdint.h>
 
+//
+// Allocators are recycled by the fence value that tells when the GPU is done
+// with them.  Each thread keeps the last few allocators it discarded, and
+// reuses them without touching anything shared.  The rest go to a lock-free
+// FIFO shared by every thread, so that contexts recorded on many threads at
+// once don't serialize here.  Only creating a new allocator takes a lock.
+//
 class CommandAllocatorPool
 {
 public:
@@ -32,11 +40,30 @@ public:
 
     inline size_t Size() { return m_AllocatorPool.size(); }
 
+    // No more allocators than this are created for one queue, so the FIFO
+    // always has room for every one of them
+    static const uint32_t kMaxAllocators = 1024;
+
 private:
+    ID3D12CommandAllocator* PopReadyAllocator(uint64_t CompletedFenceValue);
+    void PushReadyAllocator(uint64_t FenceValue, ID3D12CommandAllocator* Allocator);
+
+    // A slot in the FIFO.  Its sequence number says whether it's waiting to
+    // be written or read, and for which lap of the ring.
+    struct ReadyAllocator
+    {
+        std::atomic<uint64_t> Sequence;
+        std::atomic<uint64_t> FenceValue;
+        std::atomic<ID3D12CommandAllocator*> Allocator;
+    };
+
     const D3D12_COMMAND_LIST_TYPE m_cCommandListType;
 
     ID3D12Device* m_Device;
     std::vector<ID3D12CommandAllocator*> m_AllocatorPool;
-    std::queue<std::pair<uint64_t, ID3D12CommandAllocator*>> m_ReadyAllocators;
     std::mutex m_AllocatorMutex;
+
+    std::unique_ptr<ReadyAllocator[]> m_ReadyAllocators;
+    alignas(64) std::atomic<uint64_t> m_PushPosition;
+    alignas(64) std::atomic<uint64_t> m_PopPosition;
 };
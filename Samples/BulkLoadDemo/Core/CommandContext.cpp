@@ -131,30 +131,54 @@ uint64_t CommandContext::Flush(bool WaitForCompletion)
 
 uint64_t CommandContext::Finish( bool WaitForCompletion )
 {
-    ASSERT(m_Type == D3D12_COMMAND_LIST_TYPE_DIRECT || m_Type == D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    CommandContext* Context = this;
+    return FinishBatch(&Context, 1, WaitForCompletion);
+}
 
-    FlushResourceBarriers();
+uint64_t CommandContext::FinishBatch( CommandContext* const* Contexts, size_t NumContexts, bool WaitForCompletion )
+{
+    ASSERT(NumContexts > 0);
 
-    if (m_ID.length() > 0)
-        EngineProfiling::EndBlock(this);
+    const D3D12_COMMAND_LIST_TYPE Type = Contexts[0]->m_Type;
+    ASSERT(Type == D3D12_COMMAND_LIST_TYPE_DIRECT || Type == D3D12_COMMAND_LIST_TYPE_COMPUTE);
 
-    ASSERT(m_CurrentAllocator != nullptr);
+    std::vector<ID3D12CommandList*> CommandLists(NumContexts);
+    for (size_t i = 0; i < NumContexts; ++i)
+    {
+        CommandContext& Context = *Contexts[i];
+        ASSERT(Context.m_Type == Type, "Contexts in a batch must share a queue");
 
-    CommandQueue& Queue = g_CommandManager.GetQueue(m_Type);
+        Context.FlushResourceBarriers();
 
-    uint64_t FenceValue = Queue.ExecuteCommandList(m_CommandList);
-    Queue.DiscardAllocator(FenceValue, m_CurrentAllocator);
-    m_CurrentAllocator = nullptr;
+        if (Context.m_ID.length() > 0)
+            EngineProfiling::EndBlock(&Context);
+
+        ASSERT(Context.m_CurrentAllocator != nullptr);
+        CommandLists[i] = Context.m_CommandList;
+    }
 
-    m_CpuLinearAllocator.CleanupUsedPages(FenceValue);
-    m_GpuLinearAllocator.CleanupUsedPages(FenceValue);
-    m_DynamicViewDescriptorHeap.CleanupUsedHeaps(FenceValue);
-    m_DynamicSamplerDescriptorHeap.CleanupUsedHeaps(FenceValue);
+    CommandQueue& Queue = g_CommandManager.GetQueue(Type);
+
+    uint64_t FenceValue = Queue.ExecuteCommandLists((UINT)NumContexts, CommandLists.data());
+
+    for (size_t i = 0; i < NumContexts; ++i)
+    {
+        CommandContext& Context = *Contexts[i];
+
+        Queue.DiscardAllocator(FenceValue, Context.m_CurrentAllocator);
+        Context.m_CurrentAllocator = nullptr;
+
+        Context.m_CpuLinearAllocator.CleanupUsedPages(FenceValue);
+        Context.m_GpuLinearAllocator.CleanupUsedPages(FenceValue);
+        Context.m_DynamicViewDescriptorHeap.CleanupUsedHeaps(FenceValue);
+        Context.m_DynamicSamplerDescriptorHeap.CleanupUsedHeaps(FenceValue);
+    }
 
     if (WaitForCompletion)
         g_CommandManager.WaitForFence(FenceValue);
 
-    g_ContextManager.FreeContext(this);
+    for (size_t i = 0; i < NumContexts; ++i)
+        g_ContextManager.FreeContext(Contexts[i]);
 
     return FenceValue;
 }
@@ -168,6 +192,7 @@ CommandContext::CommandContext(D3D12_COMMAND_LIST_TYPE Type) :
 {
     m_OwningManager = nullptr;
     m_CommandList = nullptr;
+    m_CommandList6 = nullptr;
     m_CurrentAllocator = nullptr;
     ZeroMemory(m_CurrentDescriptorHeaps, sizeof(m_CurrentDescriptorHeaps));
 
@@ -179,6 +204,8 @@ CommandContext::CommandContext(D3D12_COMMAND_LIST_TYPE Type) :
 
 CommandContext::~CommandContext( void )
 {
+    if (m_CommandList6 != nullptr)
+        m_CommandList6->Release();
     if (m_CommandList != nullptr)
         m_CommandList->Release();
 }
@@ -186,6 +213,10 @@ CommandContext::~CommandContext( void )
 void CommandContext::Initialize(void)
 {
     g_CommandManager.CreateNewCommandList(m_Type, &m_CommandList, &m_CurrentAllocator);
+
+    // Older runtimes don't have mesh shaders, which only DispatchMesh() needs
+    if (FAILED(m_CommandList->QueryInterface(MY_IID_PPV_ARGS(&m_CommandList6))))
+        m_CommandList6 = nullptr;
 }
 
 void CommandContext::Reset( void )
@@ -104,6 +104,11 @@ public:
     // Flush existing commands and release the current context
     uint64_t Finish( bool WaitForCompletion = false );
 
+    // Finish several contexts of the same type with one ExecuteCommandLists call.  The GPU runs them
+    // in the order given, so contexts recorded in parallel see each other's work as if they'd been
+    // finished one after another.
+    static uint64_t FinishBatch( CommandContext* const* Contexts, size_t NumContexts, bool WaitForCompletion = false );
+
     // Prepare to render by reserving a command list and command allocator
     void Initialize(void);
 
@@ -168,6 +173,7 @@ protected:
 
     CommandListManager* m_OwningManager;
     ID3D12GraphicsCommandList* m_CommandList;
+    ID3D12GraphicsCommandList6* m_CommandList6;   // For DispatchMesh(), or null if the runtime doesn't have it
     ID3D12CommandAllocator* m_CurrentAllocator;
 
     ID3D12RootSignature* m_CurGraphicsRootSignature;
@@ -237,6 +243,7 @@ public:
     void SetConstants( UINT RootIndex, DWParam X, DWParam Y, DWParam Z );
     void SetConstants( UINT RootIndex, DWParam X, DWParam Y, DWParam Z, DWParam W );
     void SetConstantBuffer( UINT RootIndex, D3D12_GPU_VIRTUAL_ADDRESS CBV );
+    void SetShaderResourceView( UINT RootIndex, D3D12_GPU_VIRTUAL_ADDRESS SRV );
     void SetDynamicConstantBufferView( UINT RootIndex, size_t BufferSize, const void* BufferData );
     void SetBufferSRV( UINT RootIndex, const GpuBuffer& SRV, UINT64 Offset = 0);
     void SetBufferUAV( UINT RootIndex, const GpuBuffer& UAV, UINT64 Offset = 0);
@@ -261,6 +268,7 @@ public:
     void DrawIndexedInstanced(UINT IndexCountPerInstance, UINT InstanceCount, UINT StartIndexLocation,
         INT BaseVertexLocation, UINT StartInstanceLocation);
     void DrawIndirect( GpuBuffer& ArgumentBuffer, uint64_t ArgumentBufferOffset = 0 );
+    void DispatchMesh( UINT GroupCountX, UINT GroupCountY = 1, UINT GroupCountZ = 1 );
     void ExecuteIndirect(CommandSignature& CommandSig, GpuBuffer& ArgumentBuffer, uint64_t ArgumentStartOffset = 0,
         uint32_t MaxCommands = 1, GpuBuffer* CommandCounterBuffer = nullptr, uint64_t CounterOffset = 0);
 
@@ -456,6 +464,11 @@ inline void GraphicsContext::SetConstantBuffer( UINT RootIndex, D3D12_GPU_VIRTUA
     m_CommandList->SetGraphicsRootConstantBufferView(RootIndex, CBV);
 }
 
+inline void GraphicsContext::SetShaderResourceView( UINT RootIndex, D3D12_GPU_VIRTUAL_ADDRESS SRV )
+{
+    m_CommandList->SetGraphicsRootShaderResourceView(RootIndex, SRV);
+}
+
 inline void GraphicsContext::SetDynamicConstantBufferView( UINT RootIndex, size_t BufferSize, const void* BufferData )
 {
     ASSERT(BufferData != nullptr && Math::IsAligned(BufferData, 16));
@@ -700,6 +713,15 @@ inline void GraphicsContext::DrawIndexedInstanced(UINT IndexCountPerInstance, UI
     m_CommandList->DrawIndexedInstanced(IndexCountPerInstance, InstanceCount, StartIndexLocation, BaseVertexLocation, StartInstanceLocation);
 }
 
+inline void GraphicsContext::DispatchMesh( UINT GroupCountX, UINT GroupCountY, UINT GroupCountZ )
+{
+    ASSERT(m_CommandList6 != nullptr, "Mesh shaders aren't supported");
+    FlushResourceBarriers();
+    m_DynamicViewDescriptorHeap.CommitGraphicsRootDescriptorTables(m_CommandList);
+    m_DynamicSamplerDescriptorHeap.CommitGraphicsRootDescriptorTables(m_CommandList);
+    m_CommandList6->DispatchMesh(GroupCountX, GroupCountY, GroupCountZ);
+}
+
 inline void GraphicsContext::ExecuteIndirect(CommandSignature& CommandSig,
     GpuBuffer& ArgumentBuffer, uint64_t ArgumentStartOffset,
     uint32_t MaxCommands, GpuBuffer* CommandCounterBuffer, uint64_t CounterOffset)
@@ -966,27 +966,28 @@ static HRESULT CreateD3DResources( _In_ ID3D12Device* d3dDevice,
 }
 
 //--------------------------------------------------------------------------------------
-static HRESULT CreateTextureFromDDS( _In_ ID3D12Device* d3dDevice,
-                                     _In_ const DDS_HEADER* header,
-                                     _In_reads_bytes_(bitSize) const uint8_t* bitData,
-                                     _In_ size_t bitSize,
-                                     _In_ size_t maxsize,
-                                     _In_ bool forceSRGB,
-                                     _Outptr_opt_ ID3D12Resource** texture,
-                                     _In_ D3D12_CPU_DESCRIPTOR_HANDLE textureView )
+// Get the dimensions and format of the texture that a DDS header describes
+//--------------------------------------------------------------------------------------
+static HRESULT GetTextureInfo( _In_ const DDS_HEADER* header,
+                               _Out_ uint32_t& resDim,
+                               _Out_ UINT& width,
+                               _Out_ UINT& height,
+                               _Out_ UINT& depth,
+                               _Out_ size_t& mipCount,
+                               _Out_ UINT& arraySize,
+                               _Out_ DXGI_FORMAT& format,
+                               _Out_ bool& isCubeMap )
 {
-    HRESULT hr = S_OK;
+    width = header->width;
+    height = header->height;
+    depth = header->depth;
 
-    UINT width = header->width;
-    UINT height = header->height;
-    UINT depth = header->depth;
+    resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+    arraySize = 1;
+    format = DXGI_FORMAT_UNKNOWN;
+    isCubeMap = false;
 
-    uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
-    UINT arraySize = 1;
-    DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
-    bool isCubeMap = false;
-
-    size_t mipCount = header->mipMapCount;
+    mipCount = header->mipMapCount;
     if (0 == mipCount)
     {
         mipCount = 1;
@@ -1142,6 +1143,37 @@ static HRESULT CreateTextureFromDDS( _In_ ID3D12Device* d3dDevice,
         return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
     }
 
+    return S_OK;
+}
+
+
+//--------------------------------------------------------------------------------------
+static HRESULT CreateTextureFromDDS( _In_ ID3D12Device* d3dDevice,
+                                     _In_ const DDS_HEADER* header,
+                                     _In_reads_bytes_(bitSize) const uint8_t* bitData,
+                                     _In_ size_t bitSize,
+                                     _In_ size_t maxsize,
+                                     _In_ bool forceSRGB,
+                                     _Outptr_opt_ ID3D12Resource** texture,
+                                     _In_ D3D12_CPU_DESCRIPTOR_HANDLE textureView )
+{
+    HRESULT hr = S_OK;
+
+    uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+    UINT width = 0;
+    UINT height = 0;
+    UINT depth = 0;
+    size_t mipCount = 0;
+    UINT arraySize = 0;
+    DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+    bool isCubeMap = false;
+
+    hr = GetTextureInfo( header, resDim, width, height, depth, mipCount, arraySize, format, isCubeMap );
+    if ( FAILED(hr) )
+    {
+        return hr;
+    }
+
     {
         // Create the texture
         UINT subresourceCount = static_cast<UINT>(mipCount) * arraySize;
@@ -1348,3 +1380,222 @@ HRESULT CreateDDSTextureFromFile(
 
     return hr;
 }
+
+
+_Use_decl_annotations_
+HRESULT GetDDSTextureLayout(
+    const uint8_t* ddsHeader,
+    size_t headerSize,
+    uint64_t fileSize,
+    bool forceSRGB,
+    DDS_TEXTURE_LAYOUT* layout )
+{
+    if (!ddsHeader || !layout)
+    {
+        return E_INVALIDARG;
+    }
+
+    if (headerSize < (sizeof(uint32_t) + sizeof(DDS_HEADER)))
+    {
+        return E_FAIL;
+    }
+
+    uint32_t dwMagicNumber = *( const uint32_t* )( ddsHeader );
+    if (dwMagicNumber != DDS_MAGIC)
+    {
+        return E_FAIL;
+    }
+
+    auto header = reinterpret_cast<const DDS_HEADER*>( ddsHeader + sizeof( uint32_t ) );
+
+    if (header->size != sizeof(DDS_HEADER) ||
+        header->ddspf.size != sizeof(DDS_PIXELFORMAT))
+    {
+        return E_FAIL;
+    }
+
+    size_t offset = sizeof(DDS_HEADER) + sizeof(uint32_t);
+
+    if (header->ddspf.flags & DDS_FOURCC)
+    {
+        if (MAKEFOURCC( 'D', 'X', '1', '0' ) == header->ddspf.fourCC)
+            offset += sizeof(DDS_HEADER_DXT10);
+    }
+
+    if (headerSize < offset)
+        return E_FAIL;
+
+    uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+    UINT width = 0;
+    UINT height = 0;
+    UINT depth = 0;
+    size_t mipCount = 0;
+    UINT arraySize = 0;
+    DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+    bool isCubeMap = false;
+
+    HRESULT hr = GetTextureInfo( header, resDim, width, height, depth, mipCount, arraySize, format, isCubeMap );
+    if ( FAILED(hr) )
+    {
+        return hr;
+    }
+
+    if (resDim == D3D12_RESOURCE_DIMENSION_TEXTURE3D)
+    {
+        return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+    }
+
+    if ( forceSRGB )
+    {
+        format = MakeSRGB( format );
+    }
+
+    D3D12_RESOURCE_DESC& desc = layout->Desc;
+    desc = {};
+    desc.Dimension = static_cast<D3D12_RESOURCE_DIMENSION>( resDim );
+    desc.Width = width;
+    desc.Height = height;
+    desc.DepthOrArraySize = static_cast<UINT16>( arraySize );
+    desc.MipLevels = static_cast<UINT16>( mipCount );
+    desc.Format = format;
+    desc.SampleDesc.Count = 1;
+    desc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+
+    D3D12_SHADER_RESOURCE_VIEW_DESC& SRVDesc = layout->SRVDesc;
+    SRVDesc = {};
+    SRVDesc.Format = format;
+    SRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+    if (resDim == D3D12_RESOURCE_DIMENSION_TEXTURE1D)
+    {
+        if (arraySize > 1)
+        {
+            SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE1DARRAY;
+            SRVDesc.Texture1DArray.MipLevels = desc.MipLevels;
+            SRVDesc.Texture1DArray.ArraySize = arraySize;
+        }
+        else
+        {
+            SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE1D;
+            SRVDesc.Texture1D.MipLevels = desc.MipLevels;
+        }
+    }
+    else if ( isCubeMap )
+    {
+        if (arraySize > 6)
+        {
+            SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURECUBEARRAY;
+            SRVDesc.TextureCubeArray.MipLevels = desc.MipLevels;
+            SRVDesc.TextureCubeArray.NumCubes = arraySize / 6;
+        }
+        else
+        {
+            SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURECUBE;
+            SRVDesc.TextureCube.MipLevels = desc.MipLevels;
+        }
+    }
+    else if (arraySize > 1)
+    {
+        SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DARRAY;
+        SRVDesc.Texture2DArray.MipLevels = desc.MipLevels;
+        SRVDesc.Texture2DArray.ArraySize = arraySize;
+    }
+    else
+    {
+        SRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+        SRVDesc.Texture2D.MipLevels = desc.MipLevels;
+    }
+
+    // A packed file's chunks replace the data that would follow the headers
+    layout->PackedCompressionFormat = 0;
+    layout->PackedChunks.clear();
+
+    auto packedHeader = reinterpret_cast<const DDS_PACKED_HEADER*>( ddsHeader + offset );
+    if (headerSize >= offset + sizeof(DDS_PACKED_HEADER) && packedHeader->Magic == DDS_PACKED_MAGIC)
+    {
+        if (packedHeader->Version != DDS_PACKED_VERSION)
+        {
+            return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+        }
+
+        size_t chunksOffset = offset + sizeof(DDS_PACKED_HEADER);
+        if (headerSize < chunksOffset + packedHeader->NumChunks * sizeof(DDS_PACKED_CHUNK))
+        {
+            return E_FAIL;
+        }
+
+        auto chunks = reinterpret_cast<const DDS_PACKED_CHUNK*>( ddsHeader + chunksOffset );
+        uint32_t nextSubresource = 0;
+        for (uint32_t i = 0; i < packedHeader->NumChunks; ++i)
+        {
+            if (chunks[i].FirstSubresource != nextSubresource || chunks[i].Offset + chunks[i].Size > fileSize)
+            {
+                return E_FAIL;
+            }
+            nextSubresource += chunks[i].NumSubresources;
+        }
+
+        if (nextSubresource != mipCount * arraySize)
+        {
+            return E_FAIL;
+        }
+
+        layout->PackedCompressionFormat = packedHeader->CompressionFormat;
+        layout->PackedChunks.assign( chunks, chunks + packedHeader->NumChunks );
+
+        // None of the tightly packed data is in the file
+        fileSize = UINT64_MAX;
+    }
+
+    // The subresources follow the headers in the same order as D3D12's: every
+    // mip of the first array slice, then every mip of the next, and so on.
+    layout->BlockHeight = 1;
+    layout->Subresources.clear();
+    layout->Subresources.reserve( mipCount * arraySize );
+
+    uint64_t dataOffset = offset;
+    for( size_t j = 0; j < arraySize; j++ )
+    {
+        size_t w = width;
+        size_t h = height;
+        for( size_t i = 0; i < mipCount; i++ )
+        {
+            size_t NumBytes = 0;
+            size_t RowBytes = 0;
+            size_t NumRows = 0;
+            GetSurfaceInfo( w, h, format, &NumBytes, &RowBytes, &NumRows );
+
+            // Planar formats have more rows than texels, and can't be read a
+            // row at a time
+            if (NumRows > h)
+            {
+                return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+            }
+
+            if (NumRows < h)
+            {
+                layout->BlockHeight = 4;
+            }
+
+            if (dataOffset + NumBytes > fileSize)
+            {
+                return HRESULT_FROM_WIN32( ERROR_HANDLE_EOF );
+            }
+
+            DDS_SUBRESOURCE_LAYOUT subresource;
+            subresource.Offset = dataOffset;
+            subresource.RowPitch = static_cast<uint32_t>( RowBytes );
+            subresource.NumRows = static_cast<uint32_t>( NumRows );
+            subresource.Width = static_cast<uint32_t>( w );
+            subresource.Height = static_cast<uint32_t>( h );
+            layout->Subresources.push_back( subresource );
+
+            dataOffset += NumBytes;
+
+            w = std::max<size_t>( w >> 1, 1 );
+            h = std::max<size_t>( h >> 1, 1 );
+        }
+    }
+
+    return S_OK;
+}
@@ -27,6 +27,8 @@
 #include <stdint.h>
 #pragma warning(pop)
 
+#include <vector>
+
 enum DDS_ALPHA_MODE
 {
     DDS_ALPHA_MODE_UNKNOWN       = 0,
@@ -56,3 +58,70 @@ HRESULT __cdecl CreateDDSTextureFromFile( _In_ ID3D12Device* d3dDevice,
                                             );
 
 size_t BitsPerPixel(_In_ DXGI_FORMAT fmt);
+
+// The magic number, header and DX10 header extension at the start of a DDS file
+const size_t DDS_MAX_HEADER_SIZE = sizeof(uint32_t) + 124 + 20;
+
+// Where one subresource's data is in a DDS file.  The rows are tightly packed, so
+// RowPitch needn't be a multiple of D3D12_TEXTURE_DATA_PITCH_ALIGNMENT.  For
+// block-compressed formats each row is a row of blocks.
+struct DDS_SUBRESOURCE_LAYOUT
+{
+    uint64_t Offset;
+    uint32_t RowPitch;
+    uint32_t NumRows;
+    uint32_t Width;
+    uint32_t Height;
+};
+
+// A DDS file packed for DirectStorage, by MiniArchive's -dds option, has a
+// DDS_PACKED_HEADER and its chunks straight after the usual headers, all within
+// the first DDS_PACKED_MAX_HEADER_SIZE bytes.  Each chunk is a run of
+// subresources laid out as GetCopyableFootprints places them, and possibly
+// compressed, so that it's read by a single
+// DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES request.
+const uint32_t DDS_PACKED_MAGIC = 0x4b505344; // "DSPK"
+const uint32_t DDS_PACKED_VERSION = 1;
+const size_t DDS_PACKED_MAX_HEADER_SIZE = 4096;
+
+struct DDS_PACKED_HEADER
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t CompressionFormat; // A DSTORAGE_COMPRESSION_FORMAT, the same for every chunk
+    uint32_t NumChunks;
+};
+
+struct DDS_PACKED_CHUNK
+{
+    uint64_t Offset;
+    uint32_t Size;
+    uint32_t UncompressedSize;
+    uint32_t FirstSubresource;
+    uint32_t NumSubresources;
+};
+
+struct DDS_TEXTURE_LAYOUT
+{
+    D3D12_RESOURCE_DESC Desc;
+    D3D12_SHADER_RESOURCE_VIEW_DESC SRVDesc;
+    uint32_t BlockHeight;   // Texels per row of data
+    std::vector<DDS_SUBRESOURCE_LAYOUT> Subresources;   // In D3D12 subresource order
+
+    // Only for packed files, whose Subresources describe the data as it was
+    // before it was packed
+    uint32_t PackedCompressionFormat;
+    std::vector<DDS_PACKED_CHUNK> PackedChunks;
+};
+
+// Describes the texture in a DDS file, and where each subresource's data is, from
+// the first DDS_MAX_HEADER_SIZE bytes of the file (or all of it, if it's smaller).
+// This lets a loader read the data straight into the texture.  For packed files
+// the first DDS_PACKED_MAX_HEADER_SIZE bytes are needed, to find the chunks.
+// Volume textures aren't supported.
+HRESULT __cdecl GetDDSTextureLayout( _In_reads_bytes_(headerSize) const uint8_t* ddsHeader,
+                                     _In_ size_t headerSize,
+                                     _In_ uint64_t fileSize,
+                                     _In_ bool forceSRGB,
+                                     _Out_ DDS_TEXTURE_LAYOUT* layout
+                                   );
@@ -101,7 +101,7 @@ void DepthOfField::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(s_RootSignature); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO( s_DoFPass1CS, g_pDoFPass1CS);
     CreatePSO( s_DoFTilePassCS, g_pDoFTilePassCS);
@@ -29,10 +29,9 @@ void DescriptorAllocator::DestroyAll(void)
     sm_DescriptorHeapPool.clear();
 }
 
+// Called with sm_AllocationMutex held
 ID3D12DescriptorHeap* DescriptorAllocator::RequestNewHeap(D3D12_DESCRIPTOR_HEAP_TYPE Type)
 {
-    std::lock_guard<std::mutex> LockGuard(sm_AllocationMutex);
-
     D3D12_DESCRIPTOR_HEAP_DESC Desc;
     Desc.Type = Type;
     Desc.NumDescriptors = sm_NumDescriptorsPerHeap;
@@ -47,6 +46,9 @@ ID3D12DescriptorHeap* DescriptorAllocator::RequestNewHeap(D3D12_DESCRIPTOR_HEAP_
 
 D3D12_CPU_DESCRIPTOR_HANDLE DescriptorAllocator::Allocate( uint32_t Count )
 {
+    // Buffers are also created on worker threads, e.g. for model instances
+    std::lock_guard<std::mutex> LockGuard(sm_AllocationMutex);
+
     if (m_CurrentHeap == nullptr || m_RemainingFreeHandles < Count)
     {
         m_CurrentHeap = RequestNewHeap(m_Type);
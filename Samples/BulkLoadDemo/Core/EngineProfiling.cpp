@@ -22,6 +22,10 @@
 #include <vector>
 #include <unordered_map>
 #include <array>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
 
 using namespace Graphics;
 using namespace GraphRenderer;
@@ -34,6 +38,123 @@ namespace EngineProfiling
     bool Paused = false;
 }
 
+namespace
+{
+    BoolVar RecordTrace("Profiling/Record Trace", false);
+
+    struct TraceEvent
+    {
+        const char* Name;
+        const char* Track;  // Only for intervals
+        int64_t StartTick;
+        int64_t EndTick;
+    };
+
+    // The most recent events of one thread, or of the GPU.  Only that thread
+    // writes them, and the count is published after each event, so the trace
+    // can be exported while they're still being recorded.
+    struct TraceTimeline
+    {
+        static const uint32_t kCapacity = 8192;
+
+        // The oldest events may be overwritten while they're exported
+        static const uint32_t kExportSlack = kCapacity / 16;
+
+        uint32_t ThreadId;  // 0 for the GPU
+        std::atomic<uint64_t> NumEvents = 0;
+        TraceEvent Events[kCapacity];
+
+        void Record(const char* Name, const char* Track, int64_t StartTick, int64_t EndTick)
+        {
+            uint64_t Index = NumEvents.load(std::memory_order_relaxed);
+            Events[Index % kCapacity] = { Name, Track, StartTick, EndTick };
+            NumEvents.store(Index + 1, std::memory_order_release);
+        }
+    };
+
+    // Timelines are never freed, since threadpool threads may record until
+    // the process exits.  The mutex is only taken to add one or to export.
+    std::mutex s_TraceMutex;
+    std::vector<TraceTimeline*> s_TraceTimelines;
+    TraceTimeline* s_GpuTimeline = nullptr;
+
+    // The open scopes of the calling thread, which needn't have a timeline
+    // unless the trace is being recorded
+    const uint32_t kMaxTraceDepth = 32;
+    thread_local TraceTimeline* t_TraceTimeline = nullptr;
+    thread_local uint32_t t_TraceDepth = 0;
+    thread_local const char* t_TraceNames[kMaxTraceDepth];
+    thread_local int64_t t_TraceStartTicks[kMaxTraceDepth];
+
+    TraceTimeline* CreateTimeline(uint32_t ThreadId)
+    {
+        TraceTimeline* Timeline = new TraceTimeline;
+        Timeline->ThreadId = ThreadId;
+
+        std::lock_guard<std::mutex> Lock(s_TraceMutex);
+        s_TraceTimelines.push_back(Timeline);
+        return Timeline;
+    }
+
+    TraceTimeline& GetThreadTimeline()
+    {
+        if (t_TraceTimeline == nullptr)
+            t_TraceTimeline = CreateTimeline(GetCurrentThreadId());
+        return *t_TraceTimeline;
+    }
+
+    // Called only from UpdateTimes, as the GPU timers are read back
+    void RecordGpuEvent(const char* Name, int64_t StartTick, int64_t EndTick)
+    {
+        if (s_GpuTimeline == nullptr)
+            s_GpuTimeline = CreateTimeline(0);
+        s_GpuTimeline->Record(Name, nullptr, StartTick, EndTick);
+    }
+
+    std::string GetTimelineName(uint32_t ThreadId)
+    {
+        if (ThreadId == 0)
+            return "GPU";
+
+        std::string Name = "Thread " + std::to_string(ThreadId);
+
+        HANDLE Thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, ThreadId);
+        if (Thread != nullptr)
+        {
+            PWSTR Description = nullptr;
+            if (SUCCEEDED(GetThreadDescription(Thread, &Description)))
+            {
+                if (Description[0] != L'\0')
+                    Name = Utility::WideStringToUTF8(Description) + " (" + std::to_string(ThreadId) + ")";
+                LocalFree(Description);
+            }
+            CloseHandle(Thread);
+        }
+
+        return Name;
+    }
+
+    void WriteJsonString(std::ostream& Out, const char* Str)
+    {
+        Out << '"';
+        for (; *Str; ++Str)
+        {
+            if (*Str == '"' || *Str == '\\')
+                Out << '\\';
+            if (static_cast<unsigned char>(*Str) >= 0x20)
+                Out << *Str;
+        }
+        Out << '"';
+    }
+
+    CallbackTrigger ExportTraceTrigger("Profiling/Export Trace", [](void*)
+    {
+        const wchar_t* FileName = L"Trace.json";
+        bool Succeeded = EngineProfiling::ExportTrace(FileName);
+        Utility::Printf(L"%ls %ls\n", Succeeded ? L"Exported" : L"Failed to export", FileName);
+    });
+}
+
 class StatHistory
 {
 public:
@@ -195,7 +316,8 @@ class NestedTimingTree
 {
 public:
     NestedTimingTree( const wstring& name, NestedTimingTree* parent = nullptr )
-        : m_Name(name), m_Parent(parent), m_IsExpanded(false), m_IsGraphed(false), m_GraphHandle(PERF_GRAPH_ERROR) {}
+        : m_Name(name), m_TraceName(Utility::WideStringToUTF8(name)), m_Parent(parent), m_IsExpanded(false),
+        m_IsGraphed(false), m_GraphHandle(PERF_GRAPH_ERROR) {}
 
     NestedTimingTree* GetChild( const wstring& name )
     {
@@ -318,6 +440,13 @@ public:
         m_CpuTime.RecordStat(FrameIndex, 1000.0f * (float)SystemTime::TimeBetweenTicks(m_StartTick, m_EndTick));
         m_GpuTime.RecordStat(FrameIndex, 1000.0f * m_GpuTimer.GetTime());
 
+        int64_t GpuStartTick, GpuEndTick;
+        if (RecordTrace && this != &sm_RootScope &&
+            GpuTimeManager::GetCpuTicks(m_GpuTimer.GetTimerIndex(), GpuStartTick, GpuEndTick))
+        {
+            RecordGpuEvent(m_TraceName.c_str(), GpuStartTick, GpuEndTick);
+        }
+
         for (auto node : m_Children)
             node->GatherTimes(FrameIndex);
 
@@ -390,6 +519,7 @@ private:
     }
 
     wstring m_Name;
+    string m_TraceName;
     NestedTimingTree* m_Parent;
     vector<NestedTimingTree*> m_Children;
     unordered_map<wstring, NestedTimingTree*> m_LUT;
@@ -436,14 +566,25 @@ namespace EngineProfiling
         NestedTimingTree::UpdateTimes();
     }
 
+    // The timing tree belongs to the thread that draws the frames, which is
+    // the one that runs static initialization.  Blocks on other threads, like
+    // passes recorded in parallel, only mark their context for PIX.
+    static const DWORD s_RenderThreadId = GetCurrentThreadId();
+
     void BeginBlock(const wstring& name, CommandContext* Context)
     {
-        NestedTimingTree::PushProfilingMarker(name, Context);
+        if (GetCurrentThreadId() == s_RenderThreadId)
+            NestedTimingTree::PushProfilingMarker(name, Context);
+        else if (Context != nullptr)
+            Context->PIXBeginEvent(name.c_str());
     }
 
     void EndBlock(CommandContext* Context)
     {
-        NestedTimingTree::PopProfilingMarker(Context);
+        if (GetCurrentThreadId() == s_RenderThreadId)
+            NestedTimingTree::PopProfilingMarker(Context);
+        else if (Context != nullptr)
+            Context->PIXEndEvent();
     }
 
     bool IsPaused()
@@ -451,6 +592,105 @@ namespace EngineProfiling
         return Paused;
     }
 
+    void BeginEvent(const char* name)
+    {
+        // Scopes opened while the trace isn't recorded are closed unrecorded
+        uint32_t Depth = t_TraceDepth++;
+        if (Depth < kMaxTraceDepth)
+        {
+            t_TraceNames[Depth] = RecordTrace ? name : nullptr;
+            t_TraceStartTicks[Depth] = RecordTrace ? SystemTime::GetCurrentTick() : 0;
+        }
+    }
+
+    void EndEvent()
+    {
+        ASSERT(t_TraceDepth > 0, "EndEvent without a BeginEvent");
+
+        uint32_t Depth = --t_TraceDepth;
+        if (Depth < kMaxTraceDepth && t_TraceNames[Depth] != nullptr && RecordTrace)
+        {
+            GetThreadTimeline().Record(
+                t_TraceNames[Depth], nullptr, t_TraceStartTicks[Depth], SystemTime::GetCurrentTick());
+        }
+    }
+
+    void RecordInterval(const char* track, const char* name, int64_t startTick, int64_t endTick)
+    {
+        if (RecordTrace)
+            GetThreadTimeline().Record(name, track, startTick, endTick);
+    }
+
+    bool ExportTrace(const wstring& fileName)
+    {
+        vector<TraceTimeline*> Timelines;
+        {
+            std::lock_guard<std::mutex> Lock(s_TraceMutex);
+            Timelines = s_TraceTimelines;
+        }
+
+        std::ofstream Out(fileName, std::ios::out | std::ios::trunc);
+        if (!Out)
+            return false;
+
+        // Scopes are complete events on their thread's track.  Intervals are
+        // async events, grouped by their track's name, since they can overlap.
+        const DWORD ProcessId = GetCurrentProcessId();
+        uint64_t NextIntervalId = 1;
+        const char* Separator = "\n";
+
+        Out << std::fixed << std::setprecision(3);
+        Out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        for (TraceTimeline* Timeline : Timelines)
+        {
+            Out << Separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << ProcessId
+                << ",\"tid\":" << Timeline->ThreadId << ",\"args\":{\"name\":";
+            WriteJsonString(Out, GetTimelineName(Timeline->ThreadId).c_str());
+            Out << "}}";
+            Separator = ",\n";
+
+            const uint64_t NumEvents = Timeline->NumEvents.load(std::memory_order_acquire);
+            uint64_t FirstEvent = 0;
+            if (NumEvents > TraceTimeline::kCapacity)
+                FirstEvent = NumEvents - TraceTimeline::kCapacity + TraceTimeline::kExportSlack;
+
+            for (uint64_t i = FirstEvent; i < NumEvents; ++i)
+            {
+                const TraceEvent& Event = Timeline->Events[i % TraceTimeline::kCapacity];
+                const double Start = SystemTime::TicksToMillisecs(Event.StartTick) * 1000.0;
+                const double End = SystemTime::TicksToMillisecs(Event.EndTick) * 1000.0;
+
+                if (Event.Track == nullptr)
+                {
+                    Out << Separator << "{\"name\":";
+                    WriteJsonString(Out, Event.Name);
+                    Out << ",\"ph\":\"X\",\"ts\":" << Start << ",\"dur\":" << (End - Start) << ",\"pid\":" << ProcessId
+                        << ",\"tid\":" << Timeline->ThreadId << "}";
+                }
+                else
+                {
+                    const uint64_t Id = NextIntervalId++;
+                    const char* Phases[] = { "b", "e" };
+                    const double Times[] = { Start, End };
+                    for (uint32_t Phase = 0; Phase < 2; ++Phase)
+                    {
+                        Out << Separator << "{\"name\":";
+                        WriteJsonString(Out, Event.Name);
+                        Out << ",\"cat\":";
+                        WriteJsonString(Out, Event.Track);
+                        Out << ",\"ph\":\"" << Phases[Phase] << "\",\"id\":" << Id << ",\"ts\":" << Times[Phase]
+                            << ",\"pid\":" << ProcessId << ",\"tid\":" << Timeline->ThreadId << "}";
+                    }
+                }
+            }
+        }
+
+        Out << "\n]}\n";
+        Out.close();
+        return !Out.fail();
+    }
+
     void DisplayFrameRate( TextContext& Text )
     {
         if (!DrawFrameRate)
@@ -464,6 +704,12 @@ namespace EngineProfiling
             cpuTime, gpuTime, (uint32_t)(frameRate + 0.5f));
     }
 
+    float GetGpuBusyFraction( void )
+    {
+        float frameDelta = NestedTimingTree::GetFrameDelta();
+        return frameDelta > 0.0f ? NestedTimingTree::GetTotalGpuTime() / 1000.0f / frameDelta : 0.0f;
+    }
+
     void DisplayPerfGraph( GraphicsContext& Context )
     {
         if (DrawPerfGraph)
@@ -502,10 +748,12 @@ void NestedTimingTree::PushProfilingMarker( const wstring& name, CommandContext*
 {
     sm_CurrentNode = sm_CurrentNode->GetChild(name);
     sm_CurrentNode->StartTiming(Context);
+    EngineProfiling::BeginEvent(sm_CurrentNode->m_TraceName.c_str());
 }
 
 void NestedTimingTree::PopProfilingMarker( CommandContext* Context )
 {
+    EngineProfiling::EndEvent();
     sm_CurrentNode->StopTiming(Context);
     sm_CurrentNode = sm_CurrentNode->m_Parent;
 }
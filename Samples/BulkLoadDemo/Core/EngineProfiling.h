@@ -26,9 +26,30 @@ namespace EngineProfiling
     void EndBlock(CommandContext* Context = nullptr);
 
     void DisplayFrameRate(TextContext& Text);
+
+    // The share of the frame that the GPU spends on the timed blocks,
+    // averaged over recent frames
+    float GetGpuBusyFraction(void);
+
     void DisplayPerfGraph(GraphicsContext& Text);
     void Display(TextContext& Text, float x, float y, float w, float h);
     bool IsPaused();
+
+    // Records a scope on the calling thread's timeline, while "Profiling/Record
+    // Trace" is set.  Any thread may record, without taking a lock.  The name
+    // is kept by pointer, so it should be a string literal.  The blocks above
+    // are recorded too, along with their GPU times.
+    void BeginEvent(const char* name);
+    void EndEvent();
+
+    // Records an interval measured elsewhere, eg. from submitting a batch of
+    // DirectStorage requests to its completion, on a track of its own.  Ticks
+    // are from SystemTime::GetCurrentTick.  Intervals on a track may overlap.
+    void RecordInterval(const char* track, const char* name, int64_t startTick, int64_t endTick);
+
+    // Writes the recorded events as a Chrome trace, for chrome://tracing or
+    // ui.perfetto.dev
+    bool ExportTrace(const std::wstring& fileName);
 }
 
 #ifdef RELEASE
@@ -38,6 +59,12 @@ public:
     ScopedTimer(const std::wstring&) {}
     ScopedTimer(const std::wstring&, CommandContext&) {}
 };
+
+class ScopedTraceEvent
+{
+public:
+    ScopedTraceEvent(const char*) {}
+};
 #else
 class ScopedTimer
 {
@@ -58,4 +85,17 @@ public:
 private:
     CommandContext* m_Context;
 };
+
+class ScopedTraceEvent
+{
+public:
+    ScopedTraceEvent( const char* name )
+    {
+        EngineProfiling::BeginEvent(name);
+    }
+    ~ScopedTraceEvent()
+    {
+        EngineProfiling::EndEvent();
+    }
+};
 #endif
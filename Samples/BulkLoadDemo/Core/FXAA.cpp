@@ -76,7 +76,7 @@ void FXAA::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(RootSig); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO(ResolveWorkCS, g_pFXAAResolveWorkQueueCS);
     if (g_bTypedUAVLoadSupport_R11G11B10_FLOAT)
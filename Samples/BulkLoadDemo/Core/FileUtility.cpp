@@ -129,8 +129,80 @@ ByteArray Utility::ReadFileSync( const wstring& fileName)
     return ReadFileHelperEx(make_shared<wstring>(fileName));
 }
 
+// An overlapped read of a whole file.  It's owned by its threadpool I/O callback once it has been issued.
+struct AsyncFileRead
+{
+    ~AsyncFileRead()
+    {
+        // The file must be closed before the threadpool I/O object
+        if (File != INVALID_HANDLE_VALUE)
+            CloseHandle(File);
+        if (Io != nullptr)
+            CloseThreadpoolIo(Io);
+    }
+
+    OVERLAPPED Overlapped = {};
+    HANDLE File = INVALID_HANDLE_VALUE;
+    PTP_IO Io = nullptr;
+    ByteArray Data;
+    task_completion_event<ByteArray> Completed;
+};
+
+static void CALLBACK OnFileReadComplete(PTP_CALLBACK_INSTANCE, void* context, void*, ULONG result,
+    ULONG_PTR bytesRead, PTP_IO)
+{
+    unique_ptr<AsyncFileRead> read(static_cast<AsyncFileRead*>(context));
+
+    task_completion_event<ByteArray> completed = read->Completed;
+    ByteArray data = (result == NO_ERROR && bytesRead == read->Data->size()) ? read->Data : NullFile;
+    read.reset();
+
+    completed.set(data);
+}
+
 task<ByteArray> Utility::ReadFileAsync(const wstring& fileName)
 {
     shared_ptr<wstring> SharedPtr = make_shared<wstring>(fileName);
-    return create_task( [=] { return ReadFileHelperEx(SharedPtr); } );
+
+    // A compressed version takes precedence, and has to be inflated on a worker thread anyway.  Checking the
+    // attributes is cheaper than the failed read that ReadFileHelperEx would otherwise try first.
+    WIN32_FILE_ATTRIBUTE_DATA zippedAttributes;
+    if (GetFileAttributesExW((fileName + L".gz").c_str(), GetFileExInfoStandard, &zippedAttributes))
+        return create_task( [=] { return ReadFileHelperEx(SharedPtr); } );
+
+    unique_ptr<AsyncFileRead> read = make_unique<AsyncFileRead>();
+    read->File = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (read->File == INVALID_HANDLE_VALUE)
+        return task_from_result(NullFile);
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(read->File, &fileSize))
+        return task_from_result(NullFile);
+
+    // A single ReadFile can't read more than 4 GiB
+    if (fileSize.HighPart != 0)
+        return create_task( [=] { return ReadFileHelper(*SharedPtr); } );
+
+    read->Data = make_shared<vector<byte> >( fileSize.LowPart );
+    if (fileSize.LowPart == 0)
+        return task_from_result(read->Data);
+
+    read->Io = CreateThreadpoolIo(read->File, OnFileReadComplete, read.get(), nullptr);
+    if (read->Io == nullptr)
+        return task_from_result(NullFile);
+
+    task<ByteArray> result(read->Completed);
+
+    // The completion is queued to the threadpool even if the read finishes straight away
+    StartThreadpoolIo(read->Io);
+    if (!ReadFile(read->File, read->Data->data(), fileSize.LowPart, nullptr, &read->Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        CancelThreadpoolIo(read->Io);
+        return task_from_result(NullFile);
+    }
+
+    read.release();
+    return result;
 }
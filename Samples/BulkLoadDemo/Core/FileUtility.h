@@ -31,7 +31,8 @@ namespace Utility
     // This operation blocks until the entire file is read.
     ByteArray ReadFileSync(const wstring& fileName);
 
-    // Same as previous except that it does not block but instead returns a task.
+    // Same as previous except that it does not block but instead returns a task.  Files without a ".gz"
+    // version are read with overlapped I/O straight into the returned array, so no thread waits on the read.
     task<ByteArray> ReadFileAsync(const wstring& fileName);
 
 } // namespace Utility
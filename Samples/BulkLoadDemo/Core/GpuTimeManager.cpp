@@ -28,6 +28,9 @@ namespace
     uint64_t sm_ValidTimeStart = 0;
     uint64_t sm_ValidTimeEnd = 0;
     double sm_GpuTickDelta = 0.0;
+    uint64_t sm_CalibrationGpuTimestamp = 0;
+    uint64_t sm_CalibrationCpuTimestamp = 0;
+    double sm_CpuTicksPerGpuTick = 0.0;
 }
 
 void GpuTimeManager::Initialize(uint32_t MaxNumTimers)
@@ -36,6 +39,10 @@ void GpuTimeManager::Initialize(uint32_t MaxNumTimers)
     Graphics::g_CommandManager.GetCommandQueue()->GetTimestampFrequency(&GpuFrequency);
     sm_GpuTickDelta = 1.0 / static_cast<double>(GpuFrequency);
 
+    LARGE_INTEGER CpuFrequency;
+    QueryPerformanceFrequency(&CpuFrequency);
+    sm_CpuTicksPerGpuTick = static_cast<double>(CpuFrequency.QuadPart) / static_cast<double>(GpuFrequency);
+
     D3D12_HEAP_PROPERTIES HeapProps;
     HeapProps.Type = D3D12_HEAP_TYPE_READBACK;
     HeapProps.CPUPageProperty = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
@@ -115,6 +122,10 @@ void GpuTimeManager::BeginReadBack(void)
     sm_ValidTimeStart = sm_TimeStampBuffer[0];
     sm_ValidTimeEnd = sm_TimeStampBuffer[1];
 
+    // Recalibrated every frame, so the clocks can't drift apart
+    Graphics::g_CommandManager.GetCommandQueue()->GetClockCalibration(
+        &sm_CalibrationGpuTimestamp, &sm_CalibrationCpuTimestamp);
+
     // On the first frame, with random values in the timestamp query heap, we can avoid a misstart.
     if (sm_ValidTimeEnd < sm_ValidTimeStart)
     {
@@ -150,3 +161,26 @@ float GpuTimeManager::GetTime(uint32_t TimerIdx)
 
     return static_cast<float>(sm_GpuTickDelta * (TimeStamp2 - TimeStamp1));
 }
+
+bool GpuTimeManager::GetCpuTicks(uint32_t TimerIdx, int64_t& StartTick, int64_t& StopTick)
+{
+    ASSERT(sm_TimeStampBuffer != nullptr, "Time stamp readback buffer is not mapped");
+    ASSERT(TimerIdx < sm_NumTimers, "Invalid GPU timer index");
+
+    uint64_t TimeStamp1 = sm_TimeStampBuffer[TimerIdx * 2];
+    uint64_t TimeStamp2 = sm_TimeStampBuffer[TimerIdx * 2 + 1];
+
+    if (TimeStamp1 < sm_ValidTimeStart || TimeStamp2 > sm_ValidTimeEnd || TimeStamp2 <= TimeStamp1 )
+        return false;
+
+    auto ToCpuTick = [](uint64_t TimeStamp)
+    {
+        double GpuTicks = static_cast<double>(static_cast<int64_t>(TimeStamp - sm_CalibrationGpuTimestamp));
+        int64_t CpuTicks = static_cast<int64_t>(GpuTicks * sm_CpuTicksPerGpuTick);
+        return static_cast<int64_t>(sm_CalibrationCpuTimestamp) + CpuTicks;
+    };
+
+    StartTick = ToCpuTick(TimeStamp1);
+    StopTick = ToCpuTick(TimeStamp2);
+    return true;
+}
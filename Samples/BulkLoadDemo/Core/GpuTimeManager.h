@@ -36,4 +36,8 @@ namespace GpuTimeManager
 
     // Returns the time in milliseconds between start and stop queries
     float GetTime(uint32_t TimerIdx);
+
+    // Returns the start and stop time stamps as SystemTime ticks, correlated by
+    // the queue's clock calibration, or false if the timer wasn't used
+    bool GetCpuTicks(uint32_t TimerIdx, int64_t& StartTick, int64_t& StopTick);
 }
@@ -275,7 +275,7 @@ void Graphics::InitializeCommonState(void)
 #define CreatePSO(ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(g_CommonRS); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO(g_GenerateMipsLinearPSO[0], g_pGenerateMipsLinearCS);
     CreatePSO(g_GenerateMipsLinearPSO[1], g_pGenerateMipsLinearOddXCS);
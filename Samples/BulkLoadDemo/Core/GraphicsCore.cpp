@@ -371,6 +371,9 @@ void Graphics::Initialize(void)
 
     g_CommandManager.Create(g_Device);
 
+    // PSOs compiled by earlier runs are loaded from the pipeline library
+    PSO::InitializeCache(L"PipelineCache.bin");
+
     // Common state was moved to GraphicsCommon.*
     InitializeCommonState();
 
@@ -17,13 +17,30 @@
 #include "GraphicsCore.h"
 #include "CommandListManager.h"
 #include <thread>
+#include <deque>
 
 using namespace Graphics;
 using namespace std;
 
+namespace
+{
+    // The pages a thread retired, for one allocator type.  Pages that the
+    // cache has no room for go back to the manager's shared pool.
+    struct ThreadPageCache
+    {
+        static const size_t kMaxPages = 16;
+
+        deque<pair<uint64_t, vector<LinearAllocationPage*>>> RetiredPages;
+        vector<LinearAllocationPage*> AvailablePages;
+        size_t NumPages = 0;
+    };
+
+    thread_local ThreadPageCache t_PageCaches[kNumAllocatorTypes];
+}
+
 LinearAllocatorType LinearAllocatorPageManager::sm_AutoType = kGpuExclusive;
 
-LinearAllocatorPageManager::LinearAllocatorPageManager()
+LinearAllocatorPageManager::LinearAllocatorPageManager() : m_NumPendingDeletions(0)
 {
     m_AllocationType = sm_AutoType;
     sm_AutoType = (LinearAllocatorType)(sm_AutoType + 1);
@@ -32,7 +49,37 @@ LinearAllocatorPageManager::LinearAllocatorPageManager()
 
 LinearAllocatorPageManager LinearAllocator::sm_PageManager[2];
 
+void LinearAllocatorPageManager::Destroy( void )
+{
+    // Other threads' caches are left pointing at destroyed pages, which is
+    // only safe because nothing records after this
+    t_PageCaches[m_AllocationType] = ThreadPageCache();
+    m_PagePool.clear();
+}
+
 LinearAllocationPage* LinearAllocatorPageManager::RequestPage()
+{
+    ThreadPageCache& Cache = t_PageCaches[m_AllocationType];
+
+    while (!Cache.RetiredPages.empty() && g_CommandManager.IsFenceComplete(Cache.RetiredPages.front().first))
+    {
+        vector<LinearAllocationPage*>& Batch = Cache.RetiredPages.front().second;
+        Cache.AvailablePages.insert(Cache.AvailablePages.end(), Batch.begin(), Batch.end());
+        Cache.RetiredPages.pop_front();
+    }
+
+    if (!Cache.AvailablePages.empty())
+    {
+        LinearAllocationPage* PagePtr = Cache.AvailablePages.back();
+        Cache.AvailablePages.pop_back();
+        --Cache.NumPages;
+        return PagePtr;
+    }
+
+    return RequestSharedPage();
+}
+
+LinearAllocationPage* LinearAllocatorPageManager::RequestSharedPage()
 {
     lock_guard<mutex> LockGuard(m_Mutex);
 
@@ -60,6 +107,14 @@ LinearAllocationPage* LinearAllocatorPageManager::RequestPage()
 
 void LinearAllocatorPageManager::DiscardPages( uint64_t FenceValue, const vector<LinearAllocationPage*>& UsedPages )
 {
+    ThreadPageCache& Cache = t_PageCaches[m_AllocationType];
+    if (Cache.NumPages + UsedPages.size() <= ThreadPageCache::kMaxPages)
+    {
+        Cache.RetiredPages.emplace_back(FenceValue, UsedPages);
+        Cache.NumPages += UsedPages.size();
+        return;
+    }
+
     lock_guard<mutex> LockGuard(m_Mutex);
     for (auto iter = UsedPages.begin(); iter != UsedPages.end(); ++iter)
         m_RetiredPages.push(make_pair(FenceValue, *iter));
@@ -67,6 +122,10 @@ void LinearAllocatorPageManager::DiscardPages( uint64_t FenceValue, const vector
 
 void LinearAllocatorPageManager::FreeLargePages( uint64_t FenceValue, const vector<LinearAllocationPage*>& LargePages )
 {
+    // Most contexts never allocate a large page
+    if (LargePages.empty() && m_NumPendingDeletions.load(memory_order_relaxed) == 0)
+        return;
+
     lock_guard<mutex> LockGuard(m_Mutex);
 
     while (!m_DeletionQueue.empty() && g_CommandManager.IsFenceComplete(m_DeletionQueue.front().first))
@@ -80,6 +139,8 @@ void LinearAllocatorPageManager::FreeLargePages( uint64_t FenceValue, const vect
         (*iter)->Unmap();
         m_DeletionQueue.push(make_pair(FenceValue, *iter));
     }
+
+    m_NumPendingDeletions.store(m_DeletionQueue.size(), memory_order_relaxed);
 }
 
 LinearAllocationPage* LinearAllocatorPageManager::CreateNewPage( size_t PageSize  )
@@ -13,12 +13,13 @@
 // Description:  This is a dynamic graphics memory allocator for DX12.  It's designed to work in concert
 // with the CommandContext class and to do so in a thread-safe manner.  There may be many command contexts,
 // each with its own linear allocators.  They act as windows into a global memory pool by reserving a
-// context-local memory page.  Requesting a new page is done in a thread-safe manner by guarding accesses
-// with a mutex lock.
+// context-local memory page.  Each thread keeps the pages it retired, and takes pages from them before
+// requesting one from the global pool, which is guarded by a mutex lock.
 //
 // When a command context is finished, it will receive a fence ID that indicates when it's safe to reclaim
 // used resources.  The CleanupUsedPages() method must be invoked at this time so that the used pages can be
-// scheduled for reuse after the fence has cleared.
+// scheduled for reuse after the fence has cleared.  A thread's retired pages are kept in batches by fence,
+// and a whole batch becomes available at once when its fence has cleared.
 
 #pragma once
 
@@ -26,6 +27,7 @@
 #include <vector>
 #include <queue>
 #include <mutex>
+#include <atomic>
 
 // Constant blocks must be multiples of 16 constants @ 16 bytes each
 #define DEFAULT_ALIGN 256
@@ -111,10 +113,12 @@ public:
     // "large" pages.
     void FreeLargePages( uint64_t FenceID, const std::vector<LinearAllocationPage*>& Pages );
 
-    void Destroy( void ) { m_PagePool.clear(); }
+    void Destroy( void );
 
 private:
 
+    LinearAllocationPage* RequestSharedPage( void );
+
     static LinearAllocatorType sm_AutoType;
 
     LinearAllocatorType m_AllocationType;
@@ -123,6 +127,9 @@ private:
     std::queue<std::pair<uint64_t, LinearAllocationPage*> > m_DeletionQueue;
     std::queue<LinearAllocationPage*> m_AvailablePages;
     std::mutex m_Mutex;
+
+    // Lets FreeLargePages() skip the lock when there's nothing to do
+    std::atomic<size_t> m_NumPendingDeletions;
 };
 
 class LinearAllocator
@@ -52,7 +52,7 @@ void MotionBlur::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(g_CommonRS); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     if (g_bTypedUAVLoadSupport_R11G11B10_FLOAT)
     {
@@ -405,7 +405,7 @@ void ParticleEffectManager::Initialize( uint32_t MaxDisplayWidth, uint32_t MaxDi
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(RootSig); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
     CreatePSO(s_ParticleSpawnCS, g_pParticleSpawnCS);
     CreatePSO(s_ParticleUpdateCS, g_pParticleUpdateCS);
     CreatePSO(s_ParticleDispatchIndirectArgsCS, g_pParticleDispatchIndirectArgsCS);
@@ -532,6 +532,28 @@ void ParticleEffectManager::RegisterTexture(uint32_t index, const Texture& textu
     CommandContext::InitializeTextureArraySlice(TextureArray, index, (GpuResource&)texture);
 }
 
+bool ParticleEffectManager::SetTextureArray(const Texture& texture)
+{
+    const D3D12_RESOURCE_DESC& CurrentDesc = TextureArray.GetResource()->GetDesc();
+    const D3D12_RESOURCE_DESC& NewDesc = ((GpuResource&)texture).GetResource()->GetDesc();
+
+    if (NewDesc.Dimension != CurrentDesc.Dimension ||
+        NewDesc.Format != CurrentDesc.Format ||
+        NewDesc.Width != CurrentDesc.Width ||
+        NewDesc.Height != CurrentDesc.Height ||
+        NewDesc.DepthOrArraySize != CurrentDesc.DepthOrArraySize ||
+        NewDesc.MipLevels != CurrentDesc.MipLevels)
+    {
+        return false;
+    }
+
+    // Nothing has been drawn with the array Initialize created yet, so it can go.
+    // The texture's state goes with its resource.
+    TextureArray = (const GpuResource&)texture;
+    g_Device->CopyDescriptorsSimple(1, TextureArraySRV, texture.GetSRV(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    return true;
+}
+
 void ParticleEffectManager::Shutdown( void )
 {
     ClearAll();
@@ -40,6 +40,11 @@ namespace ParticleEffectManager
     float GetCurrentLife(EffectHandle EffectID);
     void RegisterTexture(uint32_t index, const Texture& texture);
 
+    // Uses a texture array that was loaded whole, such as the atlas MiniArchive
+    // -particles writes, instead of the slices RegisterTexture copies in.  It must
+    // match the array Initialize creates; returns false if it doesn't.
+    bool SetTextureArray(const Texture& texture);
+
     extern BoolVar Enable;
     extern BoolVar PauseSim;
     extern BoolVar EnableTiledRendering;
@@ -14,23 +14,318 @@
 #include "GraphicsCore.h"
 #include "PipelineState.h"
 #include "RootSignature.h"
+#include "FileUtility.h"
 #include "Hash.h"
 #include <map>
+#include <algorithm>
 #include <thread>
 #include <mutex>
+#include <fstream>
+#include <string_view>
 
 using Math::IsAligned;
 using namespace Graphics;
 using Microsoft::WRL::ComPtr;
 using namespace std;
 
-static map< size_t, ComPtr<ID3D12PipelineState> > s_GraphicsPSOHashMap;
-static map< size_t, ComPtr<ID3D12PipelineState> > s_ComputePSOHashMap;
+namespace
+{
+    // A compiled PSO, shared by every PSO object with the same state.  Compiled
+    // is published once it's ready, which for FinalizeAsync() is on a worker thread.
+    struct PSOEntry
+    {
+        ComPtr<ID3D12PipelineState> Object;
+        atomic<ID3D12PipelineState*> Compiled = { nullptr };
+    };
+
+    struct PSOHashMap
+    {
+        mutex Mutex;
+        map< size_t, PSOEntry > Entries;
+    };
+}
+
+static PSOHashMap s_GraphicsPSOHashMap;
+static PSOHashMap s_ComputePSOHashMap;
+static PSOHashMap s_MeshPSOHashMap;
+
+// The pipeline library is read from disk at startup, so PSOs compiled by an
+// earlier run are loaded instead of compiled again.  Its data has to outlive it.
+static ComPtr<ID3D12PipelineLibrary1> s_PipelineLibrary;
+static Utility::ByteArray s_PipelineLibraryData;
+static wstring s_PipelineLibraryPath;
+static mutex s_PipelineLibraryMutex;
+static bool s_PipelineLibraryChanged = false;
+
+// The PSOs that FinalizeAsync() is compiling
+static mutex s_AsyncCompilesMutex;
+static vector< concurrency::task<void> > s_AsyncCompiles;
+
+void PSO::InitializeCache( const wstring& FilePath )
+{
+    ASSERT(s_PipelineLibrary == nullptr);
+
+    ComPtr<ID3D12Device1> Device1;
+    if (FAILED(g_Device->QueryInterface(MY_IID_PPV_ARGS(&Device1))))
+        return;
+
+    s_PipelineLibraryPath = FilePath;
+    s_PipelineLibraryData = Utility::ReadFileSync(FilePath);
+
+    HRESULT hr = E_FAIL;
+    if (!s_PipelineLibraryData->empty())
+    {
+        hr = Device1->CreatePipelineLibrary(s_PipelineLibraryData->data(), s_PipelineLibraryData->size(),
+            MY_IID_PPV_ARGS(&s_PipelineLibrary));
+
+        // A library from another driver or adapter is started over
+        if (FAILED(hr))
+            Utility::Printf(L"Discarding pipeline library %s (0x%08X)\n", FilePath.c_str(), hr);
+    }
+
+    if (FAILED(hr))
+    {
+        s_PipelineLibraryData = Utility::NullFile;
+        hr = Device1->CreatePipelineLibrary(nullptr, 0, MY_IID_PPV_ARGS(&s_PipelineLibrary));
+    }
+
+    // Some drivers and tools don't support pipeline libraries, so PSOs are just compiled every run
+    if (FAILED(hr))
+    {
+        Utility::Printf("Pipeline libraries are unsupported (0x%08X), so PSOs won't be cached\n", hr);
+        s_PipelineLibrary = nullptr;
+    }
+}
+
+static void WaitForAsyncCompiles( void )
+{
+    lock_guard<mutex> Lock(s_AsyncCompilesMutex);
+    for (auto& Task : s_AsyncCompiles)
+        Task.wait();
+    s_AsyncCompiles.clear();
+}
+
+static void SavePipelineLibrary( void )
+{
+    if (s_PipelineLibrary == nullptr || !s_PipelineLibraryChanged)
+        return;
+
+    vector<char> Data(s_PipelineLibrary->GetSerializedSize());
+    if (FAILED(s_PipelineLibrary->Serialize(Data.data(), Data.size())))
+        return;
+
+    ofstream File(s_PipelineLibraryPath, ios::out | ios::binary | ios::trunc);
+    File.write(Data.data(), Data.size());
+    if (!File)
+        Utility::Printf(L"Failed to write pipeline library %s\n", s_PipelineLibraryPath.c_str());
+}
 
 void PSO::DestroyAll(void)
 {
-    s_GraphicsPSOHashMap.clear();
-    s_ComputePSOHashMap.clear();
+    WaitForAsyncCompiles();
+    SavePipelineLibrary();
+
+    s_PipelineLibrary = nullptr;
+    s_PipelineLibraryData = nullptr;
+    s_PipelineLibraryChanged = false;
+
+    s_GraphicsPSOHashMap.Entries.clear();
+    s_ComputePSOHashMap.Entries.clear();
+    s_MeshPSOHashMap.Entries.clear();
+}
+
+static ID3D12PipelineState* WaitForPSO( const atomic<ID3D12PipelineState*>& Compiled )
+{
+    ID3D12PipelineState* Object;
+    while ((Object = Compiled.load(memory_order_acquire)) == nullptr)
+        this_thread::yield();
+    return Object;
+}
+
+ID3D12PipelineState* PSO::GetAsyncPipelineStateObject( void ) const
+{
+    ASSERT(m_AsyncPSO != nullptr, L"PSO %s was never finalized", m_Name);
+
+    ID3D12PipelineState* Object = m_AsyncPSO->load(memory_order_acquire);
+    if (Object != nullptr)
+        return Object;
+    else if (m_FallbackPSO != nullptr)
+        return m_FallbackPSO;
+    else
+        return WaitForPSO(*m_AsyncPSO);
+}
+
+bool PSO::IsReady( void ) const
+{
+    return m_PSO != nullptr || (m_AsyncPSO != nullptr && m_AsyncPSO->load(memory_order_acquire) != nullptr);
+}
+
+void PSO::SetCompiledPSO( const atomic<ID3D12PipelineState*>& Compiled, size_t HashCode, bool Async,
+    const PSO* Fallback )
+{
+    m_HashCode = HashCode;
+    m_PSO = Compiled.load(memory_order_acquire);
+    m_AsyncPSO = nullptr;
+    m_FallbackPSO = nullptr;
+
+    if (m_PSO != nullptr)
+        return;
+
+    if (Async)
+    {
+        ASSERT(Fallback == nullptr || Fallback->GetRootSignature().GetSignature() == m_RootSignature->GetSignature(),
+            L"Fallback for %s has a different root signature", m_Name);
+        m_AsyncPSO = &Compiled;
+        m_FallbackPSO = Fallback != nullptr ? Fallback->GetPipelineStateObject() : nullptr;
+    }
+    else
+    {
+        m_PSO = WaitForPSO(Compiled);
+    }
+}
+
+// Finds the hash map's entry for a PSO.  Returns true if it was added, in which
+// case the caller has to compile it.
+static bool ReservePSO( PSOHashMap& HashMap, size_t HashCode, PSOEntry*& Entry )
+{
+    lock_guard<mutex> CS(HashMap.Mutex);
+    auto iter = HashMap.Entries.find(HashCode);
+
+    // Reserve space so the next inquiry will find that someone got here first.
+    if (iter == HashMap.Entries.end())
+    {
+        Entry = &HashMap.Entries[HashCode];
+        return true;
+    }
+    else
+    {
+        Entry = &iter->second;
+        return false;
+    }
+}
+
+// Compiles a new PSO, now or on a worker thread, and publishes it in its entry
+static void CompilePSO( PSOEntry& Entry, bool Async, function<ID3D12PipelineState*()> Compile )
+{
+    auto CompileAndPublish = [&Entry, Compile]()
+    {
+        ID3D12PipelineState* Object = Compile();
+        Entry.Object.Attach(Object);
+        Entry.Compiled.store(Object, memory_order_release);
+    };
+
+    if (!Async)
+    {
+        CompileAndPublish();
+        return;
+    }
+
+    lock_guard<mutex> Lock(s_AsyncCompilesMutex);
+
+    // Forget the compiles that have finished
+    s_AsyncCompiles.erase(remove_if(s_AsyncCompiles.begin(), s_AsyncCompiles.end(),
+        [](const concurrency::task<void>& Task) { return Task.is_done(); }), s_AsyncCompiles.end());
+
+    s_AsyncCompiles.push_back(concurrency::create_task(CompileAndPublish));
+}
+
+// PSOs are named in the pipeline library by a hash of their description which,
+// unlike the hash map's, is the same from run to run.  Shaders, input layouts and
+// root signatures are hashed by their contents rather than their addresses.
+static size_t HashBytecode( const D3D12_SHADER_BYTECODE& Bytecode, size_t Hash )
+{
+    const uint32_t* Begin = (const uint32_t*)Bytecode.pShaderBytecode;
+    return Utility::HashRange(Begin, Begin + Bytecode.BytecodeLength / 4, Hash);
+}
+
+static wstring GetLibraryName( size_t Hash )
+{
+    wchar_t Name[17];
+    swprintf_s(Name, L"%016llX", (unsigned long long)Hash);
+    return Name;
+}
+
+static wstring GetLibraryName( D3D12_GRAPHICS_PIPELINE_STATE_DESC Desc, const RootSignature& RootSig )
+{
+    ASSERT(Desc.StreamOutput.NumEntries == 0, "Stream output isn't hashed");
+
+    size_t Hash = Utility::HashState(&Desc.InputLayout.NumElements, 1, RootSig.GetHashCode());
+    for (UINT i = 0; i < Desc.InputLayout.NumElements; ++i)
+    {
+        D3D12_INPUT_ELEMENT_DESC Element = Desc.InputLayout.pInputElementDescs[i];
+        size_t SemanticHash = std::hash<string_view>()(Element.SemanticName);
+        Element.SemanticName = nullptr;
+        Hash = Utility::HashState(&Element, 1, Hash);
+        Hash = Utility::HashState(&SemanticHash, 1, Hash);
+    }
+
+    Hash = HashBytecode(Desc.VS, Hash);
+    Hash = HashBytecode(Desc.PS, Hash);
+    Hash = HashBytecode(Desc.DS, Hash);
+    Hash = HashBytecode(Desc.HS, Hash);
+    Hash = HashBytecode(Desc.GS, Hash);
+
+    Desc.pRootSignature = nullptr;
+    Desc.VS = Desc.PS = Desc.DS = Desc.HS = Desc.GS = {};
+    Desc.StreamOutput = {};
+    Desc.InputLayout.pInputElementDescs = nullptr;
+    Desc.CachedPSO = {};
+    return GetLibraryName(Utility::HashState(&Desc, 1, Hash));
+}
+
+static wstring GetLibraryName( D3D12_COMPUTE_PIPELINE_STATE_DESC Desc, const RootSignature& RootSig )
+{
+    size_t Hash = HashBytecode(Desc.CS, RootSig.GetHashCode());
+
+    Desc.pRootSignature = nullptr;
+    Desc.CS = {};
+    Desc.CachedPSO = {};
+    return GetLibraryName(Utility::HashState(&Desc, 1, Hash));
+}
+
+static wstring GetLibraryName( D3DX12_MESH_SHADER_PIPELINE_STATE_DESC Desc, const RootSignature& RootSig )
+{
+    size_t Hash = HashBytecode(Desc.AS, RootSig.GetHashCode());
+    Hash = HashBytecode(Desc.MS, Hash);
+    Hash = HashBytecode(Desc.PS, Hash);
+
+    Desc.pRootSignature = nullptr;
+    Desc.AS = Desc.MS = Desc.PS = {};
+    Desc.CachedPSO = {};
+    return GetLibraryName(Utility::HashState(&Desc, 1, Hash));
+}
+
+// Loads a PSO from the pipeline library with Load, or if it isn't there, compiles
+// it with Create and stores it for the next run
+template <typename LoadFn, typename CreateFn>
+static ID3D12PipelineState* LoadOrCreatePSO( const wstring& LibraryName, const wchar_t* Name,
+    LoadFn&& Load, CreateFn&& Create )
+{
+    ID3D12PipelineState* Object = nullptr;
+
+    if (s_PipelineLibrary != nullptr)
+    {
+        // The library only needs loads of the same PSO to be synchronized, but
+        // loading is quick compared to compiling
+        lock_guard<mutex> Lock(s_PipelineLibraryMutex);
+        if (FAILED(Load(LibraryName.c_str(), &Object)))
+            Object = nullptr;
+    }
+
+    if (Object == nullptr)
+    {
+        ASSERT_SUCCEEDED( Create(&Object) );
+
+        if (s_PipelineLibrary != nullptr)
+        {
+            lock_guard<mutex> Lock(s_PipelineLibraryMutex);
+            if (SUCCEEDED(s_PipelineLibrary->StorePipeline(LibraryName.c_str(), Object)))
+                s_PipelineLibraryChanged = true;
+        }
+    }
+
+    Object->SetName(Name);
+    return Object;
 }
 
 
@@ -116,6 +411,16 @@ void GraphicsPSO::SetInputLayout( UINT NumElements, const D3D12_INPUT_ELEMENT_DE
 }
 
 void GraphicsPSO::Finalize()
+{
+    Finalize(false, nullptr);
+}
+
+void GraphicsPSO::FinalizeAsync( const PSO* Fallback )
+{
+    Finalize(true, Fallback);
+}
+
+void GraphicsPSO::Finalize( bool Async, const PSO* Fallback )
 {
     // Make sure the root signature is finalized first
     m_PSODesc.pRootSignature = m_RootSignature->GetSignature();
@@ -126,39 +431,41 @@ void GraphicsPSO::Finalize()
     HashCode = Utility::HashState(m_InputLayouts.get(), m_PSODesc.InputLayout.NumElements, HashCode);
     m_PSODesc.InputLayout.pInputElementDescs = m_InputLayouts.get();
 
-    ID3D12PipelineState** PSORef = nullptr;
-    bool firstCompile = false;
+    PSOEntry* Entry = nullptr;
+    if (ReservePSO(s_GraphicsPSOHashMap, HashCode, Entry))
     {
-        static mutex s_HashMapMutex;
-        lock_guard<mutex> CS(s_HashMapMutex);
-        auto iter = s_GraphicsPSOHashMap.find(HashCode);
+        ASSERT(m_PSODesc.DepthStencilState.DepthEnable != (m_PSODesc.DSVFormat == DXGI_FORMAT_UNKNOWN));
+
+        // The compile keeps its own copy of the description and input layout
+        const D3D12_GRAPHICS_PIPELINE_STATE_DESC Desc = m_PSODesc;
+        const shared_ptr<const D3D12_INPUT_ELEMENT_DESC> InputLayouts = m_InputLayouts;
+        const wstring LibraryName = GetLibraryName(m_PSODesc, *m_RootSignature);
+        const wchar_t* Name = m_Name;
 
-        // Reserve space so the next inquiry will find that someone got here first.
-        if (iter == s_GraphicsPSOHashMap.end())
+        CompilePSO(*Entry, Async, [Desc, InputLayouts, LibraryName, Name]()
         {
-            firstCompile = true;
-            PSORef = s_GraphicsPSOHashMap[HashCode].GetAddressOf();
-        }
-        else
-            PSORef = iter->second.GetAddressOf();
+            return LoadOrCreatePSO(LibraryName, Name,
+                [&](const wchar_t* LibName, ID3D12PipelineState** Object)
+                { return s_PipelineLibrary->LoadGraphicsPipeline(LibName, &Desc, MY_IID_PPV_ARGS(Object)); },
+                [&](ID3D12PipelineState** Object)
+                { return g_Device->CreateGraphicsPipelineState(&Desc, MY_IID_PPV_ARGS(Object)); });
+        });
     }
 
-    if (firstCompile)
-    {
-        ASSERT(m_PSODesc.DepthStencilState.DepthEnable != (m_PSODesc.DSVFormat == DXGI_FORMAT_UNKNOWN));
-        ASSERT_SUCCEEDED( g_Device->CreateGraphicsPipelineState(&m_PSODesc, MY_IID_PPV_ARGS(&m_PSO)) );
-        s_GraphicsPSOHashMap[HashCode].Attach(m_PSO);
-        m_PSO->SetName(m_Name);
-    }
-    else
-    {
-        while (*PSORef == nullptr)
-            this_thread::yield();
-        m_PSO = *PSORef;
-    }
+    SetCompiledPSO(Entry->Compiled, HashCode, Async, Fallback);
 }
 
 void ComputePSO::Finalize()
+{
+    Finalize(false, nullptr);
+}
+
+void ComputePSO::FinalizeAsync( const PSO* Fallback )
+{
+    Finalize(true, Fallback);
+}
+
+void ComputePSO::Finalize( bool Async, const PSO* Fallback )
 {
     // Make sure the root signature is finalized first
     m_PSODesc.pRootSignature = m_RootSignature->GetSignature();
@@ -166,35 +473,24 @@ void ComputePSO::Finalize()
 
     size_t HashCode = Utility::HashState(&m_PSODesc);
 
-    ID3D12PipelineState** PSORef = nullptr;
-    bool firstCompile = false;
+    PSOEntry* Entry = nullptr;
+    if (ReservePSO(s_ComputePSOHashMap, HashCode, Entry))
     {
-        static mutex s_HashMapMutex;
-        lock_guard<mutex> CS(s_HashMapMutex);
-        auto iter = s_ComputePSOHashMap.find(HashCode);
+        const D3D12_COMPUTE_PIPELINE_STATE_DESC Desc = m_PSODesc;
+        const wstring LibraryName = GetLibraryName(m_PSODesc, *m_RootSignature);
+        const wchar_t* Name = m_Name;
 
-        // Reserve space so the next inquiry will find that someone got here first.
-        if (iter == s_ComputePSOHashMap.end())
+        CompilePSO(*Entry, Async, [Desc, LibraryName, Name]()
         {
-            firstCompile = true;
-            PSORef = s_ComputePSOHashMap[HashCode].GetAddressOf();
-        }
-        else
-            PSORef = iter->second.GetAddressOf();
+            return LoadOrCreatePSO(LibraryName, Name,
+                [&](const wchar_t* LibName, ID3D12PipelineState** Object)
+                { return s_PipelineLibrary->LoadComputePipeline(LibName, &Desc, MY_IID_PPV_ARGS(Object)); },
+                [&](ID3D12PipelineState** Object)
+                { return g_Device->CreateComputePipelineState(&Desc, MY_IID_PPV_ARGS(Object)); });
+        });
     }
 
-    if (firstCompile)
-    {
-        ASSERT_SUCCEEDED( g_Device->CreateComputePipelineState(&m_PSODesc, MY_IID_PPV_ARGS(&m_PSO)) );
-        s_ComputePSOHashMap[HashCode].Attach(m_PSO);
-        m_PSO->SetName(m_Name);
-    }
-    else
-    {
-        while (*PSORef == nullptr)
-            this_thread::yield();
-        m_PSO = *PSORef;
-    }
+    SetCompiledPSO(Entry->Compiled, HashCode, Async, Fallback);
 }
 
 ComputePSO::ComputePSO(const wchar_t* Name)
@@ -203,3 +499,106 @@ ComputePSO::ComputePSO(const wchar_t* Name)
     ZeroMemory(&m_PSODesc, sizeof(m_PSODesc));
     m_PSODesc.NodeMask = 1;
 }
+
+MeshPSO::MeshPSO(const wchar_t* Name)
+    : PSO(Name)
+{
+    ZeroMemory(&m_PSODesc, sizeof(m_PSODesc));
+    m_PSODesc.NodeMask = 1;
+    m_PSODesc.SampleMask = 0xFFFFFFFFu;
+    m_PSODesc.SampleDesc.Count = 1;
+    m_PSODesc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+}
+
+void MeshPSO::SetBlendState( const D3D12_BLEND_DESC& BlendDesc )
+{
+    m_PSODesc.BlendState = BlendDesc;
+}
+
+void MeshPSO::SetRasterizerState( const D3D12_RASTERIZER_DESC& RasterizerDesc )
+{
+    m_PSODesc.RasterizerState = RasterizerDesc;
+}
+
+void MeshPSO::SetDepthStencilState( const D3D12_DEPTH_STENCIL_DESC& DepthStencilDesc )
+{
+    m_PSODesc.DepthStencilState = DepthStencilDesc;
+}
+
+void MeshPSO::SetSampleMask( UINT SampleMask )
+{
+    m_PSODesc.SampleMask = SampleMask;
+}
+
+void MeshPSO::SetDepthTargetFormat(DXGI_FORMAT DSVFormat, UINT MsaaCount, UINT MsaaQuality )
+{
+    SetRenderTargetFormats(0, nullptr, DSVFormat, MsaaCount, MsaaQuality );
+}
+
+void MeshPSO::SetRenderTargetFormat( DXGI_FORMAT RTVFormat, DXGI_FORMAT DSVFormat, UINT MsaaCount, UINT MsaaQuality )
+{
+    SetRenderTargetFormats(1, &RTVFormat, DSVFormat, MsaaCount, MsaaQuality );
+}
+
+void MeshPSO::SetRenderTargetFormats( UINT NumRTVs, const DXGI_FORMAT* RTVFormats, DXGI_FORMAT DSVFormat, UINT MsaaCount, UINT MsaaQuality )
+{
+    ASSERT(NumRTVs == 0 || RTVFormats != nullptr, "Null format array conflicts with non-zero length");
+    for (UINT i = 0; i < NumRTVs; ++i)
+    {
+        ASSERT(RTVFormats[i] != DXGI_FORMAT_UNKNOWN);
+        m_PSODesc.RTVFormats[i] = RTVFormats[i];
+    }
+    for (UINT i = NumRTVs; i < m_PSODesc.NumRenderTargets; ++i)
+        m_PSODesc.RTVFormats[i] = DXGI_FORMAT_UNKNOWN;
+    m_PSODesc.NumRenderTargets = NumRTVs;
+    m_PSODesc.DSVFormat = DSVFormat;
+    m_PSODesc.SampleDesc.Count = MsaaCount;
+    m_PSODesc.SampleDesc.Quality = MsaaQuality;
+}
+
+void MeshPSO::Finalize()
+{
+    Finalize(false, nullptr);
+}
+
+void MeshPSO::FinalizeAsync( const PSO* Fallback )
+{
+    Finalize(true, Fallback);
+}
+
+void MeshPSO::Finalize( bool Async, const PSO* Fallback )
+{
+    // Make sure the root signature is finalized first
+    m_PSODesc.pRootSignature = m_RootSignature->GetSignature();
+    ASSERT(m_PSODesc.pRootSignature != nullptr);
+
+    size_t HashCode = Utility::HashState(&m_PSODesc);
+
+    PSOEntry* Entry = nullptr;
+    if (ReservePSO(s_MeshPSOHashMap, HashCode, Entry))
+    {
+        ASSERT(m_PSODesc.DepthStencilState.DepthEnable != (m_PSODesc.DSVFormat == DXGI_FORMAT_UNKNOWN));
+
+        const D3DX12_MESH_SHADER_PIPELINE_STATE_DESC Desc = m_PSODesc;
+        const wstring LibraryName = GetLibraryName(m_PSODesc, *m_RootSignature);
+        const wchar_t* Name = m_Name;
+
+        CompilePSO(*Entry, Async, [Desc, LibraryName, Name]()
+        {
+            // Mesh shader pipelines can only be described with a stream
+            ComPtr<ID3D12Device2> Device2;
+            ASSERT_SUCCEEDED( g_Device->QueryInterface(MY_IID_PPV_ARGS(&Device2)) );
+
+            CD3DX12_PIPELINE_MESH_STATE_STREAM StateStream(Desc);
+            D3D12_PIPELINE_STATE_STREAM_DESC StreamDesc = { sizeof(StateStream), &StateStream };
+
+            return LoadOrCreatePSO(LibraryName, Name,
+                [&](const wchar_t* LibName, ID3D12PipelineState** Object)
+                { return s_PipelineLibrary->LoadPipeline(LibName, &StreamDesc, MY_IID_PPV_ARGS(Object)); },
+                [&](ID3D12PipelineState** Object)
+                { return Device2->CreatePipelineState(&StreamDesc, MY_IID_PPV_ARGS(Object)); });
+        });
+    }
+
+    SetCompiledPSO(Entry->Compiled, HashCode, Async, Fallback);
+}
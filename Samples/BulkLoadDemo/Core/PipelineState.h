@@ -14,6 +14,7 @@
 #pragma once
 
 #include "pch.h"
+#include <atomic>
 
 class CommandContext;
 class RootSignature;
@@ -28,7 +29,13 @@ class PSO
 {
 public:
 
-    PSO(const wchar_t* Name) : m_Name(Name), m_RootSignature(nullptr) {}
+    PSO(const wchar_t* Name) : m_Name(Name), m_RootSignature(nullptr), m_PSO(nullptr), m_AsyncPSO(nullptr),
+        m_FallbackPSO(nullptr), m_HashCode(0) {}
+
+    // Loads the ID3D12PipelineLibrary that compiled PSOs are kept in between
+    // runs.  Call it before finalizing any PSOs.  DestroyAll() waits for any PSOs
+    // still compiling and writes the library back if PSOs were added to it.
+    static void InitializeCache( const std::wstring& FilePath );
 
     static void DestroyAll( void );
 
@@ -43,15 +50,36 @@ public:
         return *m_RootSignature;
     }
 
-    ID3D12PipelineState* GetPipelineStateObject( void ) const { return m_PSO; }
+    // Until a PSO finalized with FinalizeAsync() has compiled, this returns its
+    // fallback, or waits for it to compile if it has none.
+    ID3D12PipelineState* GetPipelineStateObject( void ) const
+    {
+        return m_PSO != nullptr ? m_PSO : GetAsyncPipelineStateObject();
+    }
+
+    // False while FinalizeAsync() is still compiling the PSO
+    bool IsReady( void ) const;
+
+    // Identifies the finalized state, so PSOs can be compared before they've compiled
+    size_t GetHashCode( void ) const { return m_HashCode; }
 
 protected:
 
+    ID3D12PipelineState* GetAsyncPipelineStateObject( void ) const;
+
+    // Points the PSO at the compiled pipeline state, or at where a worker thread
+    // will publish it for FinalizeAsync()
+    void SetCompiledPSO( const std::atomic<ID3D12PipelineState*>& Compiled, size_t HashCode, bool Async,
+        const PSO* Fallback );
+
     const wchar_t* m_Name;
 
     const RootSignature* m_RootSignature;
 
     ID3D12PipelineState* m_PSO;
+    const std::atomic<ID3D12PipelineState*>* m_AsyncPSO;
+    ID3D12PipelineState* m_FallbackPSO;
+    size_t m_HashCode;
 };
 
 class GraphicsPSO : public PSO
@@ -90,12 +118,58 @@ public:
     // Perform validation and compute a hash value for fast state block comparisons
     void Finalize();
 
+    // Like Finalize(), but compiles a new PSO on a worker thread.  Until it's
+    // ready, Fallback is used in its place, so it has to have the same root
+    // signature and input layout.  Without one, the first use waits for it.
+    // The shaders must stay valid until it has compiled.
+    void FinalizeAsync( const PSO* Fallback = nullptr );
+
 private:
 
+    void Finalize( bool Async, const PSO* Fallback );
+
     D3D12_GRAPHICS_PIPELINE_STATE_DESC m_PSODesc;
     std::shared_ptr<const D3D12_INPUT_ELEMENT_DESC> m_InputLayouts;
 };
 
+// A graphics pipeline with amplification and mesh shaders in place of the
+// input assembler and vertex shader.  It needs ID3D12Device2 and a device with
+// D3D12_MESH_SHADER_TIER_1.
+class MeshPSO : public PSO
+{
+    friend class CommandContext;
+
+public:
+
+    // Start with empty state
+    MeshPSO(const wchar_t* Name = L"Unnamed Mesh PSO");
+
+    void SetBlendState( const D3D12_BLEND_DESC& BlendDesc );
+    void SetRasterizerState( const D3D12_RASTERIZER_DESC& RasterizerDesc );
+    void SetDepthStencilState( const D3D12_DEPTH_STENCIL_DESC& DepthStencilDesc );
+    void SetSampleMask( UINT SampleMask );
+    void SetDepthTargetFormat( DXGI_FORMAT DSVFormat, UINT MsaaCount = 1, UINT MsaaQuality = 0 );
+    void SetRenderTargetFormat( DXGI_FORMAT RTVFormat, DXGI_FORMAT DSVFormat, UINT MsaaCount = 1, UINT MsaaQuality = 0 );
+    void SetRenderTargetFormats( UINT NumRTVs, const DXGI_FORMAT* RTVFormats, DXGI_FORMAT DSVFormat, UINT MsaaCount = 1, UINT MsaaQuality = 0 );
+
+    void SetAmplificationShader( const void* Binary, size_t Size ) { m_PSODesc.AS = CD3DX12_SHADER_BYTECODE(const_cast<void*>(Binary), Size); }
+    void SetMeshShader( const void* Binary, size_t Size ) { m_PSODesc.MS = CD3DX12_SHADER_BYTECODE(const_cast<void*>(Binary), Size); }
+    void SetPixelShader( const void* Binary, size_t Size ) { m_PSODesc.PS = CD3DX12_SHADER_BYTECODE(const_cast<void*>(Binary), Size); }
+
+    void SetAmplificationShader( const D3D12_SHADER_BYTECODE& Binary ) { m_PSODesc.AS = Binary; }
+    void SetMeshShader( const D3D12_SHADER_BYTECODE& Binary ) { m_PSODesc.MS = Binary; }
+    void SetPixelShader( const D3D12_SHADER_BYTECODE& Binary ) { m_PSODesc.PS = Binary; }
+
+    void Finalize();
+    void FinalizeAsync( const PSO* Fallback = nullptr );
+
+private:
+
+    void Finalize( bool Async, const PSO* Fallback );
+
+    D3DX12_MESH_SHADER_PIPELINE_STATE_DESC m_PSODesc;
+};
+
 
 class ComputePSO : public PSO
 {
@@ -108,8 +182,11 @@ public:
     void SetComputeShader( const D3D12_SHADER_BYTECODE& Binary ) { m_PSODesc.CS = Binary; }
 
     void Finalize();
+    void FinalizeAsync( const PSO* Fallback = nullptr );
 
 private:
 
+    void Finalize( bool Async, const PSO* Fallback );
+
     D3D12_COMPUTE_PIPELINE_STATE_DESC m_PSODesc;
 };
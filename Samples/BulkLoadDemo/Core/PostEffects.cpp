@@ -135,7 +135,7 @@ void PostEffects::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(PostEffectsRS); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     if (g_bTypedUAVLoadSupport_R11G11B10_FLOAT)
     {
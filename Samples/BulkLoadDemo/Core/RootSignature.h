@@ -162,6 +162,9 @@ public:
 
     ID3D12RootSignature* GetSignature() const { return m_Signature; }
 
+    // A hash of the description, which unlike the signature's address is the same from run to run
+    size_t GetHashCode() const { return m_HashCode; }
+
 protected:
 
     BOOL m_Finalized;
@@ -174,4 +177,5 @@ protected:
     std::unique_ptr<RootParameter[]> m_ParamArray;
     std::unique_ptr<D3D12_STATIC_SAMPLER_DESC[]> m_SamplerArray;
     ID3D12RootSignature* m_Signature;
+    size_t m_HashCode;
 };
@@ -99,7 +99,7 @@ void SSAO::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(s_RootSignature); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO( s_DepthPrepare1CS, g_pAoPrepareDepthBuffers1CS );
     CreatePSO( s_DepthPrepare2CS, g_pAoPrepareDepthBuffers2CS );
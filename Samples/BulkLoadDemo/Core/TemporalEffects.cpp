@@ -59,7 +59,7 @@ void TemporalEffects::Initialize( void )
 #define CreatePSO( ObjName, ShaderByteCode ) \
     ObjName.SetRootSignature(g_CommonRS); \
     ObjName.SetComputeShader(ShaderByteCode, sizeof(ShaderByteCode) ); \
-    ObjName.Finalize();
+    ObjName.FinalizeAsync();
 
     CreatePSO( s_TemporalBlendCS, g_pTemporalBlendCS );
     CreatePSO( s_BoundNeighborhoodCS, g_pBoundNeighborhoodCS );
@@ -19,6 +19,8 @@
 #include "FileUtility.h"
 #include "GraphicsCommon.h"
 #include "CommandContext.h"
+#include <atomic>
+#include <future>
 #include <map>
 #include <thread>
 
@@ -42,6 +44,7 @@ public:
 
     void WaitForLoad(void) const;
     void CreateFromMemory(ByteArray memory, eDefaultTexture fallback, bool sRGB);
+    bool CreateFromLoader(TextureManager::DDSFileLoader loader, const wstring& fileName, bool sRGB);
     void CreateFromResource(ID3D12Resource* resource, eDefaultTexture fallback, bool sRGB);
 
 private:
@@ -49,16 +52,21 @@ private:
     bool IsValid(void) const { return m_IsValid; }
     void Unload();
 
+    void FinishLoad();
+
     std::wstring m_MapKey;		// For deleting from the map later
     bool m_IsValid;
-    bool m_IsLoading;
-    size_t m_ReferenceCount;
+    std::atomic<bool> m_IsLoading;
+    std::promise<void> m_LoadPromise;
+    std::shared_future<void> m_Loaded;
+    std::atomic<size_t> m_ReferenceCount;
 };
 
 namespace TextureManager
 {
     wstring s_RootPath = L"";
     map<wstring, std::unique_ptr<ManagedTexture>> s_TextureCache;
+    DDSFileLoader s_DDSFileLoader = nullptr;
 
     void Initialize( const wstring& TextureLibRoot )
     {
@@ -70,41 +78,60 @@ namespace TextureManager
         s_TextureCache.clear();
     }
 
+    void SetDDSFileLoader( DDSFileLoader loader )
+    {
+        s_DDSFileLoader = loader;
+    }
+
     mutex s_Mutex;
 
-    ManagedTexture* FindOrLoadTexture( const wstring& fileName, eDefaultTexture fallback, bool forceSRGB )
+    // Returns the managed texture for a file, and whether it was just created, in
+    // which case the caller must load it.
+    ManagedTexture* FindOrCreateTexture( const wstring& fileName, bool forceSRGB, bool& created )
     {
-        ManagedTexture* tex = nullptr;
+        lock_guard<mutex> Guard(s_Mutex);
 
+        wstring key = fileName;
+        if (forceSRGB)
+            key += L"_sRGB";
+
+        // Search for an existing managed texture, which may still be loading
+        auto iter = s_TextureCache.find(key);
+        if (iter != s_TextureCache.end())
         {
-            lock_guard<mutex> Guard(s_Mutex);
+            created = false;
+            return iter->second.get();
+        }
 
-            wstring key = fileName;
-            if (forceSRGB)
-                key += L"_sRGB";
+        // If it's not found, create a new managed texture for the caller to load
+        ManagedTexture* tex = new ManagedTexture(key);
+        s_TextureCache[key].reset(tex);
+        created = true;
+        return tex;
+    }
 
-            // Search for an existing managed texture
-            auto iter = s_TextureCache.find(key);
-            if (iter != s_TextureCache.end())
-            {
-                // If a texture was already created make sure it has finished loading before
-                // returning a point to it.
-                tex = iter->second.get();
-                tex->WaitForLoad();
-                return tex;
-            }
-            else
-            {
-                // If it's not found, create a new managed texture and start loading it
-                tex = new ManagedTexture(key);
-                s_TextureCache[key].reset(tex);
-            }
+    void LoadTexture( ManagedTexture* tex, const wstring& fileName, eDefaultTexture fallback, bool forceSRGB )
+    {
+        if (s_DDSFileLoader == nullptr || !tex->CreateFromLoader(s_DDSFileLoader, s_RootPath + fileName, forceSRGB))
+        {
+            Utility::ByteArray ba = Utility::ReadFileSync( s_RootPath + fileName );
+            tex->CreateFromMemory(ba, fallback, forceSRGB);
         }
+    }
 
-        Utility::ByteArray ba = Utility::ReadFileSync( s_RootPath + fileName );
-        tex->CreateFromMemory(ba, fallback, forceSRGB);
+    ManagedTexture* FindOrLoadTexture( const wstring& fileName, eDefaultTexture fallback, bool forceSRGB )
+    {
+        bool created = false;
+        ManagedTexture* tex = FindOrCreateTexture(fileName, forceSRGB, created);
+
+        // If a texture was already created make sure it has finished loading before
+        // returning a pointer to it.  This happens outside the lock, so that loads of
+        // other files aren't held up.
+        if (created)
+            LoadTexture(tex, fileName, fallback, forceSRGB);
+        else
+            tex->WaitForLoad();
 
-        // This was the first time it was requested, so indicate that the caller must read the file
         return tex;
     }
 
@@ -123,6 +150,7 @@ ManagedTexture::ManagedTexture( const wstring& FileName )
     : m_MapKey(FileName), m_IsValid(false), m_IsLoading(true), m_ReferenceCount(0)
 {
     m_hCpuDescriptorHandle.ptr = D3D12_GPU_VIRTUAL_ADDRESS_UNKNOWN;
+    m_Loaded = m_LoadPromise.get_future().share();
 }
 
 void ManagedTexture::CreateFromMemory(ByteArray ba, eDefaultTexture fallback, bool forceSRGB)
@@ -133,8 +161,10 @@ void ManagedTexture::CreateFromMemory(ByteArray ba, eDefaultTexture fallback, bo
     }
     else
     {
-        // We probably have a texture to load, so let's allocate a new descriptor
-        m_hCpuDescriptorHandle = AllocateDescriptor(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        // We probably have a texture to load, so let's allocate a new descriptor,
+        // unless CreateFromLoader already did
+        if (m_hCpuDescriptorHandle.ptr == D3D12_GPU_VIRTUAL_ADDRESS_UNKNOWN)
+            m_hCpuDescriptorHandle = AllocateDescriptor(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
         if ( SUCCEEDED( CreateDDSTextureFromMemory( g_Device, (const uint8_t*)ba->data(), ba->size(),
             0, forceSRGB, m_pResource.GetAddressOf(), m_hCpuDescriptorHandle) ) )
@@ -152,7 +182,24 @@ void ManagedTexture::CreateFromMemory(ByteArray ba, eDefaultTexture fallback, bo
         }
     }
 
-    m_IsLoading = false;
+    FinishLoad();
+}
+
+bool ManagedTexture::CreateFromLoader(TextureManager::DDSFileLoader loader, const wstring& fileName, bool forceSRGB)
+{
+    m_hCpuDescriptorHandle = AllocateDescriptor(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+
+    if (FAILED(loader(fileName.c_str(), forceSRGB, m_pResource.ReleaseAndGetAddressOf(), m_hCpuDescriptorHandle)))
+        return false;
+
+    m_IsValid = true;
+    D3D12_RESOURCE_DESC desc = GetResource()->GetDesc();
+    m_Width = (uint32_t)desc.Width;
+    m_Height = desc.Height;
+    m_Depth = desc.DepthOrArraySize;
+
+    FinishLoad();
+    return true;
 }
 
 void ManagedTexture::CreateFromResource(ID3D12Resource* resource, eDefaultTexture fallback, bool sRGB)
@@ -195,13 +242,19 @@ void ManagedTexture::CreateFromResource(ID3D12Resource* resource, eDefaultTextur
         g_Device->CreateShaderResourceView(m_pResource.Get(), nullptr, m_hCpuDescriptorHandle);
     }
 
+    FinishLoad();
+}
+
+void ManagedTexture::FinishLoad()
+{
     m_IsLoading = false;
+    m_LoadPromise.set_value();
 }
 
 void ManagedTexture::WaitForLoad( void ) const
 {
-    while ((volatile bool&)m_IsLoading)
-        this_thread::yield();
+    if (m_IsLoading)
+        m_Loaded.wait();
 }
 
 void ManagedTexture::Unload()
@@ -246,24 +299,34 @@ void TextureRef::operator= (TextureRef& rhs)
         ++m_ref->m_ReferenceCount;
 }
 
+void TextureRef::WaitForLoad() const
+{
+    if (m_ref != nullptr)
+        m_ref->WaitForLoad();
+}
+
 bool TextureRef::IsValid() const
 {
+    WaitForLoad();
     return m_ref && m_ref->IsValid();
 }
 
 const Texture* TextureRef::Get( void ) const
 {
+    WaitForLoad();
     return m_ref;
 }
 
 const Texture* TextureRef::operator->( void ) const
 {
     ASSERT(m_ref != nullptr);
+    WaitForLoad();
     return m_ref;
 }
 
 D3D12_CPU_DESCRIPTOR_HANDLE TextureRef::GetSRV() const
 {
+    WaitForLoad();
     if (m_ref != nullptr)
         return m_ref->GetSRV();
     else
@@ -281,6 +344,23 @@ TextureRef TextureManager::LoadDDSFromFile( const string& filePath, eDefaultText
     return LoadDDSFromFile(Utility::UTF8ToWideString(filePath), fallback, forceSRGB);
 }
 
+TextureRef TextureManager::LoadDDSFromFileAsync( const wstring& filePath, eDefaultTexture fallback, bool forceSRGB )
+{
+    bool created = false;
+    ManagedTexture* tex = FindOrCreateTexture(filePath, forceSRGB, created);
+    TextureRef ref = tex;
+
+    // The task holds a reference, so the texture outlives its load even if the
+    // caller lets go of theirs
+    if (created)
+    {
+        concurrency::create_task([ref, tex, filePath, fallback, forceSRGB]
+            { LoadTexture(tex, filePath, fallback, forceSRGB); });
+    }
+
+    return ref;
+}
+
 TextureRef TextureManager::LoadFromResource( char const* narrowPath, ID3D12Resource* resource, eDefaultTexture fallback, bool forceSRGB )
 {
     ManagedTexture* tex = nullptr;
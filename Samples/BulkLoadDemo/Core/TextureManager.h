@@ -41,8 +41,24 @@ namespace TextureManager
     TextureRef LoadDDSFromFile( const std::wstring& filePath, eDefaultTexture fallback = kMagenta2D, bool sRGB = false );
     TextureRef LoadDDSFromFile( const std::string& filePath, eDefaultTexture fallback = kMagenta2D, bool sRGB = false );
 
+    // Starts loading a texture from a DDS file on a worker thread, and returns
+    // straight away.  Requests for a file that's already loading share its load.
+    // Using the reference waits for the load to finish, so that many textures can
+    // be loaded in parallel by starting them all before using any of them.
+    TextureRef LoadDDSFromFileAsync( const std::wstring& filePath, eDefaultTexture fallback = kMagenta2D, bool sRGB = false );
+
     // Loads a texture, using a pre-loaded resource if available.
     TextureRef LoadFromResource( char const* path, ID3D12Resource* resource = nullptr, eDefaultTexture fallback = kMagenta2D, bool sRGB = false );
+
+    // Loads a DDS file straight into a new texture and creates its SRV, like
+    // CreateDDSTextureFromFile.  If it fails, the file is read and uploaded by
+    // LoadDDSFromFile as usual.
+    using DDSFileLoader = HRESULT (*)( const wchar_t* fileName, bool forceSRGB, ID3D12Resource** texture,
+        D3D12_CPU_DESCRIPTOR_HANDLE textureView );
+
+    // Sets the loader used by LoadDDSFromFile, or nullptr to read files with
+    // Utility::ReadFileSync.
+    void SetDDSFileLoader( DDSFileLoader loader );
 }
 
 // Forward declaration; private implementation
@@ -64,6 +80,9 @@ public:
     void operator= (std::nullptr_t);
     void operator= (TextureRef& rhs);
 
+    // Wait for the texture to finish loading.  The methods below wait too.
+    void WaitForLoad() const;
+
     // Check that this points to a valid texture (which loaded successfully)
     bool IsValid() const;
 
@@ -10,6 +10,7 @@
 #include "pch.h"
 
 #include "../BulkLoadDemo/MarcFileFormat.h"
+#include "../Core/DDSTextureLoader.h"
 #include "../Model/ModelLoader.h"
 #include "../Model/TextureConvert.h"
 #include "../Model/glTF.h"
@@ -18,22 +19,163 @@
 #include <dstorage.h>
 #include <zlib.h>
 
+#ifndef USE_LIBDEFLATE
+#define USE_LIBDEFLATE 0
+#endif
+
+#if USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifndef USE_GDEFLATE_LIBRARY
+#define USE_GDEFLATE_LIBRARY 0
+#endif
+
+#if USE_GDEFLATE_LIBRARY
+#if USE_LIBDEFLATE
+// The GDeflate library links its own copy of libdeflate
+#error USE_GDEFLATE_LIBRARY and USE_LIBDEFLATE can't be combined
+#endif
+#include <GDeflate.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <execution>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 using Microsoft::WRL::ComPtr;
+using Microsoft::WRL::Wrappers::Event;
 
 //
 // Global state used for compressing
 //
 
+// Textures are compressed on a pool of workers, which already keep every core
+// busy, so compression on a worker thread uses that thread alone.
+static thread_local bool t_isTextureWorker = false;
+
+#if !USE_GDEFLATE_LIBRARY
 static ComPtr<IDStorageCompressionCodec> g_bufferCompression;
 
+// The texture workers don't share g_bufferCompression.  Each worker thread
+// creates a codec of its own, with a single thread.
+static IDStorageCompressionCodec* GetBufferCompression()
+{
+    if (!t_isTextureWorker)
+        return g_bufferCompression.Get();
+
+    thread_local ComPtr<IDStorageCompressionCodec> workerCompression;
+    if (!workerCompression)
+    {
+        ASSERT_SUCCEEDED(
+            DStorageCreateCompressionCodec(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE, 1, IID_PPV_ARGS(&workerCompression)));
+    }
+    return workerCompression.Get();
+}
+#endif
+
+#if !USE_LIBDEFLATE
+//
+// Compresses source into a single ZLib stream, deflating 1 MiB chunks of it in
+// parallel the way pigz does.  Each chunk is primed with the 32 KiB of input
+// before it, so matches still reach back across chunk boundaries, and all but
+// the last end with a sync flush so that the chunks can be concatenated.  The
+// chunks' adler32 checksums are combined into the stream's.
+//
+static bool CompressZlibParallel(std::vector<char>& dest, char const* source, size_t sourceSize)
+{
+    constexpr size_t ChunkSize = 1024 * 1024;
+    constexpr size_t WindowSize = 32 * 1024;
+
+    size_t const numChunks = (sourceSize + ChunkSize - 1) / ChunkSize;
+    std::vector<std::vector<char>> chunks(numChunks);
+    std::vector<uLong> checksums(numChunks);
+    std::atomic<bool> failed = false;
+
+    std::vector<size_t> indices(numChunks);
+    std::iota(indices.begin(), indices.end(), size_t(0));
+
+    std::for_each(
+        std::execution::par,
+        indices.begin(),
+        indices.end(),
+        [&](size_t i)
+        {
+            size_t const begin = i * ChunkSize;
+            size_t const size = std::min(ChunkSize, sourceSize - begin);
+            bool const last = (i + 1) == numChunks;
+            auto input = reinterpret_cast<Bytef const*>(source + begin);
+
+            z_stream stream{};
+            if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                failed = true;
+                return;
+            }
+
+            if (begin > 0)
+            {
+                size_t const dictionarySize = std::min(WindowSize, begin);
+                deflateSetDictionary(&stream, input - dictionarySize, static_cast<uInt>(dictionarySize));
+            }
+
+            // A sync flush adds an empty stored block on top of the bound
+            std::vector<char>& chunk = chunks[i];
+            chunk.resize(deflateBound(&stream, static_cast<uLong>(size)) + 16);
+
+            stream.next_in = const_cast<Bytef*>(input);
+            stream.avail_in = static_cast<uInt>(size);
+            stream.next_out = reinterpret_cast<Bytef*>(chunk.data());
+            stream.avail_out = static_cast<uInt>(chunk.size());
+
+            int const result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+            bool const succeeded =
+                last ? (result == Z_STREAM_END) : (result == Z_OK && stream.avail_in == 0 && stream.avail_out != 0);
+            chunk.resize(stream.total_out);
+            deflateEnd(&stream);
+
+            checksums[i] = adler32(adler32(0, nullptr, 0), input, static_cast<uInt>(size));
+
+            if (!succeeded)
+                failed = true;
+        });
+
+    if (failed)
+        return false;
+
+    // The default-level ZLib header, then the chunks, then the checksum
+    dest.assign({char(0x78), char(0x9c)});
+
+    uLong checksum = adler32(0, nullptr, 0);
+    for (size_t i = 0; i < numChunks; ++i)
+    {
+        dest.insert(dest.end(), chunks[i].begin(), chunks[i].end());
+
+        z_off_t const size = static_cast<z_off_t>(std::min(ChunkSize, sourceSize - i * ChunkSize));
+        checksum = (i == 0) ? checksums[0] : adler32_combine(checksum, checksums[i], size);
+    }
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+        dest.push_back(static_cast<char>((checksum >> shift) & 0xff));
+
+    return true;
+}
+#endif
+
 template<typename T>
 static std::remove_reference_t<T> Compress(marc::Compression compression, T&& source)
 {
@@ -45,7 +187,11 @@ static std::remove_reference_t<T> Compress(marc::Compression compression, T&& so
     {
         size_t maxSize;
         if (compression == marc::Compression::GDeflate)
-            maxSize = g_bufferCompression->CompressBufferBound(static_cast<uint32_t>(source.size()));
+#if USE_GDEFLATE_LIBRARY
+            maxSize = GDeflate::CompressBound(source.size());
+#else
+            maxSize = GetBufferCompression()->CompressBufferBound(static_cast<uint32_t>(source.size()));
+#endif
         else if (compression == marc::Compression::Zlib)
             maxSize = static_cast<size_t>(compressBound(static_cast<uLong>(source.size())));
         else
@@ -60,29 +206,76 @@ static std::remove_reference_t<T> Compress(marc::Compression compression, T&& so
 
         if (compression == marc::Compression::GDeflate)
         {
-            compressionResult = g_bufferCompression->CompressBuffer(
+#if USE_GDEFLATE_LIBRARY
+            // The library compresses the 64 KiB tiles on a pool of its own,
+            // with one worker per hardware thread.  Its highest level is the
+            // one DSTORAGE_COMPRESSION_BEST_RATIO uses.
+            uint32_t const flags = t_isTextureWorker ? GDeflate::COMPRESS_SINGLE_THREAD : 0;
+
+            actualCompressedSize = dest.size();
+            bool const compressed = GDeflate::Compress(
+                reinterpret_cast<uint8_t*>(dest.data()),
+                &actualCompressedSize,
+                reinterpret_cast<uint8_t const*>(source.data()),
+                source.size(),
+                GDeflate::MaximumCompressionLevel,
+                flags);
+
+            compressionResult = compressed ? S_OK : E_FAIL;
+#else
+            compressionResult = GetBufferCompression()->CompressBuffer(
                 reinterpret_cast<const void*>(source.data()),
                 static_cast<uint32_t>(source.size()),
                 DSTORAGE_COMPRESSION_BEST_RATIO,
                 reinterpret_cast<void*>(dest.data()),
                 static_cast<uint32_t>(dest.size()),
                 &actualCompressedSize);
+#endif
         }
         else if (compression == marc::Compression::Zlib)
         {
-            uLong destSize = static_cast<uLong>(dest.size());
-            int result = compress(
-                reinterpret_cast<Bytef*>(dest.data()),
-                &destSize,
-                reinterpret_cast<Bytef const*>(source.data()),
-                static_cast<uLong>(source.size()));
+#if USE_LIBDEFLATE
+            // libdeflate writes the same ZLib format faster, at zlib's default level
+            libdeflate_compressor* compressor = libdeflate_alloc_compressor(6);
+            actualCompressedSize = compressor ? libdeflate_zlib_compress(
+                                                    compressor,
+                                                    source.data(),
+                                                    source.size(),
+                                                    dest.data(),
+                                                    dest.size())
+                                              : 0;
+            libdeflate_free_compressor(compressor);
+
+            compressionResult = actualCompressedSize != 0 ? S_OK : E_FAIL;
+#else
+            std::vector<char> parallel;
+            if (!t_isTextureWorker && source.size() > 1024 * 1024)
+            {
+                if (CompressZlibParallel(parallel, reinterpret_cast<char const*>(source.data()), source.size()))
+                    compressionResult = S_OK;
+                else
+                    compressionResult = E_FAIL;
 
-            if (result == Z_OK)
-                compressionResult = S_OK;
+                dest.assign(parallel.begin(), parallel.end());
+                actualCompressedSize = dest.size();
+            }
             else
-                compressionResult = E_FAIL;
-
-            actualCompressedSize = destSize;
+            {
+                uLong destSize = static_cast<uLong>(dest.size());
+                int result = compress(
+                    reinterpret_cast<Bytef*>(dest.data()),
+                    &destSize,
+                    reinterpret_cast<Bytef const*>(source.data()),
+                    static_cast<uLong>(source.size()));
+
+                if (result == Z_OK)
+                    compressionResult = S_OK;
+                else
+                    compressionResult = E_FAIL;
+
+                actualCompressedSize = destSize;
+            }
+#endif
         }
 
         if (FAILED(compressionResult))
@@ -98,31 +291,121 @@ static std::remove_reference_t<T> Compress(marc::Compression compression, T&& so
     }
 }
 
-static std::string Compress(marc::Compression compression, std::stringstream sourceStream)
+//
+// Which bytes of a block are endpoints, for the BCn formats whose endpoints
+// and indices are whole bytes.  BC6H and BC7 pack them at bit offsets that
+// depend on each block's mode, so they aren't split.
+//
+static bool GetBcSplitLayout(DXGI_FORMAT format, marc::BcSplitHeader& header)
 {
-    auto source = sourceStream.str();
-    return Compress(compression, std::move(source));
+    switch (format)
+    {
+    case DXGI_FORMAT_BC1_TYPELESS:
+    case DXGI_FORMAT_BC1_UNORM:
+    case DXGI_FORMAT_BC1_UNORM_SRGB:
+        // Two RGB565 colors, then the indices
+        header = {8, 0, 0x000f};
+        return true;
+
+    case DXGI_FORMAT_BC2_TYPELESS:
+    case DXGI_FORMAT_BC2_UNORM:
+    case DXGI_FORMAT_BC2_UNORM_SRGB:
+        // Explicit alpha, which is treated as indices, then a BC1 color block
+        header = {16, 0, 0x0f00};
+        return true;
+
+    case DXGI_FORMAT_BC3_TYPELESS:
+    case DXGI_FORMAT_BC3_UNORM:
+    case DXGI_FORMAT_BC3_UNORM_SRGB:
+        // A BC4 alpha block, then a BC1 color block
+        header = {16, 0, 0x0f03};
+        return true;
+
+    case DXGI_FORMAT_BC4_TYPELESS:
+    case DXGI_FORMAT_BC4_UNORM:
+    case DXGI_FORMAT_BC4_SNORM:
+        // Two 8-bit endpoints, then 3-bit indices
+        header = {8, 0, 0x0003};
+        return true;
+
+    case DXGI_FORMAT_BC5_TYPELESS:
+    case DXGI_FORMAT_BC5_UNORM:
+    case DXGI_FORMAT_BC5_SNORM:
+        // Two BC4 blocks
+        header = {16, 0, 0x0303};
+        return true;
+
+    default:
+        return false;
+    }
 }
 
-template<typename T>
-void WriteArray(std::ostream& s, T const* data, size_t count)
+//
+// A region that's built in memory.  It has the parts of std::ostream's
+// interface that the helpers below use, so they write to either, but it
+// writes straight into one contiguous buffer, patches it in place, and hands
+// the buffer to the compressor without copying it.
+//
+class ByteWriter
+{
+    std::vector<char> m_data;
+
+public:
+    void reserve(size_t size)
+    {
+        m_data.reserve(size);
+    }
+
+    ByteWriter& write(char const* data, std::streamsize size)
+    {
+        m_data.insert(m_data.end(), data, data + size);
+        return *this;
+    }
+
+    ByteWriter& put(char c)
+    {
+        m_data.push_back(c);
+        return *this;
+    }
+
+    std::streampos tellp() const
+    {
+        return static_cast<std::streamoff>(m_data.size());
+    }
+
+    void Patch(std::streampos pos, void const* data, size_t size)
+    {
+        size_t const offset = static_cast<size_t>(static_cast<std::streamoff>(pos));
+        assert(offset + size <= m_data.size());
+        memcpy(m_data.data() + offset, data, size);
+    }
+
+    std::vector<char> Release()
+    {
+        return std::move(m_data);
+    }
+};
+
+template<typename STREAM, typename T>
+void WriteArray(STREAM& s, T const* data, size_t count)
 {
     s.write((char*)data, sizeof(*data) * count);
 }
 
-template<typename CONTAINER>
-marc::Array<typename CONTAINER::value_type> WriteArray(std::ostream& s, CONTAINER const& data)
+template<typename STREAM, typename CONTAINER>
+marc::Array<typename CONTAINER::value_type> WriteArray(STREAM& s, CONTAINER const& data)
 {
     auto pos = s.tellp();
     WriteArray(s, data.data(), data.size());
 
-    marc::Array<typename CONTAINER::value_type> array;
-    array.Data.Offset = static_cast<uint32_t>(pos);
+    marc::Array<typename CONTAINER::value_type> array{};
+    array.Data.Offset = static_cast<uint64_t>(pos);
 
     return array;
 }
 
-static std::streampos PadToAlignment(std::ostream& s, uint64_t alignment)
+template<typename STREAM>
+static std::streampos PadToAlignment(STREAM& s, uint64_t alignment)
 {
     auto pos = s.tellp();
 
@@ -144,9 +427,9 @@ static std::streampos PadToAlignment(std::ostream& s, uint64_t alignment)
     }
 }
 
-template<typename CONTAINER>
+template<typename STREAM, typename CONTAINER>
 marc::Ptr<typename CONTAINER::value_type> WriteElementAlignedArray(
-    std::ostream& s,
+    STREAM& s,
     CONTAINER const& data,
     uint64_t alignment)
 {
@@ -160,8 +443,8 @@ marc::Ptr<typename CONTAINER::value_type> WriteElementAlignedArray(
 
     assert(pos % D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT == 0);
 
-    marc::Ptr<typename CONTAINER::value_type> ptr;
-    ptr.Offset = static_cast<uint32_t>(pos);
+    marc::Ptr<typename CONTAINER::value_type> ptr{};
+    ptr.Offset = static_cast<uint64_t>(pos);
 
     return ptr;
 }
@@ -174,14 +457,19 @@ void Patch(std::ostream& s, std::streampos pos, void const* data, size_t size)
     s.seekp(oldPos);
 }
 
-template<typename T>
-void Patch(std::ostream& s, std::streampos pos, T const& value)
+void Patch(ByteWriter& s, std::streampos pos, void const* data, size_t size)
+{
+    s.Patch(pos, data, size);
+}
+
+template<typename STREAM, typename T>
+void Patch(STREAM& s, std::streampos pos, T const& value)
 {
     Patch(s, pos, &value, sizeof(value));
 }
 
-template<typename T>
-void Patch(std::ostream& s, std::streampos pos, std::vector<T> const& values)
+template<typename STREAM, typename T>
+void Patch(STREAM& s, std::streampos pos, std::vector<T> const& values)
 {
     Patch(s, pos, values.data(), values.size() * sizeof(T));
 }
@@ -199,13 +487,15 @@ public:
     {
     }
 
-    void Set(std::ostream& stream, T const& value) const
+    template<typename STREAM>
+    void Set(STREAM& stream, T const& value) const
     {
         Patch(stream, m_pos, value);
     }
 
     // Overload that only works when T is a marc::Ptr<> (SFINAE)
-    void Set(std::ostream& stream, std::streampos value) const
+    template<typename STREAM>
+    void Set(STREAM& stream, std::streampos value) const
     {
         T t;
         t.OffsetFromRegionStart = static_cast<uint64_t>(value);
@@ -230,8 +520,8 @@ Fixup<FIXUP> MakeFixup(std::streampos startPos, T const* src, FIXUP const* fixup
     return Fixup<FIXUP>(fixupPos);
 }
 
-template<typename T, typename... FIXUPS>
-std::tuple<Fixup<FIXUPS>...> WriteStruct(std::ostream& out, T const* src, FIXUPS const*... fixups)
+template<typename STREAM, typename T, typename... FIXUPS>
+std::tuple<Fixup<FIXUPS>...> WriteStruct(STREAM& out, T const* src, FIXUPS const*... fixups)
 {
     auto startPos = out.tellp();
     out.write(reinterpret_cast<char const*>(src), sizeof(*src));
@@ -239,6 +529,34 @@ std::tuple<Fixup<FIXUPS>...> WriteStruct(std::ostream& out, T const* src, FIXUPS
     return std::make_tuple(MakeFixup(startPos, src, fixups)...);
 }
 
+//
+// Ptrs are built up holding the offset of their target from the start of the
+// region, and are made self-relative (see marc::Ptr) just before the structure
+// that holds them is written to ownerPos.
+//
+template<typename OWNER, typename T>
+void MakePtrSelfRelative(std::streampos ownerPos, OWNER const& owner, marc::Ptr<T>& ptr)
+{
+    if (ptr.Offset == 0)
+        return;
+
+    auto fieldOffset = reinterpret_cast<char const*>(&ptr) - reinterpret_cast<char const*>(&owner);
+    int64_t fieldPos = static_cast<int64_t>(ownerPos) + fieldOffset;
+    ptr.Offset = static_cast<uint64_t>(static_cast<int64_t>(ptr.Offset) - fieldPos);
+}
+
+template<typename OWNER, typename T>
+void MakePtrSelfRelative(std::streampos ownerPos, OWNER const& owner, marc::Array<T>& array)
+{
+    MakePtrSelfRelative(ownerPos, owner, array.Data);
+}
+
+template<typename OWNER, typename... PTRS>
+void MakeSelfRelative(std::streampos ownerPos, OWNER const& owner, PTRS&... ptrs)
+{
+    (MakePtrSelfRelative(ownerPos, owner, ptrs), ...);
+}
+
 static void Set(float dest[4], Math::BoundingSphere const& src)
 {
     dest[0] = src.GetCenter().GetX();
@@ -254,51 +572,562 @@ static void Set(float dest[3], Math::Vector3 const& src)
     dest[2] = src.GetZ();
 }
 
+//
+// FNV-1a, for keying things by their content
+//
+class Fnv1a
+{
+    uint64_t m_hash = 14695981039346656037ull;
+
+public:
+    void Add(void const* data, size_t size)
+    {
+        auto bytes = static_cast<unsigned char const*>(data);
+        for (size_t i = 0; i < size; ++i)
+            m_hash = (m_hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    template<typename T>
+    void Add(T const& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Add(&value, sizeof(value));
+    }
+
+    uint64_t Get() const
+    {
+        return m_hash;
+    }
+};
+
 namespace
 {
     using namespace marc;
 
+    // Where a region is decompressed to
+    enum class RegionTarget
+    {
+        Gpu, // textures and buffers
+        Cpu, // the CPU metadata and CPU data, which are read into system memory
+    };
+
+    //
+    // Used by -auto to choose each region's compression.  A region costs the
+    // time to read its compressed bytes at the target bandwidth plus the time
+    // to decode it.  GDeflate regions that go to the GPU are decoded by the
+    // GPU; everything else, including all ZLib, is decoded on the CPU.  The
+    // decode rates are rough figures, in bytes written per second; the
+    // bandwidth of the drive the archives are meant for matters more.
+    //
+    struct CompressionCostModel
+    {
+        double ReadBytesPerSecond;
+
+        static constexpr double GpuGDeflateBytesPerSecond = 20e9;
+        static constexpr double CpuGDeflateBytesPerSecond = 2e9;
+        static constexpr double CpuZlibBytesPerSecond = 0.5e9;
+
+        double GetCost(
+            Compression compression,
+            RegionTarget target,
+            size_t compressedSize,
+            size_t uncompressedSize) const
+        {
+            double seconds = compressedSize / ReadBytesPerSecond;
+
+            switch (compression)
+            {
+            case Compression::GDeflate:
+                seconds += uncompressedSize /
+                           (target == RegionTarget::Gpu ? GpuGDeflateBytesPerSecond : CpuGDeflateBytesPerSecond);
+                break;
+
+            case Compression::Zlib:
+            case Compression::ZlibBcSplit:
+                seconds += uncompressedSize / CpuZlibBytesPerSecond;
+                break;
+
+            default:
+                break;
+            }
+
+            return seconds;
+        }
+    };
+
+    // Where a texture is converted from, and how
+    struct TextureSource
+    {
+        std::string Name;
+        std::filesystem::path Path;
+        uint8_t Flags;
+
+        // The texture's index in the texture store, or NotShared
+        uint32_t SharedIndex = NotShared;
+    };
+
+    // How a file written in a batch refers to the batch's texture store
+    struct TextureStoreRef
+    {
+        bool IsTextureStore = false;
+
+        // The store's filename, relative to the file's directory
+        std::string Name;
+
+        // The descs of the store's textures, as it was written
+        std::vector<D3D12_RESOURCE_DESC> const* Descs = nullptr;
+    };
+
+    //
+    // Textures are shared by their content, so the same image referenced from
+    // different files, or under different names, is stored once.  The conversion
+    // flags are part of the key since they change what's written.  The same key
+    // names a converted texture in the cache.
+    //
+    uint64_t HashTextureSource(TextureSource const& source)
+    {
+        Fnv1a hash;
+
+        std::ifstream file(source.Path, std::ios::in | std::ios::binary);
+        if (!file)
+        {
+            std::cout << "Unable to read " << source.Path.string().c_str() << std::endl;
+            throw std::runtime_error("Texture load failed");
+        }
+
+        std::vector<char> buffer(1024 * 1024);
+        while (file)
+        {
+            file.read(buffer.data(), buffer.size());
+            hash.Add(buffer.data(), static_cast<size_t>(file.gcount()));
+        }
+
+        hash.Add(source.Flags);
+        return hash.Get();
+    }
+
+    //
+    // With -cache, every compressed region is also kept in a file of its own,
+    // named by a hash of its uncompressed bytes and of the settings that
+    // decide how it's compressed.  When a later export produces the same
+    // region, because neither its source nor the settings have changed, the
+    // file is read back instead of compressing the region again.  Converted
+    // textures are kept the same way, as DDS files named by HashTextureSource,
+    // so an unchanged texture isn't converted again either.
+    //
+    class RegionCache
+    {
+        std::filesystem::path m_directory;
+
+        // At the start of each file, ahead of the compressed bytes
+        struct EntryHeader
+        {
+            uint32_t UncompressedSize;
+            Compression Compression;
+        };
+
+    public:
+        explicit RegionCache(std::filesystem::path directory)
+            : m_directory(std::move(directory))
+        {
+            std::filesystem::create_directories(m_directory);
+        }
+
+        bool Load(uint64_t key, uint32_t uncompressedSize, Compression& compression, std::vector<char>& data) const
+        {
+            std::ifstream file(GetPath(key), std::ios::in | std::ios::binary | std::ios::ate);
+            if (!file)
+                return false;
+
+            std::streamoff const dataSize = static_cast<std::streamoff>(file.tellg()) - sizeof(EntryHeader);
+            if (dataSize < 0)
+                return false;
+
+            EntryHeader header{};
+            file.seekg(0);
+            if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+                header.UncompressedSize != uncompressedSize)
+                return false;
+
+            data.resize(static_cast<size_t>(dataSize));
+            if (!file.read(data.data(), dataSize))
+                return false;
+
+            compression = header.Compression;
+            return true;
+        }
+
+        void Store(
+            uint64_t key,
+            uint32_t uncompressedSize,
+            Compression compression,
+            std::vector<char> const& data) const
+        {
+            WriteEntry(
+                GetPath(key, ".region"),
+                [&](std::ofstream& file)
+                {
+                    EntryHeader header{uncompressedSize, compression};
+                    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                    file.write(data.data(), data.size());
+                });
+        }
+
+        bool LoadTexture(uint64_t key, ScratchImage& image) const
+        {
+            std::filesystem::path const path = GetPath(key, ".dds");
+            if (!std::filesystem::exists(path))
+                return false;
+
+            return SUCCEEDED(LoadFromDDSFile(path.c_str(), DDS_FLAGS_NONE, nullptr, image));
+        }
+
+        void StoreTexture(uint64_t key, ScratchImage const& image) const
+        {
+            std::filesystem::path const path = GetPath(key, ".dds");
+
+            Blob blob;
+            if (FAILED(SaveToDDSMemory(
+                    image.GetImages(),
+                    image.GetImageCount(),
+                    image.GetMetadata(),
+                    DDS_FLAGS_NONE,
+                    blob)))
+            {
+                std::cout << "Unable to write " << path.string().c_str() << " to the cache" << std::endl;
+                return;
+            }
+
+            WriteEntry(
+                path,
+                [&](std::ofstream& file)
+                { file.write(static_cast<char const*>(blob.GetBufferPointer()), blob.GetBufferSize()); });
+        }
+
+    private:
+        std::filesystem::path GetPath(uint64_t key, char const* extension) const
+        {
+            std::stringstream name;
+            name << std::hex << std::setw(16) << std::setfill('0') << key << extension;
+            return m_directory / name.str();
+        }
+
+        template <typename WRITE>
+        void WriteEntry(std::filesystem::path const& path, WRITE&& write) const
+        {
+            // The entry is written under a name of its own and then renamed,
+            // so that an interrupted export, or another worker storing the
+            // same entry, can't leave a partial entry behind.
+            std::stringstream tempName;
+            tempName << path.filename().string() << "." << std::this_thread::get_id() << ".tmp";
+            std::filesystem::path const tempPath = m_directory / tempName.str();
+
+            bool written;
+            {
+                std::ofstream file(tempPath, std::ios::out | std::ios::trunc | std::ios::binary);
+                write(file);
+                written = static_cast<bool>(file);
+            }
+
+            std::error_code ec;
+            if (written)
+                std::filesystem::rename(tempPath, path, ec);
+
+            if (!written || ec)
+            {
+                std::filesystem::remove(tempPath, ec);
+                std::cout << "Unable to write " << path.string().c_str() << " to the cache" << std::endl;
+            }
+        }
+    };
+
+    //
+    // With -swizzle, textures are also written in the 64KB_STANDARD_SWIZZLE
+    // layout, which the GPU produces: the texture is uploaded into a resource
+    // with that layout, and its memory is read back through a buffer placed
+    // over it.  The standard swizzle is a defined layout, so the buffer
+    // inherits the texture's bytes, and they're the same on every adapter
+    // that supports it.  The textures are swizzled one at a time.
+    //
+    class TextureSwizzler
+    {
+        std::mutex m_mutex;
+        ComPtr<ID3D12Device> m_device;
+        ComPtr<ID3D12CommandQueue> m_queue;
+        ComPtr<ID3D12CommandAllocator> m_allocator;
+        ComPtr<ID3D12GraphicsCommandList> m_commandList;
+        ComPtr<ID3D12Fence> m_fence;
+        uint64_t m_fenceValue = 0;
+        Event m_fenceEvent;
+
+    public:
+        // The heap that holds the texture and the buffer over it must allow
+        // both, which needs resource heap tier 2
+        static bool IsSupported(ID3D12Device* device)
+        {
+            D3D12_FEATURE_DATA_D3D12_OPTIONS options{};
+            if (FAILED(device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options))))
+                return false;
+
+            return options.StandardSwizzle64KBSupported && options.ResourceHeapTier >= D3D12_RESOURCE_HEAP_TIER_2;
+        }
+
+        explicit TextureSwizzler(ID3D12Device* device)
+            : m_device(device)
+            , m_fenceEvent(CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS))
+        {
+            D3D12_COMMAND_QUEUE_DESC queueDesc{};
+            queueDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+
+            if (FAILED(m_device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&m_queue))) ||
+                FAILED(m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_COPY, IID_PPV_ARGS(&m_allocator))) ||
+                FAILED(m_device->CreateCommandList(
+                    0,
+                    D3D12_COMMAND_LIST_TYPE_COPY,
+                    m_allocator.Get(),
+                    nullptr,
+                    IID_PPV_ARGS(&m_commandList))) ||
+                FAILED(m_commandList->Close()) ||
+                FAILED(m_device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&m_fence))) ||
+                !m_fenceEvent.IsValid())
+            {
+                throw std::runtime_error("Failed to create the texture swizzler");
+            }
+        }
+
+        //
+        // Returns the memory of a texture with the given desc and contents, in
+        // the standard swizzle, or nothing if the device can't create the
+        // texture with that layout.
+        //
+        std::vector<char> Swizzle(D3D12_RESOURCE_DESC desc, std::vector<D3D12_SUBRESOURCE_DATA> const& subresources)
+        {
+            std::lock_guard lock(m_mutex);
+
+            desc.Layout = D3D12_TEXTURE_LAYOUT_64KB_STANDARD_SWIZZLE;
+            desc.Alignment = 0;
+
+            D3D12_RESOURCE_ALLOCATION_INFO const info = m_device->GetResourceAllocationInfo(0, 1, &desc);
+            if (info.SizeInBytes == UINT64_MAX)
+                return {};
+
+            CD3DX12_HEAP_DESC heapDesc(
+                info.SizeInBytes,
+                D3D12_HEAP_TYPE_DEFAULT,
+                info.Alignment,
+                D3D12_HEAP_FLAG_ALLOW_ALL_BUFFERS_AND_TEXTURES);
+            CD3DX12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(info.SizeInBytes);
+
+            ComPtr<ID3D12Heap> heap;
+            ComPtr<ID3D12Resource> texture;
+            ComPtr<ID3D12Resource> buffer;
+            if (FAILED(m_device->CreateHeap(&heapDesc, IID_PPV_ARGS(&heap))) ||
+                FAILED(m_device->CreatePlacedResource(
+                    heap.Get(),
+                    0,
+                    &desc,
+                    D3D12_RESOURCE_STATE_COPY_DEST,
+                    nullptr,
+                    IID_PPV_ARGS(&texture))) ||
+                FAILED(m_device->CreatePlacedResource(
+                    heap.Get(),
+                    0,
+                    &bufferDesc,
+                    D3D12_RESOURCE_STATE_COMMON,
+                    nullptr,
+                    IID_PPV_ARGS(&buffer))))
+            {
+                return {};
+            }
+
+            UINT const numSubresources = static_cast<UINT>(subresources.size());
+            CD3DX12_HEAP_PROPERTIES uploadHeap(D3D12_HEAP_TYPE_UPLOAD);
+            CD3DX12_HEAP_PROPERTIES readbackHeap(D3D12_HEAP_TYPE_READBACK);
+            CD3DX12_RESOURCE_DESC uploadDesc =
+                CD3DX12_RESOURCE_DESC::Buffer(GetRequiredIntermediateSize(texture.Get(), 0, numSubresources));
+
+            ComPtr<ID3D12Resource> upload;
+            ComPtr<ID3D12Resource> readback;
+            if (FAILED(m_device->CreateCommittedResource(
+                    &uploadHeap,
+                    D3D12_HEAP_FLAG_NONE,
+                    &uploadDesc,
+                    D3D12_RESOURCE_STATE_GENERIC_READ,
+                    nullptr,
+                    IID_PPV_ARGS(&upload))) ||
+                FAILED(m_device->CreateCommittedResource(
+                    &readbackHeap,
+                    D3D12_HEAP_FLAG_NONE,
+                    &bufferDesc,
+                    D3D12_RESOURCE_STATE_COPY_DEST,
+                    nullptr,
+                    IID_PPV_ARGS(&readback))))
+            {
+                throw std::runtime_error("Failed to create the swizzling buffers");
+            }
+
+            m_allocator->Reset();
+            m_commandList->Reset(m_allocator.Get(), nullptr);
+
+            UpdateSubresources(
+                m_commandList.Get(),
+                texture.Get(),
+                upload.Get(),
+                0,
+                0,
+                numSubresources,
+                subresources.data());
+
+            auto barrier = CD3DX12_RESOURCE_BARRIER::Aliasing(texture.Get(), buffer.Get());
+            m_commandList->ResourceBarrier(1, &barrier);
+
+            m_commandList->CopyBufferRegion(readback.Get(), 0, buffer.Get(), 0, info.SizeInBytes);
+
+            if (FAILED(m_commandList->Close()))
+                throw std::runtime_error("Failed to record the texture swizzle");
+
+            ID3D12CommandList* commandLists[] = {m_commandList.Get()};
+            m_queue->ExecuteCommandLists(1, commandLists);
+            m_queue->Signal(m_fence.Get(), ++m_fenceValue);
+            m_fence->SetEventOnCompletion(m_fenceValue, m_fenceEvent.Get());
+            WaitForSingleObject(m_fenceEvent.Get(), INFINITE);
+
+            std::vector<char> data(static_cast<size_t>(info.SizeInBytes));
+
+            void* mapped = nullptr;
+            D3D12_RANGE readRange{0, data.size()};
+            if (FAILED(readback->Map(0, &readRange, &mapped)))
+                throw std::runtime_error("Failed to read back the swizzled texture");
+
+            std::memcpy(data.data(), mapped, data.size());
+
+            D3D12_RANGE writtenRange{};
+            readback->Unmap(0, &writtenRange);
+
+            return data;
+        }
+    };
+
     class Exporter
     {
         std::ostream& m_out;
         Compression m_compression;
-        TexConversionFlags m_extraTextureFlags;
+        Compression m_cpuCompression; // For the regions the CPU reads
+        std::optional<CompressionCostModel> m_autoCompression;
+        bool m_bcSplit;
+        bool m_loadOrder;
+        uint32_t m_regionAlignment;
         uint32_t m_stagingBufferSizeBytes;
-        glTF::Asset const& m_asset;
+        bool m_tiled;
+        std::unique_ptr<TextureSwizzler> m_swizzler; // with -swizzle, if the device supports it
+        std::vector<TextureSource> m_textures;
         Renderer::ModelData const& m_modelData;
+        TextureStoreRef m_textureStore;
+        RegionCache const* m_cache;
 
         ComPtr<ID3D12Device> m_device;
 
+        // The adapter and driver that m_device runs on; the texture layouts
+        // are only written if they're known
+        std::optional<marc::AdapterId> m_adapterId;
+
         std::streampos m_materialConstantsGpuOffset;
 
         struct TextureMetadata
         {
             std::vector<marc::GpuRegion> SingleMips;
             marc::GpuRegion RemainingMips;
+            uint32_t NumTiledMips = 0;
+            uint32_t NumHeapTiles = 0;
+            std::vector<marc::TextureTile> Tiles;
+            std::vector<marc::TextureMipBand> MipBands;
+            uint64_t SwizzledSize = 0;
+            std::vector<marc::GpuRegion> SwizzledParts;
         };
 
         std::vector<TextureMetadata> m_textureMetadata;
         std::vector<D3D12_RESOURCE_DESC> m_textureDescs;
 
+        // A region that has been compressed but not yet written to m_out
+        struct PendingRegion
+        {
+            Compression Compression;
+            std::vector<char> Data;
+            uint32_t UncompressedSize;
+            std::string Name;
+            bool Cached = false;
+        };
+
+        // A texture that has been converted, with its regions compressed and
+        // ready to be written out.  The regions are written in the order
+        // Tiles, SingleMips, MipBands, RemainingMips, and the metadata's
+        // regions are filled in as they are.
+        struct PreparedTexture
+        {
+            TextureMetadata Metadata;
+            D3D12_RESOURCE_DESC Desc;
+            std::vector<PendingRegion> Tiles;
+            std::vector<PendingRegion> SingleMips;
+            std::vector<PendingRegion> MipBands;
+            std::optional<PendingRegion> RemainingMips;
+            std::vector<PendingRegion> SwizzledParts;
+        };
+
+        // Serializes the workers' progress messages
+        std::mutex m_consoleMutex;
+
         Exporter(
             std::ostream& out,
             Compression compression,
-            TexConversionFlags extraTextureFlags,
+            Compression cpuCompression,
+            std::optional<CompressionCostModel> autoCompression,
+            bool bcSplit,
+            bool loadOrder,
+            uint32_t regionAlignment,
             uint32_t stagingBufferSizeBytes,
-            glTF::Asset const& asset,
-            Renderer::ModelData const& modelData)
+            bool tiled,
+            bool swizzle,
+            std::vector<TextureSource> textures,
+            Renderer::ModelData const& modelData,
+            TextureStoreRef textureStore,
+            RegionCache const* cache)
             : m_out(out)
             , m_stagingBufferSizeBytes(stagingBufferSizeBytes)
+            , m_tiled(tiled)
             , m_compression(compression)
-            , m_extraTextureFlags(extraTextureFlags)
-            , m_asset(asset)
+            , m_cpuCompression(cpuCompression)
+            , m_autoCompression(autoCompression)
+            , m_bcSplit(bcSplit)
+            , m_loadOrder(loadOrder)
+            , m_regionAlignment(regionAlignment)
+            , m_textures(std::move(textures))
             , m_modelData(modelData)
+            , m_textureStore(std::move(textureStore))
+            , m_cache(cache)
         {
             if (auto hr = D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&m_device)); FAILED(hr))
             {
                 std::cout << "Failed to create D3D12 device: 0x" << std::hex << hr << std::endl;
                 throw std::runtime_error("Failed to create D3D12 device");
             }
+
+            ComPtr<IDXGIFactory4> dxgiFactory;
+            ComPtr<IDXGIAdapter> adapter;
+            marc::AdapterId adapterId;
+            if (SUCCEEDED(CreateDXGIFactory1(IID_PPV_ARGS(&dxgiFactory))) &&
+                SUCCEEDED(dxgiFactory->EnumAdapterByLuid(m_device->GetAdapterLuid(), IID_PPV_ARGS(&adapter))) &&
+                marc::GetAdapterId(adapter.Get(), adapterId))
+            {
+                m_adapterId = adapterId;
+            }
+
+            if (swizzle)
+            {
+                if (TextureSwizzler::IsSupported(m_device.Get()))
+                    m_swizzler = std::make_unique<TextureSwizzler>(m_device.Get());
+                else
+                    std::cout << "The device can't swizzle textures; -swizzle is ignored" << std::endl;
+            }
         }
 
         void Export()
@@ -315,26 +1144,133 @@ namespace
 
             auto [fixupHeader] = WriteStruct(m_out, &header, &header);
 
-            WriteTextures();
-            header.UnstructuredGpuData = WriteUnstructuredGpuData();
+            if (m_loadOrder)
+            {
+                // The regions are written in the order they're needed, so that
+                // a load reads forwards through the file: the least detailed
+                // mips and the CPU and GPU data, which a model must have before
+                // it's shown, and then the detailed mips.  The textures are all
+                // held in memory until the CPU and GPU data have been written.
+                std::vector<PreparedTexture> textures;
+                PrepareTextures([&](PreparedTexture texture) { textures.push_back(std::move(texture)); });
+
+                for (PreparedTexture& texture : textures)
+                    WriteRemainingMips(texture);
+
+                PendingRegion gpuData = BuildUnstructuredGpuData();
+                header.CpuData = WriteCpuData();
+                header.UnstructuredGpuData = AppendRegion<void>(gpuData);
+
+                for (PreparedTexture& texture : textures)
+                {
+                    WriteDetailedMips(texture);
+                    AddTexture(std::move(texture));
+                }
+            }
+            else
+            {
+                PrepareTextures([&](PreparedTexture texture) { WritePreparedTexture(std::move(texture)); });
+                header.UnstructuredGpuData = AppendRegion<void>(BuildUnstructuredGpuData());
+                header.CpuData = WriteCpuData();
+            }
+
+            // The CPU metadata is written last, so that a loader can read it
+            // along with the header by speculatively reading the end of the
+            // file.
             header.CpuMetadata = WriteCpuMetadata();
-            header.CpuData = WriteCpuData();
 
             fixupHeader.Set(m_out, header);
         }
 
-        void WriteTextures()
+        //
+        // The textures are converted, and their regions compressed, in
+        // parallel on the worker pool.  Each texture is passed to onPrepared,
+        // on this thread, as soon as it and all the textures before it are
+        // ready, so that writing them gives the file the same layout as if
+        // they had been written one at a time.
+        //
+        void PrepareTextures(std::function<void(PreparedTexture)> const& onPrepared)
         {
-            for (size_t i = 0; i < m_modelData.m_TextureNames.size(); ++i)
-            {
-                std::string const& textureName = m_modelData.m_TextureNames[i];
-                uint8_t flags = m_modelData.m_TextureOptions[i];
-                flags |= m_extraTextureFlags;
-                WriteTexture(textureName, flags);
-            }
+            size_t const numTextures = m_textures.size();
+
+            std::vector<std::promise<PreparedTexture>> promises(numTextures);
+            std::vector<std::future<PreparedTexture>> futures;
+            futures.reserve(numTextures);
+            for (auto& promise : promises)
+                futures.push_back(promise.get_future());
+
+            auto workers = std::async(
+                std::launch::async,
+                [&]
+                {
+                    std::vector<size_t> indices(numTextures);
+                    std::iota(indices.begin(), indices.end(), size_t(0));
+
+                    std::for_each(
+                        std::execution::par,
+                        indices.begin(),
+                        indices.end(),
+                        [&](size_t i)
+                        {
+                            t_isTextureWorker = true;
+                            try
+                            {
+                                TextureSource const& source = m_textures[i];
+                                if (source.SharedIndex != NotShared)
+                                    promises[i].set_value(PrepareSharedTexture(source.SharedIndex));
+                                else
+                                    promises[i].set_value(PrepareTexture(source));
+                            }
+                            catch (...)
+                            {
+                                promises[i].set_exception(std::current_exception());
+                            }
+                            t_isTextureWorker = false;
+                        });
+                });
+
+            for (auto& future : futures)
+                onPrepared(future.get());
+
+            workers.get();
+        }
+
+        void WritePreparedTexture(PreparedTexture texture)
+        {
+            WriteDetailedMips(texture);
+            WriteRemainingMips(texture);
+            AddTexture(std::move(texture));
+        }
+
+        void WriteDetailedMips(PreparedTexture& texture)
+        {
+            for (size_t i = 0; i < texture.Tiles.size(); ++i)
+                texture.Metadata.Tiles[i].Data = AppendRegion<void>(texture.Tiles[i]);
+
+            for (PendingRegion const& region : texture.SingleMips)
+                texture.Metadata.SingleMips.push_back(AppendRegion<void>(region));
+
+            for (size_t i = 0; i < texture.MipBands.size(); ++i)
+                texture.Metadata.MipBands[i].Data = AppendRegion<void>(texture.MipBands[i]);
+
+            for (PendingRegion const& region : texture.SwizzledParts)
+                texture.Metadata.SwizzledParts.push_back(AppendRegion<void>(region));
         }
 
-        marc::GpuRegion WriteTextureRegion(
+        void WriteRemainingMips(PreparedTexture& texture)
+        {
+            if (texture.RemainingMips)
+                texture.Metadata.RemainingMips = AppendRegion<void>(*texture.RemainingMips);
+        }
+
+        // Once all of its regions have been written
+        void AddTexture(PreparedTexture texture)
+        {
+            m_textureMetadata.push_back(std::move(texture.Metadata));
+            m_textureDescs.push_back(texture.Desc);
+        }
+
+        PendingRegion BuildTextureRegion(
             uint32_t currentSubresource,
             uint32_t numSubresources,
             std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> const& layouts,
@@ -342,6 +1278,7 @@ namespace
             std::vector<UINT64> const& rowSizes,
             uint64_t totalBytes,
             std::vector<D3D12_SUBRESOURCE_DATA> const& subresources,
+            DXGI_FORMAT format,
             std::string const& name)
         {
             std::vector<char> data(totalBytes);
@@ -364,21 +1301,283 @@ namespace
                     layout.Footprint.Depth);
             }
 
-            return WriteRegion<void>(data, name.c_str());
+            return CompressRegion(std::move(data), name, RegionTarget::Gpu, format);
         }
 
-        void WriteTexture(std::string const& name, uint8_t flags)
+        //
+        // Tiled textures store each 64KB tile of their standard MIPs as a
+        // separate region, so the runtime can map them into a reserved resource
+        // and load them one tile at a time.  Returns false if the texture can't
+        // be tiled, in which case it is written the usual way.
+        //
+        bool TryPrepareTiledTexture(
+            std::string const& name,
+            D3D12_RESOURCE_DESC const& desc,
+            std::vector<D3D12_SUBRESOURCE_DATA> const& subresources,
+            PreparedTexture& prepared)
         {
-            std::filesystem::path texturePath = m_asset.m_basePath;
-            texturePath /= name;
-            texturePath = absolute(texturePath);
-
-            std::cout << "Converting " << name << std::endl;
-            auto image = BuildDDS(texturePath.wstring().c_str(), flags);
+            if (desc.Dimension != D3D12_RESOURCE_DIMENSION_TEXTURE2D || desc.DepthOrArraySize != 1)
+                return false;
+
+            D3D12_RESOURCE_DESC reservedDesc = desc;
+            reservedDesc.Layout = D3D12_TEXTURE_LAYOUT_64KB_UNDEFINED_SWIZZLE;
+
+            ComPtr<ID3D12Resource> reserved;
+            if (FAILED(m_device->CreateReservedResource(
+                    &reservedDesc,
+                    D3D12_RESOURCE_STATE_COMMON,
+                    nullptr,
+                    IID_PPV_ARGS(&reserved))))
+            {
+                return false;
+            }
+
+            UINT numTiles = 0;
+            D3D12_PACKED_MIP_INFO packedMipInfo{};
+            D3D12_TILE_SHAPE tileShape{};
+            UINT numSubresourceTilings = desc.MipLevels;
+            std::vector<D3D12_SUBRESOURCE_TILING> tilings(numSubresourceTilings);
+            m_device->GetResourceTiling(
+                reserved.Get(),
+                &numTiles,
+                &packedMipInfo,
+                &tileShape,
+                &numSubresourceTilings,
+                0,
+                tilings.data());
+
+            if (packedMipInfo.NumStandardMips == 0)
+                return false;
+
+            bool const compressed = DirectX::IsCompressed(desc.Format);
+            uint32_t const blockSize = compressed ? 4 : 1;
+            size_t const bytesPerBlock = DirectX::BitsPerPixel(desc.Format) * blockSize * blockSize / 8;
+
+            TextureMetadata& textureMetadata = prepared.Metadata;
+
+            for (uint32_t mip = 0; mip < packedMipInfo.NumStandardMips; ++mip)
+            {
+                auto const& subresource = subresources[mip];
+                uint32_t const mipWidth = std::max(1u, static_cast<uint32_t>(desc.Width >> mip));
+                uint32_t const mipHeight = std::max(1u, desc.Height >> mip);
+
+                for (uint32_t y = 0; y < tilings[mip].HeightInTiles; ++y)
+                {
+                    for (uint32_t x = 0; x < tilings[mip].WidthInTiles; ++x)
+                    {
+                        uint32_t const left = x * tileShape.WidthInTexels;
+                        uint32_t const top = y * tileShape.HeightInTexels;
+                        uint32_t const width = std::min(tileShape.WidthInTexels, mipWidth - left);
+                        uint32_t const height = std::min(tileShape.HeightInTexels, mipHeight - top);
+
+                        // The tile is stored with the same layout as a texture
+                        // the size of the tile
+                        auto tileDesc = CD3DX12_RESOURCE_DESC::Tex2D(
+                            desc.Format,
+                            Math::AlignUp(width, blockSize),
+                            Math::AlignUp(height, blockSize),
+                            1,
+                            1);
+
+                        D3D12_PLACED_SUBRESOURCE_FOOTPRINT layout;
+                        UINT numRows;
+                        UINT64 rowSize;
+                        UINT64 totalBytes;
+                        m_device->GetCopyableFootprints(&tileDesc, 0, 1, 0, &layout, &numRows, &rowSize, &totalBytes);
+
+                        std::vector<char> data(totalBytes);
+                        auto const* source = static_cast<char const*>(subresource.pData) +
+                                             (top / blockSize) * subresource.RowPitch +
+                                             (left / blockSize) * bytesPerBlock;
+
+                        for (UINT row = 0; row < numRows; ++row)
+                        {
+                            memcpy(
+                                data.data() + layout.Offset + row * layout.Footprint.RowPitch,
+                                source + row * subresource.RowPitch,
+                                static_cast<size_t>(rowSize));
+                        }
+
+                        std::stringstream regionName;
+                        regionName << name << " mip " << mip << " tile " << x << "," << y;
+
+                        prepared.Tiles.push_back(
+                            CompressRegion(std::move(data), regionName.str(), RegionTarget::Gpu, desc.Format));
+                        textureMetadata.Tiles.push_back(TextureTile{mip, x, y, {}});
+                    }
+                }
+            }
+
+            textureMetadata.NumTiledMips = packedMipInfo.NumStandardMips;
+            textureMetadata.NumHeapTiles = numTiles;
+
+            uint32_t const firstPackedMip = packedMipInfo.NumStandardMips;
+            uint32_t const numPackedMips = desc.MipLevels - firstPackedMip;
+
+            if (numPackedMips > 0)
+            {
+                std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(numPackedMips);
+                std::vector<UINT> numRows(numPackedMips);
+                std::vector<UINT64> rowSizes(numPackedMips);
+                uint64_t totalBytes = 0;
+
+                m_device->GetCopyableFootprints(
+                    &desc,
+                    firstPackedMip,
+                    numPackedMips,
+                    0,
+                    layouts.data(),
+                    numRows.data(),
+                    rowSizes.data(),
+                    &totalBytes);
+
+                std::stringstream regionName;
+                regionName << name << " packed mips " << firstPackedMip << " to " << desc.MipLevels;
+                prepared.RemainingMips = BuildTextureRegion(
+                    firstPackedMip,
+                    numPackedMips,
+                    layouts,
+                    numRows,
+                    rowSizes,
+                    totalBytes,
+                    subresources,
+                    desc.Format,
+                    regionName.str());
+            }
+
+            prepared.Desc = reservedDesc;
+
+            return true;
+        }
+
+        //
+        // A shared texture has no regions in this file.  Only its desc is
+        // written, which is the same as the store's.
+        //
+        PreparedTexture PrepareSharedTexture(uint32_t sharedIndex) const
+        {
+            PreparedTexture prepared{};
+            prepared.Desc = m_textureStore.Descs->at(sharedIndex);
+            return prepared;
+        }
+
+        //
+        // Splits a mip that is too large for the staging buffer into bands of
+        // rows that each fit, to be read into their own boxes of the mip.  The
+        // mip's SingleMips region is left empty.  Returns false if the mip
+        // can't be split, or if even one row of blocks doesn't fit.
+        //
+        bool TryPrepareMipBands(
+            std::string const& name,
+            D3D12_RESOURCE_DESC const& desc,
+            uint32_t mip,
+            std::vector<D3D12_SUBRESOURCE_DATA> const& subresources,
+            PreparedTexture& prepared)
+        {
+            // The loader addresses single mips by mip level
+            if (desc.Dimension != D3D12_RESOURCE_DIMENSION_TEXTURE2D || desc.DepthOrArraySize != 1)
+                return false;
+
+            uint32_t const blockSize = DirectX::IsCompressed(desc.Format) ? 4 : 1;
+            uint32_t const mipWidth = std::max(1u, static_cast<uint32_t>(desc.Width >> mip));
+            uint32_t const mipHeight = std::max(1u, desc.Height >> mip);
+            uint32_t const numBlockRows = (mipHeight + blockSize - 1) / blockSize;
+
+            D3D12_PLACED_SUBRESOURCE_FOOTPRINT layout;
+            UINT numRows;
+            UINT64 rowSize;
+            UINT64 totalBytes;
+
+            // How much one row of blocks needs
+            auto rowDesc =
+                CD3DX12_RESOURCE_DESC::Tex2D(desc.Format, Math::AlignUp(mipWidth, blockSize), blockSize, 1, 1);
+            m_device->GetCopyableFootprints(&rowDesc, 0, 1, 0, &layout, &numRows, &rowSize, &totalBytes);
+            if (totalBytes > m_stagingBufferSizeBytes)
+                return false;
+
+            uint32_t const blockRowsPerBand = static_cast<uint32_t>(std::clamp<uint64_t>(
+                m_stagingBufferSizeBytes / layout.Footprint.RowPitch,
+                1,
+                numBlockRows));
+
+            auto const& subresource = subresources[mip];
+
+            for (uint32_t firstRow = 0; firstRow < numBlockRows; firstRow += blockRowsPerBand)
+            {
+                uint32_t const bandRows = std::min(blockRowsPerBand, numBlockRows - firstRow);
+                uint32_t const top = firstRow * blockSize;
+                uint32_t const bottom = std::min((firstRow + bandRows) * blockSize, mipHeight);
+
+                // The band is stored with the same layout as a texture the
+                // size of the band
+                auto bandDesc = CD3DX12_RESOURCE_DESC::Tex2D(
+                    desc.Format,
+                    Math::AlignUp(mipWidth, blockSize),
+                    bandRows * blockSize,
+                    1,
+                    1);
+                m_device->GetCopyableFootprints(&bandDesc, 0, 1, 0, &layout, &numRows, &rowSize, &totalBytes);
+
+                std::vector<char> data(totalBytes);
+                auto const* source = static_cast<char const*>(subresource.pData) + firstRow * subresource.RowPitch;
+
+                for (UINT row = 0; row < numRows; ++row)
+                {
+                    memcpy(
+                        data.data() + layout.Offset + row * layout.Footprint.RowPitch,
+                        source + row * subresource.RowPitch,
+                        static_cast<size_t>(rowSize));
+                }
+
+                std::stringstream regionName;
+                regionName << name << " mip " << mip << " rows " << top << " to " << bottom;
+
+                prepared.MipBands.push_back(
+                    CompressRegion(std::move(data), regionName.str(), RegionTarget::Gpu, desc.Format));
+                prepared.Metadata.MipBands.push_back(TextureMipBand{mip, top, bottom, {}});
+            }
+
+            std::stringstream regionName;
+            regionName << name << " mip " << mip << " (in bands)";
+            prepared.SingleMips.push_back(CompressRegion({}, regionName.str(), RegionTarget::Gpu));
+
+            return true;
+        }
+
+        //
+        // Converts a texture and compresses its regions.  This is called on
+        // the worker pool, so it only reads the exporter's state.
+        //
+        PreparedTexture PrepareTexture(TextureSource const& source)
+        {
+            std::string const& name = source.Name;
+
+            std::unique_ptr<ScratchImage> image;
+            uint64_t cacheKey = 0;
+            if (m_cache)
+            {
+                cacheKey = HashTextureSource(source);
+                image = std::make_unique<ScratchImage>();
+                if (!m_cache->LoadTexture(cacheKey, *image))
+                    image.reset();
+            }
+
+            {
+                std::lock_guard lock(m_consoleMutex);
+                std::cout << "Converting " << name << (image ? " (cached)" : "") << std::endl;
+            }
 
             if (!image)
             {
-                throw std::runtime_error("Texture load failed");
+                image = BuildDDS(source.Path.wstring().c_str(), source.Flags);
+
+                if (!image)
+                {
+                    throw std::runtime_error("Texture load failed");
+                }
+
+                if (m_cache)
+                    m_cache->StoreTexture(cacheKey, *image);
             }
 
             TexMetadata const& metadata = image->GetMetadata();
@@ -392,7 +1591,8 @@ namespace
                     subresources);
                 FAILED(hr))
             {
-                std::cout << texturePath.c_str() << " failed to prepare layout 0x" << std::hex << hr << std::endl;
+                std::lock_guard lock(m_consoleMutex);
+                std::cout << source.Path.c_str() << " failed to prepare layout 0x" << std::hex << hr << std::endl;
                 throw std::runtime_error("Texture preparation failed");
             }
 
@@ -407,9 +1607,11 @@ namespace
             desc.SampleDesc.Count = 1;
             desc.Dimension = static_cast<D3D12_RESOURCE_DIMENSION>(metadata.dimension);
 
-            auto const totalSubresourceCount = CD3DX12_RESOURCE_DESC(desc).Subresources(m_device.Get());
+            PreparedTexture prepared{};
+            if (m_tiled && TryPrepareTiledTexture(name, desc, subresources, prepared))
+                return prepared;
 
-            std::vector<GpuRegion> regions;
+            auto const totalSubresourceCount = CD3DX12_RESOURCE_DESC(desc).Subresources(m_device.Get());
 
             std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(totalSubresourceCount);
             std::vector<UINT> numRows(totalSubresourceCount);
@@ -443,24 +1645,32 @@ namespace
 
                 if (totalBytes > m_stagingBufferSizeBytes)
                 {
-                    std::cout << "Mip " << currentSubresource << " won't fit in the staging buffer.\n"
-                              << "Try adding -stagingbuffersize=" << ((totalBytes + 1024 * 1024 - 1) / 1024 / 1024)
-                              << " to the command-line" << std::endl;
-                    std::exit(1);
+                    if (!TryPrepareMipBands(name, desc, currentSubresource, subresources, prepared))
+                    {
+                        std::lock_guard lock(m_consoleMutex);
+                        std::cout << "Mip " << currentSubresource << " won't fit in the staging buffer.\n"
+                                  << "Try adding -stagingbuffersize="
+                                  << ((totalBytes + 1024 * 1024 - 1) / 1024 / 1024) << " to the command-line"
+                                  << std::endl;
+                        std::exit(1);
+                    }
                 }
+                else
+                {
+                    std::stringstream regionName;
+                    regionName << name << " mip " << currentSubresource;
 
-                std::stringstream regionName;
-                regionName << name << " mip " << currentSubresource;
-
-                regions.push_back(WriteTextureRegion(
-                    currentSubresource,
-                    1,
-                    layouts,
-                    numRows,
-                    rowSizes,
-                    totalBytes,
-                    subresources,
-                    regionName.str()));
+                    prepared.SingleMips.push_back(BuildTextureRegion(
+                        currentSubresource,
+                        1,
+                        layouts,
+                        numRows,
+                        rowSizes,
+                        totalBytes,
+                        subresources,
+                        desc.Format,
+                        regionName.str()));
+                }
 
                 ++currentSubresource;
 
@@ -478,13 +1688,11 @@ namespace
                 }
             }
 
-            marc::GpuRegion remainingMipsRegion{};
-
             if (currentSubresource < totalSubresourceCount)
             {
                 std::stringstream regionName;
                 regionName << name << " mips " << currentSubresource << " to " << totalSubresourceCount;
-                remainingMipsRegion = WriteTextureRegion(
+                prepared.RemainingMips = BuildTextureRegion(
                     currentSubresource,
                     totalSubresourceCount - currentSubresource,
                     layouts,
@@ -492,21 +1700,67 @@ namespace
                     rowSizes,
                     totalBytes,
                     subresources,
+                    desc.Format,
                     regionName.str());
             }
 
-            TextureMetadata textureMetadata;
-            textureMetadata.SingleMips = std::move(regions);
-            textureMetadata.RemainingMips = remainingMipsRegion;
+            prepared.Desc = desc;
+
+            if (m_swizzler)
+                PrepareSwizzledTexture(name, desc, subresources, prepared);
+
+            return prepared;
+        }
+
+        //
+        // Adds the texture's memory in the standard swizzle, as parts that
+        // each fit in the staging buffer.  Only 2D textures that would be
+        // placed at 64KB alignment anyway are swizzled, since the standard
+        // swizzle needs it.
+        //
+        void PrepareSwizzledTexture(
+            std::string const& name,
+            D3D12_RESOURCE_DESC const& desc,
+            std::vector<D3D12_SUBRESOURCE_DATA> const& subresources,
+            PreparedTexture& prepared)
+        {
+            if (desc.Dimension != D3D12_RESOURCE_DIMENSION_TEXTURE2D)
+                return;
+
+            D3D12_RESOURCE_DESC smallDesc = desc;
+            smallDesc.Alignment = D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT;
+            if (m_device->GetResourceAllocationInfo(0, 1, &smallDesc).Alignment ==
+                D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT)
+                return;
+
+            std::vector<char> data = m_swizzler->Swizzle(desc, subresources);
+            if (data.empty())
+                return;
+
+            prepared.Metadata.SwizzledSize = data.size();
 
-            m_textureMetadata.push_back(std::move(textureMetadata));
+            for (size_t offset = 0; offset < data.size(); offset += m_stagingBufferSizeBytes)
+            {
+                size_t const size = std::min<size_t>(m_stagingBufferSizeBytes, data.size() - offset);
+
+                std::stringstream regionName;
+                regionName << name << " swizzled part " << prepared.SwizzledParts.size();
 
-            m_textureDescs.push_back(desc);
+                prepared.SwizzledParts.push_back(CompressRegion(
+                    std::vector<char>(data.begin() + offset, data.begin() + offset + size),
+                    regionName.str(),
+                    RegionTarget::Gpu));
+            }
         }
 
-        GpuRegion WriteUnstructuredGpuData()
+        PendingRegion BuildUnstructuredGpuData()
         {
-            std::stringstream s;
+            // Reserved up front, with room for the material constants to be
+            // padded, so the buffer is never reallocated
+            size_t const numMaterials = m_modelData.m_MaterialConstants.size();
+            ByteWriter s;
+            size_t const materialsSize = (numMaterials + 1) * D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT;
+            s.reserve(m_modelData.m_GeometryData.size() + materialsSize);
 
             WriteArray(s, m_modelData.m_GeometryData);
 
@@ -516,44 +1770,207 @@ namespace
                                                D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT)
                                                .Offset;
 
-            return WriteRegion<void>(s.str(), "GPU Data");
+            return CompressRegion(s.Release(), "GPU Data", RegionTarget::Gpu);
         }
 
-        template<typename T, typename C>
-        Region<T> WriteRegion(C uncompressedRegion, char const* name)
+        template<typename T>
+        Region<T> WriteRegion(std::vector<char> uncompressedRegion, char const* name, RegionTarget target)
         {
-            size_t uncompressedSize = uncompressedRegion.size();
+            return AppendRegion<T>(CompressRegion(std::move(uncompressedRegion), name, target));
+        }
+
+        //
+        // Compressing a region doesn't touch m_out, so it may be done on any
+        // thread.
+        //
+        PendingRegion CompressRegion(
+            std::vector<char> uncompressedRegion,
+            std::string name,
+            RegionTarget target,
+            DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN) const
+        {
+            // Offsets are 64-bit, but each region is read by a single
+            // DirectStorage request, whose sizes are 32-bit
+            if (uncompressedRegion.size() > UINT32_MAX)
+                throw std::runtime_error(name + " is larger than 4GB");
+
+            // Uncompressed regions are quicker to copy than to cache
+            bool const compresses = m_compression != Compression::None || m_autoCompression;
+            if (!m_cache || !compresses || uncompressedRegion.empty())
+                return CompressUncachedRegion(std::move(uncompressedRegion), std::move(name), target, format);
+
+            uint64_t const key = GetCacheKey(uncompressedRegion, target, format);
+
+            PendingRegion cached;
+            cached.UncompressedSize = static_cast<uint32_t>(uncompressedRegion.size());
+            if (m_cache->Load(key, cached.UncompressedSize, cached.Compression, cached.Data))
+            {
+                cached.Name = std::move(name);
+                cached.Cached = true;
+                return cached;
+            }
+
+            PendingRegion pending =
+                CompressUncachedRegion(std::move(uncompressedRegion), std::move(name), target, format);
+            m_cache->Store(key, pending.UncompressedSize, pending.Compression, pending.Data);
+            return pending;
+        }
+
+        //
+        // Everything that changes how a region is compressed is part of its
+        // cache key, along with the region's bytes.
+        //
+        uint64_t GetCacheKey(std::vector<char> const& data, RegionTarget target, DXGI_FORMAT format) const
+        {
+            Fnv1a hash;
+            hash.Add(CURRENT_MARC_FILE_VERSION);
+            hash.Add(USE_LIBDEFLATE);
+            hash.Add(USE_GDEFLATE_LIBRARY);
+            hash.Add(m_compression);
+            hash.Add(m_cpuCompression);
+            hash.Add(m_autoCompression ? m_autoCompression->ReadBytesPerSecond : 0.0);
+            hash.Add(m_bcSplit);
+            hash.Add(target);
+            hash.Add(format);
+            hash.Add(data.data(), data.size());
+            return hash.Get();
+        }
+
+        PendingRegion CompressUncachedRegion(
+            std::vector<char> uncompressedRegion,
+            std::string name,
+            RegionTarget target,
+            DXGI_FORMAT format) const
+        {
+            Compression const compression = target == RegionTarget::Cpu ? m_cpuCompression : m_compression;
+
+            PendingRegion pending;
+            pending.Compression = compression;
+            pending.UncompressedSize = static_cast<uint32_t>(uncompressedRegion.size());
+            pending.Name = std::move(name);
 
-            C compressedRegion;
+            // Empty regions, like a texture store's GPU data, aren't compressed
+            if (uncompressedRegion.empty())
+                pending.Compression = Compression::None;
 
-            Compression compression = m_compression;
+            if (m_autoCompression && !uncompressedRegion.empty())
+            {
+                // Each format is tried, and the one that's cheapest to load is
+                // kept.  Leaving the region uncompressed sets the bar.
+                size_t const size = uncompressedRegion.size();
+
+                pending.Compression = Compression::None;
+                double bestCost = m_autoCompression->GetCost(Compression::None, target, size, size);
+
+                for (Compression compression : {Compression::GDeflate, Compression::Zlib})
+                {
+                    std::vector<char> data = Compress(compression, uncompressedRegion);
+                    double cost = m_autoCompression->GetCost(compression, target, data.size(), size);
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        pending.Compression = compression;
+                        pending.Data = std::move(data);
+                    }
+                }
+
+                if (auto data = CompressBcSplit(uncompressedRegion, format))
+                {
+                    double cost = m_autoCompression->GetCost(Compression::ZlibBcSplit, target, data->size(), size);
+                    if (cost < bestCost)
+                    {
+                        pending.Compression = Compression::ZlibBcSplit;
+                        pending.Data = std::move(*data);
+                    }
+                }
 
-            if (compression == Compression::None)
+                if (pending.Compression == Compression::None)
+                    pending.Data = std::move(uncompressedRegion);
+
+                return pending;
+            }
+
+            if (pending.Compression == Compression::None)
             {
-                compressedRegion = std::move(uncompressedRegion);
+                pending.Data = std::move(uncompressedRegion);
             }
             else
             {
-                compressedRegion = Compress(m_compression, uncompressedRegion);
-                if (compressedRegion.size() > uncompressedSize)
+                pending.Data = Compress(compression, uncompressedRegion);
+
+                if (compression == Compression::Zlib)
+                {
+                    auto split = CompressBcSplit(uncompressedRegion, format);
+                    if (split && split->size() < pending.Data.size())
+                    {
+                        pending.Compression = Compression::ZlibBcSplit;
+                        pending.Data = std::move(*split);
+                    }
+                }
+
+                if (pending.Data.size() > uncompressedRegion.size())
+                {
+                    pending.Compression = Compression::None;
+                    pending.Data = std::move(uncompressedRegion);
+                }
+            }
+
+            return pending;
+        }
+
+        //
+        // With -bcsplit, BC1 to BC5 texture data is also tried with its blocks
+        // split into an endpoint plane and an index plane before it's
+        // compressed with Zlib.  Returns nothing if the data can't be split.
+        //
+        std::optional<std::vector<char>> CompressBcSplit(std::vector<char> const& data, DXGI_FORMAT format) const
+        {
+            BcSplitHeader header;
+            if (!m_bcSplit || !GetBcSplitLayout(format, header) || (data.size() % header.BlockSize) != 0)
+                return std::nullopt;
+
+            std::vector<char> planes;
+            planes.reserve(data.size());
+            for (bool endpoints : {true, false})
+            {
+                for (size_t block = 0; block < data.size(); block += header.BlockSize)
                 {
-                    compression = Compression::None;
-                    compressedRegion = std::move(uncompressedRegion);
+                    for (uint32_t b = 0; b < header.BlockSize; ++b)
+                    {
+                        if (((header.EndpointMask & (1u << b)) != 0) == endpoints)
+                            planes.push_back(data[block + b]);
+                    }
                 }
             }
 
-            Region<T> r;
-            r.Compression = compression;
-            r.Data.Offset = static_cast<uint32_t>(m_out.tellp());
-            r.CompressedSize = static_cast<uint32_t>(compressedRegion.size());
-            r.UncompressedSize = static_cast<uint32_t>(uncompressedSize);
+            std::vector<char> compressed(sizeof(header));
+            memcpy(compressed.data(), &header, sizeof(header));
+
+            std::vector<char> compressedPlanes = Compress(Compression::Zlib, std::move(planes));
+            compressed.insert(compressed.end(), compressedPlanes.begin(), compressedPlanes.end());
+            return compressed;
+        }
+
+        template<typename T>
+        Region<T> AppendRegion(PendingRegion const& pending)
+        {
+            // Aligning to the drive's sectors keeps each region from sharing
+            // sectors with the next, which may not be read at the same time
+            if (m_regionAlignment > 0 && !pending.Data.empty())
+                PadToAlignment(m_out, m_regionAlignment);
+
+            Region<T> r{};
+            r.Compression = pending.Compression;
+            r.Data.Offset = static_cast<uint64_t>(m_out.tellp());
+            r.CompressedSize = static_cast<uint32_t>(pending.Data.size());
+            r.UncompressedSize = pending.UncompressedSize;
 
             if (r.Compression == Compression::None)
             {
                 assert(r.CompressedSize == r.UncompressedSize);
             }
 
-            m_out.write(compressedRegion.data(), compressedRegion.size());
+            m_out.write(pending.Data.data(), pending.Data.size());
 
             auto toString = [](Compression c)
             {
@@ -565,29 +1982,34 @@ namespace
                     return "GDeflate";
                 case Compression::Zlib:
                     return "Zlib";
+                case Compression::ZlibBcSplit:
+                    return "Zlib (BC split)";
                 default:
                     throw std::runtime_error("Unknown compression format");
                 }
             };
 
-            std::cout << r.Data.Offset << ":  " << name << " " << toString(r.Compression) << " " << r.UncompressedSize
-                      << " --> " << r.CompressedSize << "\n";
+            std::lock_guard lock(m_consoleMutex);
+            std::cout << r.Data.Offset << ":  " << pending.Name << " " << toString(r.Compression) << " "
+                      << r.UncompressedSize << " --> " << r.CompressedSize << (pending.Cached ? " (cached)" : "")
+                      << "\n";
 
             return r;
         }
 
         Region<CpuMetadataHeader> WriteCpuMetadata()
         {
-            std::stringstream s;
+            ByteWriter s;
 
             CpuMetadataHeader header{};
 
             // Write placeholder header; we'll fix this up later when we've
             // written everything else out
+            auto headerPos = s.tellp();
             auto [fixupHeader] = WriteStruct(s, &header, &header);
 
             // Textures
-            header.NumTextures = static_cast<uint32_t>(m_modelData.m_TextureNames.size());
+            header.NumTextures = static_cast<uint32_t>(m_textures.size());
 
             std::vector<marc::TextureMetadata> textureMetadata;
             textureMetadata.reserve(m_textureMetadata.size());
@@ -595,38 +2017,134 @@ namespace
             // Write out the texture metadata, building up the blittable
             // versions as we go
 
-            assert(m_textureMetadata.size() == m_modelData.m_TextureNames.size());
+            assert(m_textureMetadata.size() == m_textures.size());
             for (size_t i = 0; i < m_textureMetadata.size(); ++i)
             {
                 marc::TextureMetadata metadata{};
-                metadata.Name = WriteArray(s, m_modelData.m_TextureNames[i]).Data;
+                metadata.Name = WriteArray(s, m_textures[i].Name).Data;
                 s.put(0); // null terminate the name string
 
                 metadata.NumSingleMips = static_cast<uint32_t>(m_textureMetadata[i].SingleMips.size());
                 metadata.SingleMips = WriteArray(s, m_textureMetadata[i].SingleMips);
                 metadata.RemainingMips = m_textureMetadata[i].RemainingMips;
+                metadata.NumTiledMips = m_textureMetadata[i].NumTiledMips;
+                metadata.NumTiles = static_cast<uint32_t>(m_textureMetadata[i].Tiles.size());
+                metadata.Tiles = WriteArray(s, m_textureMetadata[i].Tiles);
+                metadata.NumHeapTiles = m_textureMetadata[i].NumHeapTiles;
+                metadata.NumMipBands = static_cast<uint32_t>(m_textureMetadata[i].MipBands.size());
+                metadata.MipBands = WriteArray(s, m_textureMetadata[i].MipBands);
+                metadata.SharedIndex = m_textures[i].SharedIndex;
                 textureMetadata.push_back(metadata);
             }
 
+            auto texturesPos = s.tellp();
+            for (size_t i = 0; i < textureMetadata.size(); ++i)
+            {
+                marc::TextureMetadata& metadata = textureMetadata[i];
+                MakeSelfRelative(
+                    texturesPos + static_cast<std::streamoff>(i * sizeof(metadata)),
+                    metadata,
+                    metadata.Name,
+                    metadata.SingleMips,
+                    metadata.Tiles,
+                    metadata.MipBands);
+            }
+
             header.Textures = WriteArray(s, textureMetadata);
             header.TextureDescs = WriteArray(s, m_textureDescs);
 
+            // Texture layouts, so that the runtime doesn't need to ask the
+            // device about each texture when it's on the same adapter and
+            // driver.  Shared textures are placed by the texture store, and
+            // tiled ones are reserved resources, so neither has a layout.
+            if (m_adapterId)
+            {
+                std::vector<marc::TextureLayout> layouts(m_textureDescs.size());
+                for (size_t i = 0; i < m_textureDescs.size(); ++i)
+                {
+                    D3D12_RESOURCE_DESC desc = m_textureDescs[i];
+                    if (m_textures[i].SharedIndex != NotShared ||
+                        desc.Layout == D3D12_TEXTURE_LAYOUT_64KB_UNDEFINED_SWIZZLE)
+                        continue;
+
+                    desc.Alignment = D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT;
+                    D3D12_RESOURCE_ALLOCATION_INFO info = m_device->GetResourceAllocationInfo(0, 1, &desc);
+                    if (info.Alignment != D3D12_SMALL_RESOURCE_PLACEMENT_ALIGNMENT)
+                    {
+                        desc.Alignment = 0;
+                        info = m_device->GetResourceAllocationInfo(0, 1, &desc);
+                    }
+
+                    layouts[i] = {info.SizeInBytes, info.Alignment};
+                }
+
+                header.LayoutAdapter = *m_adapterId;
+                header.TextureLayouts = WriteArray(s, layouts);
+            }
+
+            // Swizzled textures
+            if (std::any_of(
+                    m_textureMetadata.begin(),
+                    m_textureMetadata.end(),
+                    [](TextureMetadata const& metadata) { return !metadata.SwizzledParts.empty(); }))
+            {
+                std::vector<marc::SwizzledTexture> swizzledTextures;
+                swizzledTextures.reserve(m_textureMetadata.size());
+                for (TextureMetadata const& metadata : m_textureMetadata)
+                {
+                    marc::SwizzledTexture swizzled{};
+                    swizzled.SizeInBytes = metadata.SwizzledSize;
+                    swizzled.NumParts = static_cast<uint32_t>(metadata.SwizzledParts.size());
+                    swizzled.Parts = WriteArray(s, metadata.SwizzledParts);
+                    swizzledTextures.push_back(swizzled);
+                }
+
+                auto swizzledPos = s.tellp();
+                for (size_t i = 0; i < swizzledTextures.size(); ++i)
+                {
+                    marc::SwizzledTexture& swizzled = swizzledTextures[i];
+                    MakeSelfRelative(
+                        swizzledPos + static_cast<std::streamoff>(i * sizeof(swizzled)),
+                        swizzled,
+                        swizzled.Parts);
+                }
+
+                header.SwizzledTextures = WriteArray(s, swizzledTextures);
+            }
+
             header.NumMaterials = static_cast<uint32_t>(m_modelData.m_MaterialConstants.size());
 
+            // Texture store
+            header.IsTextureStore = m_textureStore.IsTextureStore ? 1 : 0;
+            if (!m_textureStore.Name.empty())
+            {
+                header.TextureStoreName = WriteArray(s, m_textureStore.Name).Data;
+                s.put(0); // null terminate the name string
+            }
+
             // Fixup the CPU data header
+            MakeSelfRelative(
+                headerPos,
+                header,
+                header.Textures,
+                header.TextureDescs,
+                header.TextureLayouts,
+                header.SwizzledTextures,
+                header.TextureStoreName);
             fixupHeader.Set(s, header);
 
-            return WriteRegion<CpuMetadataHeader>(s.str(), "CPU Metadata");
+            return WriteRegion<CpuMetadataHeader>(s.Release(), "CPU Metadata", RegionTarget::Cpu);
         }
 
         Region<CpuDataHeader> WriteCpuData()
         {
-            std::stringstream s;
+            ByteWriter s;
 
             CpuDataHeader header{};
 
             // Write placeholder header; we'll fix this up later when we've
             // written everything else out
+            auto headerPos = s.tellp();
             auto [fixupHeader] = WriteStruct(s, &header, &header);
 
             // Scene Graph
@@ -639,7 +2157,7 @@ namespace
             // Each "mesh" actually consists of a header - the Mesh struct -
             // followed by a number of Mesh::Draw structs.
             header.NumMeshes = static_cast<uint32_t>(m_modelData.m_Meshes.size());
-            header.Meshes.Offset = static_cast<uint32_t>(s.tellp());
+            header.Meshes.Offset = static_cast<uint64_t>(s.tellp());
 
             for (size_t i = 0; i < m_modelData.m_Meshes.size(); ++i)
             {
@@ -652,7 +2170,7 @@ namespace
             // Materials
             header.MaterialConstantsGpuOffset = static_cast<uint32_t>(m_materialConstantsGpuOffset);
             assert(m_modelData.m_MaterialConstants.size() == m_modelData.m_MaterialTextures.size());
-            header.Materials.Data.Offset = static_cast<uint32_t>(s.tellp());
+            header.Materials.Data.Offset = static_cast<uint64_t>(s.tellp());
 
             for (auto& materialTextureData : m_modelData.m_MaterialTextures)
             {
@@ -683,124 +2201,1438 @@ namespace
             header.JointIndices = WriteArray(s, m_modelData.m_JointIndices);
             header.JointIBMs = WriteArray(s, m_modelData.m_JointIBMs);
 
+            // Position quantization
+            header.NumPositionQuantizations = static_cast<uint32_t>(m_modelData.m_PositionQuantization.size());
+            header.PositionQuantizations = WriteArray(s, m_modelData.m_PositionQuantization);
+
+            // Meshlets
+            header.NumMeshlets = static_cast<uint32_t>(m_modelData.m_Meshlets.size());
+            header.Meshlets = WriteArray(s, m_modelData.m_Meshlets);
+
             // Fixup the CPU data header
+            MakeSelfRelative(
+                headerPos,
+                header,
+                header.SceneGraph,
+                header.Meshes,
+                header.Materials,
+                header.Animations,
+                header.AnimationCurves,
+                header.KeyFrameData,
+                header.JointIndices,
+                header.JointIBMs,
+                header.PositionQuantizations,
+                header.Meshlets);
             fixupHeader.Set(s, header);
 
-            return WriteRegion<CpuDataHeader>(s.str(), "CPU Data");
+            return WriteRegion<CpuDataHeader>(s.Release(), "CPU Data", RegionTarget::Cpu);
         }
 
     public:
-        static void Export(
+        //
+        // Returns the descs of the textures that were written, which the files
+        // that share a texture store's textures are written with.
+        //
+        static std::vector<D3D12_RESOURCE_DESC> Export(
             std::ostream& out,
             Compression compression,
-            TexConversionFlags extraTextureFlags,
+            Compression cpuCompression,
+            std::optional<CompressionCostModel> autoCompression,
+            bool bcSplit,
+            bool loadOrder,
+            uint32_t regionAlignment,
             uint32_t stagingBufferSizeBytes,
-            glTF::Asset const& asset,
-            Renderer::ModelData const& modelData)
+            bool tiled,
+            bool swizzle,
+            std::vector<TextureSource> textures,
+            Renderer::ModelData const& modelData,
+            TextureStoreRef textureStore,
+            RegionCache const* cache)
         {
-            Exporter exporter(out, compression, extraTextureFlags, stagingBufferSizeBytes, asset, modelData);
+            Exporter exporter(
+                out,
+                compression,
+                cpuCompression,
+                autoCompression,
+                bcSplit,
+                loadOrder,
+                regionAlignment,
+                stagingBufferSizeBytes,
+                tiled,
+                swizzle,
+                std::move(textures),
+                modelData,
+                std::move(textureStore),
+                cache);
             exporter.Export();
+            return std::move(exporter.m_textureDescs);
         }
     };
 } // namespace
 
-static void ShowUsage(char const* exeName)
+//
+// Packs the archives that were written to files into a bundle (see
+// marc::BundleHeader) and removes them.  Each is named by its path relative to
+// the bundle's directory, so the names the models use for their texture store
+// still find it once they're all in the bundle.
+//
+static bool WriteBundle(std::filesystem::path const& bundlePath, std::vector<std::filesystem::path> const& files)
 {
-    std::cout << "Usage: " << exeName << " [-gdeflate|-zlib] [-stagingbuffersize=X] [-bc] source.gltf dest.marc\n";
-    std::cout << "\n\nStaging buffer size is in MiB.  Default is 256 MiB.\n";
-}
+    std::filesystem::path bundleDirectory = absolute(bundlePath).parent_path();
 
-int main(int argc, char** argv)
-{
-    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    marc::BundleHeader header{};
+    memcpy(header.Id, "MBDL", 4);
+    header.Version = marc::CURRENT_BUNDLE_FILE_VERSION;
+    header.NumEntries = static_cast<uint32_t>(files.size());
 
-    bool useGDeflate = false;
-    bool useZlib = false;
-    bool useBC = false;
-    uint32_t stagingBufferSizeMiB = 256;
-    char const* sourceFilename = nullptr;
-    char const* destFilename = nullptr;
+    std::vector<marc::BundleEntry> entries(files.size());
+    std::string names;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::string name = std::filesystem::relative(absolute(files[i]), bundleDirectory).string();
+        entries[i].NameOffset = static_cast<uint32_t>(names.size());
+        entries[i].NameLength = static_cast<uint32_t>(name.size());
+        names += name;
+    }
+    header.NamesSize = static_cast<uint32_t>(names.size());
 
-    for (int i = 1; i < argc; ++i)
+    std::ofstream out(bundlePath, std::ios::out | std::ios::trunc | std::ios::binary);
+
+    // The entries are patched once the files' offsets are known
+    WriteStruct(out, &header);
+    auto entriesPos = out.tellp();
+    WriteArray(out, entries);
+    out.write(names.data(), names.size());
+
+    for (size_t i = 0; i < files.size(); ++i)
     {
-        char const* arg = argv[i];
-        std::regex stagingBufferRegex{"-stagingbuffersize=([0-9]+)", std::regex_constants::icase};
-        std::cmatch match;
+        entries[i].Offset = static_cast<uint64_t>(PadToAlignment(out, marc::BundleAlignment));
 
-        if (_strcmpi(arg, "-gdeflate") == 0)
-            useGDeflate = true;
-        else if (_strcmpi(arg, "-zlib") == 0)
-            useZlib = true;
-        else if (_strcmpi(arg, "-bc") == 0)
-            useBC = true;
-        else if (std::regex_match(arg, match, stagingBufferRegex))
-            stagingBufferSizeMiB = atoi(match[1].first);
-        else if (!sourceFilename)
-            sourceFilename = arg;
-        else if (!destFilename)
-            destFilename = arg;
+        std::ifstream in(files[i], std::ios::in | std::ios::binary);
+        out << in.rdbuf();
+        if (!in || !out)
+        {
+            std::cout << "Unable to add " << files[i].string() << " to the bundle" << std::endl;
+            return false;
+        }
+
+        entries[i].Size = static_cast<uint64_t>(out.tellp()) - entries[i].Offset;
     }
 
-    if (useZlib && useGDeflate)
+    Patch(out, entriesPos, entries);
+    out.close();
+    if (!out)
     {
-        std::cout << "Only one of -zlib or -gdeflate may be specified at a time." << std::endl;
-        ShowUsage(argv[0]);
-        return -1;
+        std::cout << "Unable to write " << bundlePath.string() << std::endl;
+        return false;
     }
 
-    marc::Compression compression = marc::Compression::None;
-    if (useGDeflate)
-        compression = marc::Compression::GDeflate;
-    else if (useZlib)
-        compression = marc::Compression::Zlib;
+    for (std::filesystem::path const& file : files)
+        std::filesystem::remove(file);
+
+    return true;
+}
+
+//
+// Packs a DDS file for DirectStorage (see DDS_PACKED_HEADER).  The subresources
+// are grouped into the longest runs whose footprints fit in the staging buffer,
+// and each run is laid out as GetCopyableFootprints places it and compressed.
+//
+static bool PackDDS(
+    std::vector<uint8_t> const& source,
+    std::string const& sourceName,
+    std::filesystem::path const& destPath,
+    marc::Compression compression,
+    uint32_t stagingBufferSizeBytes)
+{
+    DDS_TEXTURE_LAYOUT layout;
+    if (auto hr = GetDDSTextureLayout(source.data(), source.size(), source.size(), false, &layout); FAILED(hr))
+    {
+        std::cout << sourceName << " isn't a DDS file that can be packed: 0x" << std::hex << hr << std::dec
+                  << std::endl;
+        return false;
+    }
 
-    if (!(sourceFilename && destFilename))
+    if (!layout.PackedChunks.empty())
     {
-        ShowUsage(argv[0]);
-        return -1;
+        std::cout << sourceName << " is already packed" << std::endl;
+        return false;
+    }
+
+    ComPtr<ID3D12Device> device;
+    if (auto hr = D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&device)); FAILED(hr))
+    {
+        std::cout << "Failed to create D3D12 device: 0x" << std::hex << hr << std::dec << std::endl;
+        return false;
     }
 
-    std::filesystem::path sourcePath(sourceFilename);
-    sourcePath.make_preferred();
+    uint32_t const numSubresources = static_cast<uint32_t>(layout.Subresources.size());
+    std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> footprints(numSubresources);
+    std::vector<UINT> numRows(numSubresources);
+    std::vector<UINT64> rowSizes(numSubresources);
 
-    std::cout << "Source: " << sourcePath.string().c_str() << std::endl;
+    std::vector<DDS_PACKED_CHUNK> chunks;
+    std::vector<std::vector<uint8_t>> chunkData;
 
-    Renderer::ModelData modelData;
-    glTF::Asset asset(sourcePath.wstring());
-    constexpr int sceneIndex = -1;
-    constexpr bool compileTextures = false;
-    if (!BuildModel(modelData, asset, sceneIndex, compileTextures))
+    for (uint32_t first = 0; first < numSubresources;)
     {
-        std::cout << "Unable to read source gltf file" << std::endl;
-        return -1;
+        // The longest run from first that fits
+        uint32_t count = numSubresources - first;
+        uint64_t totalBytes = 0;
+        for (; count > 0; --count)
+        {
+            device->GetCopyableFootprints(&layout.Desc, first, count, 0, nullptr, nullptr, nullptr, &totalBytes);
+            if (totalBytes <= stagingBufferSizeBytes)
+                break;
+        }
+
+        if (count == 0)
+        {
+            device->GetCopyableFootprints(&layout.Desc, first, 1, 0, nullptr, nullptr, nullptr, &totalBytes);
+            std::cout << "Subresource " << first << " of " << sourceName
+                      << " won't fit in the staging buffer.\n"
+                      << "Try adding -stagingbuffersize=" << ((totalBytes + 1024 * 1024 - 1) / 1024 / 1024)
+                      << " to the command-line" << std::endl;
+            return false;
+        }
+
+        device->GetCopyableFootprints(
+            &layout.Desc,
+            first,
+            count,
+            0,
+            footprints.data(),
+            numRows.data(),
+            rowSizes.data(),
+            &totalBytes);
+
+        std::vector<uint8_t> data(static_cast<size_t>(totalBytes));
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            DDS_SUBRESOURCE_LAYOUT const& subresource = layout.Subresources[first + i];
+            for (uint32_t row = 0; row < numRows[i]; ++row)
+            {
+                memcpy(
+                    data.data() + footprints[i].Offset + static_cast<size_t>(row) * footprints[i].Footprint.RowPitch,
+                    source.data() + subresource.Offset + static_cast<size_t>(row) * subresource.RowPitch,
+                    static_cast<size_t>(rowSizes[i]));
+            }
+        }
+
+        DDS_PACKED_CHUNK chunk{};
+        chunk.UncompressedSize = static_cast<uint32_t>(totalBytes);
+        chunk.FirstSubresource = first;
+        chunk.NumSubresources = count;
+        chunks.push_back(chunk);
+        chunkData.push_back(Compress(compression, std::move(data)));
+
+        first += count;
     }
 
-    if (useGDeflate)
+    // The headers, up to where the data started
+    size_t const headersSize = static_cast<size_t>(layout.Subresources[0].Offset);
+    size_t const packedHeadersSize =
+        headersSize + sizeof(DDS_PACKED_HEADER) + chunks.size() * sizeof(DDS_PACKED_CHUNK);
+    if (packedHeadersSize > DDS_PACKED_MAX_HEADER_SIZE)
     {
-        // Get the buffer compression interface for DSTORAGE_COMPRESSION_FORMAT_GDEFLATE
-        constexpr uint32_t NumCompressionThreads = 6;
-        ASSERT_SUCCEEDED(DStorageCreateCompressionCodec(
-            DSTORAGE_COMPRESSION_FORMAT_GDEFLATE,
-            NumCompressionThreads,
-            IID_PPV_ARGS(&g_bufferCompression)));
+        std::cout << sourceName << " needs too many chunks; try a larger -stagingbuffersize" << std::endl;
+        return false;
     }
 
-    TexConversionFlags extraTextureFlags{};
-    if (useBC)
+    DDS_PACKED_HEADER header{};
+    header.Magic = DDS_PACKED_MAGIC;
+    header.Version = DDS_PACKED_VERSION;
+    header.NumChunks = static_cast<uint32_t>(chunks.size());
+    switch (compression)
     {
-        extraTextureFlags = static_cast<TexConversionFlags>(extraTextureFlags | kDefaultBC);
+    case marc::Compression::GDeflate:
+        header.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+        break;
+    case marc::Compression::Zlib:
+        // BulkLoadDemo's custom decompression, CUSTOM_COMPRESSION_FORMAT_ZLIB
+        header.CompressionFormat = DSTORAGE_CUSTOM_COMPRESSION_0;
+        break;
+    default:
+        header.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+        break;
+    }
+
+    // The chunks start on a sector, after the headers
+    uint64_t offset = DDS_PACKED_MAX_HEADER_SIZE;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        chunks[i].Offset = offset;
+        chunks[i].Size = static_cast<uint32_t>(chunkData[i].size());
+        offset += chunks[i].Size;
+    }
+
+    std::ofstream out(destPath, std::ios::out | std::ios::trunc | std::ios::binary);
+    out.write(reinterpret_cast<char const*>(source.data()), headersSize);
+    WriteStruct(out, &header);
+    WriteArray(out, chunks.data(), chunks.size());
+    PadToAlignment(out, DDS_PACKED_MAX_HEADER_SIZE);
+    for (std::vector<uint8_t> const& data : chunkData)
+        out.write(reinterpret_cast<char const*>(data.data()), data.size());
+
+    out.close();
+    if (!out)
+    {
+        std::cout << "Unable to write " << destPath.string() << std::endl;
+        return false;
     }
 
-    std::filesystem::path destPath(destFilename);
-    destPath.make_preferred();
+    std::cout << sourceName << " -> " << destPath.string() << ": " << chunks.size() << " chunks, "
+              << source.size() << " -> " << offset << " bytes" << std::endl;
+    return true;
+}
 
-    std::cout << "Dest: " << destPath.string().c_str() << std::endl;
+static bool PackDDS(
+    std::filesystem::path const& sourcePath,
+    std::filesystem::path const& destPath,
+    marc::Compression compression,
+    uint32_t stagingBufferSizeBytes)
+{
+    std::ifstream in(sourcePath, std::ios::in | std::ios::binary);
+    std::vector<uint8_t> source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in && !in.eof())
+    {
+        std::cout << "Unable to read " << sourcePath.string() << std::endl;
+        return false;
+    }
 
-    std::ofstream outStream(destPath, std::ios::out | std::ios::trunc | std::ios::binary);
+    return PackDDS(source, sourcePath.string(), destPath, compression, stagingBufferSizeBytes);
+}
 
-    Exporter::Export(outStream, compression, extraTextureFlags, stagingBufferSizeMiB * 1024 * 1024, asset, modelData);
+//
+// Builds the texture array that ParticleEffectManager draws particles with from
+// the textures a particle effects file names, and packs it as -dds does, so that
+// it's loaded with one request.  The textures are put in the slices in the order
+// the emitters first use them, which is the order ParticleEffects numbers them
+// in.  Their paths are relative to the current directory, as they are for the
+// sample.
+//
+static bool BuildParticleAtlas(
+    std::filesystem::path const& jsonPath,
+    std::filesystem::path const& destPath,
+    marc::Compression compression,
+    uint32_t stagingBufferSizeBytes)
+{
+    // The array ParticleEffectManager::Initialize creates, which the atlas replaces
+    constexpr size_t AtlasSize = 64;
+    constexpr size_t AtlasSlices = 16;
+    constexpr size_t AtlasMips = 4;
+    constexpr DXGI_FORMAT AtlasFormat = DXGI_FORMAT_BC3_UNORM_SRGB;
+
+    // ParticleEffectProperties' default, for emitters that don't name a texture
+    constexpr char DefaultTexturePath[] = "Resources/Textures/sparkTex.dds";
+
+    std::ifstream in(jsonPath);
+    nlohmann::json setup = nlohmann::json::parse(in, nullptr, false);
+    if (setup.is_discarded() || !setup.is_object() || setup.find("ParticleEmitters") == setup.end())
+    {
+        std::cout << jsonPath.string() << " isn't a particle effects file" << std::endl;
+        return false;
+    }
 
-    outStream.close();
+    std::vector<std::string> texturePaths;
+    for (nlohmann::json const& emitter : setup["ParticleEmitters"])
+    {
+        auto it = emitter.find("TexturePath");
+        std::string path = it != emitter.end() ? it->get<std::string>() : DefaultTexturePath;
+        if (std::find(texturePaths.begin(), texturePaths.end(), path) == texturePaths.end())
+            texturePaths.push_back(path);
+    }
+
+    if (texturePaths.size() > AtlasSlices)
+    {
+        std::cout << jsonPath.string() << " uses " << texturePaths.size() << " textures, but the atlas only has "
+                  << AtlasSlices << " slices" << std::endl;
+        return false;
+    }
+
+    ScratchImage atlas;
+    if (FAILED(atlas.Initialize2D(AtlasFormat, AtlasSize, AtlasSize, AtlasSlices, AtlasMips)))
+    {
+        std::cout << "Unable to create the atlas" << std::endl;
+        return false;
+    }
+    memset(atlas.GetPixels(), 0, atlas.GetPixelsSize());
+
+    for (size_t slice = 0; slice < texturePaths.size(); ++slice)
+    {
+        std::filesystem::path const path = std::filesystem::u8path(texturePaths[slice]).make_preferred();
+
+        TexMetadata metadata;
+        ScratchImage image;
+        if (FAILED(LoadFromDDSFile(path.c_str(), DDS_FLAGS_NONE, &metadata, image)))
+        {
+            std::cout << "Unable to read " << path.string() << std::endl;
+            return false;
+        }
+
+        // The sample loads them as sRGB, so either form of the format will do
+        if (metadata.dimension != TEX_DIMENSION_TEXTURE2D || metadata.width != AtlasSize ||
+            metadata.height != AtlasSize || metadata.arraySize != 1 || metadata.mipLevels < AtlasMips ||
+            MakeSRGB(metadata.format) != AtlasFormat)
+        {
+            std::cout << path.string() << " needs to be " << AtlasSize << "x" << AtlasSize << " BC3 with at least "
+                      << AtlasMips << " mips" << std::endl;
+            return false;
+        }
+
+        for (size_t mip = 0; mip < AtlasMips; ++mip)
+        {
+            Image const* src = image.GetImage(mip, 0, 0);
+            Image const* dst = atlas.GetImage(mip, slice, 0);
+            memcpy(dst->pixels, src->pixels, dst->slicePitch);
+        }
+    }
+
+    Blob blob;
+    if (FAILED(SaveToDDSMemory(atlas.GetImages(), atlas.GetImageCount(), atlas.GetMetadata(), DDS_FLAGS_NONE, blob)))
+    {
+        std::cout << "Unable to save the atlas" << std::endl;
+        return false;
+    }
+
+    uint8_t const* data = static_cast<uint8_t const*>(blob.GetBufferPointer());
+    std::vector<uint8_t> source(data, data + blob.GetBufferSize());
+    return PackDDS(source, jsonPath.string(), destPath, compression, stagingBufferSizeBytes);
+}
+
+namespace
+{
+    // A region found by AnalyzeArchive
+    struct AnalyzedRegion
+    {
+        size_t Kind; // index into AnalysisKinds
+        marc::Compression Compression;
+        char const* Data; // as stored in the file
+        uint32_t CompressedSize;
+        uint32_t UncompressedSize;
+    };
+
+    // The regions are grouped by what they're loaded into.  Only the GDeflate
+    // regions of the kinds that go to GPU memory can be decompressed on the
+    // GPU; BulkLoadDemo decodes the CPU regions on the CPU.
+    struct AnalysisKind
+    {
+        char const* Name;
+        bool Gpu;
+    };
+
+    constexpr AnalysisKind AnalysisKinds[] = {
+        {"Texture mips", true},
+        {"Texture tiles", true},
+        {"Swizzled textures", true},
+        {"GPU buffer", true},
+        {"CPU metadata", false},
+        {"CPU data", false},
+    };
+
+    enum AnalysisKindIndex : size_t
+    {
+        KindMips,
+        KindTiles,
+        KindSwizzled,
+        KindGpuBuffer,
+        KindCpuMetadata,
+        KindCpuData,
+        NumAnalysisKinds
+    };
+
+    static_assert(std::size(AnalysisKinds) == NumAnalysisKinds);
+
+    using AnalysisClock = std::chrono::high_resolution_clock;
+
+    double SecondsSince(AnalysisClock::time_point start)
+    {
+        return std::chrono::duration<double>(AnalysisClock::now() - start).count();
+    }
+} // namespace
+
+//
+// Decodes a region on the CPU, the way BulkLoadDemo does.  A ZlibBcSplit
+// region is only inflated, so its blocks are left split.
+//
+static bool DecodeRegion(
+    marc::Compression compression,
+    char const* source,
+    size_t sourceSize,
+    char* dest,
+    size_t destSize)
+{
+    switch (compression)
+    {
+    case marc::Compression::None:
+        if (sourceSize != destSize)
+            return false;
+        memcpy(dest, source, destSize);
+        return true;
+
+    case marc::Compression::GDeflate:
+    {
+#if USE_GDEFLATE_LIBRARY
+        return GDeflate::Decompress(
+            reinterpret_cast<uint8_t*>(dest),
+            destSize,
+            reinterpret_cast<uint8_t const*>(source),
+            sourceSize,
+            std::thread::hardware_concurrency());
+#else
+        size_t decompressedSize = 0;
+        return SUCCEEDED(
+                   GetBufferCompression()->DecompressBuffer(source, sourceSize, dest, destSize, &decompressedSize)) &&
+               decompressedSize == destSize;
+#endif
+    }
+
+    case marc::Compression::ZlibBcSplit:
+        if (sourceSize < sizeof(marc::BcSplitHeader))
+            return false;
+        source += sizeof(marc::BcSplitHeader);
+        sourceSize -= sizeof(marc::BcSplitHeader);
+        [[fallthrough]];
+
+    case marc::Compression::Zlib:
+    {
+        uLongf decompressedSize = static_cast<uLongf>(destSize);
+        return uncompress(
+                   reinterpret_cast<Bytef*>(dest),
+                   &decompressedSize,
+                   reinterpret_cast<Bytef const*>(source),
+                   static_cast<uLong>(sourceSize)) == Z_OK &&
+               decompressedSize == destSize;
+    }
+
+    default:
+        return false;
+    }
+}
+
+//
+// Decodes the GDeflate regions with DirectStorage into a GPU buffer, and
+// returns how long it took, or nothing if it couldn't.  The regions are read
+// from memory, so only decompression is timed.  They go in batches of up to
+// 1 GiB, and everything is done twice so that the second pass doesn't include
+// DirectStorage creating its shaders.
+//
+static std::optional<double> TimeGpuGDeflate(std::vector<AnalyzedRegion const*> const& regions)
+{
+    if (regions.empty())
+        return std::nullopt;
+
+    ComPtr<ID3D12Device> device;
+    if (auto hr = D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&device)); FAILED(hr))
+    {
+        std::cout << "Failed to create D3D12 device: 0x" << std::hex << hr << std::dec << std::endl;
+        return std::nullopt;
+    }
+
+    ComPtr<IDStorageFactory> factory;
+    if (FAILED(DStorageGetFactory(IID_PPV_ARGS(&factory))))
+        return std::nullopt;
+
+    constexpr uint64_t Alignment = 256;
+    constexpr uint64_t MaxBatchSize = 1024ull * 1024 * 1024;
+
+    uint64_t largestRegion = 0;
+    uint64_t totalSize = 0;
+    for (AnalyzedRegion const* region : regions)
+    {
+        largestRegion = std::max<uint64_t>({largestRegion, region->CompressedSize, region->UncompressedSize});
+        totalSize += (region->UncompressedSize + Alignment - 1) & ~(Alignment - 1);
+    }
+
+    // Every request has to fit in the staging buffer
+    factory->SetStagingBufferSize(static_cast<uint32_t>(std::max<uint64_t>(largestRegion, 32 * 1024 * 1024)));
+
+    DSTORAGE_QUEUE_DESC queueDesc{};
+    queueDesc.Device = device.Get();
+    queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+    queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+    queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+    queueDesc.Name = "MiniArchive analysis";
+
+    ComPtr<IDStorageQueue2> queue;
+    if (FAILED(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(&queue))))
+        return std::nullopt;
+
+    if (queue->GetCompressionSupport(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE) &
+        DSTORAGE_COMPRESSION_SUPPORT_CPU_FALLBACK)
+    {
+        std::cout << "This GPU can't decompress GDeflate, so DirectStorage decodes it on the CPU instead" << std::endl;
+    }
+
+    uint64_t const bufferSize = std::min(totalSize, std::max(MaxBatchSize, largestRegion));
+
+    CD3DX12_HEAP_PROPERTIES defaultHeap(D3D12_HEAP_TYPE_DEFAULT);
+    CD3DX12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(bufferSize);
+
+    ComPtr<ID3D12Resource> buffer;
+    ComPtr<ID3D12Fence> fence;
+    if (FAILED(device->CreateCommittedResource(
+            &defaultHeap,
+            D3D12_HEAP_FLAG_NONE,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(&buffer))) ||
+        FAILED(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence))))
+    {
+        return std::nullopt;
+    }
+
+    Event fenceEvent(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    uint64_t fenceValue = 0;
+
+    auto waitForBatch = [&]()
+    {
+        ++fenceValue;
+        queue->EnqueueSignal(fence.Get(), fenceValue);
+        queue->Submit();
+
+        ASSERT_SUCCEEDED(fence->SetEventOnCompletion(fenceValue, fenceEvent.Get()));
+        WaitForSingleObject(fenceEvent.Get(), INFINITE);
+    };
+
+    double seconds = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        AnalysisClock::time_point start = AnalysisClock::now();
+
+        uint64_t offset = 0;
+        for (AnalyzedRegion const* region : regions)
+        {
+            if (offset + region->UncompressedSize > bufferSize)
+            {
+                waitForBatch();
+                offset = 0;
+            }
+
+            DSTORAGE_REQUEST request{};
+            request.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+            request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+            request.Source.Memory.Source = region->Data;
+            request.Source.Memory.Size = region->CompressedSize;
+            request.Destination.Buffer.Resource = buffer.Get();
+            request.Destination.Buffer.Offset = offset;
+            request.Destination.Buffer.Size = region->UncompressedSize;
+            request.UncompressedSize = region->UncompressedSize;
+            queue->EnqueueRequest(&request);
+
+            offset += (region->UncompressedSize + Alignment - 1) & ~(Alignment - 1);
+        }
+        waitForBatch();
+
+        seconds = SecondsSince(start);
+    }
+
+    DSTORAGE_ERROR_RECORD errorRecord{};
+    queue->RetrieveErrorRecord(&errorRecord);
+    if (errorRecord.FailureCount > 0)
+    {
+        std::cout << "DirectStorage failed to decompress " << errorRecord.FailureCount
+                  << " regions, hr = 0x" << std::hex << errorRecord.FirstFailure.HResult << std::dec << std::endl;
+        return std::nullopt;
+    }
+
+    return seconds;
+}
+
+static std::string FormatMiB(uint64_t bytes)
+{
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(2) << bytes / (1024.0 * 1024.0) << " MiB";
+    return s.str();
+}
+
+static std::string FormatDecodeTime(size_t numRegions, uint64_t uncompressedSize, std::optional<double> seconds)
+{
+    std::ostringstream s;
+    s << numRegions << " regions, " << FormatMiB(uncompressedSize);
+    if (numRegions == 0)
+        return s.str();
+
+    if (!seconds)
+        return s.str() + ", not measured";
+
+    s << std::fixed << std::setprecision(2) << " in " << *seconds * 1000.0 << " ms ("
+      << uncompressedSize / std::max(*seconds, 1e-9) / 1e9 << " GB/s of output)";
+    return s.str();
+}
+
+//
+// Reports how well each kind of region in one .marc file compresses, how long
+// its regions take to decode with each format on this machine, and how long
+// the file would take to load at the given read bandwidth.  data holds the
+// whole file.
+//
+static bool AnalyzeMarcFile(std::string const& name, char const* data, size_t size, double readBytesPerSecond)
+{
+    std::cout << name << std::endl;
+
+    if (size < sizeof(marc::Header))
+    {
+        std::cout << "  Not a .marc file" << std::endl;
+        return false;
+    }
+
+    marc::Header header;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.Id, "MARC", 4) != 0 || !marc::IsSupportedVersion(header.Version))
+    {
+        std::cout << "  Not a .marc file, or an unsupported version" << std::endl;
+        return false;
+    }
+
+    uint64_t const offsetMask = marc::GetOffsetMask(header.Version);
+
+    std::vector<AnalyzedRegion> regions;
+    bool inBounds = true;
+
+    auto addRegion = [&](size_t kind, auto const& region)
+    {
+        if (region.UncompressedSize == 0)
+            return;
+
+        uint64_t const offset = region.Data.Offset & offsetMask;
+        if (offset > size || region.CompressedSize > size - offset)
+        {
+            inBounds = false;
+            return;
+        }
+
+        regions.push_back(
+            {kind, region.Compression, data + offset, region.CompressedSize, region.UncompressedSize});
+    };
+
+    addRegion(KindGpuBuffer, header.UnstructuredGpuData);
+    addRegion(KindCpuMetadata, header.CpuMetadata);
+    addRegion(KindCpuData, header.CpuData);
+
+    if (!inBounds)
+    {
+        std::cout << "  The header's regions are outside the file" << std::endl;
+        return false;
+    }
+
+    // The texture regions are listed in the CPU metadata.  Headers written by
+    // older versions are shorter, so the rest of the buffer stays zeroed.
+    std::vector<char> metadataImage(
+        std::max<size_t>(header.CpuMetadata.UncompressedSize, sizeof(marc::CpuMetadataHeader)));
+
+    auto metadataRegion = std::find_if(
+        regions.begin(),
+        regions.end(),
+        [](AnalyzedRegion const& region) { return region.Kind == KindCpuMetadata; });
+
+    if (metadataRegion == regions.end() ||
+        !DecodeRegion(
+            metadataRegion->Compression,
+            metadataRegion->Data,
+            metadataRegion->CompressedSize,
+            metadataImage.data(),
+            metadataRegion->UncompressedSize))
+    {
+        std::cout << "  Unable to decode the CPU metadata" << std::endl;
+        return false;
+    }
+
+    auto const& metadata = *reinterpret_cast<marc::CpuMetadataHeader const*>(metadataImage.data());
+
+    // Before version 8 the Ptrs in the metadata are offsets from its start
+    auto resolve = [&](auto const& ptr)
+    {
+        using T = std::remove_reference_t<decltype(*ptr.Get())>;
+        if (marc::HasSelfRelativePtrs(header.Version))
+            return ptr.Get();
+
+        uint64_t const offset = ptr.Offset & offsetMask;
+        return offset == 0 ? nullptr : reinterpret_cast<T*>(metadataImage.data() + offset);
+    };
+
+    marc::TextureMetadata const* textures = resolve(metadata.Textures.Data);
+    for (uint32_t i = 0; textures && i < metadata.NumTextures; ++i)
+    {
+        marc::TextureMetadata const& texture = textures[i];
+
+        marc::GpuRegion const* singleMips = resolve(texture.SingleMips.Data);
+        for (uint32_t mip = 0; singleMips && mip < texture.NumSingleMips; ++mip)
+            addRegion(KindMips, singleMips[mip]);
+
+        marc::TextureMipBand const* bands = resolve(texture.MipBands.Data);
+        for (uint32_t band = 0; bands && band < texture.NumMipBands; ++band)
+            addRegion(KindMips, bands[band].Data);
+
+        addRegion(texture.NumTiles > 0 ? KindTiles : KindMips, texture.RemainingMips);
+
+        marc::TextureTile const* tiles = resolve(texture.Tiles.Data);
+        for (uint32_t tile = 0; tiles && tile < texture.NumTiles; ++tile)
+            addRegion(KindTiles, tiles[tile].Data);
+    }
+
+    // Swizzled textures are stored twice; a loader reads one copy or the other
+    marc::SwizzledTexture const* swizzled =
+        marc::HasSwizzledTextures(header.Version) ? resolve(metadata.SwizzledTextures.Data) : nullptr;
+    for (uint32_t i = 0; swizzled && i < metadata.NumTextures; ++i)
+    {
+        marc::GpuRegion const* parts = resolve(swizzled[i].Parts.Data);
+        for (uint32_t part = 0; parts && part < swizzled[i].NumParts; ++part)
+            addRegion(KindSwizzled, parts[part]);
+    }
+
+    if (!inBounds)
+    {
+        std::cout << "  Some of the texture regions are outside the file" << std::endl;
+        return false;
+    }
+
+    std::cout << "  Version " << header.Version << ", " << metadata.NumTextures << " textures, " << regions.size()
+              << " regions" << std::endl;
+
+    // Ratios by kind
+    std::cout << "  " << std::left << std::setw(20) << "Region type" << std::right << std::setw(9) << "Regions"
+              << std::setw(16) << "Uncompressed" << std::setw(16) << "Compressed" << std::setw(8) << "Ratio"
+              << "  None/GDeflate/ZLib" << std::endl;
+
+    for (size_t kind = 0; kind < NumAnalysisKinds; ++kind)
+    {
+        size_t numRegions = 0;
+        uint64_t compressedSize = 0;
+        uint64_t uncompressedSize = 0;
+        size_t formats[3] = {};
+
+        for (AnalyzedRegion const& region : regions)
+        {
+            if (region.Kind != kind)
+                continue;
+
+            ++numRegions;
+            compressedSize += region.CompressedSize;
+            uncompressedSize += region.UncompressedSize;
+            ++formats[std::min<size_t>(static_cast<size_t>(region.Compression), 2)];
+        }
+
+        if (numRegions == 0)
+            continue;
+
+        std::cout << "  " << std::left << std::setw(20) << AnalysisKinds[kind].Name << std::right << std::setw(9)
+                  << numRegions << std::setw(16) << FormatMiB(uncompressedSize) << std::setw(16)
+                  << FormatMiB(compressedSize) << std::setw(8) << std::fixed << std::setprecision(2)
+                  << double(uncompressedSize) / std::max<uint64_t>(compressedSize, 1) << "  " << formats[0] << "/"
+                  << formats[1] << "/" << formats[2] << std::endl;
+    }
+
+    // Decode every compressed region with the decoder BulkLoadDemo would use
+    std::vector<AnalyzedRegion const*> cpuGDeflate;
+    std::vector<AnalyzedRegion const*> gpuGDeflate;
+    std::vector<AnalyzedRegion const*> zlib;
+    uint64_t cpuGDeflateSize = 0;
+    uint64_t gpuGDeflateSize = 0;
+    uint64_t zlibSize = 0;
+    uint64_t compressedSize = 0;
+    uint64_t uncompressedSize = 0;
+    uint32_t largestRegion = 0;
+
+    for (AnalyzedRegion const& region : regions)
+    {
+        compressedSize += region.CompressedSize;
+        uncompressedSize += region.UncompressedSize;
+        largestRegion = std::max(largestRegion, region.UncompressedSize);
+
+        if (region.Compression == marc::Compression::GDeflate)
+        {
+            cpuGDeflate.push_back(&region);
+            cpuGDeflateSize += region.UncompressedSize;
+
+            if (AnalysisKinds[region.Kind].Gpu)
+            {
+                gpuGDeflate.push_back(&region);
+                gpuGDeflateSize += region.UncompressedSize;
+            }
+        }
+        else if (region.Compression != marc::Compression::None)
+        {
+            zlib.push_back(&region);
+            zlibSize += region.UncompressedSize;
+        }
+    }
+
+    std::vector<char> scratch(largestRegion);
+
+    auto timeCpu = [&](std::vector<AnalyzedRegion const*> const& list) -> std::optional<double>
+    {
+        if (list.empty())
+            return std::nullopt;
+
+        AnalysisClock::time_point start = AnalysisClock::now();
+        for (AnalyzedRegion const* region : list)
+        {
+            if (!DecodeRegion(
+                    region->Compression,
+                    region->Data,
+                    region->CompressedSize,
+                    scratch.data(),
+                    region->UncompressedSize))
+            {
+                std::cout << "  A region failed to decode" << std::endl;
+                return std::nullopt;
+            }
+        }
+        return SecondsSince(start);
+    };
+
+    std::optional<double> const cpuGDeflateSeconds = timeCpu(cpuGDeflate);
+    std::optional<double> const zlibSeconds = timeCpu(zlib);
+    std::optional<double> const gpuGDeflateSeconds = TimeGpuGDeflate(gpuGDeflate);
+
+    std::cout << "  CPU GDeflate: " << FormatDecodeTime(cpuGDeflate.size(), cpuGDeflateSize, cpuGDeflateSeconds)
+              << std::endl;
+    std::cout << "  CPU ZLib:     " << FormatDecodeTime(zlib.size(), zlibSize, zlibSeconds) << std::endl;
+    std::cout << "  GPU GDeflate: " << FormatDecodeTime(gpuGDeflate.size(), gpuGDeflateSize, gpuGDeflateSeconds)
+              << std::endl;
+
+    // A load reads and decodes at once, so it takes as long as the slowest of
+    // the disk, the GPU and the CPU.  The GPU regions' GDeflate goes to the
+    // GPU when it could be measured there.  Every region is counted, so a
+    // file with swizzled textures is estimated as if both copies were read.
+    auto rate = [](uint64_t bytes, std::optional<double> seconds) { return seconds ? *seconds / bytes : 0.0; };
+
+    uint64_t const cpuOnlyGDeflateSize = cpuGDeflateSize - (gpuGDeflateSeconds ? gpuGDeflateSize : 0);
+    double const readSeconds = compressedSize / readBytesPerSecond;
+    double const gpuSeconds = gpuGDeflateSeconds.value_or(0.0);
+    double const cpuSeconds = cpuOnlyGDeflateSize * rate(cpuGDeflateSize, cpuGDeflateSeconds) +
+                              zlibSize * rate(zlibSize, zlibSeconds);
+
+    std::cout << std::fixed << std::setprecision(2) << "  At " << readBytesPerSecond / 1e6
+              << " MB/s: reading takes " << readSeconds * 1000.0 << " ms, GPU decoding " << gpuSeconds * 1000.0
+              << " ms, CPU decoding " << cpuSeconds * 1000.0 << " ms, so the load takes about "
+              << std::max({readSeconds, gpuSeconds, cpuSeconds}) * 1000.0 << " ms.  Uncompressed it would take "
+              << uncompressedSize / readBytesPerSecond * 1000.0 << " ms." << std::endl;
+
+    return true;
+}
+
+//
+// Runs AnalyzeMarcFile on a .marc file, or on every file in a bundle.
+//
+static bool AnalyzeArchive(std::filesystem::path const& path, double readBytesPerSecond)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in && !in.eof())
+    {
+        std::cout << "Unable to read " << path.string() << std::endl;
+        return false;
+    }
+
+    marc::BundleHeader bundle{};
+    if (data.size() >= sizeof(bundle))
+        memcpy(&bundle, data.data(), sizeof(bundle));
+
+    if (memcmp(bundle.Id, "MBDL", 4) != 0)
+        return AnalyzeMarcFile(path.string(), data.data(), data.size(), readBytesPerSecond);
+
+    size_t const namesOffset = sizeof(bundle) + bundle.NumEntries * sizeof(marc::BundleEntry);
+    if (bundle.Version != marc::CURRENT_BUNDLE_FILE_VERSION || namesOffset + bundle.NamesSize > data.size())
+    {
+        std::cout << path.string() << " isn't a bundle this version can read" << std::endl;
+        return false;
+    }
+
+    auto const* entries = reinterpret_cast<marc::BundleEntry const*>(data.data() + sizeof(bundle));
+    char const* names = data.data() + namesOffset;
+
+    bool succeeded = true;
+    for (uint32_t i = 0; i < bundle.NumEntries; ++i)
+    {
+        marc::BundleEntry const& entry = entries[i];
+        std::string name = path.string() + ": " + std::string(names + entry.NameOffset, entry.NameLength);
+
+        if (entry.Offset > data.size() || entry.Size > data.size() - entry.Offset)
+        {
+            std::cout << name << " is outside the bundle" << std::endl;
+            succeeded = false;
+            continue;
+        }
+
+        succeeded &= AnalyzeMarcFile(name, data.data() + entry.Offset, entry.Size, readBytesPerSecond);
+    }
+
+    return succeeded;
+}
+
+static void ShowUsage(char const* exeName)
+{
+    std::cout << "Usage: " << exeName
+              << " [-gdeflate|-zlib [-cpuzlib]|-auto] [-targetbandwidth=X] [-bcsplit] [-stagingbuffersize=X] [-bc] "
+                 "[-tiled] [-swizzle] [-loadorder] [-align=X] [-quantize] [-indexorder=X] [-meshlets] [-cache=dir] "
+                 "source.gltf dest.marc\n";
+    std::cout << "       " << exeName
+              << " [-gdeflate|-zlib [-cpuzlib]|-auto] [-targetbandwidth=X] [-bcsplit] [-stagingbuffersize=X] "
+                 "[-bc] [-tiled] [-swizzle] [-loadorder] [-align=X] [-quantize] [-indexorder=X] [-meshlets] "
+                 "[-cache=dir] [-shared=store.marc] [-bundle=dest.bundle] source.gltf dest.marc "
+                 "[source.gltf dest.marc ...]\n";
+    std::cout << "       " << exeName
+              << " -dds [-gdeflate|-zlib] [-stagingbuffersize=X] source.dds dest.dds [source.dds dest.dds ...]\n";
+    std::cout << "       " << exeName << " -particles [-gdeflate|-zlib] particles.json dest.dds\n";
+    std::cout << "       " << exeName << " -analyze [-targetbandwidth=X] file.marc|file.bundle [...]\n";
+    std::cout << "\n\nStaging buffer size is in MiB.  Default is 256 MiB.\n";
+    std::cout << "-zlib still compresses the CPU metadata and data with GDeflate, unless -cpuzlib is given.\n";
+    std::cout << "-auto chooses each region's compression by how long it would take to read and decode.\n";
+    std::cout << "-bcsplit also tries Zlib on BC1-5 textures with their endpoints and indices split apart.\n";
+    std::cout << "Target bandwidth is the read speed -auto and -analyze assume, in MB/s.  Default is 3000 MB/s.\n";
+    std::cout << "-tiled stores 2D textures as 64KB tiles, to be loaded into reserved resources.\n";
+    std::cout << "-swizzle also stores 2D textures in the 64KB standard swizzle, to be read straight into GPUs that "
+                 "support it.\n";
+    std::cout << "-loadorder writes the regions in the order they're loaded, so loads read forwards.\n";
+    std::cout << "-align aligns each region, in KiB, for example to 4 or 64.  Default is 4 with -loadorder, else 0.\n";
+    std::cout << "-quantize stores unskinned mesh positions as 16 bits per component, within each node's bounds.\n";
+    std::cout << "-indexorder orders triangles with forsyth, tipsify or overdraw (tipsify, then sorted to reduce "
+                 "overdraw).  Default is forsyth.\n";
+    std::cout << "-meshlets splits opaque, unskinned meshes with float positions into meshlets for mesh shaders.\n";
+    std::cout << "-cache keeps converted textures and compressed regions in dir, so ones that haven't changed aren't "
+                 "converted or compressed again.\n";
+    std::cout << "-shared writes the textures used by more than one of the models to store.marc, once.\n";
+    std::cout << "-bundle packs all the .marc files written into dest.bundle, so they can be loaded as one file.\n";
+    std::cout << "-dds packs DDS files so BulkLoadDemo reads each run of subresources that fits in the staging "
+                 "buffer with one request.\n";
+    std::cout << "-particles packs the textures a particle effects file uses into one texture array, for "
+                 "ParticleEffects to load instead of the textures.  Name it after the file, such as particles.dds.\n";
+    std::cout << "-analyze reports each archive's compression ratio by region type, times decoding its regions with "
+                 "CPU GDeflate, CPU ZLib and GPU GDeflate, and estimates its load time at the target bandwidth.\n";
+}
+
+namespace
+{
+    // A model being archived
+    struct BatchModel
+    {
+        std::filesystem::path SourcePath;
+        std::filesystem::path DestPath;
+        std::optional<glTF::Asset> Asset;
+        Renderer::ModelData ModelData;
+        std::vector<TextureSource> Textures;
+    };
+} // namespace
+
+int main(int argc, char** argv)
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    bool useGDeflate = false;
+    bool useZlib = false;
+    bool useAuto = false;
+    bool useCpuZlib = false;
+    bool useBcSplit = false;
+    bool useLoadOrder = false;
+    bool useQuantize = false;
+    bool useMeshlets = false;
+    bool packDDS = false;
+    bool buildParticleAtlas = false;
+    bool analyze = false;
+    Renderer::IndexOrder indexOrder = Renderer::IndexOrder::Forsyth;
+    std::optional<uint32_t> alignKiB;
+    uint32_t targetBandwidthMBps = 3000;
+    bool useBC = false;
+    bool useTiled = false;
+    bool useSwizzle = false;
+    uint32_t stagingBufferSizeMiB = 256;
+    char const* storeFilename = nullptr;
+    char const* cacheDirectory = nullptr;
+    char const* bundleFilename = nullptr;
+    std::vector<char const*> filenames;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        char const* arg = argv[i];
+        std::regex stagingBufferRegex{"-stagingbuffersize=([0-9]+)", std::regex_constants::icase};
+        std::regex sharedRegex{"-shared=(.+)", std::regex_constants::icase};
+        std::regex targetBandwidthRegex{"-targetbandwidth=([0-9]+)", std::regex_constants::icase};
+        std::regex alignRegex{"-align=([0-9]+)", std::regex_constants::icase};
+        std::regex cacheRegex{"-cache=(.+)", std::regex_constants::icase};
+        std::regex bundleRegex{"-bundle=(.+)", std::regex_constants::icase};
+        std::regex indexOrderRegex{"-indexorder=(forsyth|tipsify|overdraw)", std::regex_constants::icase};
+        std::cmatch match;
+
+        if (_strcmpi(arg, "-gdeflate") == 0)
+            useGDeflate = true;
+        else if (_strcmpi(arg, "-zlib") == 0)
+            useZlib = true;
+        else if (_strcmpi(arg, "-auto") == 0)
+            useAuto = true;
+        else if (_strcmpi(arg, "-cpuzlib") == 0)
+            useCpuZlib = true;
+        else if (_strcmpi(arg, "-bcsplit") == 0)
+            useBcSplit = true;
+        else if (_strcmpi(arg, "-loadorder") == 0)
+            useLoadOrder = true;
+        else if (_strcmpi(arg, "-quantize") == 0)
+            useQuantize = true;
+        else if (_strcmpi(arg, "-meshlets") == 0)
+            useMeshlets = true;
+        else if (_strcmpi(arg, "-dds") == 0)
+            packDDS = true;
+        else if (_strcmpi(arg, "-particles") == 0)
+            buildParticleAtlas = true;
+        else if (_strcmpi(arg, "-analyze") == 0)
+            analyze = true;
+        else if (std::regex_match(arg, match, indexOrderRegex))
+        {
+            if (_strcmpi(match[1].first, "tipsify") == 0)
+                indexOrder = Renderer::IndexOrder::Tipsify;
+            else if (_strcmpi(match[1].first, "overdraw") == 0)
+                indexOrder = Renderer::IndexOrder::TipsifyOverdraw;
+            else
+                indexOrder = Renderer::IndexOrder::Forsyth;
+        }
+        else if (std::regex_match(arg, match, alignRegex))
+            alignKiB = atoi(match[1].first);
+        else if (_strcmpi(arg, "-bc") == 0)
+            useBC = true;
+        else if (_strcmpi(arg, "-tiled") == 0)
+            useTiled = true;
+        else if (_strcmpi(arg, "-swizzle") == 0)
+            useSwizzle = true;
+        else if (std::regex_match(arg, match, stagingBufferRegex))
+            stagingBufferSizeMiB = atoi(match[1].first);
+        else if (std::regex_match(arg, match, targetBandwidthRegex))
+            targetBandwidthMBps = atoi(match[1].first);
+        else if (std::regex_match(arg, match, sharedRegex))
+            storeFilename = match[1].first;
+        else if (std::regex_match(arg, match, cacheRegex))
+            cacheDirectory = match[1].first;
+        else if (std::regex_match(arg, match, bundleRegex))
+            bundleFilename = match[1].first;
+        else
+            filenames.push_back(arg);
+    }
+
+    if ((int(useZlib) + int(useGDeflate) + int(useAuto)) > 1)
+    {
+        std::cout << "Only one of -zlib, -gdeflate or -auto may be specified at a time." << std::endl;
+        ShowUsage(argv[0]);
+        return -1;
+    }
+
+    // The split blocks are put back together by the CPU, so they go with the
+    // formats the CPU decodes
+    if (useBcSplit && !(useZlib || useAuto))
+    {
+        std::cout << "-bcsplit needs -zlib or -auto." << std::endl;
+        ShowUsage(argv[0]);
+        return -1;
+    }
+
+    if (targetBandwidthMBps == 0)
+    {
+        ShowUsage(argv[0]);
+        return -1;
+    }
+
+    // Regions written in load order are aligned to 4 KiB sectors unless told
+    // otherwise
+    uint32_t const regionAlignmentKiB = alignKiB.value_or(useLoadOrder ? 4 : 0);
+
+    if (useCpuZlib && !useZlib)
+    {
+        std::cout << "-cpuzlib needs -zlib." << std::endl;
+        ShowUsage(argv[0]);
+        return -1;
+    }
+
+    marc::Compression compression = marc::Compression::None;
+    if (useGDeflate)
+        compression = marc::Compression::GDeflate;
+    else if (useZlib)
+        compression = marc::Compression::Zlib;
+
+    // The CPU metadata and data are GDeflate whenever they're compressed,
+    // since BulkLoadDemo decodes GDeflate on every core, and ZLib on just one
+    marc::Compression cpuCompression = compression;
+    if (useZlib && !useCpuZlib)
+        cpuCompression = marc::Compression::GDeflate;
+
+    std::optional<CompressionCostModel> autoCompression;
+    if (useAuto)
+        autoCompression = CompressionCostModel{targetBandwidthMBps * 1e6};
+
+    std::optional<RegionCache> regionCache;
+    if (cacheDirectory)
+        regionCache.emplace(std::filesystem::path(cacheDirectory).make_preferred());
+
+#if !USE_GDEFLATE_LIBRARY
+    if (useGDeflate || useAuto || cpuCompression == marc::Compression::GDeflate || analyze)
+    {
+        // Get the buffer compression interface for DSTORAGE_COMPRESSION_FORMAT_GDEFLATE
+        constexpr uint32_t NumCompressionThreads = 6;
+        ASSERT_SUCCEEDED(DStorageCreateCompressionCodec(
+            DSTORAGE_COMPRESSION_FORMAT_GDEFLATE,
+            NumCompressionThreads,
+            IID_PPV_ARGS(&g_bufferCompression)));
+    }
+#endif
+
+    // Archives are analyzed without writing anything
+    if (analyze)
+    {
+        if (useGDeflate || useZlib || useAuto || filenames.empty())
+        {
+            ShowUsage(argv[0]);
+            return -1;
+        }
+
+        bool analyzed = true;
+        for (char const* filename : filenames)
+            analyzed &= AnalyzeArchive(filename, targetBandwidthMBps * 1e6);
+        return analyzed ? 0 : -1;
+    }
+
+    // DDS files are packed on their own, and need a format DirectStorage can
+    // decompress straight into a texture
+    if (packDDS)
+    {
+        if (useAuto || useBcSplit || filenames.empty() || filenames.size() % 2 != 0)
+        {
+            ShowUsage(argv[0]);
+            return -1;
+        }
+
+        for (size_t i = 0; i < filenames.size(); i += 2)
+        {
+            if (!PackDDS(filenames[i], filenames[i + 1], compression, stagingBufferSizeMiB * 1024 * 1024))
+                return -1;
+        }
+        return 0;
+    }
+
+    if (buildParticleAtlas)
+    {
+        if (useAuto || useBcSplit || filenames.size() != 2)
+        {
+            ShowUsage(argv[0]);
+            return -1;
+        }
+
+        bool const built =
+            BuildParticleAtlas(filenames[0], filenames[1], compression, stagingBufferSizeMiB * 1024 * 1024);
+        return built ? 0 : -1;
+    }
+
+    // Without -shared or -bundle exactly one model is archived
+    bool const batch = storeFilename || bundleFilename;
+    bool const validFilenames = batch ? (!filenames.empty() && filenames.size() % 2 == 0) : (filenames.size() == 2);
+    if (!validFilenames)
+    {
+        ShowUsage(argv[0]);
+        return -1;
+    }
+
+    TexConversionFlags extraTextureFlags{};
+    if (useBC)
+    {
+        extraTextureFlags = static_cast<TexConversionFlags>(extraTextureFlags | kDefaultBC);
+    }
+
+    // Every model is loaded before anything is written, so that the textures
+    // they share are known.
+    std::vector<BatchModel> models(filenames.size() / 2);
+    for (size_t i = 0; i < models.size(); ++i)
+    {
+        BatchModel& model = models[i];
+
+        model.SourcePath = filenames[i * 2];
+        model.SourcePath.make_preferred();
+        model.DestPath = filenames[i * 2 + 1];
+        model.DestPath.make_preferred();
+
+        std::cout << "Source: " << model.SourcePath.string().c_str() << std::endl;
+
+        model.Asset.emplace(model.SourcePath.wstring());
+        constexpr int sceneIndex = -1;
+        constexpr bool compileTextures = false;
+        if (!BuildModel(model.ModelData, *model.Asset, sceneIndex, compileTextures, indexOrder))
+        {
+            std::cout << "Unable to read source gltf file" << std::endl;
+            return -1;
+        }
+
+        // Lossless, so it's always done
+        size_t const numMaterials = model.ModelData.m_MaterialConstants.size();
+        if (Renderer::DeduplicateMaterials(model.ModelData))
+        {
+            std::cout << "Merged duplicate materials: " << numMaterials << " -> "
+                      << model.ModelData.m_MaterialConstants.size() << std::endl;
+        }
+
+        if (useQuantize)
+        {
+            size_t const geometrySize = model.ModelData.m_GeometryData.size();
+            if (Renderer::QuantizePositions(model.ModelData))
+            {
+                std::cout << "Quantized positions: geometry " << geometrySize << " -> "
+                          << model.ModelData.m_GeometryData.size() << " bytes" << std::endl;
+            }
+        }
+
+        // After quantization, since that rebuilds the geometry data
+        if (useMeshlets)
+        {
+            size_t const geometrySize = model.ModelData.m_GeometryData.size();
+            if (Renderer::BuildMeshlets(model.ModelData))
+            {
+                std::cout << "Built meshlets: geometry " << geometrySize << " -> "
+                          << model.ModelData.m_GeometryData.size() << " bytes" << std::endl;
+            }
+        }
+
+        for (size_t t = 0; t < model.ModelData.m_TextureNames.size(); ++t)
+        {
+            TextureSource source;
+            source.Name = model.ModelData.m_TextureNames[t];
+            source.Path = absolute(std::filesystem::path(model.Asset->m_basePath) / source.Name);
+            source.Flags = static_cast<uint8_t>(model.ModelData.m_TextureOptions[t] | extraTextureFlags);
+            model.Textures.push_back(std::move(source));
+        }
+    }
+
+    // A texture goes in the store if more than one model uses it.  The store's
+    // textures are in the order the models first use them.
+    std::vector<TextureSource> storeTextures;
+    if (storeFilename)
+    {
+        struct SharedTexture
+        {
+            uint32_t NumModels = 0;
+            size_t LastModel = ~size_t(0);
+            uint32_t StoreIndex = marc::NotShared;
+        };
+
+        std::unordered_map<uint64_t, SharedTexture> sharedTextures;
+        std::vector<std::vector<uint64_t>> textureHashes(models.size());
+
+        for (size_t i = 0; i < models.size(); ++i)
+        {
+            for (TextureSource const& source : models[i].Textures)
+            {
+                uint64_t hash = HashTextureSource(source);
+                textureHashes[i].push_back(hash);
+
+                SharedTexture& shared = sharedTextures[hash];
+                if (shared.LastModel != i)
+                {
+                    shared.LastModel = i;
+                    ++shared.NumModels;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < models.size(); ++i)
+        {
+            for (size_t t = 0; t < models[i].Textures.size(); ++t)
+            {
+                SharedTexture& shared = sharedTextures[textureHashes[i][t]];
+                if (shared.NumModels < 2)
+                    continue;
+
+                if (shared.StoreIndex == marc::NotShared)
+                {
+                    shared.StoreIndex = static_cast<uint32_t>(storeTextures.size());
+                    storeTextures.push_back(models[i].Textures[t]);
+                }
+
+                models[i].Textures[t].SharedIndex = shared.StoreIndex;
+            }
+        }
+
+        if (storeTextures.empty())
+            std::cout << "None of the models share textures, so there's no texture store" << std::endl;
+    }
+
+    // The files written, for -bundle
+    std::vector<std::filesystem::path> writtenPaths;
+
+    std::filesystem::path storePath;
+    std::vector<D3D12_RESOURCE_DESC> storeDescs;
+    if (!storeTextures.empty())
+    {
+        storePath = storeFilename;
+        storePath.make_preferred();
+
+        std::cout << "Texture store: " << storePath.string().c_str() << std::endl;
+
+        TextureStoreRef storeRef;
+        storeRef.IsTextureStore = true;
+
+        // The store has only textures
+        Renderer::ModelData noModel;
+
+        std::ofstream outStream(storePath, std::ios::out | std::ios::trunc | std::ios::binary);
+        storeDescs = Exporter::Export(
+            outStream,
+            compression,
+            cpuCompression,
+            autoCompression,
+            useBcSplit,
+            useLoadOrder,
+            regionAlignmentKiB * 1024,
+            stagingBufferSizeMiB * 1024 * 1024,
+            useTiled,
+            useSwizzle,
+            std::move(storeTextures),
+            noModel,
+            storeRef,
+            regionCache ? &*regionCache : nullptr);
+        outStream.close();
+        writtenPaths.push_back(storePath);
+    }
+
+    for (BatchModel& model : models)
+    {
+        std::cout << "Dest: " << model.DestPath.string().c_str() << std::endl;
+
+        TextureStoreRef storeRef;
+        if (!storePath.empty())
+        {
+            std::filesystem::path destDirectory = absolute(model.DestPath).parent_path();
+            storeRef.Name = std::filesystem::relative(absolute(storePath), destDirectory).string();
+            storeRef.Descs = &storeDescs;
+        }
+
+        std::ofstream outStream(model.DestPath, std::ios::out | std::ios::trunc | std::ios::binary);
+
+        Exporter::Export(
+            outStream,
+            compression,
+            cpuCompression,
+            autoCompression,
+            useBcSplit,
+            useLoadOrder,
+            regionAlignmentKiB * 1024,
+            stagingBufferSizeMiB * 1024 * 1024,
+            useTiled,
+            useSwizzle,
+            std::move(model.Textures),
+            model.ModelData,
+            storeRef,
+            regionCache ? &*regionCache : nullptr);
+
+        outStream.close();
+        writtenPaths.push_back(model.DestPath);
+    }
+
+    if (bundleFilename)
+    {
+        std::filesystem::path bundlePath = bundleFilename;
+        bundlePath.make_preferred();
+
+        std::cout << "Bundle: " << bundlePath.string().c_str() << std::endl;
+        if (!WriteBundle(bundlePath, writtenPaths))
+            return -1;
+    }
 
     return 0;
 }
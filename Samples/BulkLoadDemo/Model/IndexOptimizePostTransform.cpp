@@ -22,6 +22,9 @@
 #include <ASSERT.h>
 #include <math.h>
 #include <algorithm>
+#include <numeric>
+#include <vector>
+#include <DirectXMath.h>
 
 #include "IndexOptimizePostTransform.h"
 
@@ -448,3 +451,239 @@ void OptimizeFaces(const SrcIndexType* indexList, size_t indexCount, DstIndexTyp
         entriesInCache0 = std::min(entriesInCache1, lruCacheSize);
     }
 }
+
+//-----------------------------------------------------------------------------
+//  This is an implementation of the "Tipsify" algorithm from Sander, Nehab and
+//  Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+//  Overdraw" (SIGGRAPH 2007).  Unlike the algorithm above, it never scores
+//  the whole cache, so it runs in time linear in the number of triangles.
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    template <typename IndexType>
+    uint32_t SkipDeadEnd(const uint32_t* liveTriangles, std::vector<uint32_t>& deadEndStack,
+        const IndexType* indexList, size_t indexCount, uint32_t& cursor)
+    {
+        // Prefer the vertices of recently emitted triangles, which are likely to still be in the cache
+        while (!deadEndStack.empty())
+        {
+            uint32_t vertex = deadEndStack.back();
+            deadEndStack.pop_back();
+            if (liveTriangles[vertex] > 0)
+                return vertex;
+        }
+
+        // Otherwise, continue from the first input triangle not yet considered
+        while (cursor < indexCount)
+        {
+            uint32_t vertex = indexList[cursor++];
+            if (liveTriangles[vertex] > 0)
+                return vertex;
+        }
+
+        return UINT32_MAX;
+    }
+}
+
+template <typename SrcIndexType, typename DstIndexType>
+void OptimizeFacesTipsify(const SrcIndexType* indexList, size_t indexCount, size_t vertexCount,
+    DstIndexType* newIndexList, size_t cacheSize)
+{
+    ASSERT(indexCount % 3 == 0);
+
+    // Build the vertex to triangle adjacency with a counting sort
+    std::vector<uint32_t> liveTriangles(vertexCount, 0);
+    for (size_t i = 0; i < indexCount; ++i)
+    {
+        ASSERT(indexList[i] < vertexCount);
+        liveTriangles[indexList[i]]++;
+    }
+
+    std::vector<uint32_t> adjacencyStart(vertexCount + 1);
+    adjacencyStart[0] = 0;
+    for (size_t v = 0; v < vertexCount; ++v)
+        adjacencyStart[v + 1] = adjacencyStart[v] + liveTriangles[v];
+
+    std::vector<uint32_t> adjacency(indexCount);
+    {
+        std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+        for (size_t i = 0; i < indexCount; ++i)
+            adjacency[fill[indexList[i]]++] = (uint32_t)(i / 3);
+    }
+
+    // The time each vertex last entered the simulated FIFO cache
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(indexCount / 3, false);
+    std::vector<uint32_t> deadEndStack;
+    std::vector<uint32_t> candidates;
+
+    const uint32_t k = (uint32_t)cacheSize;
+    uint32_t timeStamp = k + 1;
+    uint32_t cursor = 0;
+    DstIndexType* output = newIndexList;
+
+    uint32_t fanningVertex = indexCount > 0 ? (uint32_t)indexList[0] : UINT32_MAX;
+    while (fanningVertex != UINT32_MAX)
+    {
+        candidates.clear();
+
+        // Emit all of the fanning vertex's remaining triangles
+        for (uint32_t a = adjacencyStart[fanningVertex]; a < adjacencyStart[fanningVertex + 1]; ++a)
+        {
+            uint32_t face = adjacency[a];
+            if (emitted[face])
+                continue;
+
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                uint32_t vertex = indexList[face * 3 + j];
+                *output++ = (DstIndexType)vertex;
+                deadEndStack.push_back(vertex);
+                candidates.push_back(vertex);
+                liveTriangles[vertex]--;
+                if (timeStamp - cacheTime[vertex] > k)
+                    cacheTime[vertex] = timeStamp++;
+            }
+            emitted[face] = true;
+        }
+
+        // Choose the candidate that will still be in the cache after its own
+        // triangles are emitted, preferring the one that entered it earliest
+        uint32_t nextVertex = UINT32_MAX;
+        int bestPriority = -1;
+        for (uint32_t vertex : candidates)
+        {
+            if (liveTriangles[vertex] == 0)
+                continue;
+
+            int priority = 0;
+            if (timeStamp - cacheTime[vertex] + 2 * liveTriangles[vertex] <= k)
+                priority = (int)(timeStamp - cacheTime[vertex]);
+
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                nextVertex = vertex;
+            }
+        }
+
+        if (nextVertex == UINT32_MAX)
+            nextVertex = SkipDeadEnd(liveTriangles.data(), deadEndStack, indexList, indexCount, cursor);
+
+        fanningVertex = nextVertex;
+    }
+
+    ASSERT(output == newIndexList + indexCount);
+}
+
+//-----------------------------------------------------------------------------
+//  The overdraw pass from the same paper, simplified to its "hard" cluster
+//  boundaries.  Triangles that made every one of their vertices miss the
+//  cache start a new cluster, so reordering the clusters doesn't change the
+//  cache behavior much.  The clusters that face away from the center of the
+//  mesh are the most likely to occlude the others, so they are drawn first.
+//-----------------------------------------------------------------------------
+
+template <typename IndexType>
+void OptimizeOverdraw(IndexType* indexList, size_t indexCount, const float* positions, size_t vertexCount,
+    size_t cacheSize)
+{
+    using namespace DirectX;
+
+    ASSERT(indexCount % 3 == 0);
+    const size_t faceCount = indexCount / 3;
+    if (faceCount == 0)
+        return;
+
+    // Split the triangles into clusters where the simulated FIFO cache misses on all three vertices
+    std::vector<uint32_t> clusterStart;
+    {
+        std::vector<uint32_t> cacheTime(vertexCount, 0);
+        uint32_t timeStamp = (uint32_t)cacheSize + 1;
+
+        for (uint32_t face = 0; face < faceCount; ++face)
+        {
+            uint32_t misses = 0;
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                uint32_t vertex = indexList[face * 3 + j];
+                ASSERT(vertex < vertexCount);
+                if (timeStamp - cacheTime[vertex] > cacheSize)
+                {
+                    cacheTime[vertex] = timeStamp++;
+                    ++misses;
+                }
+            }
+            if (misses == 3 || face == 0)
+                clusterStart.push_back(face);
+        }
+    }
+
+    if (clusterStart.size() == 1)
+        return;
+
+    const uint32_t clusterCount = (uint32_t)clusterStart.size();
+    clusterStart.push_back((uint32_t)faceCount);
+
+    auto Position = [positions](uint32_t vertex) { return XMLoadFloat3((const XMFLOAT3*)positions + vertex); };
+
+    // Area weighted centroid and normal of each cluster, and of the whole mesh
+    std::vector<XMFLOAT3> clusterCentroid(clusterCount);
+    std::vector<XMFLOAT3> clusterNormal(clusterCount);
+    XMVECTOR meshCentroid = XMVectorZero();
+    float meshArea = 0.0f;
+
+    for (uint32_t c = 0; c < clusterCount; ++c)
+    {
+        XMVECTOR centroid = XMVectorZero();
+        XMVECTOR normal = XMVectorZero();
+        float area = 0.0f;
+
+        for (uint32_t face = clusterStart[c]; face < clusterStart[c + 1]; ++face)
+        {
+            XMVECTOR p0 = Position(indexList[face * 3 + 0]);
+            XMVECTOR p1 = Position(indexList[face * 3 + 1]);
+            XMVECTOR p2 = Position(indexList[face * 3 + 2]);
+
+            // The cross product's length is twice the area of the triangle
+            XMVECTOR n = XMVector3Cross(p1 - p0, p2 - p0);
+            float faceArea = XMVectorGetX(XMVector3Length(n));
+
+            centroid += (p0 + p1 + p2) * (faceArea / 3.0f);
+            normal += n;
+            area += faceArea;
+        }
+
+        meshCentroid += centroid;
+        meshArea += area;
+
+        XMStoreFloat3(&clusterCentroid[c], area > 0.0f ? centroid / area : Position(indexList[clusterStart[c] * 3]));
+        XMStoreFloat3(&clusterNormal[c], XMVector3Normalize(normal));
+    }
+
+    if (meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    std::vector<float> clusterSortKey(clusterCount);
+    for (uint32_t c = 0; c < clusterCount; ++c)
+    {
+        XMVECTOR toCluster = XMLoadFloat3(&clusterCentroid[c]) - meshCentroid;
+        clusterSortKey[c] = XMVectorGetX(XMVector3Dot(toCluster, XMLoadFloat3(&clusterNormal[c])));
+    }
+
+    std::vector<uint32_t> clusterOrder(clusterCount);
+    std::iota(clusterOrder.begin(), clusterOrder.end(), 0);
+    std::stable_sort(clusterOrder.begin(), clusterOrder.end(),
+        [&](uint32_t a, uint32_t b) { return clusterSortKey[a] > clusterSortKey[b]; });
+
+    std::vector<IndexType> sortedIndices;
+    sortedIndices.reserve(indexCount);
+    for (uint32_t c : clusterOrder)
+    {
+        sortedIndices.insert(sortedIndices.end(),
+            indexList + clusterStart[c] * 3, indexList + clusterStart[c + 1] * 3);
+    }
+
+    std::copy(sortedIndices.begin(), sortedIndices.end(), indexList);
+}
@@ -0,0 +1,431 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "InstanceBatch.h"
+#include "Model.h"
+#include "ConstantBuffers.h"
+#include "../Core/BitonicSort.h"
+#include "../Core/CommandSignature.h"
+#include "../Core/EngineProfiling.h"
+#include "../Core/PipelineState.h"
+#include "../Core/RootSignature.h"
+
+#include "CompiledShaders/CullInstancesCS.h"
+#include "CompiledShaders/WriteSortedDrawsCS.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+using namespace Math;
+using namespace Graphics;
+using namespace Renderer;
+
+namespace
+{
+    enum CullRootBindings
+    {
+        kCullConstants,
+        kCullDraws,
+        kCullData,
+        kCullSphereTransforms,
+        kCullCulledDraws,
+        kCullDrawCounts,
+        kCullSortList,
+
+        kNumCullRootBindings
+    };
+
+    // Sorts each view's visible draws front to back within their groups on the
+    // GPU, as MeshSorter does on the CPU for the meshes it draws
+    BoolVar SortDraws("Renderer/Sort GPU-Driven Draws", true);
+
+    RootSignature s_CullRootSig;
+    ComputePSO s_CullPSO(L"Cull Instances CS");
+    ComputePSO s_WriteSortedDrawsPSO(L"Write Sorted Draws CS");
+
+    // Sets the mesh and material constants, the vertex and index buffers,
+    // then draws.  This matches the layout of IndirectDraw.
+    CommandSignature s_DrawSignature(5);
+
+#pragma pack(push, 4)
+    struct IndirectDraw
+    {
+        D3D12_GPU_VIRTUAL_ADDRESS meshCBV;
+        D3D12_GPU_VIRTUAL_ADDRESS materialCBV;
+        D3D12_VERTEX_BUFFER_VIEW vertexBuffer;
+        D3D12_INDEX_BUFFER_VIEW indexBuffer;
+        D3D12_DRAW_INDEXED_ARGUMENTS draw;
+    };
+#pragma pack(pop)
+
+    static_assert(sizeof(IndirectDraw) == 68, "IndirectDraw doesn't match CullInstancesCS");
+
+    struct CullData
+    {
+        XMFLOAT4 sphere;        // Object space bounding sphere
+        uint32_t transformIdx;  // Index of the node's sphere transform
+        uint32_t groupIdx;
+        uint32_t firstDraw;     // The group's first draw
+        uint32_t pad;
+    };
+
+    __declspec(align(16)) struct CullConstants
+    {
+        Vector4 frustumPlanes[6];
+        uint32_t numDraws;
+        uint32_t numGroups;
+        uint32_t sortDraws;
+        uint32_t pad;
+        Vector3 viewerPos;
+        Vector3 viewerForward;
+    };
+
+    // The sort keys hold the group index in their upper 16 bits
+    const size_t kMaxSortedGroups = 1 << 16;
+
+    // The draw counts are followed by the length of the sort list, and are
+    // 16 byte aligned, for FillBuffer
+    uint32_t GetCountsSize(size_t numGroups)
+    {
+        return (uint32_t)AlignUp((numGroups + 1) * sizeof(uint32_t), 16);
+    }
+}
+
+void InstanceBatch::InitializeResources(void)
+{
+    s_CullRootSig.Reset(kNumCullRootBindings, 0);
+    s_CullRootSig[kCullConstants].InitAsConstantBuffer(0);
+    s_CullRootSig[kCullDraws].InitAsBufferSRV(0);
+    s_CullRootSig[kCullData].InitAsBufferSRV(1);
+    s_CullRootSig[kCullSphereTransforms].InitAsBufferSRV(2);
+    s_CullRootSig[kCullCulledDraws].InitAsBufferUAV(0);
+    s_CullRootSig[kCullDrawCounts].InitAsBufferUAV(1);
+    s_CullRootSig[kCullSortList].InitAsBufferUAV(2);
+    s_CullRootSig.Finalize(L"CullInstancesRS");
+
+    s_CullPSO.SetRootSignature(s_CullRootSig);
+    s_CullPSO.SetComputeShader(g_pCullInstancesCS, sizeof(g_pCullInstancesCS));
+    s_CullPSO.Finalize();
+
+    s_WriteSortedDrawsPSO.SetRootSignature(s_CullRootSig);
+    s_WriteSortedDrawsPSO.SetComputeShader(g_pWriteSortedDrawsCS, sizeof(g_pWriteSortedDrawsCS));
+    s_WriteSortedDrawsPSO.Finalize();
+
+    s_DrawSignature[0].ConstantBufferView(kMeshConstants);
+    s_DrawSignature[1].ConstantBufferView(kMaterialConstants);
+    s_DrawSignature[2].VertexBufferView(0);
+    s_DrawSignature[3].IndexBufferView();
+    s_DrawSignature[4].DrawIndexed();
+    s_DrawSignature.Finalize(&m_RootSig);
+}
+
+void InstanceBatch::Shutdown(void)
+{
+    s_DrawSignature.Destroy();
+}
+
+bool InstanceBatch::CanBatch(const ModelInstance& instance)
+{
+    const Model* model = instance.GetModel();
+    if (model == nullptr)
+        return false;
+
+    const uint8_t* pMesh = model->m_MeshData;
+    for (uint32_t i = 0; i < model->m_NumMeshes; ++i)
+    {
+        const Mesh& mesh = *(const Mesh*)pMesh;
+
+        // Skinned meshes need their joints set for each draw, and transparent
+        // ones need to be sorted
+        if (mesh.numJoints > 0 || (mesh.psoFlags & (PSOFlags::kHasSkin | PSOFlags::kAlphaBlend)) != 0)
+            return false;
+
+        pMesh += sizeof(Mesh) + (mesh.numDraws - 1) * sizeof(Mesh::Draw);
+    }
+    return true;
+}
+
+void InstanceBatch::Create(const std::vector<const ModelInstance*>& instances)
+{
+    Destroy();
+
+    struct BatchedDraw
+    {
+        uint32_t groupIdx;
+        IndirectDraw depth;
+        IndirectDraw color;
+        CullData cull;
+    };
+
+    std::vector<BatchedDraw> draws;
+    std::map<uint64_t, uint32_t> groupIndices;
+
+    m_Instances = instances;
+    m_FirstTransform.reserve(instances.size());
+
+    for (const ModelInstance* instance : instances)
+    {
+        ASSERT(CanBatch(*instance));
+        const Model& model = *instance->GetModel();
+
+        m_FirstTransform.push_back(m_NumTransforms);
+
+        const uint8_t* pMesh = model.m_MeshData;
+        for (uint32_t i = 0; i < model.m_NumMeshes; ++i)
+        {
+            const Mesh& mesh = *(const Mesh*)pMesh;
+
+            // Meshes that can be drawn with the same PSOs and descriptor
+            // tables are in the same group
+            uint8_t depthPSO = GetDepthPSO(mesh.psoFlags, false);
+            uint64_t key = (uint64_t)mesh.pso << 48 | (uint64_t)mesh.srvTable << 32 |
+                           (uint64_t)mesh.samplerTable << 16 | depthPSO;
+
+            auto [it, inserted] = groupIndices.try_emplace(key, (uint32_t)m_Groups.size());
+            if (inserted)
+            {
+                Group group{};
+                group.srvTable = mesh.srvTable;
+                group.samplerTable = mesh.samplerTable;
+                group.pso = mesh.pso;
+                group.depthPSO = depthPSO;
+                group.shadowPSO = GetDepthPSO(mesh.psoFlags, true);
+                group.alphaTest = (mesh.psoFlags & PSOFlags::kAlphaTest) != 0;
+                m_Groups.push_back(group);
+            }
+
+            BatchedDraw draw{};
+            draw.groupIdx = it->second;
+            draw.depth.meshCBV = instance->GetMeshConstants() + sizeof(MeshConstants) * mesh.meshCBV;
+            draw.depth.materialCBV = model.m_MaterialConstants + sizeof(MaterialConstants) * mesh.materialCBV;
+            draw.depth.indexBuffer = {model.m_DataBuffer + mesh.ibOffset, mesh.ibSize, (DXGI_FORMAT)mesh.ibFormat};
+            draw.depth.draw.InstanceCount = 1;
+            draw.color = draw.depth;
+            draw.depth.vertexBuffer =
+                {model.m_DataBuffer + mesh.vbDepthOffset, mesh.vbDepthSize, GetDepthVertexStride(mesh)};
+            draw.color.vertexBuffer = {model.m_DataBuffer + mesh.vbOffset, mesh.vbSize, mesh.vbStride};
+            draw.cull.sphere = XMFLOAT4(mesh.bounds);
+            draw.cull.transformIdx = m_NumTransforms + mesh.meshCBV;
+
+            for (uint32_t j = 0; j < mesh.numDraws; ++j)
+            {
+                draw.depth.draw.IndexCountPerInstance = mesh.draw[j].primCount;
+                draw.depth.draw.StartIndexLocation = mesh.draw[j].startIndex;
+                draw.depth.draw.BaseVertexLocation = (INT)mesh.draw[j].baseVertex;
+                draw.color.draw = draw.depth.draw;
+                draws.push_back(draw);
+            }
+
+            pMesh += sizeof(Mesh) + (mesh.numDraws - 1) * sizeof(Mesh::Draw);
+        }
+
+        m_NumTransforms += model.m_NumNodes;
+    }
+
+    if (draws.empty())
+    {
+        Destroy();
+        return;
+    }
+
+    // Each group's draws are together, so that the culled draws for a group
+    // can be written to its own range
+    std::stable_sort(draws.begin(), draws.end(),
+        [](const BatchedDraw& a, const BatchedDraw& b) { return a.groupIdx < b.groupIdx; });
+
+    std::vector<IndirectDraw> depthDraws(draws.size());
+    std::vector<IndirectDraw> colorDraws(draws.size());
+    std::vector<CullData> cullData(draws.size());
+
+    for (uint32_t i = 0; i < (uint32_t)draws.size(); ++i)
+    {
+        Group& group = m_Groups[draws[i].groupIdx];
+        if (group.numDraws++ == 0)
+            group.firstDraw = i;
+
+        depthDraws[i] = draws[i].depth;
+        colorDraws[i] = draws[i].color;
+        cullData[i] = draws[i].cull;
+        cullData[i].groupIdx = draws[i].groupIdx;
+        cullData[i].firstDraw = group.firstDraw;
+    }
+
+    m_NumDraws = (uint32_t)draws.size();
+
+    m_DepthDraws.Create(L"Instance Batch Depth Draws", m_NumDraws, sizeof(IndirectDraw), depthDraws.data());
+    m_ColorDraws.Create(L"Instance Batch Color Draws", m_NumDraws, sizeof(IndirectDraw), colorDraws.data());
+    m_CullData.Create(L"Instance Batch Cull Data", m_NumDraws, sizeof(CullData), cullData.data());
+
+    // Each view has its own buffers, so the shadow view can be culled on
+    // another context while the main view is
+    for (uint32_t i = 0; i < kNumViews; ++i)
+    {
+        m_CulledDraws[i].Create(L"Instance Batch Culled Draws", m_NumDraws, sizeof(IndirectDraw));
+        m_DrawCounts[i].Create(L"Instance Batch Draw Counts", GetCountsSize(m_Groups.size()) / 4, 4);
+        m_SortList[i].Create(L"Instance Batch Sort List", m_NumDraws, sizeof(uint64_t));
+        BitonicSort::CreateDispatchArgs(m_SortDispatchArgs[i], L"Instance Batch Sort Dispatch Args");
+    }
+}
+
+void InstanceBatch::Destroy(void)
+{
+    m_Instances.clear();
+    m_FirstTransform.clear();
+    m_NumTransforms = 0;
+    m_NumDraws = 0;
+    m_Groups.clear();
+    m_CullData.Destroy();
+    m_DepthDraws.Destroy();
+    m_ColorDraws.Destroy();
+    for (uint32_t i = 0; i < kNumViews; ++i)
+    {
+        m_CulledDraws[i].Destroy();
+        m_DrawCounts[i].Destroy();
+        m_SortList[i].Destroy();
+        m_SortDispatchArgs[i].Destroy();
+    }
+}
+
+void InstanceBatch::Cull(MeshSorter::BatchType type, const BaseCamera& camera, GraphicsContext& gfxContext)
+{
+    if (IsEmpty())
+        return;
+
+    ScopedTimer _prof(L"Cull Instances", gfxContext);
+
+    ComputeContext& context = gfxContext.GetComputeContext();
+
+    // The instances were updated this frame, so gather their bounding sphere
+    // transforms.  Each instance's are already contiguous.  They're gathered
+    // straight into upload memory, since sorting replaces the root signature
+    // between views and they have to be bound again.
+    DynAlloc sphereTransforms = context.ReserveUploadMemory(m_NumTransforms * sizeof(ScaleAndTranslation));
+    for (size_t i = 0; i < m_Instances.size(); ++i)
+    {
+        std::memcpy((ScaleAndTranslation*)sphereTransforms.DataPtr + m_FirstTransform[i],
+            m_Instances[i]->GetBoundingSphereTransforms(),
+            m_Instances[i]->GetModel()->m_NumNodes * sizeof(ScaleAndTranslation));
+    }
+
+    if (type == MeshSorter::kShadows)
+    {
+        CullView(kShadowDepth, camera, sphereTransforms.GpuAddress, context);
+    }
+    else
+    {
+        CullView(kMainDepth, camera, sphereTransforms.GpuAddress, context);
+        CullView(kMainColor, camera, sphereTransforms.GpuAddress, context);
+    }
+}
+
+void InstanceBatch::CullView(View view, const BaseCamera& camera, D3D12_GPU_VIRTUAL_ADDRESS sphereTransforms,
+    ComputeContext& context)
+{
+    const bool sortDraws = SortDraws && m_Groups.size() <= kMaxSortedGroups;
+
+    context.FillBuffer(m_DrawCounts[view], 0, 0u, GetCountsSize(m_Groups.size()));
+
+    context.TransitionResource(m_DrawCounts[view], D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    context.TransitionResource(m_SortList[view], D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    context.TransitionResource(m_CulledDraws[view], D3D12_RESOURCE_STATE_UNORDERED_ACCESS, true);
+
+    CullConstants constants;
+    const Frustum& frustum = camera.GetWorldSpaceFrustum();
+    for (int i = 0; i < 6; ++i)
+        constants.frustumPlanes[i] = Vector4(frustum.GetFrustumPlane((Frustum::PlaneID)i));
+    constants.numDraws = m_NumDraws;
+    constants.numGroups = (uint32_t)m_Groups.size();
+    constants.sortDraws = sortDraws;
+    constants.viewerPos = camera.GetPosition();
+    constants.viewerForward = camera.GetForwardVec();
+
+    context.SetRootSignature(s_CullRootSig);
+    context.SetPipelineState(s_CullPSO);
+    context.GetCommandList()->SetComputeRootShaderResourceView(kCullSphereTransforms, sphereTransforms);
+    context.SetBufferSRV(kCullData, m_CullData);
+    context.SetDynamicConstantBufferView(kCullConstants, sizeof(constants), &constants);
+    context.SetBufferSRV(kCullDraws, view == kMainColor ? m_ColorDraws : m_DepthDraws);
+    context.SetBufferUAV(kCullCulledDraws, m_CulledDraws[view]);
+    context.SetBufferUAV(kCullDrawCounts, m_DrawCounts[view]);
+    context.SetBufferUAV(kCullSortList, m_SortList[view]);
+    context.Dispatch1D(m_NumDraws, 64);
+
+    if (sortDraws)
+    {
+        // The sort list's length follows the draw counts
+        const uint32_t listCountOffset = (uint32_t)m_Groups.size() * sizeof(uint32_t);
+        BitonicSort::Sort(context, m_SortList[view], m_DrawCounts[view], listCountOffset, false, true,
+            &m_SortDispatchArgs[view]);
+
+        context.TransitionResource(m_DrawCounts[view], D3D12_RESOURCE_STATE_UNORDERED_ACCESS, true);
+
+        // Only as many threads as there are visible draws do anything
+        context.SetRootSignature(s_CullRootSig);
+        context.SetPipelineState(s_WriteSortedDrawsPSO);
+        context.SetBufferSRV(kCullData, m_CullData);
+        context.SetDynamicConstantBufferView(kCullConstants, sizeof(constants), &constants);
+        context.SetBufferSRV(kCullDraws, view == kMainColor ? m_ColorDraws : m_DepthDraws);
+        context.SetBufferUAV(kCullCulledDraws, m_CulledDraws[view]);
+        context.SetBufferUAV(kCullDrawCounts, m_DrawCounts[view]);
+        context.SetBufferUAV(kCullSortList, m_SortList[view]);
+        context.Dispatch1D(m_NumDraws, 64);
+    }
+
+    context.TransitionResource(m_CulledDraws[view], D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    context.TransitionResource(m_DrawCounts[view], D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+}
+
+bool InstanceBatch::HasDraws(MeshSorter::BatchType type, MeshSorter::DrawPass pass) const
+{
+    if (IsEmpty() || pass == MeshSorter::kTransparent)
+        return false;
+
+    // Without a separate Z pass only the alpha tested meshes have one
+    if (type == MeshSorter::kDefault && pass == MeshSorter::kZPass && !SeparateZPass)
+        return std::any_of(m_Groups.begin(), m_Groups.end(), [](const Group& group) { return group.alphaTest; });
+
+    return true;
+}
+
+void InstanceBatch::Render(MeshSorter::BatchType type, MeshSorter::DrawPass pass, GraphicsContext& context)
+{
+    ASSERT(HasDraws(type, pass));
+
+    View view = type == MeshSorter::kShadows ? kShadowDepth : pass == MeshSorter::kZPass ? kMainDepth : kMainColor;
+
+    for (uint32_t i = 0; i < (uint32_t)m_Groups.size(); ++i)
+    {
+        const Group& group = m_Groups[i];
+
+        // These match the PSOs MeshSorter::AddMesh chooses
+        uint32_t pso;
+        if (view == kShadowDepth)
+        {
+            pso = group.shadowPSO;
+        }
+        else if (view == kMainDepth)
+        {
+            if (!SeparateZPass && !group.alphaTest)
+                continue;
+            pso = group.depthPSO;
+        }
+        else
+        {
+            pso = (SeparateZPass || group.alphaTest) ? group.pso + 1 : group.pso;
+        }
+
+        pso = GetDrawPSO(pso);
+        SetMaterialTextures(context, pso, group.srvTable, group.samplerTable);
+        context.SetPipelineState(sm_PSOs[pso]);
+
+        context.ExecuteIndirect(s_DrawSignature, m_CulledDraws[view], group.firstDraw * sizeof(IndirectDraw),
+            group.numDraws, &m_DrawCounts[view], i * sizeof(uint32_t));
+    }
+}
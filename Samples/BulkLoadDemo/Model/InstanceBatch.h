@@ -0,0 +1,96 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include "Renderer.h"
+#include "../Core/GpuBuffer.h"
+#include "../Core/Math/Transform.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class ModelInstance;
+
+namespace Renderer
+{
+    //
+    // Draws a fixed set of model instances with ExecuteIndirect.  The draw
+    // arguments for every mesh are built once, when the batch is created, and
+    // each view culls them against its frustum with a compute shader, so the
+    // CPU cost per frame doesn't depend on how many meshes there are.  The
+    // visible draws of each group are then sorted front to back with
+    // BitonicSort, so the GPU orders them the way MeshSorter would.
+    //
+    // The indirect draws can't change descriptor tables, so they are grouped
+    // by PSO and material tables, with one ExecuteIndirect per group.  Only
+    // unskinned instances without transparent meshes can be batched; the rest
+    // still go through MeshSorter.
+    //
+    // The instances must not move, or be destroyed, while they are in the batch.
+    //
+    class InstanceBatch
+    {
+    public:
+        static void InitializeResources(void);
+        static void Shutdown(void);
+
+        static bool CanBatch(const ModelInstance& instance);
+
+        void Create(const std::vector<const ModelInstance*>& instances);
+        void Destroy(void);
+
+        bool IsEmpty(void) const { return m_Groups.empty(); }
+
+        // Culls the batch for the sorter's view.  MeshSorter calls this before
+        // it draws its first pass.
+        void Cull(MeshSorter::BatchType type, const BaseCamera& camera, GraphicsContext& context);
+
+        bool HasDraws(MeshSorter::BatchType type, MeshSorter::DrawPass pass) const;
+
+        // Draws the culled batch.  The render targets and common root
+        // parameters must already be set for the pass.
+        void Render(MeshSorter::BatchType type, MeshSorter::DrawPass pass, GraphicsContext& context);
+
+    private:
+        // The culled draws for the main view's depth and color passes, and
+        // for the shadow view.
+        enum View { kMainDepth, kMainColor, kShadowDepth, kNumViews };
+
+        struct Group
+        {
+            uint32_t firstDraw;
+            uint32_t numDraws;
+            uint16_t srvTable;
+            uint16_t samplerTable;
+            uint16_t pso;
+            uint8_t depthPSO;
+            uint8_t shadowPSO;
+            bool alphaTest;
+        };
+
+        void CullView(View view, const BaseCamera& camera, D3D12_GPU_VIRTUAL_ADDRESS sphereTransforms,
+            ComputeContext& context);
+
+        std::vector<const ModelInstance*> m_Instances;
+        std::vector<uint32_t> m_FirstTransform;    // Per instance
+        uint32_t m_NumTransforms = 0;
+        uint32_t m_NumDraws = 0;
+
+        std::vector<Group> m_Groups;
+        StructuredBuffer m_CullData;
+        ByteAddressBuffer m_DepthDraws;
+        ByteAddressBuffer m_ColorDraws;
+        ByteAddressBuffer m_CulledDraws[kNumViews];
+        ByteAddressBuffer m_DrawCounts[kNumViews];  // Groups + sort list length
+        ByteAddressBuffer m_SortList[kNumViews];    // Key/draw index pairs for BitonicSort
+        IndirectArgsBuffer m_SortDispatchArgs[kNumViews];
+    };
+
+} // namespace Renderer
@@ -0,0 +1,197 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#include "MeshConstantsPool.h"
+#include "ConstantBuffers.h"
+#include "../Core/CommandContext.h"
+#include "../Core/CommandListManager.h"
+#include "../Core/GpuBuffer.h"
+#include "../Core/GraphicsCore.h"
+#include "../Core/UploadBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+using namespace Graphics;
+
+namespace
+{
+    ByteAddressBuffer s_GpuConstants;
+    UploadBuffer s_UploadRing;                  // kNumFrames slots of s_MaxNodes
+    MeshConstants* s_UploadData = nullptr;      // Mapped for the lifetime of the pool
+    uint32_t s_MaxNodes = 0;
+
+    uint32_t s_Slot = 0;
+    uint64_t s_SlotFences[MeshConstantsPool::kNumFrames] = {};
+
+    // The range of nodes written to the current slot
+    uint32_t s_DirtyBegin = UINT32_MAX;
+    uint32_t s_DirtyEnd = 0;
+
+    // Free ranges of nodes, first node -> count
+    std::mutex s_FreeMutex;
+    std::map<uint32_t, uint32_t> s_FreeRanges;
+}
+
+void MeshConstantsPool::Initialize(uint32_t maxNodes)
+{
+    static_assert(sizeof(MeshConstants) == 256, "The ring is indexed by node");
+
+    s_MaxNodes = maxNodes;
+    s_GpuConstants.Create(L"Mesh Constants Pool", maxNodes, sizeof(MeshConstants));
+    s_UploadRing.Create(L"Mesh Constants Upload Ring", kNumFrames * maxNodes * sizeof(MeshConstants));
+    s_UploadData = (MeshConstants*)s_UploadRing.Map();
+
+    s_Slot = 0;
+    std::fill(std::begin(s_SlotFences), std::end(s_SlotFences), 0);
+    s_DirtyBegin = UINT32_MAX;
+    s_DirtyEnd = 0;
+
+    s_FreeRanges.clear();
+    s_FreeRanges[0] = maxNodes;
+}
+
+void MeshConstantsPool::Shutdown(void)
+{
+    if (s_UploadData != nullptr)
+    {
+        s_UploadRing.Unmap();
+        s_UploadData = nullptr;
+    }
+    s_UploadRing.Destroy();
+    s_GpuConstants.Destroy();
+    s_FreeRanges.clear();
+    s_MaxNodes = 0;
+}
+
+void MeshConstantsPool::Commit(void)
+{
+    if (s_DirtyBegin < s_DirtyEnd)
+    {
+        const size_t slotOffset = (size_t)s_Slot * s_MaxNodes * sizeof(MeshConstants);
+        const size_t begin = (size_t)s_DirtyBegin * sizeof(MeshConstants);
+        const size_t size = (size_t)(s_DirtyEnd - s_DirtyBegin) * sizeof(MeshConstants);
+
+        GraphicsContext& gfxContext = GraphicsContext::Begin(L"Commit Mesh Constants");
+        gfxContext.TransitionResource(s_GpuConstants, D3D12_RESOURCE_STATE_COPY_DEST, true);
+        gfxContext.GetCommandList()->CopyBufferRegion(
+            s_GpuConstants.GetResource(), begin, s_UploadRing.GetResource(), slotOffset + begin, size);
+        gfxContext.TransitionResource(s_GpuConstants, D3D12_RESOURCE_STATE_GENERIC_READ, true);
+        s_SlotFences[s_Slot] = gfxContext.Finish();
+
+        s_DirtyBegin = UINT32_MAX;
+        s_DirtyEnd = 0;
+    }
+
+    // Only an instance that changed writes in the frame, so it's very rare
+    // for the GPU to still be copying from the next slot
+    s_Slot = (s_Slot + 1) % kNumFrames;
+    g_CommandManager.WaitForFence(s_SlotFences[s_Slot]);
+}
+
+MeshConstantsPool::Allocation::Allocation(Allocation&& other)
+    : m_FirstNode(other.m_FirstNode), m_NumNodes(other.m_NumNodes), m_WrittenSlots(other.m_WrittenSlots)
+{
+    other.m_NumNodes = 0;
+}
+
+MeshConstantsPool::Allocation& MeshConstantsPool::Allocation::operator=(Allocation&& other)
+{
+    if (this != &other)
+    {
+        Destroy();
+        m_FirstNode = other.m_FirstNode;
+        m_NumNodes = other.m_NumNodes;
+        m_WrittenSlots = other.m_WrittenSlots;
+        other.m_NumNodes = 0;
+    }
+    return *this;
+}
+
+bool MeshConstantsPool::Allocation::Create(uint32_t numNodes)
+{
+    Destroy();
+
+    if (numNodes == 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(s_FreeMutex);
+
+    // First fit, which keeps the live instances packed at the front of the
+    // pool and the range that Commit copies short
+    for (auto it = s_FreeRanges.begin(); it != s_FreeRanges.end(); ++it)
+    {
+        if (it->second < numNodes)
+            continue;
+
+        m_FirstNode = it->first;
+        m_NumNodes = numNodes;
+        m_WrittenSlots = 0;
+
+        if (it->second > numNodes)
+            s_FreeRanges[it->first + numNodes] = it->second - numNodes;
+        s_FreeRanges.erase(it);
+        return true;
+    }
+
+    return false;
+}
+
+void MeshConstantsPool::Allocation::Destroy(void)
+{
+    if (m_NumNodes == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(s_FreeMutex);
+
+    uint32_t first = m_FirstNode;
+    uint32_t count = m_NumNodes;
+
+    // Merge with the free ranges on either side
+    auto next = s_FreeRanges.lower_bound(first);
+    if (next != s_FreeRanges.end() && first + count == next->first)
+    {
+        count += next->second;
+        next = s_FreeRanges.erase(next);
+    }
+    if (next != s_FreeRanges.begin())
+    {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == first)
+        {
+            first = prev->first;
+            count += prev->second;
+            s_FreeRanges.erase(prev);
+        }
+    }
+    s_FreeRanges[first] = count;
+
+    m_NumNodes = 0;
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS MeshConstantsPool::Allocation::GetGpuVirtualAddress(void) const
+{
+    return s_GpuConstants.GetGpuVirtualAddress() + (size_t)m_FirstNode * sizeof(MeshConstants);
+}
+
+void MeshConstantsPool::Allocation::Write(const MeshConstants* constants)
+{
+    const uint32_t slotBit = 1u << s_Slot;
+    if (m_WrittenSlots & slotBit)
+        return;
+
+    MeshConstants* dest = s_UploadData + (size_t)s_Slot * s_MaxNodes + m_FirstNode;
+    std::memcpy(dest, constants, m_NumNodes * sizeof(MeshConstants));
+    m_WrittenSlots |= slotBit;
+
+    s_DirtyBegin = std::min(s_DirtyBegin, m_FirstNode);
+    s_DirtyEnd = std::max(s_DirtyEnd, m_FirstNode + m_NumNodes);
+}
@@ -0,0 +1,70 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+
+#pragma once
+
+#include "../Core/pch.h"
+#include <cstdint>
+
+struct MeshConstants;
+
+//
+// The mesh constants and skinning joints of model instances, kept in one GPU
+// buffer.  Each slot of the persistently mapped upload ring mirrors the whole
+// buffer, so Commit can copy everything written in a frame with one
+// CopyBufferRegion.
+//
+// For that to be safe every slot must hold the latest constants of every
+// instance in the range being copied, so an instance writes its constants once
+// into each slot after they change.  After that a static instance costs
+// nothing until it changes again.
+//
+namespace MeshConstantsPool
+{
+    static const uint32_t kNumFrames = 3;
+
+    void Initialize(uint32_t maxNodes);
+    void Shutdown(void);
+
+    // Copies this frame's writes to the GPU buffer, then moves on to the next
+    // slot of the ring.  Call it once per frame, after the instances are
+    // updated and before they are drawn.
+    void Commit(void);
+
+    class Allocation
+    {
+    public:
+        Allocation() {}
+        ~Allocation() { Destroy(); }
+        Allocation(Allocation&& other);
+        Allocation& operator=(Allocation&& other);
+
+        Allocation(const Allocation&) = delete;
+        Allocation& operator=(const Allocation&) = delete;
+
+        // Returns false when the pool doesn't have room for the constants
+        bool Create(uint32_t numNodes);
+        void Destroy(void);
+
+        bool IsValid(void) const { return m_NumNodes != 0; }
+        D3D12_GPU_VIRTUAL_ADDRESS GetGpuVirtualAddress(void) const;
+
+        // The constants have changed, so every slot needs them again
+        void Invalidate(void) { m_WrittenSlots = 0; }
+
+        // Writes the constants to this frame's slot, unless it already has
+        // them.  This must be called every frame until each slot has them.
+        void Write(const MeshConstants* constants);
+
+    private:
+        uint32_t m_FirstNode = 0;
+        uint32_t m_NumNodes = 0;
+        uint32_t m_WrittenSlots = 0;    // One bit per slot
+    };
+}
@@ -70,7 +70,21 @@ static DXGI_FORMAT AccessorFormat(const Accessor& accessor)
     }
 }
 
-void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim, const Math::Matrix4& localToObject )
+// The simulated FIFO cache for Tipsify and the overdraw pass
+static const size_t kTipsifyCacheSize = 16;
+
+template <typename SrcIndexType, typename DstIndexType>
+static void OptimizeIndices(const SrcIndexType* indexList, size_t indexCount, uint32_t maxIndex,
+    DstIndexType* newIndexList, Renderer::IndexOrder indexOrder)
+{
+    if (indexOrder == Renderer::IndexOrder::Forsyth)
+        OptimizeFaces(indexList, indexCount, newIndexList, 64);
+    else
+        OptimizeFacesTipsify(indexList, indexCount, maxIndex + 1, newIndexList, kTipsifyCacheSize);
+}
+
+void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim, const Math::Matrix4& localToObject,
+    Renderer::IndexOrder indexOrder )
 {
     ASSERT(inPrim.attributes[0] != nullptr, "Must have POSITION");
     uint32_t vertexCount = inPrim.attributes[0]->count;
@@ -147,15 +161,18 @@ void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim,
         if (b32BitIndices)
         {
             ASSERT(inPrim.indices->componentType == Accessor::kUnsignedInt);
-            OptimizeFaces((uint32_t*)inPrim.indices->dataPtr, inPrim.indices->count, (uint32_t*)outPrim.IB->data(), 64);
+            OptimizeIndices((uint32_t*)inPrim.indices->dataPtr, inPrim.indices->count, maxIndex,
+                (uint32_t*)outPrim.IB->data(), indexOrder);
         }
         else if (inPrim.indices->componentType == Accessor::kUnsignedShort)
         {
-            OptimizeFaces((uint16_t*)inPrim.indices->dataPtr, inPrim.indices->count, (uint16_t*)outPrim.IB->data(), 64);
+            OptimizeIndices((uint16_t*)inPrim.indices->dataPtr, inPrim.indices->count, maxIndex,
+                (uint16_t*)outPrim.IB->data(), indexOrder);
         }
         else
         {
-            OptimizeFaces((uint32_t*)inPrim.indices->dataPtr, inPrim.indices->count, (uint16_t*)outPrim.IB->data(), 64);
+            OptimizeIndices((uint32_t*)inPrim.indices->dataPtr, inPrim.indices->count, maxIndex,
+                (uint16_t*)outPrim.IB->data(), indexOrder);
         }
         indices = outPrim.IB->data();
     }
@@ -256,6 +273,16 @@ void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim,
         ASSERT(outPrim.m_BoundsOS.GetRadius() > 0.0f);
     }
 
+    // Sorting the triangles for overdraw needs their positions, so it's done
+    // after the vertex cache optimization
+    if (indexOrder == Renderer::IndexOrder::TipsifyOverdraw && inPrim.indices != nullptr)
+    {
+        if (b32BitIndices)
+            OptimizeOverdraw((uint32_t*)indices, indexCount, (const float*)position.get(), vertexCount, kTipsifyCacheSize);
+        else
+            OptimizeOverdraw((uint16_t*)indices, indexCount, (const float*)position.get(), vertexCount, kTipsifyCacheSize);
+    }
+
     if (HasNormals)
     {
         ASSERT_SUCCEEDED(vbr.Read(normal.get(), "NORMAL", 0, vertexCount));
@@ -439,3 +466,107 @@ void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim,
     // TODO:  Generate optimized depth-only streams
 }
 
+template <typename IndexType>
+static HRESULT ComputeDrawMeshlets(const IndexType* indices, size_t numFaces, const XMFLOAT3* positions,
+    size_t numVertices, std::vector<Meshlet>& meshlets, std::vector<uint8_t>& uniqueVertexIB,
+    std::vector<MeshletTriangle>& primitives, std::vector<CullData>& cullData)
+{
+    HRESULT hr = ComputeMeshlets(indices, numFaces, positions, numVertices, nullptr,
+        meshlets, uniqueVertexIB, primitives, kMeshletMaxVertices, kMeshletMaxPrimitives);
+    if (FAILED(hr))
+        return hr;
+
+    cullData.resize(meshlets.size());
+    return ComputeCullData(positions, numVertices, meshlets.data(), meshlets.size(),
+        (const IndexType*)uniqueVertexIB.data(), uniqueVertexIB.size() / sizeof(IndexType),
+        primitives.data(), primitives.size(), cullData.data());
+}
+
+template <typename T>
+static uint32_t AppendMeshletArray(std::vector<byte>& geometry, const std::vector<T>& data)
+{
+    geometry.resize(Math::AlignUp(geometry.size(), 16));
+    uint32_t offset = (uint32_t)geometry.size();
+    geometry.insert(geometry.end(), (const byte*)data.data(), (const byte*)(data.data() + data.size()));
+    return offset;
+}
+
+bool BuildMeshletMesh( const ::Mesh& mesh, std::vector<byte>& geometry, MeshletMesh& outMeshlets )
+{
+    std::vector<Meshlet> meshlets;
+    std::vector<CullData> cullData;
+    std::vector<uint32_t> vertexIndices;
+    std::vector<MeshletTriangle> primitives;
+
+    const bool index32 = mesh.ibFormat == DXGI_FORMAT_R32_UINT;
+    const uint32_t indexSize = index32 ? 4 : 2;
+
+    for (uint32_t d = 0; d < mesh.numDraws; ++d)
+    {
+        const ::Mesh::Draw& draw = mesh.draw[d];
+        const byte* indices = geometry.data() + mesh.ibOffset + draw.startIndex * indexSize;
+
+        // A draw's vertices start at its base vertex and end at its largest index
+        uint32_t numVertices = 0;
+        for (uint32_t i = 0; i < draw.primCount; ++i)
+        {
+            uint32_t index = index32 ? ((const uint32_t*)indices)[i] : ((const uint16_t*)indices)[i];
+            numVertices = std::max(numVertices, index + 1);
+        }
+
+        std::vector<XMFLOAT3> positions(numVertices);
+        const byte* vertices = geometry.data() + mesh.vbOffset + draw.baseVertex * mesh.vbStride;
+        for (uint32_t v = 0; v < numVertices; ++v)
+            std::memcpy(&positions[v], vertices + v * mesh.vbStride, sizeof(XMFLOAT3));
+
+        std::vector<Meshlet> drawMeshlets;
+        std::vector<uint8_t> uniqueVertexIB;
+        std::vector<MeshletTriangle> drawPrimitives;
+        std::vector<CullData> drawCullData;
+
+        HRESULT hr;
+        if (index32)
+        {
+            hr = ComputeDrawMeshlets((const uint32_t*)indices, draw.primCount / 3, positions.data(), numVertices,
+                drawMeshlets, uniqueVertexIB, drawPrimitives, drawCullData);
+        }
+        else
+        {
+            hr = ComputeDrawMeshlets((const uint16_t*)indices, draw.primCount / 3, positions.data(), numVertices,
+                drawMeshlets, uniqueVertexIB, drawPrimitives, drawCullData);
+        }
+        if (FAILED(hr))
+            return false;
+
+        // The meshlets of every draw share the mesh's arrays, and their vertex
+        // indices are made absolute so the mesh shader needs no base vertex.
+        for (Meshlet& meshlet : drawMeshlets)
+        {
+            meshlet.VertOffset += (uint32_t)vertexIndices.size();
+            meshlet.PrimOffset += (uint32_t)primitives.size();
+        }
+
+        const size_t numUniqueVertices = uniqueVertexIB.size() / indexSize;
+        for (size_t i = 0; i < numUniqueVertices; ++i)
+        {
+            uint32_t index = index32 ? ((const uint32_t*)uniqueVertexIB.data())[i] :
+                ((const uint16_t*)uniqueVertexIB.data())[i];
+            vertexIndices.push_back(index + draw.baseVertex);
+        }
+
+        meshlets.insert(meshlets.end(), drawMeshlets.begin(), drawMeshlets.end());
+        cullData.insert(cullData.end(), drawCullData.begin(), drawCullData.end());
+        primitives.insert(primitives.end(), drawPrimitives.begin(), drawPrimitives.end());
+    }
+
+    if (meshlets.empty())
+        return false;
+
+    outMeshlets.meshletOffset = AppendMeshletArray(geometry, meshlets);
+    outMeshlets.cullDataOffset = AppendMeshletArray(geometry, cullData);
+    outMeshlets.vertexIndexOffset = AppendMeshletArray(geometry, vertexIndices);
+    outMeshlets.primitiveOffset = AppendMeshletArray(geometry, primitives);
+    outMeshlets.numMeshlets = (uint32_t)meshlets.size();
+
+    return true;
+}
@@ -14,6 +14,7 @@
 #pragma once
 
 #include "glTF.h"
+#include "ModelLoader.h"
 #include "../Core/Math/BoundingSphere.h"
 #include "../Core/Math/BoundingBox.h"
 
@@ -47,4 +48,9 @@ namespace Renderer
     };
 }
 
-void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim, const Math::Matrix4& localToObject );
\ No newline at end of file
+void OptimizeMesh( Renderer::Primitive& outPrim, const glTF::Primitive& inPrim, const Math::Matrix4& localToObject,
+    Renderer::IndexOrder indexOrder = Renderer::IndexOrder::Forsyth );
+
+// Splits a mesh's draws into meshlets and appends their arrays to the geometry
+// data that the mesh is in.  Returns false if the mesh couldn't be split.
+bool BuildMeshletMesh( const Mesh& mesh, std::vector<byte>& geometry, MeshletMesh& outMeshlets );
\ No newline at end of file
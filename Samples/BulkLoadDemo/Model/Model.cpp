@@ -14,13 +14,15 @@
 #include "Model.h"
 #include "Renderer.h"
 #include "ConstantBuffers.h"
+#include <algorithm>
+#include <cstring>
 
 using namespace Math;
 using namespace Renderer;
 
 void Model::Render(
     MeshSorter& sorter,
-    const GpuBuffer& meshConstants,
+    D3D12_GPU_VIRTUAL_ADDRESS meshConstants,
     const ScaleAndTranslation sphereTransforms[],
     const Joint* skeleton ) const
 {
@@ -43,9 +45,9 @@ void Model::Render(
         {
             float distance = -sphereVS.GetCenter().GetZ() - sphereVS.GetRadius();
             sorter.AddMesh(mesh, distance,
-                meshConstants.GetGpuVirtualAddress() + sizeof(MeshConstants) * mesh.meshCBV,
+                meshConstants + sizeof(MeshConstants) * mesh.meshCBV,
                 m_MaterialConstants + sizeof(MaterialConstants) * mesh.materialCBV,
-                m_DataBuffer, skeleton);
+                m_DataBuffer, skeleton, m_Meshlets ? &m_Meshlets[i] : nullptr);
         }
 
         pMesh += sizeof(Mesh) + (mesh.numDraws - 1) * sizeof(Mesh::Draw);
@@ -57,8 +59,8 @@ void ModelInstance::Render(MeshSorter& sorter) const
     if (m_Model != nullptr)
     {
         //const Frustum& frustum = sorter.GetWorldFrustum();
-        m_Model->Render(sorter, m_MeshConstantsGPU, (const ScaleAndTranslation*)m_BoundingSphereTransforms.get(),
-            m_Skeleton.get());
+        m_Model->Render(sorter, GetMeshConstants(), (const ScaleAndTranslation*)m_BoundingSphereTransforms.get(),
+            m_Model->m_NumJoints > 0 ? GetMeshConstants() + sizeof(MeshConstants) * m_Model->m_NumNodes : 0);
     }
 }
 
@@ -68,19 +70,15 @@ ModelInstance::ModelInstance( std::shared_ptr<const Model> sourceModel )
     static_assert((_alignof(MeshConstants) & 255) == 0, "CBVs need 256 byte alignment");
     if (sourceModel == nullptr)
     {
-        m_MeshConstantsCPU.Destroy();
-        m_MeshConstantsGPU.Destroy();
+        DestroyMeshConstants();
         m_BoundingSphereTransforms = nullptr;
         m_AnimGraph = nullptr;
         m_AnimState.clear();
-        m_Skeleton = nullptr;
     }
     else
     {
-        m_MeshConstantsCPU.Create(L"Mesh Constant Upload Buffer", sourceModel->m_NumNodes * sizeof(MeshConstants));
-        m_MeshConstantsGPU.Create(L"Mesh Constant GPU Buffer", sourceModel->m_NumNodes, sizeof(MeshConstants));
+        CreateMeshConstants(sourceModel->m_NumNodes, sourceModel->m_NumJoints);
         m_BoundingSphereTransforms.reset(new __m128[sourceModel->m_NumNodes]);
-        m_Skeleton.reset(new Joint[sourceModel->m_NumJoints]);
 
         if (sourceModel->m_NumAnimations > 0)
         {
@@ -96,6 +94,11 @@ ModelInstance::ModelInstance( std::shared_ptr<const Model> sourceModel )
     }
 }
 
+ModelInstance::~ModelInstance()
+{
+    DestroyMeshConstants();
+}
+
 ModelInstance::ModelInstance(ModelInstance&& other) = default;
 ModelInstance& ModelInstance::operator=(ModelInstance&& other) = default;
 
@@ -110,19 +113,15 @@ ModelInstance& ModelInstance::operator=( std::shared_ptr<const Model> sourceMode
     m_Locator = UniformTransform(kIdentity);
     if (sourceModel == nullptr)
     {
-        m_MeshConstantsCPU.Destroy();
-        m_MeshConstantsGPU.Destroy();
+        DestroyMeshConstants();
         m_BoundingSphereTransforms = nullptr;
         m_AnimGraph = nullptr;
         m_AnimState.clear();
-        m_Skeleton = nullptr;
     }
     else
     {
-        m_MeshConstantsCPU.Create(L"Mesh Constant Upload Buffer", sourceModel->m_NumNodes * sizeof(MeshConstants));
-        m_MeshConstantsGPU.Create(L"Mesh Constant GPU Buffer", sourceModel->m_NumNodes, sizeof(MeshConstants));
+        CreateMeshConstants(sourceModel->m_NumNodes, sourceModel->m_NumJoints);
         m_BoundingSphereTransforms.reset(new __m128[sourceModel->m_NumNodes]);
-        m_Skeleton.reset(new Joint[sourceModel->m_NumJoints]);
 
         if (sourceModel->m_NumAnimations > 0)
         {
@@ -139,11 +138,87 @@ ModelInstance& ModelInstance::operator=( std::shared_ptr<const Model> sourceMode
     return *this;
 }
 
+void ModelInstance::CreateMeshConstants(uint32_t numNodes, uint32_t numJoints)
+{
+    DestroyMeshConstants();
+
+    // The joints follow the nodes' constants, so that they go to the GPU with
+    // the same copy and the skinned meshes can read them from there
+    const uint32_t numJointSlots =
+        (uint32_t)((numJoints * sizeof(Joint) + sizeof(MeshConstants) - 1) / sizeof(MeshConstants));
+    const uint32_t numSlots = numNodes + numJointSlots;
+
+    m_MeshConstants.reset(new MeshConstants[numSlots]);
+    m_Skeleton = numJoints > 0 ? (Joint*)(m_MeshConstants.get() + numNodes) : nullptr;
+
+    if (!m_PooledConstants.Create(numSlots))
+    {
+        m_MeshConstantsCPU.Create(L"Mesh Constant Upload Buffer", numSlots * sizeof(MeshConstants));
+        m_MeshConstantsGPU.Create(L"Mesh Constant GPU Buffer", numSlots, sizeof(MeshConstants));
+    }
+}
+
+void ModelInstance::DestroyMeshConstants(void)
+{
+    m_MeshConstants = nullptr;
+    m_Skeleton = nullptr;
+    m_PooledConstants.Destroy();
+    m_MeshConstantsCPU.Destroy();
+    m_MeshConstantsGPU.Destroy();
+    m_ConstantsValid = false;
+}
+
+bool ModelInstance::IsAnimating(void) const
+{
+    return std::any_of(m_AnimState.begin(), m_AnimState.end(),
+        [](const AnimationState& anim) { return anim.state != AnimationState::kStopped; });
+}
+
 void ModelInstance::Update(GraphicsContext& gfxContext, float deltaTime)
+{
+    UpdateTransforms(deltaTime);
+    CommitConstants(gfxContext);
+}
+
+void ModelInstance::UpdateTransforms(float deltaTime)
 {
     if (m_Model == nullptr)
         return;
 
+    // Most instances don't move from frame to frame, and they still have the
+    // constants that were built the last time they did
+    bool changed = !m_ConstantsValid || IsAnimating() ||
+        std::memcmp(&m_Locator, &m_ConstantsLocator, sizeof(m_Locator)) != 0;
+
+    if (changed)
+        BuildMeshConstants(deltaTime);
+}
+
+void ModelInstance::CommitConstants(GraphicsContext& gfxContext)
+{
+    if (m_Model == nullptr)
+        return;
+
+    if (m_PooledConstants.IsValid())
+    {
+        m_PooledConstants.Write(m_MeshConstants.get());
+    }
+    else if (m_ConstantsNeedUpload)
+    {
+        m_ConstantsNeedUpload = false;
+
+        void* cb = m_MeshConstantsCPU.Map();
+        std::memcpy(cb, m_MeshConstants.get(), m_MeshConstantsCPU.GetBufferSize());
+        m_MeshConstantsCPU.Unmap();
+
+        gfxContext.TransitionResource(m_MeshConstantsGPU, D3D12_RESOURCE_STATE_COPY_DEST, true);
+        gfxContext.GetCommandList()->CopyBufferRegion(m_MeshConstantsGPU.GetResource(), 0, m_MeshConstantsCPU.GetResource(), 0, m_MeshConstantsCPU.GetBufferSize());
+        gfxContext.TransitionResource(m_MeshConstantsGPU, D3D12_RESOURCE_STATE_GENERIC_READ);
+    }
+}
+
+void ModelInstance::BuildMeshConstants(float deltaTime)
+{
     static const size_t kMaxStackDepth = 32;
 
     size_t stackIdx = 0;
@@ -151,7 +226,7 @@ void ModelInstance::Update(GraphicsContext& gfxContext, float deltaTime)
     Matrix4 ParentMatrix = Matrix4((AffineTransform)m_Locator);
 
     ScaleAndTranslation* boundingSphereTransforms = (ScaleAndTranslation*)m_BoundingSphereTransforms.get();
-    MeshConstants* cb = (MeshConstants*)m_MeshConstantsCPU.Map();
+    MeshConstants* cb = m_MeshConstants.get();
 
     if (m_AnimGraph)
     {
@@ -182,10 +257,16 @@ void ModelInstance::Update(GraphicsContext& gfxContext, float deltaTime)
 
         // Concatenate the transform with the parent's matrix and update the matrix list
         {
-            // Scoped so that I don't forget that I'm pointing to write-combined memory and
-            // should not read from it.
             MeshConstants& cbv = cb[Node->matrixIdx];
-            cbv.World = xform;
+            if (m_Model->m_PositionQuantization)
+            {
+                const PositionQuantization& quantization = m_Model->m_PositionQuantization[Node->matrixIdx];
+                cbv.World = xform * Matrix4(Matrix3::MakeScale(quantization.scale), Vector3(quantization.bias));
+            }
+            else
+            {
+                cbv.World = xform;
+            }
             cbv.WorldIT = InverseTranspose(xform.Get3x3());
 
             Scalar scaleXSqr = LengthSquare((Vector3)xform.GetX());
@@ -225,11 +306,10 @@ void ModelInstance::Update(GraphicsContext& gfxContext, float deltaTime)
         joint.nrmXform = InverseTranspose(joint.posXform.Get3x3());
     }
 
-    m_MeshConstantsCPU.Unmap();
-
-    gfxContext.TransitionResource(m_MeshConstantsGPU, D3D12_RESOURCE_STATE_COPY_DEST, true);
-    gfxContext.GetCommandList()->CopyBufferRegion(m_MeshConstantsGPU.GetResource(), 0, m_MeshConstantsCPU.GetResource(), 0, m_MeshConstantsCPU.GetBufferSize());
-    gfxContext.TransitionResource(m_MeshConstantsGPU, D3D12_RESOURCE_STATE_GENERIC_READ);
+    m_ConstantsLocator = m_Locator;
+    m_ConstantsValid = true;
+    m_ConstantsNeedUpload = true;
+    m_PooledConstants.Invalidate();
 }
 
 void ModelInstance::Resize( float newRadius )
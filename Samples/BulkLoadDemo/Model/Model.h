@@ -14,6 +14,8 @@
 #pragma once
 
 #include "Animation.h"
+#include "ConstantBuffers.h"
+#include "MeshConstantsPool.h"
 #include "../Core/GpuBuffer.h"
 #include "../Core/VectorMath.h"
 #include "../Core/Camera.h"
@@ -46,6 +48,7 @@ namespace PSOFlags
         kAlphaTest      = 0x040,
         kTwoSided       = 0x080,
         kHasSkin        = 0x100,  // Implies having indices and weights
+        kQuantizedPos   = 0x200,  // POSITION is R16G16B16A16_UNORM, see PositionQuantization
     };
 }
 
@@ -92,6 +95,31 @@ struct GraphNode // 96 bytes
     uint32_t skeletonRoot : 1;
 };
 
+// Maps a node's quantized positions, which are in [0, 1], back to object space.
+// The scale and bias are folded into the node's world matrix.
+struct PositionQuantization
+{
+    Math::XMFLOAT3 scale;
+    Math::XMFLOAT3 bias;
+};
+
+// The most vertices and triangles in a meshlet.  MeshletMS.hlsl has to match.
+constexpr uint32_t kMeshletMaxVertices = 64;
+constexpr uint32_t kMeshletMaxPrimitives = 126;
+
+// The meshlets of a mesh, for drawing it with mesh shaders.  The offsets are
+// into the model's data buffer, like the mesh's.  Each meshlet's vertex
+// indices are relative to the start of the mesh's vertex buffer, so all of
+// its draws share one list of meshlets.
+struct MeshletMesh
+{
+    uint32_t meshletOffset;      // DirectX::Meshlet[numMeshlets]
+    uint32_t cullDataOffset;     // DirectX::CullData[numMeshlets]
+    uint32_t vertexIndexOffset;  // uint32_t unique vertex indices
+    uint32_t primitiveOffset;    // DirectX::MeshletTriangle, three 10-bit indices per uint32_t
+    uint32_t numMeshlets;        // 0 when the mesh is drawn without meshlets
+};
+
 struct Joint
 {
     Math::Matrix4 posXform;
@@ -104,9 +132,9 @@ public:
     virtual ~Model() = default;
 
     void Render(Renderer::MeshSorter& sorter,
-        const GpuBuffer& meshConstants,
+        D3D12_GPU_VIRTUAL_ADDRESS meshConstants,
         const Math::ScaleAndTranslation sphereTransforms[],
-        const Joint* skeleton) const;
+        D3D12_GPU_VIRTUAL_ADDRESS skeleton) const;
 
     Math::BoundingSphere m_BoundingSphere; // Object-space bounding sphere
     Math::AxisAlignedBox m_BoundingBox;
@@ -124,6 +152,8 @@ public:
     AnimationSet* m_Animations = nullptr;
     uint16_t* m_JointIndices = nullptr;
     Math::Matrix4* m_JointIBMs = nullptr;
+    PositionQuantization* m_PositionQuantization = nullptr; // Per node, or null when no mesh is quantized
+    MeshletMesh* m_Meshlets = nullptr; // Per mesh, or null when no mesh has meshlets
 };
 
 // subclass of Model that owns all its own data
@@ -150,10 +180,7 @@ class ModelInstance
 {
 public:
     ModelInstance() {}
-    ~ModelInstance() {
-        m_MeshConstantsCPU.Destroy();
-        m_MeshConstantsGPU.Destroy();
-    }
+    ~ModelInstance();
     ModelInstance( std::shared_ptr<const Model> sourceModel );
     ModelInstance( const ModelInstance& modelInstance );
     ModelInstance( ModelInstance&& modelInstance );
@@ -163,8 +190,26 @@ public:
 
 
     bool IsNull(void) const { return m_Model == nullptr; }
+    const Model* GetModel(void) const { return m_Model.get(); }
+    D3D12_GPU_VIRTUAL_ADDRESS GetMeshConstants(void) const
+    {
+        return m_PooledConstants.IsValid() ? m_PooledConstants.GetGpuVirtualAddress()
+            : m_MeshConstantsGPU.GetGpuVirtualAddress();
+    }
+    const Math::ScaleAndTranslation* GetBoundingSphereTransforms(void) const
+    {
+        return (const Math::ScaleAndTranslation*)m_BoundingSphereTransforms.get();
+    }
 
+    // Only an instance that moved, or is animating, rebuilds its constants.
+    // Pooled instances are copied to the GPU by MeshConstantsPool::Commit.
     void Update(GraphicsContext& gfxContext, float deltaTime);
+
+    // Update in two halves.  UpdateTransforms only touches this instance, so
+    // different instances can be updated on different threads; the constants
+    // are then committed from the rendering thread.
+    void UpdateTransforms(float deltaTime);
+    void CommitConstants(GraphicsContext& gfxContext);
     void Render(Renderer::MeshSorter& sorter) const;
 
     void Resize(float newRadius);
@@ -185,13 +230,28 @@ public:
     void LoopAllAnimations(void);
 
 private:
+    void CreateMeshConstants(uint32_t numNodes, uint32_t numJoints);
+    void DestroyMeshConstants(void);
+    bool IsAnimating(void) const;
+    void BuildMeshConstants(float deltaTime);
+
     std::shared_ptr<const Model> m_Model;
+
+    // The constants, followed by the skeleton's joints, are built in cached
+    // memory.  They are written to the pool when it has room, or else
+    // uploaded to this instance's own buffer.
+    std::unique_ptr<MeshConstants[]> m_MeshConstants;
+    MeshConstantsPool::Allocation m_PooledConstants;
     UploadBuffer m_MeshConstantsCPU;
     ByteAddressBuffer m_MeshConstantsGPU;
+    Math::UniformTransform m_ConstantsLocator;  // The locator that m_MeshConstants was built with
+    bool m_ConstantsValid = false;
+    bool m_ConstantsNeedUpload = false;         // For an instance that isn't pooled
+
     std::unique_ptr<__m128[]> m_BoundingSphereTransforms;
     Math::UniformTransform m_Locator;
 
     std::unique_ptr<GraphNode[]> m_AnimGraph;   // A copy of the scene graph when instancing animation
     std::vector<AnimationState> m_AnimState;    // Per-animation (not per-curve)
-    std::unique_ptr<Joint[]> m_Skeleton;
+    Joint* m_Skeleton = nullptr;                // In m_MeshConstants
 };
@@ -24,6 +24,8 @@
 #include "../Core/Utility.h"
 #include "../Core/Math/Common.h"
 
+#include <algorithm>
+#include <execution>
 #include <fstream>
 #include <map>
 #include <unordered_map>
@@ -39,12 +41,42 @@ static inline Vector3 SafeNormalize(Vector3 x)
     return lenSq < 1e-10f ? Vector3(kXUnitVector) : x * RecipSqrt(lenSq);
 }
 
-void Renderer::CompileMesh(
+// A mesh in the scene graph, whose primitives are converted in parallel with
+// every other mesh's before they're packed into the geometry buffer in order.
+struct MeshJob
+{
+    glTF::Mesh* srcMesh;
+    uint32_t matrixIdx;
+    Matrix4 localToObject;
+    std::vector<Primitive> primitives;
+};
+
+// Runs OptimizeMesh on every primitive of every job.  Each primitive has its
+// own vertex and index buffers, so they don't share any state.
+static void OptimizeMeshes(std::vector<MeshJob>& jobs, IndexOrder indexOrder)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> work;
+    for (uint32_t j = 0; j < jobs.size(); ++j)
+    {
+        jobs[j].primitives.resize(jobs[j].srcMesh->primitives.size());
+        for (uint32_t i = 0; i < jobs[j].primitives.size(); ++i)
+            work.emplace_back(j, i);
+    }
+
+    std::for_each(std::execution::par, work.begin(), work.end(), [&](const std::pair<uint32_t, uint32_t>& item)
+    {
+        MeshJob& job = jobs[item.first];
+        OptimizeMesh(job.primitives[item.second], job.srcMesh->primitives[item.second], job.localToObject, indexOrder);
+    });
+}
+
+// Packs the converted primitives of a mesh into the geometry buffer
+static void PackMesh(
     std::vector<Mesh*>& meshList,
     std::vector<byte>& bufferMemory,
-    glTF::Mesh& srcMesh,
+    const glTF::Mesh& srcMesh,
     uint32_t matrixIdx,
-    const Matrix4& localToObject,
+    std::vector<Primitive>& primitives,
     BoundingSphere& boundingSphere,
     AxisAlignedBox& boundingBox
     )
@@ -61,10 +93,8 @@ void Renderer::CompileMesh(
     BoundingSphere sphereOS(kZero);
     AxisAlignedBox bboxOS(kZero);
 
-    std::vector<Primitive> primitives(srcMesh.primitives.size());
     for (uint32_t i = 0; i < primitives.size(); ++i)
     {
-        OptimizeMesh(primitives[i], srcMesh.primitives[i], localToObject);
         sphereOS = sphereOS.Union(primitives[i].m_BoundsOS);
         bboxOS.AddBoundingBox(primitives[i].m_BBoxOS);
     }
@@ -167,13 +197,31 @@ void Renderer::CompileMesh(
     bufferMemory.insert(bufferMemory.end(), stagingBuffer->begin(), stagingBuffer->end());
 }
 
+void Renderer::CompileMesh(
+    std::vector<Mesh*>& meshList,
+    std::vector<byte>& bufferMemory,
+    glTF::Mesh& srcMesh,
+    uint32_t matrixIdx,
+    const Matrix4& localToObject,
+    BoundingSphere& boundingSphere,
+    AxisAlignedBox& boundingBox
+    )
+{
+    std::vector<MeshJob> jobs(1);
+    jobs[0].srcMesh = &srcMesh;
+    jobs[0].matrixIdx = matrixIdx;
+    jobs[0].localToObject = localToObject;
+    OptimizeMeshes(jobs, IndexOrder::Forsyth);
+
+    PackMesh(meshList, bufferMemory, srcMesh, matrixIdx, jobs[0].primitives, boundingSphere, boundingBox);
+}
+
 
+// Builds the scene graph, and collects the meshes that it places in the order
+// that they're found.
 static uint32_t WalkGraph(
     std::vector<GraphNode>& sceneGraph,
-    BoundingSphere& modelBSphere,
-    AxisAlignedBox& modelBBox,
-    std::vector<Mesh*>& meshList,
-    std::vector<byte>& bufferMemory,
+    std::vector<MeshJob>& meshJobs,
     const std::vector<glTF::Node*>& siblings,
     uint32_t curPos,
     const Matrix4& xform
@@ -212,11 +260,11 @@ static uint32_t WalkGraph(
 
         if (!curNode->pointsToCamera && curNode->mesh != nullptr)
         {
-            BoundingSphere sphereOS;
-            AxisAlignedBox boxOS;
-            CompileMesh(meshList, bufferMemory, *curNode->mesh, curPos, LocalXform, sphereOS, boxOS);
-            modelBSphere = modelBSphere.Union(sphereOS);
-            modelBBox.AddBoundingBox(boxOS);
+            MeshJob job;
+            job.srcMesh = curNode->mesh;
+            job.matrixIdx = curPos;
+            job.localToObject = LocalXform;
+            meshJobs.push_back(std::move(job));
         }
 
         uint32_t nextPos = curPos + 1;
@@ -224,7 +272,7 @@ static uint32_t WalkGraph(
         if (curNode->children.size() > 0)
         {
             thisGraphNode.hasChildren = 1;
-            nextPos = WalkGraph(sceneGraph, modelBSphere, modelBBox, meshList, bufferMemory, curNode->children, nextPos, LocalXform);
+            nextPos = WalkGraph(sceneGraph, meshJobs, curNode->children, nextPos, LocalXform);
         }
 
         // Are there more siblings?
@@ -442,7 +490,8 @@ void BuildSkins(ModelData& model, const glTF::Asset& asset)
     }
 }
 
-bool Renderer::BuildModel(ModelData& model, const glTF::Asset& asset, int sceneIdx, bool compileTextures)
+bool Renderer::BuildModel(ModelData& model, const glTF::Asset& asset, int sceneIdx, bool compileTextures,
+    IndexOrder indexOrder)
 {
     BuildMaterials(model, asset, compileTextures);
 
@@ -455,10 +504,27 @@ bool Renderer::BuildModel(ModelData& model, const glTF::Asset& asset, int sceneI
     // Aggregate all of the vertex and index buffers in this unified buffer
     std::vector<byte>& bufferMemory = model.m_GeometryData;
 
+    std::vector<MeshJob> meshJobs;
+    uint32_t numNodes = WalkGraph(model.m_SceneGraph, meshJobs, scene->nodes, 0, Matrix4(kIdentity));
+    model.m_SceneGraph.resize(numNodes);
+
+    // Convert all of the primitives in parallel, then pack them in scene graph
+    // order so that the output doesn't depend on how the work was scheduled
+    OptimizeMeshes(meshJobs, indexOrder);
+
     model.m_BoundingSphere = BoundingSphere(kZero);
     model.m_BoundingBox = AxisAlignedBox(kZero);
-    uint32_t numNodes = WalkGraph(model.m_SceneGraph, model.m_BoundingSphere, model.m_BoundingBox, model.m_Meshes, bufferMemory, scene->nodes, 0, Matrix4(kIdentity));
-    model.m_SceneGraph.resize(numNodes);
+    for (MeshJob& job : meshJobs)
+    {
+        BoundingSphere sphereOS;
+        AxisAlignedBox boxOS;
+        PackMesh(model.m_Meshes, bufferMemory, *job.srcMesh, job.matrixIdx, job.primitives, sphereOS, boxOS);
+        model.m_BoundingSphere = model.m_BoundingSphere.Union(sphereOS);
+        model.m_BoundingBox.AddBoundingBox(boxOS);
+
+        // The primitives' buffers have been copied into the geometry buffer
+        job.primitives.clear();
+    }
 
     BuildAnimations(model, asset);
     BuildSkins(model, asset);
@@ -466,6 +532,204 @@ bool Renderer::BuildModel(ModelData& model, const glTF::Asset& asset, int sceneI
     return true;
 }
 
+static uint16_t QuantizeUnorm16(float value, float bias, float scale)
+{
+    if (scale <= 0.0f)
+        return 0;
+
+    float normalized = std::min(std::max((value - bias) / scale, 0.0f), 1.0f);
+    return (uint16_t)(normalized * 65535.0f + 0.5f);
+}
+
+// Copies vertices of 'stride' bytes, writing the leading float3 position as
+// four UNORM16 values and keeping the rest of each vertex as it is.
+static void AppendQuantizedVertices(
+    std::vector<byte>& out,
+    const byte* vertices,
+    uint32_t size,
+    uint32_t stride,
+    const PositionQuantization& quantization)
+{
+    const uint32_t numVertices = size / stride;
+    for (uint32_t i = 0; i < numVertices; ++i)
+    {
+        const byte* vertex = vertices + i * stride;
+        float position[3];
+        std::memcpy(position, vertex, sizeof(position));
+
+        uint16_t quantized[4] =
+        {
+            QuantizeUnorm16(position[0], quantization.bias.x, quantization.scale.x),
+            QuantizeUnorm16(position[1], quantization.bias.y, quantization.scale.y),
+            QuantizeUnorm16(position[2], quantization.bias.z, quantization.scale.z),
+            0xFFFF
+        };
+
+        out.insert(out.end(), (const byte*)quantized, (const byte*)quantized + sizeof(quantized));
+        out.insert(out.end(), vertex + sizeof(position), vertex + stride);
+    }
+}
+
+bool Renderer::QuantizePositions(ModelData& model)
+{
+    const size_t numNodes = model.m_SceneGraph.size();
+
+    // A node's quantization is folded into its world matrix, which joints and
+    // skinned meshes apply after skinning, so those nodes keep float positions.
+    std::vector<bool> canQuantize(numNodes, true);
+    for (uint16_t joint : model.m_JointIndices)
+        canQuantize[joint] = false;
+    for (const Mesh* mesh : model.m_Meshes)
+    {
+        if (mesh->psoFlags & PSOFlags::kHasSkin)
+            canQuantize[mesh->meshCBV] = false;
+    }
+
+    // All of a node's meshes share one quantization, so it spans their bounds.
+    std::vector<AxisAlignedBox> nodeBounds(numNodes, AxisAlignedBox(kZero));
+    std::vector<bool> hasBounds(numNodes, false);
+    for (const Mesh* mesh : model.m_Meshes)
+    {
+        if (!canQuantize[mesh->meshCBV])
+            continue;
+
+        const byte* vertices = model.m_GeometryData.data() + mesh->vbOffset;
+        for (uint32_t offset = 0; offset < mesh->vbSize; offset += mesh->vbStride)
+        {
+            XMFLOAT3 position;
+            std::memcpy(&position, vertices + offset, sizeof(position));
+
+            nodeBounds[mesh->meshCBV].AddPoint(Vector3(position));
+        }
+        if (mesh->vbSize > 0)
+            hasBounds[mesh->meshCBV] = true;
+    }
+
+    if (std::find(hasBounds.begin(), hasBounds.end(), true) == hasBounds.end())
+        return false;
+
+    const PositionQuantization identity = { XMFLOAT3(1.0f, 1.0f, 1.0f), XMFLOAT3(0.0f, 0.0f, 0.0f) };
+    model.m_PositionQuantization.assign(numNodes, identity);
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        if (!hasBounds[i])
+            continue;
+
+        XMStoreFloat3(&model.m_PositionQuantization[i].scale, nodeBounds[i].GetDimensions());
+        XMStoreFloat3(&model.m_PositionQuantization[i].bias, nodeBounds[i].GetMin());
+    }
+
+    // Rebuild the geometry buffer, since the quantized vertex buffers are
+    // smaller.  Every buffer stays 4-byte aligned as before.
+    std::vector<byte> geometry;
+    geometry.reserve(model.m_GeometryData.size());
+    const byte* source = model.m_GeometryData.data();
+
+    for (Mesh* mesh : model.m_Meshes)
+    {
+        const uint32_t depthStride = (mesh->psoFlags & PSOFlags::kAlphaTest) ? 16u : 12u;
+        uint32_t vbOffset = (uint32_t)geometry.size();
+        uint32_t vbDepthOffset;
+
+        if (hasBounds[mesh->meshCBV])
+        {
+            const PositionQuantization& quantization = model.m_PositionQuantization[mesh->meshCBV];
+
+            AppendQuantizedVertices(geometry, source + mesh->vbOffset, mesh->vbSize, mesh->vbStride, quantization);
+            vbDepthOffset = (uint32_t)geometry.size();
+            AppendQuantizedVertices(geometry, source + mesh->vbDepthOffset, mesh->vbDepthSize, depthStride, quantization);
+
+            mesh->vbSize = vbDepthOffset - vbOffset;
+            mesh->vbDepthSize = (uint32_t)geometry.size() - vbDepthOffset;
+            mesh->vbStride -= 4;
+            mesh->psoFlags |= PSOFlags::kQuantizedPos;
+        }
+        else
+        {
+            geometry.insert(geometry.end(), source + mesh->vbOffset, source + mesh->vbOffset + mesh->vbSize);
+            vbDepthOffset = (uint32_t)geometry.size();
+            geometry.insert(geometry.end(), source + mesh->vbDepthOffset, source + mesh->vbDepthOffset + mesh->vbDepthSize);
+        }
+
+        uint32_t ibOffset = (uint32_t)geometry.size();
+        geometry.insert(geometry.end(), source + mesh->ibOffset, source + mesh->ibOffset + mesh->ibSize);
+        geometry.resize(Math::AlignUp(geometry.size(), 4));
+
+        mesh->vbOffset = vbOffset;
+        mesh->vbDepthOffset = vbDepthOffset;
+        mesh->ibOffset = ibOffset;
+    }
+
+    model.m_GeometryData = std::move(geometry);
+
+    return true;
+}
+
+bool Renderer::BuildMeshlets(ModelData& model)
+{
+    // The mesh shaders read float positions and have no alpha testing, blending
+    // or skinning, so the other meshes keep being drawn with the vertex shaders.
+    const uint16_t kUnsupportedFlags = PSOFlags::kHasSkin | PSOFlags::kQuantizedPos |
+        PSOFlags::kAlphaBlend | PSOFlags::kAlphaTest;
+
+    std::vector<MeshletMesh> meshlets(model.m_Meshes.size(), MeshletMesh{});
+    bool anyMeshlets = false;
+
+    for (size_t i = 0; i < model.m_Meshes.size(); ++i)
+    {
+        const Mesh& mesh = *model.m_Meshes[i];
+        if ((mesh.psoFlags & kUnsupportedFlags) == 0 && BuildMeshletMesh(mesh, model.m_GeometryData, meshlets[i]))
+            anyMeshlets = true;
+    }
+
+    if (!anyMeshlets)
+        return false;
+
+    model.m_Meshlets = std::move(meshlets);
+
+    return true;
+}
+
+bool Renderer::DeduplicateMaterials(ModelData& model)
+{
+    ASSERT(model.m_MaterialConstants.size() == model.m_MaterialTextures.size());
+
+    // Materials are the same if their constants, textures, and samplers are.
+    // MaterialTextureData has padding, so its fields are compared one by one.
+    std::map<std::string, uint16_t> uniqueMaterials;
+    std::vector<uint16_t> remap(model.m_MaterialConstants.size());
+    std::vector<MaterialConstantData> constants;
+    std::vector<MaterialTextureData> textures;
+
+    for (size_t i = 0; i < model.m_MaterialConstants.size(); ++i)
+    {
+        const MaterialTextureData& textureData = model.m_MaterialTextures[i];
+
+        std::string key((const char*)&model.m_MaterialConstants[i], sizeof(MaterialConstantData));
+        key.append((const char*)textureData.stringIdx, sizeof(textureData.stringIdx));
+        key.append((const char*)&textureData.addressModes, sizeof(textureData.addressModes));
+
+        auto inserted = uniqueMaterials.try_emplace(std::move(key), (uint16_t)constants.size());
+        if (inserted.second)
+        {
+            constants.push_back(model.m_MaterialConstants[i]);
+            textures.push_back(textureData);
+        }
+        remap[i] = inserted.first->second;
+    }
+
+    if (constants.size() == model.m_MaterialConstants.size())
+        return false;
+
+    for (Mesh* mesh : model.m_Meshes)
+        mesh->materialCBV = remap[mesh->materialCBV];
+
+    model.m_MaterialConstants = std::move(constants);
+    model.m_MaterialTextures = std::move(textures);
+
+    return true;
+}
+
 bool Renderer::SaveModel(const std::wstring& filePath, const ModelData& data)
 {
     std::ofstream outFile(filePath, std::ios::out | std::ios::binary);
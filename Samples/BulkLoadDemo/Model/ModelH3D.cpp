@@ -12,6 +12,7 @@
 //
 
 #include "ModelH3D.h"
+#include "ModelLoader.h"
 #include <string.h>
 #include <float.h>
 
@@ -155,13 +156,42 @@ bool ModelH3D::LoadH3D(const wstring& filename)
 
     PostLoadMeshes();
 
-    UploadBuffer geomBuffer;
-
     uint32_t totalBinarySize = m_Header.vertexDataByteSize
         + m_Header.indexDataByteSize
         + m_Header.vertexDataByteSizeDepth
         + m_Header.indexDataByteSize;
 
+    // The geometry is stored as it's laid out in m_GeometryBuffer, so the
+    // loader reads all of it with one request.  It's still read into memory
+    // as well, for BuildModel and the bounding boxes, but without going
+    // through an upload buffer.
+    if (Renderer::GeometryFileLoader loader = Renderer::GetGeometryFileLoader(); loader && totalBinarySize > 0)
+    {
+        m_GeometryBuffer.Create(L"Geometry Buffer", totalBinarySize, 1);
+        if (SUCCEEDED(loader(filename.c_str(), file.tellg(), totalBinarySize, m_GeometryBuffer.GetResource())))
+        {
+            m_pVertexData = new unsigned char[m_Header.vertexDataByteSize];
+            m_pIndexData = new unsigned char[m_Header.indexDataByteSize];
+            m_pVertexDataDepth = new unsigned char[m_Header.vertexDataByteSizeDepth];
+            m_pIndexDataDepth = new unsigned char[m_Header.indexDataByteSize];
+
+            if (!file.read((char*)m_pVertexData, m_Header.vertexDataByteSize) ||
+                !file.read((char*)m_pIndexData, m_Header.indexDataByteSize) ||
+                !file.read((char*)m_pVertexDataDepth, m_Header.vertexDataByteSizeDepth) ||
+                !file.read((char*)m_pIndexDataDepth, m_Header.indexDataByteSize))
+            {
+                return false;
+            }
+
+            CreateGeometryViews();
+            LoadTextures(Utility::GetBasePath(filename));
+            return true;
+        }
+
+        m_GeometryBuffer.Destroy();
+    }
+
+    UploadBuffer geomBuffer;
     geomBuffer.Create(L"Geometry Upload Buffer", totalBinarySize);
     uint8_t* uploadMem = (uint8_t*)geomBuffer.Map();
 
@@ -182,10 +212,7 @@ bool ModelH3D::LoadH3D(const wstring& filename)
 
     m_GeometryBuffer.Create(L"Geometry Buffer", totalBinarySize, 1, geomBuffer);
 
-    m_VertexBuffer = m_GeometryBuffer.VertexBufferView(0, m_Header.vertexDataByteSize, m_VertexStride);
-    m_IndexBuffer = m_GeometryBuffer.IndexBufferView(m_pIndexData - m_pVertexData, m_Header.indexDataByteSize, false);
-    m_VertexBufferDepth = m_GeometryBuffer.VertexBufferView(m_pVertexDataDepth - m_pVertexData, m_Header.vertexDataByteSizeDepth, m_VertexStride);
-    m_IndexBufferDepth = m_GeometryBuffer.IndexBufferView(m_pIndexDataDepth - m_pVertexData, m_Header.indexDataByteSize, false);
+    CreateGeometryViews();
 
 
 
@@ -210,6 +237,19 @@ bool ModelH3D::LoadH3D(const wstring& filename)
     return true;
 }
 
+void ModelH3D::CreateGeometryViews()
+{
+    const size_t indexOffset = m_Header.vertexDataByteSize;
+    const size_t vertexDepthOffset = indexOffset + m_Header.indexDataByteSize;
+    const size_t indexDepthOffset = vertexDepthOffset + m_Header.vertexDataByteSizeDepth;
+
+    m_VertexBuffer = m_GeometryBuffer.VertexBufferView(0, m_Header.vertexDataByteSize, m_VertexStride);
+    m_IndexBuffer = m_GeometryBuffer.IndexBufferView(indexOffset, m_Header.indexDataByteSize, false);
+    m_VertexBufferDepth =
+        m_GeometryBuffer.VertexBufferView(vertexDepthOffset, m_Header.vertexDataByteSizeDepth, m_VertexStride);
+    m_IndexBufferDepth = m_GeometryBuffer.IndexBufferView(indexDepthOffset, m_Header.indexDataByteSize, false);
+}
+
 void ModelH3D::PostLoadMeshes()
 {
     m_VertexStride = m_pMesh[0].vertexStride;
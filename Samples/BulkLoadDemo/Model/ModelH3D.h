@@ -210,6 +210,7 @@ public:
 //protected:
 
 	bool LoadH3D(const std::wstring& filename);
+	void CreateGeometryViews();
 	bool SaveH3D(const std::wstring& filename) const;
 
 	void ComputeMeshBoundingBox(uint32_t meshIndex, Math::AxisAlignedBox& bbox) const;
@@ -31,6 +31,18 @@ using namespace Graphics;
 
 std::unordered_map<uint32_t, uint32_t> g_SamplerPermutations;
 
+static GeometryFileLoader s_GeometryFileLoader = nullptr;
+
+void Renderer::SetGeometryFileLoader(GeometryFileLoader loader)
+{
+    s_GeometryFileLoader = loader;
+}
+
+GeometryFileLoader Renderer::GetGeometryFileLoader()
+{
+    return s_GeometryFileLoader;
+}
+
 D3D12_CPU_DESCRIPTOR_HANDLE GetSampler(uint32_t addressModes)
 {
     SamplerDesc samplerDesc;
@@ -47,7 +59,8 @@ void LoadMaterials(MiniModel& model,
 {
     static_assert((_alignof(MaterialConstants) & 255) == 0, "CBVs need 256 byte alignment");
 
-    // Load textures
+    // Load textures.  They load in parallel, and the descriptor tables below wait
+    // for each one as its SRV is copied.
     const uint32_t numTextures = (uint32_t)textureNames.size();
     model.textures.resize(numTextures);
     for (size_t ti = 0; ti < numTextures; ++ti)
@@ -56,7 +69,7 @@ void LoadMaterials(MiniModel& model,
         CompileTextureOnDemand(originalFile, textureOptions[ti]);
 
         std::wstring ddsFile = Utility::RemoveExtension(originalFile) + L".dds";
-        model.textures[ti] = TextureManager::LoadDDSFromFile(ddsFile);
+        model.textures[ti] = TextureManager::LoadDDSFromFileAsync(ddsFile);
     }
 
     // Generate descriptor tables and record offsets for each material
@@ -227,7 +240,23 @@ std::shared_ptr<Model> Renderer::LoadModel(const std::wstring& filePath, bool fo
     model->m_NumMeshes = header.numMeshes;
     model->m_MeshData.reset(new uint8_t[header.meshDataSize]);
 
-	if (header.geometrySize > 0)
+    // The geometry follows the header, so the loader reads all of it with
+    // one request
+    if (header.geometrySize > 0 && s_GeometryFileLoader != nullptr)
+    {
+        model->m_DataBuffer.Create(L"Model Data", header.geometrySize, 1);
+        if (SUCCEEDED(s_GeometryFileLoader(miniFileName.c_str(), sizeof(FileHeader), header.geometrySize,
+            model->m_DataBuffer.GetResource())))
+        {
+            inFile.seekg(header.geometrySize, std::ios::cur);
+        }
+        else
+        {
+            model->m_DataBuffer.Destroy();
+        }
+    }
+
+	if (header.geometrySize > 0 && model->m_DataBuffer.GetResource() == nullptr)
 	{
 		UploadBuffer modelData;
 		modelData.Create(L"Model Data Upload", header.geometrySize);
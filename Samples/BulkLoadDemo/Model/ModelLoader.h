@@ -65,6 +65,8 @@ namespace Renderer
         std::vector<GraphNode> m_SceneGraph;
         std::vector<std::string> m_TextureNames;
         std::vector<uint8_t> m_TextureOptions;
+        std::vector<PositionQuantization> m_PositionQuantization; // Empty unless QuantizePositions() was called
+        std::vector<MeshletMesh> m_Meshlets; // Empty unless BuildMeshlets() was called
     };
 
     struct FileHeader
@@ -87,6 +89,16 @@ namespace Renderer
         float    maxPos[3];
     };
 
+    // How the triangles of each primitive are ordered for the post-transform
+    // vertex cache.  Tipsify is much faster to compile than Forsyth's
+    // algorithm, and can also sort its clusters of triangles to reduce overdraw.
+    enum class IndexOrder
+    {
+        Forsyth,
+        Tipsify,
+        TipsifyOverdraw
+    };
+
     void CompileMesh(
         std::vector<Mesh*>& meshList,
         std::vector<byte>& bufferMemory,
@@ -97,8 +109,37 @@ namespace Renderer
         Math::AxisAlignedBox& boundingBox
     );
 
-    bool BuildModel( ModelData& model, const glTF::Asset& asset, int sceneIdx = -1, bool compileTextures = true );
+    bool BuildModel( ModelData& model, const glTF::Asset& asset, int sceneIdx = -1, bool compileTextures = true,
+        IndexOrder indexOrder = IndexOrder::Forsyth );
     bool SaveModel( const std::wstring& filePath, const ModelData& model );
+
+    // Stores positions as R16G16B16A16_UNORM where possible, replacing the
+    // geometry data.  The .mini format has no quantization table, so this is
+    // only for MARC files.  Returns false if no mesh could be quantized.
+    bool QuantizePositions( ModelData& model );
+
+    // Splits the opaque, unskinned meshes with float positions into meshlets
+    // for the mesh shader path, appending them to the geometry data.  Like
+    // quantization, it's only for MARC files, and has to come after it.
+    // Returns false if no mesh could be split.
+    bool BuildMeshlets( ModelData& model );
+
+    // Merges materials with the same constants, textures and samplers, so that
+    // their meshes share a constant buffer and descriptor tables.  Returns false
+    // if there were no duplicates.
+    bool DeduplicateMaterials( ModelData& model );
     
     std::shared_ptr<Model> LoadModel( const std::wstring& filePath, bool forceRebuild = false );
+
+    // Reads size bytes at offset in a file straight into a buffer that's in
+    // D3D12_RESOURCE_STATE_COMMON, and returns once they're there.
+    using GeometryFileLoader = HRESULT (*)( const wchar_t* fileName, uint64_t offset, uint32_t size,
+        ID3D12Resource* buffer );
+
+    // Sets the loader that LoadModel and ModelH3D use to read the geometry of
+    // .mini and .h3d files into its GPU buffer, or nullptr to read it into an
+    // upload buffer with std::ifstream and copy it.  If the loader fails, the
+    // geometry is read that way instead.
+    void SetGeometryFileLoader( GeometryFileLoader loader );
+    GeometryFileLoader GetGeometryFileLoader();
 }
\ No newline at end of file
@@ -30,6 +30,9 @@ namespace
     map<wstring, uint32_t> s_TextureArrayLookup;
     vector<TextureRef> s_TextureReferences;
 
+    // Set when the effect manager was given an atlas, which already holds every texture
+    bool s_UsingTextureAtlas = false;
+
     uint32_t GetTextureIndex(const wstring& name)
     {
         // Look for the texture already being assigned an index.  If it's not found,
@@ -46,9 +49,12 @@ namespace
             s_TextureArrayLookup[name] = index;
 
             // Load the texture and register it with the effect manager
-            TextureRef texture = TextureManager::LoadDDSFromFile(name, kMagenta2D, true);
-            s_TextureReferences.push_back(texture);
-            ParticleEffectManager::RegisterTexture(index, *texture.Get());
+            if (!s_UsingTextureAtlas)
+            {
+                TextureRef texture = TextureManager::LoadDDSFromFile(name, kMagenta2D, true);
+                s_TextureReferences.push_back(texture);
+                ParticleEffectManager::RegisterTexture(index, *texture.Get());
+            }
 
             return index;
         }
@@ -86,6 +92,28 @@ void ParticleEffects::InitFromJSON(const wstring& InitJsonFile)
     if (!particle_setup.is_object() || particle_setup.find("ParticleEmitters") == particle_setup.end())
         return;
 
+    // MiniArchive -particles packs the textures into one array next to the json
+    // file, in the order the emitters first use them, which is the order
+    // GetTextureIndex numbers them in.  It's read with a single request, instead
+    // of a load and a copy for each texture.
+    if (s_TextureArrayLookup.empty())
+    {
+        wstring atlasFile = Utility::RemoveExtension(InitJsonFile) + L".dds";
+        if (ifstream(atlasFile).good())
+        {
+            TextureRef atlas = TextureManager::LoadDDSFromFile(atlasFile, kMagenta2D, true);
+            if (atlas.IsValid() && ParticleEffectManager::SetTextureArray(*atlas.Get()))
+            {
+                s_TextureReferences.push_back(atlas);
+                s_UsingTextureAtlas = true;
+            }
+            else
+            {
+                Utility::Printf(L"Warning:  %s doesn't match the particle texture array\n", atlasFile.c_str());
+            }
+        }
+    }
+
     for (auto& emitter : particle_setup["ParticleEmitters"])
     {
         ParticleEffectProperties Effect = ParticleEffectProperties();
@@ -190,4 +218,6 @@ void ParticleEffects::InitFromJSON(const wstring& InitJsonFile)
 void ParticleEffects::Shutdown()
 {
     s_TextureReferences.clear();    
+    s_TextureArrayLookup.clear();
+    s_UsingTextureAtlas = false;
 }
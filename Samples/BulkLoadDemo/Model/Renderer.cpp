@@ -16,12 +16,18 @@
 #include "TextureManager.h"
 #include "ConstantBuffers.h"
 #include "LightManager.h"
+#include "InstanceBatch.h"
 #include "../Core/RootSignature.h"
 #include "../Core/PipelineState.h"
 #include "../Core/GraphicsCommon.h"
 #include "../Core/BufferManager.h"
 #include "../Core/ShadowCamera.h"
 
+#include <array>
+#include <execution>
+#include <numeric>
+#include <thread>
+
 #include "CompiledShaders/DefaultVS.h"
 #include "CompiledShaders/DefaultSkinVS.h"
 #include "CompiledShaders/DefaultPS.h"
@@ -34,13 +40,24 @@
 #include "CompiledShaders/DefaultNoTangentNoUV1VS.h"
 #include "CompiledShaders/DefaultNoTangentNoUV1SkinVS.h"
 #include "CompiledShaders/DefaultNoTangentNoUV1PS.h"
+#include "CompiledShaders/DefaultBindlessPS.h"
+#include "CompiledShaders/DefaultBindlessNoUV1PS.h"
+#include "CompiledShaders/DefaultBindlessNoTangentPS.h"
+#include "CompiledShaders/DefaultBindlessNoTangentNoUV1PS.h"
 #include "CompiledShaders/DepthOnlyVS.h"
 #include "CompiledShaders/DepthOnlySkinVS.h"
 #include "CompiledShaders/CutoutDepthVS.h"
 #include "CompiledShaders/CutoutDepthSkinVS.h"
 #include "CompiledShaders/CutoutDepthPS.h"
+#include "CompiledShaders/CutoutDepthBindlessPS.h"
 #include "CompiledShaders/SkyboxVS.h"
 #include "CompiledShaders/SkyboxPS.h"
+#include "CompiledShaders/MeshletAS.h"
+#include "CompiledShaders/MeshletMS.h"
+#include "CompiledShaders/MeshletNoUV1MS.h"
+#include "CompiledShaders/MeshletNoTangentMS.h"
+#include "CompiledShaders/MeshletNoTangentNoUV1MS.h"
+#include "CompiledShaders/MeshletDepthMS.h"
 
 #pragma warning(disable:4319) // '~': zero extending 'uint32_t' to 'uint64_t' of greater size
 
@@ -48,9 +65,96 @@ using namespace Math;
 using namespace Graphics;
 using namespace Renderer;
 
+namespace
+{
+    // MESHLETS_PER_GROUP and kNoConeCulling in Meshlet.hlsli
+    constexpr uint32_t kMeshletsPerGroup = 32;
+    constexpr uint32_t kMeshletNoConeCulling = 0x8000;
+
+    // Meshes with any of these are never split into meshlets
+    constexpr uint16_t kMeshletUnsupportedFlags = PSOFlags::kHasSkin | PSOFlags::kQuantizedPos |
+        PSOFlags::kAlphaBlend | PSOFlags::kAlphaTest;
+
+    //
+    // Sorts the keys with a parallel LSD radix sort, 8 bits at a time, ignoring
+    // the bits below firstBit.  Each pass splits the keys into blocks: the
+    // blocks count their digits in parallel, the counts are turned into each
+    // block's first index for each digit, then the blocks scatter their keys
+    // in parallel.  The passes are stable, so keys that only differ below
+    // firstBit keep their order.  Passes where every key has the same digit,
+    // like the pass ID's high bits, are skipped.
+    //
+    void ParallelRadixSort(std::vector<uint64_t>& keys, uint32_t firstBit)
+    {
+        constexpr uint32_t kDigitBits = 8;
+        constexpr uint32_t kNumDigits = 1 << kDigitBits;
+        constexpr size_t kMinBlockSize = 1024;
+
+        const size_t numKeys = keys.size();
+        const size_t numBlocks = std::max<size_t>(1,
+            std::min<size_t>(std::thread::hardware_concurrency(), numKeys / kMinBlockSize));
+
+        auto blockBegin = [&](size_t block) { return numKeys * block / numBlocks; };
+
+        std::vector<uint64_t> temp(numKeys);
+        std::vector<std::array<size_t, kNumDigits>> offsets(numBlocks);
+        std::vector<size_t> blocks(numBlocks);
+        std::iota(blocks.begin(), blocks.end(), 0);
+
+        std::vector<uint64_t>* src = &keys;
+        std::vector<uint64_t>* dst = &temp;
+
+        for (uint32_t shift = firstBit; shift < 64; shift += kDigitBits)
+        {
+            std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](size_t block)
+            {
+                auto& counts = offsets[block];
+                counts.fill(0);
+                for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i)
+                    ++counts[((*src)[i] >> shift) & (kNumDigits - 1)];
+            });
+
+            size_t offset = 0;
+            bool allTheSame = false;
+            for (uint32_t digit = 0; digit < kNumDigits; ++digit)
+            {
+                size_t digitStart = offset;
+                for (size_t block = 0; block < numBlocks; ++block)
+                {
+                    size_t count = offsets[block][digit];
+                    offsets[block][digit] = offset;
+                    offset += count;
+                }
+                allTheSame |= (offset - digitStart) == numKeys;
+            }
+
+            if (allTheSame)
+                continue;
+
+            std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](size_t block)
+            {
+                auto& next = offsets[block];
+                for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i)
+                {
+                    uint64_t key = (*src)[i];
+                    (*dst)[next[(key >> shift) & (kNumDigits - 1)]++] = key;
+                }
+            });
+
+            std::swap(src, dst);
+        }
+
+        if (src != &keys)
+            keys.swap(temp);
+    }
+}
+
 namespace Renderer
 {
     BoolVar SeparateZPass("Renderer/Separate Z Pass", true);
+    BoolVar ParallelSorter("Renderer/Parallel Mesh Sorter", false);
+    BoolVar UseMeshlets("Renderer/Meshlets", true);
+    BoolVar UseBindless("Renderer/Bindless Materials", true);
 
     bool s_Initialized = false;
 
@@ -60,6 +164,18 @@ namespace Renderer
     std::mutex sm_PSOsMutex;
     std::vector<GraphicsPSO> sm_PSOs;
 
+    // The mesh shader variants of the PSOs in sm_PSOs that have one.  Indexed
+    // by sm_MeshletPSOIndex[psoIdx], which is -1 for the rest, or short.
+    bool s_MeshShadersSupported = false;
+    std::vector<MeshPSO> sm_MeshletPSOs;
+    std::vector<int16_t> sm_MeshletPSOIndex;
+
+    // The bindless variants of the PSOs whose pixel shaders read material
+    // textures are in sm_PSOs too.  sm_BindlessPSOIndex[psoIdx] is the index
+    // of the variant, psoIdx itself for the variants, or -1.
+    bool s_BindlessSupported = false;
+    std::vector<int16_t> sm_BindlessPSOIndex;
+
     TextureRef s_RadianceCubeMap;
     TextureRef s_IrradianceCubeMap;
     float s_SpecularIBLRange;
@@ -74,6 +190,46 @@ namespace Renderer
     DescriptorHandle m_CommonTextures;
 }
 
+// Makes pso the mesh shader variant of sm_PSOs[psoIdx]
+static void AddMeshletPSO(size_t psoIdx, const MeshPSO& pso)
+{
+    sm_MeshletPSOIndex.resize(sm_PSOs.size(), -1);
+    sm_MeshletPSOIndex[psoIdx] = (int16_t)sm_MeshletPSOs.size();
+    sm_MeshletPSOs.push_back(pso);
+}
+
+// Adds pso to sm_PSOs as the bindless variant of sm_PSOs[psoIdx], and returns its index
+static size_t AddBindlessPSO(size_t psoIdx, const GraphicsPSO& pso)
+{
+    const size_t bindlessIdx = sm_PSOs.size();
+    sm_PSOs.push_back(pso);
+    sm_BindlessPSOIndex.resize(sm_PSOs.size(), -1);
+    sm_BindlessPSOIndex[psoIdx] = (int16_t)bindlessIdx;
+    sm_BindlessPSOIndex[bindlessIdx] = (int16_t)bindlessIdx;
+    return bindlessIdx;
+}
+
+// The bindless variant of the pixel shader GetPSO() chooses for psoFlags
+static D3D12_SHADER_BYTECODE GetBindlessPS(uint16_t psoFlags)
+{
+    using namespace PSOFlags;
+
+    if (psoFlags & kHasTangent)
+    {
+        if (psoFlags & kHasUV1)
+            return { g_pDefaultBindlessPS, sizeof(g_pDefaultBindlessPS) };
+        else
+            return { g_pDefaultBindlessNoUV1PS, sizeof(g_pDefaultBindlessNoUV1PS) };
+    }
+    else
+    {
+        if (psoFlags & kHasUV1)
+            return { g_pDefaultBindlessNoTangentPS, sizeof(g_pDefaultBindlessNoTangentPS) };
+        else
+            return { g_pDefaultBindlessNoTangentNoUV1PS, sizeof(g_pDefaultBindlessNoTangentNoUV1PS) };
+    }
+}
+
 void Renderer::Initialize(void)
 {
     if (s_Initialized)
@@ -98,7 +254,28 @@ void Renderer::Initialize(void)
     m_RootSig[kCommonSRVs].InitAsDescriptorRange(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 10, 10, D3D12_SHADER_VISIBILITY_PIXEL);
     m_RootSig[kCommonCBV].InitAsConstantBuffer(1);
     m_RootSig[kSkinMatrices].InitAsBufferSRV(20, D3D12_SHADER_VISIBILITY_VERTEX);
-    m_RootSig.Finalize(L"RootSig", D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
+    m_RootSig[kMeshletConstants].InitAsConstants(2, 8);
+    m_RootSig[kMeshletMeshConstants].InitAsConstantBuffer(3);
+    m_RootSig[kMeshletData].InitAsBufferSRV(21);
+    m_RootSig[kMaterialDescriptors].InitAsConstants(4, 2, D3D12_SHADER_VISIBILITY_PIXEL);
+
+    // Bindless materials index the descriptor heaps from the pixel shader,
+    // which takes shader model 6.6 and resource binding tier 3
+    D3D12_FEATURE_DATA_SHADER_MODEL ShaderModel = { D3D_SHADER_MODEL_6_6 };
+    D3D12_FEATURE_DATA_D3D12_OPTIONS Options = {};
+    s_BindlessSupported =
+        SUCCEEDED(g_Device->CheckFeatureSupport(D3D12_FEATURE_SHADER_MODEL, &ShaderModel, sizeof(ShaderModel))) &&
+        ShaderModel.HighestShaderModel >= D3D_SHADER_MODEL_6_6 &&
+        SUCCEEDED(g_Device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &Options, sizeof(Options))) &&
+        Options.ResourceBindingTier >= D3D12_RESOURCE_BINDING_TIER_3;
+
+    D3D12_ROOT_SIGNATURE_FLAGS RootSigFlags = D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT;
+    if (s_BindlessSupported)
+    {
+        RootSigFlags |= D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED |
+            D3D12_ROOT_SIGNATURE_FLAG_SAMPLER_HEAP_DIRECTLY_INDEXED;
+    }
+    m_RootSig.Finalize(L"RootSig", RootSigFlags);
 
     DXGI_FORMAT ColorFormat = g_SceneColorBuffer.GetFormat();
     DXGI_FORMAT DepthFormat = g_SceneDepthBuffer.GetFormat();
@@ -129,6 +306,17 @@ void Renderer::Initialize(void)
         { "BLENDWEIGHT", 0, DXGI_FORMAT_R16G16B16A16_UNORM, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
     };
 
+    D3D12_INPUT_ELEMENT_DESC quantizedPosOnly[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R16G16B16A16_UNORM, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+
+    D3D12_INPUT_ELEMENT_DESC quantizedPosAndUV[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R16G16B16A16_UNORM, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+        { "TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT,       0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+
     ASSERT(sm_PSOs.size() == 0);
 
     // Depth Only PSOs
@@ -142,7 +330,7 @@ void Renderer::Initialize(void)
     DepthOnlyPSO.SetPrimitiveTopologyType(D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE);
     DepthOnlyPSO.SetRenderTargetFormats(0, nullptr, DepthFormat);
     DepthOnlyPSO.SetVertexShader(g_pDepthOnlyVS, sizeof(g_pDepthOnlyVS));
-    DepthOnlyPSO.Finalize();
+    DepthOnlyPSO.FinalizeAsync();
     sm_PSOs.push_back(DepthOnlyPSO);
 
     GraphicsPSO CutoutDepthPSO(L"Renderer: Cutout Depth PSO");
@@ -151,19 +339,19 @@ void Renderer::Initialize(void)
     CutoutDepthPSO.SetRasterizerState(RasterizerTwoSided);
     CutoutDepthPSO.SetVertexShader(g_pCutoutDepthVS, sizeof(g_pCutoutDepthVS));
     CutoutDepthPSO.SetPixelShader(g_pCutoutDepthPS, sizeof(g_pCutoutDepthPS));
-    CutoutDepthPSO.Finalize();
+    CutoutDepthPSO.FinalizeAsync();
     sm_PSOs.push_back(CutoutDepthPSO);
 
     GraphicsPSO SkinDepthOnlyPSO = DepthOnlyPSO;
     SkinDepthOnlyPSO.SetInputLayout(_countof(skinPos), skinPos);
     SkinDepthOnlyPSO.SetVertexShader(g_pDepthOnlySkinVS, sizeof(g_pDepthOnlySkinVS));
-    SkinDepthOnlyPSO.Finalize();
+    SkinDepthOnlyPSO.FinalizeAsync();
     sm_PSOs.push_back(SkinDepthOnlyPSO);
 
     GraphicsPSO SkinCutoutDepthPSO = CutoutDepthPSO;
     SkinCutoutDepthPSO.SetInputLayout(_countof(skinPosAndUV), skinPosAndUV);
     SkinCutoutDepthPSO.SetVertexShader(g_pCutoutDepthSkinVS, sizeof(g_pCutoutDepthSkinVS));
-    SkinCutoutDepthPSO.Finalize();
+    SkinCutoutDepthPSO.FinalizeAsync();
     sm_PSOs.push_back(SkinCutoutDepthPSO);
 
     ASSERT(sm_PSOs.size() == 4);
@@ -172,26 +360,94 @@ void Renderer::Initialize(void)
 
     DepthOnlyPSO.SetRasterizerState(RasterizerShadow);
     DepthOnlyPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
-    DepthOnlyPSO.Finalize();
+    DepthOnlyPSO.FinalizeAsync();
     sm_PSOs.push_back(DepthOnlyPSO);
 
     CutoutDepthPSO.SetRasterizerState(RasterizerShadowTwoSided);
     CutoutDepthPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
-    CutoutDepthPSO.Finalize();
+    CutoutDepthPSO.FinalizeAsync();
     sm_PSOs.push_back(CutoutDepthPSO);
 
     SkinDepthOnlyPSO.SetRasterizerState(RasterizerShadow);
     SkinDepthOnlyPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
-    SkinDepthOnlyPSO.Finalize();
+    SkinDepthOnlyPSO.FinalizeAsync();
     sm_PSOs.push_back(SkinDepthOnlyPSO);
 
     SkinCutoutDepthPSO.SetRasterizerState(RasterizerShadowTwoSided);
     SkinCutoutDepthPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
-    SkinCutoutDepthPSO.Finalize();
+    SkinCutoutDepthPSO.FinalizeAsync();
     sm_PSOs.push_back(SkinCutoutDepthPSO);
 
     ASSERT(sm_PSOs.size() == 8);
 
+    // Depth Only and Shadow PSOs for quantized positions.  Skinned meshes
+    // are never quantized, so there are no skinned variants.
+
+    DepthOnlyPSO.SetInputLayout(_countof(quantizedPosOnly), quantizedPosOnly);
+    DepthOnlyPSO.SetRasterizerState(RasterizerDefault);
+    DepthOnlyPSO.SetRenderTargetFormats(0, nullptr, DepthFormat);
+    DepthOnlyPSO.FinalizeAsync();
+    sm_PSOs.push_back(DepthOnlyPSO);
+
+    CutoutDepthPSO.SetInputLayout(_countof(quantizedPosAndUV), quantizedPosAndUV);
+    CutoutDepthPSO.SetRasterizerState(RasterizerTwoSided);
+    CutoutDepthPSO.SetRenderTargetFormats(0, nullptr, DepthFormat);
+    CutoutDepthPSO.FinalizeAsync();
+    sm_PSOs.push_back(CutoutDepthPSO);
+
+    DepthOnlyPSO.SetRasterizerState(RasterizerShadow);
+    DepthOnlyPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
+    DepthOnlyPSO.FinalizeAsync();
+    sm_PSOs.push_back(DepthOnlyPSO);
+
+    CutoutDepthPSO.SetRasterizerState(RasterizerShadowTwoSided);
+    CutoutDepthPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
+    CutoutDepthPSO.FinalizeAsync();
+    sm_PSOs.push_back(CutoutDepthPSO);
+
+    ASSERT(sm_PSOs.size() == 12);
+
+    // Mesh shader variants of the unskinned depth only and shadow PSOs, for
+    // meshes with meshlets
+
+    D3D12_FEATURE_DATA_D3D12_OPTIONS7 Options7 = {};
+    s_MeshShadersSupported =
+        SUCCEEDED(g_Device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS7, &Options7, sizeof(Options7))) &&
+        Options7.MeshShaderTier != D3D12_MESH_SHADER_TIER_NOT_SUPPORTED;
+
+    if (s_MeshShadersSupported)
+    {
+        MeshPSO MeshletDepthPSO(L"Renderer: Meshlet Depth Only PSO");
+        MeshletDepthPSO.SetRootSignature(m_RootSig);
+        MeshletDepthPSO.SetRasterizerState(RasterizerDefault);
+        MeshletDepthPSO.SetBlendState(BlendDisable);
+        MeshletDepthPSO.SetDepthStencilState(DepthStateReadWrite);
+        MeshletDepthPSO.SetRenderTargetFormats(0, nullptr, DepthFormat);
+        MeshletDepthPSO.SetAmplificationShader(g_pMeshletAS, sizeof(g_pMeshletAS));
+        MeshletDepthPSO.SetMeshShader(g_pMeshletDepthMS, sizeof(g_pMeshletDepthMS));
+        MeshletDepthPSO.FinalizeAsync();
+        AddMeshletPSO(GetDepthPSO(0, false), MeshletDepthPSO);
+
+        MeshletDepthPSO.SetRasterizerState(RasterizerShadow);
+        MeshletDepthPSO.SetRenderTargetFormats(0, nullptr, g_ShadowBuffer.GetFormat());
+        MeshletDepthPSO.FinalizeAsync();
+        AddMeshletPSO(GetDepthPSO(0, true), MeshletDepthPSO);
+    }
+
+    // Bindless variants of the cutout depth and shadow PSOs, which are the
+    // ones with odd indices
+
+    if (s_BindlessSupported)
+    {
+        for (size_t psoIdx = 1; psoIdx < 12; psoIdx += 2)
+        {
+            GraphicsPSO BindlessPSO = sm_PSOs[psoIdx];
+            BindlessPSO.SetPixelShader(g_pCutoutDepthBindlessPS, sizeof(g_pCutoutDepthBindlessPS));
+            BindlessPSO.FinalizeAsync();
+            AddBindlessPSO(psoIdx, BindlessPSO);
+        }
+    }
+
     // Default PSO
 
     m_DefaultPSO.SetRootSignature(m_RootSig);
@@ -211,7 +467,7 @@ void Renderer::Initialize(void)
     m_SkyboxPSO.SetInputLayout(0, nullptr);
     m_SkyboxPSO.SetVertexShader(g_pSkyboxVS, sizeof(g_pSkyboxVS));
     m_SkyboxPSO.SetPixelShader(g_pSkyboxPS, sizeof(g_pSkyboxPS));
-    m_SkyboxPSO.Finalize();
+    m_SkyboxPSO.FinalizeAsync();
 
     TextureManager::Initialize(L"");
 
@@ -221,6 +477,10 @@ void Renderer::Initialize(void)
     s_SamplerHeap.Create(L"Scene Sampler Descriptors", D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER, 2048);
 
     Lighting::InitializeResources();
+    InstanceBatch::InitializeResources();
+
+    // 16 MB of mesh constants.  Instances that don't fit use their own buffers.
+    MeshConstantsPool::Initialize(64 * 1024);
 
     // Allocate a descriptor table for the common textures
     m_CommonTextures = s_TextureHeap.Alloc(8);
@@ -309,6 +569,8 @@ void Renderer::Shutdown(void)
 {
     s_RadianceCubeMap = nullptr;
     s_IrradianceCubeMap = nullptr;
+    InstanceBatch::Shutdown();
+    MeshConstantsPool::Shutdown();
     TextureManager::Shutdown();
     s_TextureHeap.Destroy();
     s_SamplerHeap.Destroy();
@@ -324,7 +586,9 @@ uint8_t Renderer::GetPSO(uint16_t psoFlags)
     ASSERT((psoFlags & Requirements) == Requirements);
 
     std::vector<D3D12_INPUT_ELEMENT_DESC> vertexLayout;
-    if (psoFlags & kHasPosition)
+    if (psoFlags & kQuantizedPos)
+        vertexLayout.push_back({"POSITION", 0, DXGI_FORMAT_R16G16B16A16_UNORM, 0, D3D12_APPEND_ALIGNED_ELEMENT});
+    else if (psoFlags & kHasPosition)
         vertexLayout.push_back({"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT,    0, D3D12_APPEND_ALIGNED_ELEMENT});
     if (psoFlags & kHasNormal)
         vertexLayout.push_back({"NORMAL",   0, DXGI_FORMAT_R10G10B10A2_UNORM,  0, D3D12_APPEND_ALIGNED_ELEMENT});
@@ -412,14 +676,16 @@ uint8_t Renderer::GetPSO(uint16_t psoFlags)
     {
         ColorPSO.SetRasterizerState(RasterizerTwoSided);
     }
+    // This one is compiled now, so the variants below can fall back to it
     ColorPSO.Finalize();
 
     std::unique_lock<std::mutex> psosLock(sm_PSOsMutex);
 
-    // Look for an existing PSO
+    // Look for an existing PSO.  The hash codes identify PSOs that are still
+    // compiling, and ones that are drawing with a fallback.
     for (uint32_t i = 0; i < sm_PSOs.size(); ++i)
     {
-        if (ColorPSO.GetPipelineStateObject() == sm_PSOs[i].GetPipelineStateObject())
+        if (ColorPSO.GetHashCode() == sm_PSOs[i].GetHashCode())
         {
             return (uint8_t)i;
         }
@@ -429,17 +695,119 @@ uint8_t Renderer::GetPSO(uint16_t psoFlags)
     sm_PSOs.push_back(ColorPSO);
 
     // The returned PSO index has read-write depth.  The index+1 tests for equal depth.
+    // Until that compiles, the read-write one passes the same pixels after the
+    // depth prepass, so it draws in its place.
     ColorPSO.SetDepthStencilState(DepthStateTestEqual);
-    ColorPSO.Finalize();
+    ColorPSO.FinalizeAsync(&sm_PSOs.back());
 #ifdef DEBUG
     for (uint32_t i = 0; i < sm_PSOs.size(); ++i)
-        ASSERT(ColorPSO.GetPipelineStateObject() != sm_PSOs[i].GetPipelineStateObject());
+        ASSERT(ColorPSO.GetHashCode() != sm_PSOs[i].GetHashCode());
 #endif
     sm_PSOs.push_back(ColorPSO);
 
+    const size_t ColorPSOIdx = sm_PSOs.size() - 2;
+
+    // And the same pair with bindless materials
+    size_t BindlessPSOIdx = 0;
+    if (s_BindlessSupported)
+    {
+        ColorPSO.SetPixelShader(GetBindlessPS(psoFlags));
+        ColorPSO.SetDepthStencilState((psoFlags & kAlphaBlend) ? DepthStateReadOnly : DepthStateReadWrite);
+        ColorPSO.FinalizeAsync();
+        BindlessPSOIdx = AddBindlessPSO(ColorPSOIdx, ColorPSO);
+
+        ColorPSO.SetDepthStencilState(DepthStateTestEqual);
+        ColorPSO.FinalizeAsync();
+        AddBindlessPSO(ColorPSOIdx + 1, ColorPSO);
+    }
+
     ASSERT(sm_PSOs.size() <= 256, "Ran out of room for unique PSOs");
 
-    return (uint8_t)sm_PSOs.size() - 2;
+    // And the same pairs with mesh shaders, if the mesh can have meshlets
+    if (s_MeshShadersSupported && (psoFlags & kMeshletUnsupportedFlags) == 0)
+    {
+        MeshPSO MeshletPSO(L"Renderer: Meshlet PSO");
+        MeshletPSO.SetRootSignature(m_RootSig);
+        MeshletPSO.SetRasterizerState((psoFlags & kTwoSided) ? RasterizerTwoSided : RasterizerDefault);
+        MeshletPSO.SetBlendState(BlendDisable);
+        MeshletPSO.SetDepthStencilState(DepthStateReadWrite);
+        MeshletPSO.SetRenderTargetFormat(g_SceneColorBuffer.GetFormat(), g_SceneDepthBuffer.GetFormat());
+        MeshletPSO.SetAmplificationShader(g_pMeshletAS, sizeof(g_pMeshletAS));
+
+        if (psoFlags & kHasTangent)
+        {
+            if (psoFlags & kHasUV1)
+            {
+                MeshletPSO.SetMeshShader(g_pMeshletMS, sizeof(g_pMeshletMS));
+                MeshletPSO.SetPixelShader(g_pDefaultPS, sizeof(g_pDefaultPS));
+            }
+            else
+            {
+                MeshletPSO.SetMeshShader(g_pMeshletNoUV1MS, sizeof(g_pMeshletNoUV1MS));
+                MeshletPSO.SetPixelShader(g_pDefaultNoUV1PS, sizeof(g_pDefaultNoUV1PS));
+            }
+        }
+        else
+        {
+            if (psoFlags & kHasUV1)
+            {
+                MeshletPSO.SetMeshShader(g_pMeshletNoTangentMS, sizeof(g_pMeshletNoTangentMS));
+                MeshletPSO.SetPixelShader(g_pDefaultNoTangentPS, sizeof(g_pDefaultNoTangentPS));
+            }
+            else
+            {
+                MeshletPSO.SetMeshShader(g_pMeshletNoTangentNoUV1MS, sizeof(g_pMeshletNoTangentNoUV1MS));
+                MeshletPSO.SetPixelShader(g_pDefaultNoTangentNoUV1PS, sizeof(g_pDefaultNoTangentNoUV1PS));
+            }
+        }
+
+        MeshletPSO.FinalizeAsync();
+        AddMeshletPSO(ColorPSOIdx, MeshletPSO);
+
+        MeshletPSO.SetDepthStencilState(DepthStateTestEqual);
+        MeshletPSO.FinalizeAsync();
+        AddMeshletPSO(ColorPSOIdx + 1, MeshletPSO);
+
+        if (s_BindlessSupported)
+        {
+            MeshletPSO.SetPixelShader(GetBindlessPS(psoFlags));
+            MeshletPSO.SetDepthStencilState(DepthStateReadWrite);
+            MeshletPSO.FinalizeAsync();
+            AddMeshletPSO(BindlessPSOIdx, MeshletPSO);
+
+            MeshletPSO.SetDepthStencilState(DepthStateTestEqual);
+            MeshletPSO.FinalizeAsync();
+            AddMeshletPSO(BindlessPSOIdx + 1, MeshletPSO);
+        }
+    }
+
+    return (uint8_t)ColorPSOIdx;
+}
+
+uint32_t Renderer::GetDrawPSO(uint32_t psoIdx)
+{
+    if (UseBindless && psoIdx < sm_BindlessPSOIndex.size() && sm_BindlessPSOIndex[psoIdx] >= 0)
+        return (uint32_t)sm_BindlessPSOIndex[psoIdx];
+
+    return psoIdx;
+}
+
+bool Renderer::IsBindlessPSO(uint32_t psoIdx)
+{
+    return psoIdx < sm_BindlessPSOIndex.size() && sm_BindlessPSOIndex[psoIdx] == (int16_t)psoIdx;
+}
+
+void Renderer::SetMaterialTextures(GraphicsContext& context, uint32_t psoIdx, uint32_t srvTable, uint32_t samplerTable)
+{
+    if (IsBindlessPSO(psoIdx))
+    {
+        context.SetConstants(kMaterialDescriptors, srvTable, samplerTable);
+    }
+    else
+    {
+        context.SetDescriptorTable(kMaterialSRVs, s_TextureHeap[srvTable]);
+        context.SetDescriptorTable(kMaterialSamplers, s_SamplerHeap[samplerTable]);
+    }
 }
 
 void Renderer::DrawSkybox( GraphicsContext& gfxContext, const Camera& Camera, const D3D12_VIEWPORT& viewport, const D3D12_RECT& scissor )
@@ -475,19 +843,45 @@ void Renderer::DrawSkybox( GraphicsContext& gfxContext, const Camera& Camera, co
     gfxContext.Draw(3);
 }
 
+uint8_t Renderer::GetDepthPSO(uint16_t psoFlags, bool shadows)
+{
+    bool alphaTest = (psoFlags & PSOFlags::kAlphaTest) == PSOFlags::kAlphaTest;
+    bool skinned = (psoFlags & PSOFlags::kHasSkin) == PSOFlags::kHasSkin;
+    bool quantized = (psoFlags & PSOFlags::kQuantizedPos) == PSOFlags::kQuantizedPos;
+
+    // See the order the PSOs are created in Initialize
+    if (quantized)
+    {
+        ASSERT(!skinned, "Skinned meshes can't have quantized positions");
+        return (uint8_t)(8 + (shadows ? 2 : 0) + (alphaTest ? 1 : 0));
+    }
+    return (uint8_t)((shadows ? 4 : 0) + (skinned ? 2 : 0) + (alphaTest ? 1 : 0));
+}
+
+uint32_t Renderer::GetDepthVertexStride(const Mesh& mesh)
+{
+    uint32_t stride = (mesh.psoFlags & PSOFlags::kQuantizedPos) ? 8u : 12u;
+    if (mesh.psoFlags & PSOFlags::kAlphaTest)
+        stride += 4;
+    if (mesh.numJoints > 0)
+        stride += 16;
+    return stride;
+}
+
 void MeshSorter::AddMesh( const Mesh& mesh, float distance,
     D3D12_GPU_VIRTUAL_ADDRESS meshCBV,
     D3D12_GPU_VIRTUAL_ADDRESS materialCBV,
     D3D12_GPU_VIRTUAL_ADDRESS bufferPtr,
-    const Joint* skeleton)
+    D3D12_GPU_VIRTUAL_ADDRESS skeleton,
+    const MeshletMesh* meshlets)
 {
     SortKey key;
     key.value = m_SortObjects.size();
 
 	bool alphaBlend = (mesh.psoFlags & PSOFlags::kAlphaBlend) == PSOFlags::kAlphaBlend;
     bool alphaTest = (mesh.psoFlags & PSOFlags::kAlphaTest) == PSOFlags::kAlphaTest;
-    bool skinned = (mesh.psoFlags & PSOFlags::kHasSkin) == PSOFlags::kHasSkin;
-    uint64_t depthPSO = (skinned ? 2 : 0) + (alphaTest ? 1 : 0);
+    uint64_t depthPSO = GetDepthPSO(mesh.psoFlags, false);
+    uint64_t shadowPSO = GetDepthPSO(mesh.psoFlags, true);
 
     union float_or_int { float f; uint32_t u; } dist;
     dist.f = Max(distance, 0.0f);
@@ -498,7 +892,7 @@ void MeshSorter::AddMesh( const Mesh& mesh, float distance,
 			return;
 
 		key.passID = kZPass;
-		key.psoIdx = depthPSO + 4;
+		key.psoIdx = shadowPSO;
         key.key = dist.u;
 		m_SortKeys.push_back(key.value);
 		m_PassCounts[kZPass]++;
@@ -534,12 +928,63 @@ void MeshSorter::AddMesh( const Mesh& mesh, float distance,
         m_PassCounts[kOpaque]++;
     }
 
-    SortObject object = { &mesh, skeleton, meshCBV, materialCBV, bufferPtr };
+    if (meshlets != nullptr && meshlets->numMeshlets == 0)
+        meshlets = nullptr;
+
+    SortObject object = { &mesh, skeleton, meshCBV, materialCBV, bufferPtr, meshlets };
     m_SortObjects.push_back(object);
 }
 
+void MeshSorter::AddInParallel(size_t count, const std::function<void(MeshSorter&, size_t)>& addMeshes)
+{
+    const size_t numWorkers = ParallelSorter ?
+        std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count / kMinItemsPerWorker) : 0;
+
+    if (numWorkers <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            addMeshes(*this, i);
+        return;
+    }
+
+    // Each worker adds a contiguous range of the items to its own sorter
+    std::vector<MeshSorter> workers(numWorkers, MeshSorter(m_BatchType));
+    std::vector<size_t> indices(numWorkers);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    std::for_each(std::execution::par, indices.begin(), indices.end(), [&](size_t w)
+    {
+        MeshSorter& worker = workers[w];
+        worker.m_Camera = m_Camera;
+        for (size_t i = count * w / numWorkers; i < count * (w + 1) / numWorkers; ++i)
+            addMeshes(worker, i);
+    });
+
+    // Appended in order, so the keys are in the same order as if the items
+    // had been added here one by one
+    for (MeshSorter& worker : workers)
+    {
+        const uint64_t baseObject = m_SortObjects.size();
+        ASSERT(baseObject + worker.m_SortObjects.size() <= (1 << kObjectIdxBits), "Too many objects to sort");
+
+        m_SortObjects.insert(m_SortObjects.end(), worker.m_SortObjects.begin(), worker.m_SortObjects.end());
+        for (uint64_t key : worker.m_SortKeys)
+            m_SortKeys.push_back(key + baseObject);
+        for (uint32_t i = 0; i < kNumPasses; ++i)
+            m_PassCounts[i] += worker.m_PassCounts[i];
+    }
+}
+
 void MeshSorter::Sort()
 {
+    if (ParallelSorter && m_SortKeys.size() >= kMinParallelSortKeys)
+    {
+        // The keys were added in object order, so the object index bits don't
+        // need sorting
+        ParallelRadixSort(m_SortKeys, kObjectIdxBits);
+        return;
+    }
+
     struct { bool operator()(uint64_t a, uint64_t b) const { return a < b; } } Cmp;
     std::sort(m_SortKeys.begin(), m_SortKeys.end(), Cmp);
 }
@@ -554,20 +999,20 @@ void MeshSorter::RenderMeshes(
 
     Renderer::UpdateGlobalDescriptors();
 
-    context.SetRootSignature(m_RootSig);
-    context.SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    context.SetDescriptorHeap(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, s_TextureHeap.GetHeapPointer());
-    context.SetDescriptorHeap(D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER, s_SamplerHeap.GetHeapPointer());
-
-    // Set common textures
-    context.SetDescriptorTable(kCommonSRVs, m_CommonTextures);
+    // The batch is culled once, before any of its passes are drawn
+    if (m_InstanceBatch != nullptr && !m_InstanceBatchCulled)
+    {
+        m_InstanceBatch->Cull(m_BatchType, *m_Camera, context);
+        m_InstanceBatchCulled = true;
+    }
 
     // Set common shader constants
 	globals.ViewProjMatrix = m_Camera->GetViewProjMatrix();
 	globals.CameraPos = m_Camera->GetPosition();
     globals.IBLRange = s_SpecularIBLRange - s_SpecularIBLBias;
     globals.IBLBias = s_SpecularIBLBias;
-	context.SetDynamicConstantBufferView(kCommonCBV, sizeof(GlobalConstants), &globals);
+
+    SetCommonState(context, globals);
 
 	if (m_BatchType == kShadows)
 	{
@@ -618,86 +1063,246 @@ void MeshSorter::RenderMeshes(
     for ( ; m_CurrentPass <= pass; m_CurrentPass = (DrawPass)(m_CurrentPass + 1))
     {
         const uint32_t passCount = m_PassCounts[m_CurrentPass];
-        if (passCount == 0)
+        const bool batchHasDraws = m_InstanceBatch != nullptr && m_InstanceBatch->HasDraws(m_BatchType, m_CurrentPass);
+        if (passCount == 0 && !batchHasDraws)
             continue;
 
-		if (m_BatchType == kDefault)
-		{
-			switch (m_CurrentPass)
-			{
-			case kZPass:
-				context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_WRITE);
-				context.SetDepthStencilTarget(m_DSV->GetDSV());
-				break;
-			case kOpaque:
-				if (SeparateZPass)
-				{
-					context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_READ);
-					context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
-					context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV_DepthReadOnly());
-				}
-				else
-				{
-					context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_WRITE);
-					context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
-					context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV());
-				}
-				break;
-			case kTransparent:
-				context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_READ);
-				context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
-				context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV_DepthReadOnly());
-				break;
-			}
-		}
+        SetPassTargets(context, true);
 
         context.SetViewportAndScissor(m_Viewport, m_Scissor);
         context.FlushResourceBarriers();
 
         const uint32_t lastDraw = m_CurrentDraw + passCount;
 
-        while (m_CurrentDraw < lastDraw)
+        if (ParallelSorter && passCount >= 2 * kMinDrawsPerContext)
+            DrawMeshesInParallel(context, globals, m_CurrentDraw, lastDraw);
+        else
+            DrawMeshes(context, m_CurrentDraw, lastDraw);
+
+        m_CurrentDraw = lastDraw;
+
+        if (batchHasDraws)
+            m_InstanceBatch->Render(m_BatchType, m_CurrentPass, context);
+    }
+
+	if (m_BatchType == kShadows)
+	{
+		context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+	}
+}
+
+void MeshSorter::SetCommonState(GraphicsContext& context, const GlobalConstants& globals) const
+{
+    context.SetRootSignature(m_RootSig);
+    context.SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    context.SetDescriptorHeap(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, s_TextureHeap.GetHeapPointer());
+    context.SetDescriptorHeap(D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER, s_SamplerHeap.GetHeapPointer());
+
+    // Set common textures
+    context.SetDescriptorTable(kCommonSRVs, m_CommonTextures);
+
+    // Set common shader constants
+    context.SetDynamicConstantBufferView(kCommonCBV, sizeof(GlobalConstants), &globals);
+}
+
+//
+// Sets the current pass's render targets.  The contexts that record a pass in
+// parallel don't transition them: the main context already has, and resource
+// states aren't tracked per context.
+//
+void MeshSorter::SetPassTargets(GraphicsContext& context, bool transition) const
+{
+    if (m_BatchType == kShadows)
+    {
+        // The shadow map was transitioned and cleared when RenderMeshes started
+        context.SetDepthStencilTarget(m_DSV->GetDSV());
+        return;
+    }
+
+    switch (m_CurrentPass)
+    {
+    case kZPass:
+        if (transition)
+            context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+        context.SetDepthStencilTarget(m_DSV->GetDSV());
+        break;
+    case kOpaque:
+        if (SeparateZPass)
+        {
+            if (transition)
+            {
+                context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_READ);
+                context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+            }
+            context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV_DepthReadOnly());
+        }
+        else
+        {
+            if (transition)
+            {
+                context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+                context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+            }
+            context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV());
+        }
+        break;
+    case kTransparent:
+        if (transition)
         {
-            SortKey key;
-            key.value = m_SortKeys[m_CurrentDraw];
-            const SortObject& object = m_SortObjects[key.objectIdx];
-            const Mesh& mesh = *object.mesh;
+            context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_DEPTH_READ);
+            context.TransitionResource(g_SceneColorBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+        }
+        context.SetRenderTarget(g_SceneColorBuffer.GetRTV(), m_DSV->GetDSV_DepthReadOnly());
+        break;
+    }
+}
 
-            context.SetConstantBuffer(kMeshConstants, object.meshCBV);
+void MeshSorter::DrawMeshes(GraphicsContext& context, uint32_t firstDraw, uint32_t lastDraw) const
+{
+    // Meshes that share a material, or just its textures or samplers,
+    // don't set them again.  The PSO is already filtered by the context.
+    D3D12_GPU_VIRTUAL_ADDRESS lastMaterialCBV = 0;
+    uint32_t lastSrvTable = ~0u;
+    uint32_t lastSamplerTable = ~0u;
+    uint32_t lastMaterialDescriptors = ~0u;
+
+    for (uint32_t draw = firstDraw; draw < lastDraw; ++draw)
+    {
+        SortKey key;
+        key.value = m_SortKeys[draw];
+        const SortObject& object = m_SortObjects[key.objectIdx];
+        const Mesh& mesh = *object.mesh;
+        const uint32_t psoIdx = GetDrawPSO(key.psoIdx);
+
+        context.SetConstantBuffer(kMeshConstants, object.meshCBV);
+        if (object.materialCBV != lastMaterialCBV)
+        {
             context.SetConstantBuffer(kMaterialConstants, object.materialCBV);
-            context.SetDescriptorTable(kMaterialSRVs, s_TextureHeap[mesh.srvTable]);
-            context.SetDescriptorTable(kMaterialSamplers, s_SamplerHeap[mesh.samplerTable]);
-            if (mesh.numJoints > 0)
+            lastMaterialCBV = object.materialCBV;
+        }
+        if (IsBindlessPSO(psoIdx))
+        {
+            // Two root constants instead of two descriptor tables
+            const uint32_t materialDescriptors = (uint32_t)mesh.samplerTable << 16 | mesh.srvTable;
+            if (materialDescriptors != lastMaterialDescriptors)
             {
-                ASSERT(object.skeleton != nullptr, "Unspecified joint matrix array");
-                context.SetDynamicSRV(kSkinMatrices, sizeof(Joint) * mesh.numJoints, object.skeleton + mesh.startJoint);
+                context.SetConstants(kMaterialDescriptors, mesh.srvTable, mesh.samplerTable);
+                lastMaterialDescriptors = materialDescriptors;
             }
-            context.SetPipelineState(sm_PSOs[key.psoIdx]);
-
-            if (m_CurrentPass == kZPass)
+        }
+        else
+        {
+            if (mesh.srvTable != lastSrvTable)
             {
-                bool alphaTest = (mesh.psoFlags & PSOFlags::kAlphaTest) == PSOFlags::kAlphaTest;
-                uint32_t stride = alphaTest ? 16u : 12u;
-                if (mesh.numJoints > 0)
-                    stride += 16;
-                context.SetVertexBuffer(0, {object.bufferPtr + mesh.vbDepthOffset, mesh.vbDepthSize, stride});
+                context.SetDescriptorTable(kMaterialSRVs, s_TextureHeap[mesh.srvTable]);
+                lastSrvTable = mesh.srvTable;
             }
-            else
+            if (mesh.samplerTable != lastSamplerTable)
             {
-                context.SetVertexBuffer(0, {object.bufferPtr + mesh.vbOffset, mesh.vbSize, mesh.vbStride});
+                context.SetDescriptorTable(kMaterialSamplers, s_SamplerHeap[mesh.samplerTable]);
+                lastSamplerTable = mesh.samplerTable;
             }
+        }
+        if (mesh.numJoints > 0)
+        {
+            ASSERT(object.skeleton != 0, "Unspecified joint matrix array");
+            context.SetShaderResourceView(kSkinMatrices, object.skeleton + sizeof(Joint) * mesh.startJoint);
+        }
 
-            context.SetIndexBuffer({object.bufferPtr + mesh.ibOffset, mesh.ibSize, (DXGI_FORMAT)mesh.ibFormat});
+        // Meshes with meshlets are drawn with mesh shaders, if their PSO has them
+        if (object.meshlets != nullptr && UseMeshlets && psoIdx < sm_MeshletPSOIndex.size() &&
+            sm_MeshletPSOIndex[psoIdx] >= 0)
+        {
+            DrawMeshlets(context, object, sm_MeshletPSOs[sm_MeshletPSOIndex[psoIdx]]);
+            continue;
+        }
 
-            for (uint32_t i = 0; i < mesh.numDraws; ++i)
-                context.DrawIndexed(mesh.draw[i].primCount, mesh.draw[i].startIndex, mesh.draw[i].baseVertex);
+        context.SetPipelineState(sm_PSOs[psoIdx]);
 
-            ++m_CurrentDraw;
+        if (m_CurrentPass == kZPass)
+        {
+            context.SetVertexBuffer(0,
+                {object.bufferPtr + mesh.vbDepthOffset, mesh.vbDepthSize, GetDepthVertexStride(mesh)});
+        }
+        else
+        {
+            context.SetVertexBuffer(0, {object.bufferPtr + mesh.vbOffset, mesh.vbSize, mesh.vbStride});
         }
+
+        context.SetIndexBuffer({object.bufferPtr + mesh.ibOffset, mesh.ibSize, (DXGI_FORMAT)mesh.ibFormat});
+
+        for (uint32_t i = 0; i < mesh.numDraws; ++i)
+            context.DrawIndexed(mesh.draw[i].primCount, mesh.draw[i].startIndex, mesh.draw[i].baseVertex);
     }
+}
 
-	if (m_BatchType == kShadows)
-	{
-		context.TransitionResource(*m_DSV, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
-	}
+void MeshSorter::DrawMeshlets(GraphicsContext& context, const SortObject& object, const MeshPSO& pso) const
+{
+    const Mesh& mesh = *object.mesh;
+    const MeshletMesh& meshlets = *object.meshlets;
+
+    // Shadows aren't drawn from the viewer, and two-sided meshes have no back
+    // faces, so their meshlets can't be culled by their normal cones
+    uint32_t flags = mesh.psoFlags;
+    if (m_BatchType == kShadows || (mesh.psoFlags & PSOFlags::kTwoSided))
+        flags |= kMeshletNoConeCulling;
+
+    // MeshletConstants in Meshlet.hlsli
+    const uint32_t constants[] =
+    {
+        mesh.vbOffset,
+        mesh.vbStride,
+        meshlets.meshletOffset,
+        meshlets.cullDataOffset,
+        meshlets.vertexIndexOffset,
+        meshlets.primitiveOffset,
+        meshlets.numMeshlets,
+        flags,
+    };
+
+    context.SetPipelineState(pso);
+    context.SetConstantArray(kMeshletConstants, _countof(constants), constants);
+    context.SetConstantBuffer(kMeshletMeshConstants, object.meshCBV);
+    context.SetShaderResourceView(kMeshletData, object.bufferPtr);
+    context.DispatchMesh(Math::DivideByMultiple(meshlets.numMeshlets, kMeshletsPerGroup));
+}
+
+//
+// Records the draws on several contexts at once.  The contexts are submitted in
+// order, after what the main context has recorded so far, so the GPU sees the
+// same sequence it would from one context.
+//
+void MeshSorter::DrawMeshesInParallel(GraphicsContext& context, const GlobalConstants& globals,
+    uint32_t firstDraw, uint32_t lastDraw) const
+{
+    context.Flush();
+
+    const uint32_t numDraws = lastDraw - firstDraw;
+    const uint32_t numContexts = std::min(std::max(1u, std::thread::hardware_concurrency()),
+        numDraws / kMinDrawsPerContext);
+
+    std::vector<GraphicsContext*> contexts(numContexts);
+    for (auto& workerContext : contexts)
+        workerContext = &GraphicsContext::Begin();
+
+    std::vector<uint32_t> indices(numContexts);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    std::for_each(std::execution::par, indices.begin(), indices.end(), [&](uint32_t i)
+    {
+        GraphicsContext& workerContext = *contexts[i];
+        SetCommonState(workerContext, globals);
+        SetPassTargets(workerContext, false);
+        workerContext.SetViewportAndScissor(m_Viewport, m_Scissor);
+        DrawMeshes(workerContext,
+            firstDraw + numDraws * i / numContexts, firstDraw + numDraws * (i + 1) / numContexts);
+    });
+
+    for (auto workerContext : contexts)
+        workerContext->Finish();
+
+    // Flush kept the root signature, PSO and heaps, but not the rest
+    SetCommonState(context, globals);
+    SetPassTargets(context, false);
+    context.SetViewportAndScissor(m_Viewport, m_Scissor);
 }
@@ -20,22 +20,30 @@
 #include "../Core/UploadBuffer.h"
 #include "../Core/TextureManager.h"
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #include <d3d12.h>
 
 class GraphicsPSO;
+class MeshPSO;
 class RootSignature;
 class DescriptorHeap;
 class ShadowCamera;
 class ShadowBuffer;
 struct GlobalConstants;
 struct Mesh;
+struct MeshletMesh;
 struct Joint;
 
 namespace Renderer
 {
+    class InstanceBatch;
+
     extern BoolVar SeparateZPass;
+    extern BoolVar ParallelSorter;
+    extern BoolVar UseMeshlets;
+    extern BoolVar UseBindless;
 
     using namespace Math;
 
@@ -54,6 +62,10 @@ namespace Renderer
         kCommonSRVs,
         kCommonCBV,
         kSkinMatrices,
+        kMeshletConstants,      // MeshletConstants in Meshlet.hlsli
+        kMeshletMeshConstants,  // The mesh constants again, visible to the amplification and mesh shaders
+        kMeshletData,           // The model's data buffer, read by the mesh shaders
+        kMaterialDescriptors,   // The material's SRV and sampler table offsets, for the bindless pixel shaders
 
         kNumRootBindings
     };
@@ -62,6 +74,20 @@ namespace Renderer
     void Shutdown(void);
 
     uint8_t GetPSO(uint16_t psoFlags);
+    uint8_t GetDepthPSO(uint16_t psoFlags, bool shadows);
+    uint32_t GetDepthVertexStride(const Mesh& mesh);
+
+    // The PSO to draw with in place of sm_PSOs[psoIdx].  With bindless materials
+    // it's the variant whose pixel shader reads the material's textures and
+    // samplers straight from the descriptor heaps, if there is one.
+    uint32_t GetDrawPSO(uint32_t psoIdx);
+    bool IsBindlessPSO(uint32_t psoIdx);
+
+    // Binds the material's textures, at srvTable in s_TextureHeap, and its
+    // samplers, at samplerTable in s_SamplerHeap, for sm_PSOs[psoIdx].  The
+    // bindless PSOs take the offsets as root constants instead of tables.
+    void SetMaterialTextures(GraphicsContext& context, uint32_t psoIdx, uint32_t srvTable, uint32_t samplerTable);
+
     void SetIBLTextures(TextureRef diffuseIBL, TextureRef specularIBL);
     void SetIBLBias(float LODBias);
     void UpdateGlobalDescriptors(void);
@@ -86,6 +112,8 @@ namespace Renderer
 			std::memset(m_PassCounts, 0, sizeof(m_PassCounts));
 			m_CurrentPass = kZPass;
 			m_CurrentDraw = 0;
+			m_InstanceBatch = nullptr;
+			m_InstanceBatchCulled = false;
 		}
 
 		void SetCamera( const BaseCamera& camera ) { m_Camera = &camera; }
@@ -106,7 +134,18 @@ namespace Renderer
             D3D12_GPU_VIRTUAL_ADDRESS meshCBV,
             D3D12_GPU_VIRTUAL_ADDRESS materialCBV,
             D3D12_GPU_VIRTUAL_ADDRESS bufferPtr,
-            const Joint* skeleton = nullptr);
+            D3D12_GPU_VIRTUAL_ADDRESS skeleton = 0,
+            const MeshletMesh* meshlets = nullptr);
+
+        // Calls addMeshes for each of count items, such as model instances, to
+        // add the item's meshes to the sorter it is given.  With the parallel
+        // sorter the items are split between threads that each fill their own
+        // sorter, and these are merged in order.
+        void AddInParallel(size_t count, const std::function<void(MeshSorter&, size_t)>& addMeshes);
+
+        // The batch is culled and drawn along with this sorter's meshes, after
+        // the sorted meshes of each pass.
+        void AddInstanceBatch( InstanceBatch& batch ) { m_InstanceBatch = &batch; }
 
         void Sort();
 
@@ -114,6 +153,13 @@ namespace Renderer
 
     private:
 
+        static constexpr uint32_t kObjectIdxBits = 16;
+
+        // The parallel sorter only splits up work when there's enough of it
+        static constexpr size_t kMinItemsPerWorker = 64;
+        static constexpr size_t kMinParallelSortKeys = 8192;
+        static constexpr uint32_t kMinDrawsPerContext = 512;
+
         struct SortKey
         {
             union
@@ -121,7 +167,7 @@ namespace Renderer
                 uint64_t value;
                 struct
                 {
-                    uint64_t objectIdx : 16;
+                    uint64_t objectIdx : kObjectIdxBits;
                     uint64_t psoIdx : 12;
                     uint64_t key : 32;
                     uint64_t passID : 4;
@@ -132,18 +178,28 @@ namespace Renderer
         struct SortObject
         {
             const Mesh* mesh;
-            const Joint* skeleton;
+            D3D12_GPU_VIRTUAL_ADDRESS skeleton;
             D3D12_GPU_VIRTUAL_ADDRESS meshCBV;
             D3D12_GPU_VIRTUAL_ADDRESS materialCBV;
             D3D12_GPU_VIRTUAL_ADDRESS bufferPtr;
+            const MeshletMesh* meshlets; // Null, or drawn with mesh shaders when the PSO has a meshlet variant
         };
 
+        void SetCommonState(GraphicsContext& context, const GlobalConstants& globals) const;
+        void SetPassTargets(GraphicsContext& context, bool transition) const;
+        void DrawMeshes(GraphicsContext& context, uint32_t firstDraw, uint32_t lastDraw) const;
+        void DrawMeshlets(GraphicsContext& context, const SortObject& object, const MeshPSO& pso) const;
+        void DrawMeshesInParallel(GraphicsContext& context, const GlobalConstants& globals,
+            uint32_t firstDraw, uint32_t lastDraw) const;
+
         std::vector<SortObject> m_SortObjects;
         std::vector<uint64_t> m_SortKeys;
 		BatchType m_BatchType;
         uint32_t m_PassCounts[kNumPasses];
         DrawPass m_CurrentPass;
         uint32_t m_CurrentDraw;
+        InstanceBatch* m_InstanceBatch;
+        bool m_InstanceBatchCulled;
 
 		const BaseCamera* m_Camera;
 		D3D12_VIEWPORT m_Viewport;
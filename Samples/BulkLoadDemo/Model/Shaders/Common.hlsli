@@ -21,6 +21,16 @@
 
 #define Renderer_RootSig \
     "RootFlags(ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT), " \
+    Renderer_RootParameters
+
+// For the shaders that index the descriptor heaps with ResourceDescriptorHeap[]
+// and SamplerDescriptorHeap[]
+#define Renderer_BindlessRootSig \
+    "RootFlags(ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT | " \
+        "CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED | SAMPLER_HEAP_DIRECTLY_INDEXED), " \
+    Renderer_RootParameters
+
+#define Renderer_RootParameters \
     "CBV(b0, visibility = SHADER_VISIBILITY_VERTEX), " \
     "CBV(b0, visibility = SHADER_VISIBILITY_PIXEL), " \
     "DescriptorTable(SRV(t0, numDescriptors = 10), visibility = SHADER_VISIBILITY_PIXEL)," \
@@ -28,6 +38,10 @@
     "DescriptorTable(SRV(t10, numDescriptors = 10), visibility = SHADER_VISIBILITY_PIXEL)," \
     "CBV(b1), " \
     "SRV(t20, visibility = SHADER_VISIBILITY_VERTEX), " \
+    "RootConstants(num32BitConstants = 8, b2), " \
+    "CBV(b3), " \
+    "SRV(t21), " \
+    "RootConstants(num32BitConstants = 2, b4, visibility = SHADER_VISIBILITY_PIXEL), " \
     "StaticSampler(s10, maxAnisotropy = 8, visibility = SHADER_VISIBILITY_PIXEL)," \
     "StaticSampler(s11, visibility = SHADER_VISIBILITY_PIXEL," \
         "addressU = TEXTURE_ADDRESS_CLAMP," \
@@ -42,6 +56,31 @@ SamplerState defaultSampler : register(s10);
 SamplerComparisonState shadowSampler : register(s11);
 SamplerState cubeMapSampler : register(s12);
 
+#ifdef BINDLESS
+
+// Where the material's textures and samplers start in the descriptor heaps.
+// They're in the same order as the tables the other shaders bind, t0 and s0 on.
+cbuffer MaterialDescriptors : register(b4)
+{
+    uint materialSrvTable;
+    uint materialSamplerTable;
+}
+
+// Declares the texture and sampler of one slot of the material, as locals
+// from the heaps, where the other shaders declare them as globals
+#define DECLARE_MATERIAL_TEXTURE(type, name, slot) \
+    type name##Texture = ResourceDescriptorHeap[materialSrvTable + slot]; \
+    SamplerState name##Sampler = SamplerDescriptorHeap[materialSamplerTable + slot];
+
+#define Renderer_MaterialRootSig Renderer_BindlessRootSig
+
+#else
+
+#define DECLARE_MATERIAL_TEXTURE(type, name, slot)
+#define Renderer_MaterialRootSig Renderer_RootSig
+
+#endif // BINDLESS
+
 #ifndef ENABLE_TRIANGLE_ID
     #define ENABLE_TRIANGLE_ID 0
 #endif
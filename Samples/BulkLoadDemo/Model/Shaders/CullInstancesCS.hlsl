@@ -0,0 +1,57 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Culls the draws of an InstanceBatch against a view frustum.  Each visible
+// draw's arguments are appended to its group's range of the culled draws, and
+// the group's draw count is the count for its ExecuteIndirect.
+//
+// When the draws are sorted, the visible draws are appended to the sort list
+// instead, keyed by group and then by depth, and WriteSortedDrawsCS writes
+// their arguments once the list has been sorted.
+//
+
+#include "CullInstancesCommon.hlsli"
+
+[RootSignature(CullInstances_RootSig)]
+[numthreads(64, 1, 1)]
+void main( uint3 DTid : SV_DispatchThreadID )
+{
+    uint drawIdx = DTid.x;
+    if (drawIdx >= NumDraws)
+        return;
+
+    CullData cull = Cull[drawIdx];
+    float4 xform = SphereTransforms[cull.TransformIdx];
+    float3 center = cull.Sphere.xyz * xform.w + xform.xyz;
+    float radius = cull.Sphere.w * xform.w;
+
+    [unroll]
+    for (uint i = 0; i < 6; ++i)
+    {
+        if (dot(center, FrustumPlanes[i].xyz) + FrustumPlanes[i].w + radius < 0.0)
+            return;
+    }
+
+    uint slot;
+    DrawCounts.InterlockedAdd(cull.GroupIdx * 4, 1, slot);
+
+    if (SortDraws)
+    {
+        // Front to back, like MeshSorter.  Positive floats sort in the same
+        // order as their bits, so the top half of them is enough.
+        float depth = max(dot(center - ViewerPos, ViewerForward) - radius, 0.0);
+        uint key = cull.GroupIdx << 16 | asuint(depth) >> 16;
+
+        uint listIdx;
+        DrawCounts.InterlockedAdd(NumGroups * 4, 1, listIdx);
+        SortList.Store2(listIdx * 8, uint2(drawIdx, key));
+        return;
+    }
+
+    CopyDraw(drawIdx, cull.FirstDraw + slot);
+}
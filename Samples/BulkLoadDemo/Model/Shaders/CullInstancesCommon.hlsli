@@ -0,0 +1,61 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// The bindings shared by CullInstancesCS and WriteSortedDrawsCS.
+//
+
+#define CullInstances_RootSig \
+    "RootFlags(0), " \
+    "CBV(b0), " \
+    "SRV(t0), " \
+    "SRV(t1), " \
+    "SRV(t2), " \
+    "UAV(u0), " \
+    "UAV(u1), " \
+    "UAV(u2)"
+
+// The size of IndirectDraw: two CBVs, a vertex and index buffer view, and the
+// draw indexed arguments
+#define DRAW_SIZE 68
+
+struct CullData
+{
+    float4 Sphere;          // Object space bounding sphere
+    uint TransformIdx;
+    uint GroupIdx;
+    uint FirstDraw;         // The group's first draw
+    uint Pad;
+};
+
+cbuffer CSConstants : register(b0)
+{
+    float4 FrustumPlanes[6];
+    uint NumDraws;
+    uint NumGroups;         // The sort list's length follows the group counts
+    uint SortDraws;
+    float3 ViewerPos;
+    float3 ViewerForward;
+};
+
+ByteAddressBuffer Draws : register(t0);
+StructuredBuffer<CullData> Cull : register(t1);
+StructuredBuffer<float4> SphereTransforms : register(t2);   // xyz = translation, w = scale
+RWByteAddressBuffer CulledDraws : register(u0);
+RWByteAddressBuffer DrawCounts : register(u1);
+RWByteAddressBuffer SortList : register(u2);    // uint2(draw index, key) for BitonicSort
+
+void CopyDraw(uint drawIdx, uint dstIdx)
+{
+    uint src = drawIdx * DRAW_SIZE;
+    uint dst = dstIdx * DRAW_SIZE;
+    CulledDraws.Store4(dst +  0, Draws.Load4(src +  0));
+    CulledDraws.Store4(dst + 16, Draws.Load4(src + 16));
+    CulledDraws.Store4(dst + 32, Draws.Load4(src + 32));
+    CulledDraws.Store4(dst + 48, Draws.Load4(src + 48));
+    CulledDraws.Store(dst + 64, Draws.Load(src + 64));
+}
@@ -19,8 +19,10 @@ struct VSOutput
     float2 uv : TexCoord0;
 };
 
+#ifndef BINDLESS
 Texture2D<float4> baseColorTexture          : register(t0);
 SamplerState baseColorSampler               : register(s0);
+#endif
 
 cbuffer MaterialConstants : register(b0)
 {
@@ -31,9 +33,11 @@ cbuffer MaterialConstants : register(b0)
     uint flags;
 }
 
-[RootSignature(Renderer_RootSig)]
+[RootSignature(Renderer_MaterialRootSig)]
 void main(VSOutput vsOutput)
 {
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float4>, baseColor, 0)
+
     float cutoff = f16tof32(flags >> 16);
     if (baseColorTexture.Sample(baseColorSampler, vsOutput.uv).a < cutoff)
         discard;
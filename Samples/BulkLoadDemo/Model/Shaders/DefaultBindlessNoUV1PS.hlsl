@@ -0,0 +1,15 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// DefaultNoUV1PS, reading the material's textures and samplers straight from
+// the descriptor heaps (shader model 6.6).
+//
+
+#define BINDLESS 1
+#define NO_SECOND_UV 1
+#include "DefaultPS.hlsl"
\ No newline at end of file
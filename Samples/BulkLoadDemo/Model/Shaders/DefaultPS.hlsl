@@ -13,6 +13,7 @@
 
 #include "Common.hlsli"
 
+#ifndef BINDLESS
 Texture2D<float4> baseColorTexture          : register(t0);
 Texture2D<float3> metallicRoughnessTexture  : register(t1);
 Texture2D<float1> occlusionTexture          : register(t2);
@@ -24,6 +25,7 @@ SamplerState metallicRoughnessSampler       : register(s1);
 SamplerState occlusionSampler               : register(s2);
 SamplerState emissiveSampler                : register(s3);
 SamplerState normalSampler                  : register(s4);
+#endif
 
 TextureCube<float3> radianceIBLTexture      : register(t10);
 TextureCube<float3> irradianceIBLTexture    : register(t11);
@@ -228,6 +230,8 @@ float3 ComputeNormal(VSOutput vsOutput)
     float3 bitangent = normalize(cross(normal, tangent)) * vsOutput.tangent.w;
     float3x3 tangentFrame = float3x3(tangent, bitangent, normal);
 
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float3>, normal, NORMAL)
+
     // Read normal map and convert to SNORM (TODO:  convert all normal maps to R8G8B8A8_SNORM?)
     normal = normalTexture.Sample(normalSampler, UVSET(NORMAL)) * 2.0 - 1.0;
 
@@ -239,9 +243,14 @@ float3 ComputeNormal(VSOutput vsOutput)
 #endif
 }
 
-[RootSignature(Renderer_RootSig)]
+[RootSignature(Renderer_MaterialRootSig)]
 float4 main(VSOutput vsOutput) : SV_Target0
 {
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float4>, baseColor, BASECOLOR)
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float3>, metallicRoughness, METALLICROUGHNESS)
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float1>, occlusion, OCCLUSION)
+    DECLARE_MATERIAL_TEXTURE(Texture2D<float3>, emissive, EMISSIVE)
+
     // Load and modulate textures
     float4 baseColor = baseColorFactor * baseColorTexture.Sample(baseColorSampler, UVSET(BASECOLOR));
     float2 metallicRoughness = metallicRoughnessFactor * 
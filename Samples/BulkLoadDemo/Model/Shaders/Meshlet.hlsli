@@ -0,0 +1,104 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Shared by the amplification and mesh shaders that draw a mesh's meshlets.
+// The meshlets, their cull data, vertex indices and triangles are in the
+// model's data buffer along with its vertices, laid out by DirectXMesh's
+// ComputeMeshlets and ComputeCullData (see BuildMeshletMesh).
+//
+
+#include "Common.hlsli"
+
+// The amplification shader culls this many meshlets per group.  Renderer.cpp
+// has to match.
+#define MESHLETS_PER_GROUP 32
+
+// The most vertices and triangles in a meshlet.  Model.h has to match.
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_PRIMITIVES 126
+
+// PSOFlags in Model.h, along with the culling flags the renderer adds
+#define kHasTangent         0x004
+#define kHasUV0             0x008
+#define kHasUV1             0x010
+#define kNoConeCulling      0x8000
+
+cbuffer MeshletConstants : register(b2)
+{
+    uint VertexOffset;      // Of the mesh's vertex buffer
+    uint VertexStride;
+    uint MeshletOffset;
+    uint CullDataOffset;
+    uint VertexIndexOffset;
+    uint PrimitiveOffset;
+    uint NumMeshlets;
+    uint MeshletFlags;
+};
+
+cbuffer MeshConstants : register(b3)
+{
+    float4x4 WorldMatrix;   // Object to world
+    float3x3 WorldIT;       // Object normal to world normal
+};
+
+cbuffer GlobalConstants : register(b1)
+{
+    float4x4 ViewProjMatrix;
+    float4x4 SunShadowMatrix;
+    float3 ViewerPos;
+    float3 SunDirection;
+    float3 SunIntensity;
+}
+
+ByteAddressBuffer MeshletData : register(t21);
+
+// The meshlets that survived culling, for the mesh shader groups
+struct Payload
+{
+    uint MeshletIndices[MESHLETS_PER_GROUP];
+};
+
+struct Meshlet
+{
+    uint VertCount;
+    uint VertOffset;
+    uint PrimCount;
+    uint PrimOffset;
+};
+
+struct MeshletCullData
+{
+    float4 BoundingSphere;  // Object space
+    uint NormalCone;        // 8-bit unorm axis and cutoff, packed as xyzw
+    float ApexOffset;
+};
+
+Meshlet LoadMeshlet(uint index)
+{
+    uint4 data = MeshletData.Load4(MeshletOffset + index * 16);
+
+    Meshlet meshlet;
+    meshlet.VertCount = data.x;
+    meshlet.VertOffset = data.y;
+    meshlet.PrimCount = data.z;
+    meshlet.PrimOffset = data.w;
+    return meshlet;
+}
+
+MeshletCullData LoadCullData(uint index)
+{
+    uint address = CullDataOffset + index * 24;
+
+    MeshletCullData cullData;
+    cullData.BoundingSphere = asfloat(MeshletData.Load4(address));
+    uint2 cone = MeshletData.Load2(address + 16);
+    cullData.NormalCone = cone.x;
+    cullData.ApexOffset = asfloat(cone.y);
+    return cullData;
+}
+
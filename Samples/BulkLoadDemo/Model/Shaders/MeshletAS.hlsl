@@ -0,0 +1,79 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Culls a mesh's meshlets, one per thread, and launches a mesh shader group
+// for each that's left.  A meshlet is culled if its bounding sphere is
+// outside the sides of the view frustum, or if its normal cone shows that
+// every one of its triangles faces away from the viewer.
+//
+
+#include "Meshlet.hlsli"
+
+groupshared Payload s_Payload;
+groupshared uint s_NumVisible;
+
+bool IsVisible(MeshletCullData cullData)
+{
+    float4 center = mul(WorldMatrix, float4(cullData.BoundingSphere.xyz, 1.0));
+    float scale = max(max(length(WorldMatrix._11_21_31), length(WorldMatrix._12_22_32)),
+        length(WorldMatrix._13_23_33));
+    float radius = cullData.BoundingSphere.w * scale;
+
+    // The left, right, bottom and top planes, from the rows of the view
+    // projection.  Depth is left to the depth test.
+    float4 planes[4] =
+    {
+        ViewProjMatrix[3] + ViewProjMatrix[0],
+        ViewProjMatrix[3] - ViewProjMatrix[0],
+        ViewProjMatrix[3] + ViewProjMatrix[1],
+        ViewProjMatrix[3] - ViewProjMatrix[1],
+    };
+
+    for (uint i = 0; i < 4; ++i)
+    {
+        if (dot(planes[i], center) < -radius * length(planes[i].xyz))
+            return false;
+    }
+
+    // A degenerate cone spreads wider than a hemisphere, so some triangle
+    // always faces the viewer
+    if ((MeshletFlags & kNoConeCulling) || (cullData.NormalCone >> 24) == 0xff)
+        return true;
+
+    float4 cone = float4(
+        cullData.NormalCone & 0xff,
+        (cullData.NormalCone >> 8) & 0xff,
+        (cullData.NormalCone >> 16) & 0xff,
+        cullData.NormalCone >> 24) / 255.0;
+    float3 axis = normalize(mul(WorldIT, cone.xyz * 2.0 - 1.0));
+
+    // The cone's w is the largest dot product with the reversed axis at which
+    // all of the triangles face away
+    float3 apex = center.xyz - axis * cullData.ApexOffset * scale;
+    float3 view = normalize(ViewerPos - apex);
+    return dot(view, -axis) <= cone.w;
+}
+
+[RootSignature(Renderer_RootSig)]
+[numthreads(MESHLETS_PER_GROUP, 1, 1)]
+void main(uint dtid : SV_DispatchThreadID, uint gtid : SV_GroupThreadID)
+{
+    if (gtid == 0)
+        s_NumVisible = 0;
+    GroupMemoryBarrierWithGroupSync();
+
+    if (dtid < NumMeshlets && IsVisible(LoadCullData(dtid)))
+    {
+        uint index;
+        InterlockedAdd(s_NumVisible, 1, index);
+        s_Payload.MeshletIndices[index] = dtid;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    DispatchMesh(s_NumVisible, 1, 1, s_Payload);
+}
@@ -0,0 +1,114 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Draws one meshlet that MeshletAS.hlsl kept.  The vertices are read from the
+// mesh's vertex buffer in the layout that the input assembler would have used
+// (see Renderer::GetPSO), and the outputs match DefaultVS.hlsl's, so the same
+// pixel shaders are used.  DEPTH_ONLY makes the depth only and shadow variant.
+//
+
+#include "Meshlet.hlsli"
+
+struct VSOutput
+{
+    float4 position : SV_POSITION;
+#ifndef DEPTH_ONLY
+    float3 normal : NORMAL;
+#ifndef NO_TANGENT_FRAME
+    float4 tangent : TANGENT;
+#endif
+    float2 uv0 : TEXCOORD0;
+#ifndef NO_SECOND_UV
+    float2 uv1 : TEXCOORD1;
+#endif
+    float3 worldPos : TEXCOORD2;
+    float3 sunShadowCoord : TEXCOORD3;
+#endif
+};
+
+float4 UnpackR10G10B10A2(uint packed)
+{
+    return float4(packed & 0x3ff, (packed >> 10) & 0x3ff, (packed >> 20) & 0x3ff, packed >> 30) /
+        float4(1023.0, 1023.0, 1023.0, 3.0);
+}
+
+float2 UnpackR16G16Float(uint packed)
+{
+    return float2(f16tof32(packed), f16tof32(packed >> 16));
+}
+
+VSOutput LoadVertex(uint vertexIndex)
+{
+    uint address = VertexOffset + vertexIndex * VertexStride;
+
+    VSOutput vsOutput;
+
+    float3 position = asfloat(MeshletData.Load3(address));
+    float3 worldPos = mul(WorldMatrix, float4(position, 1.0)).xyz;
+    vsOutput.position = mul(ViewProjMatrix, float4(worldPos, 1.0));
+
+#ifndef DEPTH_ONLY
+    // Position, normal, then each optional attribute in turn
+    uint offset = address + 16;
+
+    float3 normal = UnpackR10G10B10A2(MeshletData.Load(address + 12)).xyz * 2 - 1;
+    vsOutput.normal = mul(WorldIT, normal);
+
+    if (MeshletFlags & kHasTangent)
+    {
+#ifndef NO_TANGENT_FRAME
+        float4 tangent = UnpackR10G10B10A2(MeshletData.Load(offset)) * 2 - 1;
+        vsOutput.tangent = float4(mul(WorldIT, tangent.xyz), tangent.w);
+#endif
+        offset += 4;
+    }
+
+    vsOutput.uv0 = 0;
+    if (MeshletFlags & kHasUV0)
+    {
+        vsOutput.uv0 = UnpackR16G16Float(MeshletData.Load(offset));
+        offset += 4;
+    }
+
+#ifndef NO_SECOND_UV
+    vsOutput.uv1 = UnpackR16G16Float(MeshletData.Load(offset));
+#endif
+
+    vsOutput.worldPos = worldPos;
+    vsOutput.sunShadowCoord = mul(SunShadowMatrix, float4(worldPos, 1.0)).xyz;
+#endif
+
+    return vsOutput;
+}
+
+[RootSignature(Renderer_RootSig)]
+[outputtopology("triangle")]
+[numthreads(128, 1, 1)]
+void main(
+    uint gtid : SV_GroupThreadID,
+    uint gid : SV_GroupID,
+    in payload Payload payload,
+    out indices uint3 triangles[MESHLET_MAX_PRIMITIVES],
+    out vertices VSOutput vertices[MESHLET_MAX_VERTICES])
+{
+    Meshlet meshlet = LoadMeshlet(payload.MeshletIndices[gid]);
+
+    SetMeshOutputCounts(meshlet.VertCount, meshlet.PrimCount);
+
+    if (gtid < meshlet.PrimCount)
+    {
+        uint packed = MeshletData.Load(PrimitiveOffset + (meshlet.PrimOffset + gtid) * 4);
+        triangles[gtid] = uint3(packed & 0x3ff, (packed >> 10) & 0x3ff, (packed >> 20) & 0x3ff);
+    }
+
+    if (gtid < meshlet.VertCount)
+    {
+        uint vertexIndex = MeshletData.Load(VertexIndexOffset + (meshlet.VertOffset + gtid) * 4);
+        vertices[gtid] = LoadVertex(vertexIndex);
+    }
+}
@@ -0,0 +1,43 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Writes the arguments of an InstanceBatch view's visible draws in the order
+// of its sorted list.  The list is sorted by group first, so a group's draws
+// are contiguous, and each draw's place in its group's range of the culled
+// draws is its distance from the first of the group's draws in the list.
+//
+
+#include "CullInstancesCommon.hlsli"
+
+[RootSignature(CullInstances_RootSig)]
+[numthreads(64, 1, 1)]
+void main( uint3 DTid : SV_DispatchThreadID )
+{
+    uint listCount = DrawCounts.Load(NumGroups * 4);
+    uint listIdx = DTid.x;
+    if (listIdx >= listCount)
+        return;
+
+    uint2 drawAndKey = SortList.Load2(listIdx * 8);
+    uint drawIdx = drawAndKey.x;
+    uint groupKey = drawAndKey.y & 0xFFFF0000;
+
+    // Find the group's first entry in the list
+    uint first = 0;
+    uint last = listIdx;
+    while (first < last)
+    {
+        uint middle = (first + last) / 2;
+        if (SortList.Load(middle * 8 + 4) < groupKey)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+
+    CopyDraw(drawIdx, Cull[drawIdx].FirstDraw + listIdx - first);
+}
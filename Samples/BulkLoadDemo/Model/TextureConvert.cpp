@@ -17,11 +17,136 @@
 #include "TextureConvert.h"
 #include "../Core/Utility.h"
 #include "DirectXTex.h"
+#include <d3d11.h>
+#include <wrl/client.h>
+#include <execution>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+#pragma comment(lib, "d3d11.lib")
 
 using namespace DirectX;
+using Microsoft::WRL::ComPtr;
 
 #define GetFlag(f) ((Flags & f) != 0)
 
+//
+// BC6H and BC7 are compressed with DirectXTex's DirectCompute encoder when
+// there's a hardware device to run it on, which is created the first time
+// it's needed.  The encoder uses the device's immediate context, so textures
+// converted on different threads take turns with it.  Waiting is still much
+// quicker than encoding these formats on the CPU.
+//
+static std::mutex s_GpuCompressMutex;
+static ComPtr<ID3D11Device> s_GpuCompressDevice;
+static bool s_GpuCompressDeviceCreated = false;
+
+// Must be called with s_GpuCompressMutex held
+static ID3D11Device* GetGpuCompressDevice()
+{
+    if (!s_GpuCompressDeviceCreated)
+    {
+        s_GpuCompressDeviceCreated = true;
+
+        const D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+        HRESULT hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, 0, featureLevels,
+            _countof(featureLevels), D3D11_SDK_VERSION, &s_GpuCompressDevice, nullptr, nullptr);
+
+        if (FAILED(hr))
+            Utility::Printf( "No DirectCompute device for BC6H and BC7 (%08X), so compressing them on the CPU.\n", hr );
+    }
+    return s_GpuCompressDevice.Get();
+}
+
+static bool IsGpuCompressFormat(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_BC6H_UF16:
+    case DXGI_FORMAT_BC6H_SF16:
+    case DXGI_FORMAT_BC7_UNORM:
+    case DXGI_FORMAT_BC7_UNORM_SRGB:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static HRESULT CompressImage( const ScratchImage& image, DXGI_FORMAT cformat, ScratchImage& result )
+{
+    const bool bGpuFormat = IsGpuCompressFormat(cformat);
+    if (bGpuFormat)
+    {
+        std::lock_guard<std::mutex> lock(s_GpuCompressMutex);
+        if (ID3D11Device* device = GetGpuCompressDevice())
+        {
+            HRESULT hr = Compress( device, image.GetImages(), image.GetImageCount(), image.GetMetadata(), cformat,
+                TEX_COMPRESS_DEFAULT, TEX_ALPHA_WEIGHT_DEFAULT, result );
+            if (SUCCEEDED(hr))
+                return hr;
+
+            Utility::Printf( "DirectCompute compression failed (%08X), so compressing on the CPU.\n", hr );
+        }
+    }
+
+    // On the CPU, BC6H and BC7 are slow enough to be worth spreading one
+    // texture's blocks across every core, even when other textures are being
+    // converted at the same time.
+    const TEX_COMPRESS_FLAGS compressFlags = bGpuFormat ? TEX_COMPRESS_PARALLEL : TEX_COMPRESS_DEFAULT;
+    return Compress( image.GetImages(), image.GetImageCount(), image.GetMetadata(), cformat, compressFlags, 0.5f,
+        result );
+}
+
+//
+// Each item of a texture array or cube map has a mip chain of its own, so the
+// chains are generated in parallel and then gathered into one image.  A single
+// texture's chain is generated as before, since each mip is filtered from the
+// one above it.
+//
+static HRESULT GenerateMipChains( const ScratchImage& image, ScratchImage& result )
+{
+    const TexMetadata& info = image.GetMetadata();
+    if (info.arraySize == 1 || info.dimension != TEX_DIMENSION_TEXTURE2D)
+        return GenerateMipMaps( image.GetImages(), image.GetImageCount(), info, TEX_FILTER_DEFAULT, 0, result );
+
+    std::vector<ScratchImage> chains(info.arraySize);
+    std::vector<HRESULT> chainResults(info.arraySize);
+    std::vector<size_t> items(info.arraySize);
+    std::iota(items.begin(), items.end(), size_t(0));
+
+    std::for_each(std::execution::par, items.begin(), items.end(), [&](size_t item)
+    {
+        chainResults[item] = GenerateMipMaps( *image.GetImage(0, item, 0), TEX_FILTER_DEFAULT, 0, chains[item] );
+    });
+
+    for (HRESULT hr : chainResults)
+    {
+        if (FAILED(hr))
+            return hr;
+    }
+
+    TexMetadata mipInfo = info;
+    mipInfo.mipLevels = chains[0].GetMetadata().mipLevels;
+
+    HRESULT hr = result.Initialize(mipInfo);
+    if (FAILED(hr))
+        return hr;
+
+    // The chains have the same format and sizes as the result, so their
+    // images have the same pitches too
+    for (size_t item = 0; item < mipInfo.arraySize; ++item)
+    {
+        for (size_t mip = 0; mip < mipInfo.mipLevels; ++mip)
+        {
+            const Image& src = *chains[item].GetImage(mip, 0, 0);
+            memcpy(result.GetImage(mip, item, 0)->pixels, src.pixels, src.slicePitch);
+        }
+    }
+
+    return S_OK;
+}
+
 void CompileTextureOnDemand(const std::wstring& originalFile, uint32_t flags)
 {
     std::wstring ddsFile = Utility::RemoveExtension(originalFile) + L".dds";
@@ -219,7 +344,7 @@ std::unique_ptr<ScratchImage> BuildDDS( const std::wstring& filePath, uint32_t F
     {
         std::unique_ptr<ScratchImage> timage(new ScratchImage);
 
-        HRESULT hr = GenerateMipMaps( image->GetImages(), image->GetImageCount(), image->GetMetadata(), TEX_FILTER_DEFAULT, 0, *timage );
+        HRESULT hr = GenerateMipChains( *image, *timage );
 
         if (FAILED(hr))
         {
@@ -242,7 +367,7 @@ std::unique_ptr<ScratchImage> BuildDDS( const std::wstring& filePath, uint32_t F
         {
             std::unique_ptr<ScratchImage> timage(new ScratchImage);
 
-            HRESULT hr = Compress( image->GetImages(), image->GetImageCount(), image->GetMetadata(), cformat, TEX_COMPRESS_DEFAULT, 0.5f, *timage );
+            HRESULT hr = CompressImage( *image, cformat, *timage );
             if (FAILED(hr))
             {
                 Utility::Printf( "Failing compressing \"%ws\" (WIC: %08X).\n", filePath.c_str(), hr );
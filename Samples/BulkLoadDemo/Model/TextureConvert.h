@@ -39,7 +39,8 @@ void CompileTextureOnDemand(const std::wstring& originalFile, uint32_t flags);
 namespace DirectX { class ScratchImage; }
 
 // Loads a non-DDS texture such as TGA, PNG, or JPG, then converts it to a more optimal
-// DDS format with a full mip chain.
+// DDS format with a full mip chain.  BC6H and BC7 are compressed with DirectCompute when
+// the default adapter supports it, and otherwise on every CPU core.
 std::unique_ptr<DirectX::ScratchImage> BuildDDS(const std::wstring& filePath, uint32_t Flags);
 
 // Loads a non-DDS texture such as TGA, PNG, or JPG, then converts it to a more optimal
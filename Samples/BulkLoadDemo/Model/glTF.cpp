@@ -454,6 +454,11 @@ void glTF::Asset::ProcessBuffers( json& buffers, ByteArray chunk1bin )
 {
     m_buffers.reserve(buffers.size());
 
+    // Every external buffer's read is started before waiting for any of them,
+    // so that scenes with many .bin files keep the disk busy
+    vector<task<ByteArray>> reads;
+    vector<wstring> filepaths;
+
     for (json::iterator it = buffers.begin(); it != buffers.end(); ++it)
     {
         json& thisBuffer = it.value();
@@ -461,16 +466,28 @@ void glTF::Asset::ProcessBuffers( json& buffers, ByteArray chunk1bin )
         if (thisBuffer.find("uri") != thisBuffer.end())
         {
             const string& uri = thisBuffer.at("uri");
-            wstring filepath = m_basePath + wstring(uri.begin(), uri.end());
-
-            ByteArray ba = ReadFileSync(filepath);
-            ASSERT(ba->size() > 0, "Missing bin file %ws", filepath.c_str());
-            m_buffers.push_back(ba);
+            filepaths.push_back(m_basePath + wstring(uri.begin(), uri.end()));
+            reads.push_back(ReadFileAsync(filepaths.back()));
         }
         else
         {
             ASSERT(it == buffers.begin(), "Only the 1st buffer allowed to be internal");
             ASSERT(chunk1bin->size() > 0, "GLB chunk1 missing data or not a GLB file");
+        }
+    }
+
+    size_t readIndex = 0;
+    for (json::iterator it = buffers.begin(); it != buffers.end(); ++it)
+    {
+        if (it.value().find("uri") != it.value().end())
+        {
+            ByteArray ba = reads[readIndex].get();
+            ASSERT(ba->size() > 0, "Missing bin file %ws", filepaths[readIndex].c_str());
+            m_buffers.push_back(ba);
+            ++readIndex;
+        }
+        else
+        {
             m_buffers.push_back(chunk1bin);
         }
     }
@@ -13,12 +13,59 @@
 #include <dstorage.h>
 #include <winrt/base.h>
 
-#include <deque>
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
 
 using winrt::check_hresult;
 using winrt::com_ptr;
 
+// GDEFLATE that HybridRouter sent to the CPU.  DirectStorage hands any custom
+// format to CustomDecompression, whatever its configuration.
+constexpr DSTORAGE_COMPRESSION_FORMAT CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU =
+    static_cast<DSTORAGE_COMPRESSION_FORMAT>(DSTORAGE_CUSTOM_COMPRESSION_0 + 1);
+
+// The header of a GDEFLATE stream.  It's followed by a table with an entry for
+// each tile: the first holds the compressed size of the last tile, and the
+// others the offset of each tile's data from the first tile's.
+struct GDeflateStreamHeader
+{
+    static constexpr uint32_t TILE_SIZE_IDX = 1;
+    static constexpr uint32_t TILE_SIZE = 64 * 1024;
+
+    uint8_t Id;
+    uint8_t Magic;
+    uint16_t NumTiles;
+    uint32_t TileSizeIdx : 2;
+    uint32_t LastTileSize : 18; // 0 when the last tile is a whole tile
+    uint32_t Reserved : 12;
+};
+
+static_assert(sizeof(GDeflateStreamHeader) == 8);
+
+// A large GDEFLATE request whose tiles are shared between the thread that took
+// it and the threads that were idle.  The tiles are split into parts of
+// TILES_PER_PART, and each thread takes the next part until there are none
+// left.
+struct TileJob
+{
+    static constexpr uint32_t TILES_PER_PART = 4;
+
+    GDeflateStreamHeader const* Header;
+    uint64_t SrcSize;
+    uint8_t* Dest;
+    uint64_t DstSize;
+    uint32_t NumParts;
+
+    std::atomic<uint32_t> NextPart = 0;
+    std::atomic<uint32_t> RemainingParts;
+    std::atomic<bool> Failed = false;
+};
+
 class Codec
 {
     com_ptr<IDStorageCompressionCodec> m_gdeflateCodec;
@@ -28,9 +75,14 @@ class Codec
 #endif
 
     std::vector<uint8_t> m_stagingBuffer;
+    std::vector<uint8_t> m_partStream;
 
 public:
+#if USE_ZLIB
+    explicit Codec(ZLibBackend zlibBackend = ZLibBackend::ZLib)
+#else
     Codec()
+#endif
     {
         // GDEFLATE's decompressor can go "wide" and use multiple threads to
         // decompress a single request. However, as we want to compare this to
@@ -42,7 +94,7 @@ public:
             IID_PPV_ARGS(m_gdeflateCodec.put())));
 
 #if USE_ZLIB
-        m_zlibCodec = winrt::make<ZLibCodec>();
+        m_zlibCodec = winrt::make<ZLibCodec>(zlibBackend);
 #endif
     }
 
@@ -59,7 +111,13 @@ public:
         return uncompressedDataSize;
     }
 
-    DSTORAGE_CUSTOM_DECOMPRESSION_RESULT Decompress(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
+    // When share is given, a GDEFLATE request with more than one part's worth
+    // of tiles is split into a TileJob.  share hands the job to other threads,
+    // and then this thread decompresses parts of it until they've all been
+    // taken, and waits for the rest to finish.
+    DSTORAGE_CUSTOM_DECOMPRESSION_RESULT Decompress(
+        DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request,
+        std::function<void(std::shared_ptr<TileJob> const&)> const& share = {})
     {
         DSTORAGE_CUSTOM_DECOMPRESSION_RESULT result{};
 
@@ -74,6 +132,7 @@ public:
             switch (request.CompressionFormat)
             {
             case DSTORAGE_COMPRESSION_FORMAT_GDEFLATE:
+            case CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU:
                 codec = m_gdeflateCodec.get();
                 break;
 #if USE_ZLIB
@@ -84,7 +143,28 @@ public:
             default:
                 std::terminate();
             }
-            size_t actualDecompressedSize = Decompress(codec, request.SrcBuffer, request.SrcSize, dest, request.DstSize);
+
+            std::shared_ptr<TileJob> job;
+            if (share && codec == m_gdeflateCodec.get())
+                job = CreateTileJob(request, dest);
+
+            size_t actualDecompressedSize;
+            if (job)
+            {
+                share(job);
+                DecompressParts(*job);
+                while (job->RemainingParts.load() != 0)
+                    std::this_thread::yield();
+
+                if (job->Failed)
+                    winrt::throw_hresult(E_FAIL);
+
+                actualDecompressedSize = request.DstSize;
+            }
+            else
+            {
+                actualDecompressedSize = Decompress(codec, request.SrcBuffer, request.SrcSize, dest, request.DstSize);
+            }
 
             if (dest != request.DstBuffer)
             {
@@ -101,6 +181,106 @@ public:
         return result;
     }
 
+    // Decompresses parts of the job until none are left to take
+    void DecompressParts(TileJob& job)
+    {
+        uint32_t part;
+        while ((part = job.NextPart++) < job.NumParts)
+        {
+            if (!DecompressPart(job, part))
+                job.Failed = true;
+
+            --job.RemainingParts;
+        }
+    }
+
+private:
+    static std::shared_ptr<TileJob> CreateTileJob(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request, void* dest)
+    {
+        if (request.SrcSize < sizeof(GDeflateStreamHeader))
+            return nullptr;
+
+        auto header = static_cast<GDeflateStreamHeader const*>(request.SrcBuffer);
+        uint64_t const tileSize = GDeflateStreamHeader::TILE_SIZE;
+        uint64_t const uncompressedSize =
+            header->NumTiles * tileSize - (header->LastTileSize == 0 ? 0 : tileSize - header->LastTileSize);
+
+        // Anything unexpected is left to the codec, which reports the error
+        if (header->Id != (header->Magic ^ 0xff) || header->TileSizeIdx != GDeflateStreamHeader::TILE_SIZE_IDX ||
+            header->NumTiles <= TileJob::TILES_PER_PART || request.DstSize != uncompressedSize ||
+            request.SrcSize < sizeof(GDeflateStreamHeader) + header->NumTiles * sizeof(uint32_t))
+        {
+            return nullptr;
+        }
+
+        auto job = std::make_shared<TileJob>();
+        job->Header = header;
+        job->SrcSize = request.SrcSize;
+        job->Dest = static_cast<uint8_t*>(dest);
+        job->DstSize = request.DstSize;
+        job->NumParts = (header->NumTiles + TileJob::TILES_PER_PART - 1) / TileJob::TILES_PER_PART;
+        job->RemainingParts = job->NumParts;
+        return job;
+    }
+
+    // The runtime's codec only decompresses whole streams, so each part is
+    // copied into a stream of its own, with a header and tile table that
+    // cover just its tiles.
+    bool DecompressPart(TileJob const& job, uint32_t part)
+    {
+        GDeflateStreamHeader const& header = *job.Header;
+        auto offsets = reinterpret_cast<uint32_t const*>(job.Header + 1);
+        auto data = reinterpret_cast<uint8_t const*>(offsets + header.NumTiles);
+        uint64_t const dataSize = job.SrcSize - (data - reinterpret_cast<uint8_t const*>(job.Header));
+
+        auto tileBegin = [&](uint32_t tile) -> uint64_t { return tile == 0 ? 0 : offsets[tile]; };
+        auto tileEnd = [&](uint32_t tile) -> uint64_t {
+            return tile + 1 == header.NumTiles ? tileBegin(tile) + offsets[0] : offsets[tile + 1];
+        };
+
+        uint32_t const firstTile = part * TileJob::TILES_PER_PART;
+        uint32_t const numTiles = std::min(TileJob::TILES_PER_PART, header.NumTiles - firstTile);
+        uint32_t const lastTile = firstTile + numTiles - 1;
+        bool const hasLastTile = lastTile + 1 == header.NumTiles;
+
+        uint64_t const begin = tileBegin(firstTile);
+        uint64_t const end = tileEnd(lastTile);
+        if (begin > end || end > dataSize)
+            return false;
+
+        size_t const tableSize = numTiles * sizeof(uint32_t);
+        m_partStream.resize(sizeof(GDeflateStreamHeader) + tableSize + (end - begin));
+
+        GDeflateStreamHeader partHeader = header;
+        partHeader.NumTiles = static_cast<uint16_t>(numTiles);
+        partHeader.LastTileSize = hasLastTile ? header.LastTileSize : 0;
+        memcpy(m_partStream.data(), &partHeader, sizeof(partHeader));
+
+        auto partOffsets = reinterpret_cast<uint32_t*>(m_partStream.data() + sizeof(GDeflateStreamHeader));
+        partOffsets[0] = static_cast<uint32_t>(end - tileBegin(lastTile));
+        for (uint32_t i = 1; i < numTiles; ++i)
+            partOffsets[i] = static_cast<uint32_t>(tileBegin(firstTile + i) - begin);
+
+        memcpy(m_partStream.data() + sizeof(GDeflateStreamHeader) + tableSize, data + begin, end - begin);
+
+        uint64_t const destOffset = uint64_t(firstTile) * GDeflateStreamHeader::TILE_SIZE;
+        uint64_t const destSize = hasLastTile ? job.DstSize - destOffset : numTiles * GDeflateStreamHeader::TILE_SIZE;
+
+        try
+        {
+            return Decompress(
+                       m_gdeflateCodec.get(),
+                       m_partStream.data(),
+                       m_partStream.size(),
+                       job.Dest + destOffset,
+                       destSize) == destSize;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+
     void* GetDestination(DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST const& request)
     {
         if (request.Flags & DSTORAGE_CUSTOM_DECOMPRESSION_FLAG_DEST_IN_UPLOAD_HEAP)
@@ -120,23 +300,191 @@ public:
     }
 };
 
+// A bounded queue that any number of threads can push to and pop from without
+// taking a lock.  Each cell's sequence number says whether it's ready to be
+// written or read on the current lap around the ring, so a thread only has to
+// win a compare-exchange on the position to own a cell.
+template<typename T, size_t CAPACITY>
+class MpmcQueue
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+    struct Cell
+    {
+        std::atomic<size_t> Sequence;
+        T Value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic<size_t> m_pushPosition{0};
+    alignas(64) std::atomic<size_t> m_popPosition{0};
+
+public:
+    MpmcQueue()
+        : m_cells(new Cell[CAPACITY])
+    {
+        for (size_t i = 0; i < CAPACITY; ++i)
+            m_cells[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false if the queue is full
+    bool TryPush(T const& value)
+    {
+        size_t position = m_pushPosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell& cell = m_cells[position & (CAPACITY - 1)];
+            size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0)
+            {
+                if (m_pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.Value = value;
+                    cell.Sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false if the queue is empty
+    bool TryPop(T& value)
+    {
+        size_t position = m_popPosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell& cell = m_cells[position & (CAPACITY - 1)];
+            size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+            if (difference == 0)
+            {
+                if (m_popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(cell.Value);
+                    cell.Sequence.store(position + CAPACITY, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_popPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Collects decompression results so that they can be handed back to
+// DirectStorage a batch at a time.  With small chunks the cost of each
+// SetRequestResults call is a large part of the time spent per request.
+class ResultBatch
+{
+    // A batch is sent once it's this full, or its oldest result has waited
+    // this long
+    static constexpr size_t MAX_RESULTS = 32;
+    static constexpr std::chrono::microseconds MAX_WAIT{100};
+
+    IDStorageCustomDecompressionQueue1* m_queue;
+    DSTORAGE_CUSTOM_DECOMPRESSION_RESULT m_results[MAX_RESULTS];
+    uint32_t m_numResults = 0;
+    std::chrono::steady_clock::time_point m_firstResultTime;
+
+public:
+    explicit ResultBatch(IDStorageCustomDecompressionQueue1* queue)
+        : m_queue(queue)
+    {
+    }
+
+    ~ResultBatch()
+    {
+        Flush();
+    }
+
+    void Add(DSTORAGE_CUSTOM_DECOMPRESSION_RESULT const& result)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (m_numResults == 0)
+            m_firstResultTime = now;
+
+        m_results[m_numResults++] = result;
+
+        if (m_numResults == MAX_RESULTS || now - m_firstResultTime >= MAX_WAIT)
+            Flush();
+    }
+
+    void Flush()
+    {
+        if (m_numResults == 0)
+            return;
+
+        m_queue->SetRequestResults(m_numResults, m_results);
+        m_numResults = 0;
+    }
+};
+
 class CustomDecompression
 {
+    // Requests beyond this many waiting for a thread are decompressed on the
+    // threadpool instead
+    static constexpr size_t MAX_QUEUED_REQUESTS = 4096;
+
+    // Each thread can help with at most one TileJob at a time, so there's
+    // room for a job for every thread
+    static constexpr size_t MAX_QUEUED_TILE_JOBS = 256;
+
+    // Only requests at least this large are shared with idle threads, so
+    // that sharing is worth waking them for
+    static constexpr uint64_t MIN_SHARED_REQUEST_SIZE = 1024 * 1024;
+
     com_ptr<IDStorageCustomDecompressionQueue1> m_queue;
     TP_WAIT* m_tpWait;
 
     std::vector<std::thread> m_threads;
 
-    std::mutex m_mutex;
-    std::condition_variable m_cv;
-    bool m_quit = false;
-    std::deque<DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST> m_requests;
+    // Released once for each request pushed to m_requests or job pushed to
+    // m_tileJobs, and once for each thread when quitting
+    winrt::handle m_requestsAvailable;
+    std::atomic<bool> m_quit = false;
+    MpmcQueue<DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST, MAX_QUEUED_REQUESTS> m_requests;
+    MpmcQueue<std::shared_ptr<TileJob>, MAX_QUEUED_TILE_JOBS> m_tileJobs;
+
+    // Threads waiting on m_requestsAvailable
+    std::atomic<uint32_t> m_idleThreads = 0;
+
+    // Requests taken from DirectStorage that haven't been decompressed yet
+    std::atomic<uint32_t> m_backlog = 0;
+
+#if USE_ZLIB
+    ZLibBackend m_zlibBackend;
+#endif
 
 public:
+#if USE_ZLIB
+    CustomDecompression(IDStorageFactory* factory, int numThreads, ZLibBackend zlibBackend = ZLibBackend::ZLib)
+        : m_zlibBackend(zlibBackend)
+#else
     CustomDecompression(IDStorageFactory* factory, int numThreads)
+#endif
     {
         check_hresult(factory->QueryInterface(IID_PPV_ARGS(m_queue.put())));
 
+        m_requestsAvailable.attach(CreateSemaphore(nullptr, 0, LONG_MAX, nullptr));
+        winrt::check_bool(static_cast<bool>(m_requestsAvailable));
+
         m_tpWait = CreateThreadpoolWait(OnDecompressionRequestsReady, this, nullptr);
         SetWaitForDecompressionRequest();
 
@@ -154,11 +502,9 @@ public:
         WaitForThreadpoolWaitCallbacks(m_tpWait, TRUE);
         CloseThreadpoolWait(m_tpWait);
 
-        std::unique_lock lock(m_mutex);
         m_quit = true;
-        lock.unlock();
-
-        m_cv.notify_all();
+        if (!m_threads.empty())
+            ReleaseSemaphore(m_requestsAvailable.get(), static_cast<LONG>(m_threads.size()), nullptr);
 
         for (auto& thread : m_threads)
         {
@@ -166,6 +512,16 @@ public:
         }
     }
 
+    uint32_t GetBacklog() const
+    {
+        return m_backlog.load(std::memory_order_relaxed);
+    }
+
+    uint32_t GetNumThreads() const
+    {
+        return static_cast<uint32_t>(m_threads.size());
+    }
+
 private:
     void SetWaitForDecompressionRequest()
     {
@@ -176,7 +532,12 @@ private:
     {
         CustomDecompression* self = reinterpret_cast<CustomDecompression*>(context);
 
+#if USE_ZLIB
+        Codec codec(self->m_zlibBackend);
+#else
         Codec codec;
+#endif
+        ResultBatch results(self->m_queue.get());
 
         while (true)
         {
@@ -189,56 +550,162 @@ private:
             if (numRequests == 0)
                 break;
 
-            if (self->m_threads.empty())
-            {
+            self->m_backlog += numRequests;
 
-                for (uint32_t i = 0; i < numRequests; ++i)
-                {
-                    auto& request = requests[i];
-                    auto result = codec.Decompress(request);
-                    self->m_queue->SetRequestResults(1, &result);
-                }
-            }
-            else
+            LONG numQueued = 0;
+            for (uint32_t i = 0; i < numRequests; ++i)
             {
-                std::unique_lock lock(self->m_mutex);
-                for (uint32_t i = 0; i < numRequests; ++i)
+                // Without threads, or when they're too far behind, the
+                // request is decompressed here
+                if (!self->m_threads.empty() && self->m_requests.TryPush(requests[i]))
+                    ++numQueued;
+                else
                 {
-                    self->m_requests.push_back(requests[i]);
+                    results.Add(codec.Decompress(requests[i]));
+                    --self->m_backlog;
                 }
-                lock.unlock();
-                self->m_cv.notify_all();
             }
+
+            if (numQueued > 0)
+                ReleaseSemaphore(self->m_requestsAvailable.get(), numQueued, nullptr);
         }
 
+        results.Flush();
         self->SetWaitForDecompressionRequest();
     }
 
     void Thread()
     {
+#if USE_ZLIB
+        Codec codec(m_zlibBackend);
+#else
         Codec codec;
+#endif
+        ResultBatch results(m_queue.get());
 
         while (true)
         {
-            DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST request;
-
-            std::unique_lock lock(m_mutex);
-            m_cv.wait(lock);
+            // Results are only held back while there's more work to do, so
+            // anything pending is sent before waiting
+            if (WaitForSingleObject(m_requestsAvailable.get(), 0) == WAIT_TIMEOUT)
+            {
+                results.Flush();
+                ++m_idleThreads;
+                WaitForSingleObject(m_requestsAvailable.get(), INFINITE);
+                --m_idleThreads;
+            }
 
             if (m_quit)
                 return;
 
-            while (!m_requests.empty())
+            // Each release of the semaphore follows a push, so there's a
+            // request or a job for this thread to take.  Jobs come first,
+            // since another thread is waiting for each of them.
+            std::shared_ptr<TileJob> job;
+            DSTORAGE_CUSTOM_DECOMPRESSION_REQUEST request;
+            while (true)
             {
-                request = m_requests.front();
-                m_requests.pop_front();
-                lock.unlock();
+                if (m_tileJobs.TryPop(job))
+                {
+                    codec.DecompressParts(*job);
+                    break;
+                }
+
+                if (m_requests.TryPop(request))
+                {
+                    if (request.DstSize >= MIN_SHARED_REQUEST_SIZE && m_idleThreads.load() > 0)
+                        results.Add(codec.Decompress(request, [this](auto const& shared) { ShareTileJob(shared); }));
+                    else
+                        results.Add(codec.Decompress(request));
+
+                    --m_backlog;
+                    break;
+                }
+
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Wakes as many idle threads as could take a part of the job, besides
+    // the one sharing it
+    void ShareTileJob(std::shared_ptr<TileJob> const& job)
+    {
+        uint32_t const numHelpers = std::min(m_idleThreads.load(), job->NumParts - 1);
+
+        LONG numQueued = 0;
+        while (static_cast<uint32_t>(numQueued) < numHelpers && m_tileJobs.TryPush(job))
+            ++numQueued;
+
+        if (numQueued > 0)
+            ReleaseSemaphore(m_requestsAvailable.get(), numQueued, nullptr);
+    }
+};
+
+// Picks the CPU or the GPU for each GDEFLATE request, with the same policy as
+// BulkLoadDemo's RouteDecompression:
+//
+// * While CustomDecompression's threads have more requests waiting than they
+//   can get through soon, everything goes to the GPU.
+//
+// * Requests no larger than the small request size go to the CPU.
+//
+// * The bytes of the larger requests are split between the two, with the CPU
+//   share of them going to the CPU.
+//
+// BulkLoadDemo adjusts the share from frame to frame with how busy the GPU
+// is.  The benchmark's GPU load is fixed for the whole test, so the share is
+// fixed too.
+class HybridRouter
+{
+    // A thread with more than this many requests waiting is falling behind
+    static constexpr uint32_t MAX_BACKLOG_PER_THREAD = 4;
+
+    CustomDecompression const& m_cpu;
+    uint32_t m_smallRequestBytes;
+    double m_cpuShare;
+    double m_cpuCredit = 0; // Bytes the CPU is owed, so the split is exact over many requests
 
-                auto result = codec.Decompress(request);
-                m_queue->SetRequestResults(1, &result);
+    uint64_t m_gpuByteCount = 0;
+    uint64_t m_cpuByteCount = 0;
 
-                lock.lock();
+public:
+    HybridRouter(CustomDecompression const& cpu, uint32_t smallRequestBytes, double cpuShare)
+        : m_cpu(cpu)
+        , m_smallRequestBytes(smallRequestBytes)
+        , m_cpuShare(cpuShare)
+    {
+    }
+
+    // Called from the thread that enqueues the requests
+    DSTORAGE_COMPRESSION_FORMAT Route(uint32_t uncompressedSize)
+    {
+        bool toCpu = false;
+        if (m_cpu.GetBacklog() < std::max(1u, m_cpu.GetNumThreads()) * MAX_BACKLOG_PER_THREAD)
+        {
+            if (uncompressedSize <= m_smallRequestBytes)
+            {
+                toCpu = true;
+            }
+            else
+            {
+                m_cpuCredit += uncompressedSize * m_cpuShare;
+                if (m_cpuCredit >= uncompressedSize)
+                {
+                    m_cpuCredit -= uncompressedSize;
+                    toCpu = true;
+                }
             }
         }
+
+        (toCpu ? m_cpuByteCount : m_gpuByteCount) += uncompressedSize;
+        return toCpu ? CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU : DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
     }
-};
\ No newline at end of file
+
+    // The share of the routed bytes that went to the CPU
+    double GetCpuByteShare() const
+    {
+        uint64_t total = m_cpuByteCount + m_gpuByteCount;
+        return total == 0 ? 0.0 : static_cast<double>(m_cpuByteCount) / total;
+    }
+};
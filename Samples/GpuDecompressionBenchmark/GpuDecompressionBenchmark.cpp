@@ -11,17 +11,33 @@
 
 #include "CustomDecompression.h"
 
+#include "../BulkLoadDemo/BulkLoadDemo/LoadTraceFormat.h"
+
+#include "CompiledShaders/GpuLoadCS.h"
+
 #include <dstorage.h>
 #include <dxgi1_4.h>
+#include <winioctl.h>
 #include <winrt/base.h>
 #include <winrt/windows.applicationmodel.datatransfer.h>
 
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
 #include <sstream>
 
+#pragma comment(lib, "version.lib")
+
 using winrt::check_hresult;
 using winrt::com_ptr;
 
@@ -44,8 +60,35 @@ void ShowHelpText()
 {
     std::cout << "Compresses a file, saves it to disk, and then loads & decompresses using DirectStorage." << std::endl
               << std::endl;
-    std::cout << "USAGE: GpuDecompressionBenchmark <path> [chunk size in MiB]" << std::endl << std::endl;
+    std::cout << "USAGE: GpuDecompressionBenchmark <path> [chunk size in MiB] [-sweep]" << std::endl;
+    std::cout << "       GpuDecompressionBenchmark -replay <load trace> [-cold]" << std::endl << std::endl;
     std::cout << "       Default chunk size is 16." << std::endl;
+    std::cout << "       -sweep tests chunk sizes from 64 KiB to 64 MiB, queue capacities, numbers of" << std::endl;
+    std::cout << "       queues and submit batch sizes in every combination, instead of staging buffer" << std::endl;
+    std::cout << "       sizes." << std::endl;
+    std::cout << "       -latency times every request, from being enqueued until it completes, and" << std::endl;
+    std::cout << "       reports percentiles and a histogram of the latencies." << std::endl;
+    std::cout << "       -background keeps loading the original file on a low priority queue while" << std::endl;
+    std::cout << "       each test runs." << std::endl;
+    std::cout << "       -gpuload <percent> keeps a compute shader busy for that percentage of every" << std::endl;
+    std::cout << "       60 Hz frame while each test runs, and reports how much longer frames take." << std::endl;
+    std::cout << "       -threads tests the CPU formats with every power of two number of decompression" << std::endl;
+    std::cout << "       threads up to the number of hardware threads, and reports the bandwidth per" << std::endl;
+    std::cout << "       thread and how it scales." << std::endl;
+    std::cout << "       -random reads the chunks in a random order, rather than from start to end." << std::endl;
+    std::cout << "       -files <count> spreads the reads over that many handles to the file." << std::endl;
+    std::cout << "       -trace <csv> replays a trace of reads, where the first column of each line is" << std::endl;
+    std::cout << "       an offset into the original file, by reading the chunk that holds each offset." << std::endl;
+    std::cout << "       -baseline <csv> compares the results with an earlier results CSV, and exits" << std::endl;
+    std::cout << "       with 2 if a test's bandwidth or cycles per byte are worse by more than the" << std::endl;
+    std::cout << "       threshold." << std::endl;
+    std::cout << "       -threshold <percent> sets the threshold for -baseline, which defaults to 5." << std::endl;
+    std::cout << "       -cold evicts the file from the system file cache before every run, so that" << std::endl;
+    std::cout << "       each run reads from the drive." << std::endl;
+    std::cout << "       -textures also loads the file as BC7 mip chains, into texture regions a mip at" << std::endl;
+    std::cout << "       a time and into multiple subresources a mip chain at a time." << std::endl;
+    std::cout << "       -replay replays a load trace captured by BulkLoadDemo as fast as it can, from" << std::endl;
+    std::cout << "       the files it was captured from, and reports the bandwidth of each run." << std::endl;
 }
 
 struct ChunkMetadata
@@ -63,29 +106,139 @@ struct Metadata
     std::vector<ChunkMetadata> Chunks;
 };
 
-Metadata GenerateUncompressedMetadata(wchar_t const* filename, uint32_t chunkSizeBytes)
+struct TestFile
 {
-    ScopedHandle inHandle(
-        CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
-    winrt::check_bool(inHandle.get());
+    std::wstring Filename;
+    Metadata Metadata;
+};
 
-    DWORD size = GetFileSize(inHandle.get(), nullptr);
+// Where a test loads the chunks to.  For textures the original file is treated
+// as a series of BC7 mip chains, like the textures in a game's archive, which
+// are read a mip at a time into texture regions or a whole mip chain at a
+// time into multiple subresources.
+enum class Destination
+{
+    Buffer,
+    TextureRegion,
+    MultipleSubresources
+};
 
-    Metadata metadata;
-    metadata.UncompressedSize = size;
-    metadata.CompressedSize = size;
-    metadata.LargestCompressedChunkSize = chunkSizeBytes;
+wchar_t const* GetDestinationName(Destination destination)
+{
+    switch (destination)
+    {
+    case Destination::Buffer:
+        return L"Buffer";
+    case Destination::TextureRegion:
+        return L"Texture Regions";
+    case Destination::MultipleSubresources:
+        return L"Multiple Subresources";
+    default:
+        std::terminate();
+    }
+}
 
-    uint32_t offset = 0;
+// The texture that each mip chain in the original file is loaded into, and
+// the size of each mip's data when it's laid out as GetCopyableFootprints
+// describes, which is what DirectStorage expects.
+struct TextureLayout
+{
+    D3D12_RESOURCE_DESC Desc;
+    std::vector<uint32_t> MipSizes;
+    uint32_t MipChainSize;
+};
+
+// Picks the largest square BC7 texture whose most detailed mip fits in a chunk
+// of the given size, with a full mip chain.
+TextureLayout GetTextureLayout(ID3D12Device* device, uint32_t chunkSizeBytes)
+{
+    // BC7 takes a byte per texel, so a W x W mip takes W * W bytes
+    uint64_t width = 64;
+    while ((width * 2) * (width * 2) <= chunkSizeBytes)
+        width *= 2;
+
+    uint16_t mipLevels = 1;
+    while ((width >> mipLevels) != 0)
+        ++mipLevels;
+
+    TextureLayout layout{};
+    layout.Desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+    layout.Desc.Width = width;
+    layout.Desc.Height = static_cast<uint32_t>(width);
+    layout.Desc.DepthOrArraySize = 1;
+    layout.Desc.MipLevels = mipLevels;
+    layout.Desc.Format = DXGI_FORMAT_BC7_UNORM;
+    layout.Desc.SampleDesc.Count = 1;
+    layout.Desc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+
+    for (uint32_t mip = 0; mip < mipLevels; ++mip)
+    {
+        UINT64 mipSize = 0;
+        device->GetCopyableFootprints(&layout.Desc, mip, 1, 0, nullptr, nullptr, nullptr, &mipSize);
+        layout.MipSizes.push_back(static_cast<uint32_t>(mipSize));
+    }
+
+    UINT64 mipChainSize = 0;
+    device->GetCopyableFootprints(&layout.Desc, 0, mipLevels, 0, nullptr, nullptr, nullptr, &mipChainSize);
+    layout.MipChainSize = static_cast<uint32_t>(mipChainSize);
+
+    return layout;
+}
+
+// Returns the uncompressed size of each chunk when the original file is read
+// into textures with the given layout.  Any data after the last whole mip
+// chain isn't read.
+std::vector<uint32_t> GetTextureChunkSizes(
+    wchar_t const* filename,
+    TextureLayout const& layout,
+    Destination destination)
+{
+    uint64_t size = std::filesystem::file_size(filename);
 
-    while (offset < size)
+    std::vector<uint32_t> chunkSizes;
+    if (destination == Destination::TextureRegion)
+    {
+        uint64_t textureSize = std::accumulate(layout.MipSizes.begin(), layout.MipSizes.end(), uint64_t(0));
+        for (uint64_t offset = 0; offset + textureSize <= size; offset += textureSize)
+            chunkSizes.insert(chunkSizes.end(), layout.MipSizes.begin(), layout.MipSizes.end());
+    }
+    else
     {
-        uint32_t chunkSize = std::min<uint32_t>(size - offset, chunkSizeBytes);
+        for (uint64_t offset = 0; offset + layout.MipChainSize <= size; offset += layout.MipChainSize)
+            chunkSizes.push_back(layout.MipChainSize);
+    }
+    return chunkSizes;
+}
+
+// Returns the uncompressed size of each chunk when a file is cut into chunks
+// that are all the same size, apart from the last.
+std::vector<uint32_t> GetUniformChunkSizes(wchar_t const* filename, uint32_t chunkSizeBytes)
+{
+    uint64_t size = std::filesystem::file_size(filename);
+
+    std::vector<uint32_t> chunkSizes;
+    for (uint64_t offset = 0; offset < size; offset += chunkSizeBytes)
+        chunkSizes.push_back(static_cast<uint32_t>(std::min<uint64_t>(size - offset, chunkSizeBytes)));
+    return chunkSizes;
+}
+
+// The chunks of the original file are read as they are, starting at the
+// beginning of the file.
+Metadata GenerateUncompressedMetadata(std::vector<uint32_t> const& chunkSizes)
+{
+    Metadata metadata{};
 
+    uint32_t offset = 0;
+    for (uint32_t chunkSize : chunkSizes)
+    {
         metadata.Chunks.push_back({offset, chunkSize, chunkSize});
+        metadata.LargestCompressedChunkSize = std::max(metadata.LargestCompressedChunkSize, chunkSize);
         offset += chunkSize;
     }
 
+    metadata.UncompressedSize = offset;
+    metadata.CompressedSize = offset;
+
     return metadata;
 }
 
@@ -111,12 +264,125 @@ com_ptr<IDStorageCompressionCodec> GetCodec(DSTORAGE_COMPRESSION_FORMAT format)
     return codec;
 }
 
+// Describes a compressed file, so that the next run can use it again rather
+// than compressing the source file from scratch.  It's written next to the
+// compressed file, with the chunk table after it.
+struct CompressedFileHeader
+{
+    static constexpr uint32_t CurrentMagic = 0x4B4E4843; // "CHNK"
+
+    uint32_t Magic;
+    uint32_t Format;
+    uint64_t SourceSize;
+    int64_t SourceWriteTime;
+    uint32_t ChunkSizeBytes; // The largest chunk
+    uint32_t NumChunks;
+};
+
+std::wstring GetChunkTableFilename(const wchar_t* compressedFilename)
+{
+    return std::wstring(compressedFilename) + L".chunks";
+}
+
+CompressedFileHeader MakeCompressedFileHeader(
+    DSTORAGE_COMPRESSION_FORMAT format,
+    const wchar_t* originalFilename,
+    std::vector<uint32_t> const& chunkSizes)
+{
+    CompressedFileHeader header{};
+    header.Magic = CompressedFileHeader::CurrentMagic;
+    header.Format = static_cast<uint32_t>(format);
+    header.SourceSize = std::filesystem::file_size(originalFilename);
+    header.SourceWriteTime = std::filesystem::last_write_time(originalFilename).time_since_epoch().count();
+    header.ChunkSizeBytes = chunkSizes.empty() ? 0 : *std::max_element(chunkSizes.begin(), chunkSizes.end());
+    header.NumChunks = static_cast<uint32_t>(chunkSizes.size());
+    return header;
+}
+
+bool TryLoadCompressedMetadata(
+    DSTORAGE_COMPRESSION_FORMAT format,
+    const wchar_t* originalFilename,
+    const wchar_t* compressedFilename,
+    std::vector<uint32_t> const& chunkSizes,
+    Metadata& metadata)
+{
+    std::ifstream chunkTable(GetChunkTableFilename(compressedFilename), std::ios::binary);
+    if (!chunkTable)
+        return false;
+
+    CompressedFileHeader header{};
+    chunkTable.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    CompressedFileHeader expected = MakeCompressedFileHeader(format, originalFilename, chunkSizes);
+
+    if (!chunkTable || std::memcmp(&header, &expected, sizeof(header)) != 0)
+        return false;
+
+    metadata = {};
+    metadata.Chunks.resize(chunkSizes.size());
+    chunkTable.read(reinterpret_cast<char*>(metadata.Chunks.data()), chunkSizes.size() * sizeof(ChunkMetadata));
+    if (!chunkTable)
+        return false;
+
+    // Every chunk must cover the same part of the source file as before
+    for (size_t i = 0; i < chunkSizes.size(); ++i)
+    {
+        if (metadata.Chunks[i].UncompressedSize != chunkSizes[i])
+            return false;
+    }
+
+    for (ChunkMetadata const& chunk : metadata.Chunks)
+    {
+        metadata.UncompressedSize += chunk.UncompressedSize;
+        metadata.CompressedSize += chunk.CompressedSize;
+        metadata.LargestCompressedChunkSize = std::max(metadata.LargestCompressedChunkSize, chunk.CompressedSize);
+    }
+
+    // The compressed file itself must still be there, and complete
+    std::error_code ec;
+    return std::filesystem::file_size(compressedFilename, ec) == metadata.CompressedSize && !ec;
+}
+
+void SaveCompressedMetadata(
+    DSTORAGE_COMPRESSION_FORMAT format,
+    const wchar_t* originalFilename,
+    const wchar_t* compressedFilename,
+    std::vector<uint32_t> const& chunkSizes,
+    Metadata const& metadata)
+{
+    CompressedFileHeader header = MakeCompressedFileHeader(format, originalFilename, chunkSizes);
+
+    std::ofstream chunkTable(GetChunkTableFilename(compressedFilename), std::ios::binary | std::ios::trunc);
+    chunkTable.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    chunkTable.write(
+        reinterpret_cast<char const*>(metadata.Chunks.data()),
+        metadata.Chunks.size() * sizeof(ChunkMetadata));
+}
+
+// Compresses each chunk of the original file, which are the given sizes and
+// start at the beginning of the file.
 Metadata Compress(
     DSTORAGE_COMPRESSION_FORMAT format,
     const wchar_t* originalFilename,
     const wchar_t* compressedFilename,
-    uint32_t chunkSizeBytes)
+    std::vector<uint32_t> const& chunkSizes)
 {
+    const uint32_t numChunks = static_cast<uint32_t>(chunkSizes.size());
+    const uint32_t largestChunkSize =
+        chunkSizes.empty() ? 0 : *std::max_element(chunkSizes.begin(), chunkSizes.end());
+
+    Metadata cachedMetadata;
+    if (TryLoadCompressedMetadata(format, originalFilename, compressedFilename, chunkSizes, cachedMetadata))
+    {
+        std::wcout << "Using existing " << compressedFilename << " (" << numChunks << " chunks of up to "
+                   << largestChunkSize / 1024 << " KiB)" << std::endl;
+        return cachedMetadata;
+    }
+
+    // Removed first, so that a run that's interrupted while compressing
+    // can't leave a chunk table that looks valid
+    std::filesystem::remove(GetChunkTableFilename(compressedFilename));
+
     ScopedHandle inHandle(CreateFile(
         originalFilename,
         GENERIC_READ,
@@ -145,22 +411,27 @@ Metadata Compress(
         nullptr));
     winrt::check_bool(outHandle.get());
 
-    uint32_t numChunks = (size + chunkSizeBytes - 1) / chunkSizeBytes;
+    // Where each chunk starts in the original file
+    std::vector<uint32_t> chunkOffsets;
+    uint32_t chunkOffset = 0;
+    for (uint32_t chunkSize : chunkSizes)
+    {
+        chunkOffsets.push_back(chunkOffset);
+        chunkOffset += chunkSize;
+    }
+    winrt::check_bool(chunkOffset <= size);
 
-    std::wcout << "Compressing " << originalFilename << " to " << compressedFilename << " in " << numChunks << "x"
-               << chunkSizeBytes / 1024 / 1024 << " MiB chunks" << std::endl;
+    std::wcout << "Compressing " << originalFilename << " to " << compressedFilename << " in " << numChunks
+               << " chunks of up to " << largestChunkSize / 1024 << " KiB" << std::endl;
 
     using Chunk = std::vector<uint8_t>;
 
-    std::vector<Chunk> chunks;
-    std::vector<uint32_t> chunkOffsets;
-
-    chunks.resize(numChunks);
-    for (uint32_t i = 0; i < numChunks; ++i)
-    {
-        uint32_t thisChunkOffset = i * chunkSizeBytes;
-        chunkOffsets.push_back(thisChunkOffset);
-    }
+    // Chunks are written out in order as soon as they're ready, so only the
+    // ones that finished ahead of the next chunk to write are held in memory.
+    std::vector<Chunk> chunks(numChunks);
+    std::vector<bool> chunkReady(numChunks, false);
+    std::mutex chunksMutex;
+    std::condition_variable chunkReadyCondition;
 
     std::atomic<size_t> nextChunk = 0;
 
@@ -181,8 +452,8 @@ Metadata Compress(
                     if (chunkIndex >= numChunks)
                         return;
 
-                    size_t thisChunkOffset = chunkIndex * chunkSizeBytes;
-                    size_t thisChunkSize = std::min<size_t>(size - thisChunkOffset, chunkSizeBytes);
+                    size_t thisChunkOffset = chunkOffsets[chunkIndex];
+                    size_t thisChunkSize = chunkSizes[chunkIndex];
 
                     Chunk chunk(codec->CompressBufferBound(thisChunkSize));
 
@@ -198,48 +469,42 @@ Metadata Compress(
                         &compressedSize));
                     chunk.resize(compressedSize);
 
-                    chunks[chunkIndex] = std::move(chunk);
+                    {
+                        std::lock_guard lock(chunksMutex);
+                        chunks[chunkIndex] = std::move(chunk);
+                        chunkReady[chunkIndex] = true;
+                    }
+                    chunkReadyCondition.notify_one();
                 }
             });
     }
 
-    size_t lastNextChunk = std::numeric_limits<size_t>::max();
-
-    do
-    {
-        Sleep(250);
-        if (nextChunk != lastNextChunk)
-        {
-            lastNextChunk = nextChunk;
-            std::cout << "   " << std::min<size_t>(numChunks, lastNextChunk + 1) << " / " << numChunks << "   \r";
-            std::cout.flush();
-        }
-    } while (lastNextChunk < numChunks);
-
-    for (auto& thread : threads)
-    {
-        thread.join();
-    }
-
     uint32_t totalCompressedSize = 0;
     uint32_t offset = 0;
 
     Metadata metadata;
-    metadata.UncompressedSize = size;
+    metadata.UncompressedSize = chunkOffset;
     metadata.LargestCompressedChunkSize = 0;
 
     for (uint32_t i = 0; i < numChunks; ++i)
     {
+        Chunk chunk;
+        {
+            std::unique_lock lock(chunksMutex);
+            chunkReadyCondition.wait(lock, [&] { return chunkReady[i]; });
+            chunk = std::move(chunks[i]);
+        }
+
         winrt::check_bool(
-            WriteFile(outHandle.get(), chunks[i].data(), static_cast<DWORD>(chunks[i].size()), nullptr, nullptr));
+            WriteFile(outHandle.get(), chunk.data(), static_cast<DWORD>(chunk.size()), nullptr, nullptr));
 
-        uint32_t thisChunkOffset = i * chunkSizeBytes;
-        uint32_t thisChunkSize = std::min<uint32_t>(size - thisChunkOffset, chunkSizeBytes);
+        std::cout << "   " << i + 1 << " / " << numChunks << "   \r";
+        std::cout.flush();
 
         ChunkMetadata chunkMetadata{};
         chunkMetadata.Offset = offset;
-        chunkMetadata.CompressedSize = static_cast<uint32_t>(chunks[i].size());
-        chunkMetadata.UncompressedSize = thisChunkSize;
+        chunkMetadata.CompressedSize = static_cast<uint32_t>(chunk.size());
+        chunkMetadata.UncompressedSize = chunkSizes[i];
         metadata.Chunks.push_back(chunkMetadata);
 
         totalCompressedSize += chunkMetadata.CompressedSize;
@@ -249,12 +514,19 @@ Metadata Compress(
             std::max(metadata.LargestCompressedChunkSize, chunkMetadata.CompressedSize);
     }
 
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
     outHandle.reset();
 
     metadata.CompressedSize = totalCompressedSize;
 
-    std::cout << "Total: " << size << " --> " << totalCompressedSize << " bytes (" << totalCompressedSize * 100.0 / size
-              << "%)     " << std::endl;
+    SaveCompressedMetadata(format, originalFilename, compressedFilename, chunkSizes, metadata);
+
+    std::cout << "Total: " << metadata.UncompressedSize << " --> " << totalCompressedSize << " bytes ("
+              << totalCompressedSize * 100.0 / metadata.UncompressedSize << "%)     " << std::endl;
 
     return metadata;
 }
@@ -268,261 +540,1753 @@ static uint64_t GetProcessCycleTime()
     return cycleTime;
 }
 
+// Bucket i counts the requests that took from 2^i to 2^(i+1) microseconds,
+// from being enqueued to being seen complete.
+constexpr size_t NUM_LATENCY_BUCKETS = 24;
+
 struct TestResult
 {
     double Bandwidth;
     uint64_t ProcessCycles;
+    double CyclesPerByte; // Process cycles per uncompressed byte
+
+    // Only measured in latency mode, in microseconds
+    double LatencyP50;
+    double LatencyP99;
+    double LatencyMax;
+    std::array<uint32_t, NUM_LATENCY_BUCKETS> LatencyHistogram;
+
+    // Only measured with a GPU load, in milliseconds
+    double IdleFrameTime;
+    double FrameTimeMean;
+    double FrameTimeP99;
+
+    // The bandwidth of the first run, and the mean of the rest.  Unless the
+    // cache is cold for every run, later runs may be served by the file cache.
+    double FirstRunBandwidth;
+    double SteadyStateBandwidth;
+
+    // Only measured with a HybridRouter, the share of the bytes that were
+    // decompressed on the CPU
+    double CpuShare;
 };
 
-TestResult RunTest(
-    IDStorageFactory* factory,
-    uint32_t stagingSizeMiB,
-    wchar_t const* sourceFilename,
-    DSTORAGE_COMPRESSION_FORMAT compressionFormat,
-    Metadata const& metadata,
-    int numRuns)
+// Which chunks are read, in what order, and how many handles they're read
+// through.  By default every chunk is read once, from start to end, through a
+// single handle.
+struct ReadPattern
 {
-    com_ptr<IDStorageFile> file;
+    std::wstring Name;
+    bool Shuffle = false;
+    uint32_t NumFileHandles = 1;
+
+    // Offsets into the original file, captured from a game's reads.  Each one
+    // reads the chunk that holds it, so that a trace can be replayed with any
+    // chunk size and format.
+    std::vector<uint64_t> TraceOffsets;
+};
 
-    HRESULT hr = factory->OpenFile(sourceFilename, IID_PPV_ARGS(file.put()));
-    if (FAILED(hr))
+// Loads a read trace, taking the offset from the first column of each line.
+// Lines that don't start with a number, such as a header, are skipped.
+std::vector<uint64_t> LoadReadTrace(wchar_t const* filename)
+{
+    std::ifstream trace(filename);
+    if (!trace)
     {
-        std::wcout << L"The file '" << sourceFilename << L"' could not be opened. HRESULT=0x" << std::hex << hr
-                   << std::endl;
+        std::wcout << L"The trace '" << filename << L"' could not be opened." << std::endl;
         std::abort();
     }
 
-    // The staging buffer size must be set before any queues are created.
-    std::cout << "  " << stagingSizeMiB << " MiB staging buffer: ";
-    uint32_t stagingBufferSizeBytes = stagingSizeMiB * 1024 * 1024;
-    check_hresult(factory->SetStagingBufferSize(stagingBufferSizeBytes));
-
-    if (metadata.LargestCompressedChunkSize > stagingBufferSizeBytes)
+    std::vector<uint64_t> offsets;
+    std::string line;
+    while (std::getline(trace, line))
     {
-        std::cout << " SKIPPED! " << std::endl;
-        return {0, 0};
+        char* end = nullptr;
+        uint64_t offset = std::strtoull(line.c_str(), &end, 10);
+        if (end != line.c_str())
+            offsets.push_back(offset);
     }
+    return offsets;
+}
 
-    com_ptr<ID3D12Device> device;
-    check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device)));
+// Returns the index of the chunk to read for each request, in order
+std::vector<uint32_t> GetReadOrder(ReadPattern const& pattern, Metadata const& metadata)
+{
+    const uint32_t numChunks = static_cast<uint32_t>(metadata.Chunks.size());
+    std::vector<uint32_t> readOrder;
 
-    // Create a DirectStorage queue which will be used to load data into a
-    // buffer on the GPU.
-    DSTORAGE_QUEUE_DESC queueDesc{};
-    queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
-    queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
-    queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-    queueDesc.Device = device.get();
+    if (pattern.TraceOffsets.empty())
+    {
+        readOrder.resize(numChunks);
+        std::iota(readOrder.begin(), readOrder.end(), 0);
+    }
+    else
+    {
+        // The offset in the original file that each chunk ends at
+        std::vector<uint64_t> chunkEnds;
+        uint64_t chunkEnd = 0;
+        for (ChunkMetadata const& chunk : metadata.Chunks)
+            chunkEnds.push_back(chunkEnd += chunk.UncompressedSize);
 
-    com_ptr<IDStorageQueue> queue;
-    check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(queue.put())));
+        for (uint64_t offset : pattern.TraceOffsets)
+        {
+            auto it = std::upper_bound(chunkEnds.begin(), chunkEnds.end(), offset);
+            readOrder.push_back(std::min(static_cast<uint32_t>(it - chunkEnds.begin()), numChunks - 1));
+        }
+    }
 
-    // Create the ID3D12Resource buffer which will be populated with the file's contents
-    D3D12_HEAP_PROPERTIES bufferHeapProps = {};
-    bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+    // Always the same order, so that every test reads the same way
+    if (pattern.Shuffle)
+        std::shuffle(readOrder.begin(), readOrder.end(), std::mt19937(12345));
 
-    D3D12_RESOURCE_DESC bufferDesc = {};
-    bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
-    bufferDesc.Width = metadata.UncompressedSize;
-    bufferDesc.Height = 1;
-    bufferDesc.DepthOrArraySize = 1;
-    bufferDesc.MipLevels = 1;
-    bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
-    bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
-    bufferDesc.SampleDesc.Count = 1;
+    return readOrder;
+}
 
-    com_ptr<ID3D12Resource> bufferResource;
-    check_hresult(device->CreateCommittedResource(
-        &bufferHeapProps,
-        D3D12_HEAP_FLAG_NONE,
-        &bufferDesc,
-        D3D12_RESOURCE_STATE_COMMON,
-        nullptr,
-        IID_PPV_ARGS(bufferResource.put())));
+// The settings that a single test varies, besides the file and how it's
+// compressed.
+struct TestParameters
+{
+    uint32_t StagingSizeMiB;
+    uint16_t QueueCapacity;
+    uint32_t NumQueues;
+    uint32_t SubmitBatchSize; // Requests per Submit on each queue, or 0 to submit them all at once
 
-    // Configure a fence to be signaled when the request is completed
-    com_ptr<ID3D12Fence> fence;
-    check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(fence.put())));
+    // Enqueues a status after every request, and polls them from another
+    // thread to time each request.  The polling thread's cycles are counted
+    // in the process cycle time.
+    bool MeasureLatency;
 
-    ScopedHandle fenceEvent(CreateEvent(nullptr, FALSE, FALSE, nullptr));
-    uint64_t fenceValue = 1;
+    // When set, this file is loaded over and over on a low priority queue for
+    // as long as the test runs
+    TestFile const* BackgroundFile;
 
-    double meanBandwidth = 0;
-    uint64_t meanCycleTime = 0;
+    // When not 0, GpuLoad keeps the GPU busy for this percentage of every
+    // frame for as long as the test runs
+    uint32_t GpuLoadPercent;
 
-    for (int i = 0; i < numRuns; ++i)
-    {
-        check_hresult(fence->SetEventOnCompletion(fenceValue, fenceEvent.get()));
+    ReadPattern const* Pattern;
 
-        // Enqueue requests to load each compressed chunk.
-        uint32_t destOffset = 0;
-        for (auto const& chunk : metadata.Chunks)
-        {
-            DSTORAGE_REQUEST request = {};
-            request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
-            request.Options.CompressionFormat = compressionFormat;
-            request.Source.File.Source = file.get();
-            request.Source.File.Offset = chunk.Offset;
-            request.Source.File.Size = chunk.CompressedSize;
-            request.UncompressedSize = chunk.UncompressedSize;
-            request.Destination.Buffer.Resource = bufferResource.get();
-            request.Destination.Buffer.Offset = destOffset;
-            request.Destination.Buffer.Size = chunk.UncompressedSize;
-            queue->EnqueueRequest(&request);
-            destOffset += request.UncompressedSize;
-        }
+    // Evicts the file from the system file cache before every run
+    bool ColdCache;
 
-        // Signal the fence when done
-        queue->EnqueueSignal(fence.get(), fenceValue);
+    // For the texture destinations, the layout of each texture
+    Destination Destination;
+    TextureLayout const* Texture;
 
-        auto startTime = std::chrono::high_resolution_clock::now();
-        auto startCycleTime = GetProcessCycleTime();
+    // When set, picks the CPU or the GPU for each GDEFLATE request
+    HybridRouter* Router;
+};
 
-        // Tell DirectStorage to start executing all queued items.
-        queue->Submit();
+// Drops whatever the system file cache holds of a file, so that the next reads
+// come from the drive.  Opening a handle without buffering makes the cache
+// manager flush and purge the file's cached pages, as long as no other handle
+// has it mapped.
+void EvictFromFileCache(wchar_t const* filename)
+{
+    ScopedHandle handle(CreateFile(
+        filename,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING,
+        nullptr));
 
-        // Wait for the submitted work to complete
-        WaitForSingleObject(fenceEvent.get(), INFINITE);
+    if (handle.get() == INVALID_HANDLE_VALUE)
+    {
+        handle.release();
+        winrt::throw_last_error();
+    }
+}
 
-        auto endCycleTime = GetProcessCycleTime();
-        auto endTime = std::chrono::high_resolution_clock::now();
+// Loads a file over and over on its own queue until it's stopped.  This stands
+// in for the bulk loading that's going on while a game streams in assets.
+class BackgroundLoad
+{
+public:
+    BackgroundLoad(IDStorageFactory* factory, ID3D12Device* device, TestFile const& testFile)
+        : m_metadata(testFile.Metadata)
+    {
+        check_hresult(factory->OpenFile(testFile.Filename.c_str(), IID_PPV_ARGS(m_file.put())));
+
+        DSTORAGE_QUEUE_DESC queueDesc{};
+        queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+        queueDesc.Priority = DSTORAGE_PRIORITY_LOW;
+        queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        queueDesc.Device = device;
+        check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(m_queue.put())));
+
+        D3D12_HEAP_PROPERTIES bufferHeapProps = {};
+        bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+        D3D12_RESOURCE_DESC bufferDesc = {};
+        bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bufferDesc.Width = m_metadata.UncompressedSize;
+        bufferDesc.Height = 1;
+        bufferDesc.DepthOrArraySize = 1;
+        bufferDesc.MipLevels = 1;
+        bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
+        bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bufferDesc.SampleDesc.Count = 1;
+
+        check_hresult(device->CreateCommittedResource(
+            &bufferHeapProps,
+            D3D12_HEAP_FLAG_NONE,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(m_buffer.put())));
+
+        check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_fence.put())));
+        m_fenceEvent.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+        m_thread = std::thread([this] { Run(); });
+    }
 
-        if (fence->GetCompletedValue() == (uint64_t)-1)
-        {
-            // Device removed!  Give DirectStorage a chance to detect the error.
-            Sleep(5);
-        }
+    ~BackgroundLoad()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
 
-        // If an error was detected the first failure record
-        // can be retrieved to get more details.
-        DSTORAGE_ERROR_RECORD errorRecord{};
-        queue->RetrieveErrorRecord(&errorRecord);
-        if (FAILED(errorRecord.FirstFailure.HResult))
+private:
+    void Run()
+    {
+        for (uint64_t fenceValue = 1; !m_stop; ++fenceValue)
         {
-            //
-            // errorRecord.FailureCount - The number of failed requests in the queue since the last
-            //                            RetrieveErrorRecord call.
-            // errorRecord.FirstFailure - Detailed record about the first failed command in the enqueue order.
-            //
-            std::cout << "The DirectStorage request failed! HRESULT=0x" << std::hex << errorRecord.FirstFailure.HResult
-                      << std::endl;
+            check_hresult(m_fence->SetEventOnCompletion(fenceValue, m_fenceEvent.get()));
 
-            if (errorRecord.FirstFailure.CommandType == DSTORAGE_COMMAND_TYPE_REQUEST)
+            uint32_t pendingRequests = 0;
+            for (auto const& chunk : m_metadata.Chunks)
             {
-                auto& r = errorRecord.FirstFailure.Request.Request;
-
-                std::cout << std::dec << "   " << r.Source.File.Offset << "   " << r.Source.File.Size << std::endl;
+                DSTORAGE_REQUEST request = {};
+                request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+                request.Options.CompressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
+                request.Source.File.Source = m_file.get();
+                request.Source.File.Offset = chunk.Offset;
+                request.Source.File.Size = chunk.CompressedSize;
+                request.UncompressedSize = chunk.UncompressedSize;
+                request.Destination.Buffer.Resource = m_buffer.get();
+                request.Destination.Buffer.Offset = chunk.Offset;
+                request.Destination.Buffer.Size = chunk.UncompressedSize;
+                m_queue->EnqueueRequest(&request);
+
+                if (++pendingRequests == DSTORAGE_MAX_QUEUE_CAPACITY)
+                {
+                    m_queue->Submit();
+                    pendingRequests = 0;
+                }
             }
-            std::terminate();
-        }
-        else
-        {
-            auto duration = endTime - startTime;
 
-            using dseconds = std::chrono::duration<double>;
-
-            double durationInSeconds = std::chrono::duration_cast<dseconds>(duration).count();
-            double bandwidth = (metadata.UncompressedSize / durationInSeconds) / 1000.0 / 1000.0 / 1000.0;
-            meanBandwidth += bandwidth;
-
-            meanCycleTime += (endCycleTime - startCycleTime);
-
-            std::cout << ".";
+            m_queue->EnqueueSignal(m_fence.get(), fenceValue);
+            m_queue->Submit();
+            WaitForSingleObject(m_fenceEvent.get(), INFINITE);
         }
-        ++fenceValue;
     }
 
-    meanBandwidth /= numRuns;
-    meanCycleTime /= numRuns;
-
-    std::cout << "  " << meanBandwidth << " GB/s"
-              << " mean cycle time: " << std::dec << meanCycleTime << std::endl;
-
-    return {meanBandwidth, meanCycleTime};
-}
+    Metadata const& m_metadata;
+    com_ptr<IDStorageFile> m_file;
+    com_ptr<IDStorageQueue> m_queue;
+    com_ptr<ID3D12Resource> m_buffer;
+    com_ptr<ID3D12Fence> m_fence;
+    ScopedHandle m_fenceEvent;
+    std::atomic<bool> m_stop = false;
+    std::thread m_thread;
+};
 
-int wmain(int argc, wchar_t* argv[])
+// Keeps the GPU busy for a percentage of every frame, on a direct queue of its
+// own, standing in for a game's rendering while DirectStorage decompresses.
+// The amount of work per frame is calibrated on the idle GPU first, and the
+// time each frame's work takes from submission to completion is recorded, so
+// that the effect of decompression on frame times can be seen.
+class GpuLoad
 {
-    enum class TestCase
+public:
+    static constexpr double FRAME_MS = 1000.0 / 60.0;
+
+    GpuLoad(ID3D12Device* device, uint32_t loadPercent)
+        : m_device(device)
     {
-        Uncompressed,
-#if USE_ZLIB
-        CpuZLib,
-#endif
-        CpuGDeflate,
-        GpuGDeflate
-    };
+        check_hresult(device->CreateRootSignature(
+            0,
+            g_pGpuLoadCS,
+            sizeof(g_pGpuLoadCS),
+            IID_PPV_ARGS(m_rootSignature.put())));
+
+        D3D12_COMPUTE_PIPELINE_STATE_DESC psoDesc{};
+        psoDesc.pRootSignature = m_rootSignature.get();
+        psoDesc.CS = {g_pGpuLoadCS, sizeof(g_pGpuLoadCS)};
+        check_hresult(device->CreateComputePipelineState(&psoDesc, IID_PPV_ARGS(m_pso.put())));
+
+        D3D12_COMMAND_QUEUE_DESC queueDesc{};
+        queueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+        check_hresult(device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(m_queue.put())));
+        check_hresult(
+            device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(m_allocator.put())));
+        check_hresult(device->CreateCommandList(
+            0,
+            D3D12_COMMAND_LIST_TYPE_DIRECT,
+            m_allocator.get(),
+            nullptr,
+            IID_PPV_ARGS(m_commandList.put())));
+        check_hresult(m_commandList->Close());
+
+        D3D12_HEAP_PROPERTIES bufferHeapProps = {};
+        bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+        D3D12_RESOURCE_DESC bufferDesc = {};
+        bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bufferDesc.Width = 256;
+        bufferDesc.Height = 1;
+        bufferDesc.DepthOrArraySize = 1;
+        bufferDesc.MipLevels = 1;
+        bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
+        bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bufferDesc.SampleDesc.Count = 1;
+        bufferDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+
+        check_hresult(device->CreateCommittedResource(
+            &bufferHeapProps,
+            D3D12_HEAP_FLAG_NONE,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            nullptr,
+            IID_PPV_ARGS(m_output.put())));
+
+        check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_fence.put())));
+        m_fenceEvent.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+        // Scale the work until a frame takes the requested share of the frame
+        // time, then average a few more frames for the idle frame time
+        constexpr int CALIBRATION_FRAMES = 30;
+        constexpr int IDLE_FRAMES = 10;
+
+        double targetMs = FRAME_MS * loadPercent / 100.0;
+        double idleMs = 0;
+
+        for (int frame = 0; frame < CALIBRATION_FRAMES + IDLE_FRAMES; ++frame)
+        {
+            double frameMs = RunFrame();
+            if (frame < CALIBRATION_FRAMES)
+            {
+                double scale = std::clamp(targetMs / std::max(frameMs, 0.01), 0.25, 4.0);
+                m_iterations = std::max(1u, static_cast<uint32_t>(m_iterations * scale));
+            }
+            else
+            {
+                idleMs += frameMs;
+            }
+        }
+        m_idleFrameMs = idleMs / IDLE_FRAMES;
 
-    TestCase testCases[] =
-    { TestCase::Uncompressed,
-#if USE_ZLIB
-      TestCase::CpuZLib,
-#endif
-      TestCase::CpuGDeflate,
-      TestCase::GpuGDeflate };
+        m_thread = std::thread([this] { Run(); });
+    }
 
-    if (argc < 2)
+    ~GpuLoad()
     {
-        ShowHelpText();
-        return -1;
+        Stop();
     }
 
-    const wchar_t* originalFilename = argv[1];
-    std::wstring gdeflateFilename = std::wstring(originalFilename) + L".gdeflate";
+    double GetIdleFrameMs() const
+    {
+        return m_idleFrameMs;
+    }
 
-#if USE_ZLIB
-    std::wstring zlibFilename = std::wstring(originalFilename) + L".zlib";
-#endif
+    // Stops the load, and returns the time that each frame took since it started
+    std::vector<double> Stop()
+    {
+        if (m_thread.joinable())
+        {
+            m_stop = true;
+            m_thread.join();
+        }
+        return std::move(m_frameTimes);
+    }
 
-    uint32_t chunkSizeMiB = 16;
-    if (argc > 2)
+private:
+    void Run()
     {
-        chunkSizeMiB = _wtoi(argv[2]);
-        if (chunkSizeMiB == 0)
+        using Clock = std::chrono::high_resolution_clock;
+
+        while (!m_stop)
         {
-            ShowHelpText();
-            std::wcout << std::endl << L"Invalid chunk size: " << argv[2] << std::endl;
-            return -1;
+            auto frameStart = Clock::now();
+            m_frameTimes.push_back(RunFrame());
+            std::this_thread::sleep_until(frameStart + std::chrono::duration<double, std::milli>(FRAME_MS));
         }
     }
-    uint32_t chunkSizeBytes = chunkSizeMiB * 1024 * 1024;
 
-    Metadata uncompressedMetadata = GenerateUncompressedMetadata(originalFilename, chunkSizeBytes);
-    Metadata gdeflateMetadata =
-        Compress(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE, originalFilename, gdeflateFilename.c_str(), chunkSizeBytes);
+    // Returns the milliseconds from submitting the frame's work until it completes
+    double RunFrame()
+    {
+        constexpr uint32_t NUM_GROUPS = 1024;
 
-#if USE_ZLIB
-    Metadata zlibMetadata =
-        Compress(DSTORAGE_CUSTOM_COMPRESSION_0, originalFilename, zlibFilename.c_str(), chunkSizeBytes);
-#endif
+        check_hresult(m_allocator->Reset());
+        check_hresult(m_commandList->Reset(m_allocator.get(), m_pso.get()));
+        m_commandList->SetComputeRootSignature(m_rootSignature.get());
+        m_commandList->SetComputeRoot32BitConstant(0, m_iterations, 0);
+        m_commandList->SetComputeRootUnorderedAccessView(1, m_output->GetGPUVirtualAddress());
+        m_commandList->Dispatch(NUM_GROUPS, 1, 1);
+        check_hresult(m_commandList->Close());
 
-    constexpr uint32_t MAX_STAGING_BUFFER_SIZE = 1024;
+        ++m_fenceValue;
+        check_hresult(m_fence->SetEventOnCompletion(m_fenceValue, m_fenceEvent.get()));
 
-    struct Result
-    {
-        TestCase TestCase;
-        uint32_t StagingBufferSizeMiB;
-        TestResult Data;
-    };
+        auto startTime = std::chrono::high_resolution_clock::now();
 
-    std::vector<Result> results;
+        ID3D12CommandList* commandLists[] = {m_commandList.get()};
+        m_queue->ExecuteCommandLists(1, commandLists);
+        check_hresult(m_queue->Signal(m_fence.get(), m_fenceValue));
+        WaitForSingleObject(m_fenceEvent.get(), INFINITE);
 
-    for (TestCase testCase : testCases)
-    {
-        DSTORAGE_COMPRESSION_FORMAT compressionFormat;
-        DSTORAGE_CONFIGURATION config{};
-        int numRuns = 0;
-        Metadata* metadata = nullptr;
-        wchar_t const* filename = nullptr;
+        auto endTime = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
 
-        switch (testCase)
-        {
-        case TestCase::Uncompressed:
+    ID3D12Device* m_device;
+    com_ptr<ID3D12RootSignature> m_rootSignature;
+    com_ptr<ID3D12PipelineState> m_pso;
+    com_ptr<ID3D12CommandQueue> m_queue;
+    com_ptr<ID3D12CommandAllocator> m_allocator;
+    com_ptr<ID3D12GraphicsCommandList> m_commandList;
+    com_ptr<ID3D12Resource> m_output;
+    com_ptr<ID3D12Fence> m_fence;
+    ScopedHandle m_fenceEvent;
+    uint64_t m_fenceValue = 0;
+
+    uint32_t m_iterations = 256;
+    double m_idleFrameMs = 0;
+
+    std::vector<double> m_frameTimes;
+    std::atomic<bool> m_stop = false;
+    std::thread m_thread;
+};
+
+TestResult RunTest(
+    IDStorageFactory* factory,
+    TestParameters const& parameters,
+    wchar_t const* sourceFilename,
+    DSTORAGE_COMPRESSION_FORMAT compressionFormat,
+    Metadata const& metadata,
+    int numRuns)
+{
+    ReadPattern const& pattern = *parameters.Pattern;
+
+    std::vector<com_ptr<IDStorageFile>> files(pattern.NumFileHandles);
+    auto openFiles = [&]()
+    {
+        for (auto& file : files)
+        {
+            HRESULT hr = factory->OpenFile(sourceFilename, IID_PPV_ARGS(file.put()));
+            if (FAILED(hr))
+            {
+                std::wcout << L"The file '" << sourceFilename << L"' could not be opened. HRESULT=0x" << std::hex
+                           << hr << std::endl;
+                std::abort();
+            }
+        }
+    };
+    openFiles();
+
+    // The staging buffer size must be set before any queues are created.
+    std::cout << "  " << parameters.StagingSizeMiB << " MiB staging buffer";
+    if (parameters.QueueCapacity != DSTORAGE_MAX_QUEUE_CAPACITY || parameters.NumQueues != 1 ||
+        parameters.SubmitBatchSize != 0)
+    {
+        std::cout << ", " << parameters.NumQueues << "x" << parameters.QueueCapacity << " queue, batches of "
+                  << parameters.SubmitBatchSize;
+    }
+    if (!pattern.Name.empty())
+        std::wcout << L", " << pattern.Name << L" reads";
+    if (parameters.Destination != Destination::Buffer)
+        std::wcout << L", " << GetDestinationName(parameters.Destination);
+    std::cout << ": ";
+
+    uint32_t stagingBufferSizeBytes = parameters.StagingSizeMiB * 1024 * 1024;
+    check_hresult(factory->SetStagingBufferSize(stagingBufferSizeBytes));
+
+    if (metadata.LargestCompressedChunkSize > stagingBufferSizeBytes)
+    {
+        std::cout << " SKIPPED! " << std::endl;
+        return {0, 0, 0};
+    }
+
+    com_ptr<ID3D12Device> device;
+    check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device)));
+
+    // Create the DirectStorage queues which will be used to load data into a
+    // buffer on the GPU.  Each one signals its own fence when it's done.
+    DSTORAGE_QUEUE_DESC queueDesc{};
+    queueDesc.Capacity = parameters.QueueCapacity;
+    queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+    queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    queueDesc.Device = device.get();
+
+    std::vector<com_ptr<IDStorageQueue>> queues(parameters.NumQueues);
+    std::vector<com_ptr<ID3D12Fence>> fences(parameters.NumQueues);
+    std::vector<ScopedHandle> fenceEvents;
+    std::vector<HANDLE> fenceEventHandles;
+
+    for (uint32_t i = 0; i < parameters.NumQueues; ++i)
+    {
+        check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(queues[i].put())));
+        check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(fences[i].put())));
+        fenceEvents.emplace_back(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        fenceEventHandles.push_back(fenceEvents.back().get());
+    }
+
+    // A queue can't hold more entries than its capacity, so it's submitted
+    // at least that often.  In latency mode each request is followed by a
+    // status, which takes an entry too.
+    uint32_t entriesPerRequest = parameters.MeasureLatency ? 2 : 1;
+    uint32_t submitBatchEntries = parameters.QueueCapacity;
+    if (parameters.SubmitBatchSize != 0)
+        submitBatchEntries = std::min(submitBatchEntries, parameters.SubmitBatchSize * entriesPerRequest);
+
+    // Create the ID3D12Resource buffer which will be populated with the
+    // file's contents, or a texture for each mip chain in it
+    D3D12_HEAP_PROPERTIES bufferHeapProps = {};
+    bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+    com_ptr<ID3D12Resource> bufferResource;
+    std::vector<com_ptr<ID3D12Resource>> textures;
+
+    if (parameters.Destination == Destination::Buffer)
+    {
+        D3D12_RESOURCE_DESC bufferDesc = {};
+        bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bufferDesc.Width = metadata.UncompressedSize;
+        bufferDesc.Height = 1;
+        bufferDesc.DepthOrArraySize = 1;
+        bufferDesc.MipLevels = 1;
+        bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
+        bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bufferDesc.SampleDesc.Count = 1;
+
+        check_hresult(device->CreateCommittedResource(
+            &bufferHeapProps,
+            D3D12_HEAP_FLAG_NONE,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(bufferResource.put())));
+    }
+    else
+    {
+        size_t numTextures = metadata.Chunks.size();
+        if (parameters.Destination == Destination::TextureRegion)
+            numTextures /= parameters.Texture->Desc.MipLevels;
+
+        textures.resize(numTextures);
+        for (auto& texture : textures)
+        {
+            check_hresult(device->CreateCommittedResource(
+                &bufferHeapProps,
+                D3D12_HEAP_FLAG_NONE,
+                &parameters.Texture->Desc,
+                D3D12_RESOURCE_STATE_COMMON,
+                nullptr,
+                IID_PPV_ARGS(texture.put())));
+        }
+    }
+
+    std::optional<BackgroundLoad> backgroundLoad;
+    if (parameters.BackgroundFile)
+        backgroundLoad.emplace(factory, device.get(), *parameters.BackgroundFile);
+
+    std::optional<GpuLoad> gpuLoad;
+    if (parameters.GpuLoadPercent != 0)
+        gpuLoad.emplace(device.get(), parameters.GpuLoadPercent);
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    // Where each chunk goes in the buffer, and which chunk each request reads
+    std::vector<uint32_t> chunkDestOffsets;
+    uint32_t chunkDestOffset = 0;
+    for (ChunkMetadata const& chunk : metadata.Chunks)
+    {
+        chunkDestOffsets.push_back(chunkDestOffset);
+        chunkDestOffset += chunk.UncompressedSize;
+    }
+
+    const std::vector<uint32_t> readOrder = GetReadOrder(pattern, metadata);
+    const uint32_t numRequests = static_cast<uint32_t>(readOrder.size());
+
+    uint64_t bytesPerRun = 0;
+    for (uint32_t chunkIndex : readOrder)
+        bytesPerRun += metadata.Chunks[chunkIndex].UncompressedSize;
+
+    std::vector<Clock::time_point> enqueueTimes(numRequests);
+    std::vector<Clock::time_point> completionTimes(numRequests);
+    std::vector<double> latencies; // Microseconds, for every request of every run
+
+    uint64_t fenceValue = 1;
+
+    double meanBandwidth = 0;
+    uint64_t meanCycleTime = 0;
+
+    double firstRunBandwidth = 0;
+    double steadyStateBandwidth = 0;
+
+    for (int i = 0; i < numRuns; ++i)
+    {
+        // DirectStorage's handles are closed while the file is evicted, so
+        // that none of them keep its pages in the cache
+        if (parameters.ColdCache)
+        {
+            for (auto& file : files)
+            {
+                file->Close();
+                file = nullptr;
+            }
+            EvictFromFileCache(sourceFilename);
+            openFiles();
+        }
+
+        for (uint32_t q = 0; q < parameters.NumQueues; ++q)
+            check_hresult(fences[q]->SetEventOnCompletion(fenceValue, fenceEventHandles[q]));
+
+        // A status array entry per request, which another thread polls so that
+        // it can record when each one completes.  The statuses are enqueued on
+        // the same queue as their request, right after it.
+        com_ptr<IDStorageStatusArray> statusArray;
+        std::atomic<uint32_t> numEnqueued = 0;
+        std::thread statusPoller;
+
+        if (parameters.MeasureLatency)
+        {
+            check_hresult(factory->CreateStatusArray(numRequests, "Latency", IID_PPV_ARGS(statusArray.put())));
+
+            statusPoller = std::thread(
+                [&]()
+                {
+                    std::vector<bool> complete(numRequests, false);
+                    uint32_t firstIncomplete = 0;
+
+                    while (firstIncomplete < numRequests)
+                    {
+                        uint32_t enqueued = numEnqueued.load(std::memory_order_acquire);
+                        Clock::time_point now = Clock::now();
+
+                        for (uint32_t r = firstIncomplete; r < enqueued; ++r)
+                        {
+                            if (!complete[r] && statusArray->IsComplete(r))
+                            {
+                                complete[r] = true;
+                                completionTimes[r] = now;
+                            }
+                        }
+
+                        while (firstIncomplete < enqueued && complete[firstIncomplete])
+                            ++firstIncomplete;
+
+                        std::this_thread::yield();
+                    }
+                });
+        }
+
+        // Requests may be submitted while they're still being enqueued, so the
+        // time taken to enqueue them is measured too.
+        auto startTime = Clock::now();
+        auto startCycleTime = GetProcessCycleTime();
+
+        // Enqueue requests to load each compressed chunk, handing them to the
+        // queues and file handles in turn.
+        std::vector<uint32_t> pendingEntries(parameters.NumQueues, 0);
+        for (uint32_t requestIndex = 0; requestIndex < numRequests; ++requestIndex)
+        {
+            uint32_t chunkIndex = readOrder[requestIndex];
+            auto const& chunk = metadata.Chunks[chunkIndex];
+            size_t queueIndex = requestIndex % parameters.NumQueues;
+
+            DSTORAGE_REQUEST request = {};
+            request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+            request.Options.CompressionFormat = compressionFormat;
+            if (parameters.Router)
+                request.Options.CompressionFormat = parameters.Router->Route(chunk.UncompressedSize);
+            request.Source.File.Source = files[requestIndex % files.size()].get();
+            request.Source.File.Offset = chunk.Offset;
+            request.Source.File.Size = chunk.CompressedSize;
+            request.UncompressedSize = chunk.UncompressedSize;
+
+            switch (parameters.Destination)
+            {
+            case Destination::Buffer:
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+                request.Destination.Buffer.Resource = bufferResource.get();
+                request.Destination.Buffer.Offset = chunkDestOffsets[chunkIndex];
+                request.Destination.Buffer.Size = chunk.UncompressedSize;
+                break;
+
+            case Destination::TextureRegion:
+            {
+                // Each chunk is one mip, of the texture for its mip chain
+                D3D12_RESOURCE_DESC const& desc = parameters.Texture->Desc;
+                uint32_t mip = chunkIndex % desc.MipLevels;
+
+                D3D12_BOX destBox{};
+                destBox.right = std::max(1u, static_cast<uint32_t>(desc.Width >> mip));
+                destBox.bottom = std::max(1u, desc.Height >> mip);
+                destBox.back = 1;
+
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION;
+                request.Destination.Texture.Resource = textures[chunkIndex / desc.MipLevels].get();
+                request.Destination.Texture.SubresourceIndex = mip;
+                request.Destination.Texture.Region = destBox;
+                break;
+            }
+
+            case Destination::MultipleSubresources:
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES;
+                request.Destination.MultipleSubresources.Resource = textures[chunkIndex].get();
+                request.Destination.MultipleSubresources.FirstSubresource = 0;
+                break;
+            }
+
+            queues[queueIndex]->EnqueueRequest(&request);
+
+            if (parameters.MeasureLatency)
+            {
+                enqueueTimes[requestIndex] = Clock::now();
+                queues[queueIndex]->EnqueueStatus(statusArray.get(), requestIndex);
+                numEnqueued.store(requestIndex + 1, std::memory_order_release);
+            }
+
+            pendingEntries[queueIndex] += entriesPerRequest;
+            if (pendingEntries[queueIndex] >= submitBatchEntries)
+            {
+                queues[queueIndex]->Submit();
+                pendingEntries[queueIndex] = 0;
+            }
+        }
+
+        // Signal the fences when done, and tell DirectStorage to start
+        // executing all the remaining queued items.
+        for (uint32_t q = 0; q < parameters.NumQueues; ++q)
+        {
+            queues[q]->EnqueueSignal(fences[q].get(), fenceValue);
+            queues[q]->Submit();
+        }
+
+        // Wait for the submitted work to complete
+        WaitForMultipleObjects(parameters.NumQueues, fenceEventHandles.data(), TRUE, INFINITE);
+
+        auto endCycleTime = GetProcessCycleTime();
+        auto endTime = Clock::now();
+
+        if (statusPoller.joinable())
+        {
+            statusPoller.join();
+
+            for (uint32_t r = 0; r < numRequests; ++r)
+            {
+                using dmicroseconds = std::chrono::duration<double, std::micro>;
+                latencies.push_back(dmicroseconds(completionTimes[r] - enqueueTimes[r]).count());
+            }
+        }
+
+        for (uint32_t q = 0; q < parameters.NumQueues; ++q)
+        {
+            if (fences[q]->GetCompletedValue() == (uint64_t)-1)
+            {
+                // Device removed!  Give DirectStorage a chance to detect the error.
+                Sleep(5);
+                break;
+            }
+        }
+
+        for (auto& queue : queues)
+        {
+            // If an error was detected the first failure record
+            // can be retrieved to get more details.
+            DSTORAGE_ERROR_RECORD errorRecord{};
+            queue->RetrieveErrorRecord(&errorRecord);
+            if (FAILED(errorRecord.FirstFailure.HResult))
+            {
+                //
+                // errorRecord.FailureCount - The number of failed requests in the queue since the last
+                //                            RetrieveErrorRecord call.
+                // errorRecord.FirstFailure - Detailed record about the first failed command in the enqueue order.
+                //
+                std::cout << "The DirectStorage request failed! HRESULT=0x" << std::hex
+                          << errorRecord.FirstFailure.HResult << std::endl;
+
+                if (errorRecord.FirstFailure.CommandType == DSTORAGE_COMMAND_TYPE_REQUEST)
+                {
+                    auto& r = errorRecord.FirstFailure.Request.Request;
+
+                    std::cout << std::dec << "   " << r.Source.File.Offset << "   " << r.Source.File.Size << std::endl;
+                }
+                std::terminate();
+            }
+        }
+
+        auto duration = endTime - startTime;
+
+        using dseconds = std::chrono::duration<double>;
+
+        double durationInSeconds = std::chrono::duration_cast<dseconds>(duration).count();
+        double bandwidth = (bytesPerRun / durationInSeconds) / 1000.0 / 1000.0 / 1000.0;
+        meanBandwidth += bandwidth;
+        if (i == 0)
+            firstRunBandwidth = bandwidth;
+        else
+            steadyStateBandwidth += bandwidth;
+
+        meanCycleTime += (endCycleTime - startCycleTime);
+
+        std::cout << ".";
+
+        ++fenceValue;
+    }
+
+    std::vector<double> frameTimes;
+    if (gpuLoad)
+        frameTimes = gpuLoad->Stop();
+
+    meanBandwidth /= numRuns;
+    meanCycleTime /= numRuns;
+    double cyclesPerByte = static_cast<double>(meanCycleTime) / bytesPerRun;
+
+    std::cout << "  " << meanBandwidth << " GB/s"
+              << " mean cycle time: " << std::dec << meanCycleTime << " (" << cyclesPerByte << " cycles/byte)"
+              << std::endl;
+
+    TestResult result{meanBandwidth, meanCycleTime, cyclesPerByte};
+    result.FirstRunBandwidth = firstRunBandwidth;
+    result.SteadyStateBandwidth = numRuns > 1 ? steadyStateBandwidth / (numRuns - 1) : firstRunBandwidth;
+
+    std::cout << "    first run: " << result.FirstRunBandwidth << " GB/s, steady state: "
+              << result.SteadyStateBandwidth << " GB/s" << (parameters.ColdCache ? " (cold)" : "") << std::endl;
+
+    if (parameters.Router)
+    {
+        result.CpuShare = parameters.Router->GetCpuByteShare();
+        std::cout << "    " << result.CpuShare * 100.0 << "% decompressed on the CPU" << std::endl;
+    }
+
+    if (!latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+
+        auto percentile = [&](double p) { return latencies[static_cast<size_t>(p * (latencies.size() - 1))]; };
+        result.LatencyP50 = percentile(0.5);
+        result.LatencyP99 = percentile(0.99);
+        result.LatencyMax = latencies.back();
+
+        for (double latency : latencies)
+        {
+            size_t bucket = latency < 1.0 ? 0 : static_cast<size_t>(std::log2(latency));
+            ++result.LatencyHistogram[std::min(bucket, NUM_LATENCY_BUCKETS - 1)];
+        }
+
+        std::cout << "    latency: p50 " << result.LatencyP50 << " us, p99 " << result.LatencyP99 << " us, max "
+                  << result.LatencyMax << " us" << std::endl;
+    }
+
+    if (!frameTimes.empty())
+    {
+        result.IdleFrameTime = gpuLoad->GetIdleFrameMs();
+        result.FrameTimeMean = std::accumulate(frameTimes.begin(), frameTimes.end(), 0.0) / frameTimes.size();
+
+        std::sort(frameTimes.begin(), frameTimes.end());
+        result.FrameTimeP99 = frameTimes[static_cast<size_t>(0.99 * (frameTimes.size() - 1))];
+
+        std::cout << "    frame time: idle " << result.IdleFrameTime << " ms, mean " << result.FrameTimeMean
+                  << " ms, p99 " << result.FrameTimeP99 << " ms" << std::endl;
+    }
+
+    return result;
+}
+
+// A load trace captured by BulkLoadDemo
+struct LoadTrace
+{
+    std::vector<std::wstring> Files;
+    std::vector<loadtrace::Request> Requests;
+};
+
+LoadTrace LoadCapturedTrace(wchar_t const* filename)
+{
+    std::ifstream s(filename, std::ios::in | std::ios::binary);
+
+    loadtrace::Header header{};
+    s.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!s || header.Id != loadtrace::Id || header.Version != loadtrace::CurrentVersion)
+    {
+        std::wcout << L"The load trace '" << filename << L"' could not be read." << std::endl;
+        std::abort();
+    }
+
+    LoadTrace trace;
+    trace.Files.resize(header.NumFiles);
+    for (std::wstring& file : trace.Files)
+    {
+        uint32_t length = 0;
+        s.read(reinterpret_cast<char*>(&length), sizeof(length));
+        file.resize(length);
+        s.read(reinterpret_cast<char*>(file.data()), length * sizeof(wchar_t));
+    }
+
+    trace.Requests.resize(header.NumRequests);
+    s.read(
+        reinterpret_cast<char*>(trace.Requests.data()),
+        static_cast<std::streamsize>(trace.Requests.size() * sizeof(loadtrace::Request)));
+
+    if (!s)
+    {
+        std::wcout << L"The load trace '" << filename << L"' is truncated." << std::endl;
+        std::abort();
+    }
+    return trace;
+}
+
+// Returns the format to replay a traced request with, or nothing if this build
+// can't decompress it.  BulkLoadDemo's GDEFLATE that was routed to the CPU goes
+// to CustomDecompression here too.
+std::optional<DSTORAGE_COMPRESSION_FORMAT> GetReplayFormat(loadtrace::Compression compression)
+{
+    switch (compression)
+    {
+    case loadtrace::Compression::None:
+        return DSTORAGE_COMPRESSION_FORMAT_NONE;
+
+    case loadtrace::Compression::GDeflate:
+        return DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+
+    case loadtrace::Compression::GDeflateCpu:
+        return CUSTOM_COMPRESSION_FORMAT_GDEFLATE_CPU;
+
+#if USE_ZLIB
+    case loadtrace::Compression::ZLib:
+        return DSTORAGE_CUSTOM_COMPRESSION_0;
+#endif
+
+    default:
+        // BulkLoadDemo's BC split ZLib is only understood by BulkLoadDemo
+        return std::nullopt;
+    }
+}
+
+// Replays a load trace as fast as DirectStorage will go, rather than at the
+// pace it was captured at.  Requests that were read from a file are read from
+// the same file, and the ones that were read from memory are read into memory
+// from the file before the runs start.  Every request that went to the GPU is
+// replayed into a buffer, since the trace doesn't record the textures; the
+// bytes read and decompressed are the same.  The destinations overlap, since
+// only the time taken is of interest.
+int ReplayLoadTrace(wchar_t const* traceFilename, bool coldCache)
+{
+    constexpr int numRuns = 5;
+
+    LoadTrace const trace = LoadCapturedTrace(traceFilename);
+
+    // GPU decompression stays enabled, as it is in BulkLoadDemo
+    DSTORAGE_CONFIGURATION config{};
+    check_hresult(DStorageSetConfiguration(&config));
+
+    com_ptr<IDStorageFactory> factory;
+    check_hresult(DStorageGetFactory(IID_PPV_ARGS(factory.put())));
+    factory->SetDebugFlags(DSTORAGE_DEBUG_SHOW_ERRORS | DSTORAGE_DEBUG_BREAK_ON_ERROR);
+
+    CustomDecompression customDecompression(factory.get(), std::max(1u, std::thread::hardware_concurrency()));
+
+    // The requests that can be replayed, with their formats, and the largest
+    // source and destinations, which size the staging buffer and the buffers
+    struct ReplayRequest
+    {
+        loadtrace::Request const* Traced;
+        DSTORAGE_COMPRESSION_FORMAT Format;
+        uint64_t MemoryOffset; // of the source in memorySources, if it's read from memory
+    };
+
+    std::vector<ReplayRequest> requests;
+    uint32_t numSkipped = 0;
+    uint32_t largestSourceSize = 0;
+    uint64_t largestMemoryDest = 0;
+    uint64_t largestBufferDest = 0;
+    uint64_t memorySourcesSize = 0;
+    uint64_t bytesPerRun = 0;
+
+    for (loadtrace::Request const& traced : trace.Requests)
+    {
+        std::optional<DSTORAGE_COMPRESSION_FORMAT> format = GetReplayFormat(traced.Format);
+        if (!format)
+        {
+            ++numSkipped;
+            continue;
+        }
+
+        ReplayRequest request{&traced, *format, 0};
+        if (traced.SourceType == loadtrace::Source::Memory)
+        {
+            request.MemoryOffset = memorySourcesSize;
+            memorySourcesSize += traced.CompressedSize;
+        }
+        requests.push_back(request);
+
+        largestSourceSize = std::max(largestSourceSize, traced.CompressedSize);
+        uint64_t& largestDest =
+            traced.DestinationType == loadtrace::Destination::Memory ? largestMemoryDest : largestBufferDest;
+        largestDest = std::max<uint64_t>(largestDest, traced.UncompressedSize);
+        bytesPerRun += traced.UncompressedSize;
+    }
+
+    std::wcout << L"Replaying " << requests.size() << L" requests from " << trace.Files.size() << L" files";
+    if (numSkipped > 0)
+        std::wcout << L", skipping " << numSkipped << L" in formats this build can't decompress";
+    if (!trace.Requests.empty())
+    {
+        std::wcout << L", captured over " << trace.Requests.back().EnqueueTime / 1000.0 << L" ms";
+    }
+    std::wcout << std::endl;
+
+    if (requests.empty())
+        return 0;
+
+    // The memory sources are read once, up front, as BulkLoadDemo reads them
+    // before the requests that use them are enqueued
+    std::vector<char> memorySources(memorySourcesSize);
+    for (ReplayRequest const& request : requests)
+    {
+        if (request.Traced->SourceType != loadtrace::Source::Memory)
+            continue;
+
+        std::ifstream s(trace.Files[request.Traced->FileIndex], std::ios::in | std::ios::binary);
+        s.seekg(static_cast<std::streamoff>(request.Traced->FileOffset));
+        s.read(memorySources.data() + request.MemoryOffset, request.Traced->CompressedSize);
+        if (!s)
+        {
+            std::wcout << L"The file '" << trace.Files[request.Traced->FileIndex] << L"' could not be read."
+                       << std::endl;
+            std::abort();
+        }
+    }
+
+    constexpr uint32_t DEFAULT_STAGING_BUFFER_SIZE = 32 * 1024 * 1024;
+    check_hresult(factory->SetStagingBufferSize(std::max(DEFAULT_STAGING_BUFFER_SIZE, largestSourceSize)));
+
+    com_ptr<ID3D12Device> device;
+    check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device)));
+
+    std::vector<com_ptr<IDStorageFile>> files(trace.Files.size());
+    auto openFiles = [&]()
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            HRESULT hr = factory->OpenFile(trace.Files[i].c_str(), IID_PPV_ARGS(files[i].put()));
+            if (FAILED(hr))
+            {
+                std::wcout << L"The file '" << trace.Files[i] << L"' could not be opened. HRESULT=0x" << std::hex
+                           << hr << std::endl;
+                std::abort();
+            }
+        }
+    };
+    openFiles();
+
+    // A queue for each source type, since a queue only takes one
+    com_ptr<IDStorageQueue> queues[2];
+    com_ptr<ID3D12Fence> fences[2];
+    ScopedHandle fenceEvents[2];
+    HANDLE fenceEventHandles[2];
+
+    for (uint32_t q = 0; q < 2; ++q)
+    {
+        DSTORAGE_QUEUE_DESC queueDesc{};
+        queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+        queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+        queueDesc.SourceType = q == 0 ? DSTORAGE_REQUEST_SOURCE_FILE : DSTORAGE_REQUEST_SOURCE_MEMORY;
+        queueDesc.Device = device.get();
+
+        check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(queues[q].put())));
+        check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(fences[q].put())));
+        fenceEvents[q].reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        fenceEventHandles[q] = fenceEvents[q].get();
+    }
+
+    std::vector<char> memoryDest(largestMemoryDest);
+
+    com_ptr<ID3D12Resource> bufferResource;
+    if (largestBufferDest > 0)
+    {
+        D3D12_HEAP_PROPERTIES bufferHeapProps = {};
+        bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+        D3D12_RESOURCE_DESC bufferDesc = {};
+        bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bufferDesc.Width = largestBufferDest;
+        bufferDesc.Height = 1;
+        bufferDesc.DepthOrArraySize = 1;
+        bufferDesc.MipLevels = 1;
+        bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
+        bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bufferDesc.SampleDesc.Count = 1;
+
+        check_hresult(device->CreateCommittedResource(
+            &bufferHeapProps,
+            D3D12_HEAP_FLAG_NONE,
+            &bufferDesc,
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(bufferResource.put())));
+    }
+
+    using Clock = std::chrono::high_resolution_clock;
+    using dseconds = std::chrono::duration<double>;
+
+    uint64_t fenceValue = 1;
+    double meanBandwidth = 0;
+    uint64_t meanCycleTime = 0;
+
+    for (int i = 0; i < numRuns; ++i)
+    {
+        if (coldCache)
+        {
+            for (auto& file : files)
+            {
+                file->Close();
+                file = nullptr;
+            }
+            for (std::wstring const& filename : trace.Files)
+                EvictFromFileCache(filename.c_str());
+            openFiles();
+        }
+
+        for (uint32_t q = 0; q < 2; ++q)
+            check_hresult(fences[q]->SetEventOnCompletion(fenceValue, fenceEventHandles[q]));
+
+        auto startTime = Clock::now();
+        auto startCycleTime = GetProcessCycleTime();
+
+        uint32_t pendingEntries[2] = {};
+        for (ReplayRequest const& replayed : requests)
+        {
+            loadtrace::Request const& traced = *replayed.Traced;
+            uint32_t const queueIndex = traced.SourceType == loadtrace::Source::Memory ? 1 : 0;
+
+            DSTORAGE_REQUEST request = {};
+            request.Options.CompressionFormat = replayed.Format;
+            if (queueIndex == 1)
+            {
+                request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_MEMORY;
+                request.Source.Memory.Source = memorySources.data() + replayed.MemoryOffset;
+                request.Source.Memory.Size = traced.CompressedSize;
+            }
+            else
+            {
+                request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+                request.Source.File.Source = files[traced.FileIndex].get();
+                request.Source.File.Offset = traced.FileOffset;
+                request.Source.File.Size = traced.CompressedSize;
+            }
+            request.UncompressedSize = traced.UncompressedSize;
+
+            if (traced.DestinationType == loadtrace::Destination::Memory)
+            {
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+                request.Destination.Memory.Buffer = memoryDest.data();
+                request.Destination.Memory.Size = traced.UncompressedSize;
+            }
+            else
+            {
+                request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+                request.Destination.Buffer.Resource = bufferResource.get();
+                request.Destination.Buffer.Offset = 0;
+                request.Destination.Buffer.Size = traced.UncompressedSize;
+            }
+
+            queues[queueIndex]->EnqueueRequest(&request);
+
+            if (++pendingEntries[queueIndex] == DSTORAGE_MAX_QUEUE_CAPACITY)
+            {
+                queues[queueIndex]->Submit();
+                pendingEntries[queueIndex] = 0;
+            }
+        }
+
+        for (uint32_t q = 0; q < 2; ++q)
+        {
+            queues[q]->EnqueueSignal(fences[q].get(), fenceValue);
+            queues[q]->Submit();
+        }
+
+        WaitForMultipleObjects(2, fenceEventHandles, TRUE, INFINITE);
+
+        auto endCycleTime = GetProcessCycleTime();
+        auto endTime = Clock::now();
+
+        for (auto& queue : queues)
+        {
+            DSTORAGE_ERROR_RECORD errorRecord{};
+            queue->RetrieveErrorRecord(&errorRecord);
+            if (FAILED(errorRecord.FirstFailure.HResult))
+            {
+                std::cout << "The DirectStorage request failed! HRESULT=0x" << std::hex
+                          << errorRecord.FirstFailure.HResult << std::endl;
+                std::terminate();
+            }
+        }
+
+        double durationInSeconds = std::chrono::duration_cast<dseconds>(endTime - startTime).count();
+        double bandwidth = (bytesPerRun / durationInSeconds) / 1000.0 / 1000.0 / 1000.0;
+        meanBandwidth += bandwidth;
+        meanCycleTime += (endCycleTime - startCycleTime);
+
+        std::cout << "  run " << i + 1 << ": " << durationInSeconds * 1000.0 << " ms, " << bandwidth << " GB/s"
+                  << std::endl;
+
+        ++fenceValue;
+    }
+
+    meanBandwidth /= numRuns;
+    meanCycleTime /= numRuns;
+    std::cout << "  " << meanBandwidth << " GB/s"
+              << " mean cycle time: " << std::dec << meanCycleTime << " ("
+              << static_cast<double>(meanCycleTime) / bytesPerRun << " cycles/byte)"
+              << (coldCache ? " (cold)" : "") << std::endl;
+
+    return 0;
+}
+
+// Describes the machine that the results were measured on, so that results
+// from different machines, drivers and runtimes can be told apart.
+struct SystemInfo
+{
+    std::wstring Adapter;
+    uint32_t AdapterVendorId = 0;
+    uint32_t AdapterDeviceId = 0;
+    std::wstring DriverVersion;
+    std::wstring StorageDevice;
+    std::wstring StorageBusType;
+    std::wstring DirectStorageVersion;
+};
+
+SystemInfo GetSystemInfo(wchar_t const* filename)
+{
+    SystemInfo info;
+
+    // The results are measured on the default adapter
+    com_ptr<IDXGIFactory1> dxgiFactory;
+    check_hresult(CreateDXGIFactory1(IID_PPV_ARGS(dxgiFactory.put())));
+
+    com_ptr<IDXGIAdapter1> adapter;
+    if (SUCCEEDED(dxgiFactory->EnumAdapters1(0, adapter.put())))
+    {
+        DXGI_ADAPTER_DESC1 desc{};
+        check_hresult(adapter->GetDesc1(&desc));
+        info.Adapter = desc.Description;
+        info.AdapterVendorId = desc.VendorId;
+        info.AdapterDeviceId = desc.DeviceId;
+
+        LARGE_INTEGER umdVersion{};
+        if (SUCCEEDED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &umdVersion)))
+        {
+            info.DriverVersion = std::to_wstring(HIWORD(umdVersion.HighPart)) + L"." +
+                                 std::to_wstring(LOWORD(umdVersion.HighPart)) + L"." +
+                                 std::to_wstring(HIWORD(umdVersion.LowPart)) + L"." +
+                                 std::to_wstring(LOWORD(umdVersion.LowPart));
+        }
+    }
+
+    // The drive that holds the file, from the volume that it's on
+    wchar_t volumePath[MAX_PATH];
+    std::wstring fullPath = std::filesystem::absolute(filename).wstring();
+    if (GetVolumePathName(fullPath.c_str(), volumePath, MAX_PATH))
+    {
+        std::wstring devicePath = L"\\\\.\\" + std::wstring(volumePath);
+        if (!devicePath.empty() && devicePath.back() == L'\\')
+            devicePath.pop_back();
+
+        ScopedHandle volume(CreateFile(
+            devicePath.c_str(),
+            0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr,
+            OPEN_EXISTING,
+            0,
+            nullptr));
+
+        if (volume.get() != INVALID_HANDLE_VALUE)
+        {
+            STORAGE_PROPERTY_QUERY query{};
+            query.PropertyId = StorageDeviceProperty;
+            query.QueryType = PropertyStandardQuery;
+
+            std::vector<uint8_t> buffer(4096);
+            DWORD bytesReturned = 0;
+            if (DeviceIoControl(
+                    volume.get(),
+                    IOCTL_STORAGE_QUERY_PROPERTY,
+                    &query,
+                    sizeof(query),
+                    buffer.data(),
+                    static_cast<DWORD>(buffer.size()),
+                    &bytesReturned,
+                    nullptr))
+            {
+                auto const* descriptor = reinterpret_cast<STORAGE_DEVICE_DESCRIPTOR const*>(buffer.data());
+                auto descriptorString = [&](DWORD offset) -> std::wstring
+                {
+                    if (offset == 0 || offset >= bytesReturned)
+                        return {};
+                    char const* str = reinterpret_cast<char const*>(buffer.data() + offset);
+                    return std::wstring(str, str + strnlen(str, bytesReturned - offset));
+                };
+
+                info.StorageDevice = descriptorString(descriptor->VendorIdOffset) +
+                                     descriptorString(descriptor->ProductIdOffset);
+
+                switch (descriptor->BusType)
+                {
+                case BusTypeNvme:
+                    info.StorageBusType = L"NVMe";
+                    break;
+                case BusTypeSata:
+                    info.StorageBusType = L"SATA";
+                    break;
+                case BusTypeUsb:
+                    info.StorageBusType = L"USB";
+                    break;
+                default:
+                    info.StorageBusType = std::to_wstring(descriptor->BusType);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            volume.release();
+        }
+    }
+
+    // The version of the DirectStorage runtime that's loaded
+    wchar_t modulePath[MAX_PATH];
+    HMODULE dstorageModule = GetModuleHandle(L"dstorage.dll");
+    if (dstorageModule && GetModuleFileName(dstorageModule, modulePath, MAX_PATH))
+    {
+        DWORD versionInfoSize = GetFileVersionInfoSize(modulePath, nullptr);
+        std::vector<uint8_t> versionInfo(versionInfoSize);
+
+        VS_FIXEDFILEINFO* fileInfo = nullptr;
+        UINT fileInfoSize = 0;
+        if (versionInfoSize != 0 && GetFileVersionInfo(modulePath, 0, versionInfoSize, versionInfo.data()) &&
+            VerQueryValue(versionInfo.data(), L"\\", reinterpret_cast<void**>(&fileInfo), &fileInfoSize))
+        {
+            info.DirectStorageVersion = std::to_wstring(HIWORD(fileInfo->dwFileVersionMS)) + L"." +
+                                        std::to_wstring(LOWORD(fileInfo->dwFileVersionMS)) + L"." +
+                                        std::to_wstring(HIWORD(fileInfo->dwFileVersionLS)) + L"." +
+                                        std::to_wstring(LOWORD(fileInfo->dwFileVersionLS));
+        }
+    }
+
+    return info;
+}
+
+// Returns the string quoted and escaped for JSON
+std::wstring JsonString(std::wstring const& str)
+{
+    std::wstring quoted = L"\"";
+    for (wchar_t c : str)
+    {
+        if (c == L'"' || c == L'\\')
+            quoted += L'\\';
+        if (c >= 0x20)
+            quoted += c;
+    }
+    return quoted + L"\"";
+}
+
+// The bandwidth and cycles per byte of each test in a results CSV file, keyed
+// by the settings that the test was run with.
+struct BaselineResult
+{
+    double Bandwidth;
+    double CyclesPerByte;
+};
+
+using BaselineResults = std::map<std::wstring, BaselineResult>;
+
+BaselineResults ParseResultsCsv(std::wistream& csv)
+{
+    // Every column that describes how a test was run is part of its key, so
+    // a baseline can only be compared with a run that used the same options
+    static wchar_t const* const KEY_COLUMNS[] = {
+        L"Case",
+        L"Chunk Size KiB",
+        L"Staging Buffer Size MiB",
+        L"Queue Capacity",
+        L"Queues",
+        L"Submit Batch Size",
+        L"GPU Load %",
+        L"Read Pattern",
+        L"Decompression Threads",
+        L"Cold Cache",
+        L"Destination"};
+
+    auto splitLine = [](std::wstring const& line)
+    {
+        std::vector<std::wstring> fields;
+        std::wstringstream stream(line);
+        std::wstring field;
+        while (std::getline(stream, field, L','))
+            fields.push_back(field);
+        return fields;
+    };
+
+    BaselineResults results;
+
+    std::wstring line;
+    if (!std::getline(csv, line))
+        return results;
+
+    std::vector<std::wstring> header = splitLine(line);
+    auto column = [&](wchar_t const* name)
+    { return static_cast<size_t>(std::find(header.begin(), header.end(), name) - header.begin()); };
+
+    size_t bandwidthColumn = column(L"Bandwidth GB/s");
+    size_t cyclesPerByteColumn = column(L"Cycles per byte");
+
+    while (std::getline(csv, line))
+    {
+        std::vector<std::wstring> fields = splitLine(line);
+        if (bandwidthColumn >= fields.size() || cyclesPerByteColumn >= fields.size())
+            continue;
+
+        std::wstring key;
+        for (wchar_t const* keyColumn : KEY_COLUMNS)
+        {
+            size_t index = column(keyColumn);
+            if (index < fields.size())
+                key += std::wstring(keyColumn) + L"=" + fields[index] + L" ";
+        }
+
+        results[key] = {_wtof(fields[bandwidthColumn].c_str()), _wtof(fields[cyclesPerByteColumn].c_str())};
+    }
+
+    return results;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    enum class TestCase
+    {
+        Uncompressed,
+#if USE_ZLIB
+        CpuZLib,
+#endif
+#if USE_LIBDEFLATE
+        CpuLibDeflate,
+#endif
+        CpuGDeflate,
+        GpuGDeflate,
+        HybridGDeflate
+    };
+
+    TestCase testCases[] =
+    { TestCase::Uncompressed,
+#if USE_ZLIB
+      TestCase::CpuZLib,
+#endif
+#if USE_LIBDEFLATE
+      TestCase::CpuLibDeflate,
+#endif
+      TestCase::CpuGDeflate,
+      TestCase::GpuGDeflate,
+      TestCase::HybridGDeflate };
+
+    if (argc < 2)
+    {
+        ShowHelpText();
+        return -1;
+    }
+
+    if (_wcsicmp(argv[1], L"-replay") == 0)
+    {
+        if (argc < 3)
+        {
+            ShowHelpText();
+            return -1;
+        }
+        return ReplayLoadTrace(argv[2], argc > 3 && _wcsicmp(argv[3], L"-cold") == 0);
+    }
+
+    const wchar_t* originalFilename = argv[1];
+
+    uint32_t chunkSizeMiB = 16;
+    bool sweep = false;
+    bool measureLatency = false;
+    bool backgroundLoad = false;
+    uint32_t gpuLoadPercent = 0;
+    bool threadSweep = false;
+    ReadPattern readPattern;
+    wchar_t const* baselineFilename = nullptr;
+    double regressionThreshold = 5.0;
+    bool coldCache = false;
+    bool textureDestinations = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (_wcsicmp(argv[i], L"-sweep") == 0)
+        {
+            sweep = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-latency") == 0)
+        {
+            measureLatency = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-background") == 0)
+        {
+            backgroundLoad = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-threads") == 0)
+        {
+            threadSweep = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-textures") == 0)
+        {
+            textureDestinations = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-cold") == 0)
+        {
+            coldCache = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-random") == 0)
+        {
+            readPattern.Shuffle = true;
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-files") == 0)
+        {
+            readPattern.NumFileHandles = (i + 1 < argc) ? _wtoi(argv[++i]) : 0;
+            if (readPattern.NumFileHandles == 0)
+            {
+                ShowHelpText();
+                std::wcout << std::endl << L"Invalid number of file handles" << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-trace") == 0)
+        {
+            if (i + 1 < argc)
+                readPattern.TraceOffsets = LoadReadTrace(argv[++i]);
+            if (readPattern.TraceOffsets.empty())
+            {
+                ShowHelpText();
+                std::wcout << std::endl << L"The trace doesn't have any reads" << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-baseline") == 0 && i + 1 < argc)
+        {
+            baselineFilename = argv[++i];
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-threshold") == 0 && i + 1 < argc)
+        {
+            regressionThreshold = _wtof(argv[++i]);
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-gpuload") == 0)
+        {
+            gpuLoadPercent = (i + 1 < argc) ? _wtoi(argv[++i]) : 0;
+            if (gpuLoadPercent == 0 || gpuLoadPercent > 100)
+            {
+                ShowHelpText();
+                std::wcout << std::endl << L"Invalid GPU load percentage" << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        chunkSizeMiB = _wtoi(argv[i]);
+        if (chunkSizeMiB == 0)
+        {
+            ShowHelpText();
+            std::wcout << std::endl << L"Invalid chunk size: " << argv[i] << std::endl;
+            return -1;
+        }
+    }
+
+    // A name for the read pattern in the results, when it isn't the default
+    if (readPattern.Shuffle || readPattern.NumFileHandles != 1 || !readPattern.TraceOffsets.empty())
+    {
+        readPattern.Name = readPattern.TraceOffsets.empty() ? L"sequential" : L"trace";
+        if (readPattern.Shuffle)
+            readPattern.Name = readPattern.TraceOffsets.empty() ? L"random" : L"shuffled trace";
+        if (readPattern.NumFileHandles != 1)
+            readPattern.Name += L" over " + std::to_wstring(readPattern.NumFileHandles) + L" handles";
+    }
+
+    constexpr uint32_t MAX_STAGING_BUFFER_SIZE = 1024;
+
+    // The values of each setting to test, in every combination.  By default
+    // only the staging buffer size varies.  A sweep varies the chunk size and
+    // how the requests are queued instead, with a staging buffer that's large
+    // enough for every chunk size.
+    std::vector<uint32_t> chunkSizesBytes;
+    std::vector<uint32_t> stagingSizesMiB;
+    std::vector<uint16_t> queueCapacities;
+    std::vector<uint32_t> queueCounts;
+    std::vector<uint32_t> submitBatchSizes;
+
+    if (sweep)
+    {
+        for (uint32_t chunkSizeBytes = 64 * 1024; chunkSizeBytes <= 64 * 1024 * 1024; chunkSizeBytes *= 4)
+            chunkSizesBytes.push_back(chunkSizeBytes);
+        stagingSizesMiB = {256};
+        queueCapacities = {DSTORAGE_MIN_QUEUE_CAPACITY, 1024, DSTORAGE_MAX_QUEUE_CAPACITY};
+        queueCounts = {1, 2, 4};
+        submitBatchSizes = {16, 256, 0};
+    }
+    else
+    {
+        chunkSizesBytes = {chunkSizeMiB * 1024 * 1024};
+        for (uint32_t stagingSizeMiB = 1; stagingSizeMiB <= MAX_STAGING_BUFFER_SIZE; stagingSizeMiB *= 2)
+            stagingSizesMiB.push_back(stagingSizeMiB);
+        queueCapacities = {DSTORAGE_MAX_QUEUE_CAPACITY};
+        queueCounts = {1};
+        submitBatchSizes = {0};
+    }
+
+    // The CPU formats are decompressed by CustomDecompression's threads, which
+    // normally use every hardware thread.  A thread sweep tries powers of two
+    // up to that instead.
+    const uint32_t hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> cpuThreadCounts;
+    if (threadSweep)
+    {
+        for (uint32_t numThreads = 1; numThreads < hardwareThreads; numThreads *= 2)
+            cpuThreadCounts.push_back(numThreads);
+    }
+    cpuThreadCounts.push_back(hardwareThreads);
+
+    // The files for one chunk size and destination.  Textures are laid out in
+    // chunks that match their mips, so they have files of their own.
+    struct ChunkedFiles
+    {
+        uint32_t ChunkSizeBytes;
+        Destination Destination;
+        TextureLayout Texture;
+        TestFile Uncompressed;
+        TestFile GDeflate;
+#if USE_ZLIB
+        TestFile ZLib;
+#endif
+    };
+
+    std::vector<Destination> destinations = {Destination::Buffer};
+    com_ptr<ID3D12Device> layoutDevice;
+    if (textureDestinations)
+    {
+        destinations.push_back(Destination::TextureRegion);
+        destinations.push_back(Destination::MultipleSubresources);
+
+        // Only used to find the layout of the textures
+        check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(layoutDevice.put())));
+    }
+
+    std::vector<ChunkedFiles> chunkedFiles;
+
+    for (uint32_t chunkSizeBytes : chunkSizesBytes)
+    {
+        for (Destination destination : destinations)
+        {
+            // A sweep keeps the files for each chunk size, so that they can
+            // all be reused by the next sweep
+            std::wstring baseFilename = originalFilename;
+            if (sweep)
+                baseFilename += L"." + std::to_wstring(chunkSizeBytes / 1024) + L"k";
+
+            ChunkedFiles files{};
+            files.ChunkSizeBytes = chunkSizeBytes;
+            files.Destination = destination;
+
+            std::vector<uint32_t> chunkSizes;
+            if (destination == Destination::Buffer)
+            {
+                chunkSizes = GetUniformChunkSizes(originalFilename, chunkSizeBytes);
+            }
+            else
+            {
+                files.Texture = GetTextureLayout(layoutDevice.get(), chunkSizeBytes);
+                chunkSizes = GetTextureChunkSizes(originalFilename, files.Texture, destination);
+
+                std::wstring textureName = std::to_wstring(files.Texture.Desc.Width) + L"x" +
+                                           std::to_wstring(files.Texture.Desc.Height) + L" BC7";
+                if (chunkSizes.empty())
+                {
+                    std::wcout << L"The file is too small to hold a " << textureName << L" mip chain" << std::endl;
+                    continue;
+                }
+
+                baseFilename += destination == Destination::TextureRegion ? L".mips" : L".mipchains";
+                std::wcout << L"Loading " << originalFilename << L" as " << chunkSizes.size() << L" "
+                           << (destination == Destination::TextureRegion ? L"mips" : L"mip chains") << L" of "
+                           << textureName << L" textures" << std::endl;
+            }
+
+            files.Uncompressed.Filename = originalFilename;
+            files.Uncompressed.Metadata = GenerateUncompressedMetadata(chunkSizes);
+
+            files.GDeflate.Filename = baseFilename + L".gdeflate";
+            files.GDeflate.Metadata = Compress(
+                DSTORAGE_COMPRESSION_FORMAT_GDEFLATE,
+                originalFilename,
+                files.GDeflate.Filename.c_str(),
+                chunkSizes);
+
+#if USE_ZLIB
+            files.ZLib.Filename = baseFilename + L".zlib";
+            files.ZLib.Metadata =
+                Compress(DSTORAGE_CUSTOM_COMPRESSION_0, originalFilename, files.ZLib.Filename.c_str(), chunkSizes);
+#endif
+
+            chunkedFiles.push_back(std::move(files));
+        }
+    }
+
+    struct Result
+    {
+        TestCase TestCase;
+        uint32_t ChunkSizeBytes;
+        TestParameters Parameters;
+        uint32_t DecompressionThreads;
+        TestResult Data;
+
+        // The bandwidth per thread, relative to the same test with one thread.
+        // This is only known in a thread sweep, for the CPU formats.
+        double Efficiency;
+    };
+
+    std::vector<Result> results;
+
+    for (TestCase testCase : testCases)
+    {
+        DSTORAGE_COMPRESSION_FORMAT compressionFormat;
+        DSTORAGE_CONFIGURATION config{};
+        int numRuns = 0;
+        TestFile ChunkedFiles::*testFile = nullptr;
+        bool cpuDecompression = false; // Decompressed by CustomDecompression
+        bool hybrid = false;           // Split between CustomDecompression and the GPU
+#if USE_ZLIB
+        ZLibBackend zlibBackend = ZLibBackend::ZLib;
+#endif
+
+        switch (testCase)
+        {
+        case TestCase::Uncompressed:
             compressionFormat = DSTORAGE_COMPRESSION_FORMAT_NONE;
             numRuns = 10;
-            metadata = &uncompressedMetadata;
-            filename = originalFilename;
+            testFile = &ChunkedFiles::Uncompressed;
             std::cout << "Uncompressed:" << std::endl;
             break;
 
@@ -530,9 +2294,21 @@ int wmain(int argc, wchar_t* argv[])
         case TestCase::CpuZLib:
             compressionFormat = DSTORAGE_CUSTOM_COMPRESSION_0;
             numRuns = 2;
-            metadata = &zlibMetadata;
-            filename = zlibFilename.c_str();
+            testFile = &ChunkedFiles::ZLib;
             std::cout << "ZLib:" << std::endl;
+            cpuDecompression = true;
+            break;
+#endif
+
+#if USE_LIBDEFLATE
+        case TestCase::CpuLibDeflate:
+            // The same ZLib file, decoded with libdeflate
+            compressionFormat = DSTORAGE_CUSTOM_COMPRESSION_0;
+            numRuns = 2;
+            testFile = &ChunkedFiles::ZLib;
+            zlibBackend = ZLibBackend::LibDeflate;
+            cpuDecompression = true;
+            std::cout << "ZLib (libdeflate):" << std::endl;
             break;
 #endif
 
@@ -546,19 +2322,28 @@ int wmain(int argc, wchar_t* argv[])
             config.NumBuiltInCpuDecompressionThreads = DSTORAGE_DISABLE_BUILTIN_CPU_DECOMPRESSION;
             config.DisableGpuDecompression = true;
 
-            metadata = &gdeflateMetadata;
-            filename = gdeflateFilename.c_str();
+            testFile = &ChunkedFiles::GDeflate;
             std::cout << "CPU GDEFLATE:" << std::endl;
+            cpuDecompression = true;
             break;
 
         case TestCase::GpuGDeflate:
             compressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
             numRuns = 10;
-            metadata = &gdeflateMetadata;
-            filename = gdeflateFilename.c_str();
+            testFile = &ChunkedFiles::GDeflate;
             std::cout << "GPU GDEFLATE:" << std::endl;
             break;
 
+        case TestCase::HybridGDeflate:
+            // GPU decompression stays enabled, and HybridRouter sends some of
+            // the requests to CustomDecompression instead
+            compressionFormat = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+            numRuns = 10;
+            testFile = &ChunkedFiles::GDeflate;
+            std::cout << "Hybrid GDEFLATE:" << std::endl;
+            hybrid = true;
+            break;
+
         default:
             std::terminate();
         }
@@ -570,109 +2355,434 @@ int wmain(int argc, wchar_t* argv[])
 
         factory->SetDebugFlags(DSTORAGE_DEBUG_SHOW_ERRORS | DSTORAGE_DEBUG_BREAK_ON_ERROR);
 
-        CustomDecompression customDecompression(factory.get(), std::thread::hardware_concurrency());
+        std::vector<uint32_t> threadCounts = {hardwareThreads};
+        if (cpuDecompression)
+            threadCounts = cpuThreadCounts;
 
-        for (uint32_t stagingSizeMiB = 1; stagingSizeMiB <= MAX_STAGING_BUFFER_SIZE; stagingSizeMiB *= 2)
+        // In a thread sweep, the bandwidth of each test with one thread, which
+        // is the first count, for the others to be compared against
+        std::vector<double> singleThreadBandwidths;
+
+        for (uint32_t numThreads : threadCounts)
         {
-            if (stagingSizeMiB < chunkSizeMiB)
-                continue;
+            if (cpuDecompression && threadSweep)
+                std::cout << " " << numThreads << " decompression threads:" << std::endl;
+
+#if USE_ZLIB
+            CustomDecompression customDecompression(factory.get(), numThreads, zlibBackend);
+#else
+            CustomDecompression customDecompression(factory.get(), numThreads);
+#endif
+
+            size_t testIndex = 0;
 
-            TestResult data = RunTest(factory.get(), stagingSizeMiB, filename, compressionFormat, *metadata, numRuns);
+            for (ChunkedFiles const& files : chunkedFiles)
+            {
+                TestFile const& file = files.*testFile;
+
+                if (sweep || textureDestinations)
+                {
+                    std::wcout << L" " << files.ChunkSizeBytes / 1024 << L" KiB chunks, "
+                               << GetDestinationName(files.Destination) << L":" << std::endl;
+                }
 
-            results.push_back({testCase, stagingSizeMiB, data});
+                for (uint32_t stagingSizeMiB : stagingSizesMiB)
+                {
+                    if (stagingSizeMiB * 1024 * 1024 < files.ChunkSizeBytes)
+                        continue;
+
+                    for (uint16_t queueCapacity : queueCapacities)
+                    {
+                        for (uint32_t numQueues : queueCounts)
+                        {
+                            for (uint32_t submitBatchSize : submitBatchSizes)
+                            {
+                                // Larger batches than the queue can hold would be
+                                // the same as submitting whenever it's full
+                                if (submitBatchSize > queueCapacity)
+                                    continue;
+
+                                // The busier the GPU, the more of the larger
+                                // requests go to the CPU
+                                constexpr uint32_t HYBRID_SMALL_REQUEST_BYTES = 64 * 1024;
+                                HybridRouter router(
+                                    customDecompression,
+                                    HYBRID_SMALL_REQUEST_BYTES,
+                                    gpuLoadPercent / 100.0);
+
+                                TestParameters parameters{
+                                    stagingSizeMiB,
+                                    queueCapacity,
+                                    numQueues,
+                                    submitBatchSize,
+                                    measureLatency,
+                                    backgroundLoad ? &files.Uncompressed : nullptr,
+                                    gpuLoadPercent,
+                                    &readPattern,
+                                    coldCache,
+                                    files.Destination,
+                                    &files.Texture,
+                                    hybrid ? &router : nullptr};
+
+                                TestResult data = RunTest(
+                                    factory.get(),
+                                    parameters,
+                                    file.Filename.c_str(),
+                                    compressionFormat,
+                                    file.Metadata,
+                                    numRuns);
+
+                                double efficiency = 0;
+                                if (cpuDecompression && threadSweep)
+                                {
+                                    if (numThreads == 1)
+                                        singleThreadBandwidths.push_back(data.Bandwidth);
+
+                                    double singleThreadBandwidth = singleThreadBandwidths[testIndex++];
+                                    if (singleThreadBandwidth > 0)
+                                        efficiency = data.Bandwidth / numThreads / singleThreadBandwidth;
+                                }
+
+                                results.push_back(
+                                    {testCase, files.ChunkSizeBytes, parameters, numThreads, data, efficiency});
+                            }
+                        }
+                    }
+                }
+            }
         }
     }
 
     std::cout << "\n\n";
 
-    std::wstringstream bandwidth;
-    std::wstringstream cycles;
+    auto testCaseName = [](TestCase testCase) -> wchar_t const*
+    {
+        switch (testCase)
+        {
+        case TestCase::Uncompressed:
+            return L"Uncompressed";
+#if USE_ZLIB
+        case TestCase::CpuZLib:
+            return L"ZLib";
+#endif
+#if USE_LIBDEFLATE
+        case TestCase::CpuLibDeflate:
+            return L"ZLib (libdeflate)";
+#endif
+        case TestCase::CpuGDeflate:
+            return L"CPU GDEFLATE";
+        case TestCase::GpuGDeflate:
+            return L"GPU GDEFLATE";
+        case TestCase::HybridGDeflate:
+            return L"Hybrid GDEFLATE";
+        default:
+            std::terminate();
+        }
+    };
+
+    // Every result, one per row, with a column for each setting.  This is
+    // always saved as a CSV file next to the original file.
+    auto writeResultsTable = [&](std::wostream& out, wchar_t const* separator)
+    {
+        out << L"Case" << separator << L"Chunk Size KiB" << separator << L"Staging Buffer Size MiB" << separator
+            << L"Queue Capacity" << separator << L"Queues" << separator << L"Submit Batch Size" << separator
+            << L"Bandwidth GB/s" << separator << L"Cycles" << separator << L"Cycles per byte" << separator
+            << L"First Run GB/s" << separator << L"Steady State GB/s" << separator << L"Cold Cache" << separator
+            << L"CPU Share %";
+
+        // The latency percentiles, then the histogram with a column per bucket
+        if (measureLatency)
+        {
+            out << separator << L"p50 us" << separator << L"p99 us" << separator << L"Max us";
+            for (size_t bucket = 0; bucket < NUM_LATENCY_BUCKETS; ++bucket)
+                out << separator << L"< " << (1ull << (bucket + 1)) << L" us";
+        }
+        if (gpuLoadPercent != 0)
+        {
+            out << separator << L"GPU Load %" << separator << L"Idle Frame ms" << separator << L"Mean Frame ms"
+                << separator << L"p99 Frame ms";
+        }
+        if (!readPattern.Name.empty())
+            out << separator << L"Read Pattern";
+        if (textureDestinations)
+            out << separator << L"Destination";
+        if (threadSweep)
+        {
+            out << separator << L"Decompression Threads" << separator << L"GB/s per Thread" << separator
+                << L"Efficiency";
+        }
+        out << std::endl;
+
+        for (Result const& r : results)
+        {
+            out << testCaseName(r.TestCase) << separator << r.ChunkSizeBytes / 1024 << separator
+                << r.Parameters.StagingSizeMiB << separator << r.Parameters.QueueCapacity << separator
+                << r.Parameters.NumQueues << separator << r.Parameters.SubmitBatchSize << separator
+                << r.Data.Bandwidth << separator << r.Data.ProcessCycles << separator << r.Data.CyclesPerByte
+                << separator << r.Data.FirstRunBandwidth << separator << r.Data.SteadyStateBandwidth << separator
+                << (r.Parameters.ColdCache ? L"Yes" : L"No") << separator << r.Data.CpuShare * 100.0;
+
+            if (measureLatency)
+            {
+                out << separator << r.Data.LatencyP50 << separator << r.Data.LatencyP99 << separator
+                    << r.Data.LatencyMax;
+                for (uint32_t count : r.Data.LatencyHistogram)
+                    out << separator << count;
+            }
+            if (gpuLoadPercent != 0)
+            {
+                out << separator << r.Parameters.GpuLoadPercent << separator << r.Data.IdleFrameTime << separator
+                    << r.Data.FrameTimeMean << separator << r.Data.FrameTimeP99;
+            }
+            if (!readPattern.Name.empty())
+                out << separator << readPattern.Name;
+            if (textureDestinations)
+                out << separator << GetDestinationName(r.Parameters.Destination);
+            if (threadSweep)
+            {
+                out << separator << r.DecompressionThreads << separator << r.Data.Bandwidth / r.DecompressionThreads
+                    << separator << r.Efficiency;
+            }
+            out << std::endl;
+        }
+    };
 
-    std::wstring header =
-        L"\"Staging Buffer Size MiB\"\t\"Uncompressed\"\t\"ZLib\"\t\"CPU GDEFLATE\"\t\"GPU GDEFLATE\"";
-    bandwidth << header << std::endl;
-    cycles << header << std::endl;
+    std::wstring csvFilename = std::wstring(originalFilename) + L".results.csv";
+    {
+        std::wofstream csv(csvFilename, std::ios::trunc);
+        writeResultsTable(csv, L",");
+    }
 
-    for (uint32_t stagingBufferSize = 1; stagingBufferSize <= MAX_STAGING_BUFFER_SIZE; stagingBufferSize *= 2)
+    // The same results as JSON, along with the machine they were measured on
+    std::wstring jsonFilename = std::wstring(originalFilename) + L".results.json";
     {
-        std::wstringstream bandwidthRow;
-        std::wstringstream cyclesRow;
+        SystemInfo system = GetSystemInfo(originalFilename);
+
+        std::wofstream json(jsonFilename, std::ios::trunc);
+        json << L"{" << std::endl;
+        json << L"  \"system\": {" << std::endl;
+        json << L"    \"adapter\": " << JsonString(system.Adapter) << L"," << std::endl;
+        json << L"    \"adapterVendorId\": " << system.AdapterVendorId << L"," << std::endl;
+        json << L"    \"adapterDeviceId\": " << system.AdapterDeviceId << L"," << std::endl;
+        json << L"    \"driverVersion\": " << JsonString(system.DriverVersion) << L"," << std::endl;
+        json << L"    \"storageDevice\": " << JsonString(system.StorageDevice) << L"," << std::endl;
+        json << L"    \"storageBusType\": " << JsonString(system.StorageBusType) << L"," << std::endl;
+        json << L"    \"directStorageVersion\": " << JsonString(system.DirectStorageVersion) << std::endl;
+        json << L"  }," << std::endl;
+        json << L"  \"results\": [";
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            Result const& r = results[i];
+
+            json << (i == 0 ? L"" : L",") << std::endl << L"    {";
+            json << L"\"case\": " << JsonString(testCaseName(r.TestCase));
+            json << L", \"chunkSizeKiB\": " << r.ChunkSizeBytes / 1024;
+            json << L", \"stagingBufferSizeMiB\": " << r.Parameters.StagingSizeMiB;
+            json << L", \"queueCapacity\": " << r.Parameters.QueueCapacity;
+            json << L", \"queues\": " << r.Parameters.NumQueues;
+            json << L", \"submitBatchSize\": " << r.Parameters.SubmitBatchSize;
+            json << L", \"decompressionThreads\": " << r.DecompressionThreads;
+            json << L", \"readPattern\": " << JsonString(readPattern.Name);
+            json << L", \"destination\": " << JsonString(GetDestinationName(r.Parameters.Destination));
+            json << L", \"bandwidthGBps\": " << r.Data.Bandwidth;
+            json << L", \"processCycles\": " << r.Data.ProcessCycles;
+            json << L", \"cyclesPerByte\": " << r.Data.CyclesPerByte;
+            json << L", \"firstRunBandwidthGBps\": " << r.Data.FirstRunBandwidth;
+            json << L", \"steadyStateBandwidthGBps\": " << r.Data.SteadyStateBandwidth;
+            json << L", \"coldCache\": " << (r.Parameters.ColdCache ? L"true" : L"false");
+            if (r.TestCase == TestCase::HybridGDeflate)
+                json << L", \"cpuSharePercent\": " << r.Data.CpuShare * 100.0;
+            if (threadSweep)
+                json << L", \"efficiency\": " << r.Efficiency;
+            if (measureLatency)
+            {
+                json << L", \"latencyP50us\": " << r.Data.LatencyP50;
+                json << L", \"latencyP99us\": " << r.Data.LatencyP99;
+                json << L", \"latencyMaxus\": " << r.Data.LatencyMax;
+            }
+            if (gpuLoadPercent != 0)
+            {
+                json << L", \"gpuLoadPercent\": " << r.Parameters.GpuLoadPercent;
+                json << L", \"idleFrameMs\": " << r.Data.IdleFrameTime;
+                json << L", \"meanFrameMs\": " << r.Data.FrameTimeMean;
+                json << L", \"p99FrameMs\": " << r.Data.FrameTimeP99;
+            }
+            json << L"}";
+        }
+
+        json << std::endl << L"  ]" << std::endl << L"}" << std::endl;
+    }
 
-        bandwidthRow << stagingBufferSize << "\t";
-        cyclesRow << stagingBufferSize << "\t";
+    std::wstringstream combined;
 
-        constexpr bool showEmptyRows = true;
+    if (sweep || measureLatency || gpuLoadPercent != 0 || threadSweep || !readPattern.Name.empty() ||
+        textureDestinations)
+    {
+        combined << "Results" << std::endl;
+        writeResultsTable(combined, L"\t");
+    }
+    else
+    {
+        std::wstringstream bandwidth;
+        std::wstringstream cycles;
+        std::wstringstream cyclesPerByte;
 
-        bool foundOne = false;
+        std::wstring header = L"\"Staging Buffer Size MiB\"\t\"Uncompressed\"\t\"ZLib\"";
+#if USE_LIBDEFLATE
+        header += L"\t\"ZLib (libdeflate)\"";
+#endif
+        header += L"\t\"CPU GDEFLATE\"\t\"GPU GDEFLATE\"\t\"Hybrid GDEFLATE\"";
+        bandwidth << header << std::endl;
+        cycles << header << std::endl;
+        cyclesPerByte << header << std::endl;
 
-        for (auto& testCase : testCases)
+        for (uint32_t stagingBufferSize : stagingSizesMiB)
         {
-            auto it = std::find_if(
-                results.begin(),
-                results.end(),
-                [&](Result const& r) { return r.TestCase == testCase && r.StagingBufferSizeMiB == stagingBufferSize; });
+            std::wstringstream bandwidthRow;
+            std::wstringstream cyclesRow;
+            std::wstringstream cyclesPerByteRow;
+
+            bandwidthRow << stagingBufferSize << "\t";
+            cyclesRow << stagingBufferSize << "\t";
+            cyclesPerByteRow << stagingBufferSize << "\t";
+
+            constexpr bool showEmptyRows = true;
 
-            if (it == results.end())
+            bool foundOne = false;
+
+            for (auto& testCase : testCases)
             {
-                bandwidthRow << L"\t";
-                cyclesRow << L"\t";
+                auto it = std::find_if(
+                    results.begin(),
+                    results.end(),
+                    [&](Result const& r)
+                    { return r.TestCase == testCase && r.Parameters.StagingSizeMiB == stagingBufferSize; });
+
+                if (it == results.end())
+                {
+                    bandwidthRow << L"\t";
+                    cyclesRow << L"\t";
+                    cyclesPerByteRow << L"\t";
+                }
+                else
+                {
+                    bandwidthRow << it->Data.Bandwidth << L"\t";
+                    cyclesRow << it->Data.ProcessCycles << L"\t";
+                    cyclesPerByteRow << it->Data.CyclesPerByte << L"\t";
+                    foundOne = true;
+                }
             }
-            else
+
+            if (showEmptyRows || foundOne)
             {
-                bandwidthRow << it->Data.Bandwidth << L"\t";
-                cyclesRow << it->Data.ProcessCycles << L"\t";
-                foundOne = true;
+                bandwidth << bandwidthRow.str() << std::endl;
+                cycles << cyclesRow.str() << std::endl;
+                cyclesPerByte << cyclesPerByteRow.str() << std::endl;
             }
         }
 
-        if (showEmptyRows || foundOne)
-        {
-            bandwidth << bandwidthRow.str() << std::endl;
-            cycles << cyclesRow.str() << std::endl;
-        }
+        combined << "Bandwidth" << std::endl
+                 << bandwidth.str() << std::endl
+                 << std::endl
+                 << "Cycles" << std::endl
+                 << cycles.str() << std::endl
+                 << std::endl
+                 << "Cycles per byte" << std::endl
+                 << cyclesPerByte.str() << std::endl;
     }
 
-    std::wstringstream combined;
-    combined << "Bandwidth" << std::endl
-             << bandwidth.str() << std::endl
-             << std::endl
-             << "Cycles" << std::endl
-             << cycles.str() << std::endl;
-
     combined << std::endl << "Compression" << std::endl;
     combined << "Case\tSize\tRatio" << std::endl;
 
-    auto ratioLine = [&](char const* name, Metadata const& metadata)
+    for (ChunkedFiles const& files : chunkedFiles)
     {
-        combined << name << "\t" << metadata.CompressedSize << "\t"
-                 << static_cast<double>(metadata.CompressedSize) / static_cast<double>(metadata.UncompressedSize)
-                 << std::endl;
-    };
+        std::wstring suffix;
+        if (sweep)
+            suffix = L" (" + std::to_wstring(files.ChunkSizeBytes / 1024) + L" KiB chunks)";
+        if (files.Destination != Destination::Buffer)
+            suffix += L" (" + std::wstring(GetDestinationName(files.Destination)) + L")";
+
+        auto ratioLine = [&](wchar_t const* name, Metadata const& metadata)
+        {
+            combined << name << suffix << "\t" << metadata.CompressedSize << "\t"
+                     << static_cast<double>(metadata.CompressedSize) / static_cast<double>(metadata.UncompressedSize)
+                     << std::endl;
+        };
 
-    ratioLine("Uncompressed", uncompressedMetadata);
+        ratioLine(L"Uncompressed", files.Uncompressed.Metadata);
 #if USE_ZLIB
-    ratioLine("ZLib", zlibMetadata);
+        ratioLine(L"ZLib", files.ZLib.Metadata);
 #else
-    combined << "ZLib" << "\tn/a\tn/a" << std::endl;
+        combined << "ZLib" << suffix << "\tn/a\tn/a" << std::endl;
 #endif
-    ratioLine("GDEFLATE", gdeflateMetadata);
+        ratioLine(L"GDEFLATE", files.GDeflate.Metadata);
+    }
 
     combined << std::endl;
 
     std::wcout << combined.str();
+    std::wcout << "Every result has been saved to " << csvFilename << " and " << jsonFilename << std::endl;
+
+    // Compare each test with the same test in the baseline, when it has one
+    int exitCode = 0;
+    if (baselineFilename)
+    {
+        std::wifstream baselineCsv(baselineFilename);
+        if (!baselineCsv)
+        {
+            std::wcout << L"The baseline '" << baselineFilename << L"' could not be opened." << std::endl;
+            return -1;
+        }
+
+        std::wifstream currentCsv(csvFilename);
+        BaselineResults baseline = ParseResultsCsv(baselineCsv);
+        BaselineResults current = ParseResultsCsv(currentCsv);
+
+        double threshold = regressionThreshold / 100.0;
+        uint32_t numCompared = 0;
+        uint32_t numRegressions = 0;
+
+        std::wcout << std::endl << L"Baseline " << baselineFilename << L":" << std::endl;
+        for (auto const& [key, result] : current)
+        {
+            auto it = baseline.find(key);
+            if (it == baseline.end())
+                continue;
+
+            ++numCompared;
+            BaselineResult const& expected = it->second;
+
+            bool slower = result.Bandwidth < expected.Bandwidth * (1.0 - threshold);
+            bool costlier = result.CyclesPerByte > expected.CyclesPerByte * (1.0 + threshold);
+            if (slower || costlier)
+            {
+                ++numRegressions;
+                std::wcout << L"  REGRESSION " << key << L": " << expected.Bandwidth << L" -> " << result.Bandwidth
+                           << L" GB/s, " << expected.CyclesPerByte << L" -> " << result.CyclesPerByte
+                           << L" cycles/byte" << std::endl;
+            }
+        }
+
+        std::wcout << L"  " << numRegressions << L" of " << numCompared << L" tests regressed by more than "
+                   << regressionThreshold << L"%" << std::endl;
+
+        if (numRegressions > 0)
+            exitCode = 2;
+    }
 
     try
     {
         SetClipboardText(combined.str());
         std::wcout << "\nThese results have been copied to the clipboard, ready to paste into Excel." << std::endl;
-        return 0;
+        return exitCode;
     }
     catch (...)
     {
         std::wcout << "\nFailed to copy results to clipboard. Sorry." << std::endl;
     }
 
-    return 0;
+    return exitCode;
 }
 
 void SetClipboardText(std::wstring const& str)
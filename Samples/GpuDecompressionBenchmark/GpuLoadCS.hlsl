@@ -0,0 +1,40 @@
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+// Burns GPU time for GpuLoad, standing in for a game's rendering.  Each thread
+// runs a dependent chain of math, so the time taken grows with Iterations.
+//
+
+#define GpuLoad_RootSig \
+    "RootConstants(num32BitConstants=1, b0), " \
+    "UAV(u0)"
+
+cbuffer Constants : register(b0)
+{
+    uint Iterations;
+};
+
+RWByteAddressBuffer Output : register(u0);
+
+[RootSignature(GpuLoad_RootSig)]
+[numthreads(64, 1, 1)]
+void main(uint3 DTid : SV_DispatchThreadID)
+{
+    float x = DTid.x * 0.001;
+    float y = 1.0;
+
+    for (uint i = 0; i < Iterations; ++i)
+    {
+        x = x * 0.999 + 0.5;
+        y = sin(y + x);
+    }
+
+    // Never true, but the compiler can't know that, so it has to keep the loop
+    if (y > 2.0)
+        Output.Store(0, asuint(y));
+}
@@ -13,13 +13,54 @@
 #else
 # define USE_ZLIB 1
 
+// Builds with libdeflate available (see README.md) can also encode and decode
+// the ZLib format with it.  It produces the same streams, faster.
+#ifndef USE_LIBDEFLATE
+# define USE_LIBDEFLATE 0
+#endif
+
 #include <dstorage.h>
 #include <winrt/base.h>
 #include <zlib.h>
 
+#if USE_LIBDEFLATE
+#include <libdeflate.h>
+#include <memory>
+#endif
+
+enum class ZLibBackend
+{
+    ZLib,
+#if USE_LIBDEFLATE
+    LibDeflate,
+#endif
+};
+
+inline char const* GetZLibBackendName(ZLibBackend backend)
+{
+    switch (backend)
+    {
+    case ZLibBackend::ZLib:
+        return "zlib";
+#if USE_LIBDEFLATE
+    case ZLibBackend::LibDeflate:
+        return "libdeflate";
+#endif
+    default:
+        std::terminate();
+    }
+}
+
 class ZLibCodec : public winrt::implements<ZLibCodec, IDStorageCompressionCodec>
 {
+    ZLibBackend m_backend;
+
 public:
+    explicit ZLibCodec(ZLibBackend backend = ZLibBackend::ZLib)
+        : m_backend(backend)
+    {
+    }
+
     HRESULT STDMETHODCALLTYPE CompressBuffer(
         const void* uncompressedData,
         size_t uncompressedDataSize,
@@ -46,6 +87,17 @@ public:
             std::terminate();
         }
 
+#if USE_LIBDEFLATE
+        if (m_backend == ZLibBackend::LibDeflate)
+            return CompressWithLibDeflate(
+                uncompressedData,
+                uncompressedDataSize,
+                compressionSetting,
+                compressedBuffer,
+                compressedBufferSize,
+                compressedDataSize);
+#endif
+
         if (compress2(
                 static_cast<Bytef*>(compressedBuffer),
                 &destLen,
@@ -69,6 +121,31 @@ public:
         size_t uncompressedBufferSize,
         size_t* uncompressedDataSize) override
     {
+#if USE_LIBDEFLATE
+        if (m_backend == ZLibBackend::LibDeflate)
+        {
+            // Decompressors hold no state between calls, so each thread keeps one
+            static thread_local std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+                decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+
+            if (decompressor
+                && libdeflate_zlib_decompress(
+                       decompressor.get(),
+                       compressedData,
+                       compressedDataSize,
+                       uncompressedBuffer,
+                       uncompressedBufferSize,
+                       uncompressedDataSize) == LIBDEFLATE_SUCCESS)
+            {
+                return S_OK;
+            }
+            else
+            {
+                return E_FAIL;
+            }
+        }
+#endif
+
         uLong destLen = static_cast<uLong>(uncompressedBufferSize);
 
         if (uncompress(
@@ -88,8 +165,44 @@ public:
 
     size_t STDMETHODCALLTYPE CompressBufferBound(size_t uncompressedDataSize) override
     {
+        // zlib's bound covers libdeflate's as well
         return compressBound(static_cast<uLong>(uncompressedDataSize));
     }
+
+private:
+#if USE_LIBDEFLATE
+    static HRESULT CompressWithLibDeflate(
+        const void* uncompressedData,
+        size_t uncompressedDataSize,
+        DSTORAGE_COMPRESSION compressionSetting,
+        void* compressedBuffer,
+        size_t compressedBufferSize,
+        size_t* compressedDataSize)
+    {
+        // libdeflate's levels go up to 12, its default is 6
+        int level = compressionSetting == DSTORAGE_COMPRESSION_BEST_RATIO ? 12
+                    : compressionSetting == DSTORAGE_COMPRESSION_FASTEST  ? 1
+                                                                          : 6;
+
+        std::unique_ptr<libdeflate_compressor, decltype(&libdeflate_free_compressor)> compressor(
+            libdeflate_alloc_compressor(level),
+            &libdeflate_free_compressor);
+        if (!compressor)
+            return E_OUTOFMEMORY;
+
+        size_t size = libdeflate_zlib_compress(
+            compressor.get(),
+            uncompressedData,
+            uncompressedDataSize,
+            compressedBuffer,
+            compressedBufferSize);
+        if (size == 0)
+            return E_FAIL;
+
+        *compressedDataSize = size;
+        return S_OK;
+    }
+#endif
 };
 
 #endif
@@ -7,11 +7,17 @@
 // PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
 //
 
+#define NOMINMAX
+
 #include <dstorage.h>
 #include <dxgi1_4.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <vector>
 #include <winrt/base.h>
 
 using winrt::com_ptr;
@@ -33,7 +39,419 @@ using ScopedHandle = std::unique_ptr<void, handle_closer>;
 void ShowHelpText()
 {
     std::cout << "Reads the contents of a file and writes them out to a buffer on the GPU using DirectStorage." << std::endl << std::endl;
-    std::cout << "USAGE: HelloDirectStorage [path]" << std::endl << std::endl;
+    std::cout << "USAGE: HelloDirectStorage [path] [-requests count] [-capacity count]" << std::endl << std::endl;
+    std::cout << "  When path is a directory, or -requests is given, every file in it is read" << std::endl;
+    std::cout << "  into one buffer, and the bandwidth and requests per second are reported." << std::endl;
+    std::cout << "  A .gdeflate file written by the GpuDecompressionBenchmark is read a chunk per" << std::endl;
+    std::cout << "  request, using its .chunks table, and decompressed on the GPU." << std::endl;
+    std::cout << "  -requests    Splits each file into this many requests (default 1)" << std::endl;
+    std::cout << "  -capacity    The capacity of the DirectStorage queue (default " << DSTORAGE_MAX_QUEUE_CAPACITY
+              << ")" << std::endl;
+    std::cout << "  -async       Keeps several batches in flight, and does other work on this thread" << std::endl;
+    std::cout << "               while they load, rather than waiting for the reads" << std::endl << std::endl;
+}
+
+// Creates a buffer on the GPU for DirectStorage to write into
+HRESULT CreateBuffer(ID3D12Device* device, uint64_t size, com_ptr<ID3D12Resource>& bufferResource)
+{
+    D3D12_HEAP_PROPERTIES bufferHeapProps = {};
+    bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+    D3D12_RESOURCE_DESC bufferDesc = {};
+    bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+    bufferDesc.Width = size;
+    bufferDesc.Height = 1;
+    bufferDesc.DepthOrArraySize = 1;
+    bufferDesc.MipLevels = 1;
+    bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
+    bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+    bufferDesc.SampleDesc.Count = 1;
+
+    return device->CreateCommittedResource(
+        &bufferHeapProps,
+        D3D12_HEAP_FLAG_NONE,
+        &bufferDesc,
+        D3D12_RESOURCE_STATE_COMMON,
+        nullptr,
+        IID_PPV_ARGS(bufferResource.put()));
+}
+
+// Checks the queue for errors, and returns true if any of its requests failed.
+// If an error was detected the first failure record can be retrieved to get
+// more details.
+bool RequestsFailed(IDStorageQueue* queue)
+{
+    DSTORAGE_ERROR_RECORD errorRecord{};
+    queue->RetrieveErrorRecord(&errorRecord);
+    if (FAILED(errorRecord.FirstFailure.HResult))
+    {
+        //
+        // errorRecord.FailureCount - The number of failed requests in the queue since the last
+        //                            RetrieveErrorRecord call.
+        // errorRecord.FirstFailure - Detailed record about the first failed command in the enqueue order.
+        //
+        std::cout << "The DirectStorage request failed! HRESULT=0x" << std::hex << errorRecord.FirstFailure.HResult << std::endl;
+        return true;
+    }
+    return false;
+}
+
+// A read of part of a file, into its place in the destination buffer.  A
+// compressed request is decompressed to UncompressedSize bytes.
+struct FileRequest
+{
+    IDStorageFile* File;
+    uint64_t Offset;
+    uint32_t Size;
+    uint32_t UncompressedSize;
+    DSTORAGE_COMPRESSION_FORMAT CompressionFormat;
+    uint64_t DestOffset;
+};
+
+// The chunk table that the GpuDecompressionBenchmark writes next to each file
+// that it compresses, named <file>.chunks: this header, followed by a
+// ChunkMetadata for each chunk, in the order they are in the file.
+struct CompressedFileHeader
+{
+    static constexpr uint32_t CurrentMagic = 0x4B4E4843; // "CHNK"
+
+    uint32_t Magic;
+    uint32_t Format;
+    uint64_t SourceSize;
+    int64_t SourceWriteTime;
+    uint32_t ChunkSizeBytes; // The largest chunk
+    uint32_t NumChunks;
+};
+
+struct ChunkMetadata
+{
+    uint32_t Offset;
+    uint32_t CompressedSize;
+    uint32_t UncompressedSize;
+};
+
+std::filesystem::path GetChunkTableFilename(std::filesystem::path const& compressedFilename)
+{
+    return compressedFilename.wstring() + L".chunks";
+}
+
+// Reads the chunk table of a file compressed with GDeflate.  Returns false if
+// the file doesn't have one, or it's for another format.
+bool LoadChunkTable(std::filesystem::path const& compressedFilename, std::vector<ChunkMetadata>& chunks)
+{
+    std::ifstream chunkTable(GetChunkTableFilename(compressedFilename), std::ios::binary);
+    if (!chunkTable)
+        return false;
+
+    CompressedFileHeader header{};
+    chunkTable.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!chunkTable || header.Magic != CompressedFileHeader::CurrentMagic ||
+        header.Format != DSTORAGE_COMPRESSION_FORMAT_GDEFLATE)
+    {
+        return false;
+    }
+
+    chunks.resize(header.NumChunks);
+    chunkTable.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(ChunkMetadata));
+    return static_cast<bool>(chunkTable);
+}
+
+void EnqueueFileRequest(IDStorageQueue* queue, FileRequest const& fileRequest, ID3D12Resource* bufferResource)
+{
+    DSTORAGE_REQUEST request = {};
+    request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+    request.Options.CompressionFormat = fileRequest.CompressionFormat;
+    request.Source.File.Source = fileRequest.File;
+    request.Source.File.Offset = fileRequest.Offset;
+    request.Source.File.Size = fileRequest.Size;
+    request.UncompressedSize = fileRequest.UncompressedSize;
+    request.Destination.Buffer.Resource = bufferResource;
+    request.Destination.Buffer.Offset = fileRequest.DestOffset;
+    request.Destination.Buffer.Size = fileRequest.UncompressedSize;
+    queue->EnqueueRequest(&request);
+}
+
+// Stands in for the rest of a frame's work, that a game would do while its
+// data loads.  Returns a value so that the compiler can't remove the loop.
+uint32_t DoOtherWork()
+{
+    uint32_t x = 1;
+    for (int i = 0; i < 10000; ++i)
+        x = x * 1664525u + 1013904223u;
+    return x;
+}
+
+// Reads the requests in batches, keeping up to MAX_BATCHES_IN_FLIGHT of them
+// queued at once.  Each batch signals the fence with its own value when it
+// completes, and a threadpool wait on the fence's event notes the
+// completion, so this thread never blocks on a read.  It submits the next
+// batch as soon as a slot is free, and does other work the rest of the
+// time.  Returns the seconds spent on the other work.
+double ReadPipelined(
+    IDStorageQueue* queue,
+    ID3D12Fence* fence,
+    std::vector<FileRequest> const& requests,
+    ID3D12Resource* bufferResource,
+    uint32_t batchSize)
+{
+    using Clock = std::chrono::high_resolution_clock;
+
+    static constexpr uint32_t MAX_BATCHES_IN_FLIGHT = 4;
+
+    struct Batch
+    {
+        ScopedHandle Event;
+        TP_WAIT* Wait = nullptr;
+        std::atomic<bool> InFlight = false;
+        std::atomic<uint32_t>* NumCompleted = nullptr;
+    };
+
+    auto onBatchCompleted = [](TP_CALLBACK_INSTANCE*, void* context, TP_WAIT*, TP_WAIT_RESULT)
+    {
+        Batch* batch = reinterpret_cast<Batch*>(context);
+        ++*batch->NumCompleted;
+        batch->InFlight = false;
+    };
+
+    std::atomic<uint32_t> numCompleted = 0;
+
+    Batch batches[MAX_BATCHES_IN_FLIGHT];
+    for (Batch& batch : batches)
+    {
+        batch.Event.reset(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        batch.Wait = CreateThreadpoolWait(onBatchCompleted, &batch, nullptr);
+        batch.NumCompleted = &numCompleted;
+        if (!batch.Event || !batch.Wait)
+            std::abort();
+    }
+
+    const uint32_t numBatches = static_cast<uint32_t>((requests.size() + batchSize - 1) / batchSize);
+    uint32_t numSubmitted = 0;
+
+    Clock::duration otherWorkTime{};
+    volatile uint32_t otherWorkResult = 0;
+
+    while (numCompleted < numBatches)
+    {
+        Batch& batch = batches[numSubmitted % MAX_BATCHES_IN_FLIGHT];
+        if (numSubmitted < numBatches && !batch.InFlight)
+        {
+            size_t first = static_cast<size_t>(numSubmitted) * batchSize;
+            size_t last = std::min(requests.size(), first + batchSize);
+            for (size_t i = first; i < last; ++i)
+                EnqueueFileRequest(queue, requests[i], bufferResource);
+
+            // The fence values start at 1, one for each batch
+            uint64_t fenceValue = ++numSubmitted;
+            batch.InFlight = true;
+            check_hresult(fence->SetEventOnCompletion(fenceValue, batch.Event.get()));
+            SetThreadpoolWait(batch.Wait, batch.Event.get(), nullptr);
+
+            queue->EnqueueSignal(fence, fenceValue);
+            queue->Submit();
+            continue;
+        }
+
+        auto startTime = Clock::now();
+        otherWorkResult = otherWorkResult + DoOtherWork();
+        otherWorkTime += Clock::now() - startTime;
+    }
+
+    for (Batch& batch : batches)
+    {
+        WaitForThreadpoolWaitCallbacks(batch.Wait, FALSE);
+        CloseThreadpoolWait(batch.Wait);
+    }
+
+    return std::chrono::duration<double>(otherWorkTime).count();
+}
+
+// Reads every file in the directory, or the one file, into a single buffer,
+// splitting each file into requestsPerFile requests.  GDeflate files with a
+// chunk table are read a chunk per request instead, and decompressed on the
+// GPU, which is the path that most titles use DirectStorage for.  The requests are
+// submitted whenever the queue is full, and the time until the last of them
+// completes gives the simplest possible measure of what DirectStorage can do
+// on this machine, for comparing more elaborate loaders against.
+int RunThroughputTest(
+    ID3D12Device* device,
+    IDStorageFactory* factory,
+    std::filesystem::path const& path,
+    uint32_t requestsPerFile,
+    uint16_t queueCapacity,
+    bool async)
+{
+    std::vector<std::filesystem::path> filenames;
+    if (std::filesystem::is_directory(path))
+    {
+        for (auto const& entry : std::filesystem::directory_iterator(path))
+        {
+            // Chunk tables are read along with the files they describe
+            if (entry.is_regular_file() && entry.path().extension() != L".chunks")
+                filenames.push_back(entry.path());
+        }
+    }
+    else
+    {
+        filenames.push_back(path);
+    }
+
+    // Each file is split into requests of the same size, the last one taking
+    // what's left, and they are placed one after another in the buffer
+    std::vector<com_ptr<IDStorageFile>> files;
+    std::vector<FileRequest> requests;
+    uint64_t totalSize = 0;     // The size of the destination buffer
+    uint64_t totalReadSize = 0; // The bytes read from the files, which is less if they're compressed
+    uint32_t largestCompressedSize = 0;
+
+    for (auto const& filename : filenames)
+    {
+        com_ptr<IDStorageFile> file;
+        HRESULT hr = factory->OpenFile(filename.c_str(), IID_PPV_ARGS(file.put()));
+        if (FAILED(hr))
+        {
+            std::wcout << L"The file '" << filename.native() << L"' could not be opened. HRESULT=0x" << std::hex << hr
+                       << std::endl;
+            return -1;
+        }
+
+        BY_HANDLE_FILE_INFORMATION info{};
+        check_hresult(file->GetFileInformation(&info));
+        uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        if (fileSize == 0)
+            continue;
+
+        std::vector<ChunkMetadata> chunks;
+        if (LoadChunkTable(filename, chunks))
+        {
+            uint64_t uncompressedSize = 0;
+            for (ChunkMetadata const& chunk : chunks)
+            {
+                requests.push_back(
+                    {file.get(),
+                     chunk.Offset,
+                     chunk.CompressedSize,
+                     chunk.UncompressedSize,
+                     DSTORAGE_COMPRESSION_FORMAT_GDEFLATE,
+                     totalSize + uncompressedSize});
+                uncompressedSize += chunk.UncompressedSize;
+                totalReadSize += chunk.CompressedSize;
+                largestCompressedSize = std::max(largestCompressedSize, chunk.CompressedSize);
+            }
+
+            files.push_back(std::move(file));
+            totalSize += uncompressedSize;
+            continue;
+        }
+
+        uint64_t requestSize = (fileSize + requestsPerFile - 1) / requestsPerFile;
+        if (requestSize > UINT32_MAX)
+        {
+            std::wcout << L"The file '" << filename.native() << L"' needs more requests, as each one can read at most "
+                       << UINT32_MAX << L" bytes" << std::endl;
+            return -1;
+        }
+
+        for (uint64_t offset = 0; offset < fileSize; offset += requestSize)
+        {
+            uint32_t size = static_cast<uint32_t>(std::min(requestSize, fileSize - offset));
+            requests.push_back({file.get(), offset, size, size, DSTORAGE_COMPRESSION_FORMAT_NONE, totalSize + offset});
+        }
+
+        files.push_back(std::move(file));
+        totalSize += fileSize;
+        totalReadSize += fileSize;
+    }
+
+    if (requests.empty())
+    {
+        std::cout << "There is nothing to read." << std::endl;
+        return -1;
+    }
+
+    // A compressed request is read whole into the staging buffer before it's
+    // decompressed, so it has to fit.  This must be set before the queue is
+    // created.
+    if (largestCompressedSize > DSTORAGE_STAGING_BUFFER_SIZE_32MB)
+        check_hresult(factory->SetStagingBufferSize(largestCompressedSize));
+
+    DSTORAGE_QUEUE_DESC queueDesc{};
+    queueDesc.Capacity = queueCapacity;
+    queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
+    queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+    queueDesc.Device = device;
+
+    com_ptr<IDStorageQueue> queue;
+    check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(queue.put())));
+
+    com_ptr<ID3D12Resource> bufferResource;
+    HRESULT hr = CreateBuffer(device, totalSize, bufferResource);
+    if (FAILED(hr))
+    {
+        std::cout << "A " << totalSize << " byte buffer could not be created. HRESULT=0x" << std::hex << hr
+                  << std::endl;
+        return -1;
+    }
+
+    com_ptr<ID3D12Fence> fence;
+    check_hresult(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(fence.put())));
+
+    std::cout << "Reading " << totalReadSize << " bytes into " << totalSize << " from " << files.size()
+              << " file(s) with " << requests.size() << " requests, on a queue with a capacity of " << queueCapacity
+              << "..." << std::endl;
+
+    // Requests may be submitted while they're still being enqueued, so the
+    // time taken to enqueue them is measured too.
+    auto startTime = std::chrono::high_resolution_clock::now();
+    double otherWorkSeconds = 0;
+
+    if (async)
+    {
+        // A quarter of the queue per batch, so that the batches in flight
+        // fit in it together
+        otherWorkSeconds =
+            ReadPipelined(queue.get(), fence.get(), requests, bufferResource.get(), std::max(1, queueCapacity / 4));
+    }
+    else
+    {
+        ScopedHandle fenceEvent(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        constexpr uint64_t fenceValue = 1;
+        check_hresult(fence->SetEventOnCompletion(fenceValue, fenceEvent.get()));
+
+        for (size_t i = 0; i < requests.size(); ++i)
+        {
+            EnqueueFileRequest(queue.get(), requests[i], bufferResource.get());
+
+            // A queue can't hold more requests than its capacity
+            if ((i + 1) % queueCapacity == 0)
+                queue->Submit();
+        }
+
+        queue->EnqueueSignal(fence.get(), fenceValue);
+        queue->Submit();
+        WaitForSingleObject(fenceEvent.get(), INFINITE);
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+
+    if (RequestsFailed(queue.get()))
+        return -1;
+
+    double seconds = std::chrono::duration<double>(endTime - startTime).count();
+    std::cout << "Completed in " << seconds * 1000.0 << " ms: " << (totalReadSize / seconds) / 1000.0 / 1000.0
+              << " MB/s read";
+    if (totalReadSize != totalSize)
+        std::cout << ", " << (totalSize / seconds) / 1000.0 / 1000.0 << " MB/s uncompressed";
+    std::cout << ", " << requests.size() / seconds << " requests/s" << std::endl;
+
+    if (async)
+    {
+        std::cout << "This thread spent " << otherWorkSeconds * 1000.0 << " ms (" << 100.0 * otherWorkSeconds / seconds
+                  << "%) of that on other work" << std::endl;
+    }
+
+    return 0;
 }
 
 // The following example reads from a specified data file and writes the contents
@@ -46,14 +464,67 @@ int wmain(int argc, wchar_t* argv[])
         return -1;
     }
 
+    const wchar_t* fileToLoad = argv[1];
+
+    uint32_t requestsPerFile = 0;
+    uint32_t queueCapacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+    bool async = false;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        if (_wcsicmp(argv[i], L"-requests") == 0)
+        {
+            requestsPerFile = (i + 1 < argc) ? _wtoi(argv[++i]) : 0;
+            if (requestsPerFile == 0)
+            {
+                ShowHelpText();
+                std::wcout << L"Invalid number of requests" << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-capacity") == 0)
+        {
+            queueCapacity = (i + 1 < argc) ? _wtoi(argv[++i]) : 0;
+            if (queueCapacity < DSTORAGE_MIN_QUEUE_CAPACITY || queueCapacity > DSTORAGE_MAX_QUEUE_CAPACITY)
+            {
+                ShowHelpText();
+                std::wcout << L"The queue capacity must be between " << DSTORAGE_MIN_QUEUE_CAPACITY << L" and "
+                           << DSTORAGE_MAX_QUEUE_CAPACITY << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (_wcsicmp(argv[i], L"-async") == 0)
+        {
+            async = true;
+            continue;
+        }
+
+        ShowHelpText();
+        std::wcout << L"Unknown option '" << argv[i] << L"'" << std::endl;
+        return -1;
+    }
+
     com_ptr<ID3D12Device> device;
     check_hresult(D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device)));
 
     com_ptr<IDStorageFactory> factory;
     check_hresult(DStorageGetFactory(IID_PPV_ARGS(factory.put())));
 
+    if (requestsPerFile != 0 || async || std::filesystem::is_directory(fileToLoad) ||
+        std::filesystem::exists(GetChunkTableFilename(fileToLoad)))
+    {
+        return RunThroughputTest(
+            device.get(),
+            factory.get(),
+            fileToLoad,
+            std::max(1u, requestsPerFile),
+            static_cast<uint16_t>(queueCapacity),
+            async);
+    }
+
     com_ptr<IDStorageFile> file;
-    const wchar_t* fileToLoad = argv[1];
     HRESULT hr = factory->OpenFile(fileToLoad, IID_PPV_ARGS(file.put()));
     if (FAILED(hr))
     {
@@ -69,7 +540,7 @@ int wmain(int argc, wchar_t* argv[])
     // Create a DirectStorage queue which will be used to load data into a
     // buffer on the GPU.
     DSTORAGE_QUEUE_DESC queueDesc{};
-    queueDesc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+    queueDesc.Capacity = static_cast<uint16_t>(queueCapacity);
     queueDesc.Priority = DSTORAGE_PRIORITY_NORMAL;
     queueDesc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
     queueDesc.Device = device.get();
@@ -78,27 +549,8 @@ int wmain(int argc, wchar_t* argv[])
     check_hresult(factory->CreateQueue(&queueDesc, IID_PPV_ARGS(queue.put())));
 
     // Create the ID3D12Resource buffer which will be populated with the file's contents
-    D3D12_HEAP_PROPERTIES bufferHeapProps = {};
-    bufferHeapProps.Type = D3D12_HEAP_TYPE_DEFAULT;
-
-    D3D12_RESOURCE_DESC bufferDesc = {};
-    bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
-    bufferDesc.Width = fileSize;
-    bufferDesc.Height = 1;
-    bufferDesc.DepthOrArraySize = 1;
-    bufferDesc.MipLevels = 1;
-    bufferDesc.Format = DXGI_FORMAT_UNKNOWN;
-    bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
-    bufferDesc.SampleDesc.Count = 1;
-
     com_ptr<ID3D12Resource> bufferResource;
-    check_hresult(device->CreateCommittedResource(
-        &bufferHeapProps,
-        D3D12_HEAP_FLAG_NONE,
-        &bufferDesc,
-        D3D12_RESOURCE_STATE_COMMON,
-        nullptr,
-        IID_PPV_ARGS(bufferResource.put())));
+    check_hresult(CreateBuffer(device.get(), fileSize, bufferResource));
 
     // Enqueue a request to read the file contents into a destination D3D12 buffer resource.
     // Note: The example request below is performing a single read of the entire file contents.
@@ -132,20 +584,7 @@ int wmain(int argc, wchar_t* argv[])
     WaitForSingleObject(fenceEvent.get(), INFINITE);
 
     // Check the status array for errors.
-    // If an error was detected the first failure record
-    // can be retrieved to get more details.
-    DSTORAGE_ERROR_RECORD errorRecord{};
-    queue->RetrieveErrorRecord(&errorRecord);
-    if (FAILED(errorRecord.FirstFailure.HResult))
-    {
-        //
-        // errorRecord.FailureCount - The number of failed requests in the queue since the last
-        //                            RetrieveErrorRecord call.
-        // errorRecord.FirstFailure - Detailed record about the first failed command in the enqueue order.
-        //
-        std::cout << "The DirectStorage request failed! HRESULT=0x" << std::hex << errorRecord.FirstFailure.HResult << std::endl;
-    }
-    else
+    if (!RequestsFailed(queue.get()))
     {
         std::cout << "The DirectStorage request completed successfully!" << std::endl;
     }